@@ -0,0 +1,238 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+    Connection churn: client threads connect to the server over loopback
+    and close again as fast as they can, which measures raptor's accept
+    and close path. The clients are plain blocking sockets so that their
+    own cost stays small.
+
+    By default the client resets the connection (SO_LINGER 0) right after
+    connecting, which leaves no TIME_WAIT behind. With --server_close the
+    server closes every connection from OnConnected instead and the client
+    waits for the end of stream.
+
+    raptor_bench_churn [--addr=127.0.0.1:50052] [--threads=4] [--seconds=5]
+        [--server_close] [--reactors=0]
+*/
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET bench_socket;
+#define BENCH_INVALID_SOCKET INVALID_SOCKET
+#define bench_close_socket closesocket
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int bench_socket;
+#define BENCH_INVALID_SOCKET (-1)
+#define bench_close_socket close
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "raptor/c.h"
+#include "raptor/framing.h"
+#include "raptor/server.h"
+#include "benchmarks/bench_util.h"
+#include "util/atomic.h"
+#include "util/histogram.h"
+#include "util/time.h"
+
+namespace {
+
+using namespace raptor;
+
+class ChurnService final : public IServerReceiver {
+public:
+    explicit ChurnService(bool server_close)
+        : _server(nullptr)
+        , _server_close(server_close)
+        , _accepted(0)
+        , _closed(0) {}
+
+    void SetServer(ITcpServer* server) { _server = server; }
+
+    void OnConnected(ConnectionId cid) override {
+        _accepted.FetchAdd(1, MemoryOrder::RELAXED);
+        // a connection closed by the server itself gets no OnClosed
+        if (_server_close && _server->CloseConnection(cid)) {
+            _closed.FetchAdd(1, MemoryOrder::RELAXED);
+        }
+    }
+    void OnMessageReceived(ConnectionId, const void*, size_t) override {}
+    void OnClosed(ConnectionId) override {
+        _closed.FetchAdd(1, MemoryOrder::RELAXED);
+    }
+
+    uint64_t Accepted() const { return _accepted.Load(); }
+    uint64_t Closed() const { return _closed.Load(); }
+
+private:
+    ITcpServer* _server;
+    bool _server_close;
+    AtomicUInt64 _accepted;
+    AtomicUInt64 _closed;
+};
+
+bool ParseAddress(const std::string& addr, sockaddr_in* sa) {
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+    memset(sa, 0, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    sa->sin_port = htons(static_cast<uint16_t>(atoi(addr.c_str() + colon + 1)));
+    return inet_pton(AF_INET, addr.substr(0, colon).c_str(), &sa->sin_addr) == 1;
+}
+
+struct ChurnWorker {
+    ChurnWorker() : connections(0), failures(0) {}
+
+    Histogram connect_time;
+    uint64_t connections;
+    uint64_t failures;
+};
+
+void ChurnLoop(const sockaddr_in* sa, bool server_close,
+    const AtomicBool* running, ChurnWorker* worker) {
+    while (running->Load()) {
+        int64_t begin = GetMonotonicNanoseconds();
+        bench_socket fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == BENCH_INVALID_SOCKET) {
+            worker->failures++;
+            continue;
+        }
+        if (connect(fd, reinterpret_cast<const sockaddr*>(sa), sizeof(*sa)) != 0) {
+            worker->failures++;
+            bench_close_socket(fd);
+            continue;
+        }
+        worker->connect_time.Record(static_cast<uint64_t>(GetMonotonicNanoseconds() - begin));
+
+        if (server_close) {
+            char buf[64];
+            while (recv(fd, buf, sizeof(buf), 0) > 0) {
+            }
+        } else {
+            linger lg;
+            lg.l_onoff = 1;
+            lg.l_linger = 0;
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, reinterpret_cast<const char*>(&lg), sizeof(lg));
+        }
+        bench_close_socket(fd);
+        worker->connections++;
+    }
+}
+
+int Run(int argc, char** argv) {
+    raptor::bench::Flags flags(argc, argv);
+
+    std::string addr = flags.GetString("addr", "127.0.0.1:50052");
+    int64_t threads = flags.GetInt("threads", 4);
+    int64_t seconds = flags.GetInt("seconds", 5);
+    bool server_close = flags.Has("server_close");
+
+    if (threads <= 0 || seconds <= 0) {
+        fprintf(stderr, "--threads and --seconds must be positive\n");
+        return 1;
+    }
+
+    sockaddr_in sa;
+    if (!ParseAddress(addr, &sa)) {
+        fprintf(stderr, "invalid address %s, ipv4:port expected\n", addr.c_str());
+        return 1;
+    }
+
+    RaptorOptions options;
+    memset(&options, 0, sizeof(options));
+    options.max_connections = 65536;
+    options.connection_timeout = 60;
+    options.reactor_threads = static_cast<size_t>(flags.GetInt("reactors", 0));
+
+    LengthPrefixedProtocol<4, 0, 4> proto;
+    ChurnService service(server_close);
+    raptor::ITcpServer* server = RaptorCreateServer(&service);
+    service.SetServer(server);
+    server->SetProtocol(&proto);
+    if (!server->Init(&options) || !server->AddListening(addr.c_str()) || !server->Start()) {
+        fprintf(stderr, "failed to start the server on %s\n", addr.c_str());
+        RaptorReleaseServer(server);
+        return 1;
+    }
+
+    AtomicBool running(true);
+    std::vector<std::unique_ptr<ChurnWorker>> workers;
+    std::vector<std::thread> clients;
+    for (int64_t i = 0; i < threads; i++) {
+        workers.emplace_back(new ChurnWorker);
+        clients.emplace_back(ChurnLoop, &sa, server_close, &running, workers.back().get());
+    }
+
+    int64_t begin = GetMonotonicNanoseconds();
+    bench::SleepMilliseconds(seconds * 1000);
+    running.Store(false);
+    for (size_t i = 0; i < clients.size(); i++) {
+        clients[i].join();
+    }
+    int64_t end = GetMonotonicNanoseconds();
+
+    Histogram connect_time;
+    uint64_t connections = 0, failures = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+        connect_time.Merge(workers[i]->connect_time);
+        connections += workers[i]->connections;
+        failures += workers[i]->failures;
+    }
+
+    // the server may still be closing the last connections
+    for (int i = 0; i < 200 && service.Closed() < service.Accepted(); i++) {
+        bench::SleepMilliseconds(10);
+    }
+
+    double elapsed = static_cast<double>(end - begin) / 1e9;
+    printf("churn threads=%d %s conn/s=%.0f accepted=%llu closed=%llu failures=%llu ",
+        static_cast<int>(threads), server_close ? "server-close" : "client-reset",
+        static_cast<double>(connections) / elapsed,
+        static_cast<unsigned long long>(service.Accepted()),
+        static_cast<unsigned long long>(service.Closed()),
+        static_cast<unsigned long long>(failures));
+    bench::PrintLatency("connect", connect_time);
+    printf("\n");
+
+    server->Shutdown();
+    RaptorReleaseServer(server);
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    raptor_global_init();
+    int result = Run(argc, argv);
+    raptor_global_cleanup();
+    return result;
+}
@@ -0,0 +1,332 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+    N-connection echo over loopback through raptor's Server and Client.
+
+    Closed loop (default): every connection keeps --pipeline messages in
+    flight and sends the next one as soon as an echo comes back.
+    Open loop (--rate=N): N messages per second in total are sent round
+    robin over the connections, whether or not the echoes keep up. The
+    latency is taken from the intended send time, so a stalled server
+    shows up in the percentiles instead of slowing the sender down.
+    --capture=FILE records the server's traffic for raptor_replay (linux).
+
+    raptor_bench_echo [--addr=127.0.0.1:50051] [--connections=16]
+        [--sizes=64,1024,16384] [--seconds=5] [--warmup=1] [--rate=0]
+        [--pipeline=1] [--reactors=0] [--dispatch=1] [--inline]
+        [--capture=FILE]
+*/
+
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "raptor/c.h"
+#include "raptor/client.h"
+#include "raptor/framing.h"
+#include "raptor/server.h"
+#include "benchmarks/bench_util.h"
+#include "util/atomic.h"
+#include "util/histogram.h"
+#include "util/time.h"
+
+namespace {
+
+using namespace raptor;
+
+typedef LengthPrefixedProtocol<4, 0, 4> EchoProtocol;
+
+// header, then the send time in nanoseconds, then padding
+const size_t kHeaderSize = 4;
+const size_t kMinFrameSize = kHeaderSize + sizeof(int64_t);
+
+class EchoService final : public IServerReceiver {
+public:
+    EchoService() : _server(nullptr) {}
+    void SetServer(ITcpServer* server) { _server = server; }
+
+    void OnConnected(ConnectionId) override {}
+    void OnMessageReceived(ConnectionId cid, const void* s, size_t len) override {
+        _server->Send(cid, s, len);
+    }
+    void OnClosed(ConnectionId) override {}
+
+private:
+    ITcpServer* _server;
+};
+
+struct RunState {
+    RunState()
+        : running(true)
+        , measure_begin(INT64_MAX)
+        , measure_end(INT64_MAX) {}
+
+    AtomicBool running;
+    // echoes of messages sent in [begin, end) are measured
+    AtomicInt64 measure_begin;
+    AtomicInt64 measure_end;
+};
+
+void InitFrame(std::string* frame, size_t size) {
+    frame->assign(size, 'x');
+    uint32_t body = static_cast<uint32_t>(size - kHeaderSize);
+    unsigned char* p = reinterpret_cast<unsigned char*>(&(*frame)[0]);
+    p[0] = static_cast<unsigned char>(body >> 24);
+    p[1] = static_cast<unsigned char>(body >> 16);
+    p[2] = static_cast<unsigned char>(body >> 8);
+    p[3] = static_cast<unsigned char>(body);
+}
+
+class EchoConnection final : public IClientReceiver {
+public:
+    EchoConnection(RunState* state, size_t frame_size, bool closed_loop)
+        : _state(state)
+        , _closed_loop(closed_loop)
+        , _client(nullptr)
+        , _connect_result(-1)
+        , _received(0) {
+        InitFrame(&_frame, frame_size);
+    }
+
+    ~EchoConnection() {
+        Close();
+    }
+
+    bool Open(const char* addr, IProtocol* proto) {
+        _client = RaptorCreateClient(this);
+        _client->SetProtocol(proto);
+        if (!_client->Init() || !_client->Connect(addr, 3000)) {
+            return false;
+        }
+        for (int i = 0; i < 3000 && _connect_result.Load() < 0; i++) {
+            bench::SleepMilliseconds(1);
+        }
+        return _connect_result.Load() == 1;
+    }
+
+    void Close() {
+        if (_client) {
+            _client->Shutdown();
+            RaptorReleaseClient(_client);
+            _client = nullptr;
+        }
+    }
+
+    // called from any thread, the frame must not be shared
+    bool Send(int64_t stamp, std::string* frame) {
+        memcpy(&(*frame)[kHeaderSize], &stamp, sizeof(stamp));
+        return _client->Send(frame->data(), frame->size());
+    }
+
+    std::string Frame() const { return _frame; }
+    const Histogram& Latency() const { return _latency; }
+    uint64_t Received() const { return _received.Load(); }
+
+    void OnConnectResult(bool success) override {
+        _connect_result.Store(success ? 1 : 0);
+    }
+
+    void OnMessageReceived(const void* s, size_t len) override {
+        int64_t now = GetMonotonicNanoseconds();
+        if (len < kMinFrameSize) {
+            return;
+        }
+        int64_t stamp;
+        memcpy(&stamp, static_cast<const char*>(s) + kHeaderSize, sizeof(stamp));
+        if (stamp >= _state->measure_begin.Load() && stamp < _state->measure_end.Load()) {
+            _latency.Record(static_cast<uint64_t>(now - stamp));
+            _received.Store(_received.Load() + 1);
+        }
+        if (_closed_loop && _state->running.Load()) {
+            Send(now, &_frame);
+        }
+    }
+
+    void OnClosed() override {}
+
+private:
+    RunState* _state;
+    bool _closed_loop;
+    ITcpClient* _client;
+    AtomicInt32 _connect_result;
+    // written by the client thread only
+    std::string _frame;
+    Histogram _latency;
+    AtomicUInt64 _received;
+};
+
+struct BenchOptions {
+    std::string addr;
+    int64_t connections;
+    int64_t seconds;
+    int64_t warmup;
+    int64_t rate;
+    int64_t pipeline;
+};
+
+// paces --rate messages per second over the connections until running is cleared
+void OpenLoop(RunState* state, int64_t rate,
+    std::vector<std::unique_ptr<EchoConnection>>* conns) {
+    std::vector<std::string> frames;
+    for (size_t i = 0; i < conns->size(); i++) {
+        frames.push_back((*conns)[i]->Frame());
+    }
+    const int64_t interval = 1000000000LL / rate;
+    const int64_t start = GetMonotonicNanoseconds();
+    int64_t sent = 0;
+    size_t next = 0;
+    while (state->running.Load()) {
+        int64_t now = GetMonotonicNanoseconds();
+        // catch up with every message that is due, late or not
+        while (start + sent * interval <= now) {
+            (*conns)[next]->Send(start + sent * interval, &frames[next]);
+            next = (next + 1) % conns->size();
+            sent++;
+        }
+        int64_t wait_ns = start + sent * interval - now;
+        if (wait_ns > 50000) {
+            bench::SleepMicroseconds(wait_ns / 1000 - 20);
+        }
+    }
+}
+
+bool RunOnce(const BenchOptions& opt, size_t frame_size, EchoProtocol* proto) {
+    RunState state;
+    const bool closed_loop = (opt.rate <= 0);
+
+    std::vector<std::unique_ptr<EchoConnection>> conns;
+    for (int64_t i = 0; i < opt.connections; i++) {
+        conns.emplace_back(new EchoConnection(&state, frame_size, closed_loop));
+        if (!conns.back()->Open(opt.addr.c_str(), proto)) {
+            fprintf(stderr, "connection %d to %s failed\n", static_cast<int>(i), opt.addr.c_str());
+            return false;
+        }
+    }
+
+    std::thread pacer;
+    if (closed_loop) {
+        for (size_t i = 0; i < conns.size(); i++) {
+            std::string frame = conns[i]->Frame();
+            for (int64_t k = 0; k < opt.pipeline; k++) {
+                conns[i]->Send(GetMonotonicNanoseconds(), &frame);
+            }
+        }
+    } else {
+        pacer = std::thread(OpenLoop, &state, opt.rate, &conns);
+    }
+
+    bench::SleepMilliseconds(opt.warmup * 1000);
+    int64_t begin = GetMonotonicNanoseconds();
+    state.measure_begin.Store(begin);
+    bench::SleepMilliseconds(opt.seconds * 1000);
+    int64_t end = GetMonotonicNanoseconds();
+    state.measure_end.Store(end);
+
+    state.running.Store(false);
+    if (pacer.joinable()) {
+        pacer.join();
+    }
+    // let the echoes of the measured window arrive
+    bench::SleepMilliseconds(200);
+
+    Histogram latency;
+    uint64_t received = 0;
+    for (size_t i = 0; i < conns.size(); i++) {
+        conns[i]->Close();
+        latency.Merge(conns[i]->Latency());
+        received += conns[i]->Received();
+    }
+
+    double elapsed = static_cast<double>(end - begin) / 1e9;
+    double msgs = static_cast<double>(received) / elapsed;
+    printf("%s conns=%d size=%d msg/s=%.0f MB/s=%.2f ",
+        closed_loop ? "closed-loop" : "open-loop",
+        static_cast<int>(opt.connections), static_cast<int>(frame_size),
+        msgs, msgs * static_cast<double>(frame_size) / (1024.0 * 1024.0));
+    bench::PrintLatency("latency", latency);
+    printf("\n");
+    fflush(stdout);
+    return true;
+}
+
+int Run(int argc, char** argv) {
+    raptor::bench::Flags flags(argc, argv);
+
+    BenchOptions opt;
+    opt.addr = flags.GetString("addr", "127.0.0.1:50051");
+    opt.connections = flags.GetInt("connections", 16);
+    opt.seconds = flags.GetInt("seconds", 5);
+    opt.warmup = flags.GetInt("warmup", 1);
+    opt.rate = flags.GetInt("rate", 0);
+    opt.pipeline = flags.GetInt("pipeline", 1);
+    std::vector<int64_t> sizes = flags.GetIntList("sizes", "64,1024,16384");
+
+    if (opt.connections <= 0 || opt.seconds <= 0 || opt.pipeline <= 0) {
+        fprintf(stderr, "--connections, --seconds and --pipeline must be positive\n");
+        return 1;
+    }
+
+    RaptorOptions options;
+    memset(&options, 0, sizeof(options));
+    options.max_connections = static_cast<size_t>(opt.connections) + 16;
+    options.send_recv_timeout = 0;
+    options.connection_timeout = 60;
+    options.reactor_threads = static_cast<size_t>(flags.GetInt("reactors", 0));
+    options.dispatch_threads = static_cast<size_t>(flags.GetInt("dispatch", 1));
+    options.inline_dispatch = flags.Has("inline") ? 1 : 0;
+    std::string capture = flags.GetString("capture", "");
+    options.capture_file = capture.empty() ? nullptr : capture.c_str();
+
+    EchoProtocol proto;
+    EchoService service;
+    raptor::ITcpServer* server = RaptorCreateServer(&service);
+    service.SetServer(server);
+    server->SetProtocol(&proto);
+    if (!server->Init(&options) || !server->AddListening(opt.addr.c_str()) || !server->Start()) {
+        fprintf(stderr, "failed to start the echo server on %s\n", opt.addr.c_str());
+        RaptorReleaseServer(server);
+        return 1;
+    }
+
+    int result = 0;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        size_t frame_size = static_cast<size_t>(sizes[i]);
+        if (frame_size < kMinFrameSize) {
+            frame_size = kMinFrameSize;
+        }
+        if (!RunOnce(opt, frame_size, &proto)) {
+            result = 1;
+            break;
+        }
+    }
+
+    server->Shutdown();
+    RaptorReleaseServer(server);
+    return result;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    raptor_global_init();
+    int result = Run(argc, argv);
+    raptor_global_cleanup();
+    return result;
+}
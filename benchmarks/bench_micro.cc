@@ -0,0 +1,233 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+    Microbenchmarks of the core data structures: Slice construction and
+    copy around the inline threshold (23 bytes), SliceBuffer with many
+    small slices and the MPSC dispatch queue with 1, 4 and 16 producers.
+
+    raptor_bench_micro [--filter=substring] [--min_ms=200]
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmarks/bench_util.h"
+#include "core/mpscq.h"
+#include "core/slice/slice.h"
+#include "core/slice/slice_buffer.h"
+#include "util/atomic.h"
+
+namespace {
+
+using namespace raptor;
+
+// both sides of the inline threshold, a small and a page sized payload
+const size_t kSliceSizes[] = { 8, 23, 24, 64, 1024, 4096 };
+
+const size_t kSmallSlice = 16;
+const size_t kSlicesPerBuffer = 256;
+
+std::string g_filter;
+int64_t g_min_ms = 200;
+
+bool Selected(const std::string& name) {
+    return g_filter.empty() || name.find(g_filter) != std::string::npos;
+}
+
+template <typename Func>
+void Run(const std::string& name, Func fn) {
+    if (Selected(name)) {
+        bench::RunMicro(name.c_str(), fn, g_min_ms);
+    }
+}
+
+void BenchSlice() {
+    static char data[4096];
+    for (size_t i = 0; i < sizeof(kSliceSizes) / sizeof(kSliceSizes[0]); i++) {
+        size_t len = kSliceSizes[i];
+        std::string suffix = "/" + std::to_string(len);
+
+        Run("Slice/Construct" + suffix, [len](int64_t n) {
+            uint64_t sum = 0;
+            for (int64_t k = 0; k < n; k++) {
+                Slice s(data, len);
+                sum += s.size();
+            }
+            return sum;
+        });
+
+        Run("Slice/Copy" + suffix, [len](int64_t n) {
+            Slice src(data, len);
+            uint64_t sum = 0;
+            for (int64_t k = 0; k < n; k++) {
+                Slice s(src);
+                sum += s.size();
+            }
+            return sum;
+        });
+
+        Run("Slice/Move" + suffix, [len](int64_t n) {
+            Slice a(data, len);
+            uint64_t sum = 0;
+            for (int64_t k = 0; k < n; k++) {
+                Slice b(std::move(a));
+                a = std::move(b);
+                sum += a.size();
+            }
+            return sum;
+        });
+    }
+}
+
+void FillBuffer(SliceBuffer* buffer, const Slice& piece) {
+    for (size_t k = 0; k < kSlicesPerBuffer; k++) {
+        buffer->AddSlice(piece);
+    }
+}
+
+void BenchSliceBuffer() {
+    static char data[4096];
+    const Slice piece(data, kSmallSlice);
+    const std::string suffix = "/" + std::to_string(kSlicesPerBuffer) + "x"
+        + std::to_string(kSmallSlice);
+
+    // one op adds a small slice and consumes it again
+    Run("SliceBuffer/AddSlice+MoveHeader", [&piece](int64_t n) {
+        SliceBuffer buffer;
+        for (int64_t k = 0; k < n; k++) {
+            buffer.AddSlice(piece);
+            buffer.MoveHeader(kSmallSlice);
+        }
+        return static_cast<uint64_t>(buffer.GetBufferLength());
+    });
+
+    // fill, then consume in steps that straddle the slice boundaries
+    Run("SliceBuffer/Fill+Drain" + suffix, [&piece](int64_t n) {
+        SliceBuffer buffer;
+        uint64_t sum = 0;
+        for (int64_t k = 0; k < n; k++) {
+            FillBuffer(&buffer, piece);
+            while (!buffer.Empty()) {
+                size_t step = buffer.GetBufferLength() < 24 ? buffer.GetBufferLength() : 24;
+                buffer.MoveHeader(step);
+                sum += step;
+            }
+        }
+        return sum;
+    });
+
+    Run("SliceBuffer/GetHeader/front", [&piece](int64_t n) {
+        SliceBuffer buffer;
+        FillBuffer(&buffer, piece);
+        uint64_t sum = 0;
+        for (int64_t k = 0; k < n; k++) {
+            sum += buffer.GetHeader(kSmallSlice).size();
+        }
+        return sum;
+    });
+
+    Run("SliceBuffer/GetHeader/1024" + suffix, [&piece](int64_t n) {
+        SliceBuffer buffer;
+        FillBuffer(&buffer, piece);
+        uint64_t sum = 0;
+        for (int64_t k = 0; k < n; k++) {
+            sum += buffer.GetHeader(1024).size();
+        }
+        return sum;
+    });
+
+    Run("SliceBuffer/Merge" + suffix, [&piece](int64_t n) {
+        SliceBuffer buffer;
+        FillBuffer(&buffer, piece);
+        uint64_t sum = 0;
+        for (int64_t k = 0; k < n; k++) {
+            sum += buffer.Merge().size();
+        }
+        return sum;
+    });
+}
+
+struct QueueNode {
+    MultiProducerSingleConsumerQueue::Node node;
+    uint64_t value;
+};
+
+// n is the total number of nodes, split over the producers
+uint64_t RunQueue(int producers, int64_t n) {
+    MultiProducerSingleConsumerQueue queue;
+    int64_t per_producer = (n + producers - 1) / producers;
+    std::vector<QueueNode> nodes(static_cast<size_t>(per_producer * producers));
+    AtomicBool go(false);
+
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&, p] {
+            while (!go.Load(MemoryOrder::ACQUIRE)) {
+                std::this_thread::yield();
+            }
+            QueueNode* mine = &nodes[static_cast<size_t>(p * per_producer)];
+            for (int64_t k = 0; k < per_producer; k++) {
+                mine[k].value = static_cast<uint64_t>(k);
+                queue.push(&mine[k].node);
+            }
+        });
+    }
+
+    go.Store(true, MemoryOrder::RELEASE);
+    uint64_t sum = 0;
+    size_t popped = 0;
+    while (popped < nodes.size()) {
+        auto node = queue.pop();
+        if (node == nullptr) {
+            std::this_thread::yield();
+            continue;
+        }
+        sum += reinterpret_cast<QueueNode*>(node)->value;
+        popped++;
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    return sum;
+}
+
+void BenchQueue() {
+    const int producer_counts[] = { 1, 4, 16 };
+    for (size_t i = 0; i < sizeof(producer_counts) / sizeof(producer_counts[0]); i++) {
+        int producers = producer_counts[i];
+        Run("MPSCQueue/PushPop/producers:" + std::to_string(producers),
+            [producers](int64_t n) { return RunQueue(producers, n); });
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    raptor::bench::Flags flags(argc, argv);
+    g_filter = flags.GetString("filter", "");
+    g_min_ms = flags.GetInt("min_ms", 200);
+
+    BenchSlice();
+    BenchSliceBuffer();
+    BenchQueue();
+    return 0;
+}
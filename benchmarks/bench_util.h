@@ -0,0 +1,151 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_BENCHMARKS_BENCH_UTIL__
+#define __RAPTOR_BENCHMARKS_BENCH_UTIL__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/histogram.h"
+#include "util/time.h"
+
+namespace raptor {
+namespace bench {
+
+// --name=value command line flags, unknown flags are ignored.
+class Flags {
+public:
+    Flags(int argc, char** argv) {
+        for (int i = 1; i < argc; i++) {
+            _args.push_back(argv[i]);
+        }
+    }
+
+    std::string GetString(const char* name, const char* def) const {
+        std::string prefix = std::string("--") + name + "=";
+        for (size_t i = 0; i < _args.size(); i++) {
+            if (_args[i].compare(0, prefix.size(), prefix) == 0) {
+                return _args[i].substr(prefix.size());
+            }
+        }
+        return def;
+    }
+
+    int64_t GetInt(const char* name, int64_t def) const {
+        std::string v = GetString(name, "");
+        return v.empty() ? def : strtoll(v.c_str(), nullptr, 10);
+    }
+
+    // "64,1024,16384"
+    std::vector<int64_t> GetIntList(const char* name, const char* def) const {
+        std::vector<int64_t> list;
+        std::string v = GetString(name, def);
+        const char* p = v.c_str();
+        while (*p) {
+            char* end = nullptr;
+            int64_t n = strtoll(p, &end, 10);
+            if (end == p) break;
+            list.push_back(n);
+            p = (*end == ',') ? end + 1 : end;
+        }
+        return list;
+    }
+
+    bool Has(const char* name) const {
+        std::string flag = std::string("--") + name;
+        for (size_t i = 0; i < _args.size(); i++) {
+            if (_args[i] == flag || _args[i].compare(0, flag.size() + 1, flag + "=") == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::vector<std::string> _args;
+};
+
+inline void SleepMilliseconds(int64_t ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline void SleepMicroseconds(int64_t us) {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+// Keeps the compiler from dropping the computation of a result.
+#ifdef _MSC_VER
+inline void DoNotOptimize(uint64_t value) {
+    static volatile uint64_t sink;
+    sink = value;
+}
+#else
+inline void DoNotOptimize(uint64_t value) {
+    asm volatile("" : : "r"(value) : "memory");
+}
+#endif
+
+// Runs fn(iterations) with a growing count until a run takes at least
+// min_ms, then prints the time per iteration. fn returns whatever it
+// computed so that the work cannot be optimized away.
+template <typename Func>
+void RunMicro(const char* name, Func fn, int64_t min_ms = 200) {
+    int64_t iterations = 1;
+    int64_t elapsed = 0;
+    for (;;) {
+        int64_t begin = GetMonotonicNanoseconds();
+        DoNotOptimize(fn(iterations));
+        elapsed = GetMonotonicNanoseconds() - begin;
+        if (elapsed >= min_ms * 1000000LL || iterations >= (1LL << 40)) {
+            break;
+        }
+        // aim a bit above min_ms, at most 100x more per step
+        int64_t next = (elapsed > 0)
+            ? static_cast<int64_t>(static_cast<double>(iterations) * 1.2 * min_ms * 1000000.0 / elapsed)
+            : iterations * 100;
+        if (next > iterations * 100) next = iterations * 100;
+        if (next <= iterations) next = iterations + 1;
+        iterations = next;
+    }
+    printf("%-40s %12.1f ns/op %14lld iterations\n", name,
+        static_cast<double>(elapsed) / static_cast<double>(iterations),
+        static_cast<long long>(iterations));
+    fflush(stdout);
+}
+
+// p50/p99/p999/max of a nanoseconds histogram, printed in microseconds
+inline void PrintLatency(const char* name, const Histogram& h) {
+    printf("%s(us) p50=%.1f p99=%.1f p999=%.1f max=%.1f",
+        name,
+        static_cast<double>(h.Percentile(50.0)) / 1000.0,
+        static_cast<double>(h.Percentile(99.0)) / 1000.0,
+        static_cast<double>(h.Percentile(99.9)) / 1000.0,
+        static_cast<double>(h.Max()) / 1000.0);
+}
+
+} // namespace bench
+} // namespace raptor
+
+#endif  // __RAPTOR_BENCHMARKS_BENCH_UTIL__
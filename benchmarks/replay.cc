@@ -0,0 +1,622 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+    Replays a capture written with RaptorOptions::capture_file against a
+    server. Every captured connection is opened again, and the bytes its
+    peer sent are written at their captured times, divided by --speed
+    (0 writes them as fast as possible). The server side of the capture
+    is only used for the byte counts the replayed server should answer
+    with: a request is the bytes read before a run of sends, its reply
+    is complete once as many bytes as the capture sent back up to the
+    end of that run have arrived. The latency is from the send writing
+    the last byte of a request to the read of the last byte of its reply.
+
+    Connections whose opening was overwritten in the capture ring are
+    skipped, as their stream would not start at its beginning.
+
+    --echo starts a raptor server on --addr that echoes whatever it
+    reads. Every captured read is then a request, whose reply is the
+    same bytes.
+
+    raptor_replay --file=capture.bin [--addr=127.0.0.1:50051] [--speed=1]
+        [--drain_ms=2000] [--echo] [--reactors=0] [--dispatch=1] [--inline]
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "raptor/c.h"
+#include "raptor/protocol.h"
+#include "raptor/server.h"
+#include "benchmarks/bench_util.h"
+#include "core/linux/traffic_capture.h"
+#include "util/histogram.h"
+#include "util/time.h"
+
+namespace {
+
+using namespace raptor;
+
+// every read is one package, echoed as it is
+class RawProtocol final : public IScatterProtocol {
+public:
+    size_t GetMaxHeaderSize() override { return 1; }
+    int CheckPackageView(const IBufferView& view) override {
+        return static_cast<int>(std::min(view.Length(), static_cast<size_t>(1 << 20)));
+    }
+};
+
+class EchoService final : public IServerReceiver {
+public:
+    EchoService() : _server(nullptr) {}
+    void SetServer(ITcpServer* server) { _server = server; }
+
+    void OnConnected(ConnectionId) override {}
+    void OnMessageReceived(ConnectionId cid, const void* s, size_t len) override {
+        _server->Send(cid, s, len);
+    }
+    void OnClosed(ConnectionId) override {}
+
+private:
+    ITcpServer* _server;
+};
+
+enum ActionType { kOpen, kWrite, kClose };
+
+struct Action {
+    int64_t time_ns;
+    uint32_t conn;
+    uint32_t type;
+    // kWrite: the bytes of the connection written once it is done
+    uint64_t offset;
+};
+
+// bytes written up to 'request', then bytes read up to 'reply'
+struct Checkpoint {
+    uint64_t request;
+    uint64_t reply;
+    // when the send writing its last byte began
+    int64_t written_ns;
+};
+
+struct ReplayConnection {
+    std::vector<uint8_t> data;
+    // bytes the server is expected to send in total
+    uint64_t expected;
+    std::vector<Checkpoint> checkpoints;
+
+    int fd = -1;
+    bool connected = false;
+    bool closing = false;
+    bool done = false;
+    uint64_t target = 0;
+    uint64_t written = 0;
+    uint64_t received = 0;
+    // the next checkpoint to be written, the next one to be read
+    size_t next_written = 0;
+    size_t next_read = 0;
+};
+
+struct Capture {
+    std::vector<ReplayConnection> conns;
+    std::vector<Action> actions;
+    size_t skipped = 0;
+    uint64_t records = 0;
+};
+
+bool LoadCapture(const char* path, bool echo, Capture* out) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    std::vector<uint8_t> file;
+    uint8_t buf[64 * 1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        file.insert(file.end(), buf, buf + n);
+    }
+    fclose(f);
+
+    CaptureFileHeader header;
+    if (file.size() < CAPTURE_HEADER_SIZE) {
+        fprintf(stderr, "%s is not a capture\n", path);
+        return false;
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0
+        || header.ring_size == 0 || header.ring_size % 8 != 0
+        || header.regions == 0 || header.regions > 65536
+        || file.size() < CaptureRingOffset(header.regions, header.ring_size, header.regions)) {
+        fprintf(stderr, "%s is not a capture\n", path);
+        return false;
+    }
+    // where each region is read next, up to its tail
+    std::vector<CaptureRegionHeader> regions(header.regions);
+    for (uint64_t r = 0; r < header.regions; r++) {
+        CaptureRegionHeader& region = regions[r];
+        memcpy(&region, file.data() + CAPTURE_HEADER_SIZE + r * sizeof(region), sizeof(region));
+        if (region.head > region.tail || region.tail - region.head > header.ring_size) {
+            fprintf(stderr, "%s is not a capture\n", path);
+            return false;
+        }
+    }
+    // the next record of region r, skipping pads, null at its tail
+    auto peek = [&](uint64_t r, const CaptureRecord** out) -> bool {
+        CaptureRegionHeader& region = regions[r];
+        const uint8_t* ring = file.data() + CaptureRingOffset(header.regions, header.ring_size, r);
+        *out = nullptr;
+        while (region.head < region.tail) {
+            uint64_t rest = header.ring_size - region.head % header.ring_size;
+            if (rest < sizeof(CaptureRecord)) {
+                region.head += rest;
+                continue;
+            }
+            const CaptureRecord* rec =
+                reinterpret_cast<const CaptureRecord*>(ring + region.head % header.ring_size);
+            if (sizeof(CaptureRecord) + rec->length > rest) {
+                fprintf(stderr, "%s: bad record at %llu of region %llu\n", path,
+                    (unsigned long long)region.head, (unsigned long long)r);
+                return false;
+            }
+            if (rec->type != kCapturePad) {
+                *out = rec;
+                return true;
+            }
+            region.head += CaptureAlign(sizeof(CaptureRecord) + rec->length);
+        }
+        return true;
+    };
+
+    // the connection index of each captured cid, kSkipped if its
+    // first record is not an opening
+    const uint32_t kSkipped = static_cast<uint32_t>(-1);
+    std::unordered_map<uint64_t, uint32_t> index;
+    // the type of the last payload record of each connection
+    std::vector<uint32_t> last_type;
+    int64_t base = INT64_MIN;
+
+    // The regions are merged by time, a cid may be used again on
+    // another reactor once it is closed.
+    for (;;) {
+        const CaptureRecord* next = nullptr;
+        uint64_t from = 0;
+        for (uint64_t r = 0; r < header.regions; r++) {
+            const CaptureRecord* rec;
+            if (!peek(r, &rec)) {
+                return false;
+            }
+            if (rec && (!next || rec->time_ns < next->time_ns)) {
+                next = rec;
+                from = r;
+            }
+        }
+        if (!next) {
+            break;
+        }
+        CaptureRecord rec;
+        memcpy(&rec, next, sizeof(rec));
+        const uint8_t* payload = reinterpret_cast<const uint8_t*>(next) + sizeof(rec);
+        regions[from].head += CaptureAlign(sizeof(rec) + rec.length);
+        out->records++;
+        if (base == INT64_MIN) {
+            base = rec.time_ns;
+        }
+        int64_t time_ns = rec.time_ns - base;
+
+        auto it = index.find(rec.cid);
+        if (rec.type == kCaptureOpen) {
+            // a cid is used again once the previous one is closed
+            uint32_t c = static_cast<uint32_t>(out->conns.size());
+            index[rec.cid] = c;
+            out->conns.emplace_back();
+            out->conns.back().expected = 0;
+            last_type.push_back(0);
+            out->actions.push_back({time_ns, c, kOpen, 0});
+            continue;
+        }
+        if (it == index.end()) {
+            index[rec.cid] = kSkipped;
+            out->skipped++;
+            continue;
+        }
+        if (it->second == kSkipped) {
+            continue;
+        }
+        uint32_t c = it->second;
+        ReplayConnection& conn = out->conns[c];
+        if (rec.type == kCaptureClose) {
+            out->actions.push_back({time_ns, c, kClose, 0});
+            index.erase(it);
+        } else if (rec.type == kCaptureRecv) {
+            conn.data.insert(conn.data.end(), payload, payload + rec.length);
+            out->actions.push_back({time_ns, c, kWrite, conn.data.size()});
+            if (echo) {
+                conn.expected = conn.data.size();
+                conn.checkpoints.push_back({conn.data.size(), conn.data.size(), 0});
+            }
+            last_type[c] = kCaptureRecv;
+        } else if (rec.type == kCaptureSend && !echo) {
+            conn.expected += rec.length;
+            if (!conn.data.empty()) {
+                if (last_type[c] == kCaptureRecv) {
+                    conn.checkpoints.push_back({conn.data.size(), conn.expected, 0});
+                } else if (!conn.checkpoints.empty()) {
+                    conn.checkpoints.back().reply = conn.expected;
+                }
+            }
+            last_type[c] = kCaptureSend;
+        }
+    }
+
+    // the records of a connection are in order, those of different
+    // reactors may be slightly out of it
+    std::stable_sort(out->actions.begin(), out->actions.end(),
+        [](const Action& a, const Action& b) { return a.time_ns < b.time_ns; });
+    return true;
+}
+
+bool ResolveAddress(const std::string& addr, struct sockaddr_storage* ss, socklen_t* len) {
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+    std::string host = addr.substr(0, colon);
+    std::string port = addr.substr(colon + 1);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || !result) {
+        return false;
+    }
+    memcpy(ss, result->ai_addr, result->ai_addrlen);
+    *len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+class Replayer {
+public:
+    Replayer(Capture* capture, const struct sockaddr_storage& addr, socklen_t addr_len)
+        : _capture(capture)
+        , _addr(addr)
+        , _addr_len(addr_len)
+        , _epfd(epoll_create1(EPOLL_CLOEXEC))
+        , _failed(0)
+        , _open(0) {}
+
+    ~Replayer() {
+        for (auto& conn : _capture->conns) {
+            if (conn.fd >= 0) {
+                close(conn.fd);
+            }
+        }
+        close(_epfd);
+    }
+
+    // returns the nanoseconds from the first connection to the last reply
+    int64_t Run(double speed, int64_t drain_ms) {
+        const std::vector<Action>& actions = _capture->actions;
+        int64_t start = GetMonotonicNanoseconds();
+        int64_t last_io = start;
+        int64_t deadline = INT64_MAX;
+        size_t next = 0;
+        struct epoll_event events[256];
+
+        for (;;) {
+            int64_t now = GetMonotonicNanoseconds();
+            while (next < actions.size() && Due(actions[next], start, speed) <= now) {
+                Apply(actions[next]);
+                next++;
+            }
+            if (next == actions.size()) {
+                if (_open == 0) {
+                    break;
+                }
+                if (deadline == INT64_MAX) {
+                    deadline = now + drain_ms * 1000000;
+                }
+                if (now >= deadline) {
+                    break;
+                }
+            }
+
+            int timeout = 10;
+            if (next < actions.size()) {
+                int64_t wait = (Due(actions[next], start, speed) - now) / 1000000;
+                timeout = static_cast<int>(std::min<int64_t>(std::max<int64_t>(wait, 0), 10));
+            }
+            int n = epoll_wait(_epfd, events, 256, timeout);
+            for (int i = 0; i < n; i++) {
+                ReplayConnection& conn = _capture->conns[events[i].data.u32];
+                if (conn.done) {
+                    continue;
+                }
+                if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                    OnWritable(&conn);
+                }
+                if (!conn.done && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                    OnReadable(&conn);
+                }
+                last_io = GetMonotonicNanoseconds();
+            }
+        }
+        return last_io - start;
+    }
+
+    const Histogram& Latency() const { return _latency; }
+    size_t Failed() const { return _failed; }
+
+private:
+    static int64_t Due(const Action& a, int64_t start, double speed) {
+        return (speed > 0) ? start + static_cast<int64_t>(static_cast<double>(a.time_ns) / speed) : start;
+    }
+
+    void Apply(const Action& a) {
+        ReplayConnection& conn = _capture->conns[a.conn];
+        switch (a.type) {
+        case kOpen:
+            Connect(&conn, a.conn);
+            break;
+        case kWrite:
+            conn.target = a.offset;
+            Flush(&conn);
+            break;
+        case kClose:
+            conn.closing = true;
+            Flush(&conn);
+            break;
+        }
+    }
+
+    void Connect(ReplayConnection* conn, uint32_t index) {
+        conn->fd = socket(_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (conn->fd < 0) {
+            Fail(conn);
+            return;
+        }
+        int one = 1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(conn->fd, reinterpret_cast<struct sockaddr*>(&_addr), _addr_len) != 0
+            && errno != EINPROGRESS) {
+            Fail(conn);
+            return;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.u64 = 0;
+        ev.data.u32 = index;
+        epoll_ctl(_epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+        _open++;
+    }
+
+    void OnWritable(ReplayConnection* conn) {
+        if (!conn->connected) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+                Fail(conn);
+                return;
+            }
+            conn->connected = true;
+        }
+        Flush(conn);
+    }
+
+    void Flush(ReplayConnection* conn) {
+        if (!conn->connected || conn->done) {
+            return;
+        }
+        while (conn->written < conn->target) {
+            // on loopback the reply may be sent before send returns
+            int64_t begin = GetMonotonicNanoseconds();
+            ssize_t r = send(conn->fd, conn->data.data() + conn->written,
+                conn->target - conn->written, MSG_NOSIGNAL);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                Fail(conn);
+                return;
+            }
+            conn->written += static_cast<uint64_t>(r);
+            while (conn->next_written < conn->checkpoints.size()
+                && conn->checkpoints[conn->next_written].request <= conn->written) {
+                conn->checkpoints[conn->next_written++].written_ns = begin;
+            }
+        }
+        CheckDone(conn);
+    }
+
+    void OnReadable(ReplayConnection* conn) {
+        uint8_t buf[64 * 1024];
+        for (;;) {
+            ssize_t r = recv(conn->fd, buf, sizeof(buf), 0);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    Fail(conn);
+                }
+                break;
+            }
+            if (r == 0) {
+                Finish(conn);
+                break;
+            }
+            conn->received += static_cast<uint64_t>(r);
+        }
+        int64_t now = GetMonotonicNanoseconds();
+        while (conn->next_read < conn->checkpoints.size()
+            && conn->checkpoints[conn->next_read].reply <= conn->received) {
+            const Checkpoint& cp = conn->checkpoints[conn->next_read++];
+            // a reply ahead of its request is not one
+            if (cp.written_ns > 0) {
+                _latency.Record(static_cast<uint64_t>(now - cp.written_ns));
+            }
+        }
+        CheckDone(conn);
+    }
+
+    // a connection closed in the capture is closed once everything
+    // is written and the replies are in
+    void CheckDone(ReplayConnection* conn) {
+        if (!conn->done && conn->closing
+            && conn->written == conn->data.size() && conn->received >= conn->expected) {
+            Finish(conn);
+        }
+    }
+
+    void Fail(ReplayConnection* conn) {
+        _failed++;
+        Finish(conn);
+    }
+
+    void Finish(ReplayConnection* conn) {
+        if (conn->done) {
+            return;
+        }
+        conn->done = true;
+        if (conn->fd >= 0) {
+            epoll_ctl(_epfd, EPOLL_CTL_DEL, conn->fd, nullptr);
+            close(conn->fd);
+            conn->fd = -1;
+            _open--;
+        }
+    }
+
+    Capture* _capture;
+    struct sockaddr_storage _addr;
+    socklen_t _addr_len;
+    int _epfd;
+    size_t _failed;
+    size_t _open;
+    Histogram _latency;
+};
+
+int Run(int argc, char** argv) {
+    bench::Flags flags(argc, argv);
+    std::string file = flags.GetString("file", "");
+    std::string addr = flags.GetString("addr", "127.0.0.1:50051");
+    double speed = strtod(flags.GetString("speed", "1").c_str(), nullptr);
+    int64_t drain_ms = flags.GetInt("drain_ms", 2000);
+    bool echo = flags.Has("echo");
+
+    if (file.empty() || speed < 0) {
+        fprintf(stderr, "usage: raptor_replay --file=capture.bin [--addr=host:port] [--speed=1]\n"
+            "    [--drain_ms=2000] [--echo] [--reactors=0] [--dispatch=1] [--inline]\n");
+        return 1;
+    }
+
+    Capture capture;
+    if (!LoadCapture(file.c_str(), echo, &capture)) {
+        return 1;
+    }
+    struct sockaddr_storage ss;
+    socklen_t ss_len = 0;
+    if (!ResolveAddress(addr, &ss, &ss_len)) {
+        fprintf(stderr, "cannot resolve %s\n", addr.c_str());
+        return 1;
+    }
+
+    RawProtocol proto;
+    EchoService service;
+    raptor::ITcpServer* server = nullptr;
+    if (echo) {
+        RaptorOptions options;
+        memset(&options, 0, sizeof(options));
+        options.max_connections = capture.conns.size() + 16;
+        options.send_recv_timeout = 0;
+        options.connection_timeout = 60;
+        options.reactor_threads = static_cast<size_t>(flags.GetInt("reactors", 0));
+        options.dispatch_threads = static_cast<size_t>(flags.GetInt("dispatch", 1));
+        options.inline_dispatch = flags.Has("inline") ? 1 : 0;
+
+        server = RaptorCreateServer(&service);
+        service.SetServer(server);
+        server->SetProtocol(&proto);
+        if (!server->Init(&options) || !server->AddListening(addr.c_str()) || !server->Start()) {
+            fprintf(stderr, "failed to start the echo server on %s\n", addr.c_str());
+            RaptorReleaseServer(server);
+            return 1;
+        }
+    }
+
+    uint64_t sent = 0, expected = 0;
+    size_t requests = 0;
+    for (const auto& conn : capture.conns) {
+        sent += conn.data.size();
+        expected += conn.expected;
+        requests += conn.checkpoints.size();
+    }
+    printf("%s: %llu records, %zu connections, %zu skipped, %zu requests, speed %g\n",
+        file.c_str(), (unsigned long long)capture.records, capture.conns.size(),
+        capture.skipped, requests, speed);
+
+    int64_t elapsed;
+    uint64_t received = 0;
+    size_t replies = 0, failed = 0;
+    Histogram latency;
+    {
+        Replayer replayer(&capture, ss, ss_len);
+        elapsed = replayer.Run(speed, drain_ms);
+        latency.Merge(replayer.Latency());
+        failed = replayer.Failed();
+    }
+    for (const auto& conn : capture.conns) {
+        received += conn.received;
+        replies += conn.next_read;
+    }
+
+    double seconds = static_cast<double>(std::max<int64_t>(elapsed, 1)) / 1e9;
+    printf("sent %llu bytes, received %llu of %llu, %zu failed connections in %.3f s\n",
+        (unsigned long long)sent, (unsigned long long)received,
+        (unsigned long long)expected, failed, seconds);
+    printf("%.1f MB/s %.0f requests/s ",
+        static_cast<double>(sent + received) / seconds / (1024.0 * 1024.0),
+        static_cast<double>(replies) / seconds);
+    bench::PrintLatency("latency", latency);
+    printf("\n");
+
+    if (server) {
+        server->Shutdown();
+        RaptorReleaseServer(server);
+    }
+    return (received < expected || failed > 0) ? 1 : 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    raptor_global_init();
+    int result = Run(argc, argv);
+    raptor_global_cleanup();
+    return result;
+}
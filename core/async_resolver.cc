@@ -0,0 +1,254 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "core/async_resolver.h"
+#include <string.h>
+
+#include "core/host_port.h"
+#include "core/sockaddr.h"
+#include "util/alloc.h"
+#include "util/time.h"
+
+namespace raptor {
+namespace {
+constexpr int64_t DEFAULT_POSITIVE_TTL_MS = 30000;
+constexpr int64_t DEFAULT_NEGATIVE_TTL_MS = 5000;
+
+bool IsNumericHost(const char* name) {
+    UniquePtr<char> host;
+    UniquePtr<char> port;
+    if (!SplitHostPort(name, &host, &port) || host == nullptr) {
+        return false;
+    }
+    unsigned char buf[sizeof(struct in6_addr)];
+    return inet_pton(AF_INET, host.get(), buf) == 1
+        || inet_pton(AF_INET6, host.get(), buf) == 1;
+}
+
+raptor_resolved_addresses* CopyAddresses(const std::vector<raptor_resolved_address>& addrs) {
+    auto r = static_cast<raptor_resolved_addresses*>(
+        Malloc(sizeof(raptor_resolved_addresses)));
+    r->naddrs = addrs.size();
+    r->addrs = static_cast<raptor_resolved_address*>(
+        Malloc(sizeof(raptor_resolved_address) * (addrs.empty() ? 1 : addrs.size())));
+    if (!addrs.empty()) {
+        memcpy(r->addrs, addrs.data(), sizeof(raptor_resolved_address) * addrs.size());
+    }
+    return r;
+}
+
+std::string MakeKey(const char* name, const char* default_port) {
+    std::string key(name);
+    key.push_back('\n');
+    if (default_port) {
+        key.append(default_port);
+    }
+    return key;
+}
+}  // namespace
+
+AsyncResolver* AsyncResolver::Instance() {
+    static AsyncResolver* resolver = new AsyncResolver;
+    return resolver;
+}
+
+AsyncResolver::AsyncResolver()
+    : _started(false)
+    , _positive_ttl_ms(DEFAULT_POSITIVE_TTL_MS)
+    , _negative_ttl_ms(DEFAULT_NEGATIVE_TTL_MS) {}
+
+bool AsyncResolver::ResolveNow(const char* name, const char* default_port,
+    raptor_resolved_addresses** addrs, raptor_error* error) {
+    *addrs = nullptr;
+    if (!name) {
+        *error = RAPTOR_ERROR_FROM_STATIC_STRING("invalid parameters");
+        return true;
+    }
+    if (raptor_is_unix_address(name) || IsNumericHost(name)) {
+        *error = raptor_blocking_resolve_address(name, default_port, addrs);
+        if (*error != RAPTOR_ERROR_NONE) {
+            *addrs = nullptr;
+        }
+        return true;
+    }
+    CacheEntry cached;
+    {
+        AutoMutex g(&_mtx);
+        if (!FindCached(MakeKey(name, default_port), &cached)) {
+            return false;
+        }
+    }
+    *error = cached.error;
+    if (cached.error == RAPTOR_ERROR_NONE) {
+        *addrs = CopyAddresses(cached.addrs);
+    }
+    return true;
+}
+
+void AsyncResolver::Resolve(const char* name, const char* default_port, ResolveCallback callback) {
+    raptor_resolved_addresses* addrs = nullptr;
+    raptor_error e = RAPTOR_ERROR_NONE;
+    if (ResolveNow(name, default_port, &addrs, &e)) {
+        callback(e, addrs);
+        return;
+    }
+
+    std::string key = MakeKey(name, default_port);
+    CacheEntry cached;
+    {
+        AutoMutex g(&_mtx);
+        // another lookup may have finished since ResolveNow
+        if (!FindCached(key, &cached)) {
+            auto it = _inflight.find(key);
+            if (it != _inflight.end()) {
+                it->second.callbacks.push_back(std::move(callback));
+                return;
+            }
+            Lookup& lookup = _inflight[key];
+            lookup.name = name;
+            lookup.has_default_port = (default_port != nullptr);
+            if (default_port) {
+                lookup.default_port = default_port;
+            }
+            lookup.callbacks.push_back(std::move(callback));
+            _queue.push_back(key);
+
+            if (!_started) {
+                _started = true;
+                _threads.reserve(RESOLVER_THREADS);
+                for (int i = 0; i < RESOLVER_THREADS; i++) {
+                    _threads.emplace_back("resolver",
+                        std::bind(&AsyncResolver::WorkThread, this, std::placeholders::_1),
+                        nullptr);
+                    _threads.back().Start();
+                }
+            }
+            _cv.Signal();
+            return;
+        }
+    }
+    Deliver(cached, callback);
+}
+
+void AsyncResolver::SetCacheTtl(int64_t positive_ms, int64_t negative_ms) {
+    AutoMutex g(&_mtx);
+    _positive_ttl_ms = positive_ms;
+    _negative_ttl_ms = negative_ms;
+    _cache.clear();
+}
+
+void AsyncResolver::ClearCache() {
+    AutoMutex g(&_mtx);
+    _cache.clear();
+}
+
+bool AsyncResolver::FindCached(const std::string& key, CacheEntry* entry) {
+    auto it = _cache.find(key);
+    if (it == _cache.end()) {
+        return false;
+    }
+    if (it->second.expire_ms <= UpdateCoarseClock()) {
+        _cache.erase(it);
+        return false;
+    }
+    *entry = it->second;
+    return true;
+}
+
+void AsyncResolver::AddCache(const std::string& key, raptor_error error,
+    const raptor_resolved_addresses* addrs) {
+    int64_t ttl = (error == RAPTOR_ERROR_NONE) ? _positive_ttl_ms : _negative_ttl_ms;
+    if (ttl <= 0) {
+        return;
+    }
+    int64_t now = UpdateCoarseClock();
+    if (_cache.size() >= MAX_CACHE_ENTRIES) {
+        for (auto it = _cache.begin(); it != _cache.end();) {
+            if (it->second.expire_ms <= now) {
+                it = _cache.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (_cache.size() >= MAX_CACHE_ENTRIES) {
+            _cache.clear();
+        }
+    }
+    CacheEntry& entry = _cache[key];
+    entry.expire_ms = now + ttl;
+    entry.error = error;
+    entry.addrs.clear();
+    if (addrs) {
+        entry.addrs.assign(addrs->addrs, addrs->addrs + addrs->naddrs);
+    }
+}
+
+void AsyncResolver::Deliver(const CacheEntry& entry, const ResolveCallback& callback) {
+    if (entry.error != RAPTOR_ERROR_NONE) {
+        callback(entry.error, nullptr);
+    } else {
+        callback(RAPTOR_ERROR_NONE, CopyAddresses(entry.addrs));
+    }
+}
+
+void AsyncResolver::WorkThread(void*) {
+    for (;;) {
+        Lookup lookup;
+        std::string key;
+        {
+            AutoMutex g(&_mtx);
+            while (_queue.empty()) {
+                _cv.Wait(&_mtx);
+            }
+            key = _queue.front();
+            _queue.pop_front();
+            lookup.name = _inflight[key].name;
+            lookup.default_port = _inflight[key].default_port;
+            lookup.has_default_port = _inflight[key].has_default_port;
+        }
+
+        raptor_resolved_addresses* addrs = nullptr;
+        raptor_error e = raptor_blocking_resolve_address(lookup.name.c_str(),
+            lookup.has_default_port ? lookup.default_port.c_str() : nullptr, &addrs);
+        if (e != RAPTOR_ERROR_NONE) {
+            addrs = nullptr;
+        }
+
+        CacheEntry result;
+        result.expire_ms = 0;
+        result.error = e;
+        if (addrs) {
+            result.addrs.assign(addrs->addrs, addrs->addrs + addrs->naddrs);
+        }
+
+        // callbacks that joined while getaddrinfo ran are taken too
+        {
+            AutoMutex g(&_mtx);
+            AddCache(key, e, addrs);
+            auto it = _inflight.find(key);
+            lookup.callbacks.swap(it->second.callbacks);
+            _inflight.erase(it);
+        }
+        raptor_resolved_addresses_destroy(addrs);
+        for (size_t i = 0; i < lookup.callbacks.size(); i++) {
+            Deliver(result, lookup.callbacks[i]);
+        }
+    }
+}
+
+} // namespace raptor
@@ -0,0 +1,138 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_CORE_ASYNC_RESOLVER__
+#define __RAPTOR_CORE_ASYNC_RESOLVER__
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "core/resolve_address.h"
+#include "util/status.h"
+#include "util/sync.h"
+#include "util/thread.h"
+
+namespace raptor {
+
+// The callback owns the addresses (nullptr on error) and frees them
+// with raptor_resolved_addresses_destroy.
+using ResolveCallback = std::function<void(raptor_error, raptor_resolved_addresses*)>;
+
+/*
+    Name resolution off the caller's thread. Numeric addresses and
+    cached names are resolved at once on the calling thread, anything
+    else goes to a few resolver threads running getaddrinfo. Lookups
+    of a name already in flight wait for that lookup instead of
+    starting another one, and the result is cached for a while.
+
+    getaddrinfo does not report the record TTL, so results are kept
+    for a fixed time, 30 seconds by default, failures for 5 seconds.
+*/
+class AsyncResolver final {
+public:
+    // leaked on purpose, resolver threads may still be running at exit
+    static AsyncResolver* Instance();
+
+    // Answers numeric addresses and cached names without a lookup,
+    // return false if the name has to go through Resolve.
+    bool ResolveNow(const char* name, const char* default_port,
+        raptor_resolved_addresses** addrs, raptor_error* error);
+
+    // callback may run before Resolve returns
+    void Resolve(const char* name, const char* default_port, ResolveCallback callback);
+
+    // 0 disables caching of successful / failed lookups
+    void SetCacheTtl(int64_t positive_ms, int64_t negative_ms);
+    void ClearCache();
+
+private:
+    enum {
+        RESOLVER_THREADS = 2,
+        MAX_CACHE_ENTRIES = 4096
+    };
+
+    struct CacheEntry {
+        int64_t expire_ms;
+        raptor_error error;
+        std::vector<raptor_resolved_address> addrs;
+    };
+
+    struct Lookup {
+        std::string name;
+        std::string default_port;
+        bool has_default_port;
+        std::vector<ResolveCallback> callbacks;
+    };
+
+    AsyncResolver();
+
+    void WorkThread(void*);
+    // requires _mtx held
+    bool FindCached(const std::string& key, CacheEntry* entry);
+    void AddCache(const std::string& key, raptor_error error,
+        const raptor_resolved_addresses* addrs);
+    static void Deliver(const CacheEntry& entry, const ResolveCallback& callback);
+
+    Mutex _mtx;
+    ConditionVariable _cv;
+    std::vector<Thread> _threads;
+    bool _started;
+    // keys of the lookups waiting for a resolver thread
+    std::deque<std::string> _queue;
+    std::unordered_map<std::string, Lookup> _inflight;
+    std::unordered_map<std::string, CacheEntry> _cache;
+    int64_t _positive_ttl_ms;
+    int64_t _negative_ttl_ms;
+};
+
+// Lets a resolve callback find out whether its owner still exists.
+// The owner calls Cancel before it goes away, which waits for a
+// callback that is running under the guard.
+template <typename T>
+class ResolveGuard final {
+public:
+    explicit ResolveGuard(T* owner) : _owner(owner) {}
+
+    void Cancel() {
+        AutoMutex g(&_mtx);
+        _owner = nullptr;
+    }
+
+    // runs fn(owner) if the owner has not been cancelled
+    template <typename Func>
+    bool Run(Func fn) {
+        AutoMutex g(&_mtx);
+        if (!_owner) {
+            return false;
+        }
+        fn(_owner);
+        return true;
+    }
+
+private:
+    Mutex _mtx;
+    T* _owner;
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_CORE_ASYNC_RESOLVER__
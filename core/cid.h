@@ -54,6 +54,25 @@ static inline uint32_t GetUserId(ConnectionId cid) {
     return (uint32_t)(cid & 0xffffffff);
 }
 
+// A user id can carry a generation in its high bits, so that
+// an id of a closed connection never matches a reused slot.
+constexpr uint32_t ConnectionIndexBits = 22;
+constexpr uint32_t MaxConnectionIndex = (1u << ConnectionIndexBits) - 1;
+constexpr uint32_t ConnectionGenerationMask = (1u << (32 - ConnectionIndexBits)) - 1;
+
+static inline uint32_t BuildUserId(uint32_t index, uint32_t generation) {
+    return ((generation & ConnectionGenerationMask) << ConnectionIndexBits)
+        | (index & MaxConnectionIndex);
+}
+
+static inline uint32_t GetConnectionIndex(ConnectionId cid) {
+    return GetUserId(cid) & MaxConnectionIndex;
+}
+
+static inline uint32_t GetConnectionGeneration(ConnectionId cid) {
+    return GetUserId(cid) >> ConnectionIndexBits;
+}
+
 }  // namespace core
 }  // namespace raptor
 #endif  // __RAPTOR_CORE_CID__
@@ -19,73 +19,96 @@
 #include "core/iomgr.h"
 #include <inttypes.h>
 #include <stddef.h>
-#include "util/alloc.h"
 #include "util/log.h"
-#include "util/string.h"
+#include "util/no_destructor.h"
 #include "util/sync.h"
 
 namespace raptor {
+namespace internal {
+IomgrStripe g_iomgr_stripes[IOMGR_STRIPES];
+
+IomgrStripe* IomgrThreadStripe() {
+    static AtomicUInt32 next_stripe;
+    static thread_local IomgrStripe* stripe =
+        &g_iomgr_stripes[next_stripe.FetchAdd(1, MemoryOrder::RELAXED) % IOMGR_STRIPES];
+    return stripe;
+}
+} // namespace internal
+
 namespace {
-int g_shutdown;
-raptor_mutex_t g_mutex;
-list_entry g_list_head;
+const char* const kTypeNames[] = { "connection", "slice", "message" };
 
-size_t IomgrCountObjects() {
-    size_t count = 0;
-    list_entry* item = g_list_head.next;
-    while (item != &g_list_head) {
-        item = item->next;
-        count++;
-    }
-    return count;
+#ifdef RAPTOR_IOMGR_TRACKING
+struct Tracker {
+    Mutex mtx;
+    list_entry head;
+    Tracker() { RAPTOR_LIST_INIT(&head); }
+};
+
+Tracker& GetTracker() {
+    static NoDestructor<Tracker> tracker;
+    return *tracker;
 }
 
-void IomgrDumpObjects(const char* kind) {
-    list_entry* item = g_list_head.next;
-    while (item != &g_list_head) {
-        int offset = offsetof(IomgrObject, entry);
-        IomgrObject* obj = reinterpret_cast<IomgrObject*>((char*)item - offset);
-        log_debug("%s OBJECT: %s %p", kind, obj->name, obj);
-        item = item->next;
-    }
+bool TakeSample() {
+    static thread_local uint32_t registered = 0;
+    return (registered++ % IOMGR_SAMPLE_RATE) == 0;
 }
+#endif
 } // namespace
 
-void IomgrInit() {
-    g_shutdown = false;
-    RaptorMutexInit(&g_mutex);
-    RAPTOR_LIST_INIT(&g_list_head);
+int64_t IomgrLiveObjects(IomgrType type) {
+    int64_t live = 0;
+    for (auto& stripe : internal::g_iomgr_stripes) {
+        live += stripe.live[static_cast<int>(type)].Load(MemoryOrder::RELAXED);
+    }
+    // a destroy counted on a stripe before its create on another
+    return live > 0 ? live : 0;
 }
 
-void IomgrRegisterObject(IomgrObject* obj, const char* name) {
-    obj->name = raptor_strdup(name);
-    RaptorMutexLock(&g_mutex);
-    raptor_list_push_back(&g_list_head, &obj->entry);
-    RaptorMutexUnlock(&g_mutex);
+void IomgrRegisterObject(IomgrObject* obj, IomgrType type, const char* name) {
+    obj->type = type;
+    IomgrAddObject(type);
+#ifdef RAPTOR_IOMGR_TRACKING
+    obj->name = name;
+    obj->sampled = TakeSample();
+    if (obj->sampled) {
+        Tracker& tracker = GetTracker();
+        AutoMutex g(&tracker.mtx);
+        raptor_list_push_back(&tracker.head, &obj->entry);
+    }
+#else
+    (void)name;
+#endif
 }
 
 void IomgrUnregisterObject(IomgrObject* obj) {
-    RaptorMutexLock(&g_mutex);
-    raptor_list_remove_entry(&obj->entry);
-    RaptorMutexUnlock(&g_mutex);
-    Free(obj->name);
+    IomgrRemoveObject(obj->type);
+#ifdef RAPTOR_IOMGR_TRACKING
+    if (obj->sampled) {
+        Tracker& tracker = GetTracker();
+        AutoMutex g(&tracker.mtx);
+        raptor_list_remove_entry(&obj->entry);
+    }
+#endif
 }
 
 void IomgrShutdown() {
-    RaptorMutexLock(&g_mutex);
-    g_shutdown = true;
-
-    if (! RAPTOR_LIST_IS_EMPTY(&g_list_head)) {
-        log_debug(
-            "Failed to free %" PRIuPTR
-            " iomgr objects before shutdown: "
-            "memory leaks are likely",
-            IomgrCountObjects());
-        IomgrDumpObjects("LEAKED");
+    for (int i = 0; i < static_cast<int>(IomgrType::kCount); i++) {
+        int64_t live = IomgrLiveObjects(static_cast<IomgrType>(i));
+        if (live > 0) {
+            log_error("iomgr: %" PRId64 " %s objects alive at shutdown", live, kTypeNames[i]);
+        }
     }
-
-    RaptorMutexUnlock(&g_mutex);
+#ifdef RAPTOR_IOMGR_TRACKING
+    Tracker& tracker = GetTracker();
+    AutoMutex g(&tracker.mtx);
+    for (list_entry* item = tracker.head.next; item != &tracker.head; item = item->next) {
+        IomgrObject* obj = reinterpret_cast<IomgrObject*>(
+            reinterpret_cast<char*>(item) - offsetof(IomgrObject, entry));
+        log_error("iomgr: leaked %s %p", obj->name, static_cast<void*>(obj));
+    }
+#endif
 }
 
 } // namespace raptor
-
@@ -19,17 +19,70 @@
 #ifndef __RAPTOR_CORE_IOMGR__
 #define __RAPTOR_CORE_IOMGR__
 
+#include <stdint.h>
+
+#include "util/atomic.h"
 #include "util/list_entry.h"
+#include "util/useful.h"
 
 namespace raptor {
+
+// Kinds of objects whose live count is kept, see IomgrLiveObjects.
+enum class IomgrType {
+    kConnection = 0,
+    kSlice,         // refcounted slice payloads, not Slice handles
+    kMessage,       // queued message nodes
+    kCount
+};
+
+/*
+    Live objects are counted per type, always. A count is spread over
+    IOMGR_STRIPES cache lines and a thread only adds to its own
+    stripe, so creating objects on different threads shares nothing
+    and takes no lock. IomgrLiveObjects sums the stripes, it is
+    approximate while objects are created or destroyed.
+
+    Built with RAPTOR_IOMGR_TRACKING, one in IOMGR_SAMPLE_RATE objects
+    registered through IomgrRegisterObject is also linked into a list
+    under a lock, IomgrShutdown reports those still alive.
+*/
+enum { IOMGR_STRIPES = 16, IOMGR_SAMPLE_RATE = 64 };
+
+namespace internal {
+struct IomgrStripe {
+    AtomicInt64 live[static_cast<int>(IomgrType::kCount)];
+    char padding[RAPTOR_CACHELINE_SIZE];
+};
+extern IomgrStripe g_iomgr_stripes[IOMGR_STRIPES];
+IomgrStripe* IomgrThreadStripe();
+} // namespace internal
+
+inline void IomgrAddObject(IomgrType type) {
+    internal::IomgrThreadStripe()->live[static_cast<int>(type)].FetchAdd(
+        1, MemoryOrder::RELAXED);
+}
+
+inline void IomgrRemoveObject(IomgrType type) {
+    internal::IomgrThreadStripe()->live[static_cast<int>(type)].FetchSub(
+        1, MemoryOrder::RELAXED);
+}
+
+int64_t IomgrLiveObjects(IomgrType type);
+
+// Embedded in objects worth tracking, name must outlive the object.
 typedef struct {
-    char* name;
+    IomgrType type;
+#ifdef RAPTOR_IOMGR_TRACKING
+    const char* name;
     list_entry entry;
+    bool sampled;
+#endif
 } IomgrObject;
 
-void IomgrInit();
-void IomgrRegisterObject(IomgrObject* obj, const char* name);
+// IomgrAddObject and, if sampled, the tracking list
+void IomgrRegisterObject(IomgrObject* obj, IomgrType type, const char* name);
 void IomgrUnregisterObject(IomgrObject* obj);
+// logs the sampled objects still alive
 void IomgrShutdown();
 } // namespace raptor
 
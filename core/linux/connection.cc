@@ -18,30 +18,105 @@
 
 #include "core/linux/connection.h"
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include "core/linux/epoll_thread.h"
 #include "core/linux/socket_setting.h"
+#include "core/linux/traffic_capture.h"
 #include "raptor/protocol.h"
+#include "raptor/service.h"
+#include "util/alloc.h"
 #include "util/log.h"
 #include "util/sync.h"
 #include "util/time.h"
+#include "util/trace.h"
+#include "util/useful.h"
 
 namespace raptor {
+namespace {
+// the connection whose recv buffer this thread is parsing, an inline
+// callback may shut it down while OnRecv holds _rcv_mutex.
+thread_local Connection* t_receiving = nullptr;
+
+constexpr size_t TLS_HEADER_SIZE = 5;
+// the largest TLSCiphertext length, 2^14 + 2048
+constexpr size_t TLS_MAX_RECORD_SIZE = 16384 + 2048;
+
+// the handshake flights go out as plain bytes of the connection
+class TlsWriter final : public ITlsWriter {
+public:
+    explicit TlsWriter(Connection* c) : _conn(c), _failed(false) {}
+    void Write(const void* data, size_t len) override {
+        if (_conn->SendWithHeader(nullptr, 0, data, len) != RAPTOR_SEND_OK) {
+            _failed = true;
+        }
+    }
+    bool Failed() const { return _failed; }
+
+private:
+    Connection* _conn;
+    bool _failed;
+};
+} // namespace
+
 Connection::Connection(internal::INotificationTransfer* service)
     : _service(service)
     , _proto(nullptr)
-    , _fd(-1)
-    , _cid(core::InvalidConnectionId)
+    , _counters(nullptr)
     , _rcv_thd(nullptr)
-    , _snd_thd(nullptr) {
-
-    _user_data = 0;
-    _extend_ptr = nullptr;
+    , _snd_thd(nullptr)
+    , _cid(core::InvalidConnectionId)
+    , _fd(-1)
+    , _shared_epoll(false)
+    , _quickack(false)
+    , _rcv_budget(DEFAULT_RECV_BUDGET)
+    , _tls_provider(nullptr)
+    , _capture(nullptr)
+    , _rcv_hint(0)
+    , _rcv_size(DEFAULT_RECV_SLICE_SIZE)
+    , _tls(nullptr)
+    , _rate_tokens(0)
+    , _rate_last_ms(0)
+    , _rate_limit(0)
+    , _rate_policy(RAPTOR_RATE_LIMIT_DROP)
+    , _rcv_resume_ms(0)
+    , _rcv_paused(false)
+    , _stream_threshold(0)
+    , _stream_remaining(0)
+    , _stream_skip(false)
+    , _rcv_bytes(0)
+    , _rcv_messages(0)
+    , _rcv_accounted(0)
+    , _snd_high_watermark(0)
+    , _snd_low_watermark(0)
+    , _snd_blocked(false)
+    , _snd_corked(false)
+    , _snd_bytes(0)
+    , _snd_messages(0)
+    , _zerocopy_seq(0)
+    , _zerocopy_threshold(0)
+    , _snd_offset(0)
+    , _compact_mark(0)
+    , _reactor(0)
+    , _user_data(0)
+    , _extend_ptr(nullptr)
+    , _pool(nullptr)
+    , _pool_next(nullptr) {
+    AccountAlloc(AllocTag::kConnection, sizeof(Connection));
+    IomgrRegisterObject(&_iomgr, IomgrType::kConnection, "connection");
 }
 
-Connection::~Connection() {}
+Connection::~Connection() {
+    IomgrUnregisterObject(&_iomgr);
+    AccountFree(AllocTag::kConnection, sizeof(Connection));
+}
 
 void Connection::Init(
                     ConnectionId cid,
@@ -50,50 +125,366 @@ void Connection::Init(
                     SendRecvThread* r, SendRecvThread* s) {
     _cid = cid;
 
-    _fd = fd;
+    _fd.Store(fd, MemoryOrder::RELEASE);
 
     _rcv_thd = r;
     _snd_thd = s;
+    _shared_epoll = (r == s);
+    _rcv_unpolled.Store(false);
 
-    _rcv_thd->Add(fd, (void*)_cid, EPOLLIN | EPOLLET);
-    _snd_thd->Add(fd, (void*)_cid, EPOLLOUT | EPOLLET);
+    if (_zerocopy_threshold > 0) {
+        auto e = raptor_set_socket_zerocopy(fd, 1);
+        if (e != RAPTOR_ERROR_NONE) {
+            log_error("connection: zero-copy disabled, %s", e->ToString().c_str());
+            _zerocopy_threshold = 0;
+        }
+    }
 
     _addr = *addr;
 
+    if (_capture) {
+        _capture->Write(_reactor, _cid, kCaptureOpen);
+    }
+
+    if (_tls_provider) {
+        _tls = _tls_provider->CreateSession(_cid);
+        if (!_tls) {
+            Shutdown(false);
+            return;
+        }
+        // arrives once the handshake is done
+        _tls_handshaking.Store(true);
+        if (_shared_epoll) {
+            _rcv_thd->Add(fd, (void*)_cid, EPOLLIN | EPOLLOUT | EPOLLET);
+            return;
+        }
+        _snd_thd->Add(fd, (void*)_cid, EPOLLOUT | EPOLLET);
+        _rcv_thd->Add(fd, (void*)_cid, EPOLLIN | EPOLLET);
+        return;
+    }
+
+    if (_shared_epoll) {
+        // a send queued by OnConnected is picked up by the add,
+        // which reports the socket writable at once
+        _service->OnConnectionArrived(_cid, &_addr);
+        if (IsOnline()) {
+            _rcv_thd->Add(fd, (void*)_cid, EPOLLIN | EPOLLOUT | EPOLLET);
+        }
+        return;
+    }
+
+    // OnConnected may send, but it always comes before the first message
+    _snd_thd->Add(fd, (void*)_cid, EPOLLOUT | EPOLLET);
     _service->OnConnectionArrived(_cid, &_addr);
+    if (IsOnline()) {
+        _rcv_thd->Add(fd, (void*)_cid, EPOLLIN | EPOLLET);
+    }
 }
 
 void Connection::SetProtocol(IProtocol* p) {
     _proto = p;
+    _checker.SetProtocol(p);
 }
 
-bool Connection::SendWithHeader(const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
-    if (!IsOnline()) return false;
-    AutoMutex g(&_snd_mutex);
+void Connection::EnableZeroCopy(size_t threshold) {
+#ifdef MSG_ZEROCOPY
+    // page pinning and completion handling do not pay off for small sends
+    if (threshold > 0 && threshold < MIN_ZEROCOPY_THRESHOLD) {
+        threshold = MIN_ZEROCOPY_THRESHOLD;
+    }
+    _zerocopy_threshold = threshold;
+#else
+    (void)threshold;
+#endif
+}
+
+void Connection::SetSendWatermarks(size_t high, size_t low) {
+    if (low == 0 || low > high) {
+        low = high / 2;
+    }
+    _snd_high_watermark = high;
+    _snd_low_watermark = low;
+}
+
+void Connection::SetRateLimit(size_t per_second, int policy) {
+    _rate_limit = static_cast<uint32_t>(RAPTOR_MIN(per_second, static_cast<size_t>(UINT32_MAX / 1000)));
+    _rate_policy = policy;
+    _rate_tokens = static_cast<int64_t>(_rate_limit) * 1000;
+    _rate_last_ms = UpdateCoarseClock();
+}
+
+void Connection::SetStreamThreshold(size_t threshold) {
+    _stream_threshold = threshold;
+}
+
+void Connection::SetTlsProvider(ITlsProvider* tls) {
+    _tls_provider = tls;
+    if (tls) {
+        // the kernel TLS layer takes no MSG_ZEROCOPY
+        _zerocopy_threshold = 0;
+    }
+}
+
+void Connection::SetQuickAck(bool enable) {
+    _quickack = enable;
+}
+
+void Connection::SetRecvBudget(size_t bytes) {
+    _rcv_budget = (bytes > 0) ? bytes : static_cast<size_t>(DEFAULT_RECV_BUDGET);
+}
+
+void Connection::SetCapture(TrafficCapture* capture) {
+    _capture = capture;
+}
+
+void Connection::SetCounters(ServerCounters* counters) {
+    _counters = counters;
+    AtomicUInt64* rings = counters ? &counters->ring_bytes : nullptr;
+    _rcv_buffer.SetRingCounter(rings);
+    _snd_buffer.SetRingCounter(rings);
+}
+
+int Connection::SendWithHeader(const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
+    raptor_iovec iov[2];
+    size_t count = 0;
     if (hdr != nullptr && hdr_len > 0) {
-        _snd_buffer.AddSlice(Slice(hdr, hdr_len));
+        iov[count].base = hdr;
+        iov[count].len = hdr_len;
+        count++;
     }
     if (data != nullptr && data_len > 0) {
-        _snd_buffer.AddSlice(Slice(data, data_len));
+        iov[count].base = data;
+        iov[count].len = data_len;
+        count++;
+    }
+    return SendV(iov, count);
+}
+
+int Connection::SendV(const raptor_iovec* iov, size_t count, const uint64_t* token) {
+    if (!IsOnline()) return RAPTOR_SEND_FAILED;
+    bool completed = false;
+    int r = WriteOrQueue(iov, count, token, &completed);
+    if (completed) {
+        _service->OnSendCompleted(_cid, token, 1);
+    }
+    return r;
+}
+
+int Connection::WriteOrQueue(const raptor_iovec* iov, size_t count,
+    const uint64_t* token, bool* completed) {
+    AutoMutex g(&_snd_mutex);
+    // shut down since IsOnline, the fd number may belong to another
+    if (_fd.Load() < 0) {
+        return RAPTOR_SEND_FAILED;
+    }
+
+    if (_snd_high_watermark > 0 && _snd_buffer.GetBufferLength() >= _snd_high_watermark) {
+        _snd_blocked = true;
+        return RAPTOR_SEND_WOULD_BLOCK;
+    }
+    _snd_messages++;
+
+    size_t total = 0;
+    // zero-copy payloads must be referenced by a slice until completion
+    bool zerocopy = false;
+    for (size_t i = 0; i < count; i++) {
+        total += iov[i].len;
+        zerocopy = zerocopy || (_zerocopy_threshold > 0 && iov[i].len >= _zerocopy_threshold);
+    }
+
+    size_t sent = 0;
+    bool filled = false;
+    if (!HasPendingSend() && !zerocopy && !_snd_corked) {
+        // fast path: nothing is queued, try to send on the caller's
+        // thread. Fragments beyond MAX_DIRECT_IOV are queued.
+        struct iovec vec[MAX_DIRECT_IOV];
+        size_t n = 0;
+        size_t attempted = 0;
+        for (size_t i = 0; i < count && n < MAX_DIRECT_IOV; i++) {
+            if (iov[i].len > 0) {
+                vec[n].iov_base = const_cast<void*>(iov[i].base);
+                vec[n].iov_len = iov[i].len;
+                attempted += iov[i].len;
+                n++;
+            }
+        }
+        ssize_t r = DirectSend(vec, n);
+        if (r < 0) {
+            return RAPTOR_SEND_FAILED;
+        }
+        sent = static_cast<size_t>(r);
+        filled = (sent < attempted);
+        _snd_bytes += sent;
+        if (_counters) {
+            ServerCounters::Add(_counters->bytes_sent, sent);
+            ServerCounters::Add(_counters->messages_sent, 1);
+        }
+        if (sent == total) {
+            *completed = (token != nullptr);
+            return RAPTOR_SEND_OK;
+        }
+    } else if (_counters) {
+        ServerCounters::Add(_counters->messages_sent, 1);
+    }
+    if (_counters) {
+        ServerCounters::Add(_counters->send_queued_bytes, total - sent);
+    }
+
+    // queue the unsent remainder and wait for EPOLLOUT
+    _snd_buffer.AddFragments(iov, count, sent);
+    if (token) {
+        _snd_tokens.push_back({_snd_offset + _snd_buffer.GetBufferLength(), *token});
+    }
+    if (!_snd_corked && !filled) {
+        PollSend();
+    }
+    return RAPTOR_SEND_OK;
+}
+
+int Connection::SendSlice(const Slice& s) {
+    if (!IsOnline()) return RAPTOR_SEND_FAILED;
+    AutoMutex g(&_snd_mutex);
+    if (_fd.Load() < 0) {
+        return RAPTOR_SEND_FAILED;
+    }
+
+    if (_snd_high_watermark > 0 && _snd_buffer.GetBufferLength() >= _snd_high_watermark) {
+        _snd_blocked = true;
+        return RAPTOR_SEND_WOULD_BLOCK;
+    }
+    _snd_messages++;
+
+    size_t sent = 0;
+    bool filled = false;
+    if (!HasPendingSend() && !IsZeroCopySlice(s) && !_snd_corked) {
+        struct iovec vec;
+        vec.iov_base = const_cast<uint8_t*>(s.begin());
+        vec.iov_len = s.size();
+        ssize_t r = DirectSend(&vec, 1);
+        if (r < 0) {
+            return RAPTOR_SEND_FAILED;
+        }
+        sent = static_cast<size_t>(r);
+        filled = (sent < s.size());
+        _snd_bytes += sent;
+        if (_counters) {
+            ServerCounters::Add(_counters->bytes_sent, sent);
+            ServerCounters::Add(_counters->messages_sent, 1);
+        }
+        if (sent == s.size()) {
+            return RAPTOR_SEND_OK;
+        }
+    } else if (_counters) {
+        ServerCounters::Add(_counters->messages_sent, 1);
     }
-    _snd_thd->Modify(_fd, (void*)_cid, EPOLLOUT | EPOLLET);
+    if (_counters) {
+        ServerCounters::Add(_counters->send_queued_bytes, s.size() - sent);
+    }
+
+    _snd_buffer.AddSlice(sent > 0 ? s - sent : s);
+    if (!_snd_corked && !filled) {
+        PollSend();
+    }
+    return RAPTOR_SEND_OK;
+}
+
+bool Connection::Cork() {
+    AutoMutex g(&_snd_mutex);
+    if (_snd_corked) {
+        return false;
+    }
+    _snd_corked = true;
+    return true;
+}
+
+void Connection::Uncork() {
+    AutoMutex g(&_snd_mutex);
+    _snd_corked = false;
+}
+
+bool Connection::SendFile(raptor_file_t file, uint64_t offset, uint64_t length,
+    raptor_send_file_callback done, void* ctx) {
+    if (!IsOnline()) return false;
+    AutoMutex g(&_snd_mutex);
+    if (_fd.Load() < 0) {
+        return false;
+    }
+
+    FileSend f;
+    f.fd = file;
+    f.offset = offset;
+    f.remaining = length;
+    f.before = _snd_buffer.GetBufferLength();
+    f.done = done;
+    f.ctx = ctx;
+    for (const FileSend& queued : _snd_files) {
+        f.before -= queued.before;
+    }
+    _snd_files.push_back(f);
+    _snd_messages++;
+    if (_counters) {
+        ServerCounters::Add(_counters->messages_sent, 1);
+    }
+    PollSend();
     return true;
 }
 
+ssize_t Connection::DirectSend(const struct iovec* iov, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = const_cast<struct iovec*>(iov);
+    msg.msg_iovlen = count;
+
+    ssize_t r;
+    do {
+        r = ::sendmsg(_fd.Load(), &msg, MSG_DONTWAIT);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            return 0;
+        }
+        return -1;
+    }
+    RAPTOR_TRACE(send, RAPTOR_TRACE_SEND, _cid, r);
+    if (_capture) {
+        _capture->Write(_reactor, _cid, kCaptureSend, iov, count, static_cast<size_t>(r));
+    }
+    return r;
+}
+
 void Connection::Shutdown(bool notify) {
-    if (_fd < 0) {
+    int fd = _fd.Load(MemoryOrder::ACQUIRE);
+    if (fd < 0) {
         return;
     }
 
-    _rcv_thd->Delete(_fd, EPOLLIN | EPOLLET);
-    _snd_thd->Delete(_fd, EPOLLOUT | EPOLLET);
+    if (_shared_epoll) {
+        _rcv_thd->Delete(fd, EPOLLIN | EPOLLOUT | EPOLLET);
+    } else {
+        _rcv_thd->Delete(fd, EPOLLIN | EPOLLET);
+        _snd_thd->Delete(fd, EPOLLOUT | EPOLLET);
+    }
 
-    if (notify) {
+    // nobody was told about a connection that failed its handshake
+    if (notify && !_tls_handshaking.Load()) {
         _service->OnConnectionClosed(_cid);
     }
 
-    raptor_set_socket_shutdown(_fd);
-    _fd = -1;
+    {
+        // senders on other threads write to the fd under this lock
+        AutoMutex g(&_snd_mutex);
+        _fd.Store(-1, MemoryOrder::RELEASE);
+        raptor_set_socket_shutdown(fd);
+    }
+
+    if (_capture) {
+        _capture->Write(_reactor, _cid, kCaptureClose);
+    }
 
     memset(&_addr, 0, sizeof(_addr));
 
@@ -104,7 +495,34 @@ void Connection::Shutdown(bool notify) {
 }
 
 bool Connection::IsOnline() {
-    return (_fd > 0);
+    return (_fd.Load(MemoryOrder::ACQUIRE) >= 0);
+}
+
+size_t Connection::GetSendQueueBytes() {
+    AutoMutex g(&_snd_mutex);
+    return _snd_buffer.GetBufferLength();
+}
+
+void Connection::GetInfo(RaptorConnInfo* info) {
+    memset(info, 0, sizeof(*info));
+    {
+        AutoMutex g(&_rcv_mutex);
+        info->bytes_received = _rcv_bytes;
+        info->messages_received = _rcv_messages;
+    }
+    {
+        AutoMutex g(&_snd_mutex);
+        info->bytes_sent = _snd_bytes;
+        info->messages_sent = _snd_messages;
+        info->send_queued_bytes = _snd_buffer.GetBufferLength();
+    }
+    // _last_active is on the coarse monotonic clock
+    time_t idle = Now() - _last_active.Load(MemoryOrder::RELAXED);
+    info->last_active = static_cast<int64_t>(time(0) - idle);
+    int fd = _fd.Load(MemoryOrder::ACQUIRE);
+    if (fd >= 0) {
+        raptor_get_socket_tcp_info(fd, info);
+    }
 }
 
 const raptor_resolved_address* Connection::GetAddress() {
@@ -112,43 +530,256 @@ const raptor_resolved_address* Connection::GetAddress() {
 }
 
 void Connection::ReleaseBuffer() {
+    std::vector<FileSend> files;
     {
         AutoMutex g(&_snd_mutex);
+        if (_counters) {
+            ServerCounters::Sub(_counters->send_queued_bytes, _snd_buffer.GetBufferLength());
+        }
         _snd_buffer.ClearBuffer();
+        // the ring is kept until Reset but no longer counts as held
+        // by an open connection
+        _snd_buffer.SetRingCounter(nullptr);
+        _zerocopy_records.clear();
+        _snd_tokens.clear();
+        files.assign(_snd_files.begin(), _snd_files.end());
+        _snd_files.clear();
     }
-    {
+    FinishFileSends(&files, false);
+    // otherwise Reset releases the recv buffer once OnRecv has returned
+    if (t_receiving != this) {
         AutoMutex g(&_rcv_mutex);
         _rcv_buffer.ClearBuffer();
+        _rcv_buffer.SetRingCounter(nullptr);
+        _rcv_hint = 0;
+        _stream_remaining = 0;
+        AccountRecvBuffer();
+    }
+}
+
+void Connection::Reset() {
+    Shutdown(false);
+    ReleaseBuffer();
+    DestroyTlsSession();
+    _tls_provider = nullptr;
+    _capture = nullptr;
+    _tls_handshaking.Store(false);
+    _proto = nullptr;
+    _checker.SetProtocol(nullptr);
+    _cid = core::InvalidConnectionId;
+    _rcv_thd = nullptr;
+    _snd_thd = nullptr;
+    _shared_epoll = false;
+    _zerocopy_threshold = 0;
+    _zerocopy_seq = 0;
+    _snd_high_watermark = 0;
+    _snd_low_watermark = 0;
+    _snd_blocked = false;
+    _snd_corked = false;
+    _snd_offset = 0;
+    _snd_bytes = 0;
+    _snd_messages = 0;
+    _rcv_bytes = 0;
+    _rcv_messages = 0;
+    _stream_threshold = 0;
+    _stream_remaining = 0;
+    _stream_skip = false;
+    _quickack = false;
+    _rcv_budget = DEFAULT_RECV_BUDGET;
+    _rcv_size = DEFAULT_RECV_SLICE_SIZE;
+    _rate_limit = 0;
+    _rate_policy = RAPTOR_RATE_LIMIT_DROP;
+    _rate_tokens = 0;
+    _rate_last_ms = 0;
+    if (_counters && _rcv_accounted > 0) {
+        ServerCounters::Sub(_counters->recv_buffered_bytes, _rcv_accounted);
     }
+    _rcv_accounted = 0;
+    SetCounters(nullptr);
+    _rcv_paused = false;
+    _rcv_resume_ms = 0;
+    _reactor = 0;
+    _timer.deadline = 0;
+    _timer.data = nullptr;
+    _compact_mark = 0;
+    _last_active.Store(0);
 }
 
 bool Connection::DoRecvEvent() {
     int result = OnRecv();
-    if (result == 0) {
-        _rcv_thd->Modify(_fd, (void*)_cid, EPOLLIN | EPOLLET);
-        return true;
+    if (result < 0) {
+        return false;
     }
-    return false;
+    // Re-arming a socket that still has data queues it at the tail of
+    // the epoll ready list, so a connection over its read budget is
+    // serviced again after the others that are ready. A drained
+    // shared registration stays armed for both directions.
+    if (!_shared_epoll) {
+        _rcv_thd->Modify(_fd.Load(), (void*)_cid, EPOLLIN | EPOLLET);
+    } else if (result > 0) {
+        PollRecv(true);
+    }
+    return true;
+}
+
+void Connection::PollSend() {
+    if (!_shared_epoll) {
+        _snd_thd->Modify(_fd.Load(), (void*)_cid, EPOLLOUT | EPOLLET);
+        return;
+    }
+    uint32_t events = _rcv_unpolled.Load() ? 0 : EPOLLIN;
+    _snd_thd->Modify(_fd.Load(), (void*)_cid, events | EPOLLOUT | EPOLLET);
+}
+
+void Connection::PollRecv(bool enable) {
+    if (!_shared_epoll) {
+        _rcv_thd->Modify(_fd.Load(), (void*)_cid, enable ? (EPOLLIN | EPOLLET) : EPOLLET);
+        return;
+    }
+    // a send racing with this may leave EPOLLIN on, OnRecv
+    // reads nothing while paused
+    _rcv_unpolled.Store(!enable);
+    _rcv_thd->Modify(_fd.Load(), (void*)_cid, (enable ? EPOLLIN : 0) | EPOLLOUT | EPOLLET);
 }
 
 bool Connection::DoSendEvent() {
-    int result = OnSend();
+    bool writable = false;
+    std::vector<FileSend> finished;
+    std::vector<uint64_t> tokens;
+    int result = OnSend(&writable, &finished, &tokens);
+    FinishFileSends(&finished, true);
+    if (!tokens.empty()) {
+        _service->OnSendCompleted(_cid, tokens.data(), tokens.size());
+    }
+    if (writable) {
+        _service->OnWritable(_cid);
+    }
     if (result == 0) {
         return true;
     }
     return false;
 }
 
+bool Connection::ResumeRecv() {
+    {
+        AutoMutex g(&_rcv_mutex);
+        if (!_rcv_paused || !IsOnline()) {
+            return true;
+        }
+        _rcv_paused = false;
+        // parse what was held back before reading more
+        t_receiving = this;
+        int r = ParsingProtocol();
+        t_receiving = nullptr;
+        if (r == -1) {
+            return false;
+        }
+        if (_rcv_paused) {
+            return true;
+        }
+    }
+    PollRecv(true);
+    return DoRecvEvent();
+}
+
+int64_t Connection::TakeResumeTime() {
+    if (_rate_limit == 0 || _rate_policy != RAPTOR_RATE_LIMIT_PAUSE) {
+        return 0;
+    }
+    AutoMutex g(&_rcv_mutex);
+    int64_t resume_ms = _rcv_resume_ms;
+    _rcv_resume_ms = 0;
+    return resume_ms;
+}
+
+void Connection::Compact() {
+    {
+        AutoMutex g(&_rcv_mutex);
+        size_t len = _rcv_buffer.GetBufferLength();
+        if (len > 0 && len < DEFAULT_RECV_SLICE_SIZE) {
+            // the slice it was read into may be much larger
+            Slice s = MakeSliceByLength(len);
+            _rcv_buffer.PeekHeader(s.Buffer(), len);
+            _rcv_buffer.ClearBuffer();
+            _rcv_buffer.AddSlice(std::move(s));
+        }
+        _rcv_buffer.ShrinkToFit();
+        // the next read of a quiet connection is likely small
+        _rcv_size = MIN_RECV_SLICE_SIZE;
+    }
+    AutoMutex g(&_snd_mutex);
+    _snd_buffer.ShrinkToFit();
+}
+
+size_t Connection::BufferedBytes() {
+    size_t bytes = 0;
+    {
+        AutoMutex g(&_rcv_mutex);
+        bytes += _rcv_buffer.GetBufferLength();
+    }
+    AutoMutex g(&_snd_mutex);
+    return bytes + _snd_buffer.GetBufferLength();
+}
+
+void Connection::AccountRecvBuffer() {
+    size_t len = _rcv_buffer.GetBufferLength();
+    if (!_counters || len == _rcv_accounted) {
+        return;
+    }
+    if (len > _rcv_accounted) {
+        ServerCounters::Add(_counters->recv_buffered_bytes, len - _rcv_accounted);
+    } else {
+        ServerCounters::Sub(_counters->recv_buffered_bytes, _rcv_accounted - len);
+    }
+    _rcv_accounted = len;
+}
+
+void Connection::RefillTokens() {
+    int64_t now = GetCoarseMilliseconds();
+    if (now > _rate_last_ms) {
+        int64_t capacity = static_cast<int64_t>(_rate_limit) * 1000;
+        _rate_tokens += (now - _rate_last_ms) * _rate_limit;
+        if (_rate_tokens > capacity) {
+            _rate_tokens = capacity;
+        }
+        _rate_last_ms = now;
+    }
+}
+
 int Connection::OnRecv() {
     AutoMutex g(&_rcv_mutex);
+    if (_rcv_paused) {
+        return 0;
+    }
+    if (_tls) {
+        int r = OnTlsHandshake();
+        if (r != 1) {
+            return r;
+        }
+        // the kernel may already hold application data
+    }
 
-    int recv_bytes = 0;
-    int unused_space = 0;
+    // Bytes are read straight into a refcounted slice which is sized
+    // for the rest of the pending package when its length is known,
+    // the stack buffer only catches whatever does not fit.
+    char extra[8192];
+    size_t capacity = 0;
+    size_t budget = _rcv_budget;
+    ssize_t recv_bytes = 0;
     do {
-        char buffer[8192];
+        size_t slice_size = RAPTOR_MAX(_rcv_hint, _rcv_size);
+        slice_size = RAPTOR_MIN(slice_size, static_cast<size_t>(MAX_RECV_SLICE_SIZE));
+        Slice slice = MakeSliceAtLeast(slice_size);
+        slice_size = slice.size();
 
-        unused_space = sizeof(buffer);
-        recv_bytes = ::recv(_fd, buffer, unused_space, 0);
+        struct iovec iov[2];
+        iov[0].iov_base = slice.Buffer();
+        iov[0].iov_len = slice_size;
+        iov[1].iov_base = extra;
+        iov[1].iov_len = sizeof(extra);
+        capacity = slice_size + sizeof(extra);
+
+        recv_bytes = ::readv(_fd.Load(), iov, 2);
 
         if (recv_bytes == 0) {
             return -1;
@@ -162,26 +793,189 @@ int Connection::OnRecv() {
         }
 
         // Add to recv buffer
-        _rcv_buffer.AddSlice(Slice(buffer, recv_bytes));
-        if (ParsingProtocol() == -1) {
+        size_t n = static_cast<size_t>(recv_bytes);
+        _rcv_bytes += n;
+        if (_counters) {
+            ServerCounters::Add(_counters->bytes_received, n);
+        }
+        RAPTOR_TRACE(recv, RAPTOR_TRACE_RECV, _cid, n);
+        if (_capture) {
+            _capture->Write(_reactor, _cid, kCaptureRecv, iov, 2, n);
+        }
+        if (_quickack) {
+            raptor_set_socket_quickack(_fd.Load());
+        }
+        if (n <= slice_size) {
+            if (n < slice_size / 4 && _rcv_size > MIN_RECV_SLICE_SIZE) {
+                _rcv_size = RAPTOR_MAX(_rcv_size / 2, static_cast<size_t>(MIN_RECV_SLICE_SIZE));
+            }
+            slice.CutTail(slice_size - n);
+            _rcv_buffer.AddSlice(std::move(slice));
+        } else {
+            if (_rcv_size < ADAPTIVE_RECV_SLICE_SIZE) {
+                _rcv_size = RAPTOR_MIN(_rcv_size * 2, static_cast<size_t>(ADAPTIVE_RECV_SLICE_SIZE));
+            }
+            _rcv_buffer.AddSlice(std::move(slice));
+            _rcv_buffer.AddSlice(Slice(extra, n - slice_size));
+        }
+        t_receiving = this;
+        int r = ParsingProtocol();
+        t_receiving = nullptr;
+        if (r == -1) {
             return -1;
         }
+        if (_rcv_paused) {
+            // leave the rest in the kernel, the sender's window closes
+            PollRecv(false);
+            return 0;
+        }
+        budget -= RAPTOR_MIN(n, budget);
+        if (budget == 0 && n == capacity) {
+            return 1;
+        }
 
-    } while (recv_bytes == unused_space);
+    } while (static_cast<size_t>(recv_bytes) == capacity);
     return 0;
 }
 
-int Connection::OnSend() {
+int Connection::OnTlsHandshake() {
+    TlsWriter writer(this);
+    uint8_t record[TLS_HEADER_SIZE + TLS_MAX_RECORD_SIZE];
+    int result = RAPTOR_TLS_HANDSHAKE_CONTINUE;
+    while (result == RAPTOR_TLS_HANDSHAKE_CONTINUE) {
+        // the header first, then the rest of the record it announces
+        size_t have = _rcv_buffer.GetBufferLength();
+        size_t need = TLS_HEADER_SIZE;
+        if (have >= TLS_HEADER_SIZE) {
+            _rcv_buffer.PeekHeader(record, TLS_HEADER_SIZE);
+            need += (static_cast<size_t>(record[3]) << 8) | record[4];
+            if (need > sizeof(record)) {
+                log_error("connection: tls record of %u bytes", (unsigned)need);
+                return -1;
+            }
+        }
+        if (have < need) {
+            ssize_t n = ::recv(_fd.Load(), record, need - have, 0);
+            if (n == 0) {
+                return -1;
+            }
+            if (n < 0) {
+                if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) {
+                    return 0;
+                }
+                return -1;
+            }
+            _rcv_bytes += static_cast<uint64_t>(n);
+            if (_counters) {
+                ServerCounters::Add(_counters->bytes_received, n);
+            }
+            _rcv_buffer.AddSlice(Slice(record, static_cast<size_t>(n)));
+            continue;
+        }
+
+        Slice s = _rcv_buffer.Merge();
+        _rcv_buffer.ClearBuffer();
+        result = _tls->Handshake(s.begin(), s.size(), &writer);
+        if (writer.Failed()) {
+            return -1;
+        }
+    }
+    if (result != RAPTOR_TLS_HANDSHAKE_DONE) {
+        return -1;
+    }
+
+    TlsCryptoInfo tx, rx;
+    bool ok = _tls->GetCryptoInfo(&tx, &rx);
+    DestroyTlsSession();
+    if (!ok) {
+        return -1;
+    }
+    {
+        // the last flight must leave as plain bytes before TLS_TX
+        AutoMutex g(&_snd_mutex);
+        if (HasPendingSend()) {
+            log_error("connection: tls handshake flight not sent");
+            return -1;
+        }
+        raptor_error e = raptor_set_socket_ktls(_fd.Load(), &tx, &rx);
+        memset(&tx, 0, sizeof(tx));
+        memset(&rx, 0, sizeof(rx));
+        if (e != RAPTOR_ERROR_NONE) {
+            log_error("connection: kernel tls (%s)", e->ToString().c_str());
+            return -1;
+        }
+    }
+    _tls_handshaking.Store(false);
+
+    // OnConnected may send or close it
+    t_receiving = this;
+    _service->OnConnectionArrived(_cid, &_addr);
+    t_receiving = nullptr;
+    return IsOnline() ? 1 : -1;
+}
+
+void Connection::DestroyTlsSession() {
+    if (_tls) {
+        _tls_provider->DestroySession(_tls);
+        _tls = nullptr;
+    }
+}
+
+int Connection::OnSend(bool* writable, std::vector<FileSend>* finished, std::vector<uint64_t>* tokens) {
     AutoMutex g(&_snd_mutex);
-    if (_snd_buffer.Empty()) {
+    if (!HasPendingSend() || _fd.Load() < 0) {
         return 0;
     }
 
-    size_t count = 0;
+    struct iovec iov[IOV_MAX];
     do {
+        if (!_snd_files.empty() && _snd_files.front().before == 0) {
+            FileSend& f = _snd_files.front();
+            if (!SendFileRange(&f)) {
+                return -1;
+            }
+            if (f.remaining > 0) {
+                *writable = LeaveBlocked();
+                return 0;
+            }
+            finished->push_back(f);
+            _snd_files.pop_front();
+            continue;
+        }
 
-        Slice slice = _snd_buffer.GetTopSlice();
-        int slen = ::send(_fd, slice.begin(), slice.size(), 0);
+        // bytes of _snd_buffer allowed out before the next file range
+        size_t limit = _snd_files.empty() ? SIZE_MAX : _snd_files.front().before;
+        size_t count = RAPTOR_MIN(_snd_buffer.Count(), static_cast<size_t>(IOV_MAX));
+        int flags = 0;
+        if (IsZeroCopySlice(_snd_buffer[0])) {
+            // a large slice goes out alone with MSG_ZEROCOPY
+            count = 1;
+#ifdef MSG_ZEROCOPY
+            flags = MSG_ZEROCOPY;
+#endif
+        }
+        for (size_t i = 0; i < count; i++) {
+            const Slice& s = _snd_buffer[i];
+            if ((i > 0 && IsZeroCopySlice(s)) || limit == 0) {
+                count = i;
+                break;
+            }
+            iov[i].iov_base = const_cast<uint8_t*>(s.begin());
+            iov[i].iov_len = RAPTOR_MIN(s.size(), limit);
+            limit -= iov[i].iov_len;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        ssize_t slen = ::sendmsg(_fd.Load(), &msg, flags);
+        if (slen < 0 && flags != 0 && errno == ENOBUFS) {
+            // out of optmem for zero-copy notifications, copy instead
+            flags = 0;
+            slen = ::sendmsg(_fd.Load(), &msg, 0);
+        }
 
         if (slen == 0) {
             return -1;
@@ -189,77 +983,318 @@ int Connection::OnSend() {
 
         if (slen < 0) {
             if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) {
+                *writable = LeaveBlocked();
                 return 0;
             }
             return -1;
         }
 
+        if (flags != 0) {
+            _zerocopy_records.push_back({_zerocopy_seq++, _snd_buffer[0]});
+        }
+        if (_capture) {
+            _capture->Write(_reactor, _cid, kCaptureSend, iov, count, static_cast<size_t>(slen));
+        }
         _snd_buffer.MoveHeader((size_t)slen);
-        count = _snd_buffer.Count();
+        _snd_offset += static_cast<uint64_t>(slen);
+        while (!_snd_tokens.empty() && _snd_tokens.front().end <= _snd_offset) {
+            tokens->push_back(_snd_tokens.front().token);
+            _snd_tokens.pop_front();
+        }
+        if (!_snd_files.empty()) {
+            _snd_files.front().before -= static_cast<size_t>(slen);
+        }
+        _snd_bytes += static_cast<uint64_t>(slen);
+        if (_counters) {
+            ServerCounters::Add(_counters->bytes_sent, slen);
+            ServerCounters::Sub(_counters->send_queued_bytes, slen);
+        }
+        RAPTOR_TRACE(send, RAPTOR_TRACE_SEND, _cid, slen);
 
-    } while (count > 0);
+    } while (HasPendingSend());
+    *writable = LeaveBlocked();
     return 0;
 }
 
-bool Connection::ReadSliceFromRecvBuffer(size_t read_size, Slice& s) {
-    size_t cache_size = _rcv_buffer.GetBufferLength();
-    if (read_size >= cache_size) {
-        s = _rcv_buffer.Merge();
+bool Connection::SendFileRange(FileSend* f) {
+    // sendfile moves at most this much per call
+    constexpr uint64_t MAX_SENDFILE_CHUNK = 0x7ffff000;
+    while (f->remaining > 0) {
+        off_t offset = static_cast<off_t>(f->offset);
+        size_t count = static_cast<size_t>(RAPTOR_MIN(f->remaining, MAX_SENDFILE_CHUNK));
+        ssize_t n = ::sendfile(_fd.Load(), f->fd, &offset, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EWOULDBLOCK || errno == EAGAIN;
+        }
+        if (n == 0) {
+            // the file is shorter than the range, the peer would
+            // wait forever for the rest
+            log_error("connection: sendfile reached the end of file, cid = %llx",
+                static_cast<unsigned long long>(_cid));
+            return false;
+        }
+        f->offset += static_cast<uint64_t>(n);
+        f->remaining -= static_cast<uint64_t>(n);
+        _snd_bytes += static_cast<uint64_t>(n);
+        if (_counters) {
+            ServerCounters::Add(_counters->bytes_sent, n);
+        }
+        RAPTOR_TRACE(send, RAPTOR_TRACE_SEND, _cid, n);
+    }
+    return true;
+}
+
+void Connection::FinishFileSends(std::vector<FileSend>* files, bool success) {
+    for (const FileSend& f : *files) {
+        if (f.done) {
+            f.done(_cid, success ? 1 : 0, f.ctx);
+        }
+    }
+}
+
+bool Connection::IsZeroCopySlice(const Slice& s) const {
+    return _zerocopy_threshold > 0 && s.size() >= _zerocopy_threshold;
+}
+
+bool Connection::LeaveBlocked() {
+    if (_snd_blocked && _snd_buffer.GetBufferLength() <= _snd_low_watermark) {
+        _snd_blocked = false;
         return true;
     }
-    s = _rcv_buffer.GetHeader(read_size);
     return false;
 }
 
+bool Connection::DoErrorQueueEvent() {
+    if (_zerocopy_threshold == 0) {
+        return false;
+    }
+
+    uint32_t completed = 0;
+    {
+        AutoMutex g(&_snd_mutex);
+        completed = ProcessErrorQueue();
+    }
+    if (completed > 0) {
+        _service->OnZeroCopyCompleted(_cid, completed);
+    }
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(_fd.Load(), SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+        return false;
+    }
+    return err == 0;
+}
+
+uint32_t Connection::ProcessErrorQueue() {
+    uint32_t completed = 0;
+#ifdef MSG_ZEROCOPY
+    for (;;) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t r = ::recvmsg(_fd.Load(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            auto serr = reinterpret_cast<struct sock_extended_err*>(CMSG_DATA(cm));
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // sends [ee_info, ee_data] are completed
+            uint32_t hi = serr->ee_data;
+            completed += hi - serr->ee_info + 1;
+            while (!_zerocopy_records.empty()
+                && static_cast<int32_t>(_zerocopy_records.front().seq - hi) <= 0) {
+                _zerocopy_records.pop_front();
+            }
+        }
+    }
+#endif
+    return completed;
+}
+
 int Connection::ParsingProtocol() {
     size_t cache_size = _rcv_buffer.GetBufferLength();
-    size_t header_size = _proto->GetMaxHeaderSize();
     int package_counter = 0;
 
+    // packages are handed over in batches, the slices keep
+    // their data alive after MoveHeader.
+    Slice packages[PARSE_BATCH_SIZE];
+    size_t count = 0;
+    bool stream = false;
+
+    if (_rate_limit > 0) {
+        RefillTokens();
+    }
+
+    _rcv_hint = 0;
     while (cache_size > 0) {
-        size_t read_size = header_size;
-        int pack_len = 0;
-        Slice package;
-        do {
-            bool reach_tail = ReadSliceFromRecvBuffer(read_size, package);
-            pack_len = _proto->CheckPackageLength(package.begin(), package.size());
-            if (pack_len < 0) {
-                log_error("tcp client: internal protocol error(pack_len = %d)", pack_len);
+        if (_stream_remaining > 0) {
+            if (!DeliverChunks()) {
                 return -1;
             }
-
-            // equal 0 means we need more data
-            if (pack_len == 0) {
-                if (reach_tail) {
-                    goto done;
-                }
-                read_size *= 2;
-                continue;
+            if (_rcv_paused) {
+                goto done;
             }
+            cache_size = _rcv_buffer.GetBufferLength();
+            continue;
+        }
 
-            // We got the length of a whole packet
-            if (cache_size >= (size_t)pack_len) {
-                break;
+        int pack_len = _checker.Check(_rcv_buffer);
+        if (pack_len < 0) {
+            log_error("tcp client: internal protocol error(pack_len = %d)", pack_len);
+            if (_counters) {
+                ServerCounters::Add(_counters->protocol_errors, 1);
             }
+            return -1;
+        }
+
+        // equal 0 means we need more data
+        if (pack_len == 0) {
             goto done;
-        } while (false);
+        }
 
-        if (package.size() < static_cast<size_t>(pack_len)) {
-            package = _rcv_buffer.GetHeader(pack_len);
-        } else {
-            size_t n = package.size() - pack_len;
-            package.CutTail(n);
+        // streamed, it is not waited for
+        stream = (_stream_threshold > 0 && (size_t)pack_len > _stream_threshold);
+
+        // We got the length of a whole packet
+        if (!stream && cache_size < (size_t)pack_len) {
+            _rcv_hint = pack_len - cache_size;
+            goto done;
+        }
+
+        if (_rate_limit > 0) {
+            if (_rate_tokens >= 1000) {
+                _rate_tokens -= 1000;
+            } else if (_rate_policy == RAPTOR_RATE_LIMIT_PAUSE) {
+                int64_t wait_ms = (1000 - _rate_tokens + _rate_limit - 1) / _rate_limit;
+                _rcv_paused = true;
+                _rcv_resume_ms = _rate_last_ms + wait_ms;
+                goto done;
+            } else if (_rate_policy == RAPTOR_RATE_LIMIT_CLOSE) {
+                log_error("connection: package rate limit exceeded, cid = %llx",
+                    static_cast<unsigned long long>(_cid));
+                return -1;
+            } else if (stream) {
+                _stream_remaining = pack_len;
+                _stream_skip = true;
+                continue;
+            } else {
+                _rcv_buffer.MoveHeader(pack_len);
+                cache_size = _rcv_buffer.GetBufferLength();
+                continue;
+            }
         }
-        _service->OnDataReceived(_cid, &package);
+
+        RAPTOR_TRACE(package, RAPTOR_TRACE_PACKAGE, _cid, pack_len);
+        if (stream) {
+            // the packages before it go first
+            if (count > 0) {
+                if (!DeliverPackages(packages, count)) {
+                    return -1;
+                }
+                count = 0;
+                if (_rcv_paused) {
+                    goto done;
+                }
+            }
+            _rcv_messages++;
+            if (_counters) {
+                ServerCounters::Add(_counters->messages_received, 1);
+            }
+            _stream_remaining = pack_len;
+            _stream_skip = false;
+            _service->OnStreamBegin(_cid, pack_len);
+            package_counter++;
+            continue;
+        }
+        packages[count++] = _rcv_buffer.GetHeader(pack_len);
         _rcv_buffer.MoveHeader(pack_len);
+        if (count == PARSE_BATCH_SIZE) {
+            if (!DeliverPackages(packages, count)) {
+                return -1;
+            }
+            count = 0;
+            if (_rcv_paused) {
+                goto done;
+            }
+        }
 
         cache_size = _rcv_buffer.GetBufferLength();
         package_counter++;
     }
 done:
+    // what is left waits for the rest of a package or a resume
+    AccountRecvBuffer();
+    if (count > 0 && !DeliverPackages(packages, count)) {
+        return -1;
+    }
     return package_counter;
 }
 
+bool Connection::DeliverPackages(Slice* packages, size_t count) {
+    _rcv_messages += count;
+    if (_counters) {
+        ServerCounters::Add(_counters->messages_received, count);
+    }
+    if (!_service->OnPackagesReceived(_cid, packages, count)) {
+        // the receiver has no room for more, see TcpServer::CheckOverload
+        _rcv_paused = true;
+        if (_counters) {
+            ServerCounters::Add(_counters->overload_pauses, 1);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        packages[i] = Slice();
+    }
+    // false if closed by an inline callback
+    return IsOnline();
+}
+
+bool Connection::DeliverChunks() {
+    while (_stream_remaining > 0 && !_rcv_buffer.Empty()) {
+        // a piece per receive slice, none is copied
+        size_t n = RAPTOR_MIN(_rcv_buffer.Front().size(), _stream_remaining);
+        bool paused = false;
+        if (!_stream_skip) {
+            Slice chunk = _rcv_buffer.GetHeader(n);
+            paused = !_service->OnStreamChunk(_cid, &chunk);
+        }
+        _rcv_buffer.MoveHeader(n);
+        _stream_remaining -= n;
+        if (_stream_remaining == 0 && !_stream_skip) {
+            _service->OnStreamEnd(_cid);
+        }
+        if (!IsOnline()) {
+            return false;
+        }
+        if (paused) {
+            _rcv_paused = true;
+            if (_counters) {
+                ServerCounters::Add(_counters->overload_pauses, 1);
+            }
+            break;
+        }
+    }
+    return true;
+}
+
 void Connection::SetUserData(void* ptr) {
     _extend_ptr = ptr;
 }
@@ -19,22 +19,41 @@
 #ifndef __RAPTOR_CORE_LINUX_CONNECTION__
 #define __RAPTOR_CORE_LINUX_CONNECTION__
 
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <list>
+#include <vector>
+
+#include "core/iomgr.h"
+#include "core/package_checker.h"
 #include "core/resolve_address.h"
+#include "core/server_stats.h"
 #include "core/service.h"
 #include "core/slice/slice_buffer.h"
+#include "core/timing_wheel.h"
+#include "util/atomic.h"
 #include "util/sync.h"
+#include "util/useful.h"
 
 namespace raptor {
 
+class ConnectionPool;
 class IProtocol;
+class ITlsProvider;
+class ITlsSession;
 class SendRecvThread;
+class TrafficCapture;
 
 class Connection {
     friend class TcpServer;
+    friend class ConnectionPool;
 public:
     explicit Connection(internal::INotificationTransfer* service);
     ~Connection();
 
+    // rcv == snd: both directions go into one epoll, added once
+    // with EPOLLIN | EPOLLOUT | EPOLLET
     void Init(
             ConnectionId cid,
             int fd,
@@ -42,10 +61,57 @@ public:
             SendRecvThread* rcv, SendRecvThread* snd);
 
     void SetProtocol(IProtocol* p);
-    bool SendWithHeader(
+
+    // Must be called before Init, slices of at least 'threshold'
+    // bytes are sent with MSG_ZEROCOPY. 0 disables it.
+    void EnableZeroCopy(size_t threshold);
+    // Must be called before Init, 0 means unlimited.
+    void SetSendWatermarks(size_t high, size_t low);
+    // Must be called before Init, token bucket of 'per_second'
+    // packages, policy is one of RAPTOR_RATE_LIMIT_*.
+    void SetRateLimit(size_t per_second, int policy);
+    // Must be called before Init, packages longer than 'threshold'
+    // are handed over in pieces as they are read. 0 disables it.
+    void SetStreamThreshold(size_t threshold);
+    // Must be called before Init, the reactor's counter block.
+    void SetCounters(ServerCounters* counters);
+    // Must be called before Init. The connection runs the handshake
+    // of a session of 'tls' and hands the keys to the kernel, it is
+    // reported as arrived only then. Disables zero-copy sends.
+    void SetTlsProvider(ITlsProvider* tls);
+    // Must be called before Init, TCP_QUICKACK is set again after
+    // every read.
+    void SetQuickAck(bool enable);
+    // Must be called before Init, 0 means DEFAULT_RECV_BUDGET.
+    void SetRecvBudget(size_t bytes);
+    // Must be called before Init, the bytes read and written are
+    // recorded into 'capture' until Shutdown.
+    void SetCapture(TrafficCapture* capture);
+    // return RAPTOR_SEND_OK, RAPTOR_SEND_FAILED or RAPTOR_SEND_WOULD_BLOCK
+    int SendWithHeader(
         const void* hdr, size_t hdr_len, const void* data, size_t data_len);
+    // the fragments go out as one message, in a single sendmsg when
+    // nothing is queued. Same results as SendWithHeader. A non-null
+    // token is reported by OnSendCompleted once the message is written.
+    int SendV(const raptor_iovec* iov, size_t count, const uint64_t* token = nullptr);
+    // like SendWithHeader, but a queued remainder references 's'
+    // instead of copying it.
+    int SendSlice(const Slice& s);
+    // Sends are queued without writing or waking the send thread
+    // until Uncork, return false if it was corked already.
+    bool Cork();
+    void Uncork();
+    // queues length bytes of file after everything queued so far,
+    // done runs exactly once unless this returns false.
+    bool SendFile(raptor_file_t file, uint64_t offset, uint64_t length,
+        raptor_send_file_callback done, void* ctx);
     void Shutdown(bool notify = false);
     bool IsOnline();
+    // bytes waiting in the send buffer
+    size_t GetSendQueueBytes();
+    // takes each side's lock in turn, the TCP_INFO fields stay 0
+    // if the socket has none
+    void GetInfo(RaptorConnInfo* info);
     const raptor_resolved_address* GetAddress();
     ConnectionId Id() const { return _cid; }
     void SetUserData(void* ptr);
@@ -54,39 +120,223 @@ public:
     void GetExtendInfo(uint64_t& data) const;
 
 private:
+    enum {
+        // rounded up to fill an 8KB pooled block
+        DEFAULT_RECV_SLICE_SIZE = 8000,
+        // bounds of the adaptive slice size, see _rcv_size
+        MIN_RECV_SLICE_SIZE = 1000,
+        ADAPTIVE_RECV_SLICE_SIZE = 64000,
+        DEFAULT_RECV_BUDGET = 256 * 1024,
+        MAX_RECV_SLICE_SIZE = 4 * 1024 * 1024,
+        MIN_ZEROCOPY_THRESHOLD = 4096,
+        PARSE_BATCH_SIZE = 32,
+        // fragments a SendV hands to one sendmsg
+        MAX_DIRECT_IOV = 64
+    };
+
+    struct FileSend;
 
+    // SendV with _snd_mutex taken, *completed is set if token
+    // was written at once
+    int WriteOrQueue(const raptor_iovec* iov, size_t count,
+        const uint64_t* token, bool* completed);
+    // return 0 once the socket is drained, 1 if the read budget ran
+    // out with data left in the kernel, -1 on failure
     int OnRecv();
-    int OnSend();
+    // re-arm EPOLLOUT for a send queued without a write, and EPOLLIN
+    // after a pause. EPOLLOUT stays registered, a write cut short by a
+    // full socket buffer gets its edge once the buffer drains.
+    void PollSend();
+    void PollRecv(bool enable);
+    // requires _rcv_mutex held. Reads exactly one record at a time so
+    // nothing after the handshake leaves the kernel, return 1 once the
+    // keys are installed, 0 to wait for more or -1 on failure.
+    int OnTlsHandshake();
+    void DestroyTlsSession();
+    // 'writable' is set if the send buffer left the blocked state,
+    // the file ranges fully sent are moved to 'finished'.
+    int OnSend(bool* writable, std::vector<FileSend>* finished, std::vector<uint64_t>* tokens);
+    // requires _snd_mutex held, return false on error
+    bool SendFileRange(FileSend* f);
+    // calls done of each, outside _snd_mutex
+    void FinishFileSends(std::vector<FileSend>* files, bool success);
+    bool HasPendingSend() const {
+        return !_snd_buffer.Empty() || !_snd_files.empty();
+    }
+
+    // requires _snd_mutex held, return the number of bytes
+    // written or -1 if the connection is broken.
+    ssize_t DirectSend(const struct iovec* iov, size_t count);
 
     bool DoRecvEvent();
+    // re-enables reading after a rate limit pause and parses the
+    // packages which were held back, return false on error.
+    bool ResumeRecv();
+    // return the time to resume reading if the rate limit paused it
+    // since the last call, otherwise 0.
+    int64_t TakeResumeTime();
+    // Releases what an idle connection holds beyond its state: the
+    // ring capacity of both buffers and the unused tail of the slice
+    // a partly received package sits in.
+    void Compact();
+    // bytes in the receive and send buffers, see max_buffer_memory
+    size_t BufferedBytes();
     bool DoSendEvent();
+    // return false if the socket has a pending error
+    bool DoErrorQueueEvent();
     void ReleaseBuffer();
+    // back to the freshly constructed state, keeps buffer capacity
+    void Reset();
+
+    // requires _snd_mutex held, return the number of
+    // zero-copy sends completed by the kernel.
+    uint32_t ProcessErrorQueue();
+    bool IsZeroCopySlice(const Slice& s) const;
+    // requires _snd_mutex held
+    bool LeaveBlocked();
 
     // if success return the number of parsed packets
     // otherwise return -1 (protocol error)
     int  ParsingProtocol();
+    // return false if the connection was closed meanwhile
+    bool DeliverPackages(Slice* packages, size_t count);
+    // hands over what _rcv_buffer holds of the streamed package,
+    // return false if the connection was closed meanwhile
+    bool DeliverChunks();
+
+    // requires _rcv_mutex held
+    void RefillTokens();
+    // requires _rcv_mutex held, brings recv_buffered_bytes of
+    // _counters up to date with the length of _rcv_buffer
+    void AccountRecvBuffer();
 
-    // return true if reach recv buffer tail.
-    bool ReadSliceFromRecvBuffer(size_t read_size, Slice& s);
+    // The members are grouped by the thread writing them. The recv
+    // and the send thread of a reactor each own a group kept on its
+    // own cache lines, the padding keeps them apart without relying
+    // on the allocation's alignment.
 
+    // set up by Init, read by both sides
     internal::INotificationTransfer* _service;
     IProtocol* _proto;
-    int _fd;
-    ConnectionId _cid;
-
+    ServerCounters* _counters;
     SendRecvThread* _rcv_thd;
     SendRecvThread* _snd_thd;
+    ConnectionId _cid;
+    // -1 once shut down. Reset under _snd_mutex, so a send holding
+    // it never writes to a number a new connection was given.
+    AtomicInt32 _fd;
+    // one registration for both directions, _rcv_thd == _snd_thd
+    bool _shared_epoll;
+    bool _quickack;
+    size_t _rcv_budget;
+    // non-null while the TLS handshake runs
+    ITlsProvider* _tls_provider;
+    TrafficCapture* _capture;
 
-    SliceBuffer _rcv_buffer;
-    SliceBuffer _snd_buffer;
+    char _rcv_padding[RAPTOR_CACHELINE_SIZE];
 
+    // receive side, requires _rcv_mutex held
     Mutex _rcv_mutex;
+    SliceBuffer _rcv_buffer;
+    PackageChecker _checker;
+    // bytes still missing from the package at the head of _rcv_buffer
+    size_t _rcv_hint;
+    // slice size for the next read when no package length is known,
+    // doubled after a read spilling into the stack buffer and halved
+    // after a read using less than a quarter of the slice
+    size_t _rcv_size;
+    ITlsSession* _tls;
+    // token bucket, tokens are counted in thousandths of a package.
+    int64_t _rate_tokens;
+    int64_t _rate_last_ms;
+    uint32_t _rate_limit;
+    int _rate_policy;
+    // reading is paused and _rcv_buffer may hold whole packages,
+    // _rcv_resume_ms is the time to resume, 0 if the pause is lifted
+    // by the server once its dispatch queues drain.
+    int64_t _rcv_resume_ms;
+    bool _rcv_paused;
+    // bytes still to come of the package being streamed, dropped
+    // instead of handed over when _stream_skip is set
+    size_t _stream_threshold;
+    size_t _stream_remaining;
+    bool _stream_skip;
+    // read by PollSend without the lock
+    Atomic<bool> _rcv_unpolled;
+    // since Init, for GetInfo
+    uint64_t _rcv_bytes;
+    uint64_t _rcv_messages;
+    // the length of _rcv_buffer in recv_buffered_bytes
+    size_t _rcv_accounted;
+
+    char _snd_padding[RAPTOR_CACHELINE_SIZE];
+
+    // send side, requires _snd_mutex held
     Mutex _snd_mutex;
+    SliceBuffer _snd_buffer;
+    // backpressure
+    size_t _snd_high_watermark;
+    size_t _snd_low_watermark;
+    bool _snd_blocked;
+    bool _snd_corked;
+    // since Init, for GetInfo
+    uint64_t _snd_bytes;
+    uint64_t _snd_messages;
 
-    raptor_resolved_address _addr;
+    // zero-copy sends waiting for the error queue completion,
+    // the slices stay referenced until then.
+    struct ZeroCopyRecord {
+        uint32_t seq;
+        Slice slice;
+    };
+    uint32_t _zerocopy_seq;
+    size_t _zerocopy_threshold;
+    // lists, unlike deques, allocate nothing while they are empty
+    std::list<ZeroCopyRecord> _zerocopy_records;
+
+    // SendFile ranges in send order. The head range starts once
+    // 'before' more bytes of _snd_buffer went out, each later one
+    // counts from the end of the one ahead of it.
+    struct FileSend {
+        int fd;
+        uint64_t offset;
+        uint64_t remaining;
+        size_t before;
+        raptor_send_file_callback done;
+        void* ctx;
+    };
+    std::list<FileSend> _snd_files;
+
+    // SendV tokens in send order, each completes once _snd_offset,
+    // the bytes of _snd_buffer written so far, reaches its end
+    struct SendToken {
+        uint64_t end;
+        uint64_t token;
+    };
+    uint64_t _snd_offset;
+    std::list<SendToken> _snd_tokens;
+
+    char _cold_padding[RAPTOR_CACHELINE_SIZE];
+
+    // idle timeout, owned by TcpServer
+    Atomic<time_t> _last_active;
+    TimingWheel::Node _timer;
+    // _last_active as of the last Compact, requires the reactor's
+    // timer mutex held
+    time_t _compact_mark;
+    uint32_t _reactor;
+    // OnConnectionArrived is not reported yet, nor is the close
+    Atomic<bool> _tls_handshaking;
 
     uint64_t _user_data;
     void* _extend_ptr;
+
+    // owner pool and its intrusive free list link
+    ConnectionPool* _pool;
+    Connection* _pool_next;
+    IomgrObject _iomgr;
+
+    raptor_resolved_address _addr;
 };
 
 } // namespace raptor
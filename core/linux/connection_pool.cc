@@ -0,0 +1,89 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "core/linux/connection_pool.h"
+#include "core/linux/connection.h"
+
+namespace raptor {
+
+ConnectionPool::ConnectionPool(
+    internal::INotificationTransfer* service, size_t capacity, size_t prealloc)
+    : _service(service)
+    , _free_list(nullptr)
+    , _capacity(capacity)
+    , _created(0)
+    , _free_count(0) {
+
+    if (prealloc > capacity) {
+        prealloc = capacity;
+    }
+    for (size_t i = 0; i < prealloc; i++) {
+        Connection* con = new Connection(_service);
+        con->_pool = this;
+        con->_pool_next = _free_list;
+        _free_list = con;
+    }
+    _created = prealloc;
+    _free_count = prealloc;
+}
+
+ConnectionPool::~ConnectionPool() {
+    while (_free_list) {
+        Connection* con = _free_list;
+        _free_list = con->_pool_next;
+        delete con;
+    }
+}
+
+Connection* ConnectionPool::Acquire() {
+    AutoMutex g(&_mtx);
+    if (_free_list) {
+        Connection* con = _free_list;
+        _free_list = con->_pool_next;
+        con->_pool_next = nullptr;
+        _free_count--;
+        return con;
+    }
+    if (_created >= _capacity) {
+        return nullptr;
+    }
+    Connection* con = new Connection(_service);
+    con->_pool = this;
+    _created++;
+    return con;
+}
+
+void ConnectionPool::Release(Connection* con) {
+    con->Reset();
+    AutoMutex g(&_mtx);
+    con->_pool_next = _free_list;
+    _free_list = con;
+    _free_count++;
+}
+
+size_t ConnectionPool::Outstanding() {
+    AutoMutex g(&_mtx);
+    return _created - _free_count;
+}
+
+void ConnectionPool::Recycle(void* ptr) {
+    Connection* con = reinterpret_cast<Connection*>(ptr);
+    con->_pool->Release(con);
+}
+
+} // namespace raptor
@@ -0,0 +1,61 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_CORE_LINUX_CONNECTION_POOL__
+#define __RAPTOR_CORE_LINUX_CONNECTION_POOL__
+
+#include <stddef.h>
+#include "core/service.h"
+#include "util/sync.h"
+
+namespace raptor {
+class Connection;
+
+// Recycles Connection objects so that accepting and closing a
+// connection does not go through the allocator once warmed up.
+// Free objects are chained through Connection::_pool_next.
+class ConnectionPool final {
+public:
+    ConnectionPool(internal::INotificationTransfer* service, size_t capacity, size_t prealloc);
+    ~ConnectionPool();
+
+    // return nullptr if 'capacity' objects are in use
+    Connection* Acquire();
+    void Release(Connection* con);
+
+    // number of objects acquired and not yet released
+    size_t Outstanding();
+
+    // Epoch::Retire deleter, returns the object to its pool
+    static void Recycle(void* ptr);
+
+private:
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    internal::INotificationTransfer* _service;
+    Mutex _mtx;
+    Connection* _free_list;
+    size_t _capacity;
+    size_t _created;
+    size_t _free_count;
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_CORE_LINUX_CONNECTION_POOL__
@@ -17,15 +17,14 @@
  */
 
 #include "core/linux/epoll.h"
-#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 
 namespace raptor {
 
 Epoll::Epoll()
-    : _epoll_fd(-1) {
-    memset(_events, 0, sizeof(_events));
+    : _epoll_fd(-1)
+    , _max_events(0) {
 }
 
 Epoll::~Epoll() {
@@ -34,17 +33,18 @@ Epoll::~Epoll() {
     }
 }
 
-RefCountedPtr<Status> Epoll::create() {
+RefCountedPtr<Status> Epoll::create(size_t max_events) {
     if (_epoll_fd > 0) {
         return RAPTOR_ERROR_NONE;
     }
 
-    _epoll_fd = epoll_create(MAX_EPOLL_EVENTS);
+    _max_events = max_events > 0 ? static_cast<int>(max_events) : DEFAULT_EPOLL_EVENTS;
+    _events.reset(new epoll_event[_max_events]);
+    memset(_events.get(), 0, sizeof(epoll_event) * _max_events);
+
+    _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
     if (_epoll_fd < 0) {
-        return RAPTOR_POSIX_ERROR("epoll_create");
-    }
-    if (fcntl(_epoll_fd, F_SETFD, FD_CLOEXEC) != 0) {
-        return RAPTOR_POSIX_ERROR("fcntl");
+        return RAPTOR_POSIX_ERROR("epoll_create1");
     }
     return RAPTOR_ERROR_NONE;
 }
@@ -75,7 +75,7 @@ int Epoll::remove(int fd, uint32_t events) {
 }
 
 int Epoll::polling(int timeout) {
-    return epoll_wait(_epoll_fd, _events, MAX_EPOLL_EVENTS, timeout);
+    return epoll_wait(_epoll_fd, _events.get(), _max_events, timeout);
 }
 
 struct epoll_event* Epoll::get_event(size_t index) {
@@ -21,6 +21,7 @@
 
 #include <sys/epoll.h>
 #include <stddef.h>
+#include <memory>
 #include "util/status.h"
 
 namespace raptor {
@@ -29,21 +30,24 @@ public:
     Epoll();
     ~Epoll();
 
-    RefCountedPtr<Status> create();
+    // max_events: the events one polling returns at most,
+    // 0 means DEFAULT_EPOLL_EVENTS
+    RefCountedPtr<Status> create(size_t max_events = 0);
     int add(int fd, void* data, uint32_t events);
     int modify(int fd, void* data, uint32_t events);
     int remove(int fd, uint32_t events);
 
-    // epoll_wait
+    // epoll_wait, a negative timeout waits forever
     int polling(int timeout = 1000);
     struct epoll_event* get_event(size_t index);
 
-private:
-    enum { MAX_EPOLL_EVENTS = 100 };
+    enum { DEFAULT_EPOLL_EVENTS = 100 };
 
+private:
     int ctl(int fd, epoll_event* ev, int op);
     int _epoll_fd;
-    struct epoll_event _events[MAX_EPOLL_EVENTS];
+    int _max_events;
+    std::unique_ptr<struct epoll_event[]> _events;
 };
 }  // namespace raptor
 #endif  // __RAPTOR_CORE_EPOLL__
@@ -17,25 +17,41 @@
  */
 
 #include "core/linux/epoll_thread.h"
+#include <errno.h>
 #include "util/time.h"
+#include "util/trace.h"
 
 namespace raptor {
+namespace {
+thread_local SendRecvThread* t_current = nullptr;
+}  // namespace
+
 SendRecvThread::SendRecvThread(internal::IEpollReceiver* rcv)
-    : _receiver(rcv), _shutdown(true) {
+    : _receiver(rcv), _shutdown(true), _busy_poll_ns(0) {
 }
 
 SendRecvThread::~SendRecvThread() {}
 
-RefCountedPtr<Status> SendRecvThread::Init() {
+RefCountedPtr<Status> SendRecvThread::Init(
+    const Thread::Options& options, size_t max_events, size_t busy_poll_us) {
     if (!_shutdown) {
         return RAPTOR_ERROR_NONE;
     }
 
     _shutdown = false;
-    auto e = _epoll.create();
+    _busy_poll_ns = static_cast<int64_t>(busy_poll_us) * 1000;
+    auto e = _epoll.create(max_events);
+    if (e == RAPTOR_ERROR_NONE) {
+        e = _wakeup.Init();
+    }
+    if (e == RAPTOR_ERROR_NONE
+        && _epoll.add(_wakeup.Fd(), WakeupFd::Tag(), EPOLLIN) != 0 && errno != EEXIST) {
+        e = RAPTOR_POSIX_ERROR("epoll_ctl");
+    }
     if (e == RAPTOR_ERROR_NONE) {
         _thd = Thread("send/recv",
-            std::bind(&SendRecvThread::DoWork, this, std::placeholders::_1), nullptr);
+            std::bind(&SendRecvThread::DoWork, this, std::placeholders::_1),
+            nullptr, nullptr, options);
     }
     return e;
 }
@@ -51,33 +67,52 @@ bool SendRecvThread::Start() {
 void SendRecvThread::Shutdown() {
     if (!_shutdown) {
         _shutdown = true;
+        _wakeup.Wakeup();
         _thd.Join();
     }
 }
 
+SendRecvThread* SendRecvThread::Current() {
+    return t_current;
+}
+
 void SendRecvThread::DoWork(void* ptr) {
+    t_current = this;
     while (!_shutdown) {
-        
+
         time_t current_time = Now();
         _receiver->OnCheckingEvent(current_time);
 
-        int number_of_fd = _epoll.polling();
+        int number_of_fd = Poll(_receiver->CheckingInterval());
         if (_shutdown) {
             return;
         }
+        // the events below and the next check read the cached clock
+        UpdateCoarseClock();
         if (number_of_fd <= 0) {
             continue;
         }
+        _wakeups.Store(_wakeups.Load(MemoryOrder::RELAXED) + 1, MemoryOrder::RELAXED);
+        _events.Store(_events.Load(MemoryOrder::RELAXED) + number_of_fd, MemoryOrder::RELAXED);
+        RAPTOR_TRACE(epoll_wakeup, RAPTOR_TRACE_EPOLL_WAKEUP, number_of_fd, 0);
 
         for (int i = 0; i < number_of_fd; i++) {
             struct epoll_event* ev = _epoll.get_event(i);
+            if (ev->data.ptr == WakeupFd::Tag()) {
+                _wakeup.Consume();
+                continue;
+            }
 
-            if (ev->events & EPOLLERR
-                || ev->events & EPOLLHUP
-                || ev->events & EPOLLRDHUP) {
+            if (ev->events & EPOLLHUP || ev->events & EPOLLRDHUP) {
                 _receiver->OnErrorEvent(ev->data.ptr);
                 continue;
             }
+            if (ev->events & EPOLLERR) {
+                if (!_receiver->OnErrorQueueEvent(ev->data.ptr)) {
+                    _receiver->OnErrorEvent(ev->data.ptr);
+                    continue;
+                }
+            }
             if (ev->events & EPOLLIN) {
                 _receiver->OnRecvEvent(ev->data.ptr);
             }
@@ -88,6 +123,22 @@ void SendRecvThread::DoWork(void* ptr) {
     }
 }
 
+int SendRecvThread::Poll(int timeout) {
+    if (_busy_poll_ns <= 0) {
+        return _epoll.polling(timeout);
+    }
+    // spin on non-blocking waits first, an event arriving within the
+    // window is handled without the sleep and wakeup of the thread
+    int64_t deadline = GetMonotonicNanoseconds() + _busy_poll_ns;
+    do {
+        int n = _epoll.polling(0);
+        if (n != 0 || _shutdown) {
+            return n;
+        }
+    } while (GetMonotonicNanoseconds() < deadline);
+    return _epoll.polling(timeout);
+}
+
 int SendRecvThread::Add(int fd, void* data, uint32_t events) {
     return _epoll.add(fd, data, events | EPOLLRDHUP);
 }
@@ -96,6 +147,11 @@ int SendRecvThread::Modify(int fd, void* data, uint32_t events) {
     return _epoll.modify(fd, data, events | EPOLLRDHUP);
 }
 
+int SendRecvThread::AddListener(int fd, void* data, bool exclusive) {
+    // EPOLLEXCLUSIVE takes no EPOLLRDHUP
+    return _epoll.add(fd, data, exclusive ? (EPOLLIN | EPOLLEXCLUSIVE) : EPOLLIN);
+}
+
 int SendRecvThread::Delete(int fd, uint32_t events) {
     return _epoll.remove(fd, events | EPOLLRDHUP);
 }
@@ -21,7 +21,9 @@
 
 #include <stdint.h>
 #include "core/linux/epoll.h"
+#include "core/linux/wakeup_fd.h"
 #include "core/service.h"
+#include "util/atomic.h"
 #include "util/status.h"
 #include "util/thread.h"
 
@@ -31,19 +33,40 @@ public:
     explicit SendRecvThread(internal::IEpollReceiver* rcv);
     ~SendRecvThread();
 
-    RefCountedPtr<Status> Init();
+    // max_events: see Epoll::create. busy_poll_us: how long the thread
+    // keeps polling without blocking after the last events, 0 disables.
+    RefCountedPtr<Status> Init(const Thread::Options& options = Thread::Options(),
+        size_t max_events = 0, size_t busy_poll_us = 0);
     bool Start();
     void Shutdown();
 
     int Add(int fd, void* data, uint32_t events);
     int Modify(int fd, void* data, uint32_t events);
     int Delete(int fd, uint32_t events);
+    // a listening socket, level triggered. exclusive: EPOLLEXCLUSIVE,
+    // only one of the epolls polling the socket wakes per event.
+    int AddListener(int fd, void* data, bool exclusive);
+    // makes a wait of the thread return at once, see
+    // IEpollReceiver::CheckingInterval
+    void Wakeup() { _wakeup.Wakeup(); }
+    // the thread running the caller, nullptr outside of the threads
+    static SendRecvThread* Current();
+
+    // wakeups that returned events, and the events they returned
+    uint64_t Wakeups() const { return _wakeups.Load(MemoryOrder::RELAXED); }
+    uint64_t Events() const { return _events.Load(MemoryOrder::RELAXED); }
 
 private:
     void DoWork(void* ptr);
+    int Poll(int timeout);
     internal::IEpollReceiver* _receiver;
     bool _shutdown;
+    int64_t _busy_poll_ns;
+    // written by the thread itself only
+    AtomicUInt64 _wakeups;
+    AtomicUInt64 _events;
     Epoll _epoll;
+    WakeupFd _wakeup;
     Thread _thd;
 };
 
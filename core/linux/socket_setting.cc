@@ -20,10 +20,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include <linux/filter.h>
+#ifdef RAPTOR_HAVE_KTLS
+#include <linux/tls.h>
+#endif
+#include <vector>
 #include "util/alloc.h"
 #include "util/log.h"
 #include "util/sync.h"
@@ -213,6 +220,334 @@ raptor_error raptor_set_socket_no_sigpipe_if_possible(int fd) {
     return RAPTOR_ERROR_NONE;
 }
 
+raptor_error raptor_set_socket_quickack(int fd) {
+    int val = 1;
+    if (0 != setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &val, sizeof(val))) {
+        return RAPTOR_POSIX_ERROR("setsockopt(TCP_QUICKACK)");
+    }
+    return RAPTOR_ERROR_NONE;
+}
+
+raptor_error raptor_set_socket_busy_poll(int fd, int usec) {
+#ifdef SO_BUSY_POLL
+    if (0 != setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec))) {
+        return RAPTOR_POSIX_ERROR("setsockopt(SO_BUSY_POLL)");
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    int val = 1;
+    if (0 != setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof(val))) {
+        return RAPTOR_POSIX_ERROR("setsockopt(SO_PREFER_BUSY_POLL)");
+    }
+#endif
+    return RAPTOR_ERROR_NONE;
+#else
+    (void)fd;
+    (void)usec;
+    return RAPTOR_ERROR_FROM_STATIC_STRING("SO_BUSY_POLL is not supported");
+#endif
+}
+
+raptor_error raptor_get_socket_tcp_info(int fd, raptor_conn_info_t* info) {
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    memset(&ti, 0, sizeof(ti));
+    if (0 != getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len)) {
+        return RAPTOR_POSIX_ERROR("getsockopt(TCP_INFO)");
+    }
+    info->rtt_us = ti.tcpi_rtt;
+    info->rtt_var_us = ti.tcpi_rttvar;
+    info->snd_cwnd = ti.tcpi_snd_cwnd;
+    info->snd_mss = ti.tcpi_snd_mss;
+    info->retransmits = ti.tcpi_total_retrans;
+    info->unacked = ti.tcpi_unacked;
+    return RAPTOR_ERROR_NONE;
+}
+
+int raptor_get_socket_incoming_cpu(int fd) {
+#ifdef SO_INCOMING_CPU
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (0 == getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len)) {
+        return cpu;
+    }
+#endif
+    return -1;
+}
+
+raptor_error raptor_set_socket_reuseport_cpu_steering(
+    int fd, const int* cpu_shard, size_t cpus, size_t shards) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    // A = cpu, then one compare and return per cpu of the table
+    std::vector<struct sock_filter> code;
+    code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+        static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+    for (size_t cpu = 0; cpu < cpus && code.size() + 4 < BPF_MAXINSNS; cpu++) {
+        if (cpu_shard[cpu] < 0) {
+            continue;
+        }
+        code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(cpu), 0, 1));
+        code.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<uint32_t>(cpu_shard[cpu])));
+    }
+    code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(shards)));
+    code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+
+    struct sock_fprog prog;
+    prog.len = static_cast<unsigned short>(code.size());
+    prog.filter = code.data();
+    if (0 != setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog))) {
+        return RAPTOR_POSIX_ERROR("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+    }
+    return RAPTOR_ERROR_NONE;
+#else
+    return RAPTOR_ERROR_FROM_STATIC_STRING("SO_ATTACH_REUSEPORT_CBPF is not supported");
+#endif
+}
+
+static raptor_error raptor_set_socket_int(
+    int fd, int level, int name, int val, const char* what) {
+    if (0 != setsockopt(fd, level, name, &val, sizeof(val))) {
+        return RAPTOR_POSIX_ERROR(what);
+    }
+    return RAPTOR_ERROR_NONE;
+}
+
+raptor_error raptor_set_socket_keepalive(
+    int fd, int idle_seconds, int interval_seconds, int count) {
+    raptor_error e = raptor_set_socket_int(
+        fd, SOL_SOCKET, SO_KEEPALIVE, idle_seconds > 0, "setsockopt(SO_KEEPALIVE)");
+    if (e != RAPTOR_ERROR_NONE || idle_seconds <= 0) {
+        return e;
+    }
+    e = raptor_set_socket_int(
+        fd, IPPROTO_TCP, TCP_KEEPIDLE, idle_seconds, "setsockopt(TCP_KEEPIDLE)");
+    if (e == RAPTOR_ERROR_NONE && interval_seconds > 0) {
+        e = raptor_set_socket_int(
+            fd, IPPROTO_TCP, TCP_KEEPINTVL, interval_seconds, "setsockopt(TCP_KEEPINTVL)");
+    }
+    if (e == RAPTOR_ERROR_NONE && count > 0) {
+        e = raptor_set_socket_int(
+            fd, IPPROTO_TCP, TCP_KEEPCNT, count, "setsockopt(TCP_KEEPCNT)");
+    }
+    return e;
+}
+
+raptor_error raptor_set_socket_buffer_sizes(int fd, int snd_size, int rcv_size) {
+    raptor_error e = RAPTOR_ERROR_NONE;
+    if (snd_size > 0) {
+        e = raptor_set_socket_int(
+            fd, SOL_SOCKET, SO_SNDBUF, snd_size, "setsockopt(SO_SNDBUF)");
+    }
+    if (e == RAPTOR_ERROR_NONE && rcv_size > 0) {
+        e = raptor_set_socket_int(
+            fd, SOL_SOCKET, SO_RCVBUF, rcv_size, "setsockopt(SO_RCVBUF)");
+    }
+    return e;
+}
+
+raptor_error raptor_apply_socket_profile(
+    int fd, const raptor_resolved_address* peer, const raptor_socket_profile_t* profile) {
+    raptor_error e = raptor_set_socket_buffer_sizes(fd,
+        static_cast<int>(profile->send_buffer_size),
+        static_cast<int>(profile->recv_buffer_size));
+    if (e != RAPTOR_ERROR_NONE || raptor_is_unix_socket(peer)) {
+        return e;
+    }
+    e = raptor_set_socket_low_latency(fd, profile->nagle == 0);
+    if (e == RAPTOR_ERROR_NONE && profile->quickack) {
+        e = raptor_set_socket_quickack(fd);
+    }
+    if (e == RAPTOR_ERROR_NONE && profile->user_timeout_ms > 0) {
+        e = raptor_set_socket_tcp_user_timeout(fd, static_cast<int>(profile->user_timeout_ms));
+    }
+    if (e == RAPTOR_ERROR_NONE && profile->keepalive_idle_seconds > 0) {
+        e = raptor_set_socket_keepalive(fd,
+            static_cast<int>(profile->keepalive_idle_seconds),
+            static_cast<int>(profile->keepalive_interval_seconds),
+            static_cast<int>(profile->keepalive_count));
+    }
+    if (e == RAPTOR_ERROR_NONE && profile->busy_poll_us > 0) {
+        // an optimization only, the connection is kept without it
+        raptor_set_socket_busy_poll(fd, static_cast<int>(profile->busy_poll_us));
+    }
+    return e;
+}
+
+// fds per SCM_RIGHTS message, the kernel takes up to 253
+#define RAPTOR_FDS_PER_MESSAGE 64
+
+raptor_error raptor_send_fds(int sock, const int* fds, size_t count) {
+    size_t sent = 0;
+    do {
+        size_t n = count - sent;
+        if (n > RAPTOR_FDS_PER_MESSAGE) n = RAPTOR_FDS_PER_MESSAGE;
+        // the byte tells the receiver whether more messages follow
+        char more = (sent + n < count) ? 1 : 0;
+        struct iovec iov;
+        iov.iov_base = &more;
+        iov.iov_len = 1;
+        char control[CMSG_SPACE(sizeof(int) * RAPTOR_FDS_PER_MESSAGE)];
+        memset(control, 0, sizeof(control));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (n > 0) {
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+            memcpy(CMSG_DATA(cmsg), fds + sent, sizeof(int) * n);
+        }
+        ssize_t r;
+        do {
+            r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (r < 0 && errno == EINTR);
+        if (r < 0) {
+            return RAPTOR_POSIX_ERROR("sendmsg(SCM_RIGHTS)");
+        }
+        sent += n;
+    } while (sent < count);
+    return RAPTOR_ERROR_NONE;
+}
+
+raptor_error raptor_recv_fds(int sock, int* fds, size_t max, size_t* count) {
+    *count = 0;
+    char more = 1;
+    while (more) {
+        struct iovec iov;
+        iov.iov_base = &more;
+        iov.iov_len = 1;
+        char control[CMSG_SPACE(sizeof(int) * RAPTOR_FDS_PER_MESSAGE)];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t r;
+        do {
+            r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        } while (r < 0 && errno == EINTR);
+        if (r < 0) {
+            return RAPTOR_POSIX_ERROR("recvmsg(SCM_RIGHTS)");
+        }
+        if (r == 0) {
+            return RAPTOR_ERROR_FROM_STATIC_STRING("peer closed before the last fd");
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const unsigned char* data = CMSG_DATA(cmsg);
+            for (size_t i = 0; i < n; i++) {
+                int fd;
+                memcpy(&fd, data + i * sizeof(int), sizeof(int));
+                if (*count < max) {
+                    fds[(*count)++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+    return RAPTOR_ERROR_NONE;
+}
+
+/* set SO_ZEROCOPY, required by send(MSG_ZEROCOPY) */
+raptor_error raptor_set_socket_zerocopy(int fd, int enable) {
+#ifdef SO_ZEROCOPY
+    int val = (enable != 0) ? 1 : 0;
+    if (0 != setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val))) {
+        return RAPTOR_POSIX_ERROR("setsockopt(SO_ZEROCOPY)");
+    }
+    return RAPTOR_ERROR_NONE;
+#else
+    (void)fd;
+    (void)enable;
+    return RAPTOR_ERROR_FROM_STATIC_STRING("SO_ZEROCOPY is not supported");
+#endif
+}
+
+#ifdef RAPTOR_HAVE_KTLS
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+// one direction of raptor_set_socket_ktls
+static raptor_error raptor_set_socket_ktls_crypto(int fd, int dir, const raptor_tls_crypto_t* c) {
+    union {
+        struct tls12_crypto_info_aes_gcm_128 gcm128;
+        struct tls12_crypto_info_aes_gcm_256 gcm256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+    } info;
+    memset(&info, 0, sizeof(info));
+    socklen_t len = 0;
+
+    switch (c->cipher) {
+    case RAPTOR_TLS_CIPHER_AES_GCM_128:
+        info.gcm128.info.version = c->version;
+        info.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(info.gcm128.key, c->key, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+        memcpy(info.gcm128.iv, c->iv, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+        memcpy(info.gcm128.salt, c->salt, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+        memcpy(info.gcm128.rec_seq, c->rec_seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+        len = sizeof(info.gcm128);
+        break;
+    case RAPTOR_TLS_CIPHER_AES_GCM_256:
+        info.gcm256.info.version = c->version;
+        info.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(info.gcm256.key, c->key, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+        memcpy(info.gcm256.iv, c->iv, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+        memcpy(info.gcm256.salt, c->salt, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+        memcpy(info.gcm256.rec_seq, c->rec_seq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+        len = sizeof(info.gcm256);
+        break;
+    case RAPTOR_TLS_CIPHER_CHACHA20_POLY1305:
+        info.chacha.info.version = c->version;
+        info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        memcpy(info.chacha.key, c->key, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+        memcpy(info.chacha.iv, c->iv, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+        memcpy(info.chacha.rec_seq, c->rec_seq, TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+        len = sizeof(info.chacha);
+        break;
+    default:
+        return RAPTOR_ERROR_FROM_FORMAT("unsupported tls cipher %d", c->cipher);
+    }
+
+    int r = setsockopt(fd, SOL_TLS, dir, &info, len);
+    memset(&info, 0, sizeof(info));
+    if (r != 0) {
+        return RAPTOR_POSIX_ERROR(dir == TLS_TX ? "setsockopt(TLS_TX)" : "setsockopt(TLS_RX)");
+    }
+    return RAPTOR_ERROR_NONE;
+}
+#endif
+
+raptor_error raptor_set_socket_ktls(
+    int fd, const raptor_tls_crypto_t* tx, const raptor_tls_crypto_t* rx) {
+#ifdef RAPTOR_HAVE_KTLS
+    if (0 != setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"))) {
+        return RAPTOR_POSIX_ERROR("setsockopt(TCP_ULP)");
+    }
+    raptor_error e = raptor_set_socket_ktls_crypto(fd, TLS_TX, tx);
+    if (e == RAPTOR_ERROR_NONE) {
+        e = raptor_set_socket_ktls_crypto(fd, TLS_RX, rx);
+    }
+    return e;
+#else
+    (void)fd;
+    (void)tx;
+    (void)rx;
+    return RAPTOR_ERROR_FROM_STATIC_STRING("kernel TLS is not supported");
+#endif
+}
+
 raptor_error raptor_create_dualstack_socket(
     const raptor_resolved_address* resolved_addr,
     int type, int protocol, raptor_dualstack_mode* dsmode, int* newfd) {
@@ -288,10 +623,11 @@ static int get_max_accept_queue_size(void) {
 /* Prepare a recently-created socket for listening. */
 raptor_error raptor_tcp_server_prepare_socket(
     int fd, const raptor_resolved_address* addr,
-    int* port, int so_reuseport) {
+    int* port, int so_reuseport, const raptor_socket_profile_t* profile) {
 
     raptor_resolved_address sockname_temp;
     raptor_error err = RAPTOR_ERROR_NONE;
+    int backlog = 0;
 
     RAPTOR_ASSERT(fd >= 0);
 
@@ -309,8 +645,20 @@ raptor_error raptor_tcp_server_prepare_socket(
         if (err != RAPTOR_ERROR_NONE) goto error;
         err = raptor_set_socket_reuse_addr(fd, 1);
         if (err != RAPTOR_ERROR_NONE) goto error;
-        err = raptor_set_socket_tcp_user_timeout(fd, DEFAULT_SERVER_TCP_USER_TIMEOUT_MS);
+        err = raptor_set_socket_tcp_user_timeout(fd,
+            (profile && profile->user_timeout_ms > 0)
+            ? static_cast<int>(profile->user_timeout_ms) : DEFAULT_SERVER_TCP_USER_TIMEOUT_MS);
         if (err != RAPTOR_ERROR_NONE) goto error;
+        if (profile && profile->defer_accept_seconds > 0) {
+            err = raptor_set_socket_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                static_cast<int>(profile->defer_accept_seconds), "setsockopt(TCP_DEFER_ACCEPT)");
+            if (err != RAPTOR_ERROR_NONE) goto error;
+        }
+        if (profile && profile->fastopen_queue > 0) {
+            err = raptor_set_socket_int(fd, IPPROTO_TCP, TCP_FASTOPEN,
+                static_cast<int>(profile->fastopen_queue), "setsockopt(TCP_FASTOPEN)");
+            if (err != RAPTOR_ERROR_NONE) goto error;
+        }
     }
     // setsockopt SO_NOSIGPIPE
     err = raptor_set_socket_no_sigpipe_if_possible(fd);
@@ -322,7 +670,12 @@ raptor_error raptor_tcp_server_prepare_socket(
         goto error;
     }
 
-    if (listen(fd, get_max_accept_queue_size()) < 0) {
+    backlog = get_max_accept_queue_size();
+    if (profile && profile->listen_backlog > 0) {
+        backlog = profile->listen_backlog < INT_MAX
+            ? static_cast<int>(profile->listen_backlog) : INT_MAX;
+    }
+    if (listen(fd, backlog) < 0) {
         err = RAPTOR_POSIX_ERROR("listen");
         goto error;
     }
@@ -380,6 +733,41 @@ done:
     return err;
 }
 
+// the path of a unix socket bound to the file system, otherwise nullptr
+static const char* raptor_unix_socket_path(const raptor_resolved_address* addr) {
+    if (!raptor_is_unix_socket(addr)) {
+        return nullptr;
+    }
+    const struct sockaddr_un* un = reinterpret_cast<const struct sockaddr_un*>(addr->addr);
+    if (addr->len <= offsetof(struct sockaddr_un, sun_path) || un->sun_path[0] == '\0') {
+        return nullptr;
+    }
+    return un->sun_path;
+}
+
+void raptor_remove_stale_unix_socket(const raptor_resolved_address* addr) {
+    const char* path = raptor_unix_socket_path(addr);
+    if (!path) {
+        return;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return;
+    }
+    int r = connect(fd, reinterpret_cast<const raptor_sockaddr*>(addr->addr), addr->len);
+    if (r < 0 && errno == ECONNREFUSED) {
+        unlink(path);
+    }
+    close(fd);
+}
+
+void raptor_remove_unix_socket(const raptor_resolved_address* addr) {
+    const char* path = raptor_unix_socket_path(addr);
+    if (path) {
+        unlink(path);
+    }
+}
+
 raptor_error raptor_tcp_client_prepare_socket(
                         const raptor_resolved_address* addr,
                         raptor_resolved_address* mapped_addr,
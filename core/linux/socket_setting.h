@@ -21,6 +21,7 @@
 
 #include "core/resolve_address.h"
 #include "core/sockaddr.h"
+#include "raptor/types.h"
 #include "util/status.h"
 
 /* set a socket to non blocking mode */
@@ -56,6 +57,54 @@ raptor_error raptor_set_socket_tcp_user_timeout(int fd, int timeout);
 // Tries to set SO_NOSIGPIPE if available on this platform
 raptor_error raptor_set_socket_no_sigpipe_if_possible(int fd);
 
+/* ask for immediate acks, the kernel clears it again by itself */
+raptor_error raptor_set_socket_quickack(int fd);
+
+/* SO_BUSY_POLL and SO_PREFER_BUSY_POLL */
+raptor_error raptor_set_socket_busy_poll(int fd, int usec);
+
+/* the TCP_INFO fields of raptor_conn_info_t, left alone on failure
+   (not a TCP socket) */
+raptor_error raptor_get_socket_tcp_info(int fd, raptor_conn_info_t* info);
+
+/* the cpu that processed the last packet of fd (SO_INCOMING_CPU),
+   -1 if unknown */
+int raptor_get_socket_incoming_cpu(int fd);
+
+/* Attaches a classic BPF program to the SO_REUSEPORT group of fd that
+   picks the socket cpu_shard[cpu] for a connection whose SYN arrives
+   on a cpu below 'cpus', or cpu % shards where the table has no shard
+   (-1). The shards are the sockets of the group in bind order. */
+raptor_error raptor_set_socket_reuseport_cpu_steering(
+    int fd, const int* cpu_shard, size_t cpus, size_t shards);
+
+/* SO_KEEPALIVE, idle_seconds 0 turns it off. interval_seconds and
+   count 0 keep the system defaults */
+raptor_error raptor_set_socket_keepalive(
+    int fd, int idle_seconds, int interval_seconds, int count);
+
+/* SO_SNDBUF and SO_RCVBUF, 0 keeps the size */
+raptor_error raptor_set_socket_buffer_sizes(int fd, int snd_size, int rcv_size);
+
+/* the per connection options of 'profile', for a socket accepted
+   from 'peer'. Unix sockets only take the buffer sizes. */
+raptor_error raptor_apply_socket_profile(
+    int fd, const raptor_resolved_address* peer, const raptor_socket_profile_t* profile);
+
+/* pass fds over the connected unix socket sock (SCM_RIGHTS) */
+raptor_error raptor_send_fds(int sock, const int* fds, size_t count);
+
+/* receive what raptor_send_fds sent, fds beyond max are closed */
+raptor_error raptor_recv_fds(int sock, int* fds, size_t max, size_t* count);
+
+/* set SO_ZEROCOPY, required by send(MSG_ZEROCOPY) */
+raptor_error raptor_set_socket_zerocopy(int fd, int enable);
+
+/* attach the kernel TLS layer and install the record state of both
+   directions, after the handshake and before any encrypted record */
+raptor_error raptor_set_socket_ktls(
+    int fd, const raptor_tls_crypto_t* tx, const raptor_tls_crypto_t* rx);
+
 typedef enum raptor_dualstack_mode {
     /* Uninitialized, or a non-IP socket. */
     RAPTOR_DSMODE_NONE,
@@ -74,7 +123,15 @@ raptor_error raptor_create_dualstack_socket(
 raptor_error raptor_tcp_server_prepare_socket(
                         int fd,
                         const raptor_resolved_address* addr,
-                        int* port, int so_reuseport);
+                        int* port, int so_reuseport,
+                        const raptor_socket_profile_t* profile = nullptr);
+
+/* For a unix socket path: removes the file left behind by a server
+   that is gone, i.e. connecting to it is refused. */
+void raptor_remove_stale_unix_socket(const raptor_resolved_address* addr);
+
+/* For a unix socket path: removes the file, once its listener closed. */
+void raptor_remove_unix_socket(const raptor_resolved_address* addr);
 
 raptor_error raptor_tcp_client_prepare_socket(
                         const raptor_resolved_address* addr,
@@ -16,33 +16,57 @@
  *
  */
 #include "core/linux/tcp_client.h"
-#include <sys/select.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include "core/socket_util.h"
 #include "util/log.h"
+#include "util/time.h"
+#include "util/useful.h"
 #include "core/linux/socket_setting.h"
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 namespace raptor {
 TcpClient::TcpClient(IClientReceiver* service)
     : _service(service)
     , _proto(nullptr)
     , _shutdown(true)
-    , _fd(-1) {
+    , _fd(-1)
+    , _wakeup_fd(-1)
+    , _timers(UpdateCoarseClock())
+    , _timers_closed(true)
+    , _next_timer_id(0) {
 }
 
-TcpClient::~TcpClient() {}
+TcpClient::~TcpClient() {
+    Shutdown();
+}
 
 raptor_error TcpClient::Init() {
     if (!_shutdown) {
         return RAPTOR_ERROR_FROM_STATIC_STRING("tcp client already running");
     }
 
+    _wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_wakeup_fd < 0) {
+        return RAPTOR_POSIX_ERROR("eventfd");
+    }
+
     _shutdown = false;
-    _is_connected = false;
+    _is_connected.Store(false);
+    _connecting.Store(false);
+    _resolve_guard = std::make_shared<ResolveGuard<TcpClient>>(this);
+    _t_mtx.Lock();
+    _timers_closed = false;
+    _t_mtx.Unlock();
 
     _thd = Thread("client",
         std::bind(&TcpClient::WorkThread, this, std::placeholders::_1), nullptr);
-
-    _thd.Start();
     return RAPTOR_ERROR_NONE;
 }
 
@@ -51,15 +75,55 @@ raptor_error TcpClient::Connect(const char* addr, size_t timeout_ms) {
         return RAPTOR_ERROR_FROM_STATIC_STRING("TcpClient is not initialized");
     }
 
-    raptor_resolved_addresses* addrs;
-    auto e = raptor_blocking_resolve_address(addr, nullptr, &addrs);
-    if (e != RAPTOR_ERROR_NONE) {
+    if (_connecting.Exchange(true, MemoryOrder::ACQ_REL)) {
+        return RAPTOR_ERROR_FROM_STATIC_STRING("TcpClient is already connecting");
+    }
+
+    // Numeric and cached addresses connect right away and report
+    // errors here. A name lookup completes on a resolver thread and
+    // a failure is reported by OnConnectResult(false).
+    int timeout = static_cast<int>(timeout_ms);
+    raptor_resolved_addresses* addrs = nullptr;
+    raptor_error e = RAPTOR_ERROR_NONE;
+    AsyncResolver* resolver = AsyncResolver::Instance();
+    if (resolver->ResolveNow(addr, nullptr, &addrs, &e)) {
+        e = OnResolved(e, addrs, timeout);
+        if (e != RAPTOR_ERROR_NONE) {
+            _connecting.Store(false, MemoryOrder::RELEASE);
+        }
         return e;
     }
-    RAPTOR_ASSERT(addrs->naddrs > 0);
-    e = AsyncConnect(&addrs->addrs[0], static_cast<int>(timeout_ms), &_fd);
+
+    std::shared_ptr<ResolveGuard<TcpClient>> guard = _resolve_guard;
+    resolver->Resolve(addr, nullptr,
+        [guard, timeout](raptor_error error, raptor_resolved_addresses* addrs) {
+            bool alive = guard->Run([&](TcpClient* client) {
+                if (client->OnResolved(error, addrs, timeout) != RAPTOR_ERROR_NONE) {
+                    // the work thread finds no socket and reports the failure
+                    client->_thd.Start();
+                }
+            });
+            if (!alive) {
+                raptor_resolved_addresses_destroy(addrs);
+            }
+        });
+    return RAPTOR_ERROR_NONE;
+}
+
+raptor_error TcpClient::OnResolved(raptor_error error,
+    raptor_resolved_addresses* addrs, int timeout_ms) {
+    if (error != RAPTOR_ERROR_NONE) {
+        return error;
+    }
+    error = AsyncConnect(&addrs->addrs[0], timeout_ms, &_fd);
     raptor_resolved_addresses_destroy(addrs);
-    return e;
+
+    // the work thread polls _fd, so it only starts once the
+    // socket exists
+    if (error == RAPTOR_ERROR_NONE) {
+        _thd.Start();
+    }
+    return error;
 }
 
 bool TcpClient::Send(const void* buff, size_t len) {
@@ -68,26 +132,152 @@ bool TcpClient::Send(const void* buff, size_t len) {
     }
 
     AutoMutex g(&_s_mtx);
-    _snd_buffer.AddSlice(Slice(buff, len));
+    QueueSlice(Slice(buff, len));
+    return true;
+}
+
+bool TcpClient::SendV(const raptor_iovec* iov, size_t count) {
+    if (!IsOnline()) {
+        return false;
+    }
+
+    AutoMutex g(&_s_mtx);
+    bool was_empty = _snd_buffer.Empty();
+    _snd_buffer.AddFragments(iov, count);
+    FlushQueued(was_empty);
+    return true;
+}
+
+bool TcpClient::SendZeroCopy(const void* ptr, size_t len,
+        raptor_buffer_release_callback release, void* ctx) {
+    Slice s = MakeSliceByExternal(ptr, len, release, ctx);
+    if (!IsOnline() || !ptr || len == 0) {
+        return false;
+    }
+
+    AutoMutex g(&_s_mtx);
+    QueueSlice(std::move(s));
     return true;
 }
 
+void TcpClient::QueueSlice(Slice&& s) {
+    bool was_empty = _snd_buffer.Empty();
+    _snd_buffer.AddSlice(std::move(s));
+    FlushQueued(was_empty);
+}
+
+void TcpClient::FlushQueued(bool was_empty) {
+    if (!was_empty) {
+        // the work thread already waits for the socket to drain
+        return;
+    }
+    if (_is_connected.Load(MemoryOrder::ACQUIRE)) {
+        // most sends complete right here, without waking anyone;
+        // an error is left to the work thread to find.
+        if (FlushSendBuffer() == 0 && _snd_buffer.Empty()) {
+            return;
+        }
+    }
+    Wakeup();
+}
+
+bool TcpClient::HasPendingSend() {
+    AutoMutex g(&_s_mtx);
+    return !_snd_buffer.Empty();
+}
+
+void TcpClient::Wakeup() {
+    uint64_t one = 1;
+    ssize_t r;
+    do {
+        r = write(_wakeup_fd, &one, sizeof(one));
+    } while (r < 0 && errno == EINTR);
+}
+
+void TcpClient::ConsumeWakeup() {
+    uint64_t value;
+    ssize_t r;
+    do {
+        r = read(_wakeup_fd, &value, sizeof(value));
+    } while (r < 0 && errno == EINTR);
+}
+
 bool TcpClient::IsOnline() const {
     return (_fd != -1);
 }
 
 void TcpClient::SetProtocol(IProtocol* proto) {
     _proto = proto;
+    _checker.SetProtocol(proto);
+}
+
+uint64_t TcpClient::ScheduleTimer(uint32_t delay_ms, raptor_timer_callback cb, void* ctx) {
+    if (!cb) {
+        return 0;
+    }
+    // on the precise clock rounded up, the coarse one the timers are
+    // checked with lags it, so a timer is never early
+    int64_t deadline = (GetMonotonicNanoseconds() + 999999) / 1000000 + delay_ms;
+    AutoMutex g(&_t_mtx);
+    if (_timers_closed) {
+        return 0;
+    }
+    uint64_t id = ++_next_timer_id;
+    // under the lock, CloseTimers comes before _wakeup_fd is closed
+    if (_timers.Add(id, RAPTOR_NO_CONNECTION, deadline, cb, ctx)) {
+        Wakeup();
+    }
+    return id;
+}
+
+bool TcpClient::CancelTimer(uint64_t timer_id) {
+    AutoMutex g(&_t_mtx);
+    return _timers.Cancel(timer_id);
+}
+
+void TcpClient::RunTimers() {
+    int64_t now = UpdateCoarseClock();
+    if (_timers.NextDeadline() > now) {
+        return;
+    }
+    std::vector<UserTimers::Timer*> expired;
+    {
+        AutoMutex g(&_t_mtx);
+        _timers.Expire(now, &expired);
+    }
+    for (auto timer : expired) {
+        UserTimers::Run(timer, true);
+    }
+}
+
+void TcpClient::CloseTimers() {
+    std::vector<UserTimers::Timer*> left;
+    {
+        AutoMutex g(&_t_mtx);
+        _timers_closed = true;
+        _timers.TakeAll(&left);
+    }
+    for (auto timer : left) {
+        UserTimers::Run(timer, false);
+    }
 }
 
 void TcpClient::Shutdown() {
     if (!_shutdown) {
         _shutdown = true;
 
+        // waits for a resolve callback that is starting the connect
+        _resolve_guard->Cancel();
+        Wakeup();
         _thd.Join();
+        CloseTimers();
 
         raptor_set_socket_shutdown(_fd);
         _fd = -1;
+        _is_connected.Store(false);
+
+        close(_wakeup_fd);
+        _wakeup_fd = -1;
 
         _s_mtx.Lock();
         _snd_buffer.ClearBuffer();
@@ -100,50 +290,86 @@ void TcpClient::Shutdown() {
 }
 
 void TcpClient::WorkThread(void* ptr) {
-    bool error_occurred = false;
-    while (!_shutdown) {
-
-        fd_set rfs, wfs;
-        FD_ZERO(&rfs);
-        FD_SET(_fd, &rfs);
-        FD_ZERO(&wfs);
-        FD_SET(_fd, &wfs);
+    if (_fd == -1) {
+        // started for a failed name lookup, or by Shutdown
+        // before any connect
+        if (!_shutdown) {
+            _service->OnConnectResult(false);
+        }
+        CloseTimers();
+        return;
+    }
 
-        struct timeval t;
-        t.tv_sec = 1;
-        t.tv_usec = 0;
+    while (!_shutdown) {
 
-        int r = select(_fd+1, &rfs, &wfs, NULL, &t);
-        if (r <= 0) {
-            if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) {
+        // A connected socket is almost always writable, so write
+        // interest is only armed while the connect is in progress
+        // or sends are pending. Send wakes the poll to arm it.
+        struct pollfd fds[2];
+        fds[0].fd = _fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        if (!_is_connected.Load() || HasPendingSend()) {
+            fds[0].events |= POLLOUT;
+        }
+        fds[1].fd = _wakeup_fd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        // Shutdown, Send and ScheduleTimer wake it, only the timers
+        // are checked meanwhile
+        int timeout = -1;
+        int64_t next = _timers.NextDeadline();
+        if (next != INT64_MAX) {
+            int64_t wait = RAPTOR_MAX(next - UpdateCoarseClock(), static_cast<int64_t>(0));
+            timeout = static_cast<int>(RAPTOR_MIN(wait, static_cast<int64_t>(INT32_MAX)));
+        }
+        int r = poll(fds, 2, timeout);
+        if (r < 0) {
+            if (errno == EINTR) {
                 continue;
             }
-            error_occurred = true;
             break;
         }
+        RunTimers();
+        if (fds[1].revents & POLLIN) {
+            ConsumeWakeup();
+        }
+        short revents = fds[0].revents;
+        if (revents == 0) {
+            continue;
+        }
 
-        if (!_is_connected) {
-            _is_connected = true;
+        if (!_is_connected.Load()) {
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &so_error, &len) != 0 || so_error != 0) {
+                break;
+            }
+            _is_connected.Store(true, MemoryOrder::RELEASE);
             _service->OnConnectResult(true);
+            // the sends queued meanwhile go out with the next POLLOUT
             continue;
         }
 
-        if (FD_ISSET(_fd, &rfs)) {
-            error_occurred = (DoRecv() == 0);
-        } else {
-            error_occurred = (DoSend() == 0);
+        if (revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (DoRecv() != 0) {
+                break;
+            }
         }
-
-        if (!error_occurred) {
-            break;
+        if (revents & POLLOUT) {
+            if (DoSend() != 0) {
+                break;
+            }
         }
     }
 
-    if (_is_connected) {
+    if (_is_connected.Load()) {
         _service->OnClosed();
     } else {
         _service->OnConnectResult(false);
     }
+    CloseTimers();
 }
 
 
@@ -178,27 +404,28 @@ int TcpClient::DoRecv() {
 }
 
 int TcpClient::DoSend() {
-    if (_snd_buffer.Empty()) {
-        return 0;
-    }
+    AutoMutex g(&_s_mtx);
+    return FlushSendBuffer();
+}
 
-    size_t count = 0;
-    do {
+int TcpClient::FlushSendBuffer() {
+    while (!_snd_buffer.Empty()) {
         Slice slice = _snd_buffer.GetTopSlice();
 
-        int slen = ::send(_fd, slice.begin(), slice.size(), 0);
-
+        ssize_t slen = ::send(_fd, slice.begin(), slice.size(), MSG_NOSIGNAL);
         if (slen > 0) {
-            _snd_buffer.MoveHeader(slice.size());
-        } else if (slen < 0) {
-            if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) {
-                return -1;
-            }
-        } else {
-            break;
+            // a partial send leaves the rest of the slice at the front
+            _snd_buffer.MoveHeader(static_cast<size_t>(slen));
+            continue;
+        }
+        if (slen < 0 && errno == EINTR) {
+            continue;
+        }
+        if (slen < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+            return 0;
         }
-        count = _snd_buffer.Count();
-    } while (count > 0);
+        return -1;
+    }
     return 0;
 }
 
@@ -218,7 +445,8 @@ raptor_error TcpClient::AsyncConnect(
         err = connect(sock_fd, (const raptor_sockaddr*)mapped_addr.addr, mapped_addr.len);
     } while (err < 0 && errno == EINTR);
 
-    if (errno != EWOULDBLOCK && errno != EINPROGRESS) {
+    // unix sockets usually connect at once
+    if (err < 0 && errno != EWOULDBLOCK && errno != EINPROGRESS) {
         raptor_set_socket_shutdown(sock_fd);
         return RAPTOR_POSIX_ERROR("connect");
     }
@@ -226,52 +454,28 @@ raptor_error TcpClient::AsyncConnect(
     return RAPTOR_ERROR_NONE;
 }
 
-bool TcpClient::ReadSliceFromRecvBuffer(size_t read_size, Slice& s) {
-    size_t cache_size = _rcv_buffer.GetBufferLength();
-    if (read_size >= cache_size) {
-        s = _rcv_buffer.Merge();
-        return true;
-    }
-    s = _rcv_buffer.GetHeader(read_size);
-    return false;
-}
-
 int TcpClient::ParsingProtocol() {
     size_t cache_size = _rcv_buffer.GetBufferLength();
-    size_t header_size = _proto->GetMaxHeaderSize();
     int package_counter = 0;
 
     while (cache_size > 0) {
-        size_t read_size = header_size;
-        int pack_len = 0;
-        Slice package;
-        do {
-            bool reach_tail = ReadSliceFromRecvBuffer(read_size, package);
-            pack_len = _proto->CheckPackageLength(package.begin(), package.size());
-            if (pack_len < 0) {
-                log_error("tcp client: internal protocol error(pack_len = %d)", pack_len);
-                return -1;
-            }
-
-            // equal 0 means we need more data
-            if (pack_len == 0) {
-                if (reach_tail) {
-                    goto done;
-                }
-                read_size *= 2;
-                continue;
-            }
+        int pack_len = _checker.Check(_rcv_buffer);
+        if (pack_len < 0) {
+            log_error("tcp client: internal protocol error(pack_len = %d)", pack_len);
+            return -1;
+        }
 
-            // We got the length of a whole packet
-            if (cache_size >= (size_t)pack_len) {
-                break;
-            }
+        // equal 0 means we need more data
+        if (pack_len == 0) {
             goto done;
-        } while (false);
+        }
 
-        if (package.size() < static_cast<size_t>(pack_len)) {
-            package = _rcv_buffer.GetHeader(pack_len);
+        // We got the length of a whole packet
+        if (cache_size < (size_t)pack_len) {
+            goto done;
         }
+
+        Slice package = _rcv_buffer.GetHeader(pack_len);
         _service->OnMessageReceived(package.begin(), pack_len);
         _rcv_buffer.MoveHeader(pack_len);
 
@@ -19,12 +19,17 @@
 #ifndef __RAPTOR_CORE_LINUX_TCP_CLIENT__
 #define __RAPTOR_CORE_LINUX_TCP_CLIENT__
 
+#include <memory>
+#include "core/async_resolver.h"
+#include "core/package_checker.h"
 #include "core/resolve_address.h"
 #include "core/sockaddr.h"
 #include "core/slice/slice.h"
 #include "core/slice/slice_buffer.h"
+#include "core/user_timers.h"
 #include "raptor/service.h"
 #include "raptor/protocol.h"
+#include "util/atomic.h"
 #include "util/status.h"
 #include "util/sync.h"
 #include "util/thread.h"
@@ -38,43 +43,84 @@ public:
     raptor_error Init();
     raptor_error Connect(const char* addr, size_t timeout_ms);
     bool Send(const void* buff, size_t len);
+    bool SendV(const raptor_iovec* iov, size_t count);
+    bool SendZeroCopy(const void* ptr, size_t len,
+        raptor_buffer_release_callback release, void* ctx);
     void Shutdown();
     bool IsOnline() const;
     void SetProtocol(IProtocol* proto);
+    // see ITcpClient::ScheduleTimer
+    uint64_t ScheduleTimer(uint32_t delay_ms, raptor_timer_callback cb, void* ctx);
+    bool CancelTimer(uint64_t timer_id);
 
 private:
     void WorkThread(void* ptr);
 
+    // return -1 if the connection is broken
     int DoSend();
     int DoRecv();
 
+    // requires _s_mtx held, sends until the buffer is empty or the
+    // socket is full, return -1 on error
+    int FlushSendBuffer();
+    // requires _s_mtx held
+    void QueueSlice(Slice&& s);
+    // requires _s_mtx held, after adding to _snd_buffer
+    void FlushQueued(bool was_empty);
+    bool HasPendingSend();
+
+    // makes the work thread poll again with the current interest
+    void Wakeup();
+    void ConsumeWakeup();
+
+    // on the work thread, runs the timers which are due
+    void RunTimers();
+    // the timers left are called with fired 0, no more can be added
+    void CloseTimers();
+
     raptor_error AsyncConnect(
         const raptor_resolved_address* addr, int timeout_ms, int* new_fd);
+    // runs on a resolver thread, or inline for numeric addresses
+    raptor_error OnResolved(raptor_error error,
+        raptor_resolved_addresses* addrs, int timeout_ms);
 
     // if success return the number of parsed packets
     // otherwise return -1 (protocol error)
     int  ParsingProtocol();
 
-    // return true if reach recv buffer tail.
-    bool ReadSliceFromRecvBuffer(size_t read_size, Slice& s);
-
 private:
     IClientReceiver *_service;
     IProtocol* _proto;
+    PackageChecker _checker;
 
     bool _shutdown;
-    bool _is_connected;
+    // set by the work thread, read by Send
+    AtomicBool _is_connected;
 
     int _fd;
+    // eventfd, written by Send when write interest must be armed
+    int _wakeup_fd;
 
     Thread _thd;
 
+    // set by the first Connect, a client connects only once
+    AtomicBool _connecting;
+    // cancelled by Shutdown so a late resolve result is dropped
+    std::shared_ptr<ResolveGuard<TcpClient>> _resolve_guard;
+
     Mutex _s_mtx;
     Mutex _r_mtx;
 
     SliceBuffer _snd_buffer;
     SliceBuffer _rcv_buffer;
 
+    // ScheduleTimer, the work thread runs them
+    Mutex _t_mtx;
+    UserTimers _timers;
+    // requires _t_mtx held
+    bool _timers_closed;
+    uint64_t _next_timer_id;
+
 };
 } // namespace raptor
 #endif  // __RAPTOR_CORE_LINUX_TCP_CLIENT__
@@ -0,0 +1,230 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "core/linux/tcp_connector.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "core/linux/socket_setting.h"
+#include "core/sockaddr.h"
+#include "util/log.h"
+#include "util/time.h"
+
+namespace raptor {
+namespace {
+constexpr int64_t DEFAULT_CONNECT_TIMEOUT_MS = 20000;
+// how often the deadlines are checked
+constexpr int TIMEOUT_CHECK_INTERVAL_MS = 100;
+}  // namespace
+
+TcpConnector::TcpConnector(internal::IConnectorReceiver* service)
+    : _service(service)
+    , _shutdown(true)
+    , _started(false)
+    , _next_seq(0) {}
+
+TcpConnector::~TcpConnector() {
+    Shutdown();
+}
+
+raptor_error TcpConnector::Init() {
+    if (!_shutdown.Load()) {
+        return RAPTOR_ERROR_FROM_STATIC_STRING("tcp connector already running");
+    }
+    auto e = _epoll.create();
+    if (e != RAPTOR_ERROR_NONE) {
+        return e;
+    }
+    e = _wakeup.Init();
+    if (e != RAPTOR_ERROR_NONE) {
+        return e;
+    }
+    if (_epoll.add(_wakeup.Fd(), WakeupFd::Tag(), EPOLLIN) != 0 && errno != EEXIST) {
+        return RAPTOR_POSIX_ERROR("epoll_ctl");
+    }
+    _shutdown.Store(false);
+    _started = false;
+    _thd = Thread("connector",
+        std::bind(&TcpConnector::WorkThread, this, std::placeholders::_1), nullptr);
+    return RAPTOR_ERROR_NONE;
+}
+
+void TcpConnector::Shutdown() {
+    if (_shutdown.Load()) {
+        return;
+    }
+    _mtx.Lock();
+    _shutdown.Store(true);
+    _mtx.Unlock();
+    _wakeup.Wakeup();
+
+    // joining a thread that was never started starts it, it sees
+    // _shutdown and leaves at once.
+    _thd.Join();
+
+    AutoMutex g(&_mtx);
+    for (auto& it : _pending) {
+        _epoll.remove(it.second.fd, 0);
+        raptor_set_socket_shutdown(it.second.fd);
+    }
+    _pending.clear();
+}
+
+raptor_error TcpConnector::Connect(
+    const raptor_resolved_address* addr, size_t timeout_ms, uint64_t tag) {
+
+    raptor_resolved_address mapped_addr;
+    int fd = -1;
+    // the connect timeout is enforced here, the socket keeps the
+    // default TCP_USER_TIMEOUT of client sockets
+    raptor_error e = raptor_tcp_client_prepare_socket(addr, &mapped_addr, &fd, 0);
+    if (e != RAPTOR_ERROR_NONE) {
+        return e;
+    }
+
+    int err = 0;
+    do {
+        err = connect(fd, (const raptor_sockaddr*)mapped_addr.addr, mapped_addr.len);
+    } while (err < 0 && errno == EINTR);
+    if (err < 0 && errno != EWOULDBLOCK && errno != EINPROGRESS) {
+        e = RAPTOR_POSIX_ERROR("connect");
+        raptor_set_socket_shutdown(fd);
+        return e;
+    }
+
+    PendingConnect pending;
+    pending.fd = fd;
+    pending.tag = tag;
+    pending.deadline_ms = UpdateCoarseClock()
+        + (timeout_ms > 0 ? static_cast<int64_t>(timeout_ms) : DEFAULT_CONNECT_TIMEOUT_MS);
+    pending.addr = *addr;
+
+    AutoMutex g(&_mtx);
+    if (_shutdown.Load()) {
+        raptor_set_socket_shutdown(fd);
+        return RAPTOR_ERROR_FROM_STATIC_STRING("tcp connector is not running");
+    }
+    uint64_t seq = ++_next_seq;
+    bool idle = _started && _pending.empty();
+    _pending[seq] = pending;
+    // an immediate connect, which is common on loopback,
+    // is reported through EPOLLOUT as well
+    if (_epoll.add(fd, reinterpret_cast<void*>(seq), EPOLLOUT | EPOLLET) != 0) {
+        e = RAPTOR_POSIX_ERROR("epoll_ctl");
+        _pending.erase(seq);
+        raptor_set_socket_shutdown(fd);
+        return e;
+    }
+    if (!_started) {
+        _started = true;
+        _thd.Start();
+    } else if (idle) {
+        // the thread starts checking the timeout
+        _wakeup.Wakeup();
+    }
+    return RAPTOR_ERROR_NONE;
+}
+
+size_t TcpConnector::PendingCount() {
+    AutoMutex g(&_mtx);
+    return _pending.size();
+}
+
+void TcpConnector::WorkThread(void*) {
+    int64_t next_check = UpdateCoarseClock() + TIMEOUT_CHECK_INTERVAL_MS;
+    while (!_shutdown.Load()) {
+        int timeout = TIMEOUT_CHECK_INTERVAL_MS;
+        {
+            AutoMutex g(&_mtx);
+            if (_pending.empty()) {
+                timeout = -1;
+            }
+        }
+        int number_of_fd = _epoll.polling(timeout);
+        if (_shutdown.Load()) {
+            return;
+        }
+
+        for (int i = 0; i < number_of_fd; i++) {
+            struct epoll_event* ev = _epoll.get_event(i);
+            if (ev->data.ptr == WakeupFd::Tag()) {
+                _wakeup.Consume();
+                continue;
+            }
+            uint64_t seq = reinterpret_cast<uint64_t>(ev->data.ptr);
+
+            PendingConnect pending;
+            {
+                AutoMutex g(&_mtx);
+                auto it = _pending.find(seq);
+                if (it == _pending.end()) {
+                    continue;
+                }
+                pending = it->second;
+                _pending.erase(it);
+            }
+
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            if (getsockopt(pending.fd, SOL_SOCKET, SO_ERROR, &so_error, &len) != 0) {
+                so_error = errno;
+            }
+            bool success = (so_error == 0) && !(ev->events & (EPOLLERR | EPOLLHUP));
+            Complete(pending, success);
+        }
+
+        int64_t now = UpdateCoarseClock();
+        if (now >= next_check) {
+            next_check = now + TIMEOUT_CHECK_INTERVAL_MS;
+            ExpireTimeouts(now);
+        }
+    }
+}
+
+void TcpConnector::ExpireTimeouts(int64_t now_ms) {
+    std::vector<PendingConnect> expired;
+    {
+        AutoMutex g(&_mtx);
+        for (auto it = _pending.begin(); it != _pending.end();) {
+            if (it->second.deadline_ms <= now_ms) {
+                expired.push_back(it->second);
+                it = _pending.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for (size_t i = 0; i < expired.size(); i++) {
+        Complete(expired[i], false);
+    }
+}
+
+void TcpConnector::Complete(const PendingConnect& pending, bool success) {
+    _epoll.remove(pending.fd, 0);
+    if (success) {
+        _service->OnConnectCompleted(pending.tag, pending.fd, &pending.addr);
+        return;
+    }
+    raptor_set_socket_shutdown(pending.fd);
+    _service->OnConnectCompleted(pending.tag, -1, &pending.addr);
+}
+
+} // namespace raptor
@@ -0,0 +1,89 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_CORE_LINUX_TCP_CONNECTOR__
+#define __RAPTOR_CORE_LINUX_TCP_CONNECTOR__
+
+#include <stdint.h>
+#include <map>
+
+#include "core/linux/epoll.h"
+#include "core/linux/wakeup_fd.h"
+#include "core/resolve_address.h"
+#include "core/service.h"
+#include "util/atomic.h"
+#include "util/status.h"
+#include "util/sync.h"
+#include "util/thread.h"
+
+namespace raptor {
+
+// Non-blocking connects on one epoll thread. The thread is started
+// by the first Connect, a connector that is never used costs nothing
+// but its epoll fd.
+class TcpConnector final {
+public:
+    explicit TcpConnector(internal::IConnectorReceiver* service);
+    ~TcpConnector();
+
+    TcpConnector(const TcpConnector&) = delete;
+    TcpConnector& operator= (const TcpConnector&) = delete;
+
+    raptor_error Init();
+    // closes the pending sockets without reporting them
+    void Shutdown();
+
+    // OnConnectCompleted gets tag once the connect succeeds, fails or
+    // takes longer than timeout_ms (0 means 20 seconds). It may be
+    // called before Connect returns.
+    raptor_error Connect(const raptor_resolved_address* addr, size_t timeout_ms, uint64_t tag);
+
+    size_t PendingCount();
+
+private:
+    struct PendingConnect {
+        int fd;
+        uint64_t tag;
+        int64_t deadline_ms;
+        raptor_resolved_address addr;
+    };
+
+    void WorkThread(void*);
+    // the pending entry has been taken out of _pending
+    void Complete(const PendingConnect& pending, bool success);
+    void ExpireTimeouts(int64_t now_ms);
+
+    internal::IConnectorReceiver* _service;
+    // read by the thread without holding _mtx
+    AtomicBool _shutdown;
+    bool _started;
+    Epoll _epoll;
+    // the thread waits without a timeout while nothing is pending
+    WakeupFd _wakeup;
+    Thread _thd;
+
+    Mutex _mtx;
+    // keyed by a sequence number rather than by fd, so that the event
+    // of a closed socket cannot complete a new one reusing its fd.
+    std::map<uint64_t, PendingConnect> _pending;
+    uint64_t _next_seq;
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_CORE_LINUX_TCP_CONNECTOR__
@@ -17,13 +17,20 @@
  */
 
 #include "core/linux/tcp_listener.h"
+#include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <thread>
 #include "core/sockaddr.h"
 #include "core/socket_util.h"
 #include "util/alloc.h"
+#include "util/epoch.h"
 #include "util/log.h"
+#include "util/useful.h"
 #include "util/list_entry.h"
+#include "core/linux/epoll_thread.h"
 #include "core/linux/socket_setting.h"
+#include "core/cid.h"
 
 namespace raptor {
 
@@ -32,11 +39,34 @@ struct ListenerObject {
     raptor_resolved_address addr;
     int listen_fd;
     int port;
+    int shard;
     raptor_dualstack_mode mode;
+    // exported or inherited, another process may listen on it too
+    bool shared;
+    // no longer polled, the fd is closed once no accept can use it
+    Atomic<bool> drained;
 };
 
+namespace {
+struct DrainedSocket {
+    int fd;
+    AtomicUInt64* closed;
+};
+
+void CloseDrainedSocket(void* ptr) {
+    DrainedSocket* ds = static_cast<DrainedSocket*>(ptr);
+    // a plain close, shutdown would also stop the other process
+    close(ds->fd);
+    ds->closed->FetchAdd(1, MemoryOrder::RELEASE);
+    delete ds;
+}
+} // namespace
+
 TcpListener::TcpListener(internal::IAcceptor* cp)
-    : _acceptor(cp), _shutdown(true) {
+    : _acceptor(cp), _shutdown(true), _reuse_port(false)
+    , _accept_budget(DEFAULT_ACCEPT_BUDGET), _cpu_steering(false)
+    , _tag_magic(0), _slot_count(0), _adopted(0) {
+    memset(&_profile, 0, sizeof(_profile));
     RAPTOR_LIST_INIT(&_head);
 }
 
@@ -44,32 +74,82 @@ TcpListener::~TcpListener() {
     RAPTOR_ASSERT(_shutdown);
 }
 
-RefCountedPtr<Status> TcpListener::Init() {
+RefCountedPtr<Status> TcpListener::Init(
+    size_t shards, bool reuse_port, size_t accept_budget, const CpuAffinity& affinity,
+    const raptor_socket_profile_t* profile) {
     if (!_shutdown) {
         return RAPTOR_ERROR_NONE;
     }
-    _shutdown = false;
-    auto e = _epoll.create();
-    if (e != RAPTOR_ERROR_NONE) {
-        return e;
+    if (profile) {
+        _profile = *profile;
+    } else {
+        memset(&_profile, 0, sizeof(_profile));
+    }
+    if (accept_budget == 0) {
+        accept_budget = DEFAULT_ACCEPT_BUDGET;
+    }
+    _accept_budget = RAPTOR_MIN(accept_budget, static_cast<size_t>(MAX_ACCEPT_BUDGET));
+    _accept_wakeups.Store(0);
+    _accepted.Store(0);
+    if (shards == 0) {
+        shards = 1;
+    }
+    _reuse_port = reuse_port;
+    if (!_reuse_port) {
+        shards = 1;
     }
 
-    _thd = Thread("listen",
-        std::bind(&TcpListener::DoPolling, this, std::placeholders::_1), nullptr);
-
+    _epolls.clear();
+    _wakeups.clear();
+    _thds.clear();
+    if (!_reactors.empty()) {
+        // the reactors accept, no threads of our own
+        _shutdown = false;
+        return RAPTOR_ERROR_NONE;
+    }
+    for (size_t i = 0; i < shards; i++) {
+        std::unique_ptr<Epoll> ep(new Epoll);
+        auto e = ep->create();
+        if (e != RAPTOR_ERROR_NONE) {
+            return e;
+        }
+        std::unique_ptr<WakeupFd> wakeup(new WakeupFd);
+        e = wakeup->Init();
+        if (e != RAPTOR_ERROR_NONE) {
+            return e;
+        }
+        if (ep->add(wakeup->Fd(), WakeupFd::Tag(), EPOLLIN) != 0) {
+            return RAPTOR_POSIX_ERROR("epoll_ctl");
+        }
+        _epolls.push_back(std::move(ep));
+        _wakeups.push_back(std::move(wakeup));
+        Thread::Options options;
+        options.SetAffinity(affinity.Select(i));
+        _thds.push_back(Thread("listen",
+            std::bind(&TcpListener::DoPolling, this, std::placeholders::_1),
+            reinterpret_cast<void*>(i), nullptr, options));
+    }
+    _shutdown = false;
     return RAPTOR_ERROR_NONE;
 }
 
 bool TcpListener::StartListening() {
     if (_shutdown) return false;
-    _thd.Start();
+    for (auto& thd : _thds) {
+        thd.Start();
+    }
     return true;
 }
 
 void TcpListener::Shutdown() {
     if (!_shutdown) {
         _shutdown = true;
-        _thd.Join();
+        for (auto& wakeup : _wakeups) {
+            wakeup->Wakeup();
+        }
+        for (auto& thd : _thds) {
+            thd.Join();
+        }
 
         _mtex.Lock();
         list_entry* entry = _head.next;
@@ -77,23 +157,157 @@ void TcpListener::Shutdown() {
             auto obj = reinterpret_cast<ListenerObject*>(entry);
             entry = entry->next;
 
-            raptor_set_socket_shutdown(obj->listen_fd);
+            if (!obj->drained.Load()) {
+                if (obj->shared) {
+                    close(obj->listen_fd);
+                } else {
+                    raptor_set_socket_shutdown(obj->listen_fd);
+                }
+            }
+            if (!obj->shared) {
+                raptor_remove_unix_socket(&obj->addr);
+            }
             delete obj;
         }
         RAPTOR_LIST_INIT(&_head);
+        _slot_count = 0;
         _mtex.Unlock();
     }
 }
 
+void TcpListener::PollOnReactors(const std::vector<SendRecvThread*>& reactors, uint16_t magic) {
+    RAPTOR_ASSERT(_shutdown);
+    _reactors = reactors;
+    _tag_magic = magic;
+    _slots.reset(new ListenerObject*[MAX_REACTOR_LISTENERS]);
+    _slot_count = 0;
+}
+
+void TcpListener::SetCpuSteering(const std::vector<int>& cpu_shard) {
+    _cpu_shard = cpu_shard;
+    _cpu_steering = true;
+}
+
+bool TcpListener::IsListenerTag(void* ptr) const {
+    return core::GetMagicNumber(reinterpret_cast<ConnectionId>(ptr)) == _tag_magic
+        && !_reactors.empty();
+}
+
+// the tag carries the reactor in the listen port field
+void TcpListener::Drain() {
+    if (_shutdown) return;
+    std::vector<ListenerObject*> objs;
+    _mtex.Lock();
+    for (list_entry* entry = _head.next; entry != &_head; entry = entry->next) {
+        auto obj = reinterpret_cast<ListenerObject*>(entry);
+        if (!obj->drained.Load()) {
+            obj->drained.Store(true);
+            objs.push_back(obj);
+        }
+    }
+    _mtex.Unlock();
+
+    for (ListenerObject* obj : objs) {
+        if (_reactors.empty()) {
+            _epolls[obj->shard < 0 ? 0 : obj->shard]->remove(obj->listen_fd, EPOLLIN);
+        } else {
+            for (size_t i = 0; i < _reactors.size(); i++) {
+                if (obj->shard < 0 || static_cast<size_t>(obj->shard) == i) {
+                    _reactors[i]->Delete(obj->listen_fd, EPOLLIN);
+                }
+            }
+        }
+    }
+
+    // an accept that got past the drained check still holds the fd
+    AtomicUInt64 closed;
+    closed.Store(0);
+    for (ListenerObject* obj : objs) {
+        Epoch::Retire(new DrainedSocket{obj->listen_fd, &closed}, CloseDrainedSocket);
+    }
+    while (closed.Load(MemoryOrder::ACQUIRE) < objs.size()) {
+        if (Epoch::Reclaim() > 0) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+size_t TcpListener::GetListeningFds(int* fds, size_t count) {
+    size_t n = 0;
+    AutoMutex g(&_mtex);
+    for (list_entry* entry = _head.next; entry != &_head; entry = entry->next) {
+        auto obj = reinterpret_cast<ListenerObject*>(entry);
+        if (obj->drained.Load()) {
+            continue;
+        }
+        obj->shared = true;
+        if (n < count) {
+            fds[n] = obj->listen_fd;
+        }
+        n++;
+    }
+    return n;
+}
+
+RefCountedPtr<Status> TcpListener::AdoptListeningSocket(int fd) {
+    if (_shutdown) return RAPTOR_ERROR_FROM_STATIC_STRING("tcp listener uninitialized");
+
+    int listening = 0;
+    socklen_t len = sizeof(listening);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0) {
+        return RAPTOR_POSIX_ERROR("getsockopt(SO_ACCEPTCONN)");
+    }
+    if (!listening) {
+        return RAPTOR_ERROR_FROM_STATIC_STRING("not a listening socket");
+    }
+    raptor_resolved_address addr;
+    addr.len = sizeof(addr.addr);
+    if (getsockname(fd, reinterpret_cast<raptor_sockaddr*>(addr.addr), &addr.len) != 0) {
+        return RAPTOR_POSIX_ERROR("getsockname");
+    }
+    raptor_error e = raptor_set_socket_nonblocking(fd, 1);
+    if (e == RAPTOR_ERROR_NONE) e = raptor_set_socket_cloexec(fd, 1);
+    if (e != RAPTOR_ERROR_NONE) {
+        return e;
+    }
+
+    // the shards of a reuse_port listener arrive one by one
+    int shard = -1;
+    if (_reuse_port && raptor_sockaddr_get_family(&addr) != AF_UNIX) {
+        shard = static_cast<int>(_adopted++ % Shards());
+    }
+    return RegisterListeningSocket(fd, &addr, raptor_sockaddr_get_port(&addr),
+        RAPTOR_DSMODE_NONE, shard, true);
+}
+
+void TcpListener::OnAcceptEvent(void* ptr) {
+    ConnectionId tag = reinterpret_cast<ConnectionId>(ptr);
+    uint32_t slot = core::GetUserId(tag);
+    EpochGuard guard;
+    if (slot < _slot_count) {
+        AcceptBatch(_slots[slot], core::GetListenPort(tag));
+    }
+}
+
+size_t TcpListener::Shards() const {
+    return _reactors.empty() ? _epolls.size() : _reactors.size();
+}
+
 void TcpListener::DoPolling(void* ptr) {
+    size_t shard = reinterpret_cast<size_t>(ptr);
+    Epoll* epoll = _epolls[shard].get();
     while (!_shutdown) {
-        int number_of_fd = _epoll.polling();
+        int number_of_fd = epoll->polling(-1);
         if (number_of_fd <= 0) {
             continue;
         }
 
         for (int i = 0; i < number_of_fd; i++) {
-            struct epoll_event* ev = _epoll.get_event(i);
+            struct epoll_event* ev = epoll->get_event(i);
+            if (ev->data.ptr == WakeupFd::Tag()) {
+                _wakeups[shard]->Consume();
+                continue;
+            }
             ProcessEpollEvents(ev->data.ptr, ev->events);
         }
     }
@@ -102,63 +316,160 @@ void TcpListener::DoPolling(void* ptr) {
 RefCountedPtr<Status> TcpListener::AddListeningPort(const raptor_resolved_address* addr) {
     if (_shutdown) return RAPTOR_ERROR_FROM_STATIC_STRING("tcp listener uninitialized");
 
-    int port = 0, listen_fd = 0;
+    // a unix socket path can only be bound once, its
+    // connections are spread over the reactors instead
+    if (!_reuse_port || raptor_sockaddr_get_family(addr) == AF_UNIX) {
+        int port = 0;
+        return AddListeningSocket(addr, -1, &port);
+    }
+
+    // All shards must bind the same port, so the port picked
+    // by the kernel for the first socket is reused by the others.
+    raptor_resolved_address shard_addr = *addr;
+    for (size_t i = 0; i < Shards(); i++) {
+        int port = 0;
+        auto e = AddListeningSocket(&shard_addr, static_cast<int>(i), &port);
+        if (e != RAPTOR_ERROR_NONE) {
+            return e;
+        }
+        if (i == 0) {
+            raptor_sockaddr_set_port(&shard_addr, port);
+        }
+    }
+    return RAPTOR_ERROR_NONE;
+}
+
+RefCountedPtr<Status> TcpListener::AddListeningSocket(
+    const raptor_resolved_address* addr, int shard, int* port) {
+
+    int listen_fd = 0;
     raptor_dualstack_mode mode;
+    raptor_remove_stale_unix_socket(addr);
     raptor_error e = raptor_create_dualstack_socket(addr, SOCK_STREAM, 0, &mode, &listen_fd);
     if (e != RAPTOR_ERROR_NONE) {
         log_error("Failed to create socket: %s", e->ToString().c_str());
         return e;
     }
-    e = raptor_tcp_server_prepare_socket(listen_fd, addr, &port, 1);
+    e = raptor_tcp_server_prepare_socket(listen_fd, addr, port, 1, &_profile);
     if (e != RAPTOR_ERROR_NONE) {
         log_error("Failed to configure socket: %s", e->ToString().c_str());
         return e;
     }
+    if (_cpu_steering && shard == 0) {
+        // the program belongs to the group the other shards join,
+        // without it the kernel picks a shard by hash
+        e = raptor_set_socket_reuseport_cpu_steering(
+            listen_fd, _cpu_shard.data(), _cpu_shard.size(), Shards());
+        if (e != RAPTOR_ERROR_NONE) {
+            log_error("Failed to steer connections by cpu: %s", e->ToString().c_str());
+        }
+    }
+    return RegisterListeningSocket(listen_fd, addr, *port, mode, shard, false);
+}
+
+RefCountedPtr<Status> TcpListener::RegisterListeningSocket(int listen_fd,
+    const raptor_resolved_address* addr, int port, raptor_dualstack_mode mode,
+    int shard, bool shared) {
 
     // Add to epoll
     _mtex.Lock();
+    if (!_reactors.empty() && _slot_count == MAX_REACTOR_LISTENERS) {
+        _mtex.Unlock();
+        close(listen_fd);
+        return RAPTOR_ERROR_FROM_STATIC_STRING("too many listening sockets");
+    }
     ListenerObject* node = new ListenerObject;
     raptor_list_push_back(&_head, &node->entry);
-    _mtex.Unlock();
 
     node->addr = *addr;
     node->listen_fd = listen_fd;
     node->port = port;
+    node->shard = shard;
     node->mode = mode;
+    node->shared = shared;
+    node->drained.Store(false);
 
-    _epoll.add(node->listen_fd, node, EPOLLIN);
+    if (_reactors.empty()) {
+        _mtex.Unlock();
+        _epolls[shard < 0 ? 0 : shard]->add(node->listen_fd, node, EPOLLIN);
+    } else {
+        // published before the first event can name it
+        uint32_t slot = _slot_count;
+        _slots[slot] = node;
+        _slot_count = slot + 1;
+        _mtex.Unlock();
+        for (size_t i = 0; i < _reactors.size(); i++) {
+            if (shard >= 0 && static_cast<size_t>(shard) != i) {
+                continue;
+            }
+            void* tag = reinterpret_cast<void*>(core::BuildConnectionId(
+                _tag_magic, static_cast<uint16_t>(i), slot));
+            if (_reactors[i]->AddListener(listen_fd, tag, shard < 0 && _reactors.size() > 1) != 0) {
+                log_error("Failed to poll listening socket on reactor %d: %s",
+                    static_cast<int>(i), strerror(errno));
+            }
+        }
+    }
 
     char* strAddr = nullptr;
     raptor_sockaddr_to_string(&strAddr, addr, 0);
     log_debug("start listening on %s", strAddr? strAddr : std::to_string(node->port).c_str());
     Free(strAddr);
-    return e;
+    return RAPTOR_ERROR_NONE;
 }
 
 void TcpListener::ProcessEpollEvents(void* ptr, uint32_t events) {
     ListenerObject* sp = (ListenerObject*)ptr;
     RAPTOR_ASSERT(sp != nullptr);
-    for (;;) {
-        raptor_resolved_address client;
-        int sock_fd = AcceptEx(sp->listen_fd, &client, 1, 1);
+    EpochGuard guard;
+    AcceptBatch(sp, sp->shard);
+}
+
+// called inside an epoch, Drain closes the fd only after it
+void TcpListener::AcceptBatch(ListenerObject* sp, int shard) {
+    if (sp->drained.Load(MemoryOrder::ACQUIRE)) {
+        return;
+    }
+
+    internal::IAcceptor::AcceptedSocket socks[MAX_ACCEPT_BUDGET];
+    size_t count = 0;
+
+    while (count < _accept_budget) {
+        auto& as = socks[count];
+        int sock_fd = AcceptEx(sp->listen_fd, &as.addr, 1, 1);
         if (sock_fd > 0) {
             raptor_set_socket_no_sigpipe_if_possible(sock_fd);
-            raptor_set_socket_reuse_addr(sock_fd, 1);
-            raptor_set_socket_rcv_timeout(sock_fd, 5000);
-            raptor_set_socket_snd_timeout(sock_fd, 5000);
-            _acceptor->OnNewConnection(sock_fd, sp->port, &client);
-            break;
+            // a failed option leaves the connection usable
+            raptor_error e = raptor_apply_socket_profile(sock_fd, &as.addr, &_profile);
+            if (e != RAPTOR_ERROR_NONE) {
+                log_error_ratelimited(1000, "Failed to apply socket profile: %s", e->ToString().c_str());
+            }
+            as.fd = sock_fd;
+            as.listen_port = sp->port;
+            count++;
+            continue;
         }
         if (errno == EINTR) {
             continue;
         }
-        if (errno == EAGAIN) {
-            return;
+        if (errno != EAGAIN) {
+            log_error_ratelimited(1000, "Failed accept: %s on port: %d", strerror(errno), sp->port);
         }
-        log_error("Failed accept: %s on port: %d", strerror(errno), sp->port);
+        break;
+    }
+
+    _accept_wakeups.FetchAdd(1, MemoryOrder::RELAXED);
+    if (count > 0) {
+        _accepted.FetchAdd(count, MemoryOrder::RELAXED);
+        _acceptor->OnNewConnections(socks, count, shard);
     }
 }
 
+void TcpListener::GetAcceptCounters(uint64_t* wakeups, uint64_t* accepted) const {
+    if (wakeups) *wakeups = _accept_wakeups.Load();
+    if (accepted) *accepted = _accepted.Load();
+}
+
 int TcpListener::AcceptEx(
                         int sockfd,
                         raptor_resolved_address* resolved_addr,
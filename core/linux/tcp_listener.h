@@ -19,9 +19,16 @@
 #ifndef __RAPTOR_CORE_LINUX_TCP_LISTENER__
 #define __RAPTOR_CORE_LINUX_TCP_LISTENER__
 
+#include <memory>
+#include <vector>
+
 #include "core/linux/epoll.h"
+#include "core/linux/socket_setting.h"
+#include "core/linux/wakeup_fd.h"
 #include "core/resolve_address.h"
 #include "core/service.h"
+#include "util/affinity.h"
+#include "util/atomic.h"
 #include "util/list_entry.h"
 #include "util/status.h"
 #include "util/sync.h"
@@ -29,31 +36,90 @@
 
 namespace raptor {
 struct ListenerObject;
+class SendRecvThread;
 class TcpListener final {
 public:
     explicit TcpListener(internal::IAcceptor* cp);
     ~TcpListener();
 
+    // reuse_port: every shard opens its own SO_REUSEPORT listening
+    // socket for each address and accepts on its own thread.
+    // accept_budget: max number of sockets accepted per wakeup, 0 means default.
+    // profile: options of the listening and accepted sockets, copied.
     RefCountedPtr<Status>
-        Init();
+        Init(size_t shards = 1, bool reuse_port = false, size_t accept_budget = 0,
+            const CpuAffinity& affinity = CpuAffinity(),
+            const raptor_socket_profile_t* profile = nullptr);
+    // Must be called before Init. The listening sockets are polled by
+    // 'reactors' instead of listen threads: one socket is added to all
+    // of them with EPOLLEXCLUSIVE, or with reuse_port each reactor gets
+    // its own. The event data is a tag built from 'magic', the reactor
+    // hands it to OnAcceptEvent and accepts on its own thread.
+    void PollOnReactors(const std::vector<SendRecvThread*>& reactors, uint16_t magic);
+    // Must be called before AddListeningPort. With reuse_port, a
+    // connection whose SYN arrives on cpu c is accepted by the shard
+    // cpu_shard[c], or c % shards where it has none (-1).
+    void SetCpuSteering(const std::vector<int>& cpu_shard);
+    bool IsListenerTag(void* ptr) const;
+    void OnAcceptEvent(void* ptr);
+
     RefCountedPtr<Status>
         AddListeningPort(const raptor_resolved_address* addr);
     bool StartListening();
     void Shutdown();
 
+    // Stops polling the listening sockets and closes them, without a
+    // shutdown that would also stop a process they were handed to.
+    void Drain();
+    // The fds of the listening sockets, returns how many there are
+    // and fills at most count. They are shared from now on, even
+    // Shutdown only closes them.
+    size_t GetListeningFds(int* fds, size_t count);
+    // Takes over fd, a listening socket inherited from another process.
+    RefCountedPtr<Status> AdoptListeningSocket(int fd);
+
+    // for computing accepts-per-wakeup
+    void GetAcceptCounters(uint64_t* wakeups, uint64_t* accepted) const;
+
 private:
+    enum { DEFAULT_ACCEPT_BUDGET = 64, MAX_ACCEPT_BUDGET = 256 };
+    enum { MAX_REACTOR_LISTENERS = 1024 };
+
     void DoPolling(void* ptr);
     void ProcessEpollEvents(void* ptr, uint32_t events);
+    // shard: the one reported to OnNewConnections
+    void AcceptBatch(ListenerObject* sp, int shard);
+    size_t Shards() const;
     int AcceptEx(
         int fd,
         raptor_resolved_address* addr,
         int nonblock, int cloexec);
+    RefCountedPtr<Status> AddListeningSocket(
+        const raptor_resolved_address* addr, int shard, int* port);
+    RefCountedPtr<Status> RegisterListeningSocket(int fd,
+        const raptor_resolved_address* addr, int port, raptor_dualstack_mode mode,
+        int shard, bool shared);
 
     internal::IAcceptor* _acceptor; //not owned it
     bool _shutdown;
+    bool _reuse_port;
+    size_t _accept_budget;
+    raptor_socket_profile_t _profile;
+    std::vector<int> _cpu_shard;
+    bool _cpu_steering;
+    AtomicUInt64 _accept_wakeups;
+    AtomicUInt64 _accepted;
 
-    Thread _thd;
-    Epoll _epoll;
+    std::vector<Thread> _thds;
+    std::vector<std::unique_ptr<Epoll>> _epolls;
+    // one per epoll, Shutdown wakes the listen threads through them
+    std::vector<std::unique_ptr<WakeupFd>> _wakeups;
+    // reactor polling, the tag's user id indexes _slots
+    std::vector<SendRecvThread*> _reactors;
+    uint16_t _tag_magic;
+    std::unique_ptr<ListenerObject*[]> _slots;
+    uint32_t _slot_count;
+    size_t _adopted;
     list_entry _head;
     Mutex _mtex;
 };
@@ -17,32 +17,115 @@
  */
 
 #include "core/linux/tcp_server.h"
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+#include "core/iomgr.h"
+#include "core/linux/tcp_connector.h"
 #include "core/linux/tcp_listener.h"
 #include "core/linux/socket_setting.h"
+#include "core/linux/traffic_capture.h"
 #include "core/mpscq.h"
 #include "core/resolve_address.h"
 #include "core/socket_util.h"
+#include "util/affinity.h"
+#include "util/cpu.h"
+#include "util/epoch.h"
 #include "util/log.h"
+#include "util/slab.h"
 #include "util/time.h"
+#include "util/trace.h"
+#include "util/useful.h"
 
 namespace raptor {
 enum MessageType {
     kNewConnection,
     kRecvAMessage,
     kCloseClient,
+    kZeroCopyCompleted,
+    kWritable,
+    kConnectFailed,
+    // the tokens are copied into the slice
+    kSendCompleted,
+    // a package over stream_threshold, count is its length
+    kStreamBegin,
+    kStreamChunk,
+    kStreamEnd,
+    // a user timer expired, see ScheduleTimer
+    kTimer,
 };
+// the peer address is not carried, OnConnected does not take it
 struct TcpMessageNode {
     MultiProducerSingleConsumerQueue::Node node;
-    MessageType type;
     ConnectionId cid;
-    raptor_resolved_address addr;
+    MessageType type;
+    uint32_t count;
+    // when it was queued, only set for kRecvAMessage if record_latency is on
+    int64_t enqueue_ns;
     Slice slice;
+    // only set for kTimer, it owns the timer
+    UserTimers::Timer* timer;
 };
+
+inline TcpMessageNode* NewMessageNode() {
+    AccountAlloc(AllocTag::kMessage, sizeof(TcpMessageNode));
+    IomgrAddObject(IomgrType::kMessage);
+    return Slab<TcpMessageNode>::New();
+}
+
+inline void DeleteMessageNode(TcpMessageNode* msg) {
+    AccountFree(AllocTag::kMessage, sizeof(TcpMessageNode));
+    IomgrRemoveObject(IomgrType::kMessage);
+    Slab<TcpMessageNode>::Delete(msg);
+}
 constexpr uint32_t InvalidIndex = static_cast<uint32_t>(-1);
+
+// messages taken from each lane per round, by priority
+constexpr uint32_t kLaneWeights[RAPTOR_PRIORITY_LANES] = { 1, 2, 4 };
+
+// how often the connections are walked for the ones to evict over
+// the memory budget, and the least a connection evicted holds
+constexpr int64_t MEMORY_CHECK_INTERVAL_MS = 10;
+constexpr size_t MIN_EVICT_BYTES = 64 * 1024;
+
+// RaptorOptions::codec_threshold when 0
+constexpr size_t DEFAULT_CODEC_THRESHOLD = 512;
+// RaptorOptions::capture_max_bytes when 0
+constexpr size_t DEFAULT_CAPTURE_BYTES = 64 * 1024 * 1024;
+// wheel nodes one reactor expires per wakeup, the rest wait for the next
+constexpr size_t MAX_TIMEOUT_BATCH = 256;
+// the low bits of a timer id are the reactor it is on
+constexpr uint32_t TIMER_REACTOR_BITS = 16;
+
+// the connections whose sends the callbacks on this thread hold back
+struct CorkScope {
+    TcpServer* server;
+    int64_t first_ns;
+    std::vector<ConnectionId> cids;
+};
+static thread_local CorkScope t_cork = {nullptr, 0, {}};
+
+static void FillLatency(const Histogram& h, raptor_latency_t* latency) {
+    latency->count = h.Count();
+    latency->p50 = h.Percentile(50);
+    latency->p90 = h.Percentile(90);
+    latency->p99 = h.Percentile(99);
+    latency->p999 = h.Percentile(99.9);
+    latency->max = h.Max();
+}
+
 TcpServer::TcpServer(IServerReceiver *service)
     : _service(service)
+    , _batch_service(dynamic_cast<IServerBatchReceiver*>(service))
+    , _connect_service(dynamic_cast<internal::IConnectReceiver*>(service))
     , _proto(nullptr)
-    , _shutdown(true) {}
+    , _tls(nullptr)
+    , _codec(nullptr)
+    , _shutdown(true)
+    , _mgr_used(0)
+    , _free_head(InvalidIndex)
+    , _free_tail(InvalidIndex) {}
 
 TcpServer::~TcpServer() {
     if (!_shutdown) {
@@ -53,44 +136,164 @@ TcpServer::~TcpServer() {
 raptor_error TcpServer::Init(const RaptorOptions* options) {
     if (!_shutdown) return RAPTOR_ERROR_FROM_STATIC_STRING("tcp server already running");
 
-    _listener = std::make_shared<TcpListener>(this);
-    _recv_thread = std::make_shared<SendRecvThread>(this);
-    _send_thread = std::make_shared<SendRecvThread>(this);
+    _options = *options;
+    if (_options.reactor_threads == 0) {
+        _options.reactor_threads = raptor_get_number_of_cpu_cores();
+    }
+    if (_options.socket_profile.busy_poll_us == 0) {
+        _options.socket_profile.busy_poll_us = _options.busy_poll_us;
+    }
 
-    auto e = _listener->Init();
+    CpuAffinity reactor_cpus, listener_cpus, dispatch_cpus;
+    auto e = reactor_cpus.Parse(_options.reactor_cpus);
+    if (e == RAPTOR_ERROR_NONE) e = listener_cpus.Parse(_options.listener_cpus);
+    if (e == RAPTOR_ERROR_NONE) e = dispatch_cpus.Parse(_options.dispatch_cpus);
     if (e != RAPTOR_ERROR_NONE) {
         return e;
     }
+    // the pointers are not kept
+    _options.reactor_cpus = nullptr;
+    _options.listener_cpus = nullptr;
+    _options.dispatch_cpus = nullptr;
+
+    if (_options.capture_file) {
+        _capture.reset(new TrafficCapture);
+        // a region per reactor, written by the connections on it
+        e = _capture->Open(_options.capture_file,
+            (_options.capture_max_bytes > 0) ? _options.capture_max_bytes : DEFAULT_CAPTURE_BYTES,
+            _options.reactor_threads);
+        if (e != RAPTOR_ERROR_NONE) {
+            _capture.reset();
+            return e;
+        }
+        _options.capture_file = nullptr;
+    }
+    _capture_counter.Store(0);
 
-    e = _recv_thread->Init();
+    _connector.reset(new TcpConnector(this));
+    e = _connector->Init();
     if (e != RAPTOR_ERROR_NONE) {
         return e;
     }
+    _resolve_guard = std::make_shared<ResolveGuard<TcpServer>>(this);
+
+    _recv_threads.clear();
+    _send_threads.clear();
+    for (size_t i = 0; i < _options.reactor_threads; i++) {
+        // the recv and send threads of a reactor share its cpus
+        Thread::Options thread_options;
+        thread_options.SetAffinity(reactor_cpus.Select(i));
+        auto rt = std::make_shared<SendRecvThread>(this);
+        e = rt->Init(thread_options, _options.epoll_events, _options.busy_poll_us);
+        if (e != RAPTOR_ERROR_NONE) {
+            return e;
+        }
+        auto st = rt;
+        if (!_options.single_epoll) {
+            st = std::make_shared<SendRecvThread>(this);
+            e = st->Init(thread_options, _options.epoll_events, _options.busy_poll_us);
+            if (e != RAPTOR_ERROR_NONE) {
+                return e;
+            }
+        }
+        _recv_threads.push_back(rt);
+        _send_threads.push_back(st);
+    }
+    _next_reactor = 0;
+
+    _cpu_reactor.clear();
+    if (_options.cpu_steering) {
+        for (size_t i = 0; i < _options.reactor_threads; i++) {
+            std::vector<int> cpus = reactor_cpus.Select(i);
+            if (cpus.size() != 1) {
+                continue;
+            }
+            size_t cpu = static_cast<size_t>(cpus[0]);
+            if (cpu >= _cpu_reactor.size()) {
+                _cpu_reactor.resize(cpu + 1, -1);
+            }
+            if (_cpu_reactor[cpu] < 0) {
+                _cpu_reactor[cpu] = static_cast<int>(i);
+            }
+        }
+    }
+
+    time_t n = time(0);
+    _magic_number = (n >> 16) & 0xffff;
 
-    e = _send_thread->Init();
+    _listener = std::make_shared<TcpListener>(this);
+    if (_options.reactor_accept) {
+        std::vector<SendRecvThread*> reactors;
+        for (auto& rt : _recv_threads) {
+            reactors.push_back(rt.get());
+        }
+        // tags of listening sockets never pass as a connection id
+        _listener->PollOnReactors(reactors, static_cast<uint16_t>(~_magic_number));
+    }
+    if (_options.cpu_steering && _options.reuse_port_listening) {
+        _listener->SetCpuSteering(_cpu_reactor);
+    }
+    e = _listener->Init(_options.reactor_threads,
+        _options.reuse_port_listening != 0, _options.accept_batch_size, listener_cpus,
+        &_options.socket_profile);
     if (e != RAPTOR_ERROR_NONE) {
         return e;
     }
+    // the timers run on the monotonic clock, n is wall time
+    int64_t now_ms = UpdateCoarseClock();
+    time_t now = static_cast<time_t>(now_ms / 1000);
+    _timers.clear();
+    for (size_t i = 0; i < _options.reactor_threads; i++) {
+        _timers.emplace_back(new ReactorTimer(now, now_ms));
+    }
+    _next_timer_id.Store(0);
+    _paused_count.Store(0);
+    _overloaded_workers = 0;
+    _memory_stalled.clear();
+    _memory_stalled_count.Store(0);
+    _memory_check_ms.Store(0);
+    _open_connections.Store(0);
+    _counters.reset(new ServerCounters[_options.reactor_threads]);
 
     _shutdown = false;
-    _options = *options;
-    _count.Store(0);
-
-    _mq_thd = Thread(
+    if (_options.dispatch_threads == 0) {
+        _options.dispatch_threads = 1;
+    }
+    if (_options.idle_compact_seconds == 0) {
+        _options.idle_compact_seconds = 30;
+    }
+    _workers.clear();
+    for (size_t i = 0; i < _options.dispatch_threads && !_options.inline_dispatch; i++) {
+        std::unique_ptr<DispatchWorker> worker(new DispatchWorker);
+        Thread::Options mq_options;
+        mq_options.SetAffinity(dispatch_cpus.Select(i));
+        worker->thd = Thread(
             "message_queue",
             std::bind(&TcpServer::MessageQueueThread, this, std::placeholders::_1)
-            , nullptr);
+            , worker.get(), nullptr, mq_options);
+        _workers.push_back(std::move(worker));
+    }
 
-    _conn_mtx.Lock();
-    _mgr.resize(RESERVED_CONNECTION_COUNT);
-    for (size_t i = 0; i < RESERVED_CONNECTION_COUNT; i++) {
-        _free_index_list.push_back(i);
+    if (_options.max_connections > core::MaxConnectionIndex + 1) {
+        log_error("tcpserver: max_connections is limited to %u", core::MaxConnectionIndex + 1);
+        _options.max_connections = core::MaxConnectionIndex + 1;
     }
+
+    _conn_mtx.Lock();
+    _mgr.Reset(_options.max_connections);
+    _mgr_used = 0;
+    _free_head = InvalidIndex;
+    _free_tail = InvalidIndex;
     _conn_mtx.Unlock();
 
-    time_t n = Now();
-    _magic_number = (n >> 16) & 0xffff;
-    _last_timeout_time.Store(n);
+    size_t per_reactor =
+        (_options.max_connections + _options.reactor_threads - 1) / _options.reactor_threads;
+    _pools.clear();
+    for (size_t i = 0; i < _options.reactor_threads; i++) {
+        _pools.emplace_back(
+            new ConnectionPool(this, per_reactor, PREALLOCATED_CONNECTIONS_PER_REACTOR));
+    }
+
     return RAPTOR_ERROR_NONE;
 }
 
@@ -117,51 +320,123 @@ raptor_error TcpServer::AddListening(const char* addr) {
     return ret;
 }
 
+raptor_error TcpServer::AdoptListening(int fd) {
+    if (_shutdown) return RAPTOR_ERROR_FROM_STATIC_STRING("tcp server uninitialized");
+    if (fd < 0) return RAPTOR_ERROR_FROM_STATIC_STRING("invalid parameters");
+    return _listener->AdoptListeningSocket(fd);
+}
+
+size_t TcpServer::GetListeningFds(int* fds, size_t count) {
+    if (_shutdown) return 0;
+    return _listener->GetListeningFds(fds, count);
+}
+
+void TcpServer::Drain() {
+    if (_shutdown) return;
+    _listener->Drain();
+}
+
 raptor_error TcpServer::Start() {
     if (!_listener->StartListening()) {
         return RAPTOR_ERROR_FROM_STATIC_STRING("failed to start listener");
     }
-    if (!_recv_thread->Start()) {
-        return RAPTOR_ERROR_FROM_STATIC_STRING("failed to start recv thread");
+    for (size_t i = 0; i < _recv_threads.size(); i++) {
+        if (!_recv_threads[i]->Start()) {
+            return RAPTOR_ERROR_FROM_STATIC_STRING("failed to start recv thread");
+        }
+        if (_send_threads[i] != _recv_threads[i] && !_send_threads[i]->Start()) {
+            return RAPTOR_ERROR_FROM_STATIC_STRING("failed to start send thread");
+        }
     }
-    if (!_send_thread->Start()) {
-        return RAPTOR_ERROR_FROM_STATIC_STRING("failed to start send thread");
+    for (auto& worker : _workers) {
+        worker->thd.Start();
     }
-    _mq_thd.Start();
     return RAPTOR_ERROR_NONE;
 }
 
 void TcpServer::Shutdown() {
     if (!_shutdown) {
         _shutdown = true;
-        _listener->Shutdown();
-        _recv_thread->Shutdown();
-        _send_thread->Shutdown();
-        _cv.Signal();
-        _mq_thd.Join();
+        // with reactor_accept the reactors may still be accepting
+        if (!_options.reactor_accept) {
+            _listener->Shutdown();
+        }
+        // the slots reserved by pending connects are reset below
+        _resolve_guard->Cancel();
+        _connector->Shutdown();
+        for (size_t i = 0; i < _recv_threads.size(); i++) {
+            _recv_threads[i]->Shutdown();
+            _send_threads[i]->Shutdown();
+        }
+        if (_options.reactor_accept) {
+            _listener->Shutdown();
+        }
+        for (auto& worker : _workers) {
+            {
+                AutoMutex g(&worker->mutex);
+                worker->cv.Signal();
+            }
+            worker->thd.Join();
+        }
 
+        // the user timers are called with fired 0 once nothing runs
+        std::vector<UserTimers::Timer*> user_timers;
+        for (auto& timer : _timers) {
+            AutoMutex g(&timer->mtx);
+            timer->wheel.Clear();
+            timer->paused.clear();
+            timer->user.TakeAll(&user_timers);
+        }
+        _paused_count.Store(0);
         _conn_mtx.Lock();
-        _timeout_record_list.clear();
-        _free_index_list.clear();
-        for (auto& obj : _mgr) {
-            if (obj.first) {
-                obj.first->Shutdown(false);
-                obj.first.reset();
+        _free_head = InvalidIndex;
+        _free_tail = InvalidIndex;
+        for (uint32_t i = 0; i < _mgr_used; i++) {
+            Connection* con = _mgr.At(i).con.Exchange(nullptr, MemoryOrder::ACQ_REL);
+            if (con) {
+                con->Shutdown(false);
+                Epoch::Retire(con, ConnectionPool::Recycle);
             }
         }
-        _mgr.clear();
+        _mgr_used = 0;
         _conn_mtx.Unlock();
 
+        // the pools must outlive every retired connection, readers of
+        // other servers can only delay this for a short while.
+        for (auto& pool : _pools) {
+            while (pool->Outstanding() > 0) {
+                if (Epoch::Reclaim() > 0) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+        _capture.reset();
+
         // clear message queue
-        bool empty = true;
-        do {
-            auto n = _mpscq.PopAndCheckEnd(&empty);
-            auto msg = reinterpret_cast<TcpMessageNode*>(n);
-            if (msg != nullptr) {
-                _count.FetchSub(1, MemoryOrder::RELAXED);
-                delete msg;
+        for (auto& worker : _workers) {
+            for (auto& lane : worker->lanes) {
+                bool empty = true;
+                do {
+                    auto n = lane.PopAndCheckEnd(&empty);
+                    auto msg = reinterpret_cast<TcpMessageNode*>(n);
+                    if (msg != nullptr) {
+                        worker->AddDispatched(1, msg->slice.size());
+                        if (msg->type == MessageType::kTimer) {
+                            user_timers.push_back(msg->timer);
+                        }
+                        DeleteMessageNode(msg);
+                    }
+                } while (!empty);
             }
-        } while (!empty);
+            worker->stalled.clear();
+            worker->overloaded.Store(false);
+        }
+        for (auto timer : user_timers) {
+            UserTimers::Run(timer, false);
+        }
+        _overloaded_workers = 0;
+        _memory_stalled.clear();
+        _memory_stalled_count.Store(0);
     }
 }
 
@@ -169,322 +444,1722 @@ void TcpServer::SetProtocol(IProtocol* proto) {
     _proto = proto;
 }
 
+raptor_error TcpServer::SetTlsProvider(ITlsProvider* tls) {
+#ifdef RAPTOR_HAVE_KTLS
+    _tls = tls;
+    return RAPTOR_ERROR_NONE;
+#else
+    return tls ? RAPTOR_ERROR_FROM_STATIC_STRING("built without kernel TLS support")
+               : RAPTOR_ERROR_NONE;
+#endif
+}
+
+raptor_error TcpServer::SetCodec(IMessageCodec* codec) {
+    _codec = codec;
+    return RAPTOR_ERROR_NONE;
+}
+
 bool TcpServer::Send(ConnectionId cid, const void* buf, size_t len) {
     return SendWithHeader(cid, nullptr, 0, buf, len);
 }
 
 bool TcpServer::SendWithHeader(ConnectionId cid,
         const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
-    uint32_t index = CheckConnectionId(cid);
-    if (index == InvalidIndex) {
-        return false;
-    }
+    return TrySendWithHeader(cid, hdr, hdr_len, data, data_len) == RAPTOR_SEND_OK;
+}
 
-    auto con = GetConnection(index);
+int TcpServer::TrySendWithHeader(ConnectionId cid,
+        const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
+    if (RejectSend()) {
+        return RAPTOR_SEND_FAILED;
+    }
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
     if (con) {
+        CorkSend(con);
+        if (_codec) {
+            raptor_iovec iov[2] = { { hdr, hdr_len }, { data, data_len } };
+            Slice encoded;
+            if (EncodePackage(cid, iov, 2, &encoded)) {
+                return con->SendSlice(encoded);
+            }
+        }
         return con->SendWithHeader(hdr, hdr_len, data, data_len);
     }
-    return false;
+    return RAPTOR_SEND_FAILED;
 }
 
-bool TcpServer::CloseConnection(ConnectionId cid){
-    uint32_t index = CheckConnectionId(cid);
-    if (index == InvalidIndex) {
+bool TcpServer::SendV(ConnectionId cid, const raptor_iovec* iov, size_t count) {
+    if (RejectSend()) {
         return false;
     }
-
-    auto con = GetConnection(index);
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
     if (con) {
-        con->Shutdown(false);
-        DeleteConnection(index);
+        CorkSend(con);
+        Slice encoded;
+        if (_codec && EncodePackage(cid, iov, count, &encoded)) {
+            return con->SendSlice(encoded) == RAPTOR_SEND_OK;
+        }
+        return con->SendV(iov, count) == RAPTOR_SEND_OK;
     }
-    return true;
+    return false;
 }
 
-// IAcceptor implement
-void TcpServer::OnNewConnection(int sock,
-    int listen_port, const raptor_resolved_address* addr) {
-    AutoMutex g(&_conn_mtx);
-
-    if (_free_index_list.empty() && _mgr.size() >= _options.max_connections) {
-        log_error("The maximum number of connections has been reached: %u", _options.max_connections);
-        raptor_set_socket_shutdown(sock);
-        return;
+int TcpServer::SendWithToken(ConnectionId cid, const raptor_iovec* iov, size_t count, uint64_t token) {
+    if (RejectSend()) {
+        return RAPTOR_SEND_FAILED;
+    }
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (con) {
+        CorkSend(con);
+        Slice encoded;
+        if (_codec && EncodePackage(cid, iov, count, &encoded)) {
+            raptor_iovec whole = { encoded.begin(), encoded.size() };
+            return con->SendV(&whole, 1, &token);
+        }
+        return con->SendV(iov, count, &token);
     }
+    return RAPTOR_SEND_FAILED;
+}
 
-    if (_free_index_list.empty()) {
-        size_t count = _mgr.size();
-        size_t expand = ((count * 2) < _options.max_connections) ? (count * 2) : _options.max_connections;
-        _mgr.resize(expand);
-        for (size_t i = count; i < expand; i++) {
-            _mgr[i].first = nullptr;
-            _mgr[i].second = _timeout_record_list.end();
-            _free_index_list.push_back(i);
+bool TcpServer::AllocSendBuffer(ConnectionId cid, size_t size, SendBuffer* buf) {
+    {
+        EpochGuard guard;
+        Connection* con = GetConnection(cid);
+        if (!con || !con->IsOnline()) {
+            return false;
         }
     }
+    LendSendBuffer(size, buf);
+    return true;
+}
 
-    uint32_t index = _free_index_list.front();
-    _free_index_list.pop_front();
+bool TcpServer::CommitSend(ConnectionId cid, SendBuffer* buf, size_t used) {
+    Slice s = ReclaimSendBuffer(buf, used);
+    if (s.Empty()) {
+        return used == 0;
+    }
+    if (RejectSend()) {
+        return false;
+    }
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (con) {
+        CorkSend(con);
+        return con->SendSlice(s) == RAPTOR_SEND_OK;
+    }
+    return false;
+}
 
-    ConnectionId cid = core::BuildConnectionId(_magic_number, listen_port, index);
-    time_t deadline_seconds = Now() + _options.connection_timeout;
+size_t TcpServer::Broadcast(const ConnectionId* cids, size_t count,
+        const void* data, size_t len) {
+    if (count == 0 || !data || len == 0 || RejectSend()) {
+        return 0;
+    }
 
-    _mgr[index].first = std::make_shared<Connection>(this);
-    _mgr[index].first->SetProtocol(_proto);
-    _mgr[index].first->Init(cid, sock, addr, _recv_thread.get(), _send_thread.get());
-    _mgr[index].second = _timeout_record_list.insert({deadline_seconds, index});
+    // one copy, every connection queues a reference to it. The
+    // encoded form is made once too, by the first connection asking.
+    Slice payload(data, len);
+    Slice encoded;
+    bool encode_tried = false;
+    size_t sent = 0;
+    EpochGuard guard;
+    for (size_t i = 0; i < count; i++) {
+        Connection* con = GetConnection(cids[i]);
+        if (!con) {
+            continue;
+        }
+        CorkSend(con);
+        const Slice* s = &payload;
+        if (_codec && _mgr.At(core::GetConnectionIndex(cids[i])).codec.Load(MemoryOrder::RELAXED)) {
+            if (!encode_tried) {
+                raptor_iovec iov = { data, len };
+                EncodePackage(cids[i], &iov, 1, &encoded);
+                encode_tried = true;
+            }
+            if (!encoded.Empty()) {
+                s = &encoded;
+            }
+        }
+        if (con->SendSlice(*s) == RAPTOR_SEND_OK) {
+            sent++;
+        }
+    }
+    return sent;
 }
 
-// Receiver implement (epoll event)
-void TcpServer::OnErrorEvent(void* ptr) {
-    ConnectionId cid = (ConnectionId)ptr;
-    uint32_t index = CheckConnectionId(cid);
-    if (index == InvalidIndex) {
-        log_error("tcpserver: OnErrorEvent found invalid index, cid = %x", cid);
-        return;
+bool TcpServer::SendZeroCopy(ConnectionId cid, const void* ptr, size_t len,
+        raptor_buffer_release_callback release, void* ctx) {
+    // release runs when the last reference to s goes away
+    Slice s = MakeSliceByExternal(ptr, len, release, ctx);
+    if (!ptr || len == 0 || RejectSend()) {
+        return false;
     }
-
-    auto con = GetConnection(index);
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
     if (con) {
-        con->Shutdown(true);
-        DeleteConnection(index);
+        CorkSend(con);
+        return con->SendSlice(s) == RAPTOR_SEND_OK;
     }
+    return false;
 }
 
-void TcpServer::OnRecvEvent(void* ptr) {
-    ConnectionId cid = (ConnectionId)ptr;
-    uint32_t index = CheckConnectionId(cid);
-    if (index == InvalidIndex) {
-        log_error("tcpserver: OnRecvEvent found invalid index, cid = %x", cid);
-        return;
+bool TcpServer::SendFile(ConnectionId cid, raptor_file_t file, uint64_t offset,
+        uint64_t length, raptor_send_file_callback done, void* ctx) {
+    if (length > 0) {
+        EpochGuard guard;
+        Connection* con = GetConnection(cid);
+        if (con && con->SendFile(file, offset, length, done, ctx)) {
+            return true;
+        }
     }
-
-    auto con = GetConnection(index);
-    if (!con) return;
-    if (con->DoRecvEvent()) {
-        RefreshTime(index);
-        return;
+    if (done) {
+        done(cid, 0, ctx);
     }
-    con->Shutdown(true);
-    DeleteConnection(index);
-    log_error("tcpserver: Failed to post async recv");
+    return false;
 }
 
-void TcpServer::OnSendEvent(void* ptr) {
-    ConnectionId cid = (ConnectionId)ptr;
+bool TcpServer::CloseConnection(ConnectionId cid){
     uint32_t index = CheckConnectionId(cid);
     if (index == InvalidIndex) {
-        log_error("tcpserver: OnRecvEvent found invalid index, cid = %x", cid);
-        return;
+        return false;
     }
 
-    auto con = GetConnection(index);
-    if (!con) return;
-    if (con->DoSendEvent()) {
-        RefreshTime(index);
-        return;
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (con) {
+        RemoveConnection(con, false);
     }
-    con->Shutdown(true);
-    DeleteConnection(index);
-    log_error("tcpserver: Failed to post async send");
+    return true;
 }
 
-void TcpServer::OnCheckingEvent(time_t current) {
-
-    // At least 3s to check once
-    if (current - _last_timeout_time.Load() < 3) {
-        return;
+void TcpServer::GetStats(RaptorStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!_counters) return;
+    for (size_t i = 0; i < _recv_threads.size(); i++) {
+        const ServerCounters& c = _counters[i];
+        stats->accepted += c.accepted.Load();
+        stats->closed += c.closed.Load();
+        stats->timeouts += c.timeouts.Load();
+        stats->protocol_errors += c.protocol_errors.Load();
+        stats->bytes_received += c.bytes_received.Load();
+        stats->bytes_sent += c.bytes_sent.Load();
+        stats->messages_received += c.messages_received.Load();
+        stats->messages_sent += c.messages_sent.Load();
+        stats->send_queued_bytes += c.send_queued_bytes.Load();
+        stats->idle_compactions += c.idle_compactions.Load();
+        stats->overload_pauses += c.overload_pauses.Load();
+        stats->memory_evictions += c.memory_evictions.Load();
+        stats->connection_memory += c.ring_bytes.Load() + c.recv_buffered_bytes.Load();
+        stats->epoll_wakeups += _recv_threads[i]->Wakeups();
+        stats->epoll_events += _recv_threads[i]->Events();
+        if (_send_threads[i] != _recv_threads[i]) {
+            stats->epoll_wakeups += _send_threads[i]->Wakeups();
+            stats->epoll_events += _send_threads[i]->Events();
+        }
+    }
+    if (_listener) {
+        _listener->GetAcceptCounters(&stats->accept_wakeups, &stats->accept_batched);
+    }
+    stats->buffer_memory = BufferedBytes();
+    stats->live_connection_objects = IomgrLiveObjects(IomgrType::kConnection);
+    stats->live_slices = IomgrLiveObjects(IomgrType::kSlice);
+    stats->live_message_nodes = IomgrLiveObjects(IomgrType::kMessage);
+    for (auto& worker : _workers) {
+        // read apart, a message may be dispatched before it shows as posted
+        uint64_t dispatched = worker->dispatched.Load();
+        uint64_t posted = worker->posted.Load();
+        stats->dispatch_queue_depth += (posted > dispatched) ? posted - dispatched : 0;
+        dispatched = worker->dispatched_bytes.Load();
+        posted = worker->posted_bytes.Load();
+        stats->dispatch_queue_bytes += (posted > dispatched) ? posted - dispatched : 0;
+        stats->slow_callbacks += worker->slow_callbacks.Load();
     }
-    _last_timeout_time.Store(current);
-
-    AutoMutex g(&_conn_mtx);
 
-    auto it = _timeout_record_list.begin();
-    while (it != _timeout_record_list.end()) {
-        if (it->first > current) {
-            break;
+    if (_options.record_latency && !_workers.empty()) {
+        std::unique_ptr<Histogram> queue_delay(new Histogram);
+        std::unique_ptr<Histogram> callback_time(new Histogram);
+        for (auto& worker : _workers) {
+            queue_delay->Merge(worker->queue_delay);
+            callback_time->Merge(worker->callback_time);
         }
-
-        uint32_t index = it->second;
-
-        ++it;
-
-        _mgr[index].first->Shutdown(true);
-        _mgr[index].first.reset();
-        _timeout_record_list.erase(_mgr[index].second);
-        _mgr[index].second = _timeout_record_list.end();
-        _free_index_list.push_back(index);
+        FillLatency(*queue_delay, &stats->queue_delay);
+        FillLatency(*callback_time, &stats->callback_time);
     }
-}
-
-// ServiceInterface implement
-void TcpServer::OnConnectionArrived(ConnectionId cid, const raptor_resolved_address* addr) {
-    TcpMessageNode* msg = new TcpMessageNode;
-    msg->cid = cid;
-    msg->addr = *addr;
-    msg->type = MessageType::kNewConnection;
-    _mpscq.push(&msg->node);
-    _count.FetchAdd(1, MemoryOrder::ACQ_REL);
-    _cv.Signal();
-}
-
-void TcpServer::OnDataReceived(ConnectionId cid, const Slice* s) {
-    TcpMessageNode* msg = new TcpMessageNode;
-    msg->cid = cid;
-    msg->slice = *s;
-    msg->type = MessageType::kRecvAMessage;
-    _mpscq.push(&msg->node);
-    _count.FetchAdd(1, MemoryOrder::ACQ_REL);
-    _cv.Signal();
-}
 
-void TcpServer::OnConnectionClosed(ConnectionId cid) {
-    TcpMessageNode* msg = new TcpMessageNode;
-    msg->cid = cid;
-    msg->type = MessageType::kCloseClient;
-    _mpscq.push(&msg->node);
-    _count.FetchAdd(1, MemoryOrder::ACQ_REL);
-    _cv.Signal();
+    stats->connections = _open_connections.Load(MemoryOrder::RELAXED);
+    stats->connection_memory += stats->connections * sizeof(Connection) + stats->send_queued_bytes;
+    if (stats->connections > 0) {
+        stats->memory_per_connection = stats->connection_memory / stats->connections;
+    }
 }
 
-void TcpServer::MessageQueueThread(void* ptr) {
-    while (!_shutdown) {
-        RaptorMutexLock(_mutex);
-
-        while (_count.Load() == 0) {
-            _cv.Wait(&_mutex);
-            if (_shutdown) {
-                RaptorMutexUnlock(_mutex);
-                return;
+// IAcceptor implement
+void TcpServer::OnNewConnections(
+    const AcceptedSocket* socks, size_t count, int shard) {
+    // Slots are reserved under _conn_mtx, the connections are set up
+    // outside of it since Init may run OnConnected (inline dispatch).
+    uint32_t indexes[RESERVE_BATCH_SIZE];
+    uint32_t reactors[RESERVE_BATCH_SIZE];
+    for (size_t base = 0; base < count; base += RESERVE_BATCH_SIZE) {
+        size_t n = RAPTOR_MIN(count - base, static_cast<size_t>(RESERVE_BATCH_SIZE));
+        for (size_t i = 0; i < n; i++) {
+            // a connection stays on the same reactor for its whole lifetime,
+            // sharded listeners keep it on the reactor that accepted it.
+            reactors[i] = (shard >= 0) ? static_cast<uint32_t>(shard) : InvalidIndex;
+            if (shard < 0 && _options.cpu_steering) {
+                reactors[i] = SteerReactor(socks[base + i].fd);
             }
         }
-        auto n = _mpscq.pop();
-        auto msg = reinterpret_cast<struct TcpMessageNode*>(n);
+        _conn_mtx.Lock();
+        for (size_t i = 0; i < n; i++) {
+            indexes[i] = ReserveIndex();
+            uint32_t reactor = (reactors[i] != InvalidIndex) ? reactors[i] : _next_reactor++;
+            reactors[i] = reactor % _recv_threads.size();
+        }
+        _conn_mtx.Unlock();
 
-        if (msg != nullptr) {
-            _count.FetchSub(1, MemoryOrder::RELAXED);
-            this->Dispatch(msg);
-            delete msg;
+        for (size_t i = 0; i < n; i++) {
+            const AcceptedSocket& sock = socks[base + i];
+            ConnectionId cid = (indexes[i] != InvalidIndex)
+                ? NewConnectionId(indexes[i], static_cast<uint16_t>(sock.listen_port))
+                : core::InvalidConnectionId;
+            AddConnection(sock.fd, cid, &sock.addr, indexes[i], reactors[i], true);
         }
-        RaptorMutexUnlock(_mutex);
     }
 }
 
-void TcpServer::Dispatch(struct TcpMessageNode* msg) {
-    switch (msg->type) {
-    case MessageType::kNewConnection:
-        _service->OnConnected(msg->cid);
-        break;
-    case MessageType::kRecvAMessage:
-        _service->OnMessageReceived(msg->cid, msg->slice.begin(), msg->slice.size());
-        break;
-    case MessageType::kCloseClient:
-        _service->OnClosed(msg->cid);
-        break;
-    default:
-        log_error("unknow message type %d", static_cast<int>(msg->type));
-        break;
+uint32_t TcpServer::SteerReactor(int fd) {
+    int cpu = raptor_get_socket_incoming_cpu(fd);
+    if (cpu < 0) {
+        return InvalidIndex;
     }
-}
-
-void TcpServer::DeleteConnection(uint32_t index) {
-    AutoMutex g(&_conn_mtx);
-    if (!_mgr[index].first) {
-        return;
+    size_t c = static_cast<size_t>(cpu);
+    if (c < _cpu_reactor.size() && _cpu_reactor[c] >= 0) {
+        return static_cast<uint32_t>(_cpu_reactor[c]);
     }
-    _mgr[index].first.reset();
-    _timeout_record_list.erase(_mgr[index].second);
-    _mgr[index].second = _timeout_record_list.end();
-    _free_index_list.push_back(index);
+    return static_cast<uint32_t>(c % _recv_threads.size());
 }
 
-void TcpServer::RefreshTime(uint32_t index) {
-    AutoMutex g(&_conn_mtx);
-    if (!_mgr[index].first) {
-        return;
+raptor_error TcpServer::Connect(const char* addr, size_t timeout_ms, ConnectionId* cid) {
+    if (_shutdown) return RAPTOR_ERROR_FROM_STATIC_STRING("tcp server uninitialized");
+    if (!addr || !cid) return RAPTOR_ERROR_FROM_STATIC_STRING("invalid parameters");
+
+    // Numeric and cached addresses report errors here, a name
+    // lookup that fails later is reported by OnConnectFailed.
+    raptor_resolved_addresses* addrs = nullptr;
+    raptor_error e = RAPTOR_ERROR_NONE;
+    AsyncResolver* resolver = AsyncResolver::Instance();
+    bool resolved = resolver->ResolveNow(addr, nullptr, &addrs, &e);
+    if (resolved && e != RAPTOR_ERROR_NONE) {
+        return e;
     }
-    time_t deadline_seconds = Now() + _options.connection_timeout;
-    _timeout_record_list.erase(_mgr[index].second);
-    _mgr[index].second = _timeout_record_list.insert({deadline_seconds, index});
-}
 
-bool TcpServer::SetUserData(ConnectionId cid, void* ptr) {
-    uint32_t index = CheckConnectionId(cid);
+    _conn_mtx.Lock();
+    uint32_t index = ReserveIndex();
+    _conn_mtx.Unlock();
     if (index == InvalidIndex) {
-        return false;
+        raptor_resolved_addresses_destroy(addrs);
+        return RAPTOR_ERROR_FROM_STATIC_STRING("the maximum number of connections has been reached");
     }
 
-    auto con = GetConnection(index);
-    if (con) {
-        con->SetUserData(ptr);
-        return true;
+    *cid = NewConnectionId(index, 0);
+    if (resolved) {
+        e = StartConnect(*cid, &addrs->addrs[0], timeout_ms);
+        raptor_resolved_addresses_destroy(addrs);
+        if (e != RAPTOR_ERROR_NONE) {
+            *cid = core::InvalidConnectionId;
+        }
+        return e;
     }
-    return false;
+
+    ConnectionId pending = *cid;
+    std::shared_ptr<ResolveGuard<TcpServer>> guard = _resolve_guard;
+    resolver->Resolve(addr, nullptr,
+        [guard, pending, timeout_ms](raptor_error error, raptor_resolved_addresses* addrs) {
+            guard->Run([&](TcpServer* server) {
+                if (error == RAPTOR_ERROR_NONE) {
+                    error = server->StartConnect(pending, &addrs->addrs[0], timeout_ms);
+                } else {
+                    AutoMutex g(&server->_conn_mtx);
+                    server->ReleaseIndex(core::GetConnectionIndex(pending));
+                }
+                if (error != RAPTOR_ERROR_NONE) {
+                    server->NotifyConnectFailed(pending);
+                }
+            });
+            raptor_resolved_addresses_destroy(addrs);
+        });
+    return RAPTOR_ERROR_NONE;
 }
 
-bool TcpServer::GetUserData(ConnectionId cid, void** ptr) {
-    uint32_t index = CheckConnectionId(cid);
-    if (index == InvalidIndex) {
-        return false;
+uint64_t TcpServer::ScheduleTimer(ConnectionId cid, uint32_t delay_ms,
+    raptor_timer_callback cb, void* ctx) {
+    if (_shutdown || !cb) return 0;
+
+    uint64_t seq = _next_timer_id.FetchAdd(1, MemoryOrder::RELAXED) + 1;
+    uint32_t reactor = 0;
+    if (cid == RAPTOR_NO_CONNECTION) {
+        reactor = static_cast<uint32_t>(seq % _timers.size());
+    } else {
+        EpochGuard guard;
+        Connection* con = GetConnection(cid);
+        if (!con) {
+            return 0;
+        }
+        reactor = con->_reactor;
     }
-
-    auto con = GetConnection(index);
-    if (con) {
-        con->GetUserData(ptr);
-        return true;
+    uint64_t id = (seq << TIMER_REACTOR_BITS) | reactor;
+    // on the precise clock rounded up, the coarse one the timers are
+    // checked with lags it, so a timer is never early
+    int64_t deadline = (GetMonotonicNanoseconds() + 999999) / 1000000 + delay_ms;
+
+    auto& timer = _timers[reactor];
+    bool earliest = false;
+    {
+        AutoMutex g(&timer->mtx);
+        // Shutdown takes the timers under the lock after setting it
+        if (_shutdown) {
+            return 0;
+        }
+        earliest = timer->user.Add(id, cid, deadline, cb, ctx);
     }
-    return false;
+    // the recv thread itself computes its wait after this callback
+    if (earliest && SendRecvThread::Current() != _recv_threads[reactor].get()) {
+        _recv_threads[reactor]->Wakeup();
+    }
+    return id;
 }
 
-bool TcpServer::SetExtendInfo(ConnectionId cid, uint64_t data) {
-    uint32_t index = CheckConnectionId(cid);
-    if (index == InvalidIndex) {
+bool TcpServer::CancelTimer(uint64_t timer_id) {
+    uint32_t reactor = static_cast<uint32_t>(timer_id & ((1u << TIMER_REACTOR_BITS) - 1));
+    if (_shutdown || reactor >= _timers.size()) {
         return false;
     }
+    AutoMutex g(&_timers[reactor]->mtx);
+    return _timers[reactor]->user.Cancel(timer_id);
+}
 
-    auto con = GetConnection(index);
-    if (con) {
-        con->SetExtendInfo(data);
-        return true;
+uint32_t TcpServer::CurrentReactor() {
+    SendRecvThread* current = SendRecvThread::Current();
+    if (!current) {
+        return InvalidIndex;
     }
-    return false;
+    for (size_t i = 0; i < _recv_threads.size(); i++) {
+        if (_recv_threads[i].get() == current) {
+            return static_cast<uint32_t>(i);
+        }
+    }
+    return InvalidIndex;
 }
 
-bool TcpServer::GetExtendInfo(ConnectionId cid, uint64_t& data) {
-    uint32_t index = CheckConnectionId(cid);
-    if (index == InvalidIndex) {
-        return false;
+void TcpServer::RunUserTimers(uint32_t reactor) {
+    auto& timer = _timers[reactor];
+    int64_t now = GetCoarseMilliseconds();
+    if (timer->user.NextDeadline() > now) {
+        return;
     }
-
-    auto con = GetConnection(index);
-    if (con) {
-        con->GetExtendInfo(data);
-        return true;
+    std::vector<UserTimers::Timer*> expired;
+    {
+        AutoMutex g(&timer->mtx);
+        timer->user.Expire(now, &expired);
+    }
+    for (auto t : expired) {
+        if (_options.inline_dispatch) {
+            FireTimer(t);
+            continue;
+        }
+        // in order with the other callbacks of its connection
+        TcpMessageNode* msg = NewMessageNode();
+        msg->cid = t->cid;
+        msg->type = MessageType::kTimer;
+        msg->timer = t;
+        PostMessage(msg);
     }
-    return false;
 }
 
-uint32_t TcpServer::CheckConnectionId(ConnectionId cid) const {
-    uint32_t failure = InvalidIndex;
-    if (cid == core::InvalidConnectionId) {
-        return failure;
+void TcpServer::FireTimer(UserTimers::Timer* timer) {
+    bool fired = true;
+    if (timer->cid != RAPTOR_NO_CONNECTION) {
+        EpochGuard guard;
+        fired = (GetConnection(timer->cid) != nullptr);
     }
-    uint16_t magic = core::GetMagicNumber(cid);
-    if (magic != _magic_number) {
-        return failure;
+    UserTimers::Run(timer, fired);
+}
+
+raptor_error TcpServer::StartConnect(ConnectionId cid,
+    const raptor_resolved_address* addr, size_t timeout_ms) {
+    raptor_error e = _connector->Connect(addr, timeout_ms, cid);
+    if (e != RAPTOR_ERROR_NONE) {
+        AutoMutex g(&_conn_mtx);
+        ReleaseIndex(core::GetConnectionIndex(cid));
     }
+    return e;
+}
 
-    uint32_t uid = core::GetUserId(cid);
-    if (uid >= _options.max_connections) {
-        return failure;
+void TcpServer::OnConnectCompleted(
+    uint64_t tag, int fd, const raptor_resolved_address* addr) {
+    ConnectionId cid = static_cast<ConnectionId>(tag);
+    uint32_t index = core::GetConnectionIndex(cid);
+    if (fd >= 0) {
+        _conn_mtx.Lock();
+        uint32_t reactor = _next_reactor++ % _recv_threads.size();
+        _conn_mtx.Unlock();
+        if (AddConnection(fd, cid, addr, index, reactor, false)) {
+            return;
+        }
+    } else {
+        AutoMutex g(&_conn_mtx);
+        ReleaseIndex(index);
     }
-    return uid;
+    NotifyConnectFailed(cid);
 }
 
-std::shared_ptr<Connection> TcpServer::GetConnection(uint32_t index) {
-    AutoMutex g(&_conn_mtx);
-    auto obj = _mgr[index].first;
-    return obj;
+void TcpServer::NotifyConnectFailed(ConnectionId cid) {
+    if (!_connect_service) {
+        return;
+    }
+    if (_options.inline_dispatch) {
+        _connect_service->OnConnectFailed(cid);
+        return;
+    }
+    TcpMessageNode* msg = NewMessageNode();
+    msg->cid = cid;
+    msg->type = MessageType::kConnectFailed;
+    PostMessage(msg);
+}
+
+ConnectionId TcpServer::NewConnectionId(uint32_t index, uint16_t listen_port) {
+    ConnectionSlot& slot = _mgr.At(index);
+    slot.generation++;
+    // messages of the previous connection may still be queued, the
+    // new one has no order to keep with them
+    slot.lane.Store(RAPTOR_PRIORITY_NORMAL, MemoryOrder::RELAXED);
+    slot.priority.Store(RAPTOR_PRIORITY_NORMAL, MemoryOrder::RELAXED);
+    slot.codec.Store(false, MemoryOrder::RELAXED);
+    slot.callback_ns.Store(0, MemoryOrder::RELAXED);
+    return core::BuildConnectionId(
+        _magic_number, listen_port, core::BuildUserId(index, slot.generation));
+}
+
+bool TcpServer::AddConnection(int sock, ConnectionId cid,
+    const raptor_resolved_address* addr, uint32_t index, uint32_t reactor, bool accepted) {
+
+    Connection* con = nullptr;
+    if (index != InvalidIndex) {
+        con = _pools[reactor]->Acquire();
+        if (!con) {
+            // the reactor's share is used up, borrow from a neighbor
+            for (size_t i = 1; i < _pools.size() && !con; i++) {
+                con = _pools[(reactor + i) % _pools.size()]->Acquire();
+            }
+        }
+        if (!con) {
+            AutoMutex g(&_conn_mtx);
+            ReleaseIndex(index);
+            index = InvalidIndex;
+        }
+    }
+    if (index == InvalidIndex) {
+        log_error_ratelimited(1000,
+            "The maximum number of connections has been reached: %zu", _options.max_connections);
+        raptor_set_socket_shutdown(sock);
+        return false;
+    }
+
+    // the reserved slot is owned by this thread until it is published
+    ConnectionSlot& slot = _mgr.At(index);
+    // not on a reactor, whose loop may have slept for long
+    UpdateCoarseClock();
+    time_t now = Now();
+
+    con->SetProtocol(_proto);
+    con->EnableZeroCopy(_options.zerocopy_threshold);
+    con->SetSendWatermarks(_options.send_high_watermark, _options.send_low_watermark);
+    con->SetRateLimit(_options.max_package_per_second, static_cast<int>(_options.rate_limit_policy));
+    con->SetStreamThreshold(_options.stream_threshold);
+    con->SetCounters(&_counters[reactor]);
+    con->SetTlsProvider(accepted ? _tls : nullptr);
+    con->SetQuickAck(accepted && _options.socket_profile.quickack != 0);
+    con->SetRecvBudget(_options.recv_budget);
+    con->SetCapture((accepted && _capture && (_options.capture_sample <= 1
+        || _capture_counter.FetchAdd(1) % _options.capture_sample == 0)) ? _capture.get() : nullptr);
+    ServerCounters::Add(_counters[reactor].accepted, 1);
+    RAPTOR_TRACE(connected, RAPTOR_TRACE_CONNECTED, cid, 0);
+    con->_cid = cid;
+    con->_reactor = reactor;
+    con->_last_active.Store(now);
+    con->_timer.data = con;
+    bool first = false;
+    _open_connections.FetchAdd(1, MemoryOrder::ACQ_REL);
+    {
+        AutoMutex tg(&_timers[reactor]->mtx);
+        first = (_timers[reactor]->wheel.Size() == 0);
+        _timers[reactor]->wheel.Insert(&con->_timer,
+            now + RAPTOR_MIN(_options.connection_timeout, _options.idle_compact_seconds));
+    }
+    // an idle reactor may wait without a timeout, its first connection
+    // wakes it to start checking the timeouts of its wheel
+    if (first) {
+        _recv_threads[reactor]->Wakeup();
+    }
+    // an inline OnConnected may close it before Init returns
+    EpochGuard guard;
+    slot.con.Store(con, MemoryOrder::RELEASE);
+    con->Init(cid, sock, addr,
+        _recv_threads[reactor].get(), _send_threads[reactor].get());
+    return true;
+}
+
+// Receiver implement (epoll event)
+void TcpServer::OnErrorEvent(void* ptr) {
+    ConnectionId cid = (ConnectionId)ptr;
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (con) {
+        RemoveConnection(con, true);
+    }
+}
+
+void TcpServer::OnRecvEvent(void* ptr) {
+    if (_options.reactor_accept && _listener->IsListenerTag(ptr)) {
+        _listener->OnAcceptEvent(ptr);
+        return;
+    }
+    ConnectionId cid = (ConnectionId)ptr;
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (!con) return;
+    // inline callbacks reply to what this read delivered
+    if (_options.inline_dispatch) {
+        BeginCork();
+    }
+    bool ok = con->DoRecvEvent();
+    if (_options.inline_dispatch) {
+        EndCork();
+    }
+    if (ok) {
+        RefreshTime(con);
+        SchedulePausedRecv(con);
+        return;
+    }
+    if (RemoveConnection(con, true)) {
+        log_error_ratelimited(1000, "tcpserver: Failed to post async recv");
+    }
+}
+
+void TcpServer::BeginCork() {
+    if (_options.cork_window_us > 0) {
+        t_cork.server = this;
+    }
+}
+
+void TcpServer::EndCork() {
+    FlushCorked(true);
+    if (t_cork.server == this) {
+        t_cork.server = nullptr;
+    }
+}
+
+void TcpServer::CorkSend(Connection* con) {
+    if (t_cork.server == this && con->Cork()) {
+        if (t_cork.cids.empty()) {
+            t_cork.first_ns = GetMonotonicNanoseconds();
+        }
+        t_cork.cids.push_back(con->Id());
+    }
+}
+
+void TcpServer::FlushCorked(bool all) {
+    if (t_cork.server != this || t_cork.cids.empty()) {
+        return;
+    }
+    if (!all) {
+        int64_t window_ns = static_cast<int64_t>(_options.cork_window_us) * 1000;
+        if (GetMonotonicNanoseconds() - t_cork.first_ns < window_ns) {
+            return;
+        }
+    }
+    // an inline OnWritable sends at once while the list is walked
+    t_cork.server = nullptr;
+    for (ConnectionId cid : t_cork.cids) {
+        EpochGuard guard;
+        Connection* con = GetConnection(cid);
+        if (!con) {
+            continue;
+        }
+        con->Uncork();
+        // one gather write for everything held, the send
+        // thread takes over if the socket fills up
+        if (!con->DoSendEvent() && RemoveConnection(con, true)) {
+            log_error_ratelimited(1000, "tcpserver: Failed to flush corked sends");
+        }
+    }
+    t_cork.cids.clear();
+    t_cork.server = this;
+}
+
+void TcpServer::OnSendEvent(void* ptr) {
+    ConnectionId cid = (ConnectionId)ptr;
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (!con) return;
+    if (con->DoSendEvent()) {
+        RefreshTime(con);
+        return;
+    }
+    if (RemoveConnection(con, true)) {
+        log_error_ratelimited(1000, "tcpserver: Failed to post async send");
+    }
+}
+
+bool TcpServer::OnErrorQueueEvent(void* ptr) {
+    ConnectionId cid = (ConnectionId)ptr;
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (!con) return false;
+    return con->DoErrorQueueEvent();
+}
+
+void TcpServer::OnCheckingEvent(time_t current) {
+    uint32_t reactor = CurrentReactor();
+    if (reactor != InvalidIndex) {
+        RunUserTimers(reactor);
+        CheckTimeouts(reactor, current);
+    }
+    if (_paused_count.Load(MemoryOrder::ACQUIRE) > 0) {
+        ResumePausedRecvs();
+    }
+    if (_options.max_buffer_memory > 0) {
+        CheckMemoryBudget();
+    }
+}
+
+// Each reactor expires its own wheel on every wakeup. A wheel
+// advances by the second, so within one second this only costs the
+// mutex. A mass timeout is taken MAX_TIMEOUT_BATCH nodes at a time,
+// CheckingInterval lets the reactor come back at once for the rest.
+void TcpServer::CheckTimeouts(uint32_t reactor, time_t current) {
+    ReactorTimer* timer = _timers[reactor].get();
+
+    // A node waits for the earlier of the idle timeout and the
+    // compaction, a connection is compacted once per quiet period.
+    std::vector<ConnectionId> expired;
+    std::vector<ConnectionId> quiet;
+    int64_t tick = 0;
+    {
+        AutoMutex g(&timer->mtx);
+        tick = timer->wheel.Current();
+        timer->backlog = !timer->wheel.Expire(current, [&](TimingWheel::Node* node) {
+            Connection* con = reinterpret_cast<Connection*>(node->data);
+            time_t active = con->_last_active.Load();
+            time_t deadline = active + _options.connection_timeout;
+            if (deadline <= current) {
+                expired.push_back(con->Id());
+                return;
+            }
+            if (con->_compact_mark != active) {
+                time_t compact = active + _options.idle_compact_seconds;
+                if (compact <= current) {
+                    con->_compact_mark = active;
+                    quiet.push_back(con->Id());
+                } else {
+                    deadline = RAPTOR_MIN(deadline, compact);
+                }
+            }
+            timer->wheel.Insert(node, deadline);
+        }, MAX_TIMEOUT_BATCH);
+        if (timer->wheel.Current() == tick && expired.empty() && quiet.empty()) {
+            // still the same second
+            return;
+        }
+    }
+
+    for (auto cid : quiet) {
+        EpochGuard guard;
+        Connection* con = GetConnection(cid);
+        if (con) {
+            con->Compact();
+            ServerCounters::Add(_counters[con->_reactor].idle_compactions, 1);
+        }
+    }
+
+    for (auto cid : expired) {
+        EpochGuard guard;
+        Connection* con = GetConnection(cid);
+        if (con) {
+            uint32_t reactor = con->_reactor;
+            if (RemoveConnection(con, true)) {
+                ServerCounters::Add(_counters[reactor].timeouts, 1);
+            }
+        }
+    }
+    Epoch::Reclaim();
+}
+
+int TcpServer::CheckingInterval() {
+    int interval = (_open_connections.Load(MemoryOrder::ACQUIRE) > 0) ? 1000 : -1;
+    // a recv thread also wakes up for the next user timer of its reactor
+    uint32_t reactor = CurrentReactor();
+    if (reactor == InvalidIndex) {
+        return interval;
+    }
+    if (_timers[reactor]->backlog) {
+        return 0;
+    }
+    int64_t next = _timers[reactor]->user.NextDeadline();
+    if (next == INT64_MAX) {
+        return interval;
+    }
+    int64_t wait = RAPTOR_MAX(next - UpdateCoarseClock(), static_cast<int64_t>(0));
+    if (interval >= 0 && wait > interval) {
+        return interval;
+    }
+    return static_cast<int>(RAPTOR_MIN(wait, static_cast<int64_t>(INT32_MAX)));
+}
+
+// ServiceInterface implement
+void TcpServer::OnConnectionArrived(ConnectionId cid, const raptor_resolved_address* addr) {
+    if (_options.inline_dispatch) {
+        _service->OnConnected(cid);
+        return;
+    }
+    TcpMessageNode* msg = NewMessageNode();
+    msg->cid = cid;
+    msg->type = MessageType::kNewConnection;
+    PostMessage(msg);
+}
+
+void TcpServer::OnDataReceived(ConnectionId cid, Slice* s) {
+    if (_options.inline_dispatch) {
+        if (_codec && !DecodePackage(cid, s)) {
+            return;
+        }
+        Message m = { cid, s->begin(), s->size(), GetSliceHandle(*s) };
+        _service->OnMessage(&m);
+        return;
+    }
+    TcpMessageNode* msg = NewMessageNode();
+    msg->cid = cid;
+    msg->slice = std::move(*s);
+    msg->type = MessageType::kRecvAMessage;
+    if (_options.record_latency) {
+        msg->enqueue_ns = GetMonotonicNanoseconds();
+    }
+    PostMessage(msg);
+}
+
+bool TcpServer::OnPackagesReceived(ConnectionId cid, Slice* s, size_t count) {
+    if (_options.inline_dispatch && _batch_service) {
+        Message msgs[DISPATCH_BATCH_SIZE];
+        for (size_t base = 0; base < count; base += DISPATCH_BATCH_SIZE) {
+            size_t m = RAPTOR_MIN(count - base, static_cast<size_t>(DISPATCH_BATCH_SIZE));
+            size_t n = 0;
+            for (size_t i = 0; i < m; i++) {
+                Slice* pkg = &s[base + i];
+                if (_codec && !DecodePackage(cid, pkg)) {
+                    // the connection is closing, the rest is dropped
+                    break;
+                }
+                msgs[n].connection = cid;
+                msgs[n].data = pkg->begin();
+                msgs[n].length = pkg->size();
+                msgs[n].handle = GetSliceHandle(*pkg);
+                n++;
+            }
+            if (n > 0) {
+                _batch_service->OnMessagesReceived(msgs, n);
+            }
+            if (n < m) {
+                break;
+            }
+        }
+        return !CheckMemoryPause(cid);
+    }
+    for (size_t i = 0; i < count; i++) {
+        OnDataReceived(cid, &s[i]);
+    }
+    return KeepReading(cid);
+}
+
+bool TcpServer::KeepReading(ConnectionId cid) {
+    if (!_workers.empty()
+        && (_options.max_dispatch_queue_depth > 0 || _options.max_dispatch_queue_bytes > 0)
+        && CheckOverload(cid)) {
+        return false;
+    }
+    return !CheckMemoryPause(cid);
+}
+
+void TcpServer::OnStreamBegin(ConnectionId cid, size_t total) {
+    if (_options.inline_dispatch) {
+        _service->OnMessageBegin(cid, total);
+        return;
+    }
+    TcpMessageNode* msg = NewMessageNode();
+    msg->cid = cid;
+    msg->type = MessageType::kStreamBegin;
+    // a package length is an int
+    msg->count = static_cast<uint32_t>(total);
+    PostMessage(msg);
+}
+
+bool TcpServer::OnStreamChunk(ConnectionId cid, Slice* s) {
+    if (_options.inline_dispatch) {
+        Message m = { cid, s->begin(), s->size(), GetSliceHandle(*s) };
+        _service->OnMessageChunk(&m);
+        return !CheckMemoryPause(cid);
+    }
+    TcpMessageNode* msg = NewMessageNode();
+    msg->cid = cid;
+    msg->slice = std::move(*s);
+    msg->type = MessageType::kStreamChunk;
+    PostMessage(msg);
+    return KeepReading(cid);
+}
+
+void TcpServer::OnStreamEnd(ConnectionId cid) {
+    if (_options.inline_dispatch) {
+        _service->OnMessageEnd(cid);
+        return;
+    }
+    TcpMessageNode* msg = NewMessageNode();
+    msg->cid = cid;
+    msg->type = MessageType::kStreamEnd;
+    PostMessage(msg);
+}
+
+void TcpServer::OnConnectionClosed(ConnectionId cid) {
+    if (_options.inline_dispatch) {
+        _service->OnClosed(cid);
+        return;
+    }
+    TcpMessageNode* msg = NewMessageNode();
+    msg->cid = cid;
+    msg->type = MessageType::kCloseClient;
+    PostMessage(msg);
+}
+
+void TcpServer::OnZeroCopyCompleted(ConnectionId cid, uint32_t count) {
+    if (_options.inline_dispatch) {
+        _service->OnZeroCopyCompleted(cid, count);
+        return;
+    }
+    TcpMessageNode* msg = NewMessageNode();
+    msg->cid = cid;
+    msg->count = count;
+    msg->type = MessageType::kZeroCopyCompleted;
+    PostMessage(msg);
+}
+
+void TcpServer::OnWritable(ConnectionId cid) {
+    if (_options.inline_dispatch) {
+        _service->OnWritable(cid);
+        return;
+    }
+    TcpMessageNode* msg = NewMessageNode();
+    msg->cid = cid;
+    msg->type = MessageType::kWritable;
+    PostMessage(msg);
+}
+
+void TcpServer::OnSendCompleted(ConnectionId cid, const uint64_t* tokens, size_t count) {
+    if (_options.inline_dispatch) {
+        _service->OnSendCompleted(cid, tokens, count);
+        return;
+    }
+    TcpMessageNode* msg = NewMessageNode();
+    msg->cid = cid;
+    msg->type = MessageType::kSendCompleted;
+    msg->slice = Slice(tokens, count * sizeof(uint64_t));
+    PostMessage(msg);
+}
+
+void TcpServer::PostMessage(struct TcpMessageNode* msg) {
+    uint32_t index = core::GetConnectionIndex(msg->cid);
+    DispatchWorker* worker = _workers[index % _workers.size()].get();
+    uint8_t lane = RAPTOR_PRIORITY_NORMAL;
+    ConnectionSlot* slot = _mgr.Find(index);
+    if (slot) {
+        lane = slot->lane.Load(MemoryOrder::ACQUIRE);
+        uint8_t priority = slot->priority.Load(MemoryOrder::RELAXED);
+        if (priority != lane && slot->queued.Load(MemoryOrder::ACQUIRE) == 0) {
+            slot->lane.Store(priority, MemoryOrder::RELEASE);
+            lane = priority;
+        }
+        slot->queued.FetchAdd(1, MemoryOrder::ACQ_REL);
+    }
+    worker->posted.FetchAdd(1, MemoryOrder::RELAXED);
+    if ((_options.max_dispatch_queue_bytes > 0 || _options.max_buffer_memory > 0)
+        && msg->slice.size() > 0) {
+        worker->posted_bytes.FetchAdd(msg->slice.size(), MemoryOrder::RELAXED);
+    }
+    RAPTOR_TRACE(enqueue, RAPTOR_TRACE_ENQUEUE, msg->cid, msg->type);
+    // only the push that makes the queue non-empty has to wake
+    // the worker, it does not sleep while anything is queued.
+    if (worker->lanes[lane].push(&msg->node)) {
+        AutoMutex g(&worker->mutex);
+        worker->cv.Signal();
+    }
+}
+
+void TcpServer::MessageQueueThread(void* ptr) {
+    DispatchWorker* worker = reinterpret_cast<DispatchWorker*>(ptr);
+    // consecutive messages are collected for OnMessagesReceived
+    TcpMessageNode* batch[DISPATCH_BATCH_SIZE];
+    size_t count = 0;
+    BeginCork();
+    while (!_shutdown) {
+        bool empty = false;
+        auto msg = PopMessage(worker, &empty);
+        if (msg != nullptr) {
+            RAPTOR_TRACE(dequeue, RAPTOR_TRACE_DEQUEUE, msg->cid, msg->type);
+            if (_batch_service && msg->type == MessageType::kRecvAMessage) {
+                batch[count++] = msg;
+                if (count == DISPATCH_BATCH_SIZE) {
+                    DispatchBatch(worker, batch, count);
+                    count = 0;
+                    if (worker->overloaded.Load(MemoryOrder::RELAXED)) {
+                        CheckRecovered(worker);
+                    }
+                    FlushCorked(false);
+                }
+                continue;
+            }
+            if (count > 0) {
+                DispatchBatch(worker, batch, count);
+                count = 0;
+            }
+            // as posted, Dispatch may replace the slice by its decoded form
+            size_t bytes = msg->slice.size();
+            int64_t wall = 0;
+            int64_t cpu = 0;
+            if (_options.slow_callback_us > 0) {
+                wall = GetMonotonicNanoseconds();
+                cpu = GetThreadCpuNanoseconds();
+            }
+            if (_options.record_latency && msg->type == MessageType::kRecvAMessage) {
+                int64_t start = GetMonotonicNanoseconds();
+                worker->queue_delay.Record(start - msg->enqueue_ns);
+                this->Dispatch(msg);
+                worker->callback_time.Record(GetMonotonicNanoseconds() - start);
+            } else {
+                this->Dispatch(msg);
+            }
+            if (wall != 0) {
+                bool message = (msg->type == MessageType::kRecvAMessage);
+                RaptorSlowCallback info = { msg->cid, message ? 1u : 0u, message ? bytes : 0, 0, 0 };
+                CheckCallbackTime(worker, &msg, message ? 1 : 0, &info, wall, cpu);
+            }
+            worker->AddDispatched(1, bytes);
+            DeleteMessageNode(msg);
+            if (worker->overloaded.Load(MemoryOrder::RELAXED)) {
+                CheckRecovered(worker);
+            }
+            FlushCorked(false);
+            continue;
+        }
+        if (count > 0) {
+            DispatchBatch(worker, batch, count);
+            count = 0;
+        }
+        if (!empty) {
+            // a producer is in the middle of push
+            std::this_thread::yield();
+            continue;
+        }
+        // out of messages, nothing is held while waiting
+        FlushCorked(true);
+
+        // The producer signals under the mutex after its push,
+        // so checking again here cannot miss the wakeup. A producer
+        // only finds the worker overloaded under the mutex too, when
+        // it sees what has been dispatched, so the stalled connections
+        // cannot be left behind by an idle worker.
+        std::vector<ConnectionId> stalled;
+        bool recovered = false;
+        {
+            AutoMutex g(&worker->mutex);
+            recovered = TakeStalled(worker, &stalled);
+            while (!recovered && !_shutdown && worker->IsEmpty()) {
+                worker->cv.Wait(&worker->mutex);
+            }
+        }
+        if (recovered) {
+            ResumeStalled(stalled);
+        }
+        // what drained may have brought the memory budget back
+        if (_memory_stalled_count.Load(MemoryOrder::ACQUIRE) > 0) {
+            CheckMemoryBudget();
+        }
+    }
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        bytes += batch[i]->slice.size();
+        DeleteMessageNode(batch[i]);
+    }
+    worker->AddDispatched(count, bytes);
+    EndCork();
+}
+
+struct TcpMessageNode* TcpServer::PopMessage(DispatchWorker* worker, bool* empty) {
+    *empty = true;
+    // back to the first lane visited, with new credit
+    for (size_t i = 0; i <= RAPTOR_PRIORITY_LANES; i++) {
+        if (worker->credit > 0) {
+            bool lane_empty = true;
+            auto n = worker->lanes[worker->lane].PopAndCheckEnd(&lane_empty);
+            if (n != nullptr) {
+                worker->credit--;
+                auto msg = reinterpret_cast<struct TcpMessageNode*>(n);
+                ConnectionSlot* slot = _mgr.Find(core::GetConnectionIndex(msg->cid));
+                if (slot) {
+                    slot->queued.FetchSub(1, MemoryOrder::ACQ_REL);
+                }
+                return msg;
+            }
+            if (!lane_empty) {
+                *empty = false;
+            }
+        }
+        worker->lane = (worker->lane == 0) ? RAPTOR_PRIORITY_LANES - 1 : worker->lane - 1;
+        worker->credit = kLaneWeights[worker->lane];
+    }
+    return nullptr;
+}
+
+void TcpServer::DispatchBatch(
+    DispatchWorker* worker, struct TcpMessageNode** msgs, size_t count) {
+    int64_t start = _options.record_latency ? GetMonotonicNanoseconds() : 0;
+    // as posted, before decoding
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        bytes += msgs[i]->slice.size();
+    }
+    int64_t wall = 0;
+    int64_t cpu = 0;
+    if (_options.slow_callback_us > 0) {
+        wall = GetMonotonicNanoseconds();
+        cpu = GetThreadCpuNanoseconds();
+    }
+    Message batch[DISPATCH_BATCH_SIZE];
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (start != 0) {
+            worker->queue_delay.Record(start - msgs[i]->enqueue_ns);
+        }
+        if (_codec && !DecodePackage(msgs[i]->cid, &msgs[i]->slice)) {
+            continue;
+        }
+        batch[n].connection = msgs[i]->cid;
+        batch[n].data = msgs[i]->slice.begin();
+        batch[n].length = msgs[i]->slice.size();
+        batch[n].handle = GetSliceHandle(msgs[i]->slice);
+        n++;
+    }
+    if (n > 0) {
+        _batch_service->OnMessagesReceived(batch, n);
+    }
+    if (start != 0) {
+        // one sample per callback, not per message
+        worker->callback_time.Record(GetMonotonicNanoseconds() - start);
+    }
+    if (wall != 0) {
+        RaptorSlowCallback info = { msgs[0]->cid, count, static_cast<size_t>(bytes), 0, 0 };
+        CheckCallbackTime(worker, msgs, count, &info, wall, cpu);
+    }
+    for (size_t i = 0; i < count; i++) {
+        DeleteMessageNode(msgs[i]);
+    }
+    worker->AddDispatched(count, bytes);
+}
+
+void TcpServer::CheckCallbackTime(DispatchWorker* worker, struct TcpMessageNode** msgs,
+    size_t count, RaptorSlowCallback* info, int64_t wall_start, int64_t cpu_start) {
+    int64_t wall = GetMonotonicNanoseconds() - wall_start;
+    if (count > 0) {
+        // a batch is shared evenly by its messages
+        int64_t share = wall / static_cast<int64_t>(count);
+        for (size_t i = 0; i < count; i++) {
+            AtomicInt64& avg = _mgr.At(core::GetConnectionIndex(msgs[i]->cid)).callback_ns;
+            int64_t v = avg.Load(MemoryOrder::RELAXED);
+            avg.Store(v + (share - v) / 8, MemoryOrder::RELAXED);
+        }
+    }
+    if (wall < static_cast<int64_t>(_options.slow_callback_us) * 1000) {
+        return;
+    }
+    info->wall_us = static_cast<uint64_t>(wall / 1000);
+    info->cpu_us = static_cast<uint64_t>((GetThreadCpuNanoseconds() - cpu_start) / 1000);
+    worker->slow_callbacks.Store(
+        worker->slow_callbacks.Load(MemoryOrder::RELAXED) + 1, MemoryOrder::RELAXED);
+    _service->OnSlowCallback(*info);
+}
+
+bool TcpServer::OverBound(DispatchWorker* worker, uint64_t divisor) {
+    if (_options.max_dispatch_queue_depth > 0) {
+        uint64_t dispatched = worker->dispatched.Load(MemoryOrder::RELAXED);
+        uint64_t posted = worker->posted.Load(MemoryOrder::RELAXED);
+        if (posted > dispatched
+            && posted - dispatched > _options.max_dispatch_queue_depth / divisor) {
+            return true;
+        }
+    }
+    if (_options.max_dispatch_queue_bytes > 0) {
+        uint64_t dispatched = worker->dispatched_bytes.Load(MemoryOrder::RELAXED);
+        uint64_t posted = worker->posted_bytes.Load(MemoryOrder::RELAXED);
+        if (posted > dispatched
+            && posted - dispatched > _options.max_dispatch_queue_bytes / divisor) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The connection posting while the queue is over its bound is the one
+// paused, so the connections producing the backlog stop first and the
+// others keep being read until they add to it.
+bool TcpServer::CheckOverload(ConnectionId cid) {
+    size_t index = core::GetConnectionIndex(cid) % _workers.size();
+    DispatchWorker* worker = _workers[index].get();
+    if (!OverBound(worker, 1)) {
+        return false;
+    }
+    bool first = false;
+    {
+        AutoMutex g(&worker->mutex);
+        if (!OverBound(worker, 1)) {
+            return false;
+        }
+        if (!worker->overloaded.Load(MemoryOrder::RELAXED)) {
+            worker->overloaded.Store(true, MemoryOrder::RELAXED);
+            first = true;
+        }
+        worker->stalled.push_back(cid);
+    }
+    if (first) {
+        SetOverloaded(true);
+    }
+    return true;
+}
+
+bool TcpServer::TakeStalled(DispatchWorker* worker, std::vector<ConnectionId>* stalled) {
+    if (!worker->overloaded.Load(MemoryOrder::RELAXED) || OverBound(worker, 2)) {
+        return false;
+    }
+    worker->overloaded.Store(false, MemoryOrder::RELAXED);
+    stalled->swap(worker->stalled);
+    return true;
+}
+
+void TcpServer::CheckRecovered(DispatchWorker* worker) {
+    if (OverBound(worker, 2)) {
+        return;
+    }
+    std::vector<ConnectionId> stalled;
+    bool recovered = false;
+    {
+        AutoMutex g(&worker->mutex);
+        recovered = TakeStalled(worker, &stalled);
+    }
+    if (recovered) {
+        ResumeStalled(stalled);
+    }
+}
+
+void TcpServer::ResumeStalled(const std::vector<ConnectionId>& stalled) {
+    SetOverloaded(false);
+    ResumeReads(stalled);
+}
+
+void TcpServer::ResumeReads(const std::vector<ConnectionId>& cids) {
+    std::vector<bool> wakeup(_timers.size(), false);
+    for (auto cid : cids) {
+        EpochGuard guard;
+        Connection* con = GetConnection(cid);
+        if (!con) {
+            continue;
+        }
+        auto& timer = _timers[con->_reactor];
+        AutoMutex g(&timer->mtx);
+        timer->paused.emplace_back(0, cid);
+        _paused_count.FetchAdd(1, MemoryOrder::RELEASE);
+        wakeup[con->_reactor] = true;
+    }
+    for (size_t i = 0; i < wakeup.size(); i++) {
+        if (wakeup[i]) {
+            _recv_threads[i]->Wakeup();
+        }
+    }
+}
+
+uint64_t TcpServer::BufferedBytes(uint64_t* draining) {
+    uint64_t received = 0;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < _recv_threads.size(); i++) {
+        bytes += _counters[i].send_queued_bytes.Load(MemoryOrder::RELAXED);
+        received += _counters[i].recv_buffered_bytes.Load(MemoryOrder::RELAXED);
+    }
+    for (auto& worker : _workers) {
+        uint64_t dispatched = worker->dispatched_bytes.Load(MemoryOrder::RELAXED);
+        uint64_t posted = worker->posted_bytes.Load(MemoryOrder::RELAXED);
+        bytes += (posted > dispatched) ? posted - dispatched : 0;
+    }
+    if (draining) {
+        *draining = bytes;
+    }
+    return bytes + received;
+}
+
+// Like CheckOverload the connection delivering while over the budget
+// is the one paused. The reactors check the budget again on every
+// wakeup, at least once a second while there are connections, and so
+// do the dispatch threads running out of messages.
+bool TcpServer::CheckMemoryPause(ConnectionId cid) {
+    if (_options.max_buffer_memory == 0
+        || _options.buffer_memory_policy != RAPTOR_MEMORY_PAUSE_READS
+        || BufferedBytes() <= _options.max_buffer_memory) {
+        return false;
+    }
+    AutoMutex g(&_memory_mtx);
+    _memory_stalled.push_back(cid);
+    _memory_stalled_count.Store(
+        static_cast<uint32_t>(_memory_stalled.size()), MemoryOrder::RELEASE);
+    return true;
+}
+
+bool TcpServer::RejectSend() {
+    return _options.max_buffer_memory > 0
+        && _options.buffer_memory_policy == RAPTOR_MEMORY_REJECT_SENDS
+        && BufferedBytes() > _options.max_buffer_memory;
+}
+
+void TcpServer::CheckMemoryBudget() {
+    uint64_t limit = _options.max_buffer_memory;
+    uint64_t low = limit - limit / 8;
+    if (_options.buffer_memory_policy == RAPTOR_MEMORY_CLOSE_LARGEST) {
+        // walking the connections is left to one reactor at a time
+        int64_t now = GetCoarseMilliseconds();
+        int64_t last = _memory_check_ms.Load(MemoryOrder::RELAXED);
+        if (now - last < MEMORY_CHECK_INTERVAL_MS
+            || !_memory_check_ms.CompareExchangeStrong(
+                &last, now, MemoryOrder::RELAXED, MemoryOrder::RELAXED)) {
+            return;
+        }
+        uint64_t used = BufferedBytes();
+        if (used > limit) {
+            EvictLargest(used - low);
+        }
+        return;
+    }
+    if (_memory_stalled_count.Load(MemoryOrder::ACQUIRE) == 0) {
+        return;
+    }
+    // The receive buffers of the paused connections only drain once
+    // they are resumed, so they are resumed as well when nothing else
+    // is left to drain.
+    uint64_t draining = 0;
+    if (BufferedBytes(&draining) > low && draining > 0) {
+        return;
+    }
+    std::vector<ConnectionId> stalled;
+    {
+        AutoMutex g(&_memory_mtx);
+        stalled.swap(_memory_stalled);
+        _memory_stalled_count.Store(0, MemoryOrder::RELAXED);
+    }
+    ResumeReads(stalled);
+}
+
+void TcpServer::EvictLargest(uint64_t excess) {
+    std::vector<std::pair<size_t, ConnectionId>> holders;
+    for (size_t i = 0; i < _mgr.Capacity(); i++) {
+        ConnectionSlot* slot = _mgr.Find(i);
+        if (!slot) {
+            continue;
+        }
+        EpochGuard guard;
+        Connection* con = slot->con.Load(MemoryOrder::ACQUIRE);
+        if (con) {
+            size_t bytes = con->BufferedBytes();
+            if (bytes >= MIN_EVICT_BYTES) {
+                holders.emplace_back(bytes, con->Id());
+            }
+        }
+    }
+    std::sort(holders.begin(), holders.end(),
+        [](const std::pair<size_t, ConnectionId>& a, const std::pair<size_t, ConnectionId>& b) {
+            return a.first > b.first;
+        });
+    uint64_t released = 0;
+    for (size_t i = 0; i < holders.size() && released < excess; i++) {
+        EpochGuard guard;
+        Connection* con = GetConnection(holders[i].second);
+        if (!con) {
+            continue;
+        }
+        uint32_t reactor = con->_reactor;
+        if (RemoveConnection(con, true)) {
+            log_error("tcpserver: closed cid = %llx holding %zu bytes over max_buffer_memory",
+                static_cast<unsigned long long>(holders[i].second), holders[i].first);
+            ServerCounters::Add(_counters[reactor].memory_evictions, 1);
+            released += holders[i].first;
+        }
+    }
+}
+
+void TcpServer::SetOverloaded(bool overloaded) {
+    AutoMutex g(&_overload_mtx);
+    if (overloaded) {
+        if (_overloaded_workers++ == 0) {
+            _service->OnOverload();
+        }
+    } else if (--_overloaded_workers == 0) {
+        _service->OnRecovered();
+    }
+}
+
+void TcpServer::Dispatch(struct TcpMessageNode* msg) {
+    switch (msg->type) {
+    case MessageType::kNewConnection:
+        _service->OnConnected(msg->cid);
+        break;
+    case MessageType::kRecvAMessage: {
+        if (_codec && !DecodePackage(msg->cid, &msg->slice)) {
+            break;
+        }
+        Message m = { msg->cid, msg->slice.begin(), msg->slice.size(), GetSliceHandle(msg->slice) };
+        _service->OnMessage(&m);
+        break;
+    }
+    case MessageType::kCloseClient:
+        _service->OnClosed(msg->cid);
+        break;
+    case MessageType::kZeroCopyCompleted:
+        _service->OnZeroCopyCompleted(msg->cid, msg->count);
+        break;
+    case MessageType::kWritable:
+        _service->OnWritable(msg->cid);
+        break;
+    case MessageType::kConnectFailed:
+        _connect_service->OnConnectFailed(msg->cid);
+        break;
+    case MessageType::kStreamBegin:
+        _service->OnMessageBegin(msg->cid, msg->count);
+        break;
+    case MessageType::kStreamChunk: {
+        Message m = { msg->cid, msg->slice.begin(), msg->slice.size(), GetSliceHandle(msg->slice) };
+        _service->OnMessageChunk(&m);
+        break;
+    }
+    case MessageType::kStreamEnd:
+        _service->OnMessageEnd(msg->cid);
+        break;
+    case MessageType::kTimer:
+        FireTimer(msg->timer);
+        break;
+    case MessageType::kSendCompleted:
+        {
+            // an inlined slice does not keep the tokens aligned
+            uint64_t tokens[DISPATCH_BATCH_SIZE];
+            size_t count = msg->slice.size() / sizeof(uint64_t);
+            for (size_t i = 0; i < count; i += DISPATCH_BATCH_SIZE) {
+                size_t n = RAPTOR_MIN(count - i, static_cast<size_t>(DISPATCH_BATCH_SIZE));
+                memcpy(tokens, msg->slice.begin() + i * sizeof(uint64_t), n * sizeof(uint64_t));
+                _service->OnSendCompleted(msg->cid, tokens, n);
+            }
+        }
+        break;
+    default:
+        log_error("unknow message type %d", static_cast<int>(msg->type));
+        break;
+    }
+}
+
+bool TcpServer::EncodePackage(
+    ConnectionId cid, const raptor_iovec* iov, size_t count, Slice* out) {
+    size_t threshold = _options.codec_threshold > 0
+        ? _options.codec_threshold : DEFAULT_CODEC_THRESHOLD;
+    size_t len = 0;
+    size_t fragments = 0;
+    const void* data = nullptr;
+    for (size_t i = 0; i < count; i++) {
+        if (iov[i].len > 0) {
+            len += iov[i].len;
+            data = iov[i].base;
+            fragments++;
+        }
+    }
+    if (len < threshold
+        || !_mgr.At(core::GetConnectionIndex(cid)).codec.Load(MemoryOrder::RELAXED)) {
+        return false;
+    }
+    // the codec takes the package in one piece
+    Slice whole;
+    if (fragments > 1) {
+        whole = MakeSliceByLength(len);
+        uint8_t* p = whole.Buffer();
+        for (size_t i = 0; i < count; i++) {
+            if (iov[i].len > 0) {
+                memcpy(p, iov[i].base, iov[i].len);
+                p += iov[i].len;
+            }
+        }
+        data = whole.begin();
+    }
+    size_t bound = _codec->MaxEncodedSize(len);
+    Slice encoded = MakeSliceByLength(bound);
+    size_t n = _codec->Encode(cid, data, len, encoded.Buffer());
+    if (n == 0 || n > bound) {
+        return false;
+    }
+    encoded.CutTail(bound - n);
+    *out = std::move(encoded);
+    return true;
+}
+
+bool TcpServer::DecodePackage(ConnectionId cid, Slice* s) {
+    int len = _codec->DecodedSize(cid, s->begin(), s->size());
+    if (len == 0) {
+        return true;
+    }
+    if (len > 0) {
+        Slice decoded = MakeSliceByLength(static_cast<size_t>(len));
+        if (_codec->Decode(cid, s->begin(), s->size(), decoded.Buffer(), decoded.size())) {
+            *s = std::move(decoded);
+            return true;
+        }
+    }
+    log_error("tcpserver: corrupt package on connection %llx",
+        static_cast<unsigned long long>(cid));
+    CloseConnection(cid);
+    return false;
+}
+
+bool TcpServer::RemoveConnection(Connection* con, bool notify) {
+    uint32_t index = core::GetConnectionIndex(con->Id());
+    Connection* expected = con;
+    if (!_mgr.At(index).con.CompareExchangeStrong(
+            &expected, nullptr, MemoryOrder::ACQ_REL, MemoryOrder::RELAXED)) {
+        return false;
+    }
+    _open_connections.FetchSub(1, MemoryOrder::ACQ_REL);
+    ServerCounters::Add(_counters[con->_reactor].closed, 1);
+    RAPTOR_TRACE(closed, RAPTOR_TRACE_CLOSED, con->Id(), 0);
+
+    {
+        auto& timer = _timers[con->_reactor];
+        AutoMutex tg(&timer->mtx);
+        timer->wheel.Remove(&con->_timer);
+    }
+    con->Shutdown(notify);
+
+    _conn_mtx.Lock();
+    ReleaseIndex(index);
+    _conn_mtx.Unlock();
+
+    // readers may still hold it
+    Epoch::Retire(con, ConnectionPool::Recycle);
+    return true;
+}
+
+// requires _conn_mtx held, return InvalidIndex if all slots are in use
+uint32_t TcpServer::ReserveIndex() {
+    uint32_t index = InvalidIndex;
+    if (_free_head != InvalidIndex) {
+        index = _free_head;
+        _free_head = _mgr.At(index).next_free;
+        if (_free_head == InvalidIndex) {
+            _free_tail = InvalidIndex;
+        }
+    } else if (_mgr_used < _mgr.Capacity()) {
+        index = _mgr_used++;
+        // creates the page under the lock, later users only read it
+        _mgr.At(index);
+    }
+    return index;
+}
+
+// requires _conn_mtx held
+void TcpServer::ReleaseIndex(uint32_t index) {
+    _mgr.At(index).next_free = InvalidIndex;
+    if (_free_tail == InvalidIndex) {
+        _free_head = index;
+    } else {
+        _mgr.At(_free_tail).next_free = index;
+    }
+    _free_tail = index;
+}
+
+void TcpServer::SchedulePausedRecv(Connection* con) {
+    int64_t resume_ms = con->TakeResumeTime();
+    if (resume_ms == 0) {
+        return;
+    }
+    auto& timer = _timers[con->_reactor];
+    AutoMutex g(&timer->mtx);
+    timer->paused.emplace_back(resume_ms, con->Id());
+    _paused_count.FetchAdd(1, MemoryOrder::RELEASE);
+}
+
+void TcpServer::ResumePausedRecvs() {
+    int64_t now = GetCoarseMilliseconds();
+    std::vector<ConnectionId> due;
+    for (auto& timer : _timers) {
+        AutoMutex g(&timer->mtx);
+        auto& paused = timer->paused;
+        for (size_t i = 0; i < paused.size();) {
+            if (paused[i].first <= now) {
+                due.push_back(paused[i].second);
+                paused[i] = paused.back();
+                paused.pop_back();
+                _paused_count.FetchSub(1, MemoryOrder::RELAXED);
+            } else {
+                i++;
+            }
+        }
+    }
+
+    for (auto cid : due) {
+        EpochGuard guard;
+        Connection* con = GetConnection(cid);
+        if (!con) {
+            continue;
+        }
+        if (con->ResumeRecv()) {
+            SchedulePausedRecv(con);
+        } else {
+            RemoveConnection(con, true);
+        }
+    }
+}
+
+void TcpServer::RefreshTime(Connection* con) {
+    // lazy refresh, the timing wheel is updated when the old deadline expires
+    con->_last_active.Store(Now(), MemoryOrder::RELAXED);
+}
+
+bool TcpServer::SetUserData(ConnectionId cid, void* ptr) {
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (con) {
+        con->SetUserData(ptr);
+        return true;
+    }
+    return false;
+}
+
+bool TcpServer::GetUserData(ConnectionId cid, void** ptr) {
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (con) {
+        con->GetUserData(ptr);
+        return true;
+    }
+    return false;
+}
+
+bool TcpServer::GetSendQueueBytes(ConnectionId cid, size_t* bytes) {
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (con) {
+        *bytes = con->GetSendQueueBytes();
+        return true;
+    }
+    return false;
+}
+
+bool TcpServer::SetExtendInfo(ConnectionId cid, uint64_t data) {
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (con) {
+        con->SetExtendInfo(data);
+        return true;
+    }
+    return false;
+}
+
+bool TcpServer::GetExtendInfo(ConnectionId cid, uint64_t& data) {
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (con) {
+        con->GetExtendInfo(data);
+        return true;
+    }
+    return false;
+}
+
+bool TcpServer::SetPriority(ConnectionId cid, int priority) {
+    if (priority < RAPTOR_PRIORITY_LOW || priority >= RAPTOR_PRIORITY_LANES) {
+        return false;
+    }
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (!con) {
+        return false;
+    }
+    // taken over by the next PostMessage that finds nothing queued
+    _mgr.At(core::GetConnectionIndex(cid)).priority.Store(
+        static_cast<uint8_t>(priority), MemoryOrder::RELAXED);
+    return true;
+}
+
+bool TcpServer::SetCodecEnabled(ConnectionId cid, bool enabled) {
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (!con || (enabled && !_codec)) {
+        return false;
+    }
+    _mgr.At(core::GetConnectionIndex(cid)).codec.Store(enabled, MemoryOrder::RELAXED);
+    return true;
+}
+
+bool TcpServer::GetConnectionInfo(ConnectionId cid, RaptorConnInfo* info) {
+    EpochGuard guard;
+    Connection* con = GetConnection(cid);
+    if (con) {
+        con->GetInfo(info);
+        int64_t avg = _mgr.At(core::GetConnectionIndex(cid)).callback_ns.Load(MemoryOrder::RELAXED);
+        info->callback_avg_us = static_cast<uint32_t>(avg / 1000);
+        return true;
+    }
+    return false;
+}
+
+uint32_t TcpServer::CheckConnectionId(ConnectionId cid) const {
+    uint32_t failure = InvalidIndex;
+    if (cid == core::InvalidConnectionId) {
+        return failure;
+    }
+    uint16_t magic = core::GetMagicNumber(cid);
+    if (magic != _magic_number) {
+        return failure;
+    }
+
+    uint32_t index = core::GetConnectionIndex(cid);
+    if (index >= _mgr.Capacity()) {
+        return failure;
+    }
+    return index;
+}
+
+Connection* TcpServer::GetConnection(ConnectionId cid) {
+    uint32_t index = CheckConnectionId(cid);
+    if (index == InvalidIndex) {
+        return nullptr;
+    }
+    // a forged cid may point past the pages created so far
+    ConnectionSlot* slot = _mgr.Find(index);
+    if (!slot) {
+        return nullptr;
+    }
+    Connection* con = slot->con.Load(MemoryOrder::ACQUIRE);
+    if (con && con->Id() == cid) {
+        return con;
+    }
+    return nullptr;
 }
 
 }  // namespace raptor
@@ -20,15 +20,21 @@
 #define __RAPTOR_CORE_LINUX_TCP_SERVER__
 
 #include <time.h>
-#include <map>
 #include <memory>
-#include <list>
 #include <utility>
 #include <vector>
 
+#include "core/async_resolver.h"
 #include "core/linux/epoll_thread.h"
 #include "core/linux/connection.h"
+#include "core/linux/connection_pool.h"
 #include "core/mpscq.h"
+#include "core/server_stats.h"
+#include "core/timing_wheel.h"
+#include "core/user_timers.h"
+#include "util/atomic.h"
+#include "util/histogram.h"
+#include "util/segmented_array.h"
 #include "util/status.h"
 #include "util/sync.h"
 #include "raptor/protocol.h"
@@ -36,9 +42,12 @@
 
 namespace raptor {
 class IProtocol;
+class TcpConnector;
 class TcpListener;
+class TrafficCapture;
 struct TcpMessageNode;
 class TcpServer : public internal::IAcceptor
+                , public internal::IConnectorReceiver
                 , public internal::IEpollReceiver
                 , public internal::INotificationTransfer {
 public:
@@ -47,77 +56,344 @@ public:
 
     raptor_error Init(const RaptorOptions* options);
     raptor_error AddListening(const char* addr);
+    // listener handoff, see ITcpServer::AdoptListening
+    raptor_error AdoptListening(int fd);
+    size_t GetListeningFds(int* fds, size_t count);
+    void Drain();
 
     raptor_error Start();
     void Shutdown();
     void SetProtocol(IProtocol* proto);
+    // accepted connections handshake with it first, needs kTLS
+    raptor_error SetTlsProvider(ITlsProvider* tls);
+    // see ITcpServer::SetCodec
+    raptor_error SetCodec(IMessageCodec* codec);
 
     bool Send(ConnectionId cid, const void* buf, size_t len);
+    bool SendV(ConnectionId cid, const raptor_iovec* iov, size_t count);
+    int SendWithToken(ConnectionId cid, const raptor_iovec* iov, size_t count, uint64_t token);
+    bool AllocSendBuffer(ConnectionId cid, size_t size, SendBuffer* buf);
+    bool CommitSend(ConnectionId cid, SendBuffer* buf, size_t used);
     bool SendWithHeader(ConnectionId cid,
         const void* hdr, size_t hdr_len, const void* data, size_t data_len);
+    // return the number of connections the payload was queued on
+    size_t Broadcast(const ConnectionId* cids, size_t count,
+        const void* data, size_t len);
+    // release is called once the buffer is no longer referenced
+    bool SendZeroCopy(ConnectionId cid, const void* ptr, size_t len,
+        raptor_buffer_release_callback release, void* ctx);
+    // done is called exactly once, also when this returns false
+    bool SendFile(ConnectionId cid, raptor_file_t file, uint64_t offset,
+        uint64_t length, raptor_send_file_callback done, void* ctx);
+    int TrySendWithHeader(ConnectionId cid,
+        const void* hdr, size_t hdr_len, const void* data, size_t data_len);
     bool CloseConnection(ConnectionId cid);
+    void GetStats(RaptorStats* stats);
+
+    // Starts an outbound connection, which is served like an accepted
+    // one once it is established. *cid is valid at once, OnConnected
+    // or, if the service implements internal::IConnectReceiver,
+    // OnConnectFailed follows, possibly before Connect returns.
+    raptor_error Connect(const char* addr, size_t timeout_ms, ConnectionId* cid);
+
+    // see ITcpServer::ScheduleTimer, the timer id carries its reactor
+    uint64_t ScheduleTimer(ConnectionId cid, uint32_t delay_ms,
+        raptor_timer_callback cb, void* ctx);
+    bool CancelTimer(uint64_t timer_id);
 
     // internal::IAcceptor impl
-    void OnNewConnection(
-        int sock_fd, int listen_port,
-        const raptor_resolved_address* addr) override;
+    void OnNewConnections(
+        const AcceptedSocket* socks, size_t count, int shard) override;
+
+    // internal::IConnectorReceiver impl
+    void OnConnectCompleted(
+        uint64_t tag, int fd, const raptor_resolved_address* addr) override;
 
     // internal::IEpollReceiver implement
     void OnErrorEvent(void* ptr) override;
     void OnRecvEvent(void* ptr) override;
     void OnSendEvent(void* ptr) override;
     void OnCheckingEvent(time_t current) override;
+    int CheckingInterval() override;
+    bool OnErrorQueueEvent(void* ptr) override;
 
     // internal::INotificationTransfer impl
     void OnConnectionArrived(ConnectionId cid, const raptor_resolved_address* addr);
-    void OnDataReceived(ConnectionId cid, const Slice* s) override;
+    void OnDataReceived(ConnectionId cid, Slice* s) override;
+    bool OnPackagesReceived(ConnectionId cid, Slice* s, size_t count) override;
+    void OnStreamBegin(ConnectionId cid, size_t total) override;
+    bool OnStreamChunk(ConnectionId cid, Slice* s) override;
+    void OnStreamEnd(ConnectionId cid) override;
     void OnConnectionClosed(ConnectionId cid) override;
+    void OnZeroCopyCompleted(ConnectionId cid, uint32_t count) override;
+    void OnWritable(ConnectionId cid) override;
+    void OnSendCompleted(ConnectionId cid, const uint64_t* tokens, size_t count) override;
 
     // user data
     bool SetUserData(ConnectionId cid, void* ptr);
     bool GetUserData(ConnectionId cid, void** ptr);
+    bool GetSendQueueBytes(ConnectionId cid, size_t* bytes);
     bool SetExtendInfo(ConnectionId cid, uint64_t data);
     bool GetExtendInfo(ConnectionId cid, uint64_t& data);
+    bool SetPriority(ConnectionId cid, int priority);
+    bool SetCodecEnabled(ConnectionId cid, bool enabled);
+    bool GetConnectionInfo(ConnectionId cid, RaptorConnInfo* info);
 
 private:
     void TimeoutCheckThread(void*);
     void MessageQueueThread(void*);
     uint32_t CheckConnectionId(ConnectionId cid) const;
     void Dispatch(struct TcpMessageNode* msg);
-    void DeleteConnection(uint32_t index);
-    void RefreshTime(uint32_t index);
-    std::shared_ptr<Connection> GetConnection(uint32_t index);
+    // Sends of the callbacks on this thread are held back between
+    // BeginCork and EndCork (see RaptorOptions::cork_window_us),
+    // FlushCorked writes them once the window is over or if 'all'.
+    void BeginCork();
+    void EndCork();
+    void CorkSend(Connection* con);
+    void FlushCorked(bool all);
+    void PostMessage(struct TcpMessageNode* msg);
+    // delivers and frees kRecvAMessage messages with OnMessagesReceived
+    struct DispatchWorker;
+    // the next message by weighted round robin over the lanes, *empty
+    // is false if a lane is in the middle of a push
+    struct TcpMessageNode* PopMessage(DispatchWorker* worker, bool* empty);
+    void DispatchBatch(DispatchWorker* worker, struct TcpMessageNode** msgs, size_t count);
+    // after a callback started at wall_start, cpu_start: adds it to the
+    // averages of the connections of its messages, then reports it if
+    // over slow_callback_us
+    void CheckCallbackTime(DispatchWorker* worker, struct TcpMessageNode** msgs,
+        size_t count, RaptorSlowCallback* info, int64_t wall_start, int64_t cpu_start);
+    // return true if the queue of worker is over the bounds divided
+    // by 'divisor' (see RaptorOptions::max_dispatch_queue_depth)
+    bool OverBound(DispatchWorker* worker, uint64_t divisor);
+    // return true if reading of cid has to pause for a full queue
+    bool CheckOverload(ConnectionId cid);
+    // after messages of cid were posted, false if reading of cid has
+    // to pause for a full queue or the memory budget
+    bool KeepReading(ConnectionId cid);
+    // requires worker->mutex held, return true if worker has drained
+    // out of its overload and moves its stalled connections out
+    bool TakeStalled(DispatchWorker* worker, std::vector<ConnectionId>* stalled);
+    // lifts the overload of worker if it has drained enough
+    void CheckRecovered(DispatchWorker* worker);
+    // hands the stalled connections to their reactors to be resumed
+    void ResumeStalled(const std::vector<ConnectionId>& stalled);
+    // resumed like a rate limit pause which is due now
+    void ResumeReads(const std::vector<ConnectionId>& cids);
+    // bytes held against RaptorOptions::max_buffer_memory: the receive
+    // and send buffers and the messages waiting for dispatch. *draining
+    // gets the part which drains without reading: sends and dispatch.
+    uint64_t BufferedBytes(uint64_t* draining = nullptr);
+    // return true if reading of cid has to pause for the memory budget
+    bool CheckMemoryPause(ConnectionId cid);
+    // with RAPTOR_MEMORY_REJECT_SENDS, true while over the budget
+    bool RejectSend();
+    // resumes the connections paused for the memory budget once it has
+    // drained, or evicts the largest ones at most every
+    // MEMORY_CHECK_INTERVAL_MS with RAPTOR_MEMORY_CLOSE_LARGEST
+    void CheckMemoryBudget();
+    // closes the connections holding the most until 'excess' bytes are
+    // released, those holding less than MIN_EVICT_BYTES are kept
+    void EvictLargest(uint64_t excess);
+    // the package made of the fragments, encoded by _codec into *out.
+    // False sends it as it is: encoding is off for cid, the package is
+    // below codec_threshold or the codec declined it.
+    bool EncodePackage(ConnectionId cid, const raptor_iovec* iov, size_t count, Slice* out);
+    // replaces *s by the package decoded from it, false closes cid
+    bool DecodePackage(ConnectionId cid, Slice* s);
+    // one overloaded worker more or less, tells _service about the
+    // first and the last one
+    void SetOverloaded(bool overloaded);
+    // bumps the generation of a reserved slot, which is owned by the
+    // caller until a connection is published in it
+    ConnectionId NewConnectionId(uint32_t index, uint16_t listen_port);
+    // return false if the socket has been closed and index released,
+    // 'accepted' connections run the TLS handshake if there is a provider
+    bool AddConnection(int sock, ConnectionId cid,
+        const raptor_resolved_address* addr, uint32_t index, uint32_t reactor, bool accepted);
+    void NotifyConnectFailed(ConnectionId cid);
+    // starts the connect for a reserved cid, releases it on failure
+    raptor_error StartConnect(ConnectionId cid,
+        const raptor_resolved_address* addr, size_t timeout_ms);
+    // the thread that unpublishes con shuts it down, return false if
+    // con has been removed by another thread.
+    bool RemoveConnection(Connection* con, bool notify);
+    // the reactor a connection on fd is steered to with cpu_steering,
+    // InvalidIndex if the cpu it arrived on is unknown
+    uint32_t SteerReactor(int fd);
+    uint32_t ReserveIndex();
+    void ReleaseIndex(uint32_t index);
+    void RefreshTime(Connection* con);
+    // remembers when to resume a connection paused by the rate limit
+    void SchedulePausedRecv(Connection* con);
+    void ResumePausedRecvs();
+    // wait-free, the caller must hold an EpochGuard while using the result
+    Connection* GetConnection(ConnectionId cid);
+    // the reactor whose recv thread is running the caller, InvalidIndex
+    // on any other thread
+    uint32_t CurrentReactor();
+    // on the recv thread of reactor, runs or posts its due user timers
+    void RunUserTimers(uint32_t reactor);
+    // closes and compacts the idle connections of the reactor
+    void CheckTimeouts(uint32_t reactor, time_t current);
+    // fired unless the connection of the timer is gone
+    void FireTimer(UserTimers::Timer* timer);
 
 private:
-    using TimeoutRecord = std::multimap<time_t, uint32_t>;
-    using ConnectionData =
-        std::pair<std::shared_ptr<Connection>, TimeoutRecord::iterator>;
+    // Slots are never moved, readers load 'con' without locking and
+    // closed connections are freed through epoch based reclamation.
+    // A connection's messages go to its dispatch lane, 'priority' is
+    // the one asked for by SetPriority. queued counts the messages of
+    // the slot not popped yet, the lane is only switched while there
+    // are none so a connection's callbacks cannot overtake each other.
+    struct ConnectionSlot {
+        Atomic<Connection*> con;
+        uint32_t generation;
+        // free list link, requires _conn_mtx held
+        uint32_t next_free;
+        AtomicUInt32 queued;
+        Atomic<uint8_t> lane;
+        Atomic<uint8_t> priority;
+        // sends are encoded, see SetCodecEnabled
+        Atomic<bool> codec;
+        // moving average of its message callbacks in nanoseconds,
+        // written by its dispatch worker only
+        AtomicInt64 callback_ns;
+        ConnectionSlot()
+            : con(nullptr), generation(0), next_free(0)
+            , lane(RAPTOR_PRIORITY_NORMAL), priority(RAPTOR_PRIORITY_NORMAL)
+            , codec(false), callback_ns(0) {}
+    };
+
+    enum {
+        PREALLOCATED_CONNECTIONS_PER_REACTOR = 64,
+        RESERVE_BATCH_SIZE = 64,
+        DISPATCH_BATCH_SIZE = 64
+    };
 
-    enum { RESERVED_CONNECTION_COUNT = 100 };
+    // Messages of a connection always go to the same worker and lane,
+    // so its callbacks run in order on one thread. The worker drains
+    // the lanes without locking, taking up to kLaneWeights[i] messages
+    // of lane i per round from high to low, mutex and cv are only used
+    // to sleep when every lane is empty.
+    // The queue depth is posted - dispatched, posted is added to by
+    // the producers along with their push, dispatched is only written
+    // by the worker. The bytes are only counted with a byte bound.
+    // Once over a bound the worker is overloaded, the connections
+    // which found it so are stalled until it drains to half.
+    struct DispatchWorker {
+        MultiProducerSingleConsumerQueue lanes[RAPTOR_PRIORITY_LANES];
+        // round robin position, written by the worker only
+        uint32_t lane;
+        uint32_t credit;
+        AtomicUInt64 posted;
+        AtomicUInt64 posted_bytes;
+        char padding[RAPTOR_CACHELINE_SIZE];
+        AtomicUInt64 dispatched;
+        AtomicUInt64 dispatched_bytes;
+        Atomic<bool> overloaded;
+        // requires mutex held
+        std::vector<ConnectionId> stalled;
+        // written by the worker only, in nanoseconds: from OnDataReceived
+        // to the dispatch of a message, and spent in one callback
+        Histogram queue_delay;
+        Histogram callback_time;
+        AtomicUInt64 slow_callbacks;
+        Thread thd;
+        Mutex mutex;
+        ConditionVariable cv;
+
+        DispatchWorker() : lane(RAPTOR_PRIORITY_HIGH), credit(0) {}
+
+        bool IsEmpty() {
+            for (auto& q : lanes) {
+                if (!q.IsEmpty()) return false;
+            }
+            return true;
+        }
+
+        void AddDispatched(uint64_t n, uint64_t bytes) {
+            dispatched.Store(dispatched.Load(MemoryOrder::RELAXED) + n, MemoryOrder::RELAXED);
+            if (bytes > 0) {
+                dispatched_bytes.Store(
+                    dispatched_bytes.Load(MemoryOrder::RELAXED) + bytes, MemoryOrder::RELAXED);
+            }
+        }
+    };
+
+    // Idle deadlines of the connections on one reactor. Activity only
+    // updates Connection::_last_active, a connection is moved to its
+    // real deadline when its old one is reached.
+    struct ReactorTimer {
+        Mutex mtx;
+        TimingWheel wheel;
+        // connections whose reading is paused by the rate limit,
+        // with the time in milliseconds to resume them
+        std::vector<std::pair<int64_t, ConnectionId>> paused;
+        // ScheduleTimer, run by the recv thread of the reactor
+        UserTimers user;
+        // the last CheckTimeouts left expired nodes in the wheel,
+        // read by the recv thread of the reactor only
+        bool backlog;
+        ReactorTimer(time_t now, int64_t now_ms) : wheel(now), user(now_ms), backlog(false) {}
+    };
 
     IServerReceiver* _service;
+    // non-null if _service takes batches
+    IServerBatchReceiver* _batch_service;
+    // non-null if _service is told about failed outbound connects
+    internal::IConnectReceiver* _connect_service;
     IProtocol* _proto;
+    ITlsProvider* _tls;
+    IMessageCodec* _codec;
 
     bool _shutdown;
     RaptorOptions _options;
 
-    MultiProducerSingleConsumerQueue _mpscq;
-    Thread _mq_thd;
-    Mutex _mutex;
-    ConditionVariable _cv;
-    AtomicUInt32 _count;
+    std::vector<std::unique_ptr<DispatchWorker>> _workers;
 
     std::shared_ptr<TcpListener> _listener;
-    std::shared_ptr<SendRecvThread> _recv_thread;
-    std::shared_ptr<SendRecvThread> _send_thread;
+    std::unique_ptr<TcpConnector> _connector;
+    // non-null with capture_file, outlives the connections
+    std::unique_ptr<TrafficCapture> _capture;
+    AtomicUInt64 _capture_counter;
+    // cancelled by Shutdown so a late resolve result is dropped
+    std::shared_ptr<ResolveGuard<TcpServer>> _resolve_guard;
+    std::vector<std::shared_ptr<SendRecvThread>> _recv_threads;
+    std::vector<std::shared_ptr<SendRecvThread>> _send_threads;
+    uint32_t _next_reactor;
+    // reactor pinned to each cpu, -1 for none, see cpu_steering
+    std::vector<int> _cpu_reactor;
+
+    std::vector<std::unique_ptr<ReactorTimer>> _timers;
+    // one block per reactor
+    std::unique_ptr<ServerCounters[]> _counters;
+    AtomicUInt32 _paused_count;
+    // serializes OnOverload and OnRecovered with the count they follow
+    Mutex _overload_mtx;
+    uint32_t _overloaded_workers;
+    // connections paused for the memory budget
+    Mutex _memory_mtx;
+    std::vector<ConnectionId> _memory_stalled;
+    AtomicUInt32 _memory_stalled_count;
+    AtomicInt64 _memory_check_ms;
+    // published connections, the reactors only wake up for the
+    // timeout checks while there are any
+    AtomicUInt32 _open_connections;
+    std::vector<std::unique_ptr<ConnectionPool>> _pools;
 
+    // protects slot allocation. The pages of _mgr are created by
+    // ReserveIndex as it first hands out their slots, so the table
+    // grows without moving a slot or blocking readers.
     Mutex _conn_mtx;
-    std::vector<ConnectionData> _mgr;
-    // key: timeout deadline, value: index for _mgr
-    TimeoutRecord _timeout_record_list;
-    std::list<uint32_t> _free_index_list;
+    SegmentedArray<ConnectionSlot> _mgr;
+    // slots [0, _mgr_used) have been handed out at least once
+    uint32_t _mgr_used;
+    // FIFO of released slots, chained through ConnectionSlot::next_free
+    uint32_t _free_head;
+    uint32_t _free_tail;
     uint16_t _magic_number;
-    Atomic<time_t> _last_timeout_time;
+    AtomicUInt64 _next_timer_id;
 };
 
 } // namespace raptor
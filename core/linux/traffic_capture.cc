@@ -0,0 +1,188 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+
+#include "core/linux/traffic_capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "util/time.h"
+#include "util/useful.h"
+
+namespace raptor {
+namespace {
+constexpr size_t MIN_RING_SIZE = 64 * 1024;
+// a payload is split into records of at most this many bytes
+constexpr size_t MAX_RECORD_PAYLOAD = 64 * 1024;
+}  // namespace
+
+TrafficCapture::TrafficCapture()
+    : _base(nullptr)
+    , _mapped(0)
+    , _ring_size(0)
+    , _max_payload(0)
+    , _start_ns(0)
+    , _region_count(0) {}
+
+TrafficCapture::~TrafficCapture() {
+    Close();
+}
+
+raptor_error TrafficCapture::Open(const char* path, size_t total_size, size_t regions) {
+    Close();
+    regions = RAPTOR_MAX(regions, static_cast<size_t>(1));
+    size_t ring_size = RAPTOR_MAX(total_size / regions, MIN_RING_SIZE) & ~static_cast<size_t>(7);
+    size_t mapped = CaptureRingOffset(regions, ring_size, regions);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return RAPTOR_POSIX_ERROR("open");
+    }
+    if (ftruncate(fd, static_cast<off_t>(mapped)) != 0) {
+        raptor_error e = RAPTOR_POSIX_ERROR("ftruncate");
+        close(fd);
+        return e;
+    }
+    void* p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // the mapping keeps the file
+    close(fd);
+    if (p == MAP_FAILED) {
+        return RAPTOR_POSIX_ERROR("mmap");
+    }
+
+    _base = static_cast<uint8_t*>(p);
+    _mapped = mapped;
+    _ring_size = ring_size;
+    // a record always leaves room for a few others
+    _max_payload = RAPTOR_MIN(MAX_RECORD_PAYLOAD, ring_size / 4 - sizeof(CaptureRecord));
+    _start_ns = GetMonotonicNanoseconds();
+    CaptureFileHeader* header = reinterpret_cast<CaptureFileHeader*>(_base);
+    memcpy(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    header->ring_size = ring_size;
+    header->regions = regions;
+    header->start_ns = _start_ns;
+
+    // the file is zero filled, every region starts empty
+    _regions.reset(new Region[regions]);
+    _region_count = regions;
+    for (size_t i = 0; i < regions; i++) {
+        _regions[i].header = reinterpret_cast<CaptureRegionHeader*>(
+            _base + CAPTURE_HEADER_SIZE + i * sizeof(CaptureRegionHeader));
+        _regions[i].ring = _base + CaptureRingOffset(regions, ring_size, i);
+    }
+    return RAPTOR_ERROR_NONE;
+}
+
+void TrafficCapture::Close() {
+    if (!_base) {
+        return;
+    }
+    for (size_t i = 0; i < _region_count; i++) {
+        AutoMutex g(&_regions[i].mtx);
+        _regions[i].header = nullptr;
+        _regions[i].ring = nullptr;
+    }
+    munmap(_base, _mapped);
+    _base = nullptr;
+}
+
+void TrafficCapture::Write(uint32_t region, ConnectionId cid, CaptureType type,
+    const struct iovec* iov, size_t count, size_t bytes) {
+    int64_t now = GetMonotonicNanoseconds() - _start_ns;
+    Region* r = GetRegion(region);
+    AutoMutex g(&r->mtx);
+    if (!r->header) {
+        return;
+    }
+    size_t i = 0;
+    size_t offset = 0;
+    while (bytes > 0 && i < count) {
+        size_t len = RAPTOR_MIN(bytes, _max_payload);
+        CaptureRecord* rec = Append(r, sizeof(CaptureRecord) + len, cid, type, now);
+        uint8_t* p = reinterpret_cast<uint8_t*>(rec + 1);
+        rec->length = static_cast<uint32_t>(len);
+        bytes -= len;
+        while (len > 0 && i < count) {
+            size_t n = RAPTOR_MIN(iov[i].iov_len - offset, len);
+            memcpy(p, static_cast<const uint8_t*>(iov[i].iov_base) + offset, n);
+            p += n;
+            len -= n;
+            offset += n;
+            if (offset == iov[i].iov_len) {
+                i++;
+                offset = 0;
+            }
+        }
+    }
+}
+
+void TrafficCapture::Write(uint32_t region, ConnectionId cid, CaptureType type) {
+    int64_t now = GetMonotonicNanoseconds() - _start_ns;
+    Region* r = GetRegion(region);
+    AutoMutex g(&r->mtx);
+    if (r->header) {
+        Append(r, sizeof(CaptureRecord), cid, type, now);
+    }
+}
+
+CaptureRecord* TrafficCapture::Append(
+    Region* r, size_t size, ConnectionId cid, CaptureType type, int64_t time_ns) {
+    CaptureRegionHeader* header = r->header;
+    uint64_t total = CaptureAlign(size);
+    uint64_t tail = header->tail;
+    uint64_t pos = tail;
+    uint64_t rest = _ring_size - tail % _ring_size;
+    if (rest < total) {
+        pos += rest;
+    }
+
+    // drop the oldest records until the new one fits, their
+    // headers are read before anything is overwritten
+    uint64_t head = header->head;
+    while (head + _ring_size < pos + total) {
+        uint64_t left = _ring_size - head % _ring_size;
+        if (left < sizeof(CaptureRecord)) {
+            head += left;
+            continue;
+        }
+        head += CaptureAlign(sizeof(CaptureRecord) + At(r, head)->length);
+    }
+    header->head = head;
+
+    if (pos != tail && rest >= sizeof(CaptureRecord)) {
+        CaptureRecord* pad = At(r, tail);
+        pad->cid = 0;
+        pad->time_ns = time_ns;
+        pad->length = static_cast<uint32_t>(rest - sizeof(CaptureRecord));
+        pad->type = kCapturePad;
+    }
+
+    CaptureRecord* rec = At(r, pos);
+    rec->cid = cid;
+    rec->time_ns = time_ns;
+    rec->length = 0;
+    rec->type = type;
+    header->tail = pos + total;
+    header->records++;
+    return rec;
+}
+
+} // namespace raptor
@@ -0,0 +1,145 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+
+#ifndef __RAPTOR_CORE_LINUX_TRAFFIC_CAPTURE__
+#define __RAPTOR_CORE_LINUX_TRAFFIC_CAPTURE__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <memory>
+
+#include "raptor/types.h"
+#include "util/status.h"
+#include "util/sync.h"
+#include "util/useful.h"
+
+namespace raptor {
+/*
+    Capture file (RaptorOptions::capture_file): a header, a region
+    header per region, then the ring of each region. A region holds
+    the records of the connections of one reactor, so a connection's
+    records are in order and those of different regions are merged by
+    their time. Within a ring positions grow forever, the record at
+    position p is at offset p % ring_size. [head, tail) holds the
+    records kept, the oldest ones are dropped to make room. Records
+    are 8-byte aligned and never wrap: a rest at the end of the ring
+    holds a kCapturePad record, or nothing if it is shorter than a
+    record header. Every field is in host byte order.
+*/
+enum CaptureType {
+    kCaptureOpen = 1,   // accepted, no payload
+    kCaptureRecv,       // bytes read from the peer
+    kCaptureSend,       // bytes written to the peer
+    kCaptureClose,      // no payload
+    kCapturePad,
+};
+
+constexpr char CAPTURE_MAGIC[8] = { 'R', 'P', 'T', 'R', 'C', 'A', 'P', '2' };
+// the region headers start here
+constexpr size_t CAPTURE_HEADER_SIZE = 64;
+
+struct CaptureFileHeader {
+    char magic[8];
+    // of each region
+    uint64_t ring_size;
+    uint64_t regions;
+    // CLOCK_MONOTONIC when the capture started, the records
+    // are timed relative to it
+    int64_t start_ns;
+};
+
+// a cache line each, the rings start after the last one
+struct CaptureRegionHeader {
+    uint64_t head;
+    uint64_t tail;
+    // written since the start, also those dropped since
+    uint64_t records;
+    uint64_t reserved[5];
+};
+
+inline size_t CaptureRingOffset(uint64_t regions, uint64_t ring_size, uint64_t region) {
+    return CAPTURE_HEADER_SIZE + regions * sizeof(CaptureRegionHeader) + region * ring_size;
+}
+
+// followed by length bytes
+struct CaptureRecord {
+    uint64_t cid;
+    int64_t time_ns;
+    uint32_t length;
+    uint32_t type;
+};
+
+inline uint64_t CaptureAlign(uint64_t n) {
+    return (n + 7) & ~static_cast<uint64_t>(7);
+}
+
+// Writes a capture file, mapped into memory, from any thread.
+// A write costs the lock of its region and a copy of its bytes,
+// writers to different regions share nothing.
+class TrafficCapture final {
+public:
+    TrafficCapture();
+    ~TrafficCapture();
+
+    TrafficCapture(const TrafficCapture&) = delete;
+    TrafficCapture& operator= (const TrafficCapture&) = delete;
+
+    // replaces path by an empty capture holding up to total_size bytes,
+    // split evenly over the regions
+    raptor_error Open(const char* path, size_t total_size, size_t regions);
+    void Close();
+
+    // the first 'bytes' bytes of the fragments, larger payloads are
+    // split over several records
+    void Write(uint32_t region, ConnectionId cid, CaptureType type,
+        const struct iovec* iov, size_t count, size_t bytes);
+    // a record without payload
+    void Write(uint32_t region, ConnectionId cid, CaptureType type);
+
+private:
+    struct Region {
+        Mutex mtx;
+        // null once closed
+        CaptureRegionHeader* header;
+        uint8_t* ring;
+        char padding[RAPTOR_CACHELINE_SIZE];
+    };
+
+    Region* GetRegion(uint32_t region) const {
+        return &_regions[region % _region_count];
+    }
+    // requires r->mtx held, makes room for a record of size bytes
+    // and returns it
+    CaptureRecord* Append(Region* r, size_t size, ConnectionId cid, CaptureType type, int64_t time_ns);
+    CaptureRecord* At(const Region* r, uint64_t pos) const {
+        return reinterpret_cast<CaptureRecord*>(r->ring + pos % _ring_size);
+    }
+
+    uint8_t* _base;
+    size_t _mapped;
+    uint64_t _ring_size;
+    size_t _max_payload;
+    int64_t _start_ns;
+    std::unique_ptr<Region[]> _regions;
+    size_t _region_count;
+};
+} // namespace raptor
+
+#endif  // __RAPTOR_CORE_LINUX_TRAFFIC_CAPTURE__
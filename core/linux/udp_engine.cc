@@ -0,0 +1,505 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "core/linux/udp_engine.h"
+#include <errno.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "core/resolve_address.h"
+#include "core/sockaddr.h"
+#include "core/socket_util.h"
+#include "util/alloc.h"
+#include "util/cpu.h"
+#include "util/log.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+namespace raptor {
+namespace {
+// the engine and socket of the reactor running on this thread
+thread_local const UdpEngine* t_udp_engine = nullptr;
+thread_local int t_udp_fd = -1;
+
+struct GroControl {
+    alignas(struct cmsghdr) char buf[CMSG_SPACE(sizeof(int))];
+};
+
+struct GsoControl {
+    alignas(struct cmsghdr) char buf[CMSG_SPACE(sizeof(uint16_t))];
+};
+} // namespace
+
+struct UdpEngine::Reactor {
+    int fd;
+    Thread thd;
+    UdpCounters counters;
+    uint8_t* buffers;
+    std::vector<struct mmsghdr> msgs;
+    std::vector<struct iovec> iovs;
+    std::vector<struct sockaddr_storage> addrs;
+    std::vector<GroControl> controls;
+
+    Reactor() : fd(-1), buffers(nullptr) {}
+    ~Reactor() {
+        Free(buffers);
+    }
+};
+
+UdpEngine::UdpEngine(IUdpReceiver* service)
+    : _service(service)
+    , _shutdown(true)
+    , _started(false)
+    , _buffer_size(0)
+    , _port(0) {
+    memset(&_options, 0, sizeof(_options));
+}
+
+UdpEngine::~UdpEngine() {
+    Shutdown();
+}
+
+raptor_error UdpEngine::Init(const UdpOptions* options) {
+    if (!_shutdown) return RAPTOR_ERROR_FROM_STATIC_STRING("udp engine already running");
+    if (options) {
+        _options = *options;
+    }
+    if (_options.reactor_threads == 0) {
+        _options.reactor_threads = raptor_get_number_of_cpu_cores();
+    }
+    if (_options.recv_batch == 0) {
+        _options.recv_batch = DEFAULT_RECV_BATCH;
+    }
+    _options.recv_batch = RAPTOR_MIN(_options.recv_batch, static_cast<size_t>(MAX_RECV_BATCH));
+    if (_options.max_datagram_size == 0 || _options.max_datagram_size > MAX_DATAGRAM_SIZE) {
+        _options.max_datagram_size = MAX_DATAGRAM_SIZE;
+    }
+    // a coalesced read holds up to 64KB whatever the datagram size
+    _buffer_size = _options.enable_gro ? 65535 : _options.max_datagram_size;
+
+    _reactors.clear();
+    for (size_t i = 0; i < _options.reactor_threads; i++) {
+        std::unique_ptr<Reactor> r(new Reactor);
+        size_t batch = _options.recv_batch;
+        r->buffers = static_cast<uint8_t*>(Malloc(batch * _buffer_size));
+        r->msgs.resize(batch);
+        r->iovs.resize(batch);
+        r->addrs.resize(batch);
+        r->controls.resize(batch);
+        for (size_t j = 0; j < batch; j++) {
+            r->iovs[j].iov_base = r->buffers + j * _buffer_size;
+            r->iovs[j].iov_len = _buffer_size;
+            memset(&r->msgs[j], 0, sizeof(struct mmsghdr));
+            r->msgs[j].msg_hdr.msg_iov = &r->iovs[j];
+            r->msgs[j].msg_hdr.msg_iovlen = 1;
+            r->msgs[j].msg_hdr.msg_name = &r->addrs[j];
+        }
+        r->thd = Thread("udp",
+            std::bind(&UdpEngine::WorkThread, this, std::placeholders::_1), r.get());
+        _reactors.push_back(std::move(r));
+    }
+    _next_socket.Store(0);
+    _datagrams_sent.Store(0);
+    _bytes_sent.Store(0);
+    _send_errors.Store(0);
+    _port = 0;
+    _shutdown = false;
+    return RAPTOR_ERROR_NONE;
+}
+
+raptor_error UdpEngine::Bind(const char* addr) {
+    if (_shutdown) return RAPTOR_ERROR_FROM_STATIC_STRING("udp engine uninitialized");
+    if (!addr) return RAPTOR_ERROR_FROM_STATIC_STRING("invalid parameters");
+    if (_reactors[0]->fd >= 0) return RAPTOR_ERROR_FROM_STATIC_STRING("udp engine already bound");
+
+    raptor_resolved_addresses* addrs = nullptr;
+    raptor_error e = raptor_blocking_resolve_address(addr, nullptr, &addrs);
+    if (e != RAPTOR_ERROR_NONE) {
+        return e;
+    }
+    raptor_resolved_address bind_addr = addrs->addrs[0];
+    raptor_resolved_addresses_destroy(addrs);
+
+    int family = raptor_sockaddr_get_family(&bind_addr);
+    if (family != AF_INET && family != AF_INET6) {
+        return RAPTOR_ERROR_FROM_FORMAT("not an ip address (%s)", addr);
+    }
+
+    for (size_t i = 0; i < _reactors.size(); i++) {
+        int fd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            e = RAPTOR_POSIX_ERROR("socket");
+            break;
+        }
+        _reactors[i]->fd = fd;
+
+        int one = 1;
+        if (family == AF_INET6) {
+            int zero = 0;
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+        }
+        if (_reactors.size() > 1
+            && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+            e = RAPTOR_POSIX_ERROR("setsockopt(SO_REUSEPORT)");
+            break;
+        }
+        if (_options.socket_buffer_size > 0) {
+            int size = static_cast<int>(_options.socket_buffer_size);
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        }
+        if (_options.enable_gro
+            && setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) != 0) {
+            log_error("udp engine: UDP_GRO unavailable (%s)", strerror(errno));
+            _options.enable_gro = 0;
+        }
+        // Shutdown wakes a blocked recvmmsg, the timeout is a fallback
+        struct timeval tv = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        if (bind(fd, reinterpret_cast<raptor_sockaddr*>(bind_addr.addr), bind_addr.len) != 0) {
+            e = RAPTOR_POSIX_ERROR("bind");
+            break;
+        }
+        if (i == 0) {
+            // the others bind the port picked for the first
+            raptor_resolved_address local;
+            local.len = sizeof(local.addr);
+            if (getsockname(fd, reinterpret_cast<raptor_sockaddr*>(local.addr), &local.len) != 0) {
+                e = RAPTOR_POSIX_ERROR("getsockname");
+                break;
+            }
+            _port = raptor_sockaddr_get_port(&local);
+            raptor_sockaddr_set_port(&bind_addr, _port);
+        }
+    }
+
+    if (e != RAPTOR_ERROR_NONE) {
+        for (auto& r : _reactors) {
+            if (r->fd >= 0) {
+                close(r->fd);
+                r->fd = -1;
+            }
+        }
+        _port = 0;
+        return e;
+    }
+
+    char* str = nullptr;
+    raptor_sockaddr_to_string(&str, &bind_addr, 0);
+    log_debug("udp engine: bound %s on %u sockets", str ? str : addr, (unsigned)_reactors.size());
+    Free(str);
+    return RAPTOR_ERROR_NONE;
+}
+
+raptor_error UdpEngine::Start() {
+    if (_shutdown) return RAPTOR_ERROR_FROM_STATIC_STRING("udp engine uninitialized");
+    if (_reactors[0]->fd < 0) return RAPTOR_ERROR_FROM_STATIC_STRING("udp engine not bound");
+    if (_started) return RAPTOR_ERROR_NONE;
+    _started = true;
+    for (auto& r : _reactors) {
+        r->thd.Start();
+    }
+    return RAPTOR_ERROR_NONE;
+}
+
+void UdpEngine::Shutdown() {
+    if (_shutdown) {
+        return;
+    }
+    _shutdown = true;
+    for (auto& r : _reactors) {
+        if (r->fd >= 0) {
+            // wakes the recvmmsg of the reactor
+            shutdown(r->fd, SHUT_RDWR);
+        }
+    }
+    if (_started) {
+        for (auto& r : _reactors) {
+            r->thd.Join();
+        }
+        _started = false;
+    }
+    for (auto& r : _reactors) {
+        if (r->fd >= 0) {
+            close(r->fd);
+            r->fd = -1;
+        }
+    }
+    _reactors.clear();
+    _port = 0;
+}
+
+void UdpEngine::WorkThread(void* ptr) {
+    Reactor* r = static_cast<Reactor*>(ptr);
+    t_udp_engine = this;
+    t_udp_fd = r->fd;
+    while (!_shutdown) {
+        ReceiveBatch(r);
+    }
+    t_udp_engine = nullptr;
+    t_udp_fd = -1;
+}
+
+void UdpEngine::ReceiveBatch(Reactor* r) {
+    size_t batch = r->msgs.size();
+    for (size_t i = 0; i < batch; i++) {
+        struct msghdr& hdr = r->msgs[i].msg_hdr;
+        hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        if (_options.enable_gro) {
+            hdr.msg_control = r->controls[i].buf;
+            hdr.msg_controllen = sizeof(r->controls[i].buf);
+        }
+        hdr.msg_flags = 0;
+    }
+
+    // blocks for the first datagram only
+    int n = recvmmsg(r->fd, r->msgs.data(), static_cast<unsigned int>(batch), MSG_WAITFORONE, nullptr);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && !_shutdown) {
+            UdpCounters::Add(r->counters.recv_errors, 1);
+            log_error_ratelimited(1000, "udp engine: recvmmsg (%s)", strerror(errno));
+        }
+        return;
+    }
+    UdpCounters::Add(r->counters.recv_calls, 1);
+    for (int i = 0; i < n; i++) {
+        if (r->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            UdpCounters::Add(r->counters.truncated, 1);
+            continue;
+        }
+        Deliver(r, static_cast<size_t>(i), r->msgs[i].msg_len);
+    }
+}
+
+void UdpEngine::Deliver(Reactor* r, size_t i, size_t len) {
+    struct msghdr& hdr = r->msgs[i].msg_hdr;
+    UdpPeer peer;
+    peer.len = hdr.msg_namelen;
+    memcpy(peer.addr, hdr.msg_name, RAPTOR_MIN(sizeof(peer.addr), static_cast<size_t>(peer.len)));
+
+    size_t segment = len;
+    if (_options.enable_gro) {
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int size = 0;
+                memcpy(&size, CMSG_DATA(cm), sizeof(size));
+                if (size > 0) {
+                    segment = static_cast<size_t>(size);
+                }
+            }
+        }
+    }
+
+    const uint8_t* data = r->buffers + i * _buffer_size;
+    size_t count = 0;
+    for (size_t offset = 0; offset < len; offset += segment) {
+        size_t n = RAPTOR_MIN(segment, len - offset);
+        if (n > _options.max_datagram_size) {
+            UdpCounters::Add(r->counters.truncated, 1);
+            continue;
+        }
+        _service->OnDatagramReceived(&peer, data + offset, n);
+        count++;
+    }
+    UdpCounters::Add(r->counters.datagrams_received, count);
+    UdpCounters::Add(r->counters.bytes_received, len);
+}
+
+int UdpEngine::SendSocket() {
+    if (t_udp_engine == this) {
+        return t_udp_fd;
+    }
+    if (_reactors.empty()) {
+        return -1;
+    }
+    uint32_t n = _next_socket.FetchAdd(1, MemoryOrder::RELAXED);
+    return _reactors[n % _reactors.size()]->fd;
+}
+
+bool UdpEngine::SendTo(const UdpPeer* peer, const void* data, size_t len, size_t segment_size) {
+    if (_shutdown || !peer || !data || len == 0) {
+        return false;
+    }
+    int fd = SendSocket();
+    if (fd < 0) {
+        return false;
+    }
+    const uint8_t* ptr = static_cast<const uint8_t*>(data);
+    if (segment_size == 0 || segment_size >= len) {
+        ssize_t r = sendto(fd, ptr, len, MSG_DONTWAIT,
+            reinterpret_cast<const raptor_sockaddr*>(peer->addr), peer->len);
+        if (r < 0) {
+            _send_errors.FetchAdd(1, MemoryOrder::RELAXED);
+            return false;
+        }
+        _datagrams_sent.FetchAdd(1, MemoryOrder::RELAXED);
+        _bytes_sent.FetchAdd(len, MemoryOrder::RELAXED);
+        return true;
+    }
+    if (segment_size > MAX_DATAGRAM_SIZE) {
+        return false;
+    }
+    return SendSegments(fd, peer, ptr, len, segment_size);
+}
+
+bool UdpEngine::SendSegments(int fd, const UdpPeer* peer,
+    const uint8_t* data, size_t len, size_t segment_size) {
+    // bytes of one UDP_SEGMENT send, whole segments only
+    size_t gso_bytes = RAPTOR_MIN(
+        static_cast<size_t>(MAX_GSO_SEGMENTS), MAX_DATAGRAM_SIZE / segment_size) * segment_size;
+
+    size_t offset = 0;
+    while (offset < len && _options.enable_gso) {
+        size_t n = RAPTOR_MIN(gso_bytes, len - offset);
+        struct iovec iov;
+        iov.iov_base = const_cast<uint8_t*>(data + offset);
+        iov.iov_len = n;
+
+        GsoControl control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = const_cast<char*>(peer->addr);
+        msg.msg_namelen = peer->len;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t size = static_cast<uint16_t>(segment_size);
+        memcpy(CMSG_DATA(cm), &size, sizeof(size));
+
+        if (sendmsg(fd, &msg, MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                _send_errors.FetchAdd(1, MemoryOrder::RELAXED);
+                return false;
+            }
+            // no segmentation offload on this route, split it here
+            break;
+        }
+        _datagrams_sent.FetchAdd((n + segment_size - 1) / segment_size, MemoryOrder::RELAXED);
+        _bytes_sent.FetchAdd(n, MemoryOrder::RELAXED);
+        offset += n;
+    }
+
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iovs[SEND_BATCH];
+    while (offset < len) {
+        size_t count = 0;
+        for (; count < SEND_BATCH && offset < len; count++) {
+            size_t n = RAPTOR_MIN(segment_size, len - offset);
+            iovs[count].iov_base = const_cast<uint8_t*>(data + offset);
+            iovs[count].iov_len = n;
+            memset(&msgs[count], 0, sizeof(struct mmsghdr));
+            msgs[count].msg_hdr.msg_name = const_cast<char*>(peer->addr);
+            msgs[count].msg_hdr.msg_namelen = peer->len;
+            msgs[count].msg_hdr.msg_iov = &iovs[count];
+            msgs[count].msg_hdr.msg_iovlen = 1;
+            offset += n;
+        }
+        if (SendMessages(fd, msgs, count) != count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t UdpEngine::SendBatch(const UdpDatagram* datagrams, size_t count) {
+    if (_shutdown || !datagrams) {
+        return 0;
+    }
+    int fd = SendSocket();
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iovs[SEND_BATCH];
+    size_t sent = 0;
+    while (sent < count) {
+        size_t n = RAPTOR_MIN(count - sent, static_cast<size_t>(SEND_BATCH));
+        for (size_t i = 0; i < n; i++) {
+            const UdpDatagram& d = datagrams[sent + i];
+            iovs[i].iov_base = const_cast<void*>(d.data);
+            iovs[i].iov_len = d.len;
+            memset(&msgs[i], 0, sizeof(struct mmsghdr));
+            msgs[i].msg_hdr.msg_name = const_cast<char*>(d.peer->addr);
+            msgs[i].msg_hdr.msg_namelen = d.peer->len;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        size_t done = SendMessages(fd, msgs, n);
+        sent += done;
+        if (done < n) {
+            break;
+        }
+    }
+    return sent;
+}
+
+size_t UdpEngine::SendMessages(int fd, struct mmsghdr* msgs, size_t count) {
+    size_t sent = 0;
+    while (sent < count) {
+        int r = sendmmsg(fd, msgs + sent, static_cast<unsigned int>(count - sent), MSG_DONTWAIT);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _send_errors.FetchAdd(1, MemoryOrder::RELAXED);
+            break;
+        }
+        for (int i = 0; i < r; i++) {
+            _bytes_sent.FetchAdd(msgs[sent + i].msg_len, MemoryOrder::RELAXED);
+        }
+        _datagrams_sent.FetchAdd(r, MemoryOrder::RELAXED);
+        sent += static_cast<size_t>(r);
+    }
+    return sent;
+}
+
+void UdpEngine::GetStats(UdpStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (auto& r : _reactors) {
+        stats->datagrams_received += r->counters.datagrams_received.Load();
+        stats->bytes_received += r->counters.bytes_received.Load();
+        stats->truncated += r->counters.truncated.Load();
+        stats->recv_errors += r->counters.recv_errors.Load();
+        stats->recv_calls += r->counters.recv_calls.Load();
+    }
+    stats->datagrams_sent = _datagrams_sent.Load();
+    stats->bytes_sent = _bytes_sent.Load();
+    stats->send_errors = _send_errors.Load();
+}
+
+} // namespace raptor
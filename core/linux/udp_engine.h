@@ -0,0 +1,112 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_CORE_LINUX_UDP_ENGINE__
+#define __RAPTOR_CORE_LINUX_UDP_ENGINE__
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include "raptor/service.h"
+#include "util/atomic.h"
+#include "util/status.h"
+#include "util/thread.h"
+#include "util/useful.h"
+
+struct mmsghdr;
+struct iovec;
+
+namespace raptor {
+
+// Counters of one reactor, written only by its thread.
+struct UdpCounters {
+    AtomicUInt64 datagrams_received;
+    AtomicUInt64 bytes_received;
+    AtomicUInt64 truncated;
+    AtomicUInt64 recv_errors;
+    AtomicUInt64 recv_calls;
+    char padding[RAPTOR_CACHELINE_SIZE];
+
+    static void Add(AtomicUInt64& counter, uint64_t n) {
+        counter.Store(counter.Load(MemoryOrder::RELAXED) + n, MemoryOrder::RELAXED);
+    }
+};
+
+/*
+    One SO_REUSEPORT socket per reactor, the kernel spreads the
+    datagrams over them by the peer's address. Each reactor thread
+    blocks in recvmmsg on its own socket and runs the callback
+    inline. Sends go out on the socket of the calling reactor thread,
+    so a reply from the callback needs no locking.
+*/
+class UdpEngine final {
+public:
+    explicit UdpEngine(IUdpReceiver* service);
+    ~UdpEngine();
+
+    raptor_error Init(const UdpOptions* options);
+    raptor_error Bind(const char* addr);
+    raptor_error Start();
+    void Shutdown();
+
+    bool SendTo(const UdpPeer* peer, const void* data, size_t len, size_t segment_size);
+    size_t SendBatch(const UdpDatagram* datagrams, size_t count);
+    int GetLocalPort() const { return _port; }
+    void GetStats(UdpStats* stats);
+
+private:
+    struct Reactor;
+
+    void WorkThread(void* ptr);
+    void ReceiveBatch(Reactor* r);
+    // splits a UDP_GRO buffer into the datagrams it coalesced
+    void Deliver(Reactor* r, size_t i, size_t len);
+    int SendSocket();
+    // the socket sends at most UDP_MAX_SEGMENTS per call
+    bool SendSegments(int fd, const UdpPeer* peer,
+        const uint8_t* data, size_t len, size_t segment_size);
+    size_t SendMessages(int fd, struct mmsghdr* msgs, size_t count);
+
+    enum {
+        DEFAULT_RECV_BATCH = 32,
+        MAX_RECV_BATCH = 1024,
+        MAX_DATAGRAM_SIZE = 65507,
+        // UDP_MAX_SEGMENTS of the kernel
+        MAX_GSO_SEGMENTS = 64,
+        SEND_BATCH = 64
+    };
+
+    IUdpReceiver* _service;
+    bool _shutdown;
+    bool _started;
+    UdpOptions _options;
+    size_t _buffer_size;
+    int _port;
+
+    std::vector<std::unique_ptr<Reactor>> _reactors;
+    Atomic<uint32_t> _next_socket;
+
+    AtomicUInt64 _datagrams_sent;
+    AtomicUInt64 _bytes_sent;
+    AtomicUInt64 _send_errors;
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_CORE_LINUX_UDP_ENGINE__
@@ -0,0 +1,63 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "core/linux/wakeup_fd.h"
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace raptor {
+
+WakeupFd::WakeupFd()
+    : _fd(-1) {}
+
+WakeupFd::~WakeupFd() {
+    if (_fd != -1) {
+        close(_fd);
+    }
+}
+
+RefCountedPtr<Status> WakeupFd::Init() {
+    if (_fd != -1) {
+        return RAPTOR_ERROR_NONE;
+    }
+    _fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_fd < 0) {
+        return RAPTOR_POSIX_ERROR("eventfd");
+    }
+    return RAPTOR_ERROR_NONE;
+}
+
+void WakeupFd::Wakeup() {
+    uint64_t one = 1;
+    ssize_t r;
+    do {
+        r = write(_fd, &one, sizeof(one));
+    } while (r < 0 && errno == EINTR);
+}
+
+void WakeupFd::Consume() {
+    uint64_t value;
+    ssize_t r;
+    do {
+        r = read(_fd, &value, sizeof(value));
+    } while (r < 0 && errno == EINTR);
+}
+
+} // namespace raptor
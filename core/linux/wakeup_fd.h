@@ -0,0 +1,52 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_CORE_LINUX_WAKEUP_FD__
+#define __RAPTOR_CORE_LINUX_WAKEUP_FD__
+
+#include "core/cid.h"
+#include "util/status.h"
+
+namespace raptor {
+
+// An eventfd added to a poll loop, so that another thread can make
+// it return from a wait without a timeout. Wakeups coalesce until
+// Consume.
+class WakeupFd final {
+public:
+    WakeupFd();
+    ~WakeupFd();
+
+    WakeupFd(const WakeupFd&) = delete;
+    WakeupFd& operator= (const WakeupFd&) = delete;
+
+    RefCountedPtr<Status> Init();
+    int Fd() const { return _fd; }
+    void Wakeup();
+    void Consume();
+
+    // epoll data of the descriptor, never a connection id
+    static void* Tag() { return reinterpret_cast<void*>(core::InvalidConnectionId); }
+
+private:
+    int _fd;
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_CORE_LINUX_WAKEUP_FD__
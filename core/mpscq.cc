@@ -92,4 +92,10 @@ MultiProducerSingleConsumerQueue::Node* MultiProducerSingleConsumerQueue::PopAnd
     return nullptr;
 }
 
+bool MultiProducerSingleConsumerQueue::IsEmpty() const {
+    return _oldest == &_stub
+        && _stub.next.Load(MemoryOrder::ACQUIRE) == nullptr
+        && _newest.Load(MemoryOrder::ACQUIRE) == &_stub;
+}
+
 } // namespace raptor
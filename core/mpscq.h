@@ -25,7 +25,8 @@
 namespace raptor {
 
 // Multiple producer single consumer queue
-// If you want to use pop in multiple threads, use LockedMessageQueue
+// If you want to use pop in multiple threads, or a bounded queue
+// without a node per element, see core/ring_queue.h
 class MultiProducerSingleConsumerQueue final {
 public:
     struct Node {
@@ -42,6 +43,10 @@ public:
     Node* pop();
     Node* PopAndCheckEnd(bool * empty);
 
+    // Consumer only, true if every pushed node has been popped
+    // and no push is in progress.
+    bool IsEmpty() const;
+
 private:
     union {
         char _padding[64];
@@ -0,0 +1,268 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "core/package_checker.h"
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include "core/slice/slice_buffer.h"
+#include "util/useful.h"
+
+namespace raptor {
+
+namespace {
+const size_t kNotFound = static_cast<size_t>(-1);
+
+// The SIMD loops test the first and the last delimiter byte at every
+// position of a block at once, only the positions matching both are
+// compared in full. Return the offset of the first delimiter lying
+// entirely in [data, data + len) or kNotFound.
+size_t FindDelimiter(const uint8_t* data, size_t len, const char* delimiter, size_t dlen) {
+    if (len < dlen) {
+        return kNotFound;
+    }
+    const uint8_t first = static_cast<uint8_t>(delimiter[0]);
+    const uint8_t last = static_cast<uint8_t>(delimiter[dlen - 1]);
+    const size_t end = len - dlen + 1;  // candidate positions
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i vf = _mm256_set1_epi8(static_cast<char>(first));
+    const __m256i vl = _mm256_set1_epi8(static_cast<char>(last));
+    for (; i + 32 <= end; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + dlen - 1));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, vf), _mm256_cmpeq_epi8(b, vl))));
+        while (mask != 0) {
+            size_t k = i + __builtin_ctz(mask);
+            if (memcmp(data + k, delimiter, dlen) == 0) {
+                return k;
+            }
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i vf = _mm_set1_epi8(static_cast<char>(first));
+    const __m128i vl = _mm_set1_epi8(static_cast<char>(last));
+    for (; i + 16 <= end; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + dlen - 1));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, vf), _mm_cmpeq_epi8(b, vl))));
+        while (mask != 0) {
+            size_t k = i + __builtin_ctz(mask);
+            if (memcmp(data + k, delimiter, dlen) == 0) {
+                return k;
+            }
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t vf = vdupq_n_u8(first);
+    const uint8x16_t vl = vdupq_n_u8(last);
+    for (; i + 16 <= end; i += 16) {
+        uint8x16_t a = vld1q_u8(data + i);
+        uint8x16_t b = vld1q_u8(data + i + dlen - 1);
+        uint8x16_t m = vandq_u8(vceqq_u8(a, vf), vceqq_u8(b, vl));
+        if (vmaxvq_u8(m) == 0) {
+            continue;
+        }
+        for (size_t k = i; k < i + 16; k++) {
+            if (data[k] == first && memcmp(data + k, delimiter, dlen) == 0) {
+                return k;
+            }
+        }
+    }
+#endif
+
+    for (; i < end; i++) {
+        if (data[i] == first && data[i + dlen - 1] == last
+            && memcmp(data + i, delimiter, dlen) == 0) {
+            return i;
+        }
+    }
+    return kNotFound;
+}
+} // namespace
+
+SliceBufferView::SliceBufferView(const SliceBuffer& buffer)
+    : _buffer(buffer) {}
+
+size_t SliceBufferView::Length() const {
+    return _buffer.GetBufferLength();
+}
+
+size_t SliceBufferView::SegmentCount() const {
+    return _buffer.Count();
+}
+
+const void* SliceBufferView::Segment(size_t index, size_t* len) const {
+    const Slice& s = _buffer[index];
+    *len = s.size();
+    return s.begin();
+}
+
+size_t SliceBufferView::Peek(size_t offset, void* buf, size_t len) const {
+    size_t pos = 0;
+    size_t count = _buffer.Count();
+    for (size_t i = 0; i < count && pos < len; i++) {
+        const Slice& s = _buffer[i];
+        if (offset >= s.size()) {
+            offset -= s.size();
+            continue;
+        }
+        size_t n = RAPTOR_MIN(len - pos, s.size() - offset);
+        memcpy(static_cast<uint8_t*>(buf) + pos, s.begin() + offset, n);
+        pos += n;
+        offset = 0;
+    }
+    return pos;
+}
+
+PackageChecker::PackageChecker()
+    : _proto(nullptr)
+    , _scatter(nullptr)
+    , _framing(nullptr)
+    , _scan_offset(0) {}
+
+void PackageChecker::SetProtocol(IProtocol* proto) {
+    _proto = proto;
+    _scatter = dynamic_cast<IScatterProtocol*>(proto);
+    FramingProtocol* framing = dynamic_cast<FramingProtocol*>(proto);
+    _framing = (framing && framing::IsValid(framing->GetFramingSpec()))
+        ? &framing->GetFramingSpec() : nullptr;
+    _scan_offset = 0;
+}
+
+int PackageChecker::Check(const SliceBuffer& buffer) {
+    size_t cache_size = buffer.GetBufferLength();
+    if (cache_size == 0) {
+        return 0;
+    }
+
+    if (_framing) {
+        return CheckFraming(buffer);
+    }
+
+    if (_scatter) {
+        SliceBufferView view(buffer);
+        return _scatter->CheckPackageView(view);
+    }
+
+    size_t read_size = RAPTOR_MAX(_proto->GetMaxHeaderSize(), static_cast<size_t>(1));
+    for (;;) {
+        size_t n = RAPTOR_MIN(read_size, cache_size);
+        int pack_len;
+        const Slice& front = buffer.Front();
+        if (front.size() >= n) {
+            pack_len = _proto->CheckPackageLength(front.begin(), n);
+        } else {
+            Slice header = MakeSliceByLength(n);
+            buffer.PeekHeader(header.Buffer(), n);
+            pack_len = _proto->CheckPackageLength(header.begin(), n);
+        }
+
+        // equal 0 means we need more data
+        if (pack_len != 0 || n == cache_size) {
+            return pack_len;
+        }
+        read_size *= 2;
+    }
+}
+
+int PackageChecker::CheckFraming(const SliceBuffer& buffer) {
+    const FramingSpec& spec = *_framing;
+    if (spec.kind == FramingSpec::kDelimiter) {
+        return ScanDelimiter(buffer);
+    }
+
+    size_t cache_size = buffer.GetBufferLength();
+    size_t need = (spec.kind == FramingSpec::kLengthPrefixed)
+        ? spec.header_size
+        : RAPTOR_MIN(cache_size, static_cast<size_t>(FramingSpec::kMaxVarintSize));
+    if (cache_size < need) {
+        return 0;
+    }
+
+    // the header is decoded in place unless it spans slices
+    const Slice& front = buffer.Front();
+    const uint8_t* header = front.begin();
+    Slice copy;
+    if (front.size() < need) {
+        copy = MakeSliceByLength(need);
+        buffer.PeekHeader(copy.Buffer(), need);
+        header = copy.begin();
+    }
+
+    if (spec.kind == FramingSpec::kLengthPrefixed) {
+        return framing::DecodeLengthPrefixed(spec, header);
+    }
+    return framing::DecodeVarint(spec, header, need);
+}
+
+int PackageChecker::ScanDelimiter(const SliceBuffer& buffer) {
+    const FramingSpec& spec = *_framing;
+    const size_t dlen = spec.delimiter_size;
+    const uint8_t first = static_cast<uint8_t>(spec.delimiter[0]);
+    SliceBufferView view(buffer);
+
+    size_t base = 0;
+    size_t count = buffer.Count();
+    for (size_t i = 0; i < count; i++) {
+        const Slice& s = buffer[i];
+        const uint8_t* data = s.begin();
+        size_t len = s.size();
+        if (base + len <= _scan_offset) {
+            base += len;
+            continue;
+        }
+
+        size_t pos = (_scan_offset > base) ? _scan_offset - base : 0;
+        size_t hit = FindDelimiter(data + pos, len - pos, spec.delimiter, dlen);
+        if (hit != kNotFound) {
+            _scan_offset = 0;
+            return framing::CheckTotal(spec, base + pos + hit + dlen);
+        }
+
+        // a delimiter starting in the last dlen - 1 bytes
+        // may continue in the next slice
+        size_t tail = (len - pos >= dlen - 1) ? len - (dlen - 1) : pos;
+        for (size_t k = tail; k < len; k++) {
+            char tmp[FramingSpec::kMaxDelimiterSize];
+            if (data[k] == first
+                && view.Peek(base + k, tmp, dlen) == dlen
+                && memcmp(tmp, spec.delimiter, dlen) == 0) {
+                _scan_offset = 0;
+                return framing::CheckTotal(spec, base + k + dlen);
+            }
+        }
+        base += len;
+    }
+
+    // the last dlen - 1 bytes are checked again with more data
+    _scan_offset = (base >= dlen - 1) ? base - (dlen - 1) : 0;
+    return (base >= framing::MaxPackageSize(spec)) ? -1 : 0;
+}
+
+} // namespace raptor
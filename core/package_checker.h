@@ -0,0 +1,73 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_CORE_PACKAGE_CHECKER__
+#define __RAPTOR_CORE_PACKAGE_CHECKER__
+
+#include <stddef.h>
+#include "raptor/framing.h"
+#include "raptor/protocol.h"
+
+namespace raptor {
+class SliceBuffer;
+
+// IBufferView over the slices of a SliceBuffer, without copying
+class SliceBufferView final : public IBufferView {
+public:
+    explicit SliceBufferView(const SliceBuffer& buffer);
+
+    size_t Length() const override;
+    size_t SegmentCount() const override;
+    const void* Segment(size_t index, size_t* len) const override;
+    size_t Peek(size_t offset, void* buf, size_t len) const override;
+
+private:
+    const SliceBuffer& _buffer;
+};
+
+// Checks the package at the head of a SliceBuffer with the protocol
+// set on a connection. How is decided once in SetProtocol:
+// - a FramingProtocol is parsed here from its FramingSpec,
+// - an IScatterProtocol sees the buffer in place,
+// - a plain IProtocol gets GetMaxHeaderSize() bytes, doubled while
+//   it needs more, copied only when they span slices.
+class PackageChecker final {
+public:
+    PackageChecker();
+
+    void SetProtocol(IProtocol* proto);
+
+    // return -1: error;  0: need more data; > 0 : pack_len
+    int Check(const SliceBuffer& buffer);
+
+private:
+    int CheckFraming(const SliceBuffer& buffer);
+    int ScanDelimiter(const SliceBuffer& buffer);
+
+    IProtocol* _proto;
+    IScatterProtocol* _scatter;
+    const FramingSpec* _framing;
+
+    // delimiter framing: the leading bytes of the buffer already known
+    // to hold no delimiter, a growing line is not scanned again.
+    size_t _scan_offset;
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_CORE_PACKAGE_CHECKER__
@@ -18,9 +18,13 @@
 
 #include "core/resolve_address.h"
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <memory>
+#ifndef _WIN32
+#include <sys/un.h>
+#endif
 
 #include "core/host_port.h"
 #include "core/sockaddr.h"
@@ -31,11 +35,64 @@
 #include "util/string_view.h"
 #include "util/useful.h"
 
+static const char kUnixPrefix[] = "unix:";
+static const char kUnixAbstractPrefix[] = "unix-abstract:";
+
+bool raptor_is_unix_address(const char* name) {
+    return strncmp(name, kUnixPrefix, sizeof(kUnixPrefix) - 1) == 0
+        || strncmp(name, kUnixAbstractPrefix, sizeof(kUnixAbstractPrefix) - 1) == 0;
+}
+
+static raptor_error raptor_resolve_unix_address(
+                                const char* name,
+                                raptor_resolved_addresses** addresses) {
+#ifdef _WIN32
+    return RAPTOR_ERROR_FROM_FORMAT("unix domain sockets are not supported (%s)", name);
+#else
+    bool abstract =
+        strncmp(name, kUnixAbstractPrefix, sizeof(kUnixAbstractPrefix) - 1) == 0;
+    const char* path = name + (abstract
+        ? sizeof(kUnixAbstractPrefix) - 1 : sizeof(kUnixPrefix) - 1);
+    size_t len = strlen(path);
+
+    struct sockaddr_un un;
+    // a path needs its terminator, an abstract name its leading NUL
+    if (len == 0 || len >= sizeof(un.sun_path)) {
+        return RAPTOR_ERROR_FROM_FORMAT("invalid unix socket path (%s)", name);
+    }
+
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    socklen_t addr_len;
+    if (abstract) {
+        memcpy(un.sun_path + 1, path, len);
+        addr_len = static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+    } else {
+        memcpy(un.sun_path, path, len);
+        addr_len = static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + len + 1);
+    }
+
+    *addresses = static_cast<raptor_resolved_addresses*>(
+        raptor::Malloc(sizeof(raptor_resolved_addresses)));
+    (*addresses)->naddrs = 1;
+    (*addresses)->addrs = static_cast<raptor_resolved_address*>(
+        raptor::Malloc(sizeof(raptor_resolved_address)));
+    memset((*addresses)->addrs, 0, sizeof(raptor_resolved_address));
+    memcpy((*addresses)->addrs[0].addr, &un, addr_len);
+    (*addresses)->addrs[0].len = addr_len;
+    return RAPTOR_ERROR_NONE;
+#endif
+}
+
 raptor_error raptor_blocking_resolve_address(
                                 const char* name,
                                 const char* default_port,
                                 raptor_resolved_addresses** addresses) {
 
+    if (raptor_is_unix_address(name)) {
+        return raptor_resolve_unix_address(name, addresses);
+    }
+
     struct addrinfo hints;
     struct addrinfo *result = nullptr, *resp;
     int s;
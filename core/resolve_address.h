@@ -34,6 +34,10 @@ typedef struct {
     raptor_resolved_address* addrs;
 } raptor_resolved_addresses;
 
+/* Names of unix domain sockets, "unix:/path/to/socket" or
+   "unix-abstract:name" in the linux abstract namespace. */
+bool raptor_is_unix_address(const char* name);
+
 /* Resolve addr in a blocking fashion. On success,
    default_port can be nullptr, or "https" or "http"
    result must be freed with grpc_resolved_addresses_destroy. */
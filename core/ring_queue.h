@@ -0,0 +1,265 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_CORE_RING_QUEUE__
+#define __RAPTOR_CORE_RING_QUEUE__
+
+#include <stddef.h>
+#include <memory>
+#include <utility>
+
+#include "util/atomic.h"
+#include "util/useful.h"
+
+namespace raptor {
+
+/*
+    Bounded multiple producer multiple consumer queue (D. Vyukov's
+    ring). Every cell carries a sequence number which tells whether
+    it is free for the push of a position or holds the value for the
+    pop of it, a push or a pop claims its position with one CAS on
+    its cursor. Producers and consumers only share the cells.
+    The cells are allocated once by the constructor, the capacity is
+    rounded up to a power of two. T must be default constructible and
+    movable. A batch claims as many consecutive positions as are
+    ready with a single CAS, so it may push or pop fewer than asked.
+*/
+template <typename T>
+class MultiProducerMultiConsumerRing final {
+public:
+    explicit MultiProducerMultiConsumerRing(size_t capacity)
+        : _mask(RoundUp(capacity) - 1)
+        , _cells(new Cell[_mask + 1])
+        , _push_pos(0)
+        , _pop_pos(0) {
+        for (size_t i = 0; i <= _mask; i++) {
+            _cells[i].seq.Store(i, MemoryOrder::RELAXED);
+        }
+    }
+
+    MultiProducerMultiConsumerRing(const MultiProducerMultiConsumerRing&) = delete;
+    MultiProducerMultiConsumerRing& operator= (const MultiProducerMultiConsumerRing&) = delete;
+
+    size_t Capacity() const { return _mask + 1; }
+
+    // return false if the ring is full
+    bool TryPush(T value) {
+        size_t pos;
+        if (Claim(&_push_pos, 0, 1, &pos) == 0) {
+            return false;
+        }
+        Cell& cell = _cells[pos & _mask];
+        cell.value = std::move(value);
+        cell.seq.Store(pos + 1, MemoryOrder::RELEASE);
+        return true;
+    }
+
+    // return false if the ring is empty
+    bool TryPop(T* value) {
+        size_t pos;
+        if (Claim(&_pop_pos, 1, 1, &pos) == 0) {
+            return false;
+        }
+        Cell& cell = _cells[pos & _mask];
+        *value = std::move(cell.value);
+        cell.seq.Store(pos + _mask + 1, MemoryOrder::RELEASE);
+        return true;
+    }
+
+    // return the number of values pushed, from the front of values
+    size_t TryPushBatch(T* values, size_t count) {
+        size_t pos;
+        size_t n = Claim(&_push_pos, 0, count, &pos);
+        for (size_t i = 0; i < n; i++) {
+            Cell& cell = _cells[(pos + i) & _mask];
+            cell.value = std::move(values[i]);
+            cell.seq.Store(pos + i + 1, MemoryOrder::RELEASE);
+        }
+        return n;
+    }
+
+    // return the number of values popped into values
+    size_t TryPopBatch(T* values, size_t count) {
+        size_t pos;
+        size_t n = Claim(&_pop_pos, 1, count, &pos);
+        for (size_t i = 0; i < n; i++) {
+            Cell& cell = _cells[(pos + i) & _mask];
+            values[i] = std::move(cell.value);
+            cell.seq.Store(pos + i + _mask + 1, MemoryOrder::RELEASE);
+        }
+        return n;
+    }
+
+    // approximate while other threads push or pop
+    size_t Size() const {
+        size_t push = _push_pos.Load(MemoryOrder::ACQUIRE);
+        size_t pop = _pop_pos.Load(MemoryOrder::ACQUIRE);
+        return push > pop ? push - pop : 0;
+    }
+
+    bool IsEmpty() const { return Size() == 0; }
+
+private:
+    struct Cell {
+        Atomic<size_t> seq;
+        T value;
+    };
+
+    static size_t RoundUp(size_t n) {
+        size_t r = 2;
+        while (r < n) r <<= 1;
+        return r;
+    }
+
+    // Claims up to count positions from *cursor whose cells have the
+    // sequence number of the position plus 'lag': 0 for a free cell,
+    // 1 for a filled one. Returns how many, the first one in *pos.
+    size_t Claim(Atomic<size_t>* cursor, size_t lag, size_t count, size_t* pos) {
+        size_t p = cursor->Load(MemoryOrder::RELAXED);
+        for (;;) {
+            size_t n = 0;
+            while (n < count && n <= _mask) {
+                size_t seq = _cells[(p + n) & _mask].seq.Load(MemoryOrder::ACQUIRE);
+                if (seq != p + n + lag) {
+                    break;
+                }
+                n++;
+            }
+            if (n == 0) {
+                size_t seq = _cells[p & _mask].seq.Load(MemoryOrder::ACQUIRE);
+                // behind the cursor: full for a push, empty for a pop
+                if (static_cast<ptrdiff_t>(seq - (p + lag)) < 0) {
+                    return 0;
+                }
+                // another thread claimed p meanwhile
+                p = cursor->Load(MemoryOrder::RELAXED);
+                continue;
+            }
+            if (cursor->CompareExchangeWeak(
+                    &p, p + n, MemoryOrder::RELAXED, MemoryOrder::RELAXED)) {
+                *pos = p;
+                return n;
+            }
+        }
+    }
+
+    const size_t _mask;
+    std::unique_ptr<Cell[]> _cells;
+    char _padding0[RAPTOR_CACHELINE_SIZE];
+    Atomic<size_t> _push_pos;
+    char _padding1[RAPTOR_CACHELINE_SIZE];
+    Atomic<size_t> _pop_pos;
+    char _padding2[RAPTOR_CACHELINE_SIZE];
+};
+
+/*
+    Bounded single producer single consumer queue. Each side keeps a
+    private copy of the other side's index and only reloads it when
+    the copy says the ring is full or empty, so a side touches the
+    shared cache line about once per lap. Same capacity rule and
+    requirements on T as MultiProducerMultiConsumerRing.
+*/
+template <typename T>
+class SingleProducerSingleConsumerRing final {
+public:
+    explicit SingleProducerSingleConsumerRing(size_t capacity)
+        : _mask(RoundUp(capacity) - 1)
+        , _values(new T[_mask + 1])
+        , _tail(0)
+        , _head_cache(0)
+        , _head(0)
+        , _tail_cache(0) {}
+
+    SingleProducerSingleConsumerRing(const SingleProducerSingleConsumerRing&) = delete;
+    SingleProducerSingleConsumerRing& operator= (const SingleProducerSingleConsumerRing&) = delete;
+
+    size_t Capacity() const { return _mask + 1; }
+
+    // producer only, return false if the ring is full
+    bool TryPush(T value) {
+        return TryPushBatch(&value, 1) == 1;
+    }
+
+    // consumer only, return false if the ring is empty
+    bool TryPop(T* value) {
+        return TryPopBatch(value, 1) == 1;
+    }
+
+    // producer only, return the number of values pushed
+    size_t TryPushBatch(T* values, size_t count) {
+        size_t tail = _tail.Load(MemoryOrder::RELAXED);
+        size_t room = _mask + 1 - (tail - _head_cache);
+        if (room < count) {
+            _head_cache = _head.Load(MemoryOrder::ACQUIRE);
+            room = _mask + 1 - (tail - _head_cache);
+        }
+        size_t n = RAPTOR_MIN(room, count);
+        for (size_t i = 0; i < n; i++) {
+            _values[(tail + i) & _mask] = std::move(values[i]);
+        }
+        if (n > 0) {
+            _tail.Store(tail + n, MemoryOrder::RELEASE);
+        }
+        return n;
+    }
+
+    // consumer only, return the number of values popped
+    size_t TryPopBatch(T* values, size_t count) {
+        size_t head = _head.Load(MemoryOrder::RELAXED);
+        size_t ready = _tail_cache - head;
+        if (ready < count) {
+            _tail_cache = _tail.Load(MemoryOrder::ACQUIRE);
+            ready = _tail_cache - head;
+        }
+        size_t n = RAPTOR_MIN(ready, count);
+        for (size_t i = 0; i < n; i++) {
+            values[i] = std::move(_values[(head + i) & _mask]);
+        }
+        if (n > 0) {
+            _head.Store(head + n, MemoryOrder::RELEASE);
+        }
+        return n;
+    }
+
+    // exact on the consumer, approximate elsewhere
+    bool IsEmpty() const {
+        return _head.Load(MemoryOrder::RELAXED) == _tail.Load(MemoryOrder::ACQUIRE);
+    }
+
+private:
+    static size_t RoundUp(size_t n) {
+        size_t r = 2;
+        while (r < n) r <<= 1;
+        return r;
+    }
+
+    const size_t _mask;
+    std::unique_ptr<T[]> _values;
+    char _padding0[RAPTOR_CACHELINE_SIZE];
+    // written by the producer
+    Atomic<size_t> _tail;
+    size_t _head_cache;
+    char _padding1[RAPTOR_CACHELINE_SIZE];
+    // written by the consumer
+    Atomic<size_t> _head;
+    size_t _tail_cache;
+    char _padding2[RAPTOR_CACHELINE_SIZE];
+};
+
+} // namespace raptor
+#endif  // __RAPTOR_CORE_RING_QUEUE__
@@ -0,0 +1,61 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_CORE_SERVER_STATS__
+#define __RAPTOR_CORE_SERVER_STATS__
+
+#include "util/atomic.h"
+#include "util/useful.h"
+
+namespace raptor {
+
+/*
+    Counters of one reactor, updated with relaxed atomic adds by the
+    threads serving its connections and summed by TcpServer::GetStats.
+    Each reactor has its own block and the trailing padding keeps
+    neighbouring blocks of an array off each other's cache lines.
+*/
+struct ServerCounters {
+    AtomicUInt64 accepted;
+    AtomicUInt64 closed;
+    AtomicUInt64 timeouts;
+    AtomicUInt64 protocol_errors;
+    AtomicUInt64 bytes_received;
+    AtomicUInt64 bytes_sent;
+    AtomicUInt64 messages_received;
+    AtomicUInt64 messages_sent;
+    AtomicUInt64 send_queued_bytes;
+    AtomicUInt64 idle_compactions;
+    AtomicUInt64 overload_pauses;
+    AtomicUInt64 recv_buffered_bytes;
+    // capacity of the connections' buffer rings, see SliceBuffer::SetRingCounter
+    AtomicUInt64 ring_bytes;
+    AtomicUInt64 memory_evictions;
+    char padding[RAPTOR_CACHELINE_SIZE];
+
+    static void Add(AtomicUInt64& counter, uint64_t n) {
+        counter.FetchAdd(n, MemoryOrder::RELAXED);
+    }
+    static void Sub(AtomicUInt64& counter, uint64_t n) {
+        counter.FetchSub(n, MemoryOrder::RELAXED);
+    }
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_CORE_SERVER_STATS__
@@ -19,29 +19,57 @@
 #ifndef __RAPTOR_CORE_SERVICE__
 #define __RAPTOR_CORE_SERVICE__
 
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 #include "core/cid.h"
 #include "core/sockaddr.h"
 #include "core/resolve_address.h"
+#include "core/slice/slice.h"
 
 namespace raptor {
 
-class Slice;
-
 namespace internal {
 
 // accept
 class IAcceptor {
 public:
     virtual ~IAcceptor() {}
+#ifdef _WIN32
     virtual void OnNewConnection(
-    #ifdef _WIN32
-        SOCKET fd,
-    #else
-        int fd,
-    #endif
-        int listen_port, const raptor_resolved_address* addr) = 0;
+        SOCKET fd, int listen_port, const raptor_resolved_address* addr) = 0;
+#else
+    struct AcceptedSocket {
+        int fd;
+        int listen_port;
+        raptor_resolved_address addr;
+    };
+
+    // A batch of sockets accepted in one wakeup. shard: index of the
+    // listening shard that accepted them, -1 if the listener is not sharded.
+    virtual void OnNewConnections(
+        const AcceptedSocket* socks, size_t count, int shard) = 0;
+#endif
+};
+
+// outbound connect, tag is the one given to TcpConnector::Connect
+class IConnectorReceiver {
+public:
+    virtual ~IConnectorReceiver() {}
+#ifndef _WIN32
+    // fd is -1 if the connection could not be established in time
+    virtual void OnConnectCompleted(
+        uint64_t tag, int fd, const raptor_resolved_address* addr) = 0;
+#endif
+};
+
+// implemented by the receivers of outbound connections
+class IConnectReceiver {
+public:
+    virtual ~IConnectReceiver() {}
+    // cid is not valid afterwards
+    virtual void OnConnectFailed(ConnectionId cid) = 0;
 };
 
 // for epoll
@@ -52,6 +80,13 @@ public:
     virtual void OnRecvEvent(void* ptr) = 0;
     virtual void OnSendEvent(void* ptr) = 0;
     virtual void OnCheckingEvent(time_t current) = 0;
+    // milliseconds a reactor may wait for events before running
+    // OnCheckingEvent again, -1 waits until an event or a Wakeup
+    virtual int CheckingInterval() { return 1000; }
+
+    // EPOLLERR without hang-up, return true if it only signalled
+    // error queue messages (e.g. zero-copy completions).
+    virtual bool OnErrorQueueEvent(void* /*ptr*/) { return false; }
 };
 
 // for iocp
@@ -62,14 +97,33 @@ public:
     virtual void OnRecvEvent(void* ptr, size_t transferred_bytes) = 0;
     virtual void OnSendEvent(void* ptr, size_t transferred_bytes) = 0;
     virtual void OnCheckingEvent(time_t current) = 0;
+    // a ConnectEx completed, it transfers no bytes
+    virtual void OnConnectEvent(void* ptr) { (void)ptr; }
 };
 
 class INotificationTransfer {
 public:
     virtual ~INotificationTransfer() {}
     virtual void OnConnectionArrived(ConnectionId cid, const raptor_resolved_address* addr) = 0;
-    virtual void OnDataReceived(ConnectionId cid, const Slice* s) = 0;
+    // the receiver may move out of *s
+    virtual void OnDataReceived(ConnectionId cid, Slice* s) = 0;
+    // packages parsed from one read, in order. Returning false pauses
+    // reading of cid until the receiver resumes it.
+    virtual bool OnPackagesReceived(ConnectionId cid, Slice* s, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            OnDataReceived(cid, &s[i]);
+        }
+        return true;
+    }
+    // a package over the stream threshold, handed over as it is read.
+    // Returning false from OnStreamChunk pauses reading of cid.
+    virtual void OnStreamBegin(ConnectionId /*cid*/, size_t /*total*/) {}
+    virtual bool OnStreamChunk(ConnectionId /*cid*/, Slice* /*s*/) { return true; }
+    virtual void OnStreamEnd(ConnectionId /*cid*/) {}
     virtual void OnConnectionClosed(ConnectionId cid) = 0;
+    virtual void OnZeroCopyCompleted(ConnectionId /*cid*/, uint32_t /*count*/) {}
+    virtual void OnWritable(ConnectionId /*cid*/) {}
+    virtual void OnSendCompleted(ConnectionId /*cid*/, const uint64_t* /*tokens*/, size_t /*count*/) {}
 };
 
 } // namespace internal
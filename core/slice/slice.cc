@@ -19,13 +19,18 @@
 #include "core/slice/slice.h"
 #include <string.h>
 #include <algorithm>
+#include "core/iomgr.h"
 #include "util/alloc.h"
+#include "util/block_pool.h"
 #include "util/atomic.h"
 
 namespace raptor {
-class SliceRefCount final {
+class SliceRefCount {
 public:
-    SliceRefCount();
+    // destroy is called instead of Free when the last reference goes
+    typedef void (*DestroyFunc)(SliceRefCount* refs);
+
+    explicit SliceRefCount(DestroyFunc destroy = nullptr);
     ~SliceRefCount() {}
 
     SliceRefCount(const SliceRefCount&) = delete;
@@ -36,9 +41,11 @@ public:
 
 private:
     AtomicInt32 _refs;
+    DestroyFunc _destroy;
 };
 
-SliceRefCount::SliceRefCount() {
+SliceRefCount::SliceRefCount(DestroyFunc destroy)
+    : _destroy(destroy) {
     _refs.Store(1, MemoryOrder::RELEASE);
 }
 
@@ -49,10 +56,90 @@ void SliceRefCount::AddRef() {
 void SliceRefCount::DecRef() {
     int32_t n = _refs.FetchSub(1, MemoryOrder::ACQ_REL);
     if (n == 1) {
-        Free(this);
+        if (_destroy) {
+            _destroy(this);
+        } else {
+            Free(this);
+        }
+    }
+}
+
+namespace {
+// refcount of a slice which does not own its bytes
+struct ExternalRefCount {
+    SliceRefCount base;
+    raptor_buffer_release_callback release;
+    const void* ptr;
+    size_t len;
+    void* ctx;
+
+    static void Destroy(SliceRefCount* refs) {
+        ExternalRefCount* ext = reinterpret_cast<ExternalRefCount*>(refs);
+        if (ext->release) {
+            ext->release(ext->ptr, ext->len, ext->ctx);
+        }
+        ext->base.~SliceRefCount();
+        Free(ext);
+        IomgrRemoveObject(IomgrType::kSlice);
     }
+};
+// refcount and payload in one block of a BlockPool class
+template <int C>
+void DestroyPooled(SliceRefCount* refs) {
+    refs->~SliceRefCount();
+    AccountFree(AllocTag::kSlice, BlockPool::BlockSize(C));
+    IomgrRemoveObject(IomgrType::kSlice);
+    BlockPool::Free(refs, C);
 }
 
+// above the pooled sizes the block length is kept in front of the refcount
+void DestroyLarge(SliceRefCount* refs) {
+    refs->~SliceRefCount();
+    size_t* block = reinterpret_cast<size_t*>(refs) - 1;
+    AccountFree(AllocTag::kSlice, *block);
+    IomgrRemoveObject(IomgrType::kSlice);
+    Free(block);
+}
+
+const SliceRefCount::DestroyFunc kPooledDestroy[BlockPool::CLASS_COUNT] = {
+    &DestroyPooled<0>, &DestroyPooled<1>, &DestroyPooled<2>,
+    &DestroyPooled<3>, &DestroyPooled<4>, &DestroyPooled<5>,
+    &DestroyPooled<6>, &DestroyPooled<7>, &DestroyPooled<8>
+};
+
+/*  Memory layout used by the refcounted slices created here:
+
+    +-----------+----------------------------------------------------------+
+    | refcount  | bytes                                                    |
+    +-----------+----------------------------------------------------------+
+
+    refcount is a SliceRefCount
+    bytes is an array of bytes of the requested length
+
+    Blocks up to BlockPool::MAX_BLOCK_SIZE come from the pool, so that
+    slices freed on another thread do not go through malloc. Larger
+    blocks are prefixed with their size_t length, see DestroyLarge.
+*/
+SliceRefCount* AllocRefCounted(size_t len) {
+    IomgrAddObject(IomgrType::kSlice);
+    size_t size = sizeof(SliceRefCount) + len;
+    int cls = BlockPool::ClassOf(size);
+    if (cls < 0) {
+        size += sizeof(size_t);
+        size_t* block = (size_t*)Malloc(size);
+        *block = size;
+        AccountAlloc(AllocTag::kSlice, size);
+        SliceRefCount* refs = reinterpret_cast<SliceRefCount*>(block + 1);
+        new (refs) SliceRefCount(&DestroyLarge);
+        return refs;
+    }
+    AccountAlloc(AllocTag::kSlice, BlockPool::BlockSize(cls));
+    SliceRefCount* refs = (SliceRefCount*)BlockPool::Alloc(cls);
+    new (refs) SliceRefCount(kPooledDestroy[cls]);
+    return refs;
+}
+} // namespace
+
 // ------------------------------------------
 
 Slice::Slice(const char* ptr) : Slice(ptr, strlen(ptr)) {}
@@ -73,18 +160,7 @@ Slice::Slice(const char* ptr, size_t len) {
             memcpy(_data.inlined.bytes, ptr, len);
         }
     } else {
-        /*  Memory layout used by the slice created here:
-
-            +-----------+----------------------------------------------------------+
-            | refcount  | bytes                                                    |
-            +-----------+----------------------------------------------------------+
-
-            refcount is a SliceRefCount
-            bytes is an array of bytes of the requested length
-        */
-
-        _refs = (SliceRefCount*)Malloc(sizeof(SliceRefCount) + len);
-        new (_refs) SliceRefCount;
+        _refs = AllocRefCounted(len);
         _data.refcounted.length = len;
         _data.refcounted.bytes = reinterpret_cast<uint8_t*>(_refs + 1);
         if (ptr) {
@@ -126,24 +202,23 @@ Slice& Slice::operator= (const Slice& oth) {
     return *this;
 }
 
+// moves take over the reference, oth is left empty
 Slice::Slice(Slice&& oth) {
-    if (oth._refs) {
-        oth._refs->AddRef();
-    }
-    _refs = std::move(oth._refs);
-    _data = std::move(oth._data);
+    _refs = oth._refs;
+    _data = oth._data;
+    oth._refs = nullptr;
+    memset(&oth._data, 0, sizeof(oth._data));
 }
 
 Slice& Slice::operator= (Slice&& oth) {
     if (this != &oth) {
-        if (oth._refs) {
-            oth._refs->AddRef();
-        }
         if (_refs) {
             _refs->DecRef();
         }
-        _refs = std::move(oth._refs);
-        _data = std::move(oth._data);
+        _refs = oth._refs;
+        _data = oth._data;
+        oth._refs = nullptr;
+        memset(&oth._data, 0, sizeof(oth._data));
     }
     return *this;
 }
@@ -191,14 +266,99 @@ Slice MakeSliceByLength(size_t len) {
         s._refs = nullptr;
         s._data.inlined.length = static_cast<uint8_t>(len);
     } else {
-        s._refs = (SliceRefCount*)Malloc(sizeof(SliceRefCount) + len);
-        new (s._refs) SliceRefCount;
+        s._refs = AllocRefCounted(len);
         s._data.refcounted.length = len;
         s._data.refcounted.bytes = reinterpret_cast<uint8_t*>(s._refs + 1);
     }
     return s;
 }
 
+Slice MakeSliceAtLeast(size_t len) {
+    int cls = BlockPool::ClassOf(sizeof(SliceRefCount) + len);
+    if (len > Slice::SLICE_INLINED_SIZE && cls >= 0) {
+        len = BlockPool::BlockSize(cls) - sizeof(SliceRefCount);
+    }
+    return MakeSliceByLength(len);
+}
+
+Slice MakeSliceByExternal(
+    const void* ptr, size_t len, raptor_buffer_release_callback release, void* ctx) {
+    // always refcounted, even when short, so that release runs
+    // after the last use and not right now.
+    ExternalRefCount* ext = (ExternalRefCount*)Malloc(sizeof(ExternalRefCount));
+    new (&ext->base) SliceRefCount(&ExternalRefCount::Destroy);
+    IomgrAddObject(IomgrType::kSlice);
+    ext->release = release;
+    ext->ptr = ptr;
+    ext->len = len;
+    ext->ctx = ctx;
+
+    Slice s;
+    s._refs = &ext->base;
+    s._data.refcounted.length = len;
+    s._data.refcounted.bytes = static_cast<uint8_t*>(const_cast<void*>(ptr));
+    return s;
+}
+
+void LendSendBuffer(size_t len, raptor_send_buffer_t* buf) {
+    // always refcounted, inlined bytes would move with the slice
+    Slice s = MakeSliceAtLeast(std::max(len, static_cast<size_t>(Slice::SLICE_INLINED_SIZE + 1)));
+    buf->data = s._data.refcounted.bytes;
+    buf->size = s._data.refcounted.length;
+    buf->handle = s._refs;
+    s._refs = nullptr;
+    memset(&s._data, 0, sizeof(s._data));
+}
+
+Slice ReclaimSendBuffer(raptor_send_buffer_t* buf, size_t used) {
+    Slice s;
+    if (buf->handle) {
+        s._refs = static_cast<SliceRefCount*>(buf->handle);
+        s._data.refcounted.bytes = static_cast<uint8_t*>(buf->data);
+        s._data.refcounted.length = std::min(used, buf->size);
+    }
+    buf->data = nullptr;
+    buf->size = 0;
+    buf->handle = nullptr;
+    if (s.Empty()) {
+        return Slice();
+    }
+    return s;
+}
+
+void* GetSliceHandle(const Slice& s) {
+    return s._refs;
+}
+
+void RetainSliceRef(const void* data, size_t len, void* handle, raptor_slice_t* ref) {
+    if (handle) {
+        static_cast<SliceRefCount*>(handle)->AddRef();
+        ref->data = data;
+        ref->length = len;
+        ref->handle = handle;
+        return;
+    }
+    // always refcounted, inlined bytes would move with the slice
+    Slice s = MakeSliceByLength(std::max(len, static_cast<size_t>(Slice::SLICE_INLINED_SIZE + 1)));
+    if (len > 0) {
+        memcpy(s._data.refcounted.bytes, data, len);
+    }
+    ref->data = s._data.refcounted.bytes;
+    ref->length = len;
+    ref->handle = s._refs;
+    s._refs = nullptr;
+    memset(&s._data, 0, sizeof(s._data));
+}
+
+void ReleaseSliceRef(raptor_slice_t* ref) {
+    if (ref->handle) {
+        static_cast<SliceRefCount*>(ref->handle)->DecRef();
+    }
+    ref->data = nullptr;
+    ref->length = 0;
+    ref->handle = nullptr;
+}
+
 Slice operator+ (Slice s1, Slice s2) {
     if (s1.Empty() && s2.Empty()) {
         return Slice();
@@ -228,9 +388,10 @@ Slice operator- (Slice s1, size_t length) {
         s._data.inlined.length = static_cast<uint8_t>(len);
         memcpy(s._data.inlined.bytes, s1.begin() + length, len);
     } else {
-        s = s1;
+        uint8_t* bytes = s1._data.refcounted.bytes + length;
+        s = std::move(s1);
         s._data.refcounted.length = len;
-        s._data.refcounted.bytes = s1._data.refcounted.bytes + length;
+        s._data.refcounted.bytes = bytes;
     }
     return s;
 }
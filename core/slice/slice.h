@@ -21,6 +21,8 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <utility>
+#include "raptor/types.h"
 
 namespace raptor {
 class SliceRefCount;
@@ -71,6 +73,13 @@ private:
     friend class SliceBuffer;
     friend Slice MakeSliceByDefaultSize();
     friend Slice MakeSliceByLength(size_t len);
+    friend Slice MakeSliceAtLeast(size_t len);
+    friend Slice MakeSliceByExternal(
+        const void* ptr, size_t len, raptor_buffer_release_callback release, void* ctx);
+    friend void LendSendBuffer(size_t len, raptor_send_buffer_t* buf);
+    friend Slice ReclaimSendBuffer(raptor_send_buffer_t* buf, size_t used);
+    friend void* GetSliceHandle(const Slice& s);
+    friend void RetainSliceRef(const void* data, size_t len, void* handle, raptor_slice_t* ref);
     friend Slice operator+ (Slice s1, Slice s2);
     friend Slice operator- (Slice s1, size_t len);
 };
@@ -80,6 +89,36 @@ Slice MakeSliceByDefaultSize();
 
 Slice MakeSliceByLength(size_t len);
 
+// At least len bytes, rounded up to fill the pooled block
+// the slice is allocated from.
+Slice MakeSliceAtLeast(size_t len);
+
+// Wraps caller-owned memory without copying it, release is called
+// when the last reference goes away. The memory must stay valid and
+// unchanged until then.
+Slice MakeSliceByExternal(
+    const void* ptr, size_t len, raptor_buffer_release_callback release, void* ctx);
+
+// Fills buf with at least len bytes of a pooled block, its reference
+// is held by buf->handle until ReclaimSendBuffer.
+void LendSendBuffer(size_t len, raptor_send_buffer_t* buf);
+
+// Takes the reference back from buf and clears it, the slice keeps
+// the first 'used' bytes. Empty if used is 0.
+Slice ReclaimSendBuffer(raptor_send_buffer_t* buf, size_t used);
+
+// The reference count behind the bytes of s for raptor_message_t::
+// handle, nullptr if they are inlined. No reference is taken.
+void* GetSliceHandle(const Slice& s);
+
+// Fills ref with the len bytes at data, keeping a new reference on
+// handle (see GetSliceHandle) until ReleaseSliceRef. Bytes without a
+// handle are copied into a pooled slice.
+void RetainSliceRef(const void* data, size_t len, void* handle, raptor_slice_t* ref);
+
+// Drops the reference of ref and clears it.
+void ReleaseSliceRef(raptor_slice_t* ref);
+
 // Combine the data of s1 and s2,
 // s1 is in the front, s2 is in the back
 Slice operator+ (Slice s1, Slice s2);
@@ -31,24 +31,17 @@ Slice SliceBuffer::Merge() const {
     }
 
     if (Count() == 1) {
-        return _vs[0];
+        return Front();
     }
 
     size_t len = GetBufferLength();
     Slice ret = MakeSliceByLength(len);
-    uint8_t* buf = ret.Buffer();
-    for (auto it = _vs.begin(); it != _vs.end(); ++it) {
-        size_t blk_size = it->size();
-        if (blk_size > 0) {
-            memcpy(buf, it->begin(), blk_size);
-            buf += blk_size;
-        }
-    }
+    PeekHeader(ret.Buffer(), len);
     return ret;
 }
 
 size_t SliceBuffer::Count() const {
-    return _vs.size();
+    return _count;
 }
 
 size_t SliceBuffer::GetBufferLength() const {
@@ -56,13 +49,77 @@ size_t SliceBuffer::GetBufferLength() const {
 }
 
 void SliceBuffer::AddSlice(const Slice& s) {
-    _vs.push_back(s);
+    if (_count == _ring.size()) {
+        Grow();
+    }
+    _ring[(_head + _count) & (_ring.size() - 1)] = s;
+    _count++;
     _length += s.size();
 }
 
 void SliceBuffer::AddSlice(Slice&& s) {
-    _vs.push_back(s);
+    if (_count == _ring.size()) {
+        Grow();
+    }
     _length += s.size();
+    _ring[(_head + _count) & (_ring.size() - 1)] = std::move(s);
+    _count++;
+}
+
+void SliceBuffer::AddFragments(const raptor_iovec* iov, size_t count, size_t skip) {
+    size_t i = 0;
+    while (i < count) {
+        if (skip >= iov[i].len) {
+            skip -= iov[i].len;
+            i++;
+            continue;
+        }
+        const uint8_t* base = static_cast<const uint8_t*>(iov[i].base) + skip;
+        size_t len = iov[i].len - skip;
+        skip = 0;
+        if (len >= COALESCE_SIZE) {
+            AddSlice(Slice(base, len));
+            i++;
+            continue;
+        }
+
+        // the run of small fragments starting here
+        size_t end = i + 1;
+        size_t total = len;
+        while (end < count && iov[end].len < COALESCE_SIZE) {
+            total += iov[end].len;
+            end++;
+        }
+        Slice s = MakeSliceByLength(total);
+        uint8_t* ptr = s.Buffer();
+        memcpy(ptr, base, len);
+        ptr += len;
+        for (size_t j = i + 1; j < end; j++) {
+            if (iov[j].len > 0) {
+                memcpy(ptr, iov[j].base, iov[j].len);
+                ptr += iov[j].len;
+            }
+        }
+        AddSlice(std::move(s));
+        i = end;
+    }
+}
+
+void SliceBuffer::Grow() {
+    size_t capacity = _ring.empty() ? 8 : _ring.size() * 2;
+    std::vector<Slice> ring(capacity);
+    for (size_t i = 0; i < _count; i++) {
+        ring[i] = std::move(_ring[(_head + i) & (_ring.size() - 1)]);
+    }
+    SwapRing(ring);
+    _head = 0;
+}
+
+void SliceBuffer::PopFront() {
+    _length -= _ring[_head].size();
+    _ring[_head] = Slice();
+    _head = (_head + 1) & (_ring.size() - 1);
+    _count--;
 }
 
 Slice SliceBuffer::GetHeader(size_t len) {
@@ -70,8 +127,15 @@ Slice SliceBuffer::GetHeader(size_t len) {
         return Slice();
     }
 
+    const Slice& front = Front();
+    if (front.size() >= len) {
+        Slice s = front;
+        s.CutTail(front.size() - len);
+        return s;
+    }
+
     Slice s = MakeSliceByLength(len);
-    CopyToBuffer(s.Buffer(), len);
+    PeekHeader(s.Buffer(), len);
     return s;
 }
 
@@ -79,66 +143,105 @@ bool SliceBuffer::MoveHeader(size_t len) {
     if(GetBufferLength() < len) {
         return false;
     }
-    if(len == 0) {
-        return true;
-    }
-
-    auto it = _vs.begin();
-    size_t left = it->size();
 
-    if(left > len) {
-        *it = *it - len;
-        _length -= len;
-    } else if(left == len) {
-        _length -= len;
-        _vs.erase(it);
-    } else {
-        // len > left
-        _length -= left;
-        _vs.erase(it);
+    while (len > 0) {
+        Slice& front = _ring[_head];
+        size_t left = front.size();
+        if (left > len) {
+            front = std::move(front) - len;
+            _length -= len;
+            break;
+        }
+        len -= left;
+        PopFront();
+    }
 
-        return MoveHeader(len - left);
+    // drop the empty slices left at the front
+    while (_count > 0 && _ring[_head].Empty()) {
+        PopFront();
     }
     return true;
 }
 
-size_t SliceBuffer::CopyToBuffer(void* buffer, size_t length) {
+size_t SliceBuffer::PeekHeader(void* buffer, size_t length) const {
     RAPTOR_ASSERT(length <= GetBufferLength());
 
-    auto it = _vs.begin();
-
     size_t left = length;
     size_t pos = 0;
 
-    while(it != _vs.end() && left != 0) {
-
-        size_t len = RAPTOR_MIN(left, it->size());
-        memcpy((uint8_t*)buffer + pos, it->begin(), len);
+    for (size_t i = 0; i < _count && left != 0; i++) {
+        const Slice& s = (*this)[i];
+        size_t len = RAPTOR_MIN(left, s.size());
+        memcpy((uint8_t*)buffer + pos, s.begin(), len);
 
         left -= len;
         pos += len;
-
-        ++it;
     }
 
     return pos;
 }
 
+void SliceBuffer::SwapRing(std::vector<Slice>& ring) {
+    if (_ring_counter) {
+        _ring_counter->FetchAdd(ring.capacity() * sizeof(Slice), MemoryOrder::RELAXED);
+        _ring_counter->FetchSub(RingBytes(), MemoryOrder::RELAXED);
+    }
+    _ring.swap(ring);
+}
+
+void SliceBuffer::SetRingCounter(AtomicUInt64* counter) {
+    if (counter == _ring_counter) {
+        return;
+    }
+    if (_ring_counter) {
+        _ring_counter->FetchSub(RingBytes(), MemoryOrder::RELAXED);
+    }
+    if (counter) {
+        counter->FetchAdd(RingBytes(), MemoryOrder::RELAXED);
+    }
+    _ring_counter = counter;
+}
+
 void SliceBuffer::ClearBuffer() {
-    _vs.clear();
+    // keeps the ring capacity
+    while (_count > 0) {
+        _ring[_head] = Slice();
+        _head = (_head + 1) & (_ring.size() - 1);
+        _count--;
+    }
+    _head = 0;
     _length = 0;
 }
 
+void SliceBuffer::ShrinkToFit() {
+    size_t capacity = 0;
+    if (_count > 0) {
+        capacity = 8;
+        while (capacity < _count) {
+            capacity *= 2;
+        }
+    }
+    if (capacity == _ring.size()) {
+        return;
+    }
+    std::vector<Slice> ring(capacity);
+    for (size_t i = 0; i < _count; i++) {
+        ring[i] = std::move(_ring[(_head + i) & (_ring.size() - 1)]);
+    }
+    SwapRing(ring);
+    _head = 0;
+}
+
 Slice SliceBuffer::GetTopSlice() const {
-    if (_vs.empty()) {
+    if (_count == 0) {
         return Slice();
     }
-    return _vs[0];
+    return Front();
 }
 
 Slice SliceBuffer::GetSlice(size_t index) const {
-    if (index < _vs.size()) {
-        return _vs[index];
+    if (index < _count) {
+        return (*this)[index];
     }
     return Slice();
 }
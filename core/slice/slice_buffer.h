@@ -23,32 +23,68 @@
 #include <vector>
 
 #include "core/slice/slice.h"
+#include "util/atomic.h"
 
 namespace raptor {
 
+// A queue of slices kept in a ring, consuming from the front
+// moves a read cursor instead of shifting the remaining slices.
 class SliceBuffer final {
 public:
-    SliceBuffer() : _length(0) {}
-    ~SliceBuffer() = default;
+    SliceBuffer() : _head(0), _count(0), _length(0), _ring_counter(nullptr) {}
+    ~SliceBuffer() { SetRingCounter(nullptr); }
 
     Slice Merge() const;
     size_t Count() const;
     size_t GetBufferLength() const;
     void AddSlice(const Slice& s);
     void AddSlice(Slice&& s);
+    // Copies the fragments after their first 'skip' bytes. Runs of
+    // fragments under COALESCE_SIZE share a slice, larger ones get
+    // a slice each.
+    void AddFragments(const raptor_iovec* iov, size_t count, size_t skip = 0);
 
+    // shares the front slice when it holds len bytes,
+    // only a header spanning several slices is copied.
     Slice GetHeader(size_t len);
     bool MoveHeader(size_t len);
     void ClearBuffer();
+    // shrinks the ring to the slices it holds, an empty buffer frees it
+    void ShrinkToFit();
+    // bytes allocated for the ring, not counting the slices
+    size_t RingBytes() const { return _ring.capacity() * sizeof(Slice); }
+    // RingBytes is kept added to counter from now on, nullptr takes
+    // it out again. The counter is only touched when the ring changes.
+    void SetRingCounter(AtomicUInt64* counter);
     bool Empty() const { return _length == 0; }
     Slice GetTopSlice() const;
     Slice GetSlice(size_t index) const;
 
+    // copies the first len bytes into buff without consuming them,
+    // return the number of bytes copied.
+    size_t PeekHeader(void* buff, size_t len) const;
+
+    // no bounds checking, Count() must not be 0
+    const Slice& Front() const { return _ring[_head]; }
+
+    // no bounds checking, index must be less than Count()
+    const Slice& operator[](size_t index) const {
+        return _ring[(_head + index) & (_ring.size() - 1)];
+    }
+
 private:
-    size_t CopyToBuffer(void* buff, size_t len);
+    enum { COALESCE_SIZE = 1024 };
+
+    void Grow();
+    void PopFront();
+    void SwapRing(std::vector<Slice>& ring);
 
-    std::vector<Slice> _vs;
+    // the capacity is 0 or a power of 2
+    std::vector<Slice> _ring;
+    size_t _head;
+    size_t _count;
     size_t _length;
+    AtomicUInt64* _ring_counter;
 };
 
 } // namespace raptor
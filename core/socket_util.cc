@@ -17,8 +17,12 @@
  */
 
 #include "core/socket_util.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#ifndef _WIN32
+#include <sys/un.h>
+#endif
 
 #include "core/host_port.h"
 #include "core/resolve_address.h"
@@ -155,6 +159,45 @@ void raptor_sockaddr_make_wildcard6(int port,
     resolved_wild_out->len = static_cast<socklen_t>(sizeof(raptor_sockaddr_in6));
 }
 
+#ifndef _WIN32
+// the bytes of sun_path in use, an abstract name starts with NUL
+static size_t raptor_sockaddr_unix_path(
+    const raptor_resolved_address* resolved_addr, const char** path) {
+    const struct sockaddr_un* un =
+        reinterpret_cast<const struct sockaddr_un*>(resolved_addr->addr);
+    const size_t offset = offsetof(struct sockaddr_un, sun_path);
+    *path = un->sun_path;
+    if (resolved_addr->len <= offset) {
+        return 0;  // unnamed, e.g. the peer of an accepted socket
+    }
+    size_t len = resolved_addr->len - offset;
+    if (un->sun_path[0] != '\0') {
+        len = strnlen(un->sun_path, len);
+    }
+    return len;
+}
+#endif
+
+// Unix sockets have no port, a hash of the path stands in for it
+// in the listen port bits of ConnectionId and stays the same for
+// a path across restarts.
+static int raptor_sockaddr_unix_port(const raptor_resolved_address* resolved_addr) {
+#ifdef _WIN32
+    (void)resolved_addr;
+    return 1;
+#else
+    const char* path = nullptr;
+    size_t len = raptor_sockaddr_unix_path(resolved_addr, &path);
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= static_cast<uint8_t>(path[i]);
+        h *= 16777619u;
+    }
+    h = (h >> 16) ^ (h & 0xffff);
+    return h != 0 ? static_cast<int>(h) : 1;
+#endif
+}
+
 int raptor_sockaddr_to_string(char** out,
                               const raptor_resolved_address* resolved_addr,
                               int normalize) {
@@ -197,6 +240,16 @@ int raptor_sockaddr_to_string(char** out,
             ret = raptor::JoinHostPort(&tmp_out, ntop_buf, port);
         }
         *out = tmp_out.release();
+#ifndef _WIN32
+    } else if (addr->sa_family == AF_UNIX) {
+        const char* path = nullptr;
+        size_t len = raptor_sockaddr_unix_path(resolved_addr, &path);
+        if (len > 0 && path[0] == '\0') {
+            ret = raptor_asprintf(out, "unix-abstract:%.*s", (int)(len - 1), path + 1);
+        } else {
+            ret = raptor_asprintf(out, "unix:%.*s", (int)len, path);
+        }
+#endif
     } else {
         ret = raptor_asprintf(out, "(sockaddr family=%d)", addr->sa_family);
     }
@@ -236,7 +289,7 @@ int raptor_sockaddr_get_port(const raptor_resolved_address* resolved_addr) {
     case AF_INET6:
         return ntohs(((raptor_sockaddr_in6*)addr)->sin6_port);
     case AF_UNIX:  // is unix socket
-        return 1;
+        return raptor_sockaddr_unix_port(resolved_addr);
     default:
         log_error("Unknown socket family %d in raptor_sockaddr_get_port", addr->sa_family);
         return 0;
@@ -0,0 +1,136 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "core/timing_wheel.h"
+
+namespace raptor {
+
+TimingWheel::TimingWheel(int64_t now, size_t slots)
+    : _mask(0), _size(0), _current(now) {
+    size_t n = 1;
+    while (n < slots) {
+        n <<= 1;
+    }
+    _slots.resize(n);
+    for (auto& head : _slots) {
+        RAPTOR_LIST_INIT(&head);
+    }
+    _mask = n - 1;
+}
+
+TimingWheel::~TimingWheel() {
+    Clear();
+}
+
+void TimingWheel::Insert(Node* node, int64_t deadline) {
+    if (node->Linked()) {
+        Remove(node);
+    }
+    node->deadline = deadline;
+    if (deadline < _current) {
+        deadline = _current;
+    }
+    list_entry* head = &_slots[static_cast<size_t>(deadline) & _mask];
+    raptor_list_push_back(head, &node->entry);
+    _size++;
+}
+
+void TimingWheel::Remove(Node* node) {
+    if (!node->Linked()) {
+        return;
+    }
+    raptor_list_remove_entry(&node->entry);
+    RAPTOR_LIST_ENTRY_INIT(&node->entry);
+    _size--;
+}
+
+bool TimingWheel::Expire(int64_t now, const ExpireCallback& cb, size_t max) {
+    if (now < _current) {
+        return true;
+    }
+
+    list_entry expired;
+    RAPTOR_LIST_INIT(&expired);
+
+    // a full turn visits every slot once
+    int64_t last = now;
+    if (now - _current >= static_cast<int64_t>(_slots.size())) {
+        last = _current + static_cast<int64_t>(_mask);
+    }
+
+    size_t count = 0;
+    bool done = true;
+    for (int64_t t = _current; t <= last && _size > 0; t++) {
+        list_entry* head = &_slots[static_cast<size_t>(t) & _mask];
+        list_entry* entry = head->next;
+        while (entry != head) {
+            Node* node = reinterpret_cast<Node*>(entry);
+            entry = entry->next;
+            if (node->deadline <= now) {
+                if (count == max) {
+                    // the next call starts again from this slot
+                    _current = t;
+                    done = false;
+                    break;
+                }
+                raptor_list_remove_entry(&node->entry);
+                raptor_list_push_back(&expired, &node->entry);
+                _size--;
+                count++;
+            }
+        }
+        if (!done) {
+            break;
+        }
+    }
+    if (done) {
+        _current = now + 1;
+    }
+
+    while (!RAPTOR_LIST_IS_EMPTY(&expired)) {
+        Node* node = reinterpret_cast<Node*>(raptor_list_pop_front(&expired));
+        RAPTOR_LIST_ENTRY_INIT(&node->entry);
+        cb(node);
+    }
+    return done;
+}
+
+void TimingWheel::Clear() {
+    for (auto& head : _slots) {
+        while (!RAPTOR_LIST_IS_EMPTY(&head)) {
+            list_entry* entry = raptor_list_pop_front(&head);
+            RAPTOR_LIST_ENTRY_INIT(entry);
+        }
+    }
+    _size = 0;
+}
+
+int64_t TimingWheel::NextTick() const {
+    if (_size == 0) {
+        return -1;
+    }
+    for (int64_t t = _current; t <= _current + static_cast<int64_t>(_mask); t++) {
+        const list_entry* head = &_slots[static_cast<size_t>(t) & _mask];
+        if (!RAPTOR_LIST_IS_EMPTY(head)) {
+            return t;
+        }
+    }
+    return -1;
+}
+
+} // namespace raptor
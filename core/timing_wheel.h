@@ -0,0 +1,90 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_CORE_TIMING_WHEEL__
+#define __RAPTOR_CORE_TIMING_WHEEL__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+#include "util/list_entry.h"
+
+namespace raptor {
+/*
+    Hashed timing wheel, a node is linked into the slot of its
+    deadline (deadline & mask), so insert and remove are O(1) and
+    need no allocation. Nodes whose deadline is more than one turn
+    away stay in their slot until the wheel reaches it again.
+    The unit of a tick is decided by the caller. Not thread-safe.
+*/
+class TimingWheel final {
+public:
+    struct Node {
+        list_entry entry;  // must be the first member
+        int64_t deadline;
+        void* data;
+
+        Node() : deadline(0), data(nullptr) {
+            RAPTOR_LIST_ENTRY_INIT(&entry);
+        }
+        bool Linked() const { return entry.next != nullptr; }
+    };
+
+    using ExpireCallback = std::function<void(Node*)>;
+
+    // slots is rounded up to a power of 2
+    explicit TimingWheel(int64_t now, size_t slots = DEFAULT_SLOTS);
+    ~TimingWheel();
+
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator= (const TimingWheel&) = delete;
+
+    // a deadline in the past expires on the next Expire call
+    void Insert(Node* node, int64_t deadline);
+    void Remove(Node* node);
+
+    // Advance the wheel to 'now', unlink every node whose deadline
+    // is not later than 'now' and pass it to cb. cb may insert the
+    // node again. At most max nodes are unlinked, return false if
+    // that left expired nodes behind for the next call.
+    bool Expire(int64_t now, const ExpireCallback& cb, size_t max = SIZE_MAX);
+
+    // Unlink all nodes
+    void Clear();
+
+    // The first tick from Current on whose slot holds a node, -1 if
+    // there are none. Nodes more than one turn away make it early.
+    int64_t NextTick() const;
+
+    size_t Size() const { return _size; }
+    int64_t Current() const { return _current; }
+
+private:
+    enum { DEFAULT_SLOTS = 256 };
+
+    std::vector<list_entry> _slots;
+    size_t _mask;
+    size_t _size;
+    // the earliest tick not processed yet
+    int64_t _current;
+};
+} // namespace raptor
+
+#endif  // __RAPTOR_CORE_TIMING_WHEEL__
@@ -0,0 +1,96 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+
+#include "core/user_timers.h"
+#include "util/useful.h"
+
+namespace raptor {
+namespace {
+// a turn of the wheel is about a second
+constexpr size_t USER_TIMER_SLOTS = 1024;
+constexpr int64_t NO_DEADLINE = INT64_MAX;
+}  // namespace
+
+UserTimers::UserTimers(int64_t now_ms)
+    : _wheel(now_ms, USER_TIMER_SLOTS), _next(NO_DEADLINE) {}
+
+UserTimers::~UserTimers() {
+    _wheel.Clear();
+    for (auto& it : _timers) {
+        delete it.second;
+    }
+}
+
+bool UserTimers::Add(uint64_t id, ConnectionId cid, int64_t deadline_ms,
+    raptor_timer_callback cb, void* ctx) {
+    Timer* timer = new Timer;
+    timer->node.data = timer;
+    timer->id = id;
+    timer->cid = cid;
+    timer->cb = cb;
+    timer->ctx = ctx;
+    _timers[id] = timer;
+    _wheel.Insert(&timer->node, deadline_ms);
+
+    // one in the past is due at the next Expire
+    int64_t due = RAPTOR_MAX(deadline_ms, _wheel.Current());
+    if (due < _next.Load(MemoryOrder::RELAXED)) {
+        _next.Store(due, MemoryOrder::RELEASE);
+        return true;
+    }
+    return false;
+}
+
+bool UserTimers::Cancel(uint64_t id) {
+    auto it = _timers.find(id);
+    if (it == _timers.end()) {
+        return false;
+    }
+    // _next stays, an early wakeup finds nothing due
+    _wheel.Remove(&it->second->node);
+    delete it->second;
+    _timers.erase(it);
+    return true;
+}
+
+void UserTimers::Expire(int64_t now_ms, std::vector<Timer*>* expired) {
+    _wheel.Expire(now_ms, [&](TimingWheel::Node* node) {
+        Timer* timer = reinterpret_cast<Timer*>(node->data);
+        _timers.erase(timer->id);
+        expired->push_back(timer);
+    });
+    int64_t next = _wheel.NextTick();
+    _next.Store(next < 0 ? NO_DEADLINE : next, MemoryOrder::RELEASE);
+}
+
+void UserTimers::TakeAll(std::vector<Timer*>* timers) {
+    _wheel.Clear();
+    for (auto& it : _timers) {
+        timers->push_back(it.second);
+    }
+    _timers.clear();
+    _next.Store(NO_DEADLINE, MemoryOrder::RELEASE);
+}
+
+void UserTimers::Run(Timer* timer, bool fired) {
+    timer->cb(timer->cid, timer->id, fired ? 1 : 0, timer->ctx);
+    delete timer;
+}
+
+} // namespace raptor
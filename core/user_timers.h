@@ -0,0 +1,81 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+
+#ifndef __RAPTOR_CORE_USER_TIMERS__
+#define __RAPTOR_CORE_USER_TIMERS__
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include "core/timing_wheel.h"
+#include "raptor/types.h"
+#include "util/atomic.h"
+
+namespace raptor {
+/*
+    The timers of ScheduleTimer which run on one thread, on a
+    TimingWheel ticking in milliseconds of the coarse clock. A timer
+    belongs to the set until it expires or is cancelled, the owner of
+    an expired one runs it with Run. Not thread-safe, except for
+    NextDeadline.
+*/
+class UserTimers final {
+public:
+    struct Timer {
+        TimingWheel::Node node;
+        uint64_t id;
+        ConnectionId cid;
+        raptor_timer_callback cb;
+        void* ctx;
+    };
+
+    explicit UserTimers(int64_t now_ms);
+    // the timers left are freed without being run
+    ~UserTimers();
+
+    UserTimers(const UserTimers&) = delete;
+    UserTimers& operator= (const UserTimers&) = delete;
+
+    // return true if the timer may be due before the others, the
+    // thread then has to recompute its wait
+    bool Add(uint64_t id, ConnectionId cid, int64_t deadline_ms,
+        raptor_timer_callback cb, void* ctx);
+    // frees the timer, false if it is unknown or has expired
+    bool Cancel(uint64_t id);
+    // moves the timers due at now_ms into *expired
+    void Expire(int64_t now_ms, std::vector<Timer*>* expired);
+    // moves every timer into *timers
+    void TakeAll(std::vector<Timer*>* timers);
+
+    // the earliest a timer may be due, INT64_MAX if there are none
+    int64_t NextDeadline() const { return _next.Load(MemoryOrder::ACQUIRE); }
+    size_t Size() const { return _timers.size(); }
+
+    // calls the callback of an expired timer and frees it
+    static void Run(Timer* timer, bool fired);
+
+private:
+    TimingWheel _wheel;
+    std::unordered_map<uint64_t, Timer*> _timers;
+    AtomicInt64 _next;
+};
+} // namespace raptor
+
+#endif  // __RAPTOR_CORE_USER_TIMERS__
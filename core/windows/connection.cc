@@ -18,10 +18,15 @@
 
 #include "core/windows/connection.h"
 #include <string.h>
+#include "core/server_stats.h"
 #include "core/socket_util.h"
+#include "core/windows/iocp_thread.h"
+#include "core/windows/rio_thread.h"
 #include "core/windows/socket_setting.h"
 #include "raptor/protocol.h"
+#include "util/alloc.h"
 #include "util/log.h"
+#include "util/time.h"
 #include "util/useful.h"
 
 namespace raptor {
@@ -29,8 +34,23 @@ Connection::Connection(internal::INotificationTransfer* service)
     : _service(service)
     , _proto(nullptr)
     , _send_pending(false)
+    , _inline_completion(false)
+    , _rcv_budget(DEFAULT_RECV_BUDGET)
+    , _rs(nullptr)
+    , _counters(nullptr)
     , _cid(core::InvalidConnectionId)
-    , _fd(INVALID_SOCKET) {
+    , _fd(INVALID_SOCKET)
+    , _rcv_bytes(0)
+    , _rcv_messages(0)
+    , _rcv_last(0)
+    , _snd_bytes(0)
+    , _snd_messages(0)
+    , _rio(nullptr)
+    , _rq(RIO_INVALID_RQ)
+    , _rio_rcv(nullptr)
+    , _rio_snd(nullptr)
+    , _transmitting(false)
+    , _transmit_file(nullptr) {
 
     memset(&_send_overlapped, 0, sizeof(_send_overlapped));
     memset(&_recv_overlapped, 0, sizeof(_recv_overlapped));
@@ -41,15 +61,29 @@ Connection::Connection(internal::INotificationTransfer* service)
 
     _user_data = 0;
     _extend_ptr = 0;
+    AccountAlloc(AllocTag::kConnection, sizeof(Connection));
+    IomgrRegisterObject(&_iomgr, IomgrType::kConnection, "connection");
 }
 
-Connection::~Connection() {}
+Connection::~Connection() {
+    IomgrUnregisterObject(&_iomgr);
+    AccountFree(AllocTag::kConnection, sizeof(Connection));
+}
 
 void Connection::Init(ConnectionId cid, SOCKET sock, const raptor_resolved_address* addr) {
     _cid = cid;
     _fd = sock;
     _addr = *addr;
     _send_pending = false;
+    _inline_completion = false;
+    _rs = nullptr;
+    _zero_byte_recv = false;
+    _recv_overlapped.event = IocpEventType::kRecvEvent;
+    _rcv_bytes = 0;
+    _rcv_messages = 0;
+    _rcv_last = Now();
+    _snd_bytes = 0;
+    _snd_messages = 0;
 
     _user_data = 0;
     _extend_ptr = 0;
@@ -60,8 +94,80 @@ void Connection::Init(ConnectionId cid, SOCKET sock, const raptor_resolved_addre
     _service->OnConnectionArrived(cid, &_addr);
 }
 
+bool Connection::InitRio(RioThread* rio) {
+    _rq = rio->CreateRequestQueue(_fd, _cid);
+    if (_rq == RIO_INVALID_RQ) {
+        return false;
+    }
+    _rio = rio;
+    _rio_rcv = rio->Pool()->Get();
+    _rio_snd = rio->Pool()->Get();
+    if (!_rio_rcv || !_rio_snd) {
+        return false;
+    }
+    _rio_rcv->event = IocpEventType::kRecvEvent;
+    _rio_snd->event = IocpEventType::kSendEvent;
+    // the overlapped receive buffers are not needed
+    for (size_t i = 0; i < DEFAULT_TEMP_SLICE_COUNT; i++) {
+        _tmp_buffer[i] = Slice();
+    }
+    return true;
+}
+
+void Connection::EnableInlineCompletion(SendRecvThread* rs) {
+    _inline_completion = raptor_set_socket_skip_completion_port(_fd);
+    _rs = rs;
+}
+
+void Connection::SetRecvBudget(size_t bytes) {
+    _rcv_budget = (bytes > 0) ? bytes : static_cast<size_t>(DEFAULT_RECV_BUDGET);
+}
+
+void Connection::EnableZeroByteRecv() {
+    // the reads after the notification must not wait
+    u_long nonblocking = 1;
+    if (ioctlsocket(_fd, FIONBIO, &nonblocking) != 0) {
+        return;
+    }
+    _zero_byte_recv = true;
+    _recv_overlapped.event = IocpEventType::kReadableEvent;
+    for (size_t i = 0; i < DEFAULT_TEMP_SLICE_COUNT; i++) {
+        _tmp_buffer[i] = Slice();
+    }
+}
+
+void Connection::ReleaseRio() {
+    if (!_rio) {
+        return;
+    }
+    _rcv_mtx.Lock();
+    if (_rio_rcv) {
+        _rio->Pool()->Put(_rio_rcv);
+        _rio_rcv = nullptr;
+    }
+    _rcv_mtx.Unlock();
+
+    _snd_mtx.Lock();
+    if (_rio_snd) {
+        _rio->Pool()->Put(_rio_snd);
+        _rio_snd = nullptr;
+    }
+    _snd_mtx.Unlock();
+
+    if (_rq != RIO_INVALID_RQ) {
+        // the request queue went away with the socket
+        _rio->ReleaseRequestQueue();
+        _rq = RIO_INVALID_RQ;
+    }
+}
+
 void Connection::SetProtocol(IProtocol* p) {
     _proto = p;
+    _checker.SetProtocol(p);
+}
+
+void Connection::SetCounters(ServerCounters* counters) {
+    _counters = counters;
 }
 
 void Connection::Shutdown(bool notify) {
@@ -72,6 +178,8 @@ void Connection::Shutdown(bool notify) {
     raptor_set_socket_shutdown(_fd);
     _fd = INVALID_SOCKET;
     _send_pending = false;
+    ReleaseRio();
+    _transmit_file = nullptr;
 
     if (notify) {
         _service->OnConnectionClosed(_cid);
@@ -81,9 +189,14 @@ void Connection::Shutdown(bool notify) {
     _rcv_buffer.ClearBuffer();
     _rcv_mtx.Unlock();
 
+    std::vector<FileSend> files;
     _snd_mtx.Lock();
     _snd_buffer.ClearBuffer();
+    files.assign(_snd_files.begin(), _snd_files.end());
+    _snd_files.clear();
+    _transmitting = false;
     _snd_mtx.Unlock();
+    FinishFileSends(&files, false);
 
     for (size_t i = 0; i < DEFAULT_TEMP_SLICE_COUNT; i++) {
         _tmp_buffer[i] = Slice();
@@ -95,73 +208,364 @@ void Connection::Shutdown(bool notify) {
 bool Connection::SendWithHeader(
         const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
     if (!IsOnline()) return false;
-    AutoMutex g(&_snd_mtx);
-    if (hdr != nullptr && hdr_len > 0) {
-        _snd_buffer.AddSlice(Slice(hdr, hdr_len));
+    std::vector<FileSend> finished;
+    bool ok;
+    {
+        AutoMutex g(&_snd_mtx);
+        if (hdr != nullptr && hdr_len > 0) {
+            _snd_buffer.AddSlice(Slice(hdr, hdr_len));
+        }
+        if (data != nullptr && data_len > 0) {
+            _snd_buffer.AddSlice(Slice(data, data_len));
+        }
+        _snd_messages++;
+        ok = AsyncSend(&finished);
+    }
+    FinishFileSends(&finished, true);
+    return ok;
+}
+
+bool Connection::SendV(const raptor_iovec* iov, size_t count) {
+    if (!IsOnline()) return false;
+    std::vector<FileSend> finished;
+    bool ok;
+    {
+        AutoMutex g(&_snd_mtx);
+        // one WSASend takes the slices of every fragment
+        _snd_buffer.AddFragments(iov, count);
+        _snd_messages++;
+        ok = AsyncSend(&finished);
+    }
+    FinishFileSends(&finished, true);
+    return ok;
+}
+
+bool Connection::SendSlice(const Slice& s) {
+    if (!IsOnline()) return false;
+    std::vector<FileSend> finished;
+    bool ok;
+    {
+        AutoMutex g(&_snd_mtx);
+        _snd_buffer.AddSlice(s);
+        _snd_messages++;
+        ok = AsyncSend(&finished);
     }
-    if (data != nullptr && data_len > 0) {
-        _snd_buffer.AddSlice(Slice(data, data_len));
+    FinishFileSends(&finished, true);
+    return ok;
+}
+
+bool Connection::SendFile(raptor_file_t file, uint64_t offset, uint64_t length,
+    raptor_send_file_callback done, void* ctx) {
+    // RIO sockets have no completion port to report TransmitFile on
+    if (!IsOnline() || _rio) return false;
+    std::vector<FileSend> finished;
+    {
+        AutoMutex g(&_snd_mtx);
+        if (!_transmit_file) {
+            GUID guid = WSAID_TRANSMITFILE;
+            DWORD bytes = 0;
+            if (WSAIoctl(_fd, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid),
+                    &_transmit_file, sizeof(_transmit_file), &bytes, NULL, NULL) != 0) {
+                _transmit_file = nullptr;
+                log_error("Failed to get TransmitFile: %d", WSAGetLastError());
+                return false;
+            }
+        }
+
+        FileSend f;
+        f.file = static_cast<HANDLE>(file);
+        f.offset = offset;
+        f.remaining = length;
+        f.before = _snd_buffer.GetBufferLength();
+        f.done = done;
+        f.ctx = ctx;
+        for (const FileSend& queued : _snd_files) {
+            f.before -= queued.before;
+        }
+        _snd_files.push_back(f);
+        _snd_messages++;
+        // a failed send leaves the range queued, Shutdown reports it
+        AsyncSend(&finished);
     }
-    return AsyncSend();
+    FinishFileSends(&finished, true);
+    return true;
 }
 
 constexpr size_t MAX_PACKAGE_SIZE = 0xffff;
 constexpr size_t MAX_WSABUF_COUNT = 16;
 
-bool Connection::AsyncSend() {
-    if (_snd_buffer.Empty() || _send_pending) {
-        return true;
+bool Connection::AsyncSend(std::vector<FileSend>* finished) {
+    if (_rio) {
+        if (_snd_buffer.Empty() || _send_pending) {
+            return true;
+        }
+        return RioSend();
     }
 
-    WSABUF wsa_snd_buf[MAX_WSABUF_COUNT];
-    size_t prepare_send_length = 0;
-    DWORD wsa_buf_count = 0;
+    while (HasPendingSend() && !_send_pending) {
+        if (!_snd_files.empty() && _snd_files.front().before == 0) {
+            if (!TransmitFileRange(&_snd_files.front(), finished)) {
+                return false;
+            }
+            continue;
+        }
 
-    _send_pending = true;
+        // bytes of _snd_buffer allowed out before the next file range
+        size_t limit = MAX_PACKAGE_SIZE;
+        if (!_snd_files.empty()) {
+            limit = RAPTOR_MIN(limit, _snd_files.front().before);
+        }
+        WSABUF wsa_snd_buf[MAX_WSABUF_COUNT];
+        size_t prepare_send_length = 0;
+        DWORD wsa_buf_count = 0;
 
-    size_t count = _snd_buffer.Count();
-    for (size_t i = 0; i < count && i < MAX_WSABUF_COUNT; i++) {
-        Slice s = _snd_buffer.GetSlice(i);
-        if (prepare_send_length + s.Length() > MAX_PACKAGE_SIZE) {
-            break;
+        _send_pending = true;
+
+        size_t count = _snd_buffer.Count();
+        for (size_t i = 0; i < count && i < MAX_WSABUF_COUNT; i++) {
+            Slice s = _snd_buffer.GetSlice(i);
+            size_t length = RAPTOR_MIN(s.Length(), limit - prepare_send_length);
+            if (length == 0) {
+                break;
+            }
+            wsa_snd_buf[i].buf = reinterpret_cast<char*>(s.Buffer());
+            wsa_snd_buf[i].len = static_cast<ULONG>(length);
+            prepare_send_length += length;
+            wsa_buf_count++;
+            if (length < s.Length()) {
+                // the rest of this slice goes with the next send
+                break;
+            }
+        }
+
+        // https://docs.microsoft.com/en-us/windows/win32/api/winsock2/nf-winsock2-wsasend
+        int ret = WSASend(_fd, wsa_snd_buf, wsa_buf_count, NULL, 0, &_send_overlapped.overlapped, NULL);
+
+        if (ret == SOCKET_ERROR) {
+            int error = WSAGetLastError();
+            if (error != WSA_IO_PENDING) {
+                _send_pending = false;
+                return false;
+            }
+            return true;
         }
-        wsa_snd_buf[i].buf = reinterpret_cast<char*>(s.Buffer());
-        wsa_snd_buf[i].len = static_cast<ULONG>(s.Length());
-        prepare_send_length += s.Length();
-        wsa_buf_count++;
+
+        // completed at once, otherwise the packet is still on its way
+        if (!_inline_completion) {
+            return true;
+        }
+        DWORD bytes = 0;
+        DWORD flags = 0;
+        _send_pending = false;
+        if (!WSAGetOverlappedResult(_fd, &_send_overlapped.overlapped, &bytes, FALSE, &flags)
+            || bytes == 0) {
+            return false;
+        }
+        SendCompleted(bytes, finished);
     }
+    return true;
+}
 
-    // https://docs.microsoft.com/en-us/windows/win32/api/winsock2/nf-winsock2-wsasend
-    int ret = WSASend(_fd, wsa_snd_buf, wsa_buf_count, NULL, 0, &_send_overlapped.overlapped, NULL);
+bool Connection::TransmitFileRange(FileSend* f, std::vector<FileSend>* finished) {
+    // TransmitFile takes at most 2^31 - 2 bytes per call. Client
+    // editions of Windows run only two at a time, the rest wait.
+    constexpr uint64_t MAX_TRANSMIT_CHUNK = 0x40000000;
+    DWORD count = static_cast<DWORD>(RAPTOR_MIN(f->remaining, MAX_TRANSMIT_CHUNK));
 
-    if (ret == SOCKET_ERROR) {
+    _send_pending = true;
+    _transmitting = true;
+    _send_overlapped.overlapped.Offset = static_cast<DWORD>(f->offset);
+    _send_overlapped.overlapped.OffsetHigh = static_cast<DWORD>(f->offset >> 32);
+
+    BOOL ret = _transmit_file(_fd, f->file, count, 0, &_send_overlapped.overlapped, NULL, 0);
+    if (!ret) {
         int error = WSAGetLastError();
-        if (error != WSA_IO_PENDING) {
+        if (error != WSA_IO_PENDING && error != ERROR_IO_PENDING) {
+            log_error("TransmitFile failed: %d", error);
             _send_pending = false;
+            _transmitting = false;
             return false;
         }
+        return true;
+    }
+
+    if (!_inline_completion) {
+        return true;
     }
+    DWORD bytes = 0;
+    DWORD flags = 0;
+    _send_pending = false;
+    if (!WSAGetOverlappedResult(_fd, &_send_overlapped.overlapped, &bytes, FALSE, &flags)
+        || bytes == 0) {
+        _transmitting = false;
+        return false;
+    }
+    SendCompleted(bytes, finished);
     return true;
 }
 
-bool Connection::AsyncRecv() {
-    DWORD dwFlag = 0;
-    WSABUF wsa_rcv_buf[DEFAULT_TEMP_SLICE_COUNT];
+bool Connection::AsyncRecv(size_t read) {
+    if (_rio) {
+        return RioRecv();
+    }
+    if (_zero_byte_recv) {
+        return ZeroByteRecv(read);
+    }
 
-    for (size_t i = 0; i < DEFAULT_TEMP_SLICE_COUNT; i++) {
-        wsa_rcv_buf[i].buf = reinterpret_cast<char*>(_tmp_buffer[i].Buffer());
-        wsa_rcv_buf[i].len = static_cast<ULONG>(_tmp_buffer[i].Length());
+    for (;;) {
+        DWORD dwFlag = 0;
+        WSABUF wsa_rcv_buf[DEFAULT_TEMP_SLICE_COUNT];
+
+        for (size_t i = 0; i < DEFAULT_TEMP_SLICE_COUNT; i++) {
+            wsa_rcv_buf[i].buf = reinterpret_cast<char*>(_tmp_buffer[i].Buffer());
+            wsa_rcv_buf[i].len = static_cast<ULONG>(_tmp_buffer[i].Length());
+        }
+
+        // https://docs.microsoft.com/en-us/windows/win32/api/winsock2/nf-winsock2-wsarecv
+        int ret = WSARecv(_fd, wsa_rcv_buf, DEFAULT_TEMP_SLICE_COUNT, NULL, &dwFlag, &_recv_overlapped.overlapped, NULL);
+
+        if (ret == SOCKET_ERROR) {
+            int error = WSAGetLastError();
+            if (error != WSA_IO_PENDING) {
+                return false;
+            }
+            return true;
+        }
+
+        // completed at once, otherwise the packet is still on its way
+        if (!_inline_completion) {
+            return true;
+        }
+        DWORD bytes = 0;
+        DWORD flags = 0;
+        if (!WSAGetOverlappedResult(_fd, &_recv_overlapped.overlapped, &bytes, FALSE, &flags)
+            || bytes == 0) {
+            // zero bytes, the peer closed
+            return false;
+        }
+        if (read >= _rcv_budget) {
+            // the data stays in _tmp_buffer until the packet comes round
+            _rs->Requeue((void*)_cid, &_recv_overlapped, bytes);
+            return true;
+        }
+        if (!RecvCompleted(bytes)) {
+            return false;
+        }
+        read += bytes;
     }
+}
 
-    // https://docs.microsoft.com/en-us/windows/win32/api/winsock2/nf-winsock2-wsarecv
-    int ret = WSARecv(_fd, wsa_rcv_buf, DEFAULT_TEMP_SLICE_COUNT, NULL, &dwFlag, &_recv_overlapped.overlapped, NULL);
+bool Connection::ZeroByteRecv(size_t read) {
+    for (;;) {
+        DWORD dwFlag = 0;
+        WSABUF wsa_rcv_buf;
+        wsa_rcv_buf.buf = NULL;
+        wsa_rcv_buf.len = 0;
 
-    if (ret == SOCKET_ERROR) {
-        int error = WSAGetLastError();
-        if (error != WSA_IO_PENDING) {
+        int ret = WSARecv(_fd, &wsa_rcv_buf, 1, NULL, &dwFlag, &_recv_overlapped.overlapped, NULL);
+
+        if (ret == SOCKET_ERROR) {
+            return WSAGetLastError() == WSA_IO_PENDING;
+        }
+        if (!_inline_completion) {
+            return true;
+        }
+        if (read >= _rcv_budget) {
+            _rs->Requeue((void*)_cid, &_recv_overlapped, 0);
+            return true;
+        }
+        if (!ReadAvailable(_rcv_budget - read, &read)) {
             return false;
         }
     }
+}
+
+// Bounded so a busy connection doesn't hold the thread, the next
+// zero-byte recv completes at once if more is there.
+bool Connection::ReadAvailable(size_t limit, size_t* read) {
+    size_t total = 0;
+    Slice chunk;
+    while (total < limit) {
+        if (chunk.Empty()) {
+            chunk = MakeSliceByDefaultSize();
+        }
+        int n = recv(_fd, reinterpret_cast<char*>(chunk.Buffer()),
+            static_cast<int>(chunk.Length()), 0);
+        if (n == 0) {
+            // the peer closed
+            return false;
+        }
+        if (n == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                return false;
+            }
+            break;
+        }
+        total += static_cast<size_t>(n);
+        if (static_cast<size_t>(n) < chunk.Length()) {
+            // the socket is drained, the chunk goes back to the pool
+            _rcv_buffer.AddSlice(Slice(chunk.Buffer(), static_cast<size_t>(n)));
+            break;
+        }
+        _rcv_buffer.AddSlice(std::move(chunk));
+        chunk = Slice();
+    }
+    *read += total;
+    if (total == 0) {
+        return true;
+    }
+    _rcv_bytes += total;
+    _rcv_last = Now();
+    if (_counters) {
+        ServerCounters::Add(_counters->bytes_received, total);
+    }
+    return ParsingProtocol() != -1;
+}
+
+// The data is copied into the registered chunk, RIO only sends from
+// registered memory. That copy is what replaces the page pinning of
+// every WSASend.
+bool Connection::RioSend() {
+    if (!_rio_snd) {
+        return false;
+    }
+    size_t length = 0;
+    size_t count = _snd_buffer.Count();
+    for (size_t i = 0; i < count && length < RioBufferPool::CHUNK_SIZE; i++) {
+        Slice s = _snd_buffer.GetSlice(i);
+        size_t n = s.Length();
+        if (n > RioBufferPool::CHUNK_SIZE - length) {
+            n = RioBufferPool::CHUNK_SIZE - length;
+        }
+        memcpy(_rio_snd->data + length, s.begin(), n);
+        length += n;
+    }
+
+    _send_pending = true;
+    _rio_snd->buf.Length = static_cast<ULONG>(length);
+    RioBufferPool* pool = _rio->Pool();
+    pool->MarkInFlight(_rio_snd);
+    AutoMutex g(&_rq_mtx);
+    if (!_rio->Api()->RIOSend(_rq, &_rio_snd->buf, 1, 0, _rio_snd)) {
+        pool->Complete(_rio_snd);
+        _send_pending = false;
+        return false;
+    }
+    return true;
+}
+
+bool Connection::RioRecv() {
+    if (!_rio_rcv) {
+        return false;
+    }
+    _rio_rcv->buf.Length = RioBufferPool::CHUNK_SIZE;
+    RioBufferPool* pool = _rio->Pool();
+    pool->MarkInFlight(_rio_rcv);
+    AutoMutex g(&_rq_mtx);
+    if (!_rio->Api()->RIOReceive(_rq, &_rio_rcv->buf, 1, 0, _rio_rcv)) {
+        pool->Complete(_rio_rcv);
+        return false;
+    }
     return true;
 }
 
@@ -172,90 +576,122 @@ bool Connection::IsOnline() {
 // IOCP Event
 bool Connection::OnSendEvent(size_t size) {
     RAPTOR_ASSERT(size != 0);
-    AutoMutex g(&_snd_mtx);
-    _send_pending = false;
-    _snd_buffer.MoveHeader(size);
-    if (_snd_buffer.Empty()) {
-        return true;
+    std::vector<FileSend> finished;
+    bool ok;
+    {
+        AutoMutex g(&_snd_mtx);
+        _send_pending = false;
+        SendCompleted(size, &finished);
+        ok = AsyncSend(&finished);
     }
-    return AsyncSend();
+    FinishFileSends(&finished, true);
+    return ok;
 }
 
 bool Connection::OnRecvEvent(size_t size) {
-    RAPTOR_ASSERT(size != 0);
     AutoMutex g(&_rcv_mtx);
+    size_t read = size;
+    if (_zero_byte_recv) {
+        if (!ReadAvailable(_rcv_budget, &read)) {
+            return false;
+        }
+    } else {
+        RAPTOR_ASSERT(size != 0);
+        if (!RecvCompleted(size)) {
+            return false;
+        }
+    }
+    return AsyncRecv(read);
+}
+
+void Connection::SendCompleted(size_t size, std::vector<FileSend>* finished) {
+    _snd_bytes += size;
+    if (_counters) {
+        ServerCounters::Add(_counters->bytes_sent, size);
+    }
+    if (_transmitting) {
+        _transmitting = false;
+        _send_overlapped.overlapped.Offset = 0;
+        _send_overlapped.overlapped.OffsetHigh = 0;
+        FileSend& f = _snd_files.front();
+        f.offset += size;
+        f.remaining -= RAPTOR_MIN(f.remaining, static_cast<uint64_t>(size));
+        if (f.remaining == 0) {
+            finished->push_back(f);
+            _snd_files.pop_front();
+        }
+        return;
+    }
+    _snd_buffer.MoveHeader(size);
+    if (!_snd_files.empty()) {
+        _snd_files.front().before -= size;
+    }
+}
+
+void Connection::FinishFileSends(std::vector<FileSend>* files, bool success) {
+    for (const FileSend& f : *files) {
+        if (f.done) {
+            f.done(_cid, success ? 1 : 0, f.ctx);
+        }
+    }
+}
+
+bool Connection::RecvCompleted(size_t size) {
+    _rcv_bytes += size;
+    _rcv_last = Now();
+    if (_counters) {
+        ServerCounters::Add(_counters->bytes_received, size);
+    }
+    if (_rio) {
+        if (!_rio_rcv) {
+            return false;
+        }
+        _rcv_buffer.AddSlice(Slice(_rio_rcv->data, size));
+        return ParsingProtocol() != -1;
+    }
     size_t node_size = _tmp_buffer[0].size();
     size_t count = size / node_size;
     size_t i = 0;
 
     for (; i < DEFAULT_TEMP_SLICE_COUNT && i < count; i++) {
-        _rcv_buffer.AddSlice(_tmp_buffer[i]);
+        _rcv_buffer.AddSlice(std::move(_tmp_buffer[i]));
         _tmp_buffer[i] = MakeSliceByDefaultSize();
         size -= node_size;
     }
 
     if (size > 0) {
         Slice s(_tmp_buffer[i].Buffer(), size);
-        _rcv_buffer.AddSlice(s);
+        _rcv_buffer.AddSlice(std::move(s));
     }
 
-    if (ParsingProtocol() == -1) {
-        return false;
-    }
-    return AsyncRecv();
-}
-
-bool Connection::ReadSliceFromRecvBuffer(size_t read_size, Slice& s) {
-    size_t cache_size = _rcv_buffer.GetBufferLength();
-    if (read_size >= cache_size) {
-        s = _rcv_buffer.Merge();
-        return true;
-    }
-    s = _rcv_buffer.GetHeader(read_size);
-    return false;
+    return ParsingProtocol() != -1;
 }
 
 int Connection::ParsingProtocol() {
     size_t cache_size = _rcv_buffer.GetBufferLength();
-    size_t header_size = _proto->GetMaxHeaderSize();
     int package_counter = 0;
 
     while (cache_size > 0) {
-        size_t read_size = header_size;
-        int pack_len = 0;
-        Slice package;
-        do {
-            bool reach_tail = ReadSliceFromRecvBuffer(read_size, package);
-            pack_len = _proto->CheckPackageLength(package.begin(), package.size());
-            if (pack_len < 0) {
-                log_error("tcp client: internal protocol error(pack_len = %d)", pack_len);
-                return -1;
-            }
-
-            // equal 0 means we need more data
-            if (pack_len == 0) {
-                if (reach_tail) {
-                    goto done;
-                }
-                read_size *= 2;
-                continue;
-            }
+        int pack_len = _checker.Check(_rcv_buffer);
+        if (pack_len < 0) {
+            log_error("tcp client: internal protocol error(pack_len = %d)", pack_len);
+            return -1;
+        }
 
-            // We got the length of a whole packet
-            if (cache_size >= (size_t)pack_len) {
-                break;
-            }
+        // equal 0 means we need more data
+        if (pack_len == 0) {
             goto done;
-        } while (false);
+        }
 
-        if (package.size() < static_cast<size_t>(pack_len)) {
-            package = _rcv_buffer.GetHeader(pack_len);
-        } else {
-            size_t n = package.size() - pack_len;
-            package.CutTail(n);
+        // We got the length of a whole packet
+        if (cache_size < (size_t)pack_len) {
+            goto done;
         }
+
+        Slice package = _rcv_buffer.GetHeader(pack_len);
         _service->OnDataReceived(_cid, &package);
         _rcv_buffer.MoveHeader(pack_len);
+        _rcv_messages++;
 
         cache_size = _rcv_buffer.GetBufferLength();
         package_counter++;
@@ -264,6 +700,32 @@ done:
     return package_counter;
 }
 
+size_t Connection::GetSendQueueBytes() {
+    AutoMutex g(&_snd_mtx);
+    return _snd_buffer.GetBufferLength();
+}
+
+void Connection::GetInfo(RaptorConnInfo* info) {
+    memset(info, 0, sizeof(*info));
+    {
+        AutoMutex g(&_rcv_mtx);
+        info->bytes_received = _rcv_bytes;
+        info->messages_received = _rcv_messages;
+        // _rcv_last is on the coarse monotonic clock
+        info->last_active = static_cast<int64_t>(time(0) - (Now() - _rcv_last));
+    }
+    {
+        AutoMutex g(&_snd_mtx);
+        info->bytes_sent = _snd_bytes;
+        info->messages_sent = _snd_messages;
+        info->send_queued_bytes = _snd_buffer.GetBufferLength();
+    }
+    SOCKET fd = _fd;
+    if (fd != INVALID_SOCKET) {
+        raptor_get_socket_tcp_info(fd, info);
+    }
+}
+
 void Connection::SetUserData(void* ptr) {
     _extend_ptr = ptr;
 }
@@ -21,10 +21,16 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
+#include <deque>
+#include <vector>
 
 #include "core/cid.h"
+#include "core/iomgr.h"
+#include "core/package_checker.h"
 #include "core/resolve_address.h"
 #include "core/service.h"
+#include "core/sockaddr.h"
 #include "core/slice/slice.h"
 #include "core/slice/slice_buffer.h"
 #include "core/windows/iocp.h"
@@ -32,6 +38,10 @@
 
 namespace raptor {
 class IProtocol;
+class RioThread;
+class SendRecvThread;
+struct ServerCounters;
+struct RioChunk;
 class Connection final {
     friend class TcpServer;
 public:
@@ -40,12 +50,37 @@ public:
 
     // Before Init, sock must be associated with iocp
     void Init(ConnectionId cid, SOCKET sock, const raptor_resolved_address* addr);
+    // After Init, instead of associating sock with iocp: sends and
+    // receives go through a RIO request queue of 'rio'.
+    bool InitRio(RioThread* rio);
+    // After association with iocp and before the first AsyncRecv:
+    // requests that complete at once are handled on the calling thread,
+    // a read past the budget is handed back to 'rs' instead.
+    void EnableInlineCompletion(SendRecvThread* rs);
+    // Before the first AsyncRecv, 0 means DEFAULT_RECV_BUDGET.
+    void SetRecvBudget(size_t bytes);
+    // After association with iocp and before the first AsyncRecv:
+    // an idle connection only has a zero-byte WSARecv posted and holds
+    // no receive buffer. Makes the socket non-blocking.
+    void EnableZeroByteRecv();
     void SetProtocol(IProtocol* p);
+    void SetCounters(ServerCounters* counters);
     void Shutdown(bool notify);
 
     bool SendWithHeader(
         const void* hdr, size_t hdr_len, const void* data, size_t data_len);
+    // queues a reference to 's' instead of a copy
+    bool SendSlice(const Slice& s);
+    bool SendV(const raptor_iovec* iov, size_t count);
+    // queues length bytes of file after everything queued so far,
+    // done runs exactly once unless this returns false.
+    bool SendFile(raptor_file_t file, uint64_t offset, uint64_t length,
+        raptor_send_file_callback done, void* ctx);
     bool IsOnline();
+    // bytes waiting in the send buffer
+    size_t GetSendQueueBytes();
+    // takes each side's lock in turn
+    void GetInfo(RaptorConnInfo* info);
 
     void SetUserData(void* ptr);
     void GetUserData(void** ptr) const;
@@ -53,6 +88,8 @@ public:
     void GetExtendInfo(uint64_t& data) const;
 
 private:
+    struct FileSend;
+
     // IOCP Event
     bool OnSendEvent(size_t size);
     bool OnRecvEvent(size_t size);
@@ -61,20 +98,49 @@ private:
     // otherwise return -1 (protocol error)
     int  ParsingProtocol();
 
-    // return true if reach recv buffer tail.
-    bool ReadSliceFromRecvBuffer(size_t read_size, Slice& s);
-
-    bool AsyncSend();
-    bool AsyncRecv();
+    // With inline completion these loop until a request is pending.
+    // requires _snd_mtx held, the file ranges fully sent are moved
+    // to 'finished'.
+    bool AsyncSend(std::vector<FileSend>* finished);
+    // requires _rcv_mtx held, 'read' bytes of the budget are spent
+    bool AsyncRecv(size_t read);
+    // requires _snd_mtx held
+    bool TransmitFileRange(FileSend* f, std::vector<FileSend>* finished);
+    void SendCompleted(size_t size, std::vector<FileSend>* finished);
+    // calls done of each, outside _snd_mtx
+    void FinishFileSends(std::vector<FileSend>* files, bool success);
+    bool HasPendingSend() const {
+        return !_snd_buffer.Empty() || !_snd_files.empty();
+    }
+    bool RecvCompleted(size_t size);
+    // zero-byte recv mode, requires _rcv_mtx held
+    bool ZeroByteRecv(size_t read);
+    // reads until the socket would block or limit bytes were added
+    // to 'read', false if the peer closed
+    bool ReadAvailable(size_t limit, size_t* read);
+    // requires _snd_mtx held
+    bool RioSend();
+    bool RioRecv();
+    void ReleaseRio();
 
 private:
-    enum { DEFAULT_TEMP_SLICE_COUNT = 2 };
+    enum {
+        DEFAULT_TEMP_SLICE_COUNT = 2,
+        DEFAULT_RECV_BUDGET = 256 * 1024,
+    };
 
     internal::INotificationTransfer * _service;
     IProtocol* _proto;
+    PackageChecker _checker;
 
     ConnectionId _cid;
     bool _send_pending;
+    bool _inline_completion;
+    bool _zero_byte_recv;
+    // bytes read inline per completion, the rest waits its turn
+    size_t _rcv_budget;
+    SendRecvThread* _rs;
+    ServerCounters* _counters;
 
     SOCKET _fd;
 
@@ -91,8 +157,41 @@ private:
     Mutex _rcv_mtx;
     Mutex _snd_mtx;
 
+    // since Init, for GetInfo. The receive side requires _rcv_mtx
+    // held, the send side _snd_mtx.
+    uint64_t _rcv_bytes;
+    uint64_t _rcv_messages;
+    time_t _rcv_last;
+    uint64_t _snd_bytes;
+    uint64_t _snd_messages;
+
+    // SendFile ranges in send order, requires _snd_mtx held. The
+    // head range starts once 'before' more bytes of _snd_buffer went
+    // out, each later one counts from the end of the one ahead of it.
+    struct FileSend {
+        HANDLE file;
+        uint64_t offset;
+        uint64_t remaining;
+        size_t before;
+        raptor_send_file_callback done;
+        void* ctx;
+    };
+    std::deque<FileSend> _snd_files;
+    // the pending send is a TransmitFile of the head range
+    bool _transmitting;
+    LPFN_TRANSMITFILE _transmit_file;
+
+    // registered I/O, one receive and one send chunk in use
+    RioThread* _rio;
+    RIO_RQ _rq;
+    RioChunk* _rio_rcv;
+    RioChunk* _rio_snd;
+    // RIOSend and RIOReceive on one request queue must not overlap
+    Mutex _rq_mtx;
+
     uint64_t _user_data;
     void* _extend_ptr;
+    IomgrObject _iomgr;
 };
 } // namespace raptor
 #endif  // __RAPTOR_CORE_WINDOWS_CONNECTION__
@@ -54,7 +54,7 @@ bool Iocp::polling(
     return (r != FALSE);
 }
 
-void Iocp::post(void* key, LPOVERLAPPED overlapped) {
-    PostQueuedCompletionStatus(_handle, 0, (ULONG_PTR)key, overlapped);
+void Iocp::post(void* key, LPOVERLAPPED overlapped, DWORD bytes) {
+    PostQueuedCompletionStatus(_handle, bytes, (ULONG_PTR)key, overlapped);
 }
 } // namespace raptor
@@ -26,7 +26,10 @@ namespace raptor {
 enum class IocpEventType {
     kAcceptEvent,
     kSendEvent,
-    kRecvEvent
+    kRecvEvent,
+    kConnectEvent,
+    // a zero-byte WSARecv, it says the socket has data or was closed
+    kReadableEvent
 };
 
 typedef struct {
@@ -45,7 +48,9 @@ public:
         PULONG_PTR CompletionKey,
         LPOVERLAPPED *lpOverlapped,
         DWORD timeout_ms = 1000);
-    void post(void* CompletionKey, LPOVERLAPPED Overlapped);
+    // queues a packet as if bytes were transferred by Overlapped
+    void post(void* CompletionKey, LPOVERLAPPED Overlapped, DWORD bytes = 0);
+    HANDLE handle() const { return _handle; }
 
 private:
     HANDLE _handle;
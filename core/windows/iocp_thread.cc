@@ -25,7 +25,8 @@ SendRecvThread::SendRecvThread(internal::IIocpReceiver* service)
     : _service(service)
     , _shutdown(true)
     , _rs_threads(0)
-    , _threads(nullptr) {}
+    , _threads(nullptr)
+    , _stats(nullptr) {}
 
 SendRecvThread::~SendRecvThread() {
     if (!_shutdown) {
@@ -33,7 +34,8 @@ SendRecvThread::~SendRecvThread() {
     }
 }
 
-RefCountedPtr<Status> SendRecvThread::Init(size_t rs_threads, size_t kernel_threads) {
+RefCountedPtr<Status> SendRecvThread::Init(
+    size_t rs_threads, size_t kernel_threads, const CpuAffinity& affinity) {
     if (!_shutdown) return RAPTOR_ERROR_NONE;
 
     auto e = _iocp.create(kernel_threads);
@@ -44,13 +46,13 @@ RefCountedPtr<Status> SendRecvThread::Init(size_t rs_threads, size_t kernel_thre
     _shutdown = false;
     _rs_threads = rs_threads;
     _threads = new Thread[rs_threads];
+    _stats = new IocpThreadStats[rs_threads];
     for (size_t i = 0; i < rs_threads; i++) {
+        Thread::Options options;
+        options.SetAffinity(affinity.Select(i));
         _threads[i] = Thread("send/recv",
-            [](void* param) ->void {
-                SendRecvThread* p = (SendRecvThread*)param;
-                p->WorkThread();
-            },
-            this);
+            std::bind(&SendRecvThread::WorkThread, this, std::placeholders::_1),
+            &_stats[i], nullptr, options);
     }
     return RAPTOR_ERROR_NONE;
 }
@@ -69,12 +71,26 @@ bool SendRecvThread::Start() {
 void SendRecvThread::Shutdown() {
     if (!_shutdown) {
         _shutdown = true;
-        _iocp.post(NULL, &_exit);
+        // every thread leaves after dequeuing one exit packet
+        for (size_t i = 0; i < _rs_threads; i++) {
+            _iocp.post(NULL, &_exit);
+        }
         for (size_t i = 0; i < _rs_threads; i++) {
             _threads[i].Join();
         }
+        for (size_t i = 0; i < _rs_threads; i++) {
+            log_debug("send/recv thread %u: completions=%llu recv=%llu send=%llu errors=%llu",
+                static_cast<unsigned>(i),
+                static_cast<unsigned long long>(_stats[i].completions.Load()),
+                static_cast<unsigned long long>(_stats[i].recv_events.Load()),
+                static_cast<unsigned long long>(_stats[i].send_events.Load()),
+                static_cast<unsigned long long>(_stats[i].errors.Load()));
+        }
         delete[] _threads;
         _threads = nullptr;
+        delete[] _stats;
+        _stats = nullptr;
+        _rs_threads = 0;
     }
 }
 
@@ -82,7 +98,12 @@ bool SendRecvThread::Add(SOCKET sock, void* CompletionKey) {
     return _iocp.add(sock, CompletionKey);
 }
 
-void SendRecvThread::WorkThread(){
+void SendRecvThread::Requeue(void* CompletionKey, OverLappedEx* ovl, size_t bytes) {
+    _iocp.post(CompletionKey, &ovl->overlapped, static_cast<DWORD>(bytes));
+}
+
+void SendRecvThread::WorkThread(void* ptr) {
+    IocpThreadStats* stats = static_cast<IocpThreadStats*>(ptr);
     while (!_shutdown) {
 
         time_t current_time = Now();
@@ -95,6 +116,8 @@ void SendRecvThread::WorkThread(){
         // https://docs.microsoft.com/en-us/windows/win32/api/ioapiset/nf-ioapiset-getqueuedcompletionstatus
         bool ret = _iocp.polling(
             &NumberOfBytesTransferred, (PULONG_PTR)&CompletionKey, &lpOverlapped, INFINITE);
+        // the completion below and the next check read the cached clock
+        UpdateCoarseClock();
 
         if (!ret) {
 
@@ -120,6 +143,8 @@ void SendRecvThread::WorkThread(){
 
             if (lpOverlapped != NULL && CompletionKey != NULL) {
                 // Maybe an error occurred or the connection was closed
+                IocpThreadStats::Inc(stats->completions);
+                IocpThreadStats::Inc(stats->errors);
                 DWORD err_code = GetLastError();
                 _service->OnErrorEvent(CompletionKey, static_cast<size_t>(err_code));
             }
@@ -132,18 +157,33 @@ void SendRecvThread::WorkThread(){
             break;
         }
 
+        IocpThreadStats::Inc(stats->completions);
+
+        OverLappedEx* ovl = (OverLappedEx*)lpOverlapped;
+        if (ovl->event == IocpEventType::kConnectEvent) {
+            _service->OnConnectEvent(CompletionKey);
+            continue;
+        }
+        if (ovl->event == IocpEventType::kReadableEvent) {
+            IocpThreadStats::Inc(stats->recv_events);
+            _service->OnRecvEvent(CompletionKey, 0);
+            continue;
+        }
+
         // error
         if (NumberOfBytesTransferred == 0) {
+            IocpThreadStats::Inc(stats->errors);
             DWORD err_code = GetLastError();
             _service->OnErrorEvent(CompletionKey, static_cast<size_t>(err_code));
             continue;
         }
 
-        OverLappedEx* ptr = (OverLappedEx*)lpOverlapped;
-        if (ptr->event == IocpEventType::kRecvEvent) {
+        if (ovl->event == IocpEventType::kRecvEvent) {
+            IocpThreadStats::Inc(stats->recv_events);
             _service->OnRecvEvent(CompletionKey, NumberOfBytesTransferred);
         }
-        if (ptr->event == IocpEventType::kSendEvent) {
+        if (ovl->event == IocpEventType::kSendEvent) {
+            IocpThreadStats::Inc(stats->send_events);
             _service->OnSendEvent(CompletionKey, NumberOfBytesTransferred);
         }
     }
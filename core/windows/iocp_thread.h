@@ -21,26 +21,53 @@
 
 #include "core/service.h"
 #include "core/windows/iocp.h"
+#include "util/affinity.h"
+#include "util/atomic.h"
 #include "util/status.h"
 #include "util/thread.h"
+#include "util/useful.h"
 
 namespace raptor {
+
+// Counters of one worker thread, written only by that thread.
+struct IocpThreadStats {
+    AtomicUInt64 completions;   // packets dequeued, failed ones included
+    AtomicUInt64 recv_events;
+    AtomicUInt64 send_events;
+    AtomicUInt64 errors;
+    // RIO only, notifications handled, each with a batch of completions
+    AtomicUInt64 batches;
+    char padding[RAPTOR_CACHELINE_SIZE];
+
+    static void Inc(AtomicUInt64& counter) {
+        counter.Store(counter.Load(MemoryOrder::RELAXED) + 1, MemoryOrder::RELAXED);
+    }
+};
+
 class SendRecvThread {
 public:
     explicit SendRecvThread(internal::IIocpReceiver* service);
     ~SendRecvThread();
-    RefCountedPtr<Status> Init(size_t rs_threads, size_t kernel_threads);
+    RefCountedPtr<Status> Init(size_t rs_threads, size_t kernel_threads,
+        const CpuAffinity& affinity = CpuAffinity());
     bool Start();
     void Shutdown();
     bool Add(SOCKET sock, void* CompletionKey);
+    // hands a request that completed inline to the worker threads,
+    // behind the completions already queued
+    void Requeue(void* CompletionKey, OverLappedEx* ovl, size_t bytes);
+
+    size_t ThreadCount() const { return _rs_threads; }
+    const IocpThreadStats& ThreadStats(size_t i) const { return _stats[i]; }
 
 private:
-    void WorkThread();
+    void WorkThread(void* ptr);
 
     internal::IIocpReceiver* _service;
     bool _shutdown;
     size_t _rs_threads;
     Thread* _threads;
+    IocpThreadStats* _stats;
 
     OVERLAPPED _exit;
     Iocp _iocp;
@@ -0,0 +1,335 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "core/windows/rio_thread.h"
+#include <string.h>
+#include "core/windows/socket_setting.h"
+#include "util/log.h"
+#include "util/time.h"
+
+namespace raptor {
+
+RioBufferPool::RioBufferPool()
+    : _rio(nullptr)
+    , _free(nullptr) {}
+
+RioBufferPool::~RioBufferPool() {
+    Destroy();
+}
+
+void RioBufferPool::Init(const RIO_EXTENSION_FUNCTION_TABLE* rio) {
+    _rio = rio;
+}
+
+void RioBufferPool::Destroy() {
+    AutoMutex g(&_mtx);
+    if (_regions.empty()) {
+        return;
+    }
+    for (auto& region : _regions) {
+        _rio->RIODeregisterBuffer(region.id);
+        VirtualFree(region.memory, 0, MEM_RELEASE);
+        delete[] region.chunks;
+    }
+    _regions.clear();
+    _free = nullptr;
+}
+
+bool RioBufferPool::Grow() {
+    const DWORD region_size = CHUNK_SIZE * CHUNKS_PER_REGION;
+    char* memory = static_cast<char*>(
+        VirtualAlloc(NULL, region_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    if (!memory) {
+        return false;
+    }
+    RIO_BUFFERID id = _rio->RIORegisterBuffer(memory, region_size);
+    if (id == RIO_INVALID_BUFFERID) {
+        log_error_ratelimited(1000, "rio: RIORegisterBuffer failed (%d)", WSAGetLastError());
+        VirtualFree(memory, 0, MEM_RELEASE);
+        return false;
+    }
+
+    Region region;
+    region.memory = memory;
+    region.id = id;
+    region.chunks = new RioChunk[CHUNKS_PER_REGION];
+    for (DWORD i = 0; i < CHUNKS_PER_REGION; i++) {
+        RioChunk* chunk = &region.chunks[i];
+        chunk->buf.BufferId = id;
+        chunk->buf.Offset = i * CHUNK_SIZE;
+        chunk->buf.Length = CHUNK_SIZE;
+        chunk->data = memory + i * CHUNK_SIZE;
+        chunk->event = IocpEventType::kRecvEvent;
+        chunk->in_flight = false;
+        chunk->orphaned = false;
+        chunk->next = _free;
+        _free = chunk;
+    }
+    _regions.push_back(region);
+    return true;
+}
+
+RioChunk* RioBufferPool::Get() {
+    AutoMutex g(&_mtx);
+    if (!_free && !Grow()) {
+        return nullptr;
+    }
+    RioChunk* chunk = _free;
+    _free = chunk->next;
+    chunk->next = nullptr;
+    chunk->buf.Length = CHUNK_SIZE;
+    chunk->in_flight = false;
+    chunk->orphaned = false;
+    return chunk;
+}
+
+void RioBufferPool::Put(RioChunk* chunk) {
+    AutoMutex g(&_mtx);
+    if (chunk->in_flight) {
+        // the kernel may still write to it
+        chunk->orphaned = true;
+        return;
+    }
+    chunk->next = _free;
+    _free = chunk;
+}
+
+void RioBufferPool::MarkInFlight(RioChunk* chunk) {
+    AutoMutex g(&_mtx);
+    chunk->in_flight = true;
+}
+
+bool RioBufferPool::Complete(RioChunk* chunk) {
+    AutoMutex g(&_mtx);
+    chunk->in_flight = false;
+    if (chunk->orphaned) {
+        chunk->orphaned = false;
+        chunk->next = _free;
+        _free = chunk;
+        return false;
+    }
+    return true;
+}
+
+RioThread::RioThread(internal::IIocpReceiver* service)
+    : _service(service)
+    , _shutdown(true)
+    , _rs_threads(0)
+    , _threads(nullptr)
+    , _stats(nullptr)
+    , _cq(RIO_INVALID_CQ)
+    , _cq_size(0)
+    , _cq_used(0) {
+    memset(&_rio, 0, sizeof(_rio));
+    memset(&_notify, 0, sizeof(_notify));
+    memset(&_exit, 0, sizeof(_exit));
+}
+
+RioThread::~RioThread() {
+    if (!_shutdown) {
+        Shutdown();
+    }
+    // the connections, and with them their request queues and
+    // chunks, are gone by now
+    if (_cq != RIO_INVALID_CQ) {
+        _rio.RIOCloseCompletionQueue(_cq);
+        _cq = RIO_INVALID_CQ;
+    }
+    _pool.Destroy();
+}
+
+raptor_error RioThread::Init(size_t rs_threads, const CpuAffinity& affinity) {
+    if (!_shutdown || _cq != RIO_INVALID_CQ) {
+        return RAPTOR_ERROR_FROM_STATIC_STRING("rio thread already initialized");
+    }
+
+    // the function table is fetched through any RIO capable socket
+    SOCKET s = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0,
+        RAPTOR_WSA_SOCKET_FLAGS | WSA_FLAG_REGISTERED_IO);
+    if (s == INVALID_SOCKET) {
+        return RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "WSASocket");
+    }
+    GUID guid = WSAID_MULTIPLE_RIO;
+    DWORD bytes = 0;
+    int r = WSAIoctl(s, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER,
+        &guid, sizeof(guid), &_rio, sizeof(_rio), &bytes, NULL, NULL);
+    int err = WSAGetLastError();
+    closesocket(s);
+    if (r != 0) {
+        return RAPTOR_WINDOWS_ERROR(err, "WSAIoctl(WSAID_MULTIPLE_RIO)");
+    }
+
+    auto e = _iocp.create(0);
+    if (e != RAPTOR_ERROR_NONE) {
+        return e;
+    }
+
+    RIO_NOTIFICATION_COMPLETION completion;
+    completion.Type = RIO_IOCP_COMPLETION;
+    completion.Iocp.IocpHandle = _iocp.handle();
+    completion.Iocp.CompletionKey = this;
+    completion.Iocp.Overlapped = &_notify;
+    _cq = _rio.RIOCreateCompletionQueue(INITIAL_CQ_SIZE, &completion);
+    if (_cq == RIO_INVALID_CQ) {
+        return RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "RIOCreateCompletionQueue");
+    }
+    _cq_size = INITIAL_CQ_SIZE;
+    _cq_used = 0;
+    _pool.Init(&_rio);
+
+    _shutdown = false;
+    _rs_threads = rs_threads;
+    _threads = new Thread[rs_threads];
+    _stats = new IocpThreadStats[rs_threads];
+    for (size_t i = 0; i < rs_threads; i++) {
+        Thread::Options options;
+        options.SetAffinity(affinity.Select(i));
+        _threads[i] = Thread("rio",
+            std::bind(&RioThread::WorkThread, this, std::placeholders::_1),
+            &_stats[i], nullptr, options);
+    }
+    return RAPTOR_ERROR_NONE;
+}
+
+bool RioThread::Start() {
+    if (_shutdown) {
+        return false;
+    }
+    _cq_mtx.Lock();
+    int r = _rio.RIONotify(_cq);
+    _cq_mtx.Unlock();
+    if (r != ERROR_SUCCESS) {
+        log_error("rio: RIONotify failed (%d)", r);
+        return false;
+    }
+    for (size_t i = 0; i < _rs_threads; i++) {
+        _threads[i].Start();
+    }
+    return true;
+}
+
+void RioThread::Shutdown() {
+    if (!_shutdown) {
+        _shutdown = true;
+        for (size_t i = 0; i < _rs_threads; i++) {
+            _iocp.post(NULL, &_exit);
+        }
+        for (size_t i = 0; i < _rs_threads; i++) {
+            _threads[i].Join();
+        }
+        delete[] _threads;
+        _threads = nullptr;
+        delete[] _stats;
+        _stats = nullptr;
+        _rs_threads = 0;
+    }
+}
+
+RIO_RQ RioThread::CreateRequestQueue(SOCKET sock, ConnectionId cid) {
+    AutoMutex g(&_cq_mtx);
+    if (_cq == RIO_INVALID_CQ) {
+        return RIO_INVALID_RQ;
+    }
+    // the completion queue must have room for every operation
+    // the request queues can have outstanding
+    if (_cq_used + CQ_ENTRIES_PER_QUEUE > _cq_size) {
+        DWORD size = _cq_size * 2;
+        if (size > RIO_MAX_CQ_SIZE) {
+            size = RIO_MAX_CQ_SIZE;
+        }
+        if (size < _cq_used + CQ_ENTRIES_PER_QUEUE
+            || !_rio.RIOResizeCompletionQueue(_cq, size)) {
+            log_error_ratelimited(1000, "rio: failed to grow the completion queue to %u", size);
+            return RIO_INVALID_RQ;
+        }
+        _cq_size = size;
+    }
+    RIO_RQ rq = _rio.RIOCreateRequestQueue(sock, 1, 1, 1, 1, _cq, _cq,
+        reinterpret_cast<PVOID>(cid));
+    if (rq != RIO_INVALID_RQ) {
+        _cq_used += CQ_ENTRIES_PER_QUEUE;
+    }
+    return rq;
+}
+
+void RioThread::ReleaseRequestQueue() {
+    AutoMutex g(&_cq_mtx);
+    if (_cq_used >= CQ_ENTRIES_PER_QUEUE) {
+        _cq_used -= CQ_ENTRIES_PER_QUEUE;
+    }
+}
+
+void RioThread::WorkThread(void* ptr) {
+    IocpThreadStats* stats = static_cast<IocpThreadStats*>(ptr);
+    RIORESULT results[DEQUEUE_BATCH];
+
+    while (!_shutdown) {
+        _service->OnCheckingEvent(Now());
+
+        DWORD NumberOfBytesTransferred = 0;
+        void* CompletionKey = NULL;
+        LPOVERLAPPED lpOverlapped = NULL;
+        bool ret = _iocp.polling(
+            &NumberOfBytesTransferred, (PULONG_PTR)&CompletionKey, &lpOverlapped, INFINITE);
+        UpdateCoarseClock();
+
+        if (lpOverlapped == &_exit) {
+            break;
+        }
+        if (!ret || lpOverlapped != &_notify) {
+            continue;
+        }
+
+        // re-armed at once, the next batch goes to another worker
+        ULONG count;
+        {
+            AutoMutex g(&_cq_mtx);
+            count = _rio.RIODequeueCompletion(_cq, results, DEQUEUE_BATCH);
+            _rio.RIONotify(_cq);
+        }
+        if (count == RIO_CORRUPT_CQ) {
+            log_error("rio: the completion queue is corrupt");
+            continue;
+        }
+        IocpThreadStats::Inc(stats->batches);
+
+        for (ULONG i = 0; i < count; i++) {
+            const RIORESULT& result = results[i];
+            RioChunk* chunk = reinterpret_cast<RioChunk*>(result.RequestContext);
+            void* cid = reinterpret_cast<void*>(result.SocketContext);
+            IocpThreadStats::Inc(stats->completions);
+            if (!_pool.Complete(chunk)) {
+                continue;
+            }
+            if (result.Status != 0 || result.BytesTransferred == 0) {
+                IocpThreadStats::Inc(stats->errors);
+                _service->OnErrorEvent(cid, static_cast<size_t>(result.Status));
+                continue;
+            }
+            if (chunk->event == IocpEventType::kRecvEvent) {
+                IocpThreadStats::Inc(stats->recv_events);
+                _service->OnRecvEvent(cid, result.BytesTransferred);
+            } else {
+                IocpThreadStats::Inc(stats->send_events);
+                _service->OnSendEvent(cid, result.BytesTransferred);
+            }
+        }
+    }
+}
+
+} // namespace raptor
@@ -0,0 +1,154 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_CORE_WINDOWS_RIO_THREAD__
+#define __RAPTOR_CORE_WINDOWS_RIO_THREAD__
+
+#include <vector>
+
+#include "core/cid.h"
+#include "core/service.h"
+#include "core/sockaddr.h"
+#include "core/windows/iocp.h"
+#include "core/windows/iocp_thread.h"
+#include "util/affinity.h"
+#include "util/status.h"
+#include "util/sync.h"
+#include "util/thread.h"
+
+namespace raptor {
+
+// A registered buffer a connection posts one RIO operation on.
+struct RioChunk {
+    RIO_BUF buf;
+    char* data;
+    RioChunk* next;
+    // what the chunk is posted for, set by its connection
+    IocpEventType event;
+    // both guarded by the pool lock
+    bool in_flight;
+    // released by its connection while in flight, freed on completion
+    bool orphaned;
+};
+
+/*
+    Chunks cut from large buffers registered once with RIORegisterBuffer,
+    so posting a send or receive neither pins pages nor allocates in
+    the kernel. The pool grows one region at a time.
+*/
+class RioBufferPool final {
+public:
+    enum {
+        CHUNK_SIZE = 4096,
+        CHUNKS_PER_REGION = 1024
+    };
+
+    RioBufferPool();
+    ~RioBufferPool();
+
+    void Init(const RIO_EXTENSION_FUNCTION_TABLE* rio);
+    void Destroy();
+
+    // nullptr if no more memory can be registered
+    RioChunk* Get();
+    // the chunk is freed now or, if in flight, on completion
+    void Put(RioChunk* chunk);
+    void MarkInFlight(RioChunk* chunk);
+    // false if the chunk's connection is gone
+    bool Complete(RioChunk* chunk);
+
+private:
+    struct Region {
+        char* memory;
+        RIO_BUFFERID id;
+        RioChunk* chunks;
+    };
+
+    // requires _mtx held
+    bool Grow();
+
+    const RIO_EXTENSION_FUNCTION_TABLE* _rio;
+    Mutex _mtx;
+    RioChunk* _free;
+    std::vector<Region> _regions;
+};
+
+/*
+    Replaces SendRecvThread when RaptorOptions::registered_io is set.
+    All request queues complete on a single RIO completion queue that
+    signals the completion port. A worker woken by the signal takes a
+    batch of results with RIODequeueCompletion, re-arms RIONotify so
+    another worker can take the next batch, then dispatches them to
+    the same IIocpReceiver callbacks as the overlapped engine.
+*/
+class RioThread final {
+public:
+    explicit RioThread(internal::IIocpReceiver* service);
+    ~RioThread();
+
+    // fails if the system has no RIO support
+    raptor_error Init(size_t rs_threads, const CpuAffinity& affinity = CpuAffinity());
+    bool Start();
+    // stops the workers, the completion queue and the buffers
+    // live until destruction, after the connections
+    void Shutdown();
+
+    // sock must be created with WSA_FLAG_REGISTERED_IO,
+    // returns RIO_INVALID_RQ on failure
+    RIO_RQ CreateRequestQueue(SOCKET sock, ConnectionId cid);
+    // after the socket of a request queue is closed
+    void ReleaseRequestQueue();
+
+    const RIO_EXTENSION_FUNCTION_TABLE* Api() const { return &_rio; }
+    RioBufferPool* Pool() { return &_pool; }
+
+    size_t ThreadCount() const { return _rs_threads; }
+    const IocpThreadStats& ThreadStats(size_t i) const { return _stats[i]; }
+
+private:
+    enum {
+        DEQUEUE_BATCH = 256,
+        INITIAL_CQ_SIZE = 4096,
+        // one receive and one send per request queue
+        CQ_ENTRIES_PER_QUEUE = 2
+    };
+
+    void WorkThread(void* ptr);
+
+    internal::IIocpReceiver* _service;
+    bool _shutdown;
+    size_t _rs_threads;
+    Thread* _threads;
+    IocpThreadStats* _stats;
+
+    RIO_EXTENSION_FUNCTION_TABLE _rio;
+    RioBufferPool _pool;
+    Iocp _iocp;
+    OVERLAPPED _notify;
+    OVERLAPPED _exit;
+
+    // RIO calls on one completion queue must not run concurrently
+    Mutex _cq_mtx;
+    RIO_CQ _cq;
+    DWORD _cq_size;
+    DWORD _cq_used;
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_CORE_WINDOWS_RIO_THREAD__
@@ -17,6 +17,7 @@
  */
 
 #include "core/windows/socket_setting.h"
+#include <mstcpip.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -130,12 +131,131 @@ void raptor_set_socket_shutdown(SOCKET fd) {
     closesocket(fd);
 }
 
+// A non-IFS layered provider may complete a request at once and
+// still queue a packet, skipping the port is only safe without them.
+static bool raptor_tcp_providers_are_ifs() {
+    DWORD length = 0;
+    if (WSAEnumProtocols(NULL, NULL, &length) != SOCKET_ERROR
+        || WSAGetLastError() != WSAENOBUFS) {
+        return false;
+    }
+    WSAPROTOCOL_INFO* protocols =
+        static_cast<WSAPROTOCOL_INFO*>(raptor::Malloc(length));
+    int count = WSAEnumProtocols(NULL, protocols, &length);
+    bool ifs = (count != SOCKET_ERROR);
+    for (int i = 0; i < count; i++) {
+        if (protocols[i].iProtocol == IPPROTO_TCP
+            && !(protocols[i].dwServiceFlags1 & XP1_IFS_HANDLES)) {
+            ifs = false;
+            break;
+        }
+    }
+    raptor::Free(protocols);
+    return ifs;
+}
+
+bool raptor_set_socket_skip_completion_port(SOCKET fd) {
+    static const bool ifs = raptor_tcp_providers_are_ifs();
+    if (!ifs) {
+        return false;
+    }
+    return SetFileCompletionNotificationModes(
+        reinterpret_cast<HANDLE>(fd),
+        FILE_SKIP_COMPLETION_PORT_ON_SUCCESS | FILE_SKIP_SET_EVENT_ON_HANDLE) != FALSE;
+}
+
 raptor_error raptor_set_socket_tcp_user_timeout(SOCKET fd, int timeout) {
+#ifdef TCP_MAXRT
+    // whole seconds, rounded up
+    DWORD seconds = static_cast<DWORD>((timeout + 999) / 1000);
+    if (setsockopt(fd, IPPROTO_TCP, TCP_MAXRT,
+            (const char*)&seconds, sizeof(seconds)) == SOCKET_ERROR) {
+        return RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "setsockopt(TCP_MAXRT)");
+    }
+#else
     (void)fd;
     (void)timeout;
+#endif
+    return RAPTOR_ERROR_NONE;
+}
+
+raptor_error raptor_set_socket_keepalive(
+    SOCKET fd, int idle_seconds, int interval_seconds, int count) {
+    struct tcp_keepalive vals;
+    vals.onoff = (idle_seconds > 0) ? 1 : 0;
+    vals.keepalivetime = static_cast<ULONG>(idle_seconds) * 1000;
+    vals.keepaliveinterval =
+        static_cast<ULONG>(interval_seconds > 0 ? interval_seconds : 75) * 1000;
+    DWORD bytes = 0;
+    if (WSAIoctl(fd, SIO_KEEPALIVE_VALS, &vals, sizeof(vals),
+            NULL, 0, &bytes, NULL, NULL) == SOCKET_ERROR) {
+        return RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "WSAIoctl(SIO_KEEPALIVE_VALS)");
+    }
+#ifdef TCP_KEEPCNT
+    if (idle_seconds > 0 && count > 0) {
+        DWORD val = static_cast<DWORD>(count);
+        // older systems keep their own count
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, (const char*)&val, sizeof(val));
+    }
+#else
+    (void)count;
+#endif
     return RAPTOR_ERROR_NONE;
 }
 
+raptor_error raptor_get_socket_tcp_info(SOCKET fd, raptor_conn_info_t* info) {
+#ifdef SIO_TCP_INFO
+    DWORD version = 0;
+    TCP_INFO_v0 ti;
+    DWORD bytes = 0;
+    if (WSAIoctl(fd, SIO_TCP_INFO, &version, sizeof(version),
+            &ti, sizeof(ti), &bytes, NULL, NULL) == SOCKET_ERROR) {
+        return RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "WSAIoctl(SIO_TCP_INFO)");
+    }
+    info->rtt_us = static_cast<uint32_t>(ti.RttUs);
+    info->snd_cwnd = ti.Mss > 0 ? static_cast<uint32_t>(ti.Cwnd / ti.Mss) : 0;
+    info->snd_mss = static_cast<uint32_t>(ti.Mss);
+    // counted in bytes here
+    info->retransmits = ti.Mss > 0 ? static_cast<uint32_t>(ti.BytesRetrans / ti.Mss) : 0;
+    return RAPTOR_ERROR_NONE;
+#else
+    (void)fd;
+    (void)info;
+    return RAPTOR_WINDOWS_ERROR(WSAEOPNOTSUPP, "SIO_TCP_INFO");
+#endif
+}
+
+raptor_error raptor_set_socket_buffer_sizes(SOCKET fd, int snd_size, int rcv_size) {
+    if (snd_size > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+            (const char*)&snd_size, sizeof(snd_size)) == SOCKET_ERROR) {
+        return RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "setsockopt(SO_SNDBUF)");
+    }
+    if (rcv_size > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+            (const char*)&rcv_size, sizeof(rcv_size)) == SOCKET_ERROR) {
+        return RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "setsockopt(SO_RCVBUF)");
+    }
+    return RAPTOR_ERROR_NONE;
+}
+
+raptor_error raptor_apply_socket_profile(SOCKET fd, const raptor_socket_profile_t* profile) {
+    raptor_error e = raptor_set_socket_buffer_sizes(fd,
+        static_cast<int>(profile->send_buffer_size),
+        static_cast<int>(profile->recv_buffer_size));
+    if (e == RAPTOR_ERROR_NONE) {
+        e = raptor_set_socket_low_latency(fd, profile->nagle == 0);
+    }
+    if (e == RAPTOR_ERROR_NONE && profile->user_timeout_ms > 0) {
+        e = raptor_set_socket_tcp_user_timeout(fd, static_cast<int>(profile->user_timeout_ms));
+    }
+    if (e == RAPTOR_ERROR_NONE && profile->keepalive_idle_seconds > 0) {
+        e = raptor_set_socket_keepalive(fd,
+            static_cast<int>(profile->keepalive_idle_seconds),
+            static_cast<int>(profile->keepalive_interval_seconds),
+            static_cast<int>(profile->keepalive_count));
+    }
+    return e;
+}
+
 raptor_error raptor_set_socket_no_sigpipe_if_possible(SOCKET fd) {
 #ifdef SO_NOSIGPIPE
     int val = 1;
@@ -229,11 +349,13 @@ raptor_error raptor_tcp_prepare_socket(SOCKET sock) {
 }
 
 raptor_error raptor_tcp_server_prepare_socket(
-    SOCKET sock, const raptor_resolved_address* addr, int* port, int so_reuseport) {
+    SOCKET sock, const raptor_resolved_address* addr, int* port, int so_reuseport,
+    const raptor_socket_profile_t* profile) {
 
     raptor_resolved_address sockname_temp;
     raptor_error error = RAPTOR_ERROR_NONE;
     int sockname_temp_len;
+    int backlog = SOMAXCONN;
 
     (so_reuseport);
 
@@ -247,7 +369,21 @@ raptor_error raptor_tcp_server_prepare_socket(
         goto failure;
     }
 
-    if (listen(sock, SOMAXCONN) == SOCKET_ERROR) {
+#ifdef TCP_FASTOPEN
+    if (profile && profile->fastopen_queue > 0) {
+        DWORD on = 1;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN,
+                (const char*)&on, sizeof(on)) == SOCKET_ERROR) {
+            error = RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "setsockopt(TCP_FASTOPEN)");
+            goto failure;
+        }
+    }
+#endif
+    if (profile && profile->listen_backlog > 0) {
+        // SOMAXCONN_HINT, the backlog itself rather than a maximum
+        backlog = -static_cast<int>(profile->listen_backlog < 65535 ? profile->listen_backlog : 65535);
+    }
+    if (listen(sock, backlog) == SOCKET_ERROR) {
         error = RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "listen");
         goto failure;
     }
@@ -21,6 +21,7 @@
 
 #include "core/resolve_address.h"
 #include "core/sockaddr.h"
+#include "raptor/types.h"
 #include "util/status.h"
 
 #ifndef WSA_FLAG_NO_HANDLE_INHERIT
@@ -53,9 +54,30 @@ raptor_error raptor_set_socket_ipv6_only(SOCKET fd, int only);
 // shutdown fd
 void raptor_set_socket_shutdown(SOCKET fd);
 
+/* Overlapped calls on fd that complete at once queue no completion
+   packet and set no event, the caller handles them inline. Returns
+   false when the mode is not set, e.g. a non-IFS provider is layered
+   over TCP; completions then keep arriving through the port. */
+bool raptor_set_socket_skip_completion_port(SOCKET fd);
+
 /* Set TCP_USER_TIMEOUT */
 raptor_error raptor_set_socket_tcp_user_timeout(SOCKET fd, int timeout);
 
+/* keepalive through SIO_KEEPALIVE_VALS, idle_seconds 0 turns it off.
+   interval_seconds 0 means 75. */
+raptor_error raptor_set_socket_keepalive(
+    SOCKET fd, int idle_seconds, int interval_seconds, int count);
+
+/* the SIO_TCP_INFO fields of raptor_conn_info_t, left alone where
+   the system has no SIO_TCP_INFO (before Windows 10 1703) */
+raptor_error raptor_get_socket_tcp_info(SOCKET fd, raptor_conn_info_t* info);
+
+/* SO_SNDBUF and SO_RCVBUF, 0 keeps the size */
+raptor_error raptor_set_socket_buffer_sizes(SOCKET fd, int snd_size, int rcv_size);
+
+/* the per connection options of 'profile' */
+raptor_error raptor_apply_socket_profile(SOCKET fd, const raptor_socket_profile_t* profile);
+
 // Tries to set SO_NOSIGPIPE if available on this platform
 raptor_error raptor_set_socket_no_sigpipe_if_possible(SOCKET fd);
 
@@ -83,6 +105,7 @@ raptor_error raptor_tcp_prepare_socket(SOCKET sock);
 raptor_error raptor_tcp_server_prepare_socket(
                         SOCKET sock,
                         const raptor_resolved_address* addr,
-                        int* port, int so_reuseport);
+                        int* port, int so_reuseport,
+                        const raptor_socket_profile_t* profile = nullptr);
 
 #endif  // __RAPTOR_SOCKET_OPTIONS__
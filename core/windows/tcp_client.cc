@@ -16,44 +16,115 @@
  *
  */
 #include "core/windows/tcp_client.h"
+#include <string.h>
+
 #include "core/socket_util.h"
+#include "core/windows/iocp_thread.h"
 #include "core/windows/socket_setting.h"
+#include "util/cpu.h"
 #include "util/log.h"
 
 namespace raptor {
+namespace {
+// the client whose completion the calling pool thread is handling
+thread_local TcpClient* t_handling = nullptr;
+}  // namespace
+
+/*
+    The IOCP threads shared by the TcpClients of the process, one per
+    cpu core, started by the first Init and kept for the life of the
+    process. The completion key of a socket is its TcpClient.
+*/
+class ClientIocp final : public internal::IIocpReceiver {
+public:
+    static ClientIocp* Instance() {
+        static ClientIocp* pool = new ClientIocp;
+        return pool;
+    }
+
+    raptor_error Start() {
+        AutoMutex g(&_mtx);
+        if (_started) {
+            return RAPTOR_ERROR_NONE;
+        }
+        unsigned int cores = raptor_get_number_of_cpu_cores();
+        auto e = _thd.Init(cores > 0 ? cores : 1, 0);
+        if (e != RAPTOR_ERROR_NONE) {
+            return e;
+        }
+        _started = _thd.Start();
+        return RAPTOR_ERROR_NONE;
+    }
+
+    bool Add(SOCKET sock, TcpClient* client) {
+        return _thd.Add(sock, client);
+    }
+
+    // internal::IIocpReceiver impl
+    void OnErrorEvent(void* ptr, size_t) override {
+        static_cast<TcpClient*>(ptr)->OnErrorCompleted();
+    }
+    void OnRecvEvent(void* ptr, size_t transferred_bytes) override {
+        static_cast<TcpClient*>(ptr)->OnRecvCompleted(transferred_bytes);
+    }
+    void OnSendEvent(void* ptr, size_t transferred_bytes) override {
+        static_cast<TcpClient*>(ptr)->OnSendCompleted(transferred_bytes);
+    }
+    void OnCheckingEvent(time_t) override {}
+    void OnConnectEvent(void* ptr) override {
+        static_cast<TcpClient*>(ptr)->OnConnectCompleted();
+    }
+
+private:
+    ClientIocp()
+        : _started(false)
+        , _thd(this) {}
+
+    Mutex _mtx;
+    bool _started;
+    SendRecvThread _thd;
+};
+
 TcpClient::TcpClient(IClientReceiver* service)
     : _service(service)
     , _proto(nullptr)
     , _send_pending(false)
     , _shutdown(true)
     , _connectex(nullptr)
+    , _iocp(nullptr)
     , _fd(INVALID_SOCKET)
-    , _event(WSA_INVALID_EVENT) {
+    , _connecting(false)
+    , _online(false)
+    , _pending(0) {
 }
 
-TcpClient::~TcpClient() {}
+TcpClient::~TcpClient() {
+    Shutdown();
+    WaitForOperations();
+}
 
 raptor_error TcpClient::Init() {
     if (!_shutdown) {
         return RAPTOR_ERROR_FROM_STATIC_STRING("tcp client already running");
     }
 
-    _event = WSACreateEvent();
-    if (_event == WSA_INVALID_EVENT) {
-        return RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "WSACreateEvent");
+    // a Shutdown from a callback left the completions of the previous
+    // socket on their way
+    WaitForOperations();
+
+    _iocp = ClientIocp::Instance();
+    auto e = _iocp->Start();
+    if (e != RAPTOR_ERROR_NONE) {
+        return e;
     }
 
     _shutdown = false;
     _send_pending = false;
+    _rcv_buffer.ClearBuffer();
 
     for (size_t i = 0; i < DEFAULT_TEMP_SLICE_COUNT; i++) {
         _tmp_buffer[i] = MakeSliceByDefaultSize();
     }
-
-    _thd = Thread("client",
-        std::bind(&TcpClient::WorkThread, this, std::placeholders::_1), nullptr);
-
-    _thd.Start();
     return RAPTOR_ERROR_NONE;
 }
 
@@ -63,7 +134,7 @@ raptor_error TcpClient::Connect(const char* addr, size_t timeout_ms) {
     if (_shutdown) {
         return RAPTOR_ERROR_FROM_STATIC_STRING("TcpClient is not initialized");
     }
-    if (_send_pending) {
+    if (_connecting.Load() || _online.Load()) {
         return RAPTOR_ERROR_FROM_STATIC_STRING("Connection operation in progress");
     }
     raptor_resolved_addresses* addrs;
@@ -100,18 +171,19 @@ raptor_error TcpClient::InternalConnect(const raptor_resolved_address* addr) {
     raptor_error error;
     raptor_dualstack_mode mode;
     raptor_resolved_address local_address;
+    SOCKET fd = INVALID_SOCKET;
     int status;
     BOOL ret;
 
-    error = raptor_create_socket(addr, &_fd, &mode);
+    error = raptor_create_socket(addr, &fd, &mode);
     if (error != RAPTOR_ERROR_NONE) {
         goto failure;
     }
-    error = raptor_tcp_prepare_socket(_fd);
+    error = raptor_tcp_prepare_socket(fd);
     if (error != RAPTOR_ERROR_NONE) {
         goto failure;
     }
-    error = GetConnectExIfNecessary(_fd);
+    error = GetConnectExIfNecessary(fd);
     if (error != RAPTOR_ERROR_NONE) {
         goto failure;
     }
@@ -119,35 +191,50 @@ raptor_error TcpClient::InternalConnect(const raptor_resolved_address* addr) {
     raptor_sockaddr_make_wildcard6(0, &local_address);
 
     status =
-        bind(_fd, (raptor_sockaddr*)&local_address.addr, (int)local_address.len);
+        bind(fd, (raptor_sockaddr*)&local_address.addr, (int)local_address.len);
 
     if (status != 0) {
         error = RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "bind");
         goto failure;
     }
 
-    /* Associate event type FD_CONNECT with the fd and event */
-    WSAEventSelect(_fd, _event, FD_CONNECT);
+    if (!_iocp->Add(fd, this)) {
+        error = RAPTOR_WINDOWS_ERROR(GetLastError(), "CreateIoCompletionPort");
+        goto failure;
+    }
+
+    _s_mtx.Lock();
+    _r_mtx.Lock();
+    _fd = fd;
+    _r_mtx.Unlock();
+    _s_mtx.Unlock();
 
-    ret = _connectex(_fd,
+    memset(&_connect_overlapped.overlapped, 0, sizeof(OVERLAPPED));
+    _connect_overlapped.event = IocpEventType::kConnectEvent;
+    _connecting.Store(true);
+    _pending.FetchAdd(1, MemoryOrder::ACQ_REL);
+
+    ret = _connectex(fd,
                     (raptor_sockaddr*)&addr->addr, (int)addr->len,
-                    NULL, 0, NULL, &_conncet_overlapped);
+                    NULL, 0, NULL, &_connect_overlapped.overlapped);
 
     /* It wouldn't be unusual to get a success immediately. But we'll still get
         an IOCP notification, so let's ignore it. */
     if (!ret) {
         int last_error = WSAGetLastError();
         if (last_error != ERROR_IO_PENDING) {
-            error = RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "ConnectEx");
-            goto failure;
+            error = RAPTOR_WINDOWS_ERROR(last_error, "ConnectEx");
+            _connecting.Store(false);
+            _pending.FetchSub(1, MemoryOrder::ACQ_REL);
+            CloseSocket();
+            return error;
         }
     }
 
     return RAPTOR_ERROR_NONE;
 failure:
-    if (_fd != INVALID_SOCKET) {
-        closesocket(_fd);
-        _fd = INVALID_SOCKET;
+    if (fd != INVALID_SOCKET) {
+        closesocket(fd);
     }
     return error;
 }
@@ -165,174 +252,191 @@ bool TcpClient::Send(const void* buff, size_t len) {
     return true;
 }
 
+bool TcpClient::SendV(const raptor_iovec* iov, size_t count) {
+    if (!IsOnline()) {
+        return false;
+    }
+
+    AutoMutex g(&_s_mtx);
+    _snd_buffer.AddFragments(iov, count);
+    if (!_send_pending) {
+        return AsyncSend();
+    }
+    return true;
+}
+
+bool TcpClient::SendZeroCopy(const void* ptr, size_t len,
+        raptor_buffer_release_callback release, void* ctx) {
+    Slice s = MakeSliceByExternal(ptr, len, release, ctx);
+    if (!IsOnline() || !ptr || len == 0) {
+        return false;
+    }
+
+    AutoMutex g(&_s_mtx);
+    _snd_buffer.AddSlice(std::move(s));
+    if (!_send_pending) {
+        return AsyncSend();
+    }
+    return true;
+}
+
 bool TcpClient::IsOnline() const {
-    return (_fd != INVALID_SOCKET);
+    return _online.Load();
+}
+
+// see ITcpServer::ScheduleTimer
+uint64_t TcpClient::ScheduleTimer(
+    uint32_t /*delay_ms*/, raptor_timer_callback /*cb*/, void* /*ctx*/) {
+    log_error_ratelimited(1000, "tcpclient: ScheduleTimer is not supported on windows");
+    return 0;
+}
+
+bool TcpClient::CancelTimer(uint64_t /*timer_id*/) {
+    log_error_ratelimited(1000, "tcpclient: CancelTimer is not supported on windows");
+    return false;
 }
 
 void TcpClient::SetProtocol(IProtocol* proto) {
     _proto = proto;
+    _checker.SetProtocol(proto);
 }
 
 void TcpClient::Shutdown() {
     if (!_shutdown) {
         _shutdown = true;
-        _send_pending = false;
-
-        _thd.Join();
+        _connecting.Store(false);
+        _online.Store(false);
 
-        WSACloseEvent(_event);
-        _event = WSA_INVALID_EVENT;
+        // the outstanding operations complete with an error
+        CloseSocket();
 
-        raptor_set_socket_shutdown(_fd);
-        _fd = INVALID_SOCKET;
+        // a callback of this client can't wait for its own completion
+        if (t_handling != this) {
+            WaitForOperations();
+        }
 
         _s_mtx.Lock();
+        _send_pending = false;
         _snd_buffer.ClearBuffer();
         _s_mtx.Unlock();
-
-        _r_mtx.Lock();
-        _rcv_buffer.ClearBuffer();
-        _r_mtx.Unlock();
     }
 }
 
-void TcpClient::WorkThread(void*) {
-    while (!_shutdown) {
-        DWORD ret = WSAWaitForMultipleEvents(1, &_event, FALSE, 1000, FALSE);
-        if (ret == WSA_WAIT_FAILED || ret == WSA_WAIT_TIMEOUT) {
-            continue;
-        }
-
-        WSANETWORKEVENTS network_events;
-        int r = WSAEnumNetworkEvents(_fd, _event, &network_events);
-        if (r != 0) {
-            continue;
-        }
+void TcpClient::CloseSocket() {
+    SOCKET fd;
+    _s_mtx.Lock();
+    _r_mtx.Lock();
+    fd = _fd;
+    _fd = INVALID_SOCKET;
+    _r_mtx.Unlock();
+    _s_mtx.Unlock();
+    if (fd != INVALID_SOCKET) {
+        raptor_set_socket_shutdown(fd);
+    }
+}
 
-        int error = 0;
-        if (network_events.lNetworkEvents & FD_CONNECT) {
-            error = network_events.iErrorCode[FD_CONNECT_BIT];
-            this->OnConnectEvent(error);
-        }
-        if (network_events.lNetworkEvents & FD_CLOSE) {
-            error = network_events.iErrorCode[FD_CLOSE_BIT];
-            this->OnCloseEvent(error);
-        }
-        if (network_events.lNetworkEvents & FD_READ) {
-            error = network_events.iErrorCode[FD_READ_BIT];
-            this->OnReadEvent(error);
-        }
-        if (network_events.lNetworkEvents & FD_WRITE) {
-            error = network_events.iErrorCode[FD_WRITE_BIT];
-            this->OnSendEvent(error);
-        }
+void TcpClient::WaitForOperations() {
+    while (_pending.Load(MemoryOrder::ACQUIRE) > 0) {
+        Sleep(1);
     }
 }
 
-void TcpClient::OnConnectEvent(int err) {
-    if (err != 0) {
+// The last thing a completion does, the client may be gone right after.
+void TcpClient::OperationDone() {
+    t_handling = nullptr;
+    _pending.FetchSub(1, MemoryOrder::ACQ_REL);
+}
+
+void TcpClient::CloseOnError() {
+    if (_connecting.Exchange(false, MemoryOrder::ACQ_REL)) {
+        CloseSocket();
         _service->OnConnectResult(false);
-        return;
+    } else if (_online.Exchange(false, MemoryOrder::ACQ_REL)) {
+        CloseSocket();
+        _service->OnClosed();
     }
+}
 
-    DWORD transfered_bytes = 0;
-    DWORD flags = 0;
-    BOOL success = WSAGetOverlappedResult(_fd, &_conncet_overlapped, &transfered_bytes, FALSE, &flags);
-    if (!success || !AsyncRecv()) {
-
-        // cleanup
-        Shutdown();
+void TcpClient::OnConnectCompleted() {
+    t_handling = this;
+    bool success = false;
+    _r_mtx.Lock();
+    if (_fd != INVALID_SOCKET) {
+        success = (setsockopt(_fd, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0) == 0);
+    }
+    _r_mtx.Unlock();
 
-        _service->OnConnectResult(false);
-    } else {
+    if (!success) {
+        CloseOnError();
+    } else if (_connecting.Exchange(false, MemoryOrder::ACQ_REL)) {
+        _online.Store(true);
         _service->OnConnectResult(true);
+
+        _r_mtx.Lock();
+        success = AsyncRecv();
+        _r_mtx.Unlock();
+        if (!success) {
+            CloseOnError();
+        }
     }
+    OperationDone();
 }
 
-void TcpClient::OnCloseEvent(int) {
-    // cleanup
-    Shutdown();
-
-    _service->OnClosed();
+void TcpClient::OnErrorCompleted() {
+    t_handling = this;
+    CloseOnError();
+    OperationDone();
 }
 
-bool TcpClient::DoRecv() {
-    DWORD transfered_bytes = 0;
-    DWORD flags = 0;
-    if (!WSAGetOverlappedResult(_fd, &_recv_overlapped, &transfered_bytes, FALSE, &flags)) {
-        return false;
+void TcpClient::OnRecvCompleted(size_t transferred_bytes) {
+    t_handling = this;
+    if (!_shutdown && !DoRecv(transferred_bytes)) {
+        CloseOnError();
     }
+    OperationDone();
+}
 
-    if (transfered_bytes == 0) {
-        return false;
+void TcpClient::OnSendCompleted(size_t transferred_bytes) {
+    t_handling = this;
+    bool success = true;
+    {
+        AutoMutex g(&_s_mtx);
+        _send_pending = false;
+        _snd_buffer.MoveHeader(transferred_bytes);
+        if (!_snd_buffer.Empty()) {
+            success = AsyncSend();
+        }
     }
+    if (!success) {
+        CloseOnError();
+    }
+    OperationDone();
+}
 
-    AutoMutex g(&_r_mtx);
+bool TcpClient::DoRecv(size_t transferred_bytes) {
     size_t node_size = _tmp_buffer[0].size();
-    size_t count = transfered_bytes / node_size;
+    size_t count = transferred_bytes / node_size;
     size_t i = 0;
 
     for (; i < DEFAULT_TEMP_SLICE_COUNT && i < count; i++) {
-        _rcv_buffer.AddSlice(_tmp_buffer[i]);
+        _rcv_buffer.AddSlice(std::move(_tmp_buffer[i]));
         _tmp_buffer[i] = MakeSliceByDefaultSize();
-        transfered_bytes -= node_size;
+        transferred_bytes -= node_size;
     }
 
-    if (transfered_bytes > 0) {
-        Slice s(_tmp_buffer[i].Buffer(), transfered_bytes);
-        _rcv_buffer.AddSlice(s);
+    if (transferred_bytes > 0) {
+        Slice s(_tmp_buffer[i].Buffer(), transferred_bytes);
+        _rcv_buffer.AddSlice(std::move(s));
     }
 
+    // no lock is held by the callbacks, they may Send or Shutdown
     if (ParsingProtocol() == -1) {
         return false;
     }
+    AutoMutex g(&_r_mtx);
     return AsyncRecv();
 }
 
-void TcpClient::OnReadEvent(int err) {
-    if (err != 0) {
-        OnCloseEvent(err);
-        return;
-    }
-
-    if (!DoRecv()) {
-        OnCloseEvent(err);
-    }
-}
-
-bool TcpClient::DoSend() {
-    DWORD transfered_bytes = 0;
-    DWORD flags = 0;
-
-    _send_pending = false;
-
-    if (!WSAGetOverlappedResult(_fd, &_send_overlapped, &transfered_bytes, FALSE, &flags)) {
-        return false;
-    }
-
-    if (transfered_bytes == 0) {
-        return false;
-    }
-
-    AutoMutex g(&_s_mtx);
-    _snd_buffer.MoveHeader((size_t)transfered_bytes);
-    if (!_snd_buffer.Empty()) {
-        return AsyncSend();
-    }
-    return true;
-}
-
-void TcpClient::OnSendEvent(int err) {
-    if (err != 0) {
-        OnCloseEvent(err);
-        return;
-    }
-
-    if (!DoSend()) {
-        OnCloseEvent(err);
-    }
-}
-
 constexpr size_t MAX_PACKAGE_SIZE = 0xffff;
 constexpr size_t MAX_WSABUF_COUNT = 16;
 
@@ -340,6 +444,9 @@ bool TcpClient::AsyncSend() {
     if (_snd_buffer.Empty() || _send_pending) {
         return true;
     }
+    if (_fd == INVALID_SOCKET) {
+        return false;
+    }
 
     WSABUF wsa_snd_buf[MAX_WSABUF_COUNT];
     size_t prepare_send_length = 0;
@@ -359,13 +466,18 @@ bool TcpClient::AsyncSend() {
         wsa_buf_count++;
     }
 
+    memset(&_send_overlapped.overlapped, 0, sizeof(OVERLAPPED));
+    _send_overlapped.event = IocpEventType::kSendEvent;
+    _pending.FetchAdd(1, MemoryOrder::ACQ_REL);
+
     // https://docs.microsoft.com/en-us/windows/win32/api/winsock2/nf-winsock2-wsasend
-    int ret = WSASend(_fd, wsa_snd_buf, wsa_buf_count, NULL, 0, &_send_overlapped, NULL);
+    int ret = WSASend(_fd, wsa_snd_buf, wsa_buf_count, NULL, 0, &_send_overlapped.overlapped, NULL);
 
     if (ret == SOCKET_ERROR) {
         int error = WSAGetLastError();
         if (error != WSA_IO_PENDING) {
             _send_pending = false;
+            _pending.FetchSub(1, MemoryOrder::ACQ_REL);
             return false;
         }
     }
@@ -376,69 +488,54 @@ bool TcpClient::AsyncRecv() {
     WSABUF wsa_rcv_buf[DEFAULT_TEMP_SLICE_COUNT];
     DWORD dwFlag = 0;
 
+    if (_fd == INVALID_SOCKET) {
+        return false;
+    }
+
     for (size_t i = 0; i < DEFAULT_TEMP_SLICE_COUNT; i++) {
         wsa_rcv_buf[i].buf = reinterpret_cast<char*>(_tmp_buffer[i].Buffer());
         wsa_rcv_buf[i].len = static_cast<ULONG>(_tmp_buffer[i].Length());
     }
 
+    memset(&_recv_overlapped.overlapped, 0, sizeof(OVERLAPPED));
+    _recv_overlapped.event = IocpEventType::kRecvEvent;
+    _pending.FetchAdd(1, MemoryOrder::ACQ_REL);
+
     // https://docs.microsoft.com/en-us/windows/win32/api/winsock2/nf-winsock2-wsarecv
-    int ret = WSARecv(_fd, wsa_rcv_buf, DEFAULT_TEMP_SLICE_COUNT, NULL, &dwFlag, &_recv_overlapped, NULL);
+    int ret = WSARecv(_fd, wsa_rcv_buf, DEFAULT_TEMP_SLICE_COUNT, NULL, &dwFlag, &_recv_overlapped.overlapped, NULL);
 
     if (ret == SOCKET_ERROR) {
         int error = WSAGetLastError();
         if (error != WSA_IO_PENDING) {
+            _pending.FetchSub(1, MemoryOrder::ACQ_REL);
             return false;
         }
     }
     return true;
 }
 
-bool TcpClient::ReadSliceFromRecvBuffer(size_t read_size, Slice& s) {
-    size_t cache_size = _rcv_buffer.GetBufferLength();
-    if (read_size >= cache_size) {
-        s = _rcv_buffer.Merge();
-        return true;
-    }
-    s = _rcv_buffer.GetHeader(read_size);
-    return false;
-}
-
 int TcpClient::ParsingProtocol() {
     size_t cache_size = _rcv_buffer.GetBufferLength();
-    size_t header_size = _proto->GetMaxHeaderSize();
     int package_counter = 0;
 
     while (cache_size > 0) {
-        size_t read_size = header_size;
-        int pack_len = 0;
-        Slice package;
-        do {
-            bool reach_tail = ReadSliceFromRecvBuffer(read_size, package);
-            pack_len = _proto->CheckPackageLength(package.begin(), package.size());
-            if (pack_len < 0) {
-                log_error("tcp client: internal protocol error(pack_len = %d)", pack_len);
-                return -1;
-            }
-
-            // equal 0 means we need more data
-            if (pack_len == 0) {
-                if (reach_tail) {
-                    goto done;
-                }
-                read_size *= 2;
-                continue;
-            }
-
-            // We got the length of a whole packet
-            if (cache_size >= (size_t)pack_len) {
-                break;
-            }
+        int pack_len = _checker.Check(_rcv_buffer);
+        if (pack_len < 0) {
+            log_error("tcp client: internal protocol error(pack_len = %d)", pack_len);
+            return -1;
+        }
+
+        // equal 0 means we need more data
+        if (pack_len == 0) {
             goto done;
-        } while (false);
+        }
 
-        if (package.size() < static_cast<size_t>(pack_len)) {
-            package = _rcv_buffer.GetHeader(pack_len);
+        // We got the length of a whole packet
+        if (cache_size < (size_t)pack_len) {
+            goto done;
         }
+
+        Slice package = _rcv_buffer.GetHeader(pack_len);
         _service->OnMessageReceived(package.begin(), pack_len);
         _rcv_buffer.MoveHeader(pack_len);
 
@@ -19,19 +19,32 @@
 #ifndef __RAPTOR_CORE_WINDOWS_TCP_CLIENT__
 #define __RAPTOR_CORE_WINDOWS_TCP_CLIENT__
 
+#include "core/package_checker.h"
 #include "core/resolve_address.h"
 #include "core/slice/slice.h"
 #include "core/slice/slice_buffer.h"
 #include "core/sockaddr.h"
+#include "core/windows/iocp.h"
 
+#include "util/atomic.h"
 #include "util/status.h"
 #include "util/sync.h"
-#include "util/thread.h"
 
 #include "raptor/service.h"
 #include "raptor/protocol.h"
 
 namespace raptor{
+class ClientIocp;
+
+/*
+    The completions of every TcpClient of the process are handled by
+    one shared pool of IOCP threads, see ClientIocp. The client is the
+    completion key of its socket, so it must not go away while one of
+    its operations is outstanding: Shutdown closes the socket and waits
+    for the cancelled operations, unless it is called from a callback
+    of the client itself, then the destructor or the next Init waits.
+    A client must not be destroyed from its own callbacks.
+*/
 class TcpClient final {
 public:
     explicit TcpClient(IClientReceiver* service);
@@ -40,55 +53,70 @@ public:
     raptor_error Init();
     raptor_error Connect(const char* addr, size_t timeout_ms);
     bool Send(const void* buff, size_t len);
+    bool SendV(const raptor_iovec* iov, size_t count);
+    bool SendZeroCopy(const void* ptr, size_t len,
+        raptor_buffer_release_callback release, void* ctx);
     void SetProtocol(IProtocol* proto);
     void Shutdown();
     bool IsOnline() const;
+    // not supported, always 0 and false
+    uint64_t ScheduleTimer(uint32_t delay_ms, raptor_timer_callback cb, void* ctx);
+    bool CancelTimer(uint64_t timer_id);
 
 private:
-    void WorkThread(void* ptr);
+    friend class ClientIocp;
+
     raptor_error InternalConnect(const raptor_resolved_address* addr);
     raptor_error GetConnectExIfNecessary(SOCKET s);
 
-    // network event
-    void OnConnectEvent(int err);
-    void OnCloseEvent(int err);
-    void OnReadEvent(int err);
-    void OnSendEvent(int err);
+    // completions, called by the pool threads
+    void OnConnectCompleted();
+    void OnErrorCompleted();
+    void OnRecvCompleted(size_t transferred_bytes);
+    void OnSendCompleted(size_t transferred_bytes);
+    void OperationDone();
 
+    void CloseOnError();
+    void CloseSocket();
+    void WaitForOperations();
+
+    // requires _s_mtx
     bool AsyncSend();
+    // requires _r_mtx
     bool AsyncRecv();
 
-    bool DoSend();
-    bool DoRecv();
+    bool DoRecv(size_t transferred_bytes);
 
     // if success return the number of parsed packets
     // otherwise return -1 (protocol error)
     int  ParsingProtocol();
 
-    // return true if reach recv buffer tail.
-    bool ReadSliceFromRecvBuffer(size_t read_size, Slice& s);
-
 private:
     enum { DEFAULT_TEMP_SLICE_COUNT = 2};
     IClientReceiver *_service;
     IProtocol* _proto;
+    PackageChecker _checker;
     bool _send_pending;
     bool _shutdown;
     LPFN_CONNECTEX _connectex;
+    ClientIocp* _iocp;
 
+    // guarded by both _s_mtx and _r_mtx, either one is enough to read
     SOCKET _fd;
-    WSAEVENT _event;
-
-    Thread _thd;
+    AtomicBool _connecting;
+    AtomicBool _online;
+    // overlapped operations whose completion is not handled yet
+    AtomicInt32 _pending;
 
-    OVERLAPPED _conncet_overlapped;
-    OVERLAPPED _send_overlapped;
-    OVERLAPPED _recv_overlapped;
+    OverLappedEx _connect_overlapped;
+    OverLappedEx _send_overlapped;
+    OverLappedEx _recv_overlapped;
 
     Mutex _s_mtx;
     Mutex _r_mtx;
 
     SliceBuffer _snd_buffer;
+    // only touched by the completion of the single outstanding recv
     SliceBuffer _rcv_buffer;
 
     Slice _tmp_buffer[DEFAULT_TEMP_SLICE_COUNT];
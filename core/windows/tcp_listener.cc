@@ -27,31 +27,48 @@
 
 namespace raptor {
 
+namespace {
+constexpr size_t DEFAULT_PENDING_ACCEPTS = 16;
+constexpr DWORD ACCEPT_ADDRESS_LENGTH = sizeof(raptor_sockaddr_in6) + 16;
+}  // namespace
+
+// One outstanding AcceptEx. The completion packet carries the
+// address of 'overlapped', so it must stay the first member.
+struct AcceptContext {
+    OVERLAPPED overlapped;
+    ListenerObject* listener;
+    SOCKET new_socket;
+    uint8_t addr_buffer[ACCEPT_ADDRESS_LENGTH * 2];
+    AcceptContext() {
+        memset(&overlapped, 0, sizeof(overlapped));
+        listener = nullptr;
+        new_socket = INVALID_SOCKET;
+        memset(addr_buffer, 0, sizeof(addr_buffer));
+    }
+    ~AcceptContext() {
+        if (new_socket != INVALID_SOCKET) {
+            closesocket(new_socket);
+        }
+    }
+};
+
 struct ListenerObject {
     list_entry entry;
     SOCKET listen_fd;
-    SOCKET new_socket;
     int port;
     raptor_dualstack_mode mode;
-    uint8_t addr_buffer[(sizeof(raptor_sockaddr_in6) + 16) * 2];
     raptor_resolved_address addr;
-    OVERLAPPED overlapped;
+    std::unique_ptr<AcceptContext[]> accepts;
     ListenerObject() {
         RAPTOR_LIST_ENTRY_INIT(&entry);
         listen_fd = INVALID_SOCKET;
-        new_socket = INVALID_SOCKET;
         port = 0;
-        memset(addr_buffer, 0, sizeof(addr_buffer));
         memset(&addr, 0, sizeof(addr));
-        memset(&overlapped, 0, sizeof(overlapped));
     }
     ~ListenerObject() {
         if (listen_fd != INVALID_SOCKET) {
             closesocket(listen_fd);
         }
-        if (new_socket != INVALID_SOCKET) {
-            closesocket(new_socket);
-        }
     }
 };
 
@@ -64,6 +81,9 @@ TcpListener::TcpListener(internal::IAcceptor* service)
     _AcceptEx = NULL;
     _GetAcceptExSockAddrs = nullptr;
     _max_threads = 0;
+    _pending_accepts = 0;
+    _socket_flags = RAPTOR_WSA_SOCKET_FLAGS;
+    memset(&_profile, 0, sizeof(_profile));
 }
 
 TcpListener::~TcpListener() {
@@ -73,9 +93,16 @@ TcpListener::~TcpListener() {
     RaptorMutexDestroy(&_mutex);
 }
 
-raptor_error TcpListener::Init(int max_threads) {
+raptor_error TcpListener::Init(int max_threads, size_t pending_accepts, bool registered_io,
+    const raptor_socket_profile_t* profile) {
     if (!_shutdown) return RAPTOR_ERROR_FROM_STATIC_STRING("tcp listener has been initialized");
 
+    if (profile) {
+        _profile = *profile;
+    } else {
+        memset(&_profile, 0, sizeof(_profile));
+    }
+
     if (max_threads < 1) {
         max_threads = 1;
     }
@@ -87,6 +114,11 @@ raptor_error TcpListener::Init(int max_threads) {
 
     _shutdown = false;
     _max_threads = max_threads;
+    _pending_accepts = (pending_accepts > 0) ? pending_accepts : DEFAULT_PENDING_ACCEPTS;
+    _socket_flags = RAPTOR_WSA_SOCKET_FLAGS;
+    if (registered_io) {
+        _socket_flags |= WSA_FLAG_REGISTERED_IO;
+    }
     _threads = new Thread[_max_threads];
 
     for (int i = 0; i < _max_threads; i++) {
@@ -108,7 +140,20 @@ bool TcpListener::Start() {
 void TcpListener::Shutdown() {
     if (!_shutdown) {
         _shutdown = true;
-        _iocp.post(NULL, &_exit);
+
+        // closing the listening sockets cancels their AcceptEx calls
+        RaptorMutexLock(&_mutex);
+        for (list_entry* entry = _head.next; entry != &_head; entry = entry->next) {
+            auto obj = reinterpret_cast<ListenerObject*>(entry);
+            closesocket(obj->listen_fd);
+            obj->listen_fd = INVALID_SOCKET;
+        }
+        RaptorMutexUnlock(&_mutex);
+
+        // every thread leaves after dequeuing one exit packet
+        for (int i = 0; i < _max_threads; i++) {
+            _iocp.post(NULL, &_exit);
+        }
         for (int i = 0; i < _max_threads; i++) {
             _threads[i].Join();
         }
@@ -149,7 +194,7 @@ raptor_error TcpListener::AddListeningPort(const raptor_resolved_address* addr)
     }
 
     int port = 0;
-    e = raptor_tcp_server_prepare_socket(listen_fd, addr, &port, 1);
+    e = raptor_tcp_server_prepare_socket(listen_fd, addr, &port, 1, &_profile);
     if (e != RAPTOR_ERROR_NONE) {
         log_error("Failed to configure socket: %s", e->ToString().c_str());
         return e;
@@ -161,14 +206,20 @@ raptor_error TcpListener::AddListeningPort(const raptor_resolved_address* addr)
     node->port = port;
     node->mode = mode;
     node->addr = *addr;
+    node->accepts.reset(new AcceptContext[_pending_accepts]);
     if (!_iocp.add(node->listen_fd, node.get())) {
         RaptorMutexUnlock(&_mutex);
         return RAPTOR_ERROR_FROM_STATIC_STRING("Failed to bind iocp");
     }
-    e = StartAcceptEx(node.get());
-    if(e != RAPTOR_ERROR_NONE) {
-        RaptorMutexUnlock(&_mutex);
-        return e;
+    // a burst of connections is accepted without waiting
+    // for each AcceptEx to be posted again
+    for (size_t i = 0; i < _pending_accepts; i++) {
+        node->accepts[i].listener = node.get();
+        e = StartAcceptEx(&node->accepts[i]);
+        if (e != RAPTOR_ERROR_NONE) {
+            RaptorMutexUnlock(&_mutex);
+            return e;
+        }
     }
 
     raptor_list_push_back(&_head, &node->entry);
@@ -227,41 +278,55 @@ void TcpListener::WorkThread(void*) {
         bool ret = _iocp.polling(
             &NumberOfBytesTransferred, (PULONG_PTR)&CompletionKey, &lpOverlapped, INFINITE);
 
-        if (!ret) {
+        if (lpOverlapped == &_exit) {  // shutdown
+            break;
+        }
+        if (lpOverlapped == NULL || _shutdown) {
             continue;
         }
 
-        if(lpOverlapped == &_exit) {  // shutdown
-            break;
+        AcceptContext* ctx = reinterpret_cast<AcceptContext*>(lpOverlapped);
+        if (ret) {
+            // lets getpeername and shutdown work on the accepted socket
+            setsockopt(ctx->new_socket, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT,
+                (const char*)&CompletionKey->listen_fd, sizeof(CompletionKey->listen_fd));
+            // a failed option leaves the connection usable
+            raptor_error e = raptor_apply_socket_profile(ctx->new_socket, &_profile);
+            if (e != RAPTOR_ERROR_NONE) {
+                log_error_ratelimited(1000, "Failed to apply socket profile: %s", e->ToString().c_str());
+            }
+
+            raptor_resolved_address client;
+            memset(&client, 0, sizeof(client));
+            ParsingNewConnectionAddress(ctx, &client);
+
+            _service->OnNewConnection(ctx->new_socket, CompletionKey->port, &client);
+        } else {
+            // the peer reset the connection before it was accepted
+            closesocket(ctx->new_socket);
         }
 
-        raptor_resolved_address client;
-        memset(&client, 0, sizeof(client));
-        ParsingNewConnectionAddress(CompletionKey, &client);
-
-        _service->OnNewConnection(CompletionKey->new_socket, CompletionKey->port, &client);
-
-        CompletionKey->new_socket = INVALID_SOCKET;
-        raptor_error e = StartAcceptEx(CompletionKey);
+        ctx->new_socket = INVALID_SOCKET;
+        raptor_error e = StartAcceptEx(ctx);
         if(e != RAPTOR_ERROR_NONE){
-            log_error("prepare next accept fd error: %s", e->ToString().c_str());
-            break;
+            // the other AcceptEx calls of the port keep accepting
+            log_error_ratelimited(1000, "prepare next accept fd error: %s", e->ToString().c_str());
         }
     }
 }
 
-raptor_error TcpListener::StartAcceptEx(struct ListenerObject* sp) {
+raptor_error TcpListener::StartAcceptEx(AcceptContext* ctx) {
     BOOL success = false;
-    DWORD addrlen = sizeof(raptor_sockaddr_in6) + 16;
     DWORD bytes_received = 0;
     raptor_error error = RAPTOR_ERROR_NONE;
+    ListenerObject* sp = ctx->listener;
     SOCKET sock;
 
     sock = WSASocket(
         ((raptor_sockaddr*)sp->addr.addr)->sa_family,
         SOCK_STREAM,
         IPPROTO_TCP, NULL, 0,
-        RAPTOR_WSA_SOCKET_FLAGS);
+        _socket_flags);
 
     if (sock == INVALID_SOCKET) {
         error = RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "WSASocket");
@@ -272,9 +337,10 @@ raptor_error TcpListener::StartAcceptEx(struct ListenerObject* sp) {
     if (error != RAPTOR_ERROR_NONE) goto failure;
 
     /* Start the "accept" asynchronously. */
-    success = _AcceptEx(sp->listen_fd, sock, sp->addr_buffer, 0,
-                            addrlen, addrlen, &bytes_received,
-                            &sp->overlapped);
+    memset(&ctx->overlapped, 0, sizeof(ctx->overlapped));
+    success = _AcceptEx(sp->listen_fd, sock, ctx->addr_buffer, 0,
+                            ACCEPT_ADDRESS_LENGTH, ACCEPT_ADDRESS_LENGTH, &bytes_received,
+                            &ctx->overlapped);
 
     /* It is possible to get an accept immediately without delay. However, we
         will still get an IOCP notification for it. So let's just ignore it. */
@@ -287,7 +353,7 @@ raptor_error TcpListener::StartAcceptEx(struct ListenerObject* sp) {
     }
 
     // We're ready to do the accept.
-    sp->new_socket = sock;
+    ctx->new_socket = sock;
     return RAPTOR_ERROR_NONE;
 
 failure:
@@ -298,18 +364,18 @@ failure:
 }
 
 void TcpListener::ParsingNewConnectionAddress(
-    const ListenerObject* sp, raptor_resolved_address* client) {
+    const AcceptContext* ctx, raptor_resolved_address* client) {
 
     raptor_sockaddr* local = NULL;
     raptor_sockaddr* remote = NULL;
 
-    int local_addr_len = sizeof(raptor_sockaddr_in6) + 16;
-    int remote_addr_len = sizeof(raptor_sockaddr_in6) + 16;
+    int local_addr_len = ACCEPT_ADDRESS_LENGTH;
+    int remote_addr_len = ACCEPT_ADDRESS_LENGTH;
 
     _GetAcceptExSockAddrs(
-        (void*)sp->addr_buffer, 0,
-        sizeof(raptor_sockaddr_in6) + 16,
-        sizeof(raptor_sockaddr_in6) + 16,
+        (void*)ctx->addr_buffer, 0,
+        ACCEPT_ADDRESS_LENGTH,
+        ACCEPT_ADDRESS_LENGTH,
         &local, &local_addr_len,
         &remote, &remote_addr_len);
 
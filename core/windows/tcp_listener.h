@@ -29,22 +29,26 @@
 namespace raptor {
 
 struct ListenerObject;
+struct AcceptContext;
 
 class TcpListener final {
 public:
     explicit TcpListener(internal::IAcceptor* service);
     ~TcpListener();
 
-    raptor_error Init(int max_threads = 1);
+    // registered_io: accepted sockets are created for RIO
+    // profile: options of the listening and accepted sockets, copied.
+    raptor_error Init(int max_threads = 1, size_t pending_accepts = 0,
+        bool registered_io = false, const raptor_socket_profile_t* profile = nullptr);
     raptor_error AddListeningPort(const raptor_resolved_address* addr);
     bool Start();
     void Shutdown();
 
 private:
     void WorkThread(void* ptr);
-    raptor_error StartAcceptEx(struct ListenerObject*);
+    raptor_error StartAcceptEx(AcceptContext* ctx);
     void ParsingNewConnectionAddress(
-        const ListenerObject* sp, raptor_resolved_address* remote);
+        const AcceptContext* ctx, raptor_resolved_address* remote);
 
     raptor_error GetExtensionFunction(SOCKET fd);
 
@@ -58,6 +62,9 @@ private:
     LPFN_ACCEPTEX _AcceptEx;
     LPFN_GETACCEPTEXSOCKADDRS _GetAcceptExSockAddrs;
     int _max_threads;
+    size_t _pending_accepts;
+    DWORD _socket_flags;
+    raptor_socket_profile_t _profile;
 };
 
 } // namespace raptor
@@ -17,10 +17,13 @@
  */
 
 #include "core/windows/tcp_server.h"
+#include <string.h>
+#include "core/iomgr.h"
 #include "core/windows/tcp_listener.h"
 #include "util/alloc.h"
 #include "util/cpu.h"
 #include "util/log.h"
+#include "util/trace.h"
 #include "core/windows/socket_setting.h"
 
 namespace raptor {
@@ -37,11 +40,26 @@ struct TcpMessageNode {
     Slice slice;
 };
 
+inline TcpMessageNode* NewMessageNode() {
+    AccountAlloc(AllocTag::kMessage, sizeof(TcpMessageNode));
+    IomgrAddObject(IomgrType::kMessage);
+    return new TcpMessageNode;
+}
+
+inline void DeleteMessageNode(TcpMessageNode* msg) {
+    AccountFree(AllocTag::kMessage, sizeof(TcpMessageNode));
+    IomgrRemoveObject(IomgrType::kMessage);
+    delete msg;
+}
+
 constexpr uint32_t InvalidIndex = static_cast<uint32_t>(-1);
+// connections closed by one timeout check, the rest wait for the next
+constexpr size_t MAX_TIMEOUT_BATCH = 256;
 TcpServer::TcpServer(IServerReceiver *service)
     : _service(service)
     , _proto(nullptr)
-    , _shutdown(true) {
+    , _shutdown(true)
+    , _mgr_used(0) {
 }
 
 TcpServer::~TcpServer() {
@@ -54,38 +72,71 @@ raptor_error TcpServer::Init(const RaptorOptions* options){
     if (!_shutdown) {
         return RAPTOR_ERROR_FROM_STATIC_STRING("tcp server already running");
     }
+    // listener_cpus is not supported by the iocp listener yet
+    CpuAffinity reactor_cpus, dispatch_cpus;
+    auto e = reactor_cpus.Parse(options->reactor_cpus);
+    if (e == RAPTOR_ERROR_NONE) e = dispatch_cpus.Parse(options->dispatch_cpus);
+    if (e != RAPTOR_ERROR_NONE) {
+        return e;
+    }
+
     _listener = std::make_shared<TcpListener>(this);
     _rs_thread = std::make_shared<SendRecvThread>(this);
+    _rio_thread.reset();
+
+    size_t rs_threads = options->reactor_threads;
+    if (rs_threads == 0) {
+        rs_threads = raptor_get_number_of_cpu_cores();
+    }
+    if (options->registered_io) {
+        _rio_thread = std::make_shared<RioThread>(this);
+        e = _rio_thread->Init(rs_threads, reactor_cpus);
+        if (e != RAPTOR_ERROR_NONE) {
+            log_error("registered I/O is not available, using overlapped I/O (%s)",
+                e->ToString().c_str());
+            _rio_thread.reset();
+        }
+    }
 
-    auto e = _listener->Init();
+    // RIO sockets must be created with WSA_FLAG_REGISTERED_IO
+    e = _listener->Init(1, options->pending_accepts, _rio_thread != nullptr,
+        &options->socket_profile);
     if (e != RAPTOR_ERROR_NONE) {
         return e;
     }
 
-    e = _rs_thread->Init(2, 0);
-    if (e != RAPTOR_ERROR_NONE) {
-        return e;
+    if (!_rio_thread) {
+        // 0 lets the completion port run as many threads as there are cores
+        e = _rs_thread->Init(rs_threads, options->iocp_concurrency, reactor_cpus);
+        if (e != RAPTOR_ERROR_NONE) {
+            return e;
+        }
     }
 
     _shutdown = false;
     _options = *options;
+    _options.reactor_cpus = nullptr;
+    _options.listener_cpus = nullptr;
+    _options.dispatch_cpus = nullptr;
     _count.Store(0);
 
+    Thread::Options mq_options;
+    mq_options.SetAffinity(dispatch_cpus.Select(0));
     _mq_thd = Thread(
             "message_queue",
             std::bind(&TcpServer::MessageQueueThread, this, std::placeholders::_1)
-            , nullptr);
+            , nullptr, nullptr, mq_options);
 
     _conn_mtx.Lock();
-    _mgr.resize(RESERVED_CONNECTION_COUNT);
-    for (size_t i = 0; i < RESERVED_CONNECTION_COUNT; i++) {
-        _free_index_list.push_back(i);
-    }
+    _mgr.Reset(_options.max_connections);
+    _mgr_used = 0;
     _conn_mtx.Unlock();
 
-    time_t n = Now();
+    time_t n = time(0);
     _magic_number = (n >> 16) & 0xffff;
-    _last_timeout_time.Store(n);
+    // the timeout checks run on the monotonic clock
+    _last_timeout_time.Store(static_cast<time_t>(UpdateCoarseClock() / 1000));
+    _timeout_backlog.Store(false);
     return RAPTOR_ERROR_NONE;
 }
 
@@ -111,11 +162,32 @@ raptor_error TcpServer::AddListening(const char* addr){
     return ret;
 }
 
+raptor_error TcpServer::AdoptListening(int fd) {
+    (void)fd;
+    return RAPTOR_ERROR_FROM_STATIC_STRING("listener handoff is not supported on windows");
+}
+
+size_t TcpServer::GetListeningFds(int* fds, size_t count) {
+    (void)fds;
+    (void)count;
+    return 0;
+}
+
+// closing the listening sockets stops accepting, the connections stay
+void TcpServer::Drain() {
+    if (_shutdown) return;
+    _listener->Shutdown();
+}
+
 raptor_error TcpServer::Start() {
     if (!_listener->Start()) {
         return RAPTOR_ERROR_FROM_STATIC_STRING("failed to start listener");
     }
-    if (!_rs_thread->Start()) {
+    if (_rio_thread) {
+        if (!_rio_thread->Start()) {
+            return RAPTOR_ERROR_FROM_STATIC_STRING("failed to start rio_thread");
+        }
+    } else if (!_rs_thread->Start()) {
         return RAPTOR_ERROR_FROM_STATIC_STRING("failed to start rs_thread");
     }
     _mq_thd.Start();
@@ -127,19 +199,24 @@ void TcpServer::Shutdown(){
         _shutdown = true;
         _listener->Shutdown();
         _rs_thread->Shutdown();
+        if (_rio_thread) {
+            _rio_thread->Shutdown();
+        }
         _cv.Signal();
         _mq_thd.Join();
 
         _conn_mtx.Lock();
         _timeout_record_list.clear();
         _free_index_list.clear();
-        for (auto& obj : _mgr) {
+        for (uint32_t i = 0; i < _mgr_used; i++) {
+            ConnectionData& obj = _mgr.At(i);
             if (obj.first) {
                 obj.first->Shutdown(false);
                 obj.first.reset();
             }
         }
-        _mgr.clear();
+        _mgr.Reset(0);
+        _mgr_used = 0;
         _conn_mtx.Unlock();
 
         // clear message queue
@@ -149,7 +226,7 @@ void TcpServer::Shutdown(){
             auto msg = reinterpret_cast<TcpMessageNode*>(n);
             if (msg != nullptr) {
                 _count.FetchSub(1, MemoryOrder::RELAXED);
-                delete msg;
+                DeleteMessageNode(msg);
             }
         } while (!empty);
     }
@@ -159,10 +236,25 @@ void TcpServer::SetProtocol(IProtocol* proto) {
     _proto = proto;
 }
 
+raptor_error TcpServer::SetTlsProvider(ITlsProvider* tls) {
+    return tls ? RAPTOR_ERROR_FROM_STATIC_STRING("kernel TLS is not supported on windows")
+               : RAPTOR_ERROR_NONE;
+}
+
+raptor_error TcpServer::SetCodec(IMessageCodec* codec) {
+    return codec ? RAPTOR_ERROR_FROM_STATIC_STRING("message codecs are not supported on windows")
+                 : RAPTOR_ERROR_NONE;
+}
+
 bool TcpServer::Send(ConnectionId cid, const void* buf, size_t len) {
     return SendWithHeader(cid, nullptr, 0, buf, len);
 }
 
+int TcpServer::TrySendWithHeader(ConnectionId cid,
+        const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
+    return SendWithHeader(cid, hdr, hdr_len, data, data_len) ? RAPTOR_SEND_OK : RAPTOR_SEND_FAILED;
+}
+
 bool TcpServer::SendWithHeader(ConnectionId cid,
         const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
     uint32_t index = CheckConnectionId(cid);
@@ -177,6 +269,99 @@ bool TcpServer::SendWithHeader(ConnectionId cid,
     return false;
 }
 
+bool TcpServer::SendV(ConnectionId cid, const raptor_iovec* iov, size_t count) {
+    uint32_t index = CheckConnectionId(cid);
+    if (index == InvalidIndex) {
+        return false;
+    }
+
+    auto con = GetConnection(index);
+    if (con) {
+        return con->SendV(iov, count);
+    }
+    return false;
+}
+
+bool TcpServer::AllocSendBuffer(ConnectionId cid, size_t size, SendBuffer* buf) {
+    uint32_t index = CheckConnectionId(cid);
+    if (index == InvalidIndex || !GetConnection(index)) {
+        return false;
+    }
+    LendSendBuffer(size, buf);
+    return true;
+}
+
+bool TcpServer::CommitSend(ConnectionId cid, SendBuffer* buf, size_t used) {
+    Slice s = ReclaimSendBuffer(buf, used);
+    if (s.Empty()) {
+        return used == 0;
+    }
+    uint32_t index = CheckConnectionId(cid);
+    if (index == InvalidIndex) {
+        return false;
+    }
+    auto con = GetConnection(index);
+    if (con) {
+        return con->SendSlice(s);
+    }
+    return false;
+}
+
+size_t TcpServer::Broadcast(const ConnectionId* cids, size_t count,
+        const void* data, size_t len) {
+    if (count == 0 || !data || len == 0) {
+        return 0;
+    }
+
+    // one copy, every connection queues a reference to it
+    Slice payload(data, len);
+    size_t sent = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t index = CheckConnectionId(cids[i]);
+        if (index == InvalidIndex) {
+            continue;
+        }
+        auto con = GetConnection(index);
+        if (con && con->SendSlice(payload)) {
+            sent++;
+        }
+    }
+    return sent;
+}
+
+bool TcpServer::SendZeroCopy(ConnectionId cid, const void* ptr, size_t len,
+        raptor_buffer_release_callback release, void* ctx) {
+    // release runs when the last reference to s goes away
+    Slice s = MakeSliceByExternal(ptr, len, release, ctx);
+    if (!ptr || len == 0) {
+        return false;
+    }
+    uint32_t index = CheckConnectionId(cid);
+    if (index == InvalidIndex) {
+        return false;
+    }
+    auto con = GetConnection(index);
+    if (con) {
+        return con->SendSlice(s);
+    }
+    return false;
+}
+
+bool TcpServer::SendFile(ConnectionId cid, raptor_file_t file, uint64_t offset,
+        uint64_t length, raptor_send_file_callback done, void* ctx) {
+    uint32_t index = CheckConnectionId(cid);
+    if (length > 0 && index != InvalidIndex) {
+        auto con = GetConnection(index);
+        if (con && con->SendFile(file, offset, length, done, ctx)) {
+            return true;
+        }
+    }
+    if (done) {
+        done(cid, 0, ctx);
+    }
+    return false;
+}
+
 bool TcpServer::CloseConnection(ConnectionId cid){
     uint32_t index = CheckConnectionId(cid);
     if (index == InvalidIndex) {
@@ -191,51 +376,120 @@ bool TcpServer::CloseConnection(ConnectionId cid){
     return true;
 }
 
+raptor_error TcpServer::Connect(const char* addr, size_t timeout_ms, ConnectionId* cid) {
+    (void)addr;
+    (void)timeout_ms;
+    if (cid) *cid = core::InvalidConnectionId;
+    return RAPTOR_ERROR_FROM_STATIC_STRING("outbound connections are not supported by the iocp engine");
+}
+
+void TcpServer::GetStats(RaptorStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->accepted = _counters.accepted.Load();
+    stats->closed = _counters.closed.Load();
+    stats->timeouts = _counters.timeouts.Load();
+    stats->bytes_received = _counters.bytes_received.Load();
+    stats->bytes_sent = _counters.bytes_sent.Load();
+    stats->messages_received = _counters.messages_received.Load();
+    stats->dispatch_queue_depth = _count.Load();
+    // one packet per wakeup with GetQueuedCompletionStatus
+    size_t threads = _rs_thread ? _rs_thread->ThreadCount() : 0;
+    for (size_t i = 0; i < threads; i++) {
+        uint64_t completions = _rs_thread->ThreadStats(i).completions.Load();
+        stats->epoll_wakeups += completions;
+        stats->epoll_events += completions;
+    }
+    threads = _rio_thread ? _rio_thread->ThreadCount() : 0;
+    for (size_t i = 0; i < threads; i++) {
+        stats->epoll_wakeups += _rio_thread->ThreadStats(i).batches.Load();
+        stats->epoll_events += _rio_thread->ThreadStats(i).completions.Load();
+    }
+    stats->live_connection_objects = IomgrLiveObjects(IomgrType::kConnection);
+    stats->live_slices = IomgrLiveObjects(IomgrType::kSlice);
+    stats->live_message_nodes = IomgrLiveObjects(IomgrType::kMessage);
+}
+
 // internal::IAcceptor impl
 void TcpServer::OnNewConnection(
     SOCKET sock, int listen_port, const raptor_resolved_address* addr) {
+    uint32_t index = InvalidIndex;
+    std::shared_ptr<Connection> conn = AddConnection(sock, listen_port, addr, &index);
+    if (!conn) {
+        return;
+    }
+
+    // submit the first asynchronous read, outside _conn_mtx as
+    // a read that completes inline delivers messages right here
+    bool posted;
+    {
+        AutoMutex g(&conn->_rcv_mtx);
+        posted = conn->AsyncRecv(0);
+    }
+    if (!posted) {
+        conn->Shutdown(true);
+        if (GetConnection(index) == conn) {
+            DeleteConnection(index);
+        }
+    }
+}
+
+std::shared_ptr<Connection> TcpServer::AddConnection(
+    SOCKET sock, int listen_port, const raptor_resolved_address* addr, uint32_t* out_index) {
     AutoMutex g(&_conn_mtx);
 
-    if (_free_index_list.empty() && _mgr.size() >= _options.max_connections) {
+    if (_free_index_list.empty() && _mgr_used >= _mgr.Capacity()) {
         log_error("The maximum number of connections has been reached: %u", _options.max_connections);
         raptor_set_socket_shutdown(sock);
-        return;
+        return nullptr;
     }
 
-    if (_free_index_list.empty()) {
-        size_t count = _mgr.size();
-        size_t expand = ((count * 2) < _options.max_connections) ? (count * 2) : _options.max_connections;
-        _mgr.resize(expand);
-        for (size_t i = count; i < expand; i++) {
-            _mgr[i].first = nullptr;
-            _mgr[i].second = _timeout_record_list.end();
-            _free_index_list.push_back(i);
-        }
+    uint32_t index;
+    if (!_free_index_list.empty()) {
+        index = _free_index_list.front();
+        _free_index_list.pop_front();
+    } else {
+        index = _mgr_used++;
     }
 
-    uint32_t index = _free_index_list.front();
-    _free_index_list.pop_front();
-
     ConnectionId cid = core::BuildConnectionId(
         _magic_number, static_cast<uint16_t>(listen_port), index);
 
+    // not on a completion thread, which may have slept for long
+    UpdateCoarseClock();
     time_t deadline_second = Now() + _options.connection_timeout;
 
     std::shared_ptr<Connection> conn = std::make_shared<Connection>(this);
     conn->Init(cid, sock, addr);
     conn->SetProtocol(_proto);
+    conn->SetCounters(&_counters);
+    conn->SetRecvBudget(_options.recv_budget);
 
-    // associate with iocp
-    _rs_thread->Add(sock, (void*)cid);
+    bool ready;
+    if (_rio_thread) {
+        ready = conn->InitRio(_rio_thread.get());
+    } else {
+        // associate with iocp
+        ready = _rs_thread->Add(sock, (void*)cid);
+        if (ready) {
+            conn->EnableInlineCompletion(_rs_thread.get());
+            if (_options.zero_byte_recv) {
+                conn->EnableZeroByteRecv();
+            }
+        }
+    }
 
-    // submit the first asynchronous read
-    if (conn->AsyncRecv()) {
+    if (!ready) {
         conn->Shutdown(true);
         _free_index_list.push_back(index);
-    } else {
-        _mgr[index].first = conn;
-        _mgr[index].second = _timeout_record_list.insert({deadline_second, index});
-    }
+        return nullptr;
+    }
+    ConnectionData& obj = _mgr.At(index);
+    obj.first = conn;
+    obj.second = _timeout_record_list.insert({deadline_second, index});
+    ServerCounters::Add(_counters.accepted, 1);
+    RAPTOR_TRACE(connected, RAPTOR_TRACE_CONNECTED, cid, 0);
+    *out_index = index;
+    return conn;
 }
 
 // internal::IIocpReceiver impl
@@ -243,7 +497,7 @@ void TcpServer::OnErrorEvent(void* ptr, size_t ) {
     ConnectionId cid = (ConnectionId)ptr;
     uint32_t index = CheckConnectionId(cid);
     if (index == InvalidIndex) {
-        log_error("tcpserver: OnErrorEvent found invalid index, cid = %x", cid);
+        log_error_ratelimited(1000, "tcpserver: OnErrorEvent found invalid index, cid = %x", cid);
         return;
     }
 
@@ -258,71 +512,100 @@ void TcpServer::OnRecvEvent(void* ptr, size_t transferred_bytes) {
     ConnectionId cid = (ConnectionId)ptr;
     uint32_t index = CheckConnectionId(cid);
     if (index == InvalidIndex) {
-        log_error("tcpserver: OnRecvEvent found invalid index, cid = %x", cid);
+        log_error_ratelimited(1000, "tcpserver: OnRecvEvent found invalid index, cid = %x", cid);
         return;
     }
 
     auto con = GetConnection(index);
     if (!con) return;
+    RAPTOR_TRACE(recv, RAPTOR_TRACE_RECV, cid, transferred_bytes);
     if (con->OnRecvEvent(transferred_bytes)) {
         RefreshTime(index);
         return;
     }
     con->Shutdown(true);
     DeleteConnection(index);
-    log_error("tcpserver: Failed to post async recv");
+    log_error_ratelimited(1000, "tcpserver: Failed to post async recv");
 }
 
 void TcpServer::OnSendEvent(void* ptr, size_t transferred_bytes) {
     ConnectionId cid = (ConnectionId)ptr;
     uint32_t index = CheckConnectionId(cid);
     if (index == InvalidIndex) {
-        log_error("tcpserver: OnRecvEvent found invalid index, cid = %x", cid);
+        log_error_ratelimited(1000, "tcpserver: OnSendEvent found invalid index, cid = %x", cid);
         return;
     }
 
     auto con = GetConnection(index);
     if (!con) return;
+    RAPTOR_TRACE(send, RAPTOR_TRACE_SEND, cid, transferred_bytes);
     if (con->OnSendEvent(transferred_bytes)) {
         RefreshTime(index);
         return;
     }
     con->Shutdown(true);
     DeleteConnection(index);
-    log_error("tcpserver: Failed to post async send");
+    log_error_ratelimited(1000, "tcpserver: Failed to post async send");
 }
 
 void TcpServer::OnCheckingEvent(time_t current) {
 
-    // At least 3s to check once
-    if (current - _last_timeout_time.Load() < 3) {
+    // At least 3s to check once, on every wakeup while the previous
+    // check left expired connections behind
+    time_t last = _last_timeout_time.Load();
+    time_t interval = _timeout_backlog.Load(MemoryOrder::ACQUIRE) ? 0 : 3;
+    if (current - last < interval) {
+        return;
+    }
+    if (!_last_timeout_time.CompareExchangeStrong(
+            &last, current, MemoryOrder::ACQ_REL, MemoryOrder::RELAXED)) {
         return;
     }
-    _last_timeout_time.Store(current);
-
-    AutoMutex g(&_conn_mtx);
 
-    auto it = _timeout_record_list.begin();
-    while (it != _timeout_record_list.end()) {
-        if (it->first > current) {
-            break;
+    // Only the records are taken under _conn_mtx, the connections are
+    // closed outside it. A slot is released after its connection is
+    // closed, so a late completion can't find a new connection there.
+    std::vector<std::pair<uint32_t, std::shared_ptr<Connection>>> expired;
+    {
+        AutoMutex g(&_conn_mtx);
+        auto it = _timeout_record_list.begin();
+        while (it != _timeout_record_list.end() && it->first <= current
+            && expired.size() < MAX_TIMEOUT_BATCH) {
+            uint32_t index = it->second;
+            ConnectionData& obj = _mgr.At(index);
+            it = _timeout_record_list.erase(it);
+            obj.second = _timeout_record_list.end();
+            expired.emplace_back(index, obj.first);
         }
+        bool backlog = (it != _timeout_record_list.end() && it->first <= current);
+        _timeout_backlog.Store(backlog, MemoryOrder::RELEASE);
+    }
 
-        uint32_t index = it->second;
-
-        ++it;
+    for (auto& entry : expired) {
+        entry.second->Shutdown(true);
+    }
 
-        _mgr[index].first->Shutdown(true);
-        _mgr[index].first.reset();
-        _timeout_record_list.erase(_mgr[index].second);
-        _mgr[index].second = _timeout_record_list.end();
-        _free_index_list.push_back(index);
+    AutoMutex g(&_conn_mtx);
+    for (auto& entry : expired) {
+        ConnectionData* obj = _mgr.Find(entry.first);
+        // closed by an error meanwhile
+        if (!obj || obj->first != entry.second) {
+            continue;
+        }
+        obj->first.reset();
+        if (obj->second != _timeout_record_list.end()) {
+            _timeout_record_list.erase(obj->second);
+            obj->second = _timeout_record_list.end();
+        }
+        _free_index_list.push_back(entry.first);
+        ServerCounters::Add(_counters.closed, 1);
+        ServerCounters::Add(_counters.timeouts, 1);
     }
 }
 
 // internal::INotificationTransfer impl
 void TcpServer::OnConnectionArrived(ConnectionId cid, const raptor_resolved_address* addr) {
-    TcpMessageNode* msg = new TcpMessageNode;
+    TcpMessageNode* msg = NewMessageNode();
     msg->cid = cid;
     msg->addr = *addr;
     msg->type = MessageType::kNewConnection;
@@ -331,10 +614,11 @@ void TcpServer::OnConnectionArrived(ConnectionId cid, const raptor_resolved_addr
     _cv.Signal();
 }
 
-void TcpServer::OnDataReceived(ConnectionId cid, const Slice* s) {
-    TcpMessageNode* msg = new TcpMessageNode;
+void TcpServer::OnDataReceived(ConnectionId cid, Slice* s) {
+    ServerCounters::Add(_counters.messages_received, 1);
+    TcpMessageNode* msg = NewMessageNode();
     msg->cid = cid;
-    msg->slice = *s;
+    msg->slice = std::move(*s);
     msg->type = MessageType::kRecvAMessage;
     _mpscq.push(&msg->node);
     _count.FetchAdd(1, MemoryOrder::ACQ_REL);
@@ -342,7 +626,7 @@ void TcpServer::OnDataReceived(ConnectionId cid, const Slice* s) {
 }
 
 void TcpServer::OnConnectionClosed(ConnectionId cid) {
-    TcpMessageNode* msg = new TcpMessageNode;
+    TcpMessageNode* msg = NewMessageNode();
     msg->cid = cid;
     msg->type = MessageType::kCloseClient;
     _mpscq.push(&msg->node);
@@ -352,23 +636,32 @@ void TcpServer::OnConnectionClosed(ConnectionId cid) {
 
 void TcpServer::DeleteConnection(uint32_t index) {
     AutoMutex g(&_conn_mtx);
-    if (!_mgr[index].first) {
+    ConnectionData* obj = _mgr.Find(index);
+    if (!obj || !obj->first) {
         return;
     }
-    _mgr[index].first.reset();
-    _timeout_record_list.erase(_mgr[index].second);
-    _mgr[index].second = _timeout_record_list.end();
+    RAPTOR_TRACE(closed, RAPTOR_TRACE_CLOSED, obj->first->_cid, 0);
+    obj->first.reset();
+    // the timeout check may have taken the record already
+    if (obj->second != _timeout_record_list.end()) {
+        _timeout_record_list.erase(obj->second);
+        obj->second = _timeout_record_list.end();
+    }
     _free_index_list.push_back(index);
+    ServerCounters::Add(_counters.closed, 1);
 }
 
 void TcpServer::RefreshTime(uint32_t index) {
     AutoMutex g(&_conn_mtx);
-    if (!_mgr[index].first) {
+    ConnectionData* obj = _mgr.Find(index);
+    if (!obj || !obj->first) {
         return;
     }
     time_t deadline_seconds = Now() + _options.connection_timeout;
-    _timeout_record_list.erase(_mgr[index].second);
-    _mgr[index].second = _timeout_record_list.insert({deadline_seconds, index});
+    if (obj->second != _timeout_record_list.end()) {
+        _timeout_record_list.erase(obj->second);
+    }
+    obj->second = _timeout_record_list.insert({deadline_seconds, index});
 }
 
 bool TcpServer::SetUserData(ConnectionId cid, void* ptr) {
@@ -399,6 +692,20 @@ bool TcpServer::GetUserData(ConnectionId cid, void** ptr) {
     return false;
 }
 
+bool TcpServer::GetSendQueueBytes(ConnectionId cid, size_t* bytes) {
+    uint32_t index = CheckConnectionId(cid);
+    if (index == InvalidIndex) {
+        return false;
+    }
+
+    auto con = GetConnection(index);
+    if (con) {
+        *bytes = con->GetSendQueueBytes();
+        return true;
+    }
+    return false;
+}
+
 bool TcpServer::SetExtendInfo(ConnectionId cid, uint64_t data) {
     uint32_t index = CheckConnectionId(cid);
     if (index == InvalidIndex) {
@@ -427,6 +734,45 @@ bool TcpServer::GetExtendInfo(ConnectionId cid, uint64_t& data) {
     return false;
 }
 
+int TcpServer::SendWithToken(ConnectionId /*cid*/, const raptor_iovec* /*iov*/,
+    size_t /*count*/, uint64_t /*token*/) {
+    return RAPTOR_SEND_FAILED;
+}
+
+bool TcpServer::SetPriority(ConnectionId /*cid*/, int /*priority*/) {
+    return false;
+}
+
+bool TcpServer::SetCodecEnabled(ConnectionId /*cid*/, bool /*enabled*/) {
+    return false;
+}
+
+// the completion threads have no timer wheel, see ITcpServer::ScheduleTimer
+uint64_t TcpServer::ScheduleTimer(ConnectionId /*cid*/, uint32_t /*delay_ms*/,
+    raptor_timer_callback /*cb*/, void* /*ctx*/) {
+    log_error_ratelimited(1000, "tcpserver: ScheduleTimer is not supported on windows");
+    return 0;
+}
+
+bool TcpServer::CancelTimer(uint64_t /*timer_id*/) {
+    log_error_ratelimited(1000, "tcpserver: CancelTimer is not supported on windows");
+    return false;
+}
+
+bool TcpServer::GetConnectionInfo(ConnectionId cid, RaptorConnInfo* info) {
+    uint32_t index = CheckConnectionId(cid);
+    if (index == InvalidIndex) {
+        return false;
+    }
+
+    auto con = GetConnection(index);
+    if (con) {
+        con->GetInfo(info);
+        return true;
+    }
+    return false;
+}
+
 uint32_t TcpServer::CheckConnectionId(ConnectionId cid) const {
     uint32_t failure = InvalidIndex;
     if (cid == core::InvalidConnectionId) {
@@ -461,7 +807,7 @@ void TcpServer::MessageQueueThread(void*) {
         if (msg != nullptr) {
             _count.FetchSub(1, MemoryOrder::RELAXED);
             this->Dispatch(msg);
-            delete msg;
+            DeleteMessageNode(msg);
         }
         RaptorMutexUnlock(_mutex);
     }
@@ -472,9 +818,11 @@ void TcpServer::Dispatch(struct TcpMessageNode* msg) {
     case MessageType::kNewConnection:
         _service->OnConnected(msg->cid);
         break;
-    case MessageType::kRecvAMessage:
-        _service->OnMessageReceived(msg->cid, msg->slice.begin(), msg->slice.size());
+    case MessageType::kRecvAMessage: {
+        Message m = { msg->cid, msg->slice.begin(), msg->slice.size(), GetSliceHandle(msg->slice) };
+        _service->OnMessage(&m);
         break;
+    }
     case MessageType::kCloseClient:
         _service->OnClosed(msg->cid);
         break;
@@ -486,8 +834,8 @@ void TcpServer::Dispatch(struct TcpMessageNode* msg) {
 
 std::shared_ptr<Connection> TcpServer::GetConnection(uint32_t index) {
     AutoMutex g(&_conn_mtx);
-    auto obj = _mgr[index].first;
-    return obj;
+    ConnectionData* obj = _mgr.Find(index);
+    return obj ? obj->first : nullptr;
 }
 
 } // namespace raptor
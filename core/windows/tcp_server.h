@@ -32,12 +32,15 @@
 #include "core/resolve_address.h"
 #include "core/windows/connection.h"
 #include "core/windows/iocp_thread.h"
+#include "core/windows/rio_thread.h"
 #include "util/atomic.h"
+#include "util/segmented_array.h"
 #include "util/sync.h"
 #include "util/time.h"
 #include "util/status.h"
 #include "raptor/protocol.h"
 #include "raptor/service.h"
+#include "core/server_stats.h"
 
 namespace raptor {
 class IProtocol;
@@ -52,14 +55,43 @@ public:
 
     raptor_error Init(const RaptorOptions* options);
     raptor_error AddListening(const char* addr);
+    // listener handoff, see ITcpServer::AdoptListening
+    raptor_error AdoptListening(int fd);
+    size_t GetListeningFds(int* fds, size_t count);
+    void Drain();
     raptor_error Start();
     void Shutdown();
     void SetProtocol(IProtocol* proto);
+    // no kernel TLS on windows, only nullptr is accepted
+    raptor_error SetTlsProvider(ITlsProvider* tls);
+    raptor_error SetCodec(IMessageCodec* codec);
 
     bool Send(ConnectionId cid, const void* buf, size_t len);
+    bool SendV(ConnectionId cid, const raptor_iovec* iov, size_t count);
+    // completions are not tracked, always RAPTOR_SEND_FAILED
+    int SendWithToken(ConnectionId cid, const raptor_iovec* iov, size_t count, uint64_t token);
+    bool AllocSendBuffer(ConnectionId cid, size_t size, SendBuffer* buf);
+    bool CommitSend(ConnectionId cid, SendBuffer* buf, size_t used);
     bool SendWithHeader(ConnectionId cid,
         const void* hdr, size_t hdr_len, const void* data, size_t data_len);
+    // send watermarks are not supported, never returns RAPTOR_SEND_WOULD_BLOCK
+    int TrySendWithHeader(ConnectionId cid,
+        const void* hdr, size_t hdr_len, const void* data, size_t data_len);
+    // return the number of connections the payload was queued on
+    size_t Broadcast(const ConnectionId* cids, size_t count,
+        const void* data, size_t len);
+    // release is called once the buffer is no longer referenced
+    bool SendZeroCopy(ConnectionId cid, const void* ptr, size_t len,
+        raptor_buffer_release_callback release, void* ctx);
+    // done is called exactly once, also when this returns false
+    bool SendFile(ConnectionId cid, raptor_file_t file, uint64_t offset,
+        uint64_t length, raptor_send_file_callback done, void* ctx);
     bool CloseConnection(ConnectionId cid);
+    // send_queued_bytes, messages_sent, protocol_errors and the
+    // epoll counters are not collected yet
+    void GetStats(RaptorStats* stats);
+    // outbound connections are not supported yet (ConnectEx)
+    raptor_error Connect(const char* addr, size_t timeout_ms, ConnectionId* cid);
 
     // internal::IAcceptor impl
     void OnNewConnection(
@@ -74,20 +106,32 @@ public:
 
     // internal::INotificationTransfer impl
     void OnConnectionArrived(ConnectionId cid, const raptor_resolved_address* addr) override;
-    void OnDataReceived(ConnectionId cid, const Slice* s) override;
+    void OnDataReceived(ConnectionId cid, Slice* s) override;
     void OnConnectionClosed(ConnectionId cid) override;
 
     // user data
     bool SetUserData(ConnectionId cid, void* ptr);
     bool GetUserData(ConnectionId cid, void** ptr);
+    bool GetSendQueueBytes(ConnectionId cid, size_t* bytes);
     bool SetExtendInfo(ConnectionId cid, uint64_t data);
     bool GetExtendInfo(ConnectionId cid, uint64_t& data);
+    // one dispatch queue, always false
+    bool SetPriority(ConnectionId cid, int priority);
+    bool SetCodecEnabled(ConnectionId cid, bool enabled);
+    bool GetConnectionInfo(ConnectionId cid, RaptorConnInfo* info);
+    // not supported, always 0 and false
+    uint64_t ScheduleTimer(ConnectionId cid, uint32_t delay_ms,
+        raptor_timer_callback cb, void* ctx);
+    bool CancelTimer(uint64_t timer_id);
 
 private:
 
     void MessageQueueThread(void*);
     uint32_t CheckConnectionId(ConnectionId cid) const;
     void Dispatch(struct TcpMessageNode* msg);
+    // registers an accepted socket, under _conn_mtx
+    std::shared_ptr<Connection> AddConnection(SOCKET sock, int listen_port,
+        const raptor_resolved_address* addr, uint32_t* out_index);
     void DeleteConnection(uint32_t index);
     void RefreshTime(uint32_t index);
     std::shared_ptr<Connection> GetConnection(uint32_t index);
@@ -98,8 +142,6 @@ private:
     using ConnectionData =
         std::pair<std::shared_ptr<Connection>, TimeoutRecord::iterator>;
 
-    enum { RESERVED_CONNECTION_COUNT = 100 };
-
     IServerReceiver* _service;
     IProtocol* _proto;
 
@@ -111,17 +153,26 @@ private:
     Mutex _mutex;
     ConditionVariable _cv;
     AtomicUInt32 _count;
+    // a single reactor
+    ServerCounters _counters;
 
     std::shared_ptr<SendRecvThread> _rs_thread;
+    // replaces _rs_thread with registered_io
+    std::shared_ptr<RioThread> _rio_thread;
     std::shared_ptr<TcpListener> _listener;
 
     Mutex _conn_mtx;
-    std::vector<ConnectionData> _mgr;
+    // paged, growing it moves no entry
+    SegmentedArray<ConnectionData> _mgr;
+    // entries [0, _mgr_used) have been handed out at least once
+    uint32_t _mgr_used;
     // key: timeout deadline, value: index for _mgr
     TimeoutRecord _timeout_record_list;
     std::list<uint32_t> _free_index_list;
     uint16_t _magic_number;
     Atomic<time_t> _last_timeout_time;
+    // the last timeout check hit MAX_TIMEOUT_BATCH
+    AtomicBool _timeout_backlog;
 };
 } // namespace raptor
 #endif  // __RAPTOR_CORE_WINDOWS_TCP_SERVER__
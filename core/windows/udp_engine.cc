@@ -0,0 +1,233 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "core/windows/udp_engine.h"
+#include <string.h>
+
+#include "core/resolve_address.h"
+#include "core/socket_util.h"
+#include "core/windows/socket_setting.h"
+#include "util/alloc.h"
+#include "util/cpu.h"
+#include "util/log.h"
+#include "util/useful.h"
+
+#ifndef SIO_UDP_CONNRESET
+#define SIO_UDP_CONNRESET _WSAIOW(IOC_VENDOR, 12)
+#endif
+
+namespace raptor {
+
+UdpEngine::UdpEngine(IUdpReceiver* service)
+    : _service(service)
+    , _shutdown(true)
+    , _started(false)
+    , _fd(INVALID_SOCKET)
+    , _port(0) {
+    memset(&_options, 0, sizeof(_options));
+}
+
+UdpEngine::~UdpEngine() {
+    Shutdown();
+}
+
+raptor_error UdpEngine::Init(const UdpOptions* options) {
+    if (!_shutdown) return RAPTOR_ERROR_FROM_STATIC_STRING("udp engine already running");
+    if (options) {
+        _options = *options;
+    }
+    if (_options.reactor_threads == 0) {
+        _options.reactor_threads = raptor_get_number_of_cpu_cores();
+    }
+    if (_options.max_datagram_size == 0 || _options.max_datagram_size > MAX_DATAGRAM_SIZE) {
+        _options.max_datagram_size = MAX_DATAGRAM_SIZE;
+    }
+
+    _threads.clear();
+    for (size_t i = 0; i < _options.reactor_threads; i++) {
+        _threads.push_back(Thread("udp",
+            std::bind(&UdpEngine::WorkThread, this, std::placeholders::_1), nullptr));
+    }
+    _datagrams_received.Store(0);
+    _bytes_received.Store(0);
+    _datagrams_sent.Store(0);
+    _bytes_sent.Store(0);
+    _truncated.Store(0);
+    _recv_errors.Store(0);
+    _send_errors.Store(0);
+    _port = 0;
+    _shutdown = false;
+    return RAPTOR_ERROR_NONE;
+}
+
+raptor_error UdpEngine::Bind(const char* addr) {
+    if (_shutdown) return RAPTOR_ERROR_FROM_STATIC_STRING("udp engine uninitialized");
+    if (!addr) return RAPTOR_ERROR_FROM_STATIC_STRING("invalid parameters");
+    if (_fd != INVALID_SOCKET) return RAPTOR_ERROR_FROM_STATIC_STRING("udp engine already bound");
+
+    raptor_resolved_addresses* addrs = nullptr;
+    raptor_error e = raptor_blocking_resolve_address(addr, nullptr, &addrs);
+    if (e != RAPTOR_ERROR_NONE) {
+        return e;
+    }
+    raptor_resolved_address bind_addr = addrs->addrs[0];
+    raptor_resolved_addresses_destroy(addrs);
+
+    int family = raptor_sockaddr_get_family(&bind_addr);
+    _fd = WSASocket(family, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_NO_HANDLE_INHERIT);
+    if (_fd == INVALID_SOCKET) {
+        return RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "WSASocket");
+    }
+    if (family == AF_INET6) {
+        raptor_set_socket_ipv6_only(_fd, 0);
+    }
+    if (_options.socket_buffer_size > 0) {
+        int size = static_cast<int>(_options.socket_buffer_size);
+        setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char*>(&size), sizeof(size));
+        setsockopt(_fd, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&size), sizeof(size));
+    }
+    // an ICMP port unreachable would fail the next recvfrom
+    BOOL report = FALSE;
+    DWORD bytes = 0;
+    WSAIoctl(_fd, SIO_UDP_CONNRESET, &report, sizeof(report), NULL, 0, &bytes, NULL, NULL);
+    raptor_set_socket_rcv_timeout(_fd, 1000);
+
+    raptor_resolved_address local;
+    int len = sizeof(local.addr);
+    if (bind(_fd, reinterpret_cast<raptor_sockaddr*>(bind_addr.addr), bind_addr.len) == SOCKET_ERROR
+        || getsockname(_fd, reinterpret_cast<raptor_sockaddr*>(local.addr), &len) == SOCKET_ERROR) {
+        e = RAPTOR_WINDOWS_ERROR(WSAGetLastError(), "bind");
+        closesocket(_fd);
+        _fd = INVALID_SOCKET;
+        return e;
+    }
+    local.len = static_cast<uint32_t>(len);
+    _port = raptor_sockaddr_get_port(&local);
+    return RAPTOR_ERROR_NONE;
+}
+
+raptor_error UdpEngine::Start() {
+    if (_shutdown) return RAPTOR_ERROR_FROM_STATIC_STRING("udp engine uninitialized");
+    if (_fd == INVALID_SOCKET) return RAPTOR_ERROR_FROM_STATIC_STRING("udp engine not bound");
+    if (_started) return RAPTOR_ERROR_NONE;
+    _started = true;
+    for (auto& t : _threads) {
+        t.Start();
+    }
+    return RAPTOR_ERROR_NONE;
+}
+
+void UdpEngine::Shutdown() {
+    if (_shutdown) {
+        return;
+    }
+    _shutdown = true;
+    if (_fd != INVALID_SOCKET) {
+        // fails the blocked recvfrom calls
+        closesocket(_fd);
+    }
+    if (_started) {
+        for (auto& t : _threads) {
+            t.Join();
+        }
+        _started = false;
+    }
+    _threads.clear();
+    _fd = INVALID_SOCKET;
+    _port = 0;
+}
+
+void UdpEngine::WorkThread(void*) {
+    std::vector<char> buffer(_options.max_datagram_size);
+    while (!_shutdown) {
+        UdpPeer peer;
+        int len = sizeof(peer.addr);
+        int r = recvfrom(_fd, buffer.data(), static_cast<int>(buffer.size()), 0,
+            reinterpret_cast<raptor_sockaddr*>(peer.addr), &len);
+        if (r == SOCKET_ERROR) {
+            int err = WSAGetLastError();
+            if (err == WSAEMSGSIZE) {
+                _truncated.FetchAdd(1, MemoryOrder::RELAXED);
+            } else if (err != WSAETIMEDOUT && !_shutdown) {
+                _recv_errors.FetchAdd(1, MemoryOrder::RELAXED);
+                log_error_ratelimited(1000, "udp engine: recvfrom (%d)", err);
+            }
+            continue;
+        }
+        peer.len = static_cast<uint32_t>(len);
+        _datagrams_received.FetchAdd(1, MemoryOrder::RELAXED);
+        _bytes_received.FetchAdd(r, MemoryOrder::RELAXED);
+        _service->OnDatagramReceived(&peer, buffer.data(), static_cast<size_t>(r));
+    }
+}
+
+bool UdpEngine::SendOne(const UdpPeer* peer, const char* data, size_t len) {
+    int r = sendto(_fd, data, static_cast<int>(len), 0,
+        reinterpret_cast<const raptor_sockaddr*>(peer->addr), static_cast<int>(peer->len));
+    if (r == SOCKET_ERROR) {
+        _send_errors.FetchAdd(1, MemoryOrder::RELAXED);
+        return false;
+    }
+    _datagrams_sent.FetchAdd(1, MemoryOrder::RELAXED);
+    _bytes_sent.FetchAdd(len, MemoryOrder::RELAXED);
+    return true;
+}
+
+bool UdpEngine::SendTo(const UdpPeer* peer, const void* data, size_t len, size_t segment_size) {
+    if (_shutdown || _fd == INVALID_SOCKET || !peer || !data || len == 0) {
+        return false;
+    }
+    const char* ptr = static_cast<const char*>(data);
+    if (segment_size == 0 || segment_size >= len) {
+        return SendOne(peer, ptr, len);
+    }
+    for (size_t offset = 0; offset < len; offset += segment_size) {
+        if (!SendOne(peer, ptr + offset, RAPTOR_MIN(segment_size, len - offset))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t UdpEngine::SendBatch(const UdpDatagram* datagrams, size_t count) {
+    if (_shutdown || _fd == INVALID_SOCKET || !datagrams) {
+        return 0;
+    }
+    size_t sent = 0;
+    for (; sent < count; sent++) {
+        const UdpDatagram& d = datagrams[sent];
+        if (!SendOne(d.peer, static_cast<const char*>(d.data), d.len)) {
+            break;
+        }
+    }
+    return sent;
+}
+
+void UdpEngine::GetStats(UdpStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->datagrams_received = _datagrams_received.Load();
+    stats->bytes_received = _bytes_received.Load();
+    stats->datagrams_sent = _datagrams_sent.Load();
+    stats->bytes_sent = _bytes_sent.Load();
+    stats->truncated = _truncated.Load();
+    stats->recv_errors = _recv_errors.Load();
+    stats->send_errors = _send_errors.Load();
+    stats->recv_calls = stats->datagrams_received;
+}
+
+} // namespace raptor
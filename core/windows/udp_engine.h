@@ -0,0 +1,81 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_CORE_WINDOWS_UDP_ENGINE__
+#define __RAPTOR_CORE_WINDOWS_UDP_ENGINE__
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include "core/sockaddr.h"
+#include "raptor/service.h"
+#include "util/atomic.h"
+#include "util/status.h"
+#include "util/thread.h"
+
+namespace raptor {
+
+/*
+    Windows has no SO_REUSEPORT balancing, recvmmsg or segmentation
+    offload: the reactor threads share one socket and block in
+    recvfrom, one datagram per call. recv_batch, enable_gro and
+    enable_gso are ignored, a segmented SendTo is split here.
+*/
+class UdpEngine final {
+public:
+    explicit UdpEngine(IUdpReceiver* service);
+    ~UdpEngine();
+
+    raptor_error Init(const UdpOptions* options);
+    raptor_error Bind(const char* addr);
+    raptor_error Start();
+    void Shutdown();
+
+    bool SendTo(const UdpPeer* peer, const void* data, size_t len, size_t segment_size);
+    size_t SendBatch(const UdpDatagram* datagrams, size_t count);
+    int GetLocalPort() const { return _port; }
+    void GetStats(UdpStats* stats);
+
+private:
+    void WorkThread(void* ptr);
+    bool SendOne(const UdpPeer* peer, const char* data, size_t len);
+
+    enum { MAX_DATAGRAM_SIZE = 65507 };
+
+    IUdpReceiver* _service;
+    bool _shutdown;
+    bool _started;
+    UdpOptions _options;
+    SOCKET _fd;
+    int _port;
+
+    std::vector<Thread> _threads;
+
+    AtomicUInt64 _datagrams_received;
+    AtomicUInt64 _bytes_received;
+    AtomicUInt64 _datagrams_sent;
+    AtomicUInt64 _bytes_sent;
+    AtomicUInt64 _truncated;
+    AtomicUInt64 _recv_errors;
+    AtomicUInt64 _send_errors;
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_CORE_WINDOWS_UDP_ENGINE__
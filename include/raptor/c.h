@@ -52,6 +52,52 @@ RAPTOR_API void raptor_set_log_level(int level);
 // If you want to take over raptor's log output
 RAPTOR_API void raptor_set_log_callback(raptor_log_callback cb);
 
+// Write log lines from a background thread instead of the calling
+// thread, lines are dropped rather than block when the queue is full.
+// The log callback is then called on that thread. Returns 0 on success.
+RAPTOR_API int raptor_set_log_async(int enable);
+RAPTOR_API uint64_t raptor_get_log_dropped_count();
+
+// ---- tracing ----
+
+// Called at every tracepoint (RAPTOR_TRACE_*) on the thread that hits
+// it, it must be fast and must not call back into raptor. NULL removes
+// it. Returns -1 if raptor was built without RAPTOR_ENABLE_TRACING.
+RAPTOR_API int raptor_set_trace_callback(raptor_trace_callback cb);
+
+// ---- memory ----
+
+// Route raptor's internal allocations through another allocator such
+// as jemalloc, mimalloc or an arena. Call it before raptor_global_init
+// and before any other raptor function. Returns 0 on success, -1 if
+// any of the functions is null.
+RAPTOR_API int raptor_set_allocator(
+    raptor_malloc_func malloc_fn, raptor_free_func free_fn, raptor_realloc_func realloc_fn);
+
+// Pooled slice blocks come from 2MB pages instead of malloc, so that
+// many live buffers cost few TLB entries: MAP_HUGETLB, or transparent
+// huge pages when none are reserved (linux); large pages with the lock
+// pages privilege (windows). reserve_bytes are mapped now and touched
+// with prefault, the arena grows by 2MB past them. Call it before
+// starting servers and clients. Returns 0 with huge pages, 1 with the
+// fallback pages and -1 if the memory could not be mapped.
+RAPTOR_API int raptor_enable_huge_page_arena(size_t reserve_bytes, int prefault);
+
+// Allocation counters, off by default. Enabling costs a thread-local
+// add on each slice, message and connection allocation. Enable before
+// starting servers and clients, memory allocated while the counters
+// were off is not subtracted correctly when it is freed.
+RAPTOR_API void raptor_enable_alloc_stats(int enable);
+RAPTOR_API int raptor_get_alloc_stats(raptor_alloc_stats_t* stats);
+
+// ---- name resolution ----
+
+// Host names given to connect are resolved off the calling thread and
+// the result is cached, successful lookups for 30 seconds and failed
+// ones for 5 by default. 0 disables caching for that case. Changing
+// the TTL clears the cache. Returns -1 if a value is negative.
+RAPTOR_API int raptor_set_resolver_cache_ttl(int positive_seconds, int negative_seconds);
+
 // ---- server ----
 RAPTOR_API raptor_server_t*
                raptor_server_create(const raptor_options_t* options);
@@ -61,6 +107,10 @@ RAPTOR_API void
 
 RAPTOR_API int raptor_server_start(raptor_server_t* s);
 RAPTOR_API int raptor_server_listening(raptor_server_t* s, const char* address);
+// See ITcpServer::GetListeningFds, AdoptListening and Drain (linux).
+RAPTOR_API size_t raptor_server_get_listening_fds(raptor_server_t* s, int* fds, size_t count);
+RAPTOR_API int raptor_server_adopt_listening(raptor_server_t* s, int fd);
+RAPTOR_API int raptor_server_drain(raptor_server_t* s);
 RAPTOR_API int raptor_server_shutdown(raptor_server_t* s);
 RAPTOR_API int raptor_server_set_callbacks(
                                 raptor_server_t* s,
@@ -69,6 +119,19 @@ RAPTOR_API int raptor_server_set_callbacks(
                                 raptor_server_callback_connection_closed on_closed
                                 );
 
+// Optional, takes the place of on_message_received and gets several
+// messages per call, see IServerBatchReceiver.
+RAPTOR_API int raptor_server_set_batch_callback(
+                                raptor_server_t* s,
+                                raptor_server_callback_messages_received on_messages_received
+                                );
+
+// Keeps a message of on_messages_received past the callback without
+// copying it (up to 23 bytes are copied), until raptor_slice_release.
+// Thread-safe, returns 1 on success.
+RAPTOR_API int raptor_message_retain(const raptor_message_t* msg, raptor_slice_t* slice);
+RAPTOR_API void raptor_slice_release(raptor_slice_t* slice);
+
 RAPTOR_API int raptor_server_send(
                                 raptor_server_t* s,
                                 raptor_connection_t c, const void* data, size_t len);
@@ -79,6 +142,78 @@ RAPTOR_API int raptor_server_send_with_header(
                                 const void* header, size_t header_size,
                                 const void* data, size_t len);
 
+// Sends count fragments as one message, see ITcpServer::SendV.
+RAPTOR_API int raptor_server_send_v(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                const raptor_iovec* iov, size_t count);
+
+// Returns RAPTOR_SEND_*, token is reported by the send completed
+// callback, see ITcpServer::SendWithToken.
+RAPTOR_API int raptor_server_send_with_token(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                const raptor_iovec* iov, size_t count, uint64_t token);
+
+// Lends buf writable memory to encode a message in place, every
+// buffer goes back through one raptor_server_commit_send which sends
+// its first 'used' bytes without copying them (0 only releases it).
+RAPTOR_API int raptor_server_alloc_send_buffer(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                size_t size, raptor_send_buffer_t* buf);
+
+RAPTOR_API int raptor_server_commit_send(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                raptor_send_buffer_t* buf, size_t used);
+
+// Returns RAPTOR_SEND_OK, RAPTOR_SEND_FAILED or RAPTOR_SEND_WOULD_BLOCK,
+// header may be NULL.
+RAPTOR_API int raptor_server_try_send(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                const void* header, size_t header_size,
+                                const void* data, size_t len);
+
+// Sends data to every connection in cs, the data is copied once.
+// Returns the number of connections it was queued on.
+RAPTOR_API size_t raptor_server_broadcast(
+                                raptor_server_t* s,
+                                const raptor_connection_t* cs, size_t count,
+                                const void* data, size_t len);
+
+// Sends data without copying it, release(data, len, ctx) is called
+// once raptor is done with it, also when the send fails.
+RAPTOR_API int raptor_server_send_zerocopy(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                const void* data, size_t len,
+                                raptor_buffer_release_callback release, void* ctx);
+
+// Sends len bytes of file from offset, after the data already queued.
+// done(c, success, ctx) is called exactly once, also when it fails.
+RAPTOR_API int raptor_server_send_file(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                raptor_file_t file, uint64_t offset, uint64_t len,
+                                raptor_send_file_callback done, void* ctx);
+
+// Optional, see RaptorOptions::send_high_watermark.
+RAPTOR_API int raptor_server_set_writable_callback(
+                                raptor_server_t* s,
+                                raptor_server_callback_connection_writable on_writable);
+
+// Optional, see raptor_server_send_with_token.
+RAPTOR_API int raptor_server_set_send_completed_callback(
+                                raptor_server_t* s,
+                                raptor_server_callback_send_completed on_send_completed);
+
+// Optional, see RaptorOptions::max_dispatch_queue_depth.
+RAPTOR_API int raptor_server_set_overload_callback(
+                                raptor_server_t* s,
+                                raptor_server_callback_overload on_overload);
+
 RAPTOR_API int raptor_server_set_userdata(
                                 raptor_server_t* s, raptor_connection_t c, void* userdata);
 RAPTOR_API int raptor_server_get_userdata(
@@ -87,8 +222,22 @@ RAPTOR_API int raptor_server_set_extend_info(
                                 raptor_server_t* s, raptor_connection_t c, uint64_t info);
 RAPTOR_API int raptor_server_get_extend_info(
                                 raptor_server_t* s, raptor_connection_t c, uint64_t* info);
+// priority is one of RAPTOR_PRIORITY_*, see ITcpServer::SetPriority
+RAPTOR_API int raptor_server_set_priority(
+                                raptor_server_t* s, raptor_connection_t c, int priority);
 RAPTOR_API int raptor_server_close_connection(
                                 raptor_server_t* s, raptor_connection_t c);
+RAPTOR_API int raptor_server_get_stats(raptor_server_t* s, raptor_stats_t* stats);
+// see ITcpServer::GetConnectionInfo
+RAPTOR_API int raptor_server_get_connection_info(
+                                raptor_server_t* s, raptor_connection_t c, raptor_conn_info_t* info);
+// Returns the timer id or 0, c may be RAPTOR_NO_CONNECTION. Linux
+// only, see ITcpServer::ScheduleTimer.
+RAPTOR_API uint64_t raptor_server_schedule_timer(
+                                raptor_server_t* s, raptor_connection_t c, uint32_t delay_ms,
+                                raptor_timer_callback cb, void* ctx);
+// 1 if the timer was stopped before it ran
+RAPTOR_API int raptor_server_cancel_timer(raptor_server_t* s, uint64_t timer_id);
 
 RAPTOR_API void raptor_server_destroy(raptor_server_t* s);
 
@@ -112,6 +261,20 @@ RAPTOR_API int raptor_client_set_callbacks(
 RAPTOR_API int raptor_client_send(
     raptor_client_t* c, const void* buff, size_t len);
 
+// See raptor_server_send_v.
+RAPTOR_API int raptor_client_send_v(
+    raptor_client_t* c, const raptor_iovec* iov, size_t count);
+
+// See raptor_server_send_zerocopy.
+RAPTOR_API int raptor_client_send_zerocopy(
+    raptor_client_t* c, const void* data, size_t len,
+    raptor_buffer_release_callback release, void* ctx);
+
+// See raptor_server_schedule_timer.
+RAPTOR_API uint64_t raptor_client_schedule_timer(
+    raptor_client_t* c, uint32_t delay_ms, raptor_timer_callback cb, void* ctx);
+RAPTOR_API int raptor_client_cancel_timer(raptor_client_t* c, uint64_t timer_id);
+
 RAPTOR_API void raptor_client_destroy(raptor_client_t* c);
 
 
@@ -124,6 +287,22 @@ RAPTOR_API void raptor_protocol_set_callbacks(
                                 raptor_protocol_callback_check_package_length cb3
                                 );
 
+// Built-in framings, parsed by raptor without calling back. They
+// return NULL if the arguments do not describe a valid framing.
+// A 'width' bytes length (1, 2, 4 or 8) at 'offset' in a 'header_size'
+// bytes header, it counts the body unless includes_header is set.
+RAPTOR_API raptor_protocol_t* raptor_protocol_create_length_prefixed(
+                                size_t header_size, size_t offset, size_t width,
+                                int big_endian, int includes_header);
+// a LEB128 varint body length in front of every package
+RAPTOR_API raptor_protocol_t* raptor_protocol_create_varint();
+// packages end with delimiter (up to 8 bytes), which is part of them
+RAPTOR_API raptor_protocol_t* raptor_protocol_create_delimiter(
+                                const char* delimiter, size_t delimiter_size);
+// larger packages are a protocol error, 0 means unlimited. Only for the
+// built-in framings, must be called before the protocol is set.
+RAPTOR_API int raptor_protocol_set_max_package_size(raptor_protocol_t* p, size_t size);
+
 RAPTOR_API void raptor_protocol_destroy(raptor_protocol_t* p);
 
 #ifdef __cplusplus
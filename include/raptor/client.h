@@ -39,7 +39,12 @@ public:
     void SetProtocol(IProtocol* proto) override;
     bool Connect(const char* addr, size_t timeout_ms) override;
     bool Send(const void* buff, size_t len) override;
+    bool SendV(const raptor_iovec* iov, size_t count) override;
+    bool SendZeroCopy(const void* ptr, size_t len,
+        raptor_buffer_release_callback release, void* ctx) override;
     void Shutdown() override;
+    uint64_t ScheduleTimer(uint32_t delay_ms, raptor_timer_callback cb, void* ctx) override;
+    bool CancelTimer(uint64_t timer_id) override;
 
 private:
     TcpClient* _impl;
@@ -0,0 +1,65 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_EXPORT_CLIENT_POOL__
+#define __RAPTOR_EXPORT_CLIENT_POOL__
+
+#include "raptor/export.h"
+#include "raptor/protocol.h"
+#include "raptor/service.h"
+
+namespace raptor {
+
+class TcpServer;
+class ClientPoolReceiver;
+
+class RAPTOR_API ClientPool final : public ITcpClientPool {
+public:
+    explicit ClientPool(IClientPoolReceiver* service);
+    ~ClientPool();
+
+    ClientPool(const ClientPool&) = delete;
+    ClientPool& operator= (const ClientPool&) = delete;
+
+    bool Init(const RaptorOptions* options) override;
+    void SetProtocol(IProtocol* proto) override;
+    bool Start() override;
+    void Shutdown() override;
+    bool Connect(const char* addr, size_t timeout_ms, ConnectionId* cid) override;
+    bool Send(ConnectionId cid, const void* buff, size_t len) override;
+    bool SendWithHeader(ConnectionId cid,
+        const void* hdr, size_t hdr_len, const void* data, size_t data_len) override;
+    int TrySend(ConnectionId cid,
+        const void* hdr, size_t hdr_len, const void* data, size_t data_len) override;
+    bool CloseConnection(ConnectionId cid) override;
+    bool SetUserData(ConnectionId cid, void* data) override;
+    bool GetUserData(ConnectionId cid, void** data) override;
+    bool GetSendQueueBytes(ConnectionId cid, size_t* bytes) override;
+    void GetStats(RaptorStats* stats) override;
+
+private:
+    ClientPoolReceiver* _receiver;
+    TcpServer* _impl;
+};
+
+} // namespace raptor
+
+RAPTOR_API raptor::ITcpClientPool* RaptorCreateClientPool(raptor::IClientPoolReceiver* r);
+RAPTOR_API void RaptorReleaseClientPool(raptor::ITcpClientPool* pool);
+
+#endif  // __RAPTOR_EXPORT_CLIENT_POOL__
@@ -0,0 +1,489 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_COROUTINE__
+#define __RAPTOR_COROUTINE__
+
+/*
+    C++20 coroutine front ends of the server and the client, header
+    only. Compiled without coroutine support this header declares
+    nothing, the library itself stays C++11.
+
+        raptor::coro::Task Serve(std::shared_ptr<raptor::coro::Connection> conn) {
+            for (;;) {
+                raptor::coro::Buffer msg = co_await conn->Read();
+                if (!msg) break;  // closed
+                if (!co_await conn->Send(msg.data(), msg.size())) break;
+            }
+        }
+
+    A coroutine is resumed by the callback that completes what it
+    waits for, on the thread running that callback: the dispatch
+    thread of the connection, or its reactor with inline_dispatch.
+    One coroutine at a time may wait on Read, and one on Send.
+*/
+#if defined(__cpp_impl_coroutine)
+
+#include <stddef.h>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "raptor/client.h"
+#include "raptor/server.h"
+
+namespace raptor {
+namespace coro {
+
+// A coroutine that starts at once and frees itself when it returns,
+// it is not awaited.
+struct Task {
+    struct promise_type {
+        Task get_return_object() noexcept { return Task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+// One received message. It shares the buffer the message arrived in
+// (see RaptorRetainMessage), the client's messages are copied once.
+// A Read returns a null Buffer once the connection has closed.
+class Buffer final {
+public:
+    Buffer() noexcept : _ref{nullptr, 0, nullptr} {}
+    explicit Buffer(const Message* msg) { RaptorRetainMessage(msg, &_ref); }
+    ~Buffer() { RaptorReleaseSlice(&_ref); }
+
+    Buffer(Buffer&& other) noexcept : _ref(other._ref) {
+        other._ref = SliceRef{nullptr, 0, nullptr};
+    }
+    Buffer& operator= (Buffer&& other) noexcept {
+        if (this != &other) {
+            RaptorReleaseSlice(&_ref);
+            _ref = other._ref;
+            other._ref = SliceRef{nullptr, 0, nullptr};
+        }
+        return *this;
+    }
+    Buffer(const Buffer&) = delete;
+    Buffer& operator= (const Buffer&) = delete;
+
+    const void* data() const { return _ref.data; }
+    size_t size() const { return _ref.length; }
+    explicit operator bool() const { return _ref.handle != nullptr; }
+
+private:
+    SliceRef _ref;
+};
+
+namespace detail {
+
+// The messages nobody has read yet, and the coroutine waiting for one.
+class Inbox final {
+public:
+    class Awaiter {
+    public:
+        explicit Awaiter(Inbox* inbox) : _inbox(inbox) {}
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::lock_guard<std::mutex> g(_inbox->_mtx);
+            if (!_inbox->_queue.empty()) {
+                _result = std::move(_inbox->_queue.front());
+                _inbox->_queue.pop_front();
+                return false;
+            }
+            if (_inbox->_closed) {
+                return false;
+            }
+            _inbox->_reader = h;
+            _inbox->_slot = &_result;
+            return true;
+        }
+        Buffer await_resume() { return std::move(_result); }
+
+    private:
+        Inbox* _inbox;
+        Buffer _result;
+    };
+
+    void Push(Buffer msg) {
+        std::coroutine_handle<> reader;
+        {
+            std::lock_guard<std::mutex> g(_mtx);
+            if (!_reader) {
+                _queue.push_back(std::move(msg));
+                return;
+            }
+            *_slot = std::move(msg);
+            reader = Take();
+        }
+        reader.resume();
+    }
+
+    // the waiting reader gets a null Buffer, so do later reads once
+    // the queue is empty
+    void Close() {
+        std::coroutine_handle<> reader;
+        {
+            std::lock_guard<std::mutex> g(_mtx);
+            _closed = true;
+            reader = Take();
+        }
+        if (reader) {
+            reader.resume();
+        }
+    }
+
+    // before the next connection of a client
+    void Reopen() {
+        std::lock_guard<std::mutex> g(_mtx);
+        _closed = false;
+        _queue.clear();
+    }
+
+private:
+    // requires _mtx held
+    std::coroutine_handle<> Take() {
+        std::coroutine_handle<> h = _reader;
+        _reader = nullptr;
+        _slot = nullptr;
+        return h;
+    }
+
+    std::mutex _mtx;
+    std::deque<Buffer> _queue;
+    bool _closed = false;
+    std::coroutine_handle<> _reader;
+    Buffer* _slot = nullptr;
+};
+
+// The awaited value is already there.
+template <typename T>
+struct Ready {
+    T value;
+    bool await_ready() const noexcept { return true; }
+    void await_suspend(std::coroutine_handle<>) noexcept {}
+    T await_resume() { return std::move(value); }
+};
+
+} // namespace detail
+
+/*
+    A connection of a coro::Server. Send waits while the send buffer
+    is over RaptorOptions::send_high_watermark (see ITcpServer::TrySend)
+    and is true once the message is queued. The object stays valid
+    while a reference is held, its operations fail once it closed.
+*/
+class Connection final {
+public:
+    class SendAwaiter {
+    public:
+        SendAwaiter(Connection* conn, const void* data, size_t len)
+            : _conn(conn), _data(data), _len(len), _result(RAPTOR_SEND_FAILED) {}
+        bool await_ready() {
+            _result = _conn->TrySend(_data, _len);
+            return _result != RAPTOR_SEND_WOULD_BLOCK;
+        }
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::lock_guard<std::mutex> g(_conn->_mtx);
+            // OnWritable may have come before the lock
+            _result = _conn->_closed ? RAPTOR_SEND_FAILED : _conn->TrySend(_data, _len);
+            if (_result != RAPTOR_SEND_WOULD_BLOCK) {
+                return false;
+            }
+            _conn->_writer = h;
+            _conn->_pending = this;
+            return true;
+        }
+        bool await_resume() const noexcept { return _result == RAPTOR_SEND_OK; }
+
+    private:
+        friend class Connection;
+        Connection* _conn;
+        const void* _data;
+        size_t _len;
+        int _result;
+    };
+
+    Connection(ITcpServer* server, ConnectionId cid)
+        : _server(server), _cid(cid) {}
+
+    Connection(const Connection&) = delete;
+    Connection& operator= (const Connection&) = delete;
+
+    ConnectionId Id() const { return _cid; }
+    detail::Inbox::Awaiter Read() { return detail::Inbox::Awaiter(&_inbox); }
+    // data must stay valid until the co_await returns
+    SendAwaiter Send(const void* data, size_t len) { return SendAwaiter(this, data, len); }
+    bool Close() { return _server->CloseConnection(_cid); }
+
+private:
+    friend class Server;
+
+    int TrySend(const void* data, size_t len) {
+        return _server->TrySend(_cid, nullptr, 0, data, len);
+    }
+
+    void OnWritable() {
+        std::coroutine_handle<> writer;
+        {
+            std::lock_guard<std::mutex> g(_mtx);
+            if (!_writer) {
+                return;
+            }
+            _pending->_result = TrySend(_pending->_data, _pending->_len);
+            if (_pending->_result == RAPTOR_SEND_WOULD_BLOCK) {
+                return;
+            }
+            writer = _writer;
+            _writer = nullptr;
+            _pending = nullptr;
+        }
+        writer.resume();
+    }
+
+    void OnClosed() {
+        std::coroutine_handle<> writer;
+        {
+            std::lock_guard<std::mutex> g(_mtx);
+            _closed = true;
+            if (_writer) {
+                _pending->_result = RAPTOR_SEND_FAILED;
+                writer = _writer;
+                _writer = nullptr;
+                _pending = nullptr;
+            }
+        }
+        if (writer) {
+            writer.resume();
+        }
+        _inbox.Close();
+    }
+
+    ITcpServer* _server;
+    ConnectionId _cid;
+    detail::Inbox _inbox;
+    // the send side, a waiting Send and whether OnClosed has come
+    std::mutex _mtx;
+    bool _closed = false;
+    std::coroutine_handle<> _writer;
+    SendAwaiter* _pending = nullptr;
+};
+
+/*
+    Runs handler for every new connection, from OnConnected. Get()
+    is the underlying server, to Init, SetProtocol, AddListening and
+    Start it; its OnMessage, OnWritable and OnClosed are taken. It is
+    stopped with Shutdown rather than Get()->Shutdown(), which leaves
+    the coroutines of the open connections suspended.
+*/
+class Server final : public IServerReceiver {
+public:
+    using Handler = std::function<Task(std::shared_ptr<Connection>)>;
+
+    explicit Server(Handler handler)
+        : _handler(std::move(handler))
+        , _server(RaptorCreateServer(this)) {}
+    ~Server() {
+        Shutdown();
+        RaptorReleaseServer(_server);
+    }
+
+    Server(const Server&) = delete;
+    Server& operator= (const Server&) = delete;
+
+    ITcpServer* Get() const { return _server; }
+
+    // The server closes its connections without OnClosed. Once no
+    // callback runs any more, every connection left is closed here as
+    // OnClosed would: a waiting Read returns a null Buffer and a
+    // waiting Send fails, on the calling thread.
+    void Shutdown() {
+        _server->Shutdown();
+        std::unordered_map<ConnectionId, std::shared_ptr<Connection>> conns;
+        {
+            std::lock_guard<std::mutex> g(_mtx);
+            conns.swap(_conns);
+        }
+        for (auto& it : conns) {
+            it.second->OnClosed();
+        }
+    }
+
+    // IServerReceiver impl
+    void OnConnected(ConnectionId cid) override {
+        auto conn = std::make_shared<Connection>(_server, cid);
+        {
+            std::lock_guard<std::mutex> g(_mtx);
+            _conns[cid] = conn;
+        }
+        _handler(std::move(conn));
+    }
+    void OnMessageReceived(ConnectionId cid, const void* s, size_t len) override {
+        Message msg = { cid, s, len, nullptr };
+        OnMessage(&msg);
+    }
+    void OnMessage(const Message* msg) override {
+        std::shared_ptr<Connection> conn = Find(msg->connection);
+        if (conn) {
+            conn->_inbox.Push(Buffer(msg));
+        }
+    }
+    void OnWritable(ConnectionId cid) override {
+        std::shared_ptr<Connection> conn = Find(cid);
+        if (conn) {
+            conn->OnWritable();
+        }
+    }
+    void OnClosed(ConnectionId cid) override {
+        std::shared_ptr<Connection> conn;
+        {
+            std::lock_guard<std::mutex> g(_mtx);
+            auto it = _conns.find(cid);
+            if (it == _conns.end()) {
+                return;
+            }
+            conn = std::move(it->second);
+            _conns.erase(it);
+        }
+        conn->OnClosed();
+    }
+
+private:
+    std::shared_ptr<Connection> Find(ConnectionId cid) {
+        std::lock_guard<std::mutex> g(_mtx);
+        auto it = _conns.find(cid);
+        return it != _conns.end() ? it->second : nullptr;
+    }
+
+    Handler _handler;
+    ITcpServer* _server;
+    std::mutex _mtx;
+    std::unordered_map<ConnectionId, std::shared_ptr<Connection>> _conns;
+};
+
+/*
+    A client whose Connect and Read are awaited. Get() is the
+    underlying client, to Init and SetProtocol it. Sends are queued
+    at once, so Send never waits.
+*/
+class Client final : public IClientReceiver {
+public:
+    class ConnectAwaiter {
+    public:
+        ConnectAwaiter(Client* client, const char* addr, size_t timeout_ms)
+            : _client(client), _addr(addr), _timeout_ms(timeout_ms), _success(false) {}
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            {
+                std::lock_guard<std::mutex> g(_client->_mtx);
+                _client->_connecting = h;
+                _client->_connect_result = &_success;
+            }
+            _client->_inbox.Reopen();
+            if (_client->_impl->Connect(_addr, _timeout_ms)) {
+                // OnConnectResult may have resumed the coroutine already
+                return true;
+            }
+            std::lock_guard<std::mutex> g(_client->_mtx);
+            if (!_client->_connecting) {
+                return true;
+            }
+            _client->_connecting = nullptr;
+            _client->_connect_result = nullptr;
+            return false;
+        }
+        bool await_resume() const noexcept { return _success; }
+
+    private:
+        Client* _client;
+        const char* _addr;
+        size_t _timeout_ms;
+        bool _success;
+    };
+
+    Client() : _impl(RaptorCreateClient(this)) {}
+    ~Client() {
+        _impl->Shutdown();
+        RaptorReleaseClient(_impl);
+    }
+
+    Client(const Client&) = delete;
+    Client& operator= (const Client&) = delete;
+
+    ITcpClient* Get() const { return _impl; }
+
+    // addr must stay valid until the co_await returns
+    ConnectAwaiter Connect(const char* addr, size_t timeout_ms = 0) {
+        return ConnectAwaiter(this, addr, timeout_ms);
+    }
+    detail::Inbox::Awaiter Read() { return detail::Inbox::Awaiter(&_inbox); }
+    detail::Ready<bool> Send(const void* data, size_t len) {
+        return detail::Ready<bool>{_impl->Send(data, len)};
+    }
+    void Close() {
+        _impl->Shutdown();
+        _inbox.Close();
+    }
+
+    // IClientReceiver impl
+    void OnConnectResult(bool success) override {
+        std::coroutine_handle<> h;
+        {
+            std::lock_guard<std::mutex> g(_mtx);
+            if (!_connecting) {
+                return;
+            }
+            *_connect_result = success;
+            h = _connecting;
+            _connecting = nullptr;
+            _connect_result = nullptr;
+        }
+        if (!success) {
+            _inbox.Close();
+        }
+        h.resume();
+    }
+    void OnMessageReceived(const void* s, size_t len) override {
+        Message msg = { 0, s, len, nullptr };
+        _inbox.Push(Buffer(&msg));
+    }
+    void OnClosed() override {
+        _inbox.Close();
+    }
+
+private:
+    ITcpClient* _impl;
+    detail::Inbox _inbox;
+    std::mutex _mtx;
+    std::coroutine_handle<> _connecting;
+    bool* _connect_result = nullptr;
+};
+
+} // namespace coro
+} // namespace raptor
+
+#endif  // __cpp_impl_coroutine
+#endif  // __RAPTOR_COROUTINE__
@@ -0,0 +1,58 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_EXPORT_ENDPOINT_POOL__
+#define __RAPTOR_EXPORT_ENDPOINT_POOL__
+
+#include "raptor/export.h"
+#include "raptor/protocol.h"
+#include "raptor/service.h"
+
+namespace raptor {
+
+class EndpointPoolImpl;
+
+class RAPTOR_API EndpointPool final : public ITcpEndpointPool {
+public:
+    explicit EndpointPool(IEndpointPoolReceiver* service);
+    ~EndpointPool();
+
+    EndpointPool(const EndpointPool&) = delete;
+    EndpointPool& operator= (const EndpointPool&) = delete;
+
+    bool Init(const char* addr,
+        const EndpointPoolOptions* options, const RaptorOptions* reactor_options) override;
+    void SetProtocol(IProtocol* proto) override;
+    bool Start() override;
+    void Shutdown() override;
+    bool Send(const void* buff, size_t len) override;
+    bool SendWithHeader(const void* hdr, size_t hdr_len, const void* data, size_t data_len) override;
+    size_t GetConnectedCount() override;
+    size_t GetBufferedBytes() override;
+    void GetStats(RaptorStats* stats) override;
+
+private:
+    EndpointPoolImpl* _impl;
+};
+
+} // namespace raptor
+
+RAPTOR_API raptor::ITcpEndpointPool* RaptorCreateEndpointPool(raptor::IEndpointPoolReceiver* r);
+RAPTOR_API void RaptorReleaseEndpointPool(raptor::ITcpEndpointPool* pool);
+
+#endif  // __RAPTOR_EXPORT_ENDPOINT_POOL__
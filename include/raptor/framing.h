@@ -0,0 +1,249 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_FRAMING__
+#define __RAPTOR_FRAMING__
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "raptor/protocol.h"
+
+namespace raptor {
+
+// Describes one of the built-in framings. The engines recognize a
+// FramingProtocol and parse its packages directly, without a virtual
+// call per package.
+struct FramingSpec {
+    enum Kind {
+        kLengthPrefixed,    // a fixed-size header holding the length
+        kVarint,            // a LEB128 varint length, then the body
+        kDelimiter          // a package ends with the delimiter
+    };
+    enum { kMaxDelimiterSize = 8, kMaxVarintSize = 10 };
+
+    Kind kind;
+
+    // kLengthPrefixed: the length field is 'width' bytes (1, 2, 4 or 8)
+    // at 'offset' in a 'header_size' bytes header. It counts the body
+    // unless 'includes_header' is set.
+    size_t header_size;
+    size_t offset;
+    size_t width;
+    bool big_endian;
+    bool includes_header;
+
+    // kDelimiter, the delimiter is part of the package
+    char delimiter[kMaxDelimiterSize];
+    size_t delimiter_size;
+
+    // larger packages are a protocol error, 0 means INT_MAX
+    size_t max_package_size;
+};
+
+namespace framing {
+
+inline bool IsValid(const FramingSpec& spec) {
+    switch (spec.kind) {
+    case FramingSpec::kLengthPrefixed:
+        return (spec.width == 1 || spec.width == 2 || spec.width == 4 || spec.width == 8)
+            && spec.offset + spec.width <= spec.header_size;
+    case FramingSpec::kVarint:
+        return true;
+    case FramingSpec::kDelimiter:
+        return spec.delimiter_size > 0
+            && spec.delimiter_size <= FramingSpec::kMaxDelimiterSize;
+    }
+    return false;
+}
+
+inline size_t MaxPackageSize(const FramingSpec& spec) {
+    return (spec.max_package_size > 0 && spec.max_package_size < INT_MAX)
+        ? spec.max_package_size : INT_MAX;
+}
+
+inline int CheckTotal(const FramingSpec& spec, uint64_t total) {
+    return (total == 0 || total > MaxPackageSize(spec)) ? -1 : static_cast<int>(total);
+}
+
+// data holds at least spec.header_size bytes
+inline int DecodeLengthPrefixed(const FramingSpec& spec, const uint8_t* data) {
+    const uint8_t* p = data + spec.offset;
+    uint64_t value = 0;
+    for (size_t i = 0; i < spec.width; i++) {
+        size_t k = spec.big_endian ? i : spec.width - 1 - i;
+        value = (value << 8) | p[k];
+    }
+    if (spec.includes_header) {
+        return value < spec.header_size ? -1 : CheckTotal(spec, value);
+    }
+    if (value > MaxPackageSize(spec)) {
+        return -1;
+    }
+    return CheckTotal(spec, value + spec.header_size);
+}
+
+// return -1: error;  0: need more data; > 0 : pack_len
+inline int DecodeVarint(const FramingSpec& spec, const uint8_t* data, size_t len) {
+    uint64_t value = 0;
+    size_t n = (len < FramingSpec::kMaxVarintSize) ? len : FramingSpec::kMaxVarintSize;
+    for (size_t i = 0; i < n; i++) {
+        value |= static_cast<uint64_t>(data[i] & 0x7f) << (7 * i);
+        if ((data[i] & 0x80) == 0) {
+            if (value > MaxPackageSize(spec)) {
+                return -1;
+            }
+            return CheckTotal(spec, value + i + 1);
+        }
+    }
+    return (len < FramingSpec::kMaxVarintSize) ? 0 : -1;
+}
+
+// return -1: error;  0: need more data; > 0 : pack_len
+inline int DecodeDelimiter(const FramingSpec& spec, const uint8_t* data, size_t len) {
+    const size_t dlen = spec.delimiter_size;
+    const uint8_t first = static_cast<uint8_t>(spec.delimiter[0]);
+    size_t pos = 0;
+    while (pos + dlen <= len) {
+        const void* hit = memchr(data + pos, first, len - pos - dlen + 1);
+        if (!hit) {
+            break;
+        }
+        pos = static_cast<const uint8_t*>(hit) - data;
+        if (memcmp(data + pos, spec.delimiter, dlen) == 0) {
+            return CheckTotal(spec, pos + dlen);
+        }
+        pos++;
+    }
+    return (len >= MaxPackageSize(spec)) ? -1 : 0;
+}
+
+// the contiguous form, used by FramingProtocol::CheckPackageLength
+inline int Decode(const FramingSpec& spec, const void* data, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    switch (spec.kind) {
+    case FramingSpec::kLengthPrefixed:
+        return (len < spec.header_size) ? 0 : DecodeLengthPrefixed(spec, p);
+    case FramingSpec::kVarint:
+        return DecodeVarint(spec, p, len);
+    case FramingSpec::kDelimiter:
+        return DecodeDelimiter(spec, p, len);
+    }
+    return -1;
+}
+
+} // namespace framing
+
+// A built-in framing. It works wherever an IProtocol is expected,
+// the engines check packages of these without calling it.
+class FramingProtocol : public IProtocol {
+public:
+    explicit FramingProtocol(const FramingSpec& spec) : _spec(spec) {}
+
+    const FramingSpec& GetFramingSpec() const { return _spec; }
+
+    // 0 means INT_MAX, must be called before SetProtocol
+    void SetMaxPackageSize(size_t size) { _spec.max_package_size = size; }
+
+    size_t GetMaxHeaderSize() override {
+        switch (_spec.kind) {
+        case FramingSpec::kLengthPrefixed:
+            return _spec.header_size;
+        case FramingSpec::kVarint:
+            return FramingSpec::kMaxVarintSize;
+        case FramingSpec::kDelimiter:
+            break;
+        }
+        return 1024;
+    }
+
+    int CheckPackageLength(const void* data, size_t len) override {
+        return framing::Decode(_spec, data, len);
+    }
+
+    static FramingSpec LengthPrefixedSpec(size_t header_size, size_t offset,
+        size_t width, bool big_endian, bool includes_header) {
+        FramingSpec spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.kind = FramingSpec::kLengthPrefixed;
+        spec.header_size = header_size;
+        spec.offset = offset;
+        spec.width = width;
+        spec.big_endian = big_endian;
+        spec.includes_header = includes_header;
+        return spec;
+    }
+
+    static FramingSpec VarintSpec() {
+        FramingSpec spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.kind = FramingSpec::kVarint;
+        return spec;
+    }
+
+    // delimiter_size is truncated to FramingSpec::kMaxDelimiterSize
+    static FramingSpec DelimiterSpec(const char* delimiter, size_t delimiter_size) {
+        FramingSpec spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.kind = FramingSpec::kDelimiter;
+        if (delimiter_size > FramingSpec::kMaxDelimiterSize) {
+            delimiter_size = FramingSpec::kMaxDelimiterSize;
+        }
+        memcpy(spec.delimiter, delimiter, delimiter_size);
+        spec.delimiter_size = delimiter_size;
+        return spec;
+    }
+
+private:
+    FramingSpec _spec;
+};
+
+enum class ByteOrder { kBigEndian, kLittleEndian };
+
+// e.g. LengthPrefixedProtocol<4, 0, 4> is a 4 bytes big endian
+// body length in front of every package.
+template <size_t HeaderSize, size_t Offset, size_t Width,
+          ByteOrder Order = ByteOrder::kBigEndian, bool IncludesHeader = false>
+class LengthPrefixedProtocol final : public FramingProtocol {
+    static_assert(Width == 1 || Width == 2 || Width == 4 || Width == 8,
+        "the length field must be 1, 2, 4 or 8 bytes");
+    static_assert(Offset + Width <= HeaderSize,
+        "the length field must be inside the header");
+
+public:
+    LengthPrefixedProtocol()
+        : FramingProtocol(LengthPrefixedSpec(HeaderSize, Offset, Width,
+            Order == ByteOrder::kBigEndian, IncludesHeader)) {}
+};
+
+// a LEB128 varint body length in front of every package
+class VarintProtocol final : public FramingProtocol {
+public:
+    VarintProtocol() : FramingProtocol(VarintSpec()) {}
+};
+
+// packages end with the delimiter, which is part of them
+class DelimiterProtocol final : public FramingProtocol {
+public:
+    explicit DelimiterProtocol(const char* delimiter = "\r\n")
+        : FramingProtocol(DelimiterSpec(delimiter, strlen(delimiter))) {}
+};
+
+} // namespace raptor
+#endif  // __RAPTOR_FRAMING__
@@ -20,6 +20,8 @@
 #define __RAPTOR_PROTOCOL__
 
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 namespace raptor {
 class IProtocol {
@@ -32,5 +34,70 @@ public:
     // return -1: error;  0: need more data; > 0 : pack_len
     virtual int CheckPackageLength(const void* data, size_t len) = 0;
 };
+
+// A protocol given to an IRpcClient also implements IRpcProtocol,
+// which reads the id a reply shares with its request.
+class IRpcProtocol {
+public:
+    virtual ~IRpcProtocol() {}
+
+    // data is a whole message, return false if it carries no id
+    virtual bool GetRequestId(const void* data, size_t len, uint64_t* id) = 0;
+};
+
+// Read-only access to the received bytes, which may be split
+// over several contiguous segments.
+class IBufferView {
+public:
+    virtual ~IBufferView() {}
+
+    // total number of bytes
+    virtual size_t Length() const = 0;
+
+    virtual size_t SegmentCount() const = 0;
+    // index must be less than SegmentCount()
+    virtual const void* Segment(size_t index, size_t* len) const = 0;
+
+    // copies up to len bytes starting at offset into buf,
+    // return the number of bytes copied.
+    virtual size_t Peek(size_t offset, void* buf, size_t len) const = 0;
+};
+
+// Optional, a protocol that also implements IScatterProtocol has its
+// packages checked on the received bytes in place, they are not
+// copied into one contiguous header first. CheckPackageLength(data, len)
+// is not called by raptor then.
+class IScatterProtocol : public IProtocol {
+public:
+    // return -1: error;  0: need more data; > 0 : pack_len
+    virtual int CheckPackageView(const IBufferView& view) = 0;
+
+    int CheckPackageLength(const void* data, size_t len) override {
+        ContiguousView view(data, len);
+        return CheckPackageView(view);
+    }
+
+private:
+    class ContiguousView final : public IBufferView {
+    public:
+        ContiguousView(const void* data, size_t len) : _data(data), _len(len) {}
+        size_t Length() const override { return _len; }
+        size_t SegmentCount() const override { return _len > 0 ? 1 : 0; }
+        const void* Segment(size_t, size_t* len) const override {
+            *len = _len;
+            return _data;
+        }
+        size_t Peek(size_t offset, void* buf, size_t len) const override {
+            if (offset >= _len) return 0;
+            if (len > _len - offset) len = _len - offset;
+            memcpy(buf, static_cast<const char*>(_data) + offset, len);
+            return len;
+        }
+
+    private:
+        const void* _data;
+        size_t _len;
+    };
+};
 } // namespace raptor
 #endif  // __RAPTOR_PROTOCOL__
@@ -0,0 +1,55 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_EXPORT_RPC_CLIENT__
+#define __RAPTOR_EXPORT_RPC_CLIENT__
+
+#include "raptor/export.h"
+#include "raptor/protocol.h"
+#include "raptor/service.h"
+
+namespace raptor {
+
+class RpcClientImpl;
+
+class RAPTOR_API RpcClient final : public IRpcClient {
+public:
+    explicit RpcClient(IRpcClientReceiver* service);
+    ~RpcClient();
+
+    RpcClient(const RpcClient&) = delete;
+    RpcClient& operator= (const RpcClient&) = delete;
+
+    bool Init(const RpcClientOptions* options) override;
+    bool SetProtocol(IProtocol* proto) override;
+    bool Connect(const char* addr, size_t timeout_ms) override;
+    int Call(uint64_t id, const void* data, size_t len, size_t timeout_ms, void* ctx) override;
+    size_t CallBatch(const RpcRequest* requests, size_t count) override;
+    size_t GetInFlight() override;
+    void Shutdown() override;
+
+private:
+    RpcClientImpl* _impl;
+};
+
+} // namespace raptor
+
+RAPTOR_API raptor::IRpcClient* RaptorCreateRpcClient(raptor::IRpcClientReceiver* r);
+RAPTOR_API void RaptorReleaseRpcClient(raptor::IRpcClient* client);
+
+#endif  // __RAPTOR_EXPORT_RPC_CLIENT__
@@ -35,17 +35,41 @@ public:
 
     bool Init(const RaptorOptions* options) override;
     void SetProtocol(IProtocol* proto) override;
+    bool SetTlsProvider(ITlsProvider* tls) override;
+    bool SetCodec(IMessageCodec* codec) override;
     bool AddListening(const char* addr) override;
+    size_t GetListeningFds(int* fds, size_t count) override;
+    bool AdoptListening(int fd) override;
+    void Drain() override;
     bool Start() override;
     void Shutdown() override;
     bool Send(ConnectionId cid, const void* buff, size_t len) override;
+    bool SendV(ConnectionId cid, const raptor_iovec* iov, size_t count) override;
+    int SendWithToken(ConnectionId cid, const raptor_iovec* iov, size_t count, uint64_t token) override;
+    bool AllocSendBuffer(ConnectionId cid, size_t size, SendBuffer* buf) override;
+    bool CommitSend(ConnectionId cid, SendBuffer* buf, size_t used) override;
     bool SendWithHeader(ConnectionId cid,
         const void* hdr, size_t hdr_len, const void* data, size_t data_len) override;
+    int TrySend(ConnectionId cid,
+        const void* hdr, size_t hdr_len, const void* data, size_t data_len) override;
+    size_t Broadcast(const ConnectionId* cids, size_t count,
+        const void* data, size_t len) override;
+    bool SendZeroCopy(ConnectionId cid, const void* ptr, size_t len,
+        raptor_buffer_release_callback release, void* ctx) override;
+    bool SendFile(ConnectionId cid, raptor_file_t file, uint64_t offset,
+        uint64_t length, raptor_send_file_callback done, void* ctx) override;
     bool CloseConnection(ConnectionId cid) override;
     bool SetUserData(ConnectionId id, void* userdata) override;
     bool GetUserData(ConnectionId id, void** userdata) override;
     bool SetExtendInfo(ConnectionId id, uint64_t info) override;
     bool GetExtendInfo(ConnectionId id, uint64_t* info) override;
+    bool SetPriority(ConnectionId id, int priority) override;
+    bool SetCodecEnabled(ConnectionId id, bool enabled) override;
+    void GetStats(RaptorStats* stats) override;
+    bool GetConnectionInfo(ConnectionId id, RaptorConnInfo* info) override;
+    uint64_t ScheduleTimer(ConnectionId id, uint32_t delay_ms,
+        raptor_timer_callback cb, void* ctx) override;
+    bool CancelTimer(uint64_t timer_id) override;
 
 private:
     TcpServer* _impl;
@@ -56,4 +80,23 @@ private:
 RAPTOR_API raptor::ITcpServer* RaptorCreateServer(raptor::IServerReceiver* s);
 RAPTOR_API void RaptorReleaseServer(raptor::ITcpServer* server);
 
+// Keeps the bytes of a message handed to OnMessage or OnMessagesReceived
+// past the callback. ref shares the buffer the message was received
+// in, messages of up to 23 bytes are copied. Every retained ref must
+// be released once, on any thread.
+RAPTOR_API void RaptorRetainMessage(const raptor::Message* msg, raptor::SliceRef* ref);
+RAPTOR_API void RaptorReleaseSlice(raptor::SliceRef* ref);
+
+// Passing listening sockets to a new process (linux).
+// Over a connected unix socket, with SCM_RIGHTS.
+RAPTOR_API bool RaptorSendListeningFds(int sock, const int* fds, size_t count);
+// Returns how many fds arrived, up to count.
+RAPTOR_API size_t RaptorReceiveListeningFds(int sock, int* fds, size_t count);
+// Across exec: the fds are kept open over exec and listed in the
+// RAPTOR_LISTEN_FDS environment variable.
+RAPTOR_API bool RaptorExportListeningFds(const int* fds, size_t count);
+// The fds listed in RAPTOR_LISTEN_FDS, up to count. The variable is
+// removed, so child processes do not inherit the list.
+RAPTOR_API size_t RaptorInheritedListeningFds(int* fds, size_t count);
+
 #endif  // __RAPTOR_EXPORT_SERVER__
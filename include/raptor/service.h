@@ -24,12 +24,128 @@
 
 namespace raptor {
 class IProtocol;
+
+using Message = raptor_message_t;
+using SliceRef = raptor_slice_t;
+
 class IServerReceiver {
 public:
     virtual ~IServerReceiver() {}
     virtual void OnConnected(ConnectionId cid) = 0;
     virtual void OnMessageReceived(ConnectionId cid, const void* s, size_t len) = 0;
     virtual void OnClosed(ConnectionId cid) = 0;
+
+    // Optional, takes the place of OnMessageReceived. msg may be kept
+    // past the call without copying it, see RaptorRetainMessage.
+    virtual void OnMessage(const Message* msg) {
+        OnMessageReceived(msg->connection, msg->data, msg->length);
+    }
+
+    // Optional, a package over RaptorOptions::stream_threshold comes
+    // in pieces as it is read: OnMessageBegin with its total length,
+    // OnMessageChunk for each piece, the first one holding the header,
+    // then OnMessageEnd. A connection closing in between gets OnClosed
+    // without OnMessageEnd. The pieces may be kept like messages, see
+    // RaptorRetainMessage (linux).
+    virtual void OnMessageBegin(ConnectionId /*cid*/, size_t /*total_len*/) {}
+    virtual void OnMessageChunk(const Message* /*chunk*/) {}
+    virtual void OnMessageEnd(ConnectionId /*cid*/) {}
+
+    // Optional, the kernel has released 'count' zero-copy sends
+    // (see RaptorOptions::zerocopy_threshold).
+    virtual void OnZeroCopyCompleted(ConnectionId /*cid*/, uint32_t /*count*/) {}
+
+    // Optional, a TrySend on cid returned RAPTOR_SEND_WOULD_BLOCK and
+    // its send buffer has drained to the low watermark.
+    virtual void OnWritable(ConnectionId /*cid*/) {}
+
+    // Optional, the sends of cid made with SendWithToken have been
+    // written to the socket, several finishing together come in one
+    // call. Sends still queued when cid closes are not reported.
+    virtual void OnSendCompleted(ConnectionId /*cid*/, const uint64_t* /*tokens*/, size_t /*count*/) {}
+
+    // Optional, a dispatch queue went over its bound and reading of
+    // the connections posting to it is paused, OnRecovered follows
+    // once every queue has drained (see RaptorOptions::
+    // max_dispatch_queue_depth). Called on a reactor or dispatch
+    // thread, neither may block.
+    virtual void OnOverload() {}
+    virtual void OnRecovered() {}
+
+    // Optional, a callback just took longer than RaptorOptions::
+    // slow_callback_us. Called on the same dispatch thread right
+    // after it, which stays blocked meanwhile (linux).
+    virtual void OnSlowCallback(const RaptorSlowCallback& /*info*/) {}
+};
+
+// A receiver that also implements OnMessagesReceived gets the messages
+// parsed from one read (inline dispatch) or drained from the dispatch
+// queue in one call, OnMessageReceived is not called then (linux).
+// A batch may hold messages of several connections, the messages of
+// one connection are in order.
+class IServerBatchReceiver : public IServerReceiver {
+public:
+    virtual void OnMessagesReceived(const Message* msgs, size_t count) = 0;
+
+    // used where batches are not available
+    void OnMessageReceived(ConnectionId cid, const void* s, size_t len) override {
+        Message msg = { cid, s, len, nullptr };
+        OnMessagesReceived(&msg, 1);
+    }
+    void OnMessage(const Message* msg) override {
+        OnMessagesReceived(msg, 1);
+    }
+};
+
+// Sink for the handshake bytes a TLS session sends to the peer.
+class ITlsWriter {
+public:
+    virtual ~ITlsWriter() {}
+    virtual void Write(const void* data, size_t len) = 0;
+};
+
+// The user space half of a TLS connection, backed by any TLS library.
+// It only runs the handshake, the records after it are encrypted and
+// decrypted by the kernel (kTLS).
+class ITlsSession {
+public:
+    virtual ~ITlsSession() {}
+    // 'record' is one whole record from the peer. Returns
+    // RAPTOR_TLS_HANDSHAKE_CONTINUE, _DONE or _FAILED.
+    virtual int Handshake(const void* record, size_t len, ITlsWriter* writer) = 0;
+    // called after RAPTOR_TLS_HANDSHAKE_DONE
+    virtual bool GetCryptoInfo(TlsCryptoInfo* tx, TlsCryptoInfo* rx) = 0;
+};
+
+class ITlsProvider {
+public:
+    virtual ~ITlsProvider() {}
+    // the server side of a new connection, nullptr rejects it
+    virtual ITlsSession* CreateSession(ConnectionId cid) = 0;
+    virtual void DestroySession(ITlsSession* session) = 0;
+};
+
+// Transforms whole packages, e.g. compresses them with LZ4 or zstd.
+// An encoded package must still be one package of the protocol, the
+// codec marks it (a flag in the header, say) so Decode can tell it
+// apart. Called concurrently for different connections.
+class IMessageCodec {
+public:
+    virtual ~IMessageCodec() {}
+    // upper bound of what Encode writes for a package of len bytes
+    virtual size_t MaxEncodedSize(size_t len) = 0;
+    // out holds MaxEncodedSize(len) bytes. Returns the encoded length,
+    // 0 sends the package as it is (it did not shrink, say).
+    // Broadcast encodes a package once, for its first codec-enabled
+    // target, and sends those bytes to all of them: a codec whose
+    // output depends on cid (per-connection keys or dictionaries) must
+    // not be used with Broadcast.
+    virtual size_t Encode(ConnectionId cid, const void* data, size_t len, void* out) = 0;
+    // Returns the decoded length of a received package, 0 if it is
+    // not encoded and goes to the receiver as it is, -1 if corrupt.
+    virtual int DecodedSize(ConnectionId cid, const void* data, size_t len) = 0;
+    // out holds DecodedSize bytes, false if corrupt
+    virtual bool Decode(ConnectionId cid, const void* data, size_t len, void* out, size_t out_len) = 0;
 };
 
 class RAPTOR_API ITcpServer {
@@ -37,16 +153,99 @@ public:
     virtual ~ITcpServer() {}
     virtual bool Init(const RaptorOptions* options) = 0;
     virtual void SetProtocol(IProtocol* proto) = 0;
+    // Before Start. Each connection runs a TLS handshake first and
+    // OnConnected comes once the kernel holds its keys, sends and
+    // SendFile are then encrypted by the kernel (linux, kTLS; records
+    // other than application data close the connection).
+    virtual bool SetTlsProvider(ITlsProvider* tls) = 0;
+    // Before Start. Received packages are decoded on the dispatch
+    // threads before the receiver sees them (on the reactor with
+    // inline_dispatch), a corrupt one closes its connection. Sends
+    // on a connection are encoded on the calling thread once
+    // SetCodecEnabled turned it on, for packages of at least
+    // RaptorOptions::codec_threshold bytes; CommitSend, SendZeroCopy
+    // and SendFile never are (linux).
+    virtual bool SetCodec(IMessageCodec* codec) = 0;
+    // Connections start with encoding off, it is turned on once the
+    // peer is known to decode, e.g. after a handshake message.
+    virtual bool SetCodecEnabled(ConnectionId cid, bool enabled) = 0;
+    // addr is "host:port", or on linux a unix domain socket
+    // "unix:/path/to/socket" or "unix-abstract:name". Connect takes
+    // the same forms.
     virtual bool AddListening(const char* addr) = 0;
+    // Restart without closing the listening sockets (linux): the old
+    // process hands its GetListeningFds to the new one (see
+    // RaptorSendListeningFds), which adopts them after Init instead of
+    // AddListening, and then drains. GetListeningFds fills at most
+    // count and returns how many there are, the server keeps owning
+    // them but no longer shuts them down.
+    virtual size_t GetListeningFds(int* fds, size_t count) = 0;
+    // Listens on fd, an inherited listening socket, owned by the
+    // server from now on.
+    virtual bool AdoptListening(int fd) = 0;
+    // Stops accepting and closes the listening sockets, the open
+    // connections are served until they close or Shutdown.
+    virtual void Drain() = 0;
     virtual bool Start() = 0;
     virtual void Shutdown() = 0;
     virtual bool Send(ConnectionId cid, const void* buff, size_t len) = 0;
     virtual bool SendWithHeader(ConnectionId cid, const void* hdr, size_t hdr_len, const void* data, size_t data_len) = 0;
+    // Like SendWithHeader, but tells a full send buffer (see
+    // RaptorOptions::send_high_watermark) apart from a failure.
+    // Returns RAPTOR_SEND_OK, RAPTOR_SEND_FAILED or RAPTOR_SEND_WOULD_BLOCK.
+    virtual int TrySend(ConnectionId cid, const void* hdr, size_t hdr_len, const void* data, size_t data_len) = 0;
+    // Sends the fragments as one message, in a single gather write when
+    // the send buffer is empty. Small fragments are coalesced if they
+    // have to be queued, so iov may be reused once this returns.
+    virtual bool SendV(ConnectionId cid, const raptor_iovec* iov, size_t count) = 0;
+    // Like SendV, and OnSendCompleted reports token once the data has
+    // been written to the socket, which with inline_dispatch may be
+    // before this returns. Only then, with RAPTOR_SEND_OK. Returns
+    // RAPTOR_SEND_OK, RAPTOR_SEND_FAILED or RAPTOR_SEND_WOULD_BLOCK (linux).
+    virtual int SendWithToken(ConnectionId cid, const raptor_iovec* iov, size_t count, uint64_t token) = 0;
+    // Lends buf at least size writable bytes from the slice pool, to
+    // encode a message for cid in place. Every buffer goes back with
+    // one CommitSend, which sends its first 'used' bytes without a
+    // copy; used 0 only releases it. False if cid is not connected.
+    virtual bool AllocSendBuffer(ConnectionId cid, size_t size, SendBuffer* buf) = 0;
+    virtual bool CommitSend(ConnectionId cid, SendBuffer* buf, size_t used) = 0;
+    // Sends the same payload to every connection in cids, the data is
+    // copied once and shared, and encoded at most once for the targets
+    // with the codec enabled (see IMessageCodec::Encode). Returns the
+    // number of connections it was queued on.
+    virtual size_t Broadcast(const ConnectionId* cids, size_t count, const void* data, size_t len) = 0;
+    // Sends caller-owned memory without copying it. release(ptr, len, ctx)
+    // is called exactly once when raptor is done with it, even on failure.
+    virtual bool SendZeroCopy(ConnectionId cid, const void* ptr, size_t len, raptor_buffer_release_callback release, void* ctx) = 0;
+    // Sends length bytes of file starting at offset, without copying
+    // them through user space. The range goes out after the data
+    // already queued and before anything sent later. done(cid,
+    // success, ctx) is called exactly once, even on failure.
+    virtual bool SendFile(ConnectionId cid, raptor_file_t file, uint64_t offset, uint64_t length, raptor_send_file_callback done, void* ctx) = 0;
     virtual bool CloseConnection(ConnectionId cid) = 0;
     virtual bool SetUserData(ConnectionId cid, void* data) = 0;
     virtual bool GetUserData(ConnectionId cid, void** data) = 0;
     virtual bool SetExtendInfo(ConnectionId cid, uint64_t info) = 0;
     virtual bool GetExtendInfo(ConnectionId cid, uint64_t* info) = 0;
+    // Queues the callbacks of cid in the dispatch lane of priority
+    // (RAPTOR_PRIORITY_*), connections start at normal. The callbacks
+    // stay in order, the change shows once the ones queued before it
+    // have run. No effect with inline_dispatch (linux).
+    virtual bool SetPriority(ConnectionId cid, int priority) = 0;
+    // Counters since Start, cheap enough to poll every second.
+    virtual void GetStats(RaptorStats* stats) = 0;
+    // Counters of cid since it connected and the kernel's view of its
+    // path, sampled now: a lock round trip each way and one getsockopt.
+    virtual bool GetConnectionInfo(ConnectionId cid, RaptorConnInfo* info) = 0;
+    // Calls cb(cid, id, 1, ctx) once delay_ms is over, on the reactor
+    // of cid with inline_dispatch and otherwise on its dispatch thread,
+    // in order with its other callbacks. A cid of RAPTOR_NO_CONNECTION
+    // makes a timer of no connection. Returns the timer id, 0 if cid
+    // is not connected. Linux only: the windows engine makes no timer,
+    // it logs an error and returns 0.
+    virtual uint64_t ScheduleTimer(ConnectionId cid, uint32_t delay_ms, raptor_timer_callback cb, void* ctx) = 0;
+    // True if the timer was stopped before it ran, cb is not called then.
+    virtual bool CancelTimer(uint64_t timer_id) = 0;
 };
 
 class IClientReceiver {
@@ -64,7 +263,166 @@ public:
     virtual void SetProtocol(IProtocol* proto) = 0;
     virtual bool Connect(const char* addr, size_t timeout_ms) = 0;
     virtual bool Send(const void* buff, size_t len) = 0;
+    // See ITcpServer::SendV.
+    virtual bool SendV(const raptor_iovec* iov, size_t count) = 0;
+    // See ITcpServer::SendZeroCopy.
+    virtual bool SendZeroCopy(const void* ptr, size_t len, raptor_buffer_release_callback release, void* ctx) = 0;
+    virtual void Shutdown() = 0;
+    // See ITcpServer::ScheduleTimer, the timers run on the thread of the
+    // connection with cid RAPTOR_NO_CONNECTION. The ones left when the
+    // connection ends are called with fired 0. Linux only, as there.
+    virtual uint64_t ScheduleTimer(uint32_t delay_ms, raptor_timer_callback cb, void* ctx) = 0;
+    virtual bool CancelTimer(uint64_t timer_id) = 0;
+};
+
+// The callbacks of one connection always run in order on the same
+// thread, different connections may run in parallel.
+class IClientPoolReceiver {
+public:
+    virtual ~IClientPoolReceiver() {}
+    // cid is no longer valid after a failed connect
+    virtual void OnConnectResult(ConnectionId cid, bool success) = 0;
+    virtual void OnMessageReceived(ConnectionId cid, const void* s, size_t len) = 0;
+    virtual void OnClosed(ConnectionId cid) = 0;
+    // See IServerReceiver::OnWritable.
+    virtual void OnWritable(ConnectionId /*cid*/) {}
+    // See IServerReceiver::OnOverload.
+    virtual void OnOverload() {}
+    virtual void OnRecovered() {}
+};
+
+// Many outbound connections served by a shared set of reactors, as
+// the connections of a server are. The options mean the same as for
+// ITcpServer::Init (linux).
+class RAPTOR_API ITcpClientPool {
+public:
+    virtual ~ITcpClientPool() {}
+    virtual bool Init(const RaptorOptions* options) = 0;
+    virtual void SetProtocol(IProtocol* proto) = 0;
+    virtual bool Start() = 0;
+    virtual void Shutdown() = 0;
+    // Starts connecting, *cid identifies the connection from now on.
+    // OnConnectResult may be called before Connect returns.
+    virtual bool Connect(const char* addr, size_t timeout_ms, ConnectionId* cid) = 0;
+    virtual bool Send(ConnectionId cid, const void* buff, size_t len) = 0;
+    virtual bool SendWithHeader(ConnectionId cid, const void* hdr, size_t hdr_len, const void* data, size_t data_len) = 0;
+    // See ITcpServer::TrySend.
+    virtual int TrySend(ConnectionId cid, const void* hdr, size_t hdr_len, const void* data, size_t data_len) = 0;
+    // OnClosed is not called for connections closed by this
+    virtual bool CloseConnection(ConnectionId cid) = 0;
+    virtual bool SetUserData(ConnectionId cid, void* data) = 0;
+    virtual bool GetUserData(ConnectionId cid, void** data) = 0;
+    // bytes waiting in the connection's send buffer
+    virtual bool GetSendQueueBytes(ConnectionId cid, size_t* bytes) = 0;
+    virtual void GetStats(RaptorStats* stats) = 0;
+};
+
+class IEndpointPoolReceiver {
+public:
+    virtual ~IEndpointPoolReceiver() {}
+    virtual void OnMessageReceived(ConnectionId cid, const void* s, size_t len) = 0;
+    // The pool reopens lost connections by itself, these only
+    // report it. A reopened connection has a new cid.
+    virtual void OnConnectionUp(ConnectionId /*cid*/) {}
+    virtual void OnConnectionDown(ConnectionId /*cid*/) {}
+};
+
+// A fixed number of connections to one endpoint, on the reactors of
+// an ITcpClientPool. Sends go to any open connection and are kept
+// in the pool while none is open.
+class RAPTOR_API ITcpEndpointPool {
+public:
+    virtual ~ITcpEndpointPool() {}
+    // reactor_options may be NULL
+    virtual bool Init(const char* addr,
+        const EndpointPoolOptions* options, const RaptorOptions* reactor_options) = 0;
+    virtual void SetProtocol(IProtocol* proto) = 0;
+    // starts opening the connections
+    virtual bool Start() = 0;
+    virtual void Shutdown() = 0;
+    // false if the message can neither be sent nor kept
+    // within max_buffered_bytes
+    virtual bool Send(const void* buff, size_t len) = 0;
+    virtual bool SendWithHeader(const void* hdr, size_t hdr_len, const void* data, size_t data_len) = 0;
+    virtual size_t GetConnectedCount() = 0;
+    virtual size_t GetBufferedBytes() = 0;
+    virtual void GetStats(RaptorStats* stats) = 0;
+};
+
+// OnReply and OnUnmatched run on the client's thread, OnFailed for a
+// deadline on the deadline thread, for the lost connection before
+// OnClosed.
+class IRpcClientReceiver {
+public:
+    virtual ~IRpcClientReceiver() {}
+    virtual void OnConnectResult(bool success) = 0;
+    // the reply to request id, ctx is the one it was called with
+    virtual void OnReply(uint64_t id, void* ctx, const void* s, size_t len) = 0;
+    // no reply to request id before its deadline or before the
+    // connection was lost, a late reply goes to OnUnmatched
+    virtual void OnFailed(uint64_t id, void* ctx, bool timed_out) = 0;
+    virtual void OnClosed() = 0;
+    // messages without the id of a request in flight
+    virtual void OnUnmatched(const void* /*s*/, size_t /*len*/) {}
+    // a Call returned RAPTOR_SEND_WOULD_BLOCK and half of the
+    // window has become free since
+    virtual void OnWindowOpen() {}
+};
+
+// Requests and replies on one ITcpClient connection, matched by the
+// id IRpcProtocol reads from them. Every accepted request ends in
+// exactly one OnReply or OnFailed, a request whose send failed times
+// out unless the connection is lost first. Requests in flight at
+// Shutdown are dropped without a callback.
+class RAPTOR_API IRpcClient {
+public:
+    virtual ~IRpcClient() {}
+    virtual bool Init(const RpcClientOptions* options) = 0;
+    // proto must also implement IRpcProtocol
+    virtual bool SetProtocol(IProtocol* proto) = 0;
+    virtual bool Connect(const char* addr, size_t timeout_ms) = 0;
+    // Sends data, a whole request carrying id, and waits timeout_ms
+    // for its reply, 0 means default_timeout_ms. Returns
+    // RAPTOR_SEND_OK, RAPTOR_SEND_FAILED when not connected or if id
+    // is in flight already, or RAPTOR_SEND_WOULD_BLOCK while
+    // max_in_flight requests are.
+    virtual int Call(uint64_t id, const void* data, size_t len, size_t timeout_ms, void* ctx) = 0;
+    // Like Call for each request, in one gather write. Returns how many
+    // of the first requests were accepted, it stops at the first one
+    // refused.
+    virtual size_t CallBatch(const RpcRequest* requests, size_t count) = 0;
+    virtual size_t GetInFlight() = 0;
+    virtual void Shutdown() = 0;
+};
+
+class IUdpReceiver {
+public:
+    virtual ~IUdpReceiver() {}
+    // Called on the reactor thread that read the datagram, peer and
+    // s are only valid during the call.
+    virtual void OnDatagramReceived(const UdpPeer* peer, const void* s, size_t len) = 0;
+};
+
+// Datagram sockets bound to one address and read by their own
+// reactor threads. A client binds port 0 and uses SendTo.
+class RAPTOR_API IUdpServer {
+public:
+    virtual ~IUdpServer() {}
+    virtual bool Init(const UdpOptions* options) = 0;
+    // "host:port", once before Start. Port 0 picks a free one.
+    virtual bool Bind(const char* addr) = 0;
+    virtual bool Start() = 0;
     virtual void Shutdown() = 0;
+    // segment_size > 0 splits data into datagrams of that size, the
+    // last one may be shorter. Data is copied before this returns.
+    virtual bool SendTo(const UdpPeer* peer, const void* data, size_t len, size_t segment_size) = 0;
+    // returns the number of datagrams sent, in order
+    virtual size_t SendBatch(const UdpDatagram* datagrams, size_t count) = 0;
+    // fills peer from "host:port", may block on a name lookup
+    virtual bool ResolvePeer(const char* addr, UdpPeer* peer) = 0;
+    // the bound port, 0 before Bind
+    virtual int GetLocalPort() = 0;
+    virtual void GetStats(UdpStats* stats) = 0;
 };
 }
 
@@ -29,20 +29,506 @@ extern "C" {
 typedef uint64_t ConnectionId;
 typedef uint64_t raptor_connection_t;
 
+// Socket options of accepted connections and of the listening sockets.
+// Each field left at 0 keeps the default.
+typedef struct {
+    // non-zero: keep Nagle's algorithm, by default TCP_NODELAY is set
+    size_t nagle;
+    // SO_SNDBUF and SO_RCVBUF, 0 keeps the system default
+    size_t send_buffer_size;
+    size_t recv_buffer_size;
+    // non-zero: TCP_QUICKACK, re-armed after every read since the
+    // kernel leaves quick ack mode on its own (linux)
+    size_t quickack;
+    // TCP_DEFER_ACCEPT: a connection is accepted once its first bytes
+    // arrive, or after this many seconds (linux)
+    size_t defer_accept_seconds;
+    // TCP_FASTOPEN queue length of the listening sockets, 0 disables
+    // it. Windows only turns it on or off.
+    size_t fastopen_queue;
+    // listen backlog, 0 means the system maximum
+    size_t listen_backlog;
+    // TCP_USER_TIMEOUT, 0 means 20000. Windows uses TCP_MAXRT
+    // rounded up to seconds.
+    size_t user_timeout_ms;
+    // non-zero: SO_KEEPALIVE, the first probe goes out after this
+    // many idle seconds. The interval defaults to 75 seconds and the
+    // probe count to 9. Windows older than 10 (1703) keeps its
+    // own probe count.
+    size_t keepalive_idle_seconds;
+    size_t keepalive_interval_seconds;
+    size_t keepalive_count;
+    // SO_BUSY_POLL in microseconds with SO_PREFER_BUSY_POLL: a read
+    // polls the device queue for that long before sleeping. Values
+    // above net.core.busy_read need CAP_NET_ADMIN, refused values are
+    // ignored (linux 5.11+).
+    size_t busy_poll_us;
+} raptor_socket_profile_t;
+
+typedef raptor_socket_profile_t SocketProfile;
+
 typedef struct {
     size_t max_connections;
     size_t send_recv_timeout;
     size_t connection_timeout;
+    // per connection, 0 means unlimited. Bursts of up to one second
+    // worth of packages are allowed (linux).
     size_t max_package_per_second;
+    // number of send/recv reactors, 0 means the number of cpu cores
+    size_t reactor_threads;
+    // non-zero: a reactor is one thread owning both directions of its
+    // connections in a single epoll, instead of a recv and a send
+    // thread with one epoll each (linux)
+    size_t single_epoll;
+    // completion port concurrency, the number of reactor threads the
+    // kernel lets run at once, 0 means the number of cpu cores (windows)
+    size_t iocp_concurrency;
+    // non-zero: connections send and receive with Registered I/O,
+    // falls back to overlapped I/O where RIO is missing (windows 8+)
+    size_t registered_io;
+    // non-zero: an idle connection only has a zero-byte WSARecv posted,
+    // it holds no receive buffer. Once it completes the data is read
+    // without waiting into slices taken as needed. Ignored with
+    // registered_io (windows).
+    size_t zero_byte_recv;
+    // non-zero: each reactor accepts on its own SO_REUSEPORT socket (linux)
+    size_t reuse_port_listening;
+    // non-zero: the reactor threads accept and keep their connections,
+    // there is no listen thread. A listening socket is polled by every
+    // reactor with EPOLLEXCLUSIVE, or by its own reactor with
+    // reuse_port_listening (linux 4.5+).
+    size_t reactor_accept;
+    // non-zero: a connection is served by the reactor pinned to the cpu
+    // that received its SYN, usually the cpu of its NIC receive queue.
+    // With reuse_port_listening a classic BPF program steers it to that
+    // reactor's socket (linux 4.6+), otherwise the reactor is picked by
+    // SO_INCOMING_CPU once accepted. Meant for reactor_cpus listing one
+    // cpu per reactor, a cpu without a reactor is mapped to reactor
+    // cpu % reactor_threads (linux).
+    size_t cpu_steering;
+    // non-zero: a reactor keeps polling without blocking for this many
+    // microseconds before it sleeps in epoll_wait, trading a busy cpu
+    // for the wakeup latency. Also the default of
+    // socket_profile.busy_poll_us (linux).
+    size_t busy_poll_us;
+    // events a reactor takes per wakeup, 0 means 100 (linux)
+    size_t epoll_events;
+    // max number of sockets accepted per wakeup, 0 means default (64)
+    size_t accept_batch_size;
+    // AcceptEx calls kept outstanding on each listening socket, each
+    // with a socket created in advance, 0 means 16 (windows)
+    size_t pending_accepts;
+    // slices of at least this size are sent with MSG_ZEROCOPY (linux),
+    // 0 disables zero-copy sending
+    size_t zerocopy_threshold;
+    // sends shorter than this are not encoded by the codec (see
+    // ITcpServer::SetCodec), 0 means 512 (linux)
+    size_t codec_threshold;
+    // packages longer than this are handed over in pieces as they are
+    // read, see IServerReceiver::OnMessageBegin. They are never
+    // buffered whole, nor decoded by the codec. 0 disables it (linux).
+    size_t stream_threshold;
+    // cpu affinity of the reactor, listener and dispatch threads,
+    // NULL leaves them unpinned. "0-3,8" pins the i-th thread to
+    // the i-th cpu of the list, "node1" keeps the threads on the
+    // cpus of numa node 1. Only read during initialization.
+    const char* reactor_cpus;
+    const char* listener_cpus;
+    const char* dispatch_cpus;
+    // number of threads running the server callbacks, 0 means 1.
+    // The callbacks of one connection always run in order on the
+    // same thread, different connections may run in parallel (linux).
+    size_t dispatch_threads;
+    // non-zero: the server callbacks run directly on the thread that
+    // produced the event (reactor, listener or timeout check), without
+    // the dispatch queue. The callbacks must not block (linux).
+    size_t inline_dispatch;
+    // messages and bytes waiting for one dispatch thread above which
+    // the connection posting to it stops being read, 0 means
+    // unbounded. Reading resumes once the queue has drained to half
+    // of both bounds, OnOverload and OnRecovered tell about the first
+    // overloaded thread and the last one to recover (linux).
+    size_t max_dispatch_queue_depth;
+    size_t max_dispatch_queue_bytes;
+    // bytes queued in a connection's send buffer above which sending
+    // reports would-block, 0 means unlimited. OnWritable is called
+    // once the buffer drains to send_low_watermark, 0 means half of
+    // the high watermark (linux).
+    size_t send_high_watermark;
+    size_t send_low_watermark;
+    // RAPTOR_RATE_LIMIT_DROP (default), _PAUSE or _CLOSE
+    size_t rate_limit_policy;
+    // non-zero: record the queue_delay and callback_time histograms
+    // of raptor_stats_t, costs two clock reads per message (linux)
+    size_t record_latency;
+    // non-zero: a callback on a dispatch thread running longer than
+    // this many microseconds is reported to OnSlowCallback and counted
+    // in slow_callbacks, and the message callbacks of each connection
+    // are averaged in raptor_conn_info_t. Costs a read of the clock and
+    // of the thread's cpu clock before and after each callback (linux).
+    size_t slow_callback_us;
+    // non-zero: sends made by the server callbacks are held in the
+    // connection's send buffer and leave together in one gather write
+    // once the dispatch thread runs out of messages, or this many
+    // microseconds after the first held send (linux). With
+    // inline_dispatch they leave after the read that produced them.
+    size_t cork_window_us;
+    // bytes read from one connection per readiness event, a connection
+    // reaching it is polled again behind the other ready connections
+    // of its reactor, or on windows has its next read queued behind
+    // the other completions, 0 means 256KB
+    size_t recv_budget;
+    // a connection without activity for this long gives back the
+    // spare capacity of its buffers, 0 means 30 (linux)
+    size_t idle_compact_seconds;
+    // bytes all connections of the server may hold in their receive
+    // and send buffers plus the messages waiting for dispatch, 0 means
+    // unlimited. Above it buffer_memory_policy applies, paused reads
+    // resume once the total has drained to 7/8 of it (linux).
+    size_t max_buffer_memory;
+    // RAPTOR_MEMORY_PAUSE_READS (default), _REJECT_SENDS or _CLOSE_LARGEST
+    size_t buffer_memory_policy;
+    // non-null: the bytes of accepted connections are recorded with their
+    // time into this file, a ring per reactor keeping the last
+    // capture_max_bytes between them (0 means 64MB). capture_sample records 1 connection in N, 0 or 1
+    // records all of them. TLS handshakes and the bytes of SendFile are
+    // not recorded. benchmarks/replay.cc replays a capture. Only read
+    // during initialization (linux).
+    const char* capture_file;
+    size_t capture_max_bytes;
+    size_t capture_sample;
+    // socket options applied to every accepted connection
+    raptor_socket_profile_t socket_profile;
 } raptor_options_t;
 
 typedef raptor_options_t RaptorOptions;
 
+// how ITcpEndpointPool::Send picks a connection
+#define RAPTOR_BALANCE_ROUND_ROBIN  0
+// the connection with the fewest bytes in its send buffer
+#define RAPTOR_BALANCE_LEAST_QUEUED 1
+
+typedef struct {
+    // connections kept open to the endpoint, 0 means 4
+    size_t connections;
+    // 0 means 5000
+    size_t connect_timeout_ms;
+    // A lost connection is reopened after a delay that doubles with
+    // every failed attempt, from backoff_initial_ms (0 means 100) up
+    // to backoff_max_ms (0 means 30000). Each delay is picked at
+    // random between half of it and all of it.
+    size_t backoff_initial_ms;
+    size_t backoff_max_ms;
+    // messages kept while no connection is open, 0 means 4MB
+    size_t max_buffered_bytes;
+    // RAPTOR_BALANCE_ROUND_ROBIN (default) or _LEAST_QUEUED
+    size_t balance;
+} raptor_endpoint_pool_options_t;
+
+typedef raptor_endpoint_pool_options_t EndpointPoolOptions;
+
+typedef struct {
+    // requests waiting for their reply, 0 means 1024
+    size_t max_in_flight;
+    // deadline of a request that brings none, 0 means 5000
+    size_t default_timeout_ms;
+} raptor_rpc_client_options_t;
+
+typedef raptor_rpc_client_options_t RpcClientOptions;
+
+// one request of IRpcClient::CallBatch, see IRpcClient::Call
+typedef struct {
+    uint64_t id;
+    const void* data;
+    size_t len;
+    size_t timeout_ms;
+    void* ctx;
+} raptor_rpc_request_t;
+
+typedef raptor_rpc_request_t RpcRequest;
+
+typedef struct {
+    // sockets bound to the same address with SO_REUSEPORT, one per
+    // reactor thread (linux), 0 means the number of cpu cores
+    size_t reactor_threads;
+    // datagrams read per recvmmsg call, 0 means 32 (linux)
+    size_t recv_batch;
+    // longer datagrams are dropped, 0 means 65507
+    size_t max_datagram_size;
+    // SO_RCVBUF and SO_SNDBUF, 0 keeps the system default
+    size_t socket_buffer_size;
+    // non-zero: receive with UDP_GRO, coalesced datagrams are split
+    // again before the callback (linux 5.0+)
+    size_t enable_gro;
+    // non-zero: a SendTo with a segment size goes to the kernel as
+    // one UDP_SEGMENT send (linux 4.18+)
+    size_t enable_gso;
+} raptor_udp_options_t;
+
+typedef raptor_udp_options_t UdpOptions;
+
+// a UDP peer, a struct sockaddr_in or sockaddr_in6
+typedef struct {
+    char addr[128];
+    uint32_t len;
+} raptor_udp_peer_t;
+
+typedef raptor_udp_peer_t UdpPeer;
+
+// one datagram of IUdpServer::SendBatch
+typedef struct {
+    const raptor_udp_peer_t* peer;
+    const void* data;
+    size_t len;
+} raptor_udp_datagram_t;
+
+typedef raptor_udp_datagram_t UdpDatagram;
+
+// UDP counters since Start, see IUdpServer::GetStats
+typedef struct {
+    uint64_t datagrams_received;
+    uint64_t bytes_received;
+    uint64_t datagrams_sent;
+    uint64_t bytes_sent;
+    uint64_t truncated;         // received datagrams over max_datagram_size
+    uint64_t recv_errors;
+    uint64_t send_errors;       // a full socket buffer included
+    uint64_t recv_calls;        // datagrams_received / recv_calls: batch size
+} raptor_udp_stats_t;
+
+typedef raptor_udp_stats_t UdpStats;
+
+// percentiles in nanoseconds, within 1/16th of the exact value
+typedef struct {
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} raptor_latency_t;
+
+// server counters since Start, see ITcpServer::GetStats
+typedef struct {
+    uint64_t accepted;              // connections accepted
+    uint64_t closed;                // connections closed, timeouts included
+    uint64_t timeouts;              // connections closed for being idle
+    uint64_t protocol_errors;       // connections closed by a parse error
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t messages_received;     // packages parsed
+    uint64_t messages_sent;         // sends accepted
+    uint64_t send_queued_bytes;     // now waiting in send buffers
+    uint64_t dispatch_queue_depth;  // now waiting for the dispatch threads
+    uint64_t dispatch_queue_bytes;  // their message bytes, with max_dispatch_queue_bytes
+    uint64_t overload_pauses;       // reads paused by a full dispatch queue or max_buffer_memory (linux)
+    uint64_t epoll_wakeups;         // reactor wakeups with at least one event
+    uint64_t epoll_events;          // divided by epoll_wakeups: events per wakeup
+    uint64_t accept_wakeups;        // listener wakeups (linux)
+    uint64_t accept_batched;        // sockets they accepted, divided by accept_wakeups: accepts per wakeup (linux)
+    uint64_t idle_compactions;      // connections compacted after a quiet period (linux)
+    uint64_t buffer_memory;         // now held against max_buffer_memory (linux)
+    uint64_t memory_evictions;      // connections closed by RAPTOR_MEMORY_CLOSE_LARGEST (linux)
+    uint64_t slow_callbacks;        // over slow_callback_us (linux)
+    // Alive in the process now, every server and client included.
+    // Pooled connection objects count as alive (linux).
+    uint64_t live_connection_objects;
+    uint64_t live_slices;           // refcounted payloads
+    uint64_t live_message_nodes;    // queued for dispatch
+    // Summed from running totals, no connection is visited. The objects,
+    // their buffer rings and the bytes buffered in them are included,
+    // the unused tails of the slabs behind those bytes are not (linux).
+    uint64_t connections;           // open now
+    uint64_t connection_memory;     // bytes held by them
+    uint64_t memory_per_connection; // connection_memory / connections
+    // with record_latency, not with inline_dispatch
+    raptor_latency_t queue_delay;   // from receiving a message to its dispatch
+    raptor_latency_t callback_time; // spent in one message callback
+} raptor_stats_t;
+
+typedef raptor_stats_t RaptorStats;
+
+// one connection, see ITcpServer::GetConnectionInfo
+typedef struct {
+    uint64_t bytes_received;
+    uint64_t bytes_sent;            // written to the socket
+    uint64_t messages_received;     // packages parsed
+    uint64_t messages_sent;         // sends accepted
+    uint64_t send_queued_bytes;     // now waiting in the send buffer
+    int64_t last_active;            // time() of the last receive
+    // From TCP_INFO, 0 where the kernel keeps none (unix domain
+    // sockets). Windows fills them from SIO_TCP_INFO where available,
+    // without rtt_var_us and unacked.
+    uint32_t rtt_us;                // smoothed round trip time
+    uint32_t rtt_var_us;            // its mean deviation
+    uint32_t snd_cwnd;              // congestion window, in segments
+    uint32_t snd_mss;
+    uint32_t retransmits;           // segments retransmitted so far
+    uint32_t unacked;               // segments sent but not yet acked
+    // moving average over about the last eight message callbacks, in
+    // microseconds, with slow_callback_us (linux)
+    uint32_t callback_avg_us;
+} raptor_conn_info_t;
+
+typedef raptor_conn_info_t RaptorConnInfo;
+
+// a callback over RaptorOptions::slow_callback_us, see
+// IServerReceiver::OnSlowCallback
+typedef struct {
+    raptor_connection_t connection; // for a batch, of its first message
+    size_t messages;                // in the call, 0 for other callbacks
+    size_t bytes;                   // their length as received
+    uint64_t wall_us;
+    uint64_t cpu_us;                // run on the thread, waits excluded
+} raptor_slow_callback_t;
+
+typedef raptor_slow_callback_t RaptorSlowCallback;
+
+// what a connection exceeding max_package_per_second gets
+#define RAPTOR_RATE_LIMIT_DROP  0   // excess packages are discarded
+#define RAPTOR_RATE_LIMIT_PAUSE 1   // reading stops until tokens refill
+#define RAPTOR_RATE_LIMIT_CLOSE 2   // the connection is closed
+
+// what the server does above max_buffer_memory
+#define RAPTOR_MEMORY_PAUSE_READS   0   // a connection delivering packages stops being read
+#define RAPTOR_MEMORY_REJECT_SENDS  1   // sends fail, without a later OnWritable
+#define RAPTOR_MEMORY_CLOSE_LARGEST 2   // the connections holding the most are closed
+
+// results of ITcpServer::TrySend and raptor_server_try_send
+#define RAPTOR_SEND_FAILED      0
+#define RAPTOR_SEND_OK          1
+// the send buffer is above send_high_watermark, OnWritable follows
+#define RAPTOR_SEND_WOULD_BLOCK 2
+
+// dispatch priorities of ITcpServer::SetPriority, a dispatch thread
+// takes up to 4 high, 2 normal and 1 low priority message per round
+#define RAPTOR_PRIORITY_LOW     0
+#define RAPTOR_PRIORITY_NORMAL  1
+#define RAPTOR_PRIORITY_HIGH    2
+#define RAPTOR_PRIORITY_LANES   3
+
+// one fragment of a SendV message
+typedef struct {
+    const void* base;
+    size_t len;
+} raptor_iovec;
+
+// A library-owned buffer to encode one message in place, from
+// AllocSendBuffer. data and size may be written, handle is private.
+typedef struct {
+    void* data;
+    size_t size;
+    void* handle;
+} raptor_send_buffer_t;
+
+typedef raptor_send_buffer_t SendBuffer;
+
+// called once raptor no longer references a caller-owned buffer
+// passed to a SendZeroCopy function, also when the send failed.
+typedef void (*raptor_buffer_release_callback)(const void* ptr, size_t len, void* ctx);
+
+// an open file passed to a SendFile function, a descriptor (linux)
+// or a HANDLE (windows). It must stay open until the callback.
+#ifdef _WIN32
+typedef void* raptor_file_t;
+#else
+typedef int raptor_file_t;
+#endif
+
+// called once a SendFile transfer is over, success is 0 if it failed
+// or the connection closed before the whole range went out.
+typedef void (*raptor_send_file_callback)(ConnectionId cid, int success, void* ctx);
+
+// the connection of a timer which belongs to none, see ScheduleTimer
+#define RAPTOR_NO_CONNECTION ((ConnectionId)~0ULL)
+
+// called once for every timer that is not cancelled: fired is 1 once
+// its delay is over, 0 if its connection was gone by then or the
+// server or client shut down first.
+typedef void (*raptor_timer_callback)(ConnectionId cid, uint64_t timer_id, int fired, void* ctx);
+
+// ITlsSession::Handshake results
+#define RAPTOR_TLS_HANDSHAKE_CONTINUE   0
+#define RAPTOR_TLS_HANDSHAKE_DONE       1
+#define RAPTOR_TLS_HANDSHAKE_FAILED     -1
+
+// ciphers the kernel TLS offload accepts
+#define RAPTOR_TLS_CIPHER_AES_GCM_128           51
+#define RAPTOR_TLS_CIPHER_AES_GCM_256           52
+#define RAPTOR_TLS_CIPHER_CHACHA20_POLY1305     54
+
+// The record state of one direction once the handshake is over, as
+// the TLS library reports it. AES-GCM uses 4 bytes of salt and 8 of
+// iv, ChaCha20-Poly1305 no salt and 12 bytes of iv.
+typedef struct {
+    uint16_t version;           // 0x0303 TLS 1.2, 0x0304 TLS 1.3
+    uint16_t cipher;            // RAPTOR_TLS_CIPHER_*
+    uint8_t key[32];
+    uint8_t iv[12];
+    uint8_t salt[4];
+    uint8_t rec_seq[8];         // next record sequence number, big endian
+} raptor_tls_crypto_t;
+
+typedef raptor_tls_crypto_t TlsCryptoInfo;
+
+// custom allocator, see raptor_set_allocator
+typedef void* (*raptor_malloc_func)(size_t size);
+typedef void  (*raptor_free_func)(void* ptr);
+typedef void* (*raptor_realloc_func)(void* ptr, size_t size);
+
+typedef struct {
+    int64_t  live_bytes;    // currently held
+    uint64_t allocs;        // since stats were enabled
+    uint64_t frees;
+} raptor_alloc_counter_t;
+
+typedef struct {
+    raptor_alloc_counter_t slice;       // message payloads and buffers
+    raptor_alloc_counter_t message;     // queued message nodes
+    raptor_alloc_counter_t connection;  // connection objects
+} raptor_alloc_stats_t;
+
+// tracepoints, see raptor_set_trace_callback
+#define RAPTOR_TRACE_EPOLL_WAKEUP 1   // a: events returned
+#define RAPTOR_TRACE_RECV         2   // a: connection, b: bytes read
+#define RAPTOR_TRACE_SEND         3   // a: connection, b: bytes written
+#define RAPTOR_TRACE_PACKAGE      4   // a: connection, b: package length
+#define RAPTOR_TRACE_ENQUEUE      5   // a: connection, b: message type
+#define RAPTOR_TRACE_DEQUEUE      6   // a: connection, b: message type
+#define RAPTOR_TRACE_CONNECTED    7   // a: connection
+#define RAPTOR_TRACE_CLOSED       8   // a: connection
+
+typedef void (*raptor_trace_callback)(int point, uint64_t a, uint64_t b);
+
 // server callback
 typedef void (*raptor_server_callback_connection_arrived)(raptor_connection_t c);
 typedef void (*raptor_server_callback_connection_closed)(raptor_connection_t c);
 typedef void (*raptor_server_callback_message_received)(raptor_connection_t c, const void* buffer, size_t length);
 
+// A received message, only valid during the callback unless it is
+// kept with raptor_message_retain. handle is private.
+typedef struct {
+    raptor_connection_t connection;
+    const void* data;
+    size_t length;
+    void* handle;
+} raptor_message_t;
+
+// The bytes of a message kept past its callback, valid until
+// raptor_slice_release. handle is private.
+typedef struct {
+    const void* data;
+    size_t length;
+    void* handle;
+} raptor_slice_t;
+
+typedef void (*raptor_server_callback_messages_received)(const raptor_message_t* msgs, size_t count);
+typedef void (*raptor_server_callback_connection_writable)(raptor_connection_t c);
+typedef void (*raptor_server_callback_send_completed)(
+    raptor_connection_t c, const uint64_t* tokens, size_t count);
+// 1 when reading is paused by a full dispatch queue, 0 on recovery
+typedef void (*raptor_server_callback_overload)(int overloaded);
+
 // client callback
 typedef void (*raptor_client_callback_connect_result)(int result);
 typedef void (*raptor_client_callback_connection_closed)();
@@ -0,0 +1,54 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_EXPORT_UDP_SERVER__
+#define __RAPTOR_EXPORT_UDP_SERVER__
+
+#include "raptor/export.h"
+#include "raptor/service.h"
+
+namespace raptor {
+class UdpEngine;
+class RAPTOR_API UdpServer : public IUdpServer {
+public:
+    explicit UdpServer(IUdpReceiver* service);
+    ~UdpServer();
+
+    UdpServer(const UdpServer&) = delete;
+    UdpServer& operator= (const UdpServer&) = delete;
+
+    bool Init(const UdpOptions* options) override;
+    bool Bind(const char* addr) override;
+    bool Start() override;
+    void Shutdown() override;
+    bool SendTo(const UdpPeer* peer, const void* data, size_t len, size_t segment_size) override;
+    size_t SendBatch(const UdpDatagram* datagrams, size_t count) override;
+    bool ResolvePeer(const char* addr, UdpPeer* peer) override;
+    int GetLocalPort() override;
+    void GetStats(UdpStats* stats) override;
+
+private:
+    UdpEngine* _impl;
+};
+
+} // namespace raptor
+
+RAPTOR_API raptor::IUdpServer* RaptorCreateUdpServer(raptor::IUdpReceiver* s);
+RAPTOR_API void RaptorReleaseUdpServer(raptor::IUdpServer* server);
+
+#endif  // __RAPTOR_EXPORT_UDP_SERVER__
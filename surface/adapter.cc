@@ -30,7 +30,14 @@
 #include "util/useful.h"
 
 RaptorServerAdapter::RaptorServerAdapter()
-    : _impl(std::make_shared<raptor::TcpServer>(this)) {
+    : _impl(std::make_shared<raptor::TcpServer>(this))
+    , _on_arrived_cb(nullptr)
+    , _on_message_received_cb(nullptr)
+    , _on_closed_cb(nullptr)
+    , _on_messages_received_cb(nullptr)
+    , _on_writable_cb(nullptr)
+    , _on_send_completed_cb(nullptr)
+    , _on_overload_cb(nullptr) {
 }
 
 RaptorServerAdapter::~RaptorServerAdapter() {}
@@ -48,6 +55,24 @@ void RaptorServerAdapter::SetProtocol(raptor::IProtocol* proto) {
     _impl->SetProtocol(proto);
 }
 
+bool RaptorServerAdapter::SetTlsProvider(raptor::ITlsProvider* tls) {
+    raptor_error e = _impl->SetTlsProvider(tls);
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("server adapter: set tls provider (%s)", e->ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
+bool RaptorServerAdapter::SetCodec(raptor::IMessageCodec* codec) {
+    raptor_error e = _impl->SetCodec(codec);
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("server adapter: set codec (%s)", e->ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
 bool RaptorServerAdapter::AddListening(const char* addr) {
     raptor_error e = _impl->AddListening(addr);
     if (e != RAPTOR_ERROR_NONE) {
@@ -57,6 +82,24 @@ bool RaptorServerAdapter::AddListening(const char* addr) {
     return true;
 }
 
+size_t RaptorServerAdapter::GetListeningFds(int* fds, size_t count) {
+    if (!fds && count > 0) return 0;
+    return _impl->GetListeningFds(fds, count);
+}
+
+bool RaptorServerAdapter::AdoptListening(int fd) {
+    raptor_error e = _impl->AdoptListening(fd);
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("server adapter: adopt listening (%s)", e->ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
+void RaptorServerAdapter::Drain() {
+    _impl->Drain();
+}
+
 bool RaptorServerAdapter::Start() {
     raptor_error e = _impl->Start();
     if (e != RAPTOR_ERROR_NONE) {
@@ -84,10 +127,78 @@ bool RaptorServerAdapter::SendWithHeader(
     return _impl->SendWithHeader(cid, hdr, hdr_len, data, data_len);
 }
 
+int RaptorServerAdapter::TrySend(
+    ConnectionId cid, const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
+    if ((!hdr || hdr_len == 0) && (!data || data_len == 0)) {
+        return RAPTOR_SEND_FAILED;
+    }
+    return _impl->TrySendWithHeader(cid, hdr, hdr_len, data, data_len);
+}
+
+bool RaptorServerAdapter::SendV(ConnectionId cid, const raptor_iovec* iov, size_t count) {
+    if (!iov || count == 0) {
+        return false;
+    }
+    return _impl->SendV(cid, iov, count);
+}
+
+int RaptorServerAdapter::SendWithToken(ConnectionId cid, const raptor_iovec* iov, size_t count, uint64_t token) {
+    if (!iov || count == 0) {
+        return RAPTOR_SEND_FAILED;
+    }
+    return _impl->SendWithToken(cid, iov, count, token);
+}
+
+bool RaptorServerAdapter::AllocSendBuffer(ConnectionId cid, size_t size, SendBuffer* buf) {
+    if (!buf || size == 0) {
+        return false;
+    }
+    return _impl->AllocSendBuffer(cid, size, buf);
+}
+
+bool RaptorServerAdapter::CommitSend(ConnectionId cid, SendBuffer* buf, size_t used) {
+    if (!buf) {
+        return false;
+    }
+    return _impl->CommitSend(cid, buf, used);
+}
+
+size_t RaptorServerAdapter::Broadcast(
+    const ConnectionId* cids, size_t count, const void* data, size_t len) {
+    return _impl->Broadcast(cids, count, data, len);
+}
+
+bool RaptorServerAdapter::SendZeroCopy(ConnectionId cid,
+    const void* ptr, size_t len, raptor_buffer_release_callback release, void* ctx) {
+    return _impl->SendZeroCopy(cid, ptr, len, release, ctx);
+}
+
+bool RaptorServerAdapter::SendFile(ConnectionId cid, raptor_file_t file,
+    uint64_t offset, uint64_t length, raptor_send_file_callback done, void* ctx) {
+    return _impl->SendFile(cid, file, offset, length, done, ctx);
+}
+
 bool RaptorServerAdapter::CloseConnection(ConnectionId cid) {
     return _impl->CloseConnection(cid);
 }
 
+void RaptorServerAdapter::GetStats(RaptorStats* stats) {
+    _impl->GetStats(stats);
+}
+
+bool RaptorServerAdapter::GetConnectionInfo(ConnectionId id, RaptorConnInfo* info) {
+    return _impl->GetConnectionInfo(id, info);
+}
+
+uint64_t RaptorServerAdapter::ScheduleTimer(ConnectionId id, uint32_t delay_ms,
+    raptor_timer_callback cb, void* ctx) {
+    return _impl->ScheduleTimer(id, delay_ms, cb, ctx);
+}
+
+bool RaptorServerAdapter::CancelTimer(uint64_t timer_id) {
+    return _impl->CancelTimer(timer_id);
+}
+
 void RaptorServerAdapter::OnConnected(ConnectionId id) {
     if (_on_arrived_cb) {
         _on_arrived_cb(id);
@@ -97,6 +208,19 @@ void RaptorServerAdapter::OnConnected(ConnectionId id) {
 void RaptorServerAdapter::OnMessageReceived(ConnectionId id, const void* buff, size_t len) {
     if (_on_message_received_cb) {
         _on_message_received_cb(id, buff, len);
+    } else if (_on_messages_received_cb) {
+        raptor_message_t msg = { id, buff, len, nullptr };
+        _on_messages_received_cb(&msg, 1);
+    }
+}
+
+void RaptorServerAdapter::OnMessagesReceived(const raptor::Message* msgs, size_t count) {
+    if (_on_messages_received_cb) {
+        _on_messages_received_cb(msgs, count);
+    } else if (_on_message_received_cb) {
+        for (size_t i = 0; i < count; i++) {
+            _on_message_received_cb(msgs[i].connection, msgs[i].data, msgs[i].length);
+        }
     }
 }
 
@@ -106,6 +230,30 @@ void RaptorServerAdapter::OnClosed(ConnectionId id) {
     }
 }
 
+void RaptorServerAdapter::OnWritable(ConnectionId id) {
+    if (_on_writable_cb) {
+        _on_writable_cb(id);
+    }
+}
+
+void RaptorServerAdapter::OnSendCompleted(ConnectionId id, const uint64_t* tokens, size_t count) {
+    if (_on_send_completed_cb) {
+        _on_send_completed_cb(id, tokens, count);
+    }
+}
+
+void RaptorServerAdapter::OnOverload() {
+    if (_on_overload_cb) {
+        _on_overload_cb(1);
+    }
+}
+
+void RaptorServerAdapter::OnRecovered() {
+    if (_on_overload_cb) {
+        _on_overload_cb(0);
+    }
+}
+
 // callbacks
 void RaptorServerAdapter::SetCallbacks(
                                     raptor_server_callback_connection_arrived on_arrived,
@@ -117,6 +265,26 @@ void RaptorServerAdapter::SetCallbacks(
     _on_closed_cb = on_closed;
 }
 
+void RaptorServerAdapter::SetBatchCallback(
+                                    raptor_server_callback_messages_received on_messages_received) {
+    _on_messages_received_cb = on_messages_received;
+}
+
+void RaptorServerAdapter::SetWritableCallback(
+                                    raptor_server_callback_connection_writable on_writable) {
+    _on_writable_cb = on_writable;
+}
+
+void RaptorServerAdapter::SetSendCompletedCallback(
+                                    raptor_server_callback_send_completed on_send_completed) {
+    _on_send_completed_cb = on_send_completed;
+}
+
+void RaptorServerAdapter::SetOverloadCallback(
+                                    raptor_server_callback_overload on_overload) {
+    _on_overload_cb = on_overload;
+}
+
 // user data
 bool RaptorServerAdapter::SetUserData(ConnectionId id, void* userdata) {
     return _impl->SetUserData(id, userdata);
@@ -137,6 +305,14 @@ bool RaptorServerAdapter::GetExtendInfo(ConnectionId id, uint64_t* info) {
     return r;
 }
 
+bool RaptorServerAdapter::SetPriority(ConnectionId id, int priority) {
+    return _impl->SetPriority(id, priority);
+}
+
+bool RaptorServerAdapter::SetCodecEnabled(ConnectionId id, bool enabled) {
+    return _impl->SetCodecEnabled(id, enabled);
+}
+
 // --------------------------------
 
 RaptorClientAdapter::RaptorClientAdapter()
@@ -171,10 +347,31 @@ bool RaptorClientAdapter::Send(const void* buff, size_t len) {
     return _impl->Send(buff, len);
 }
 
+bool RaptorClientAdapter::SendV(const raptor_iovec* iov, size_t count) {
+    if (!iov || count == 0) {
+        return false;
+    }
+    return _impl->SendV(iov, count);
+}
+
+bool RaptorClientAdapter::SendZeroCopy(
+    const void* ptr, size_t len, raptor_buffer_release_callback release, void* ctx) {
+    return _impl->SendZeroCopy(ptr, len, release, ctx);
+}
+
 void RaptorClientAdapter::Shutdown() {
     _impl->Shutdown();
 }
 
+uint64_t RaptorClientAdapter::ScheduleTimer(
+    uint32_t delay_ms, raptor_timer_callback cb, void* ctx) {
+    return _impl->ScheduleTimer(delay_ms, cb, ctx);
+}
+
+bool RaptorClientAdapter::CancelTimer(uint64_t timer_id) {
+    return _impl->CancelTimer(timer_id);
+}
+
 void RaptorClientAdapter::OnConnectResult(bool success) {
     if (_on_connect_result_cb) {
         _on_connect_result_cb(success ? 1 : 0);
@@ -29,7 +29,7 @@ class TcpServer;
 class TcpClient;
 } // namespace raptor
 
-class RaptorServerAdapter final : public raptor::IServerReceiver
+class RaptorServerAdapter final : public raptor::IServerBatchReceiver
                                 , public raptor::ITcpServer {
 public:
     RaptorServerAdapter();
@@ -38,21 +38,47 @@ public:
     // ITcpServer impl
     bool Init(const RaptorOptions* options) override;
     void SetProtocol(raptor::IProtocol* proto) override;
+    bool SetTlsProvider(raptor::ITlsProvider* tls) override;
+    bool SetCodec(raptor::IMessageCodec* codec) override;
     bool AddListening(const char* addr) override;
+    size_t GetListeningFds(int* fds, size_t count) override;
+    bool AdoptListening(int fd) override;
+    void Drain() override;
     bool Start() override;
     void Shutdown() override;
     bool Send(ConnectionId cid, const void* buff, size_t len) override;
     bool SendWithHeader(ConnectionId cid, const void* hdr, size_t hdr_len, const void* data, size_t data_len) override;
+    int TrySend(ConnectionId cid, const void* hdr, size_t hdr_len, const void* data, size_t data_len) override;
+    bool SendV(ConnectionId cid, const raptor_iovec* iov, size_t count) override;
+    int SendWithToken(ConnectionId cid, const raptor_iovec* iov, size_t count, uint64_t token) override;
+    bool AllocSendBuffer(ConnectionId cid, size_t size, SendBuffer* buf) override;
+    bool CommitSend(ConnectionId cid, SendBuffer* buf, size_t used) override;
+    size_t Broadcast(const ConnectionId* cids, size_t count, const void* data, size_t len) override;
+    bool SendZeroCopy(ConnectionId cid, const void* ptr, size_t len, raptor_buffer_release_callback release, void* ctx) override;
+    bool SendFile(ConnectionId cid, raptor_file_t file, uint64_t offset, uint64_t length, raptor_send_file_callback done, void* ctx) override;
     bool CloseConnection(ConnectionId cid) override;
     bool SetUserData(ConnectionId id, void* userdata) override;
     bool GetUserData(ConnectionId id, void** userdata) override;
     bool SetExtendInfo(ConnectionId id, uint64_t info) override;
     bool GetExtendInfo(ConnectionId id, uint64_t* info) override;
+    bool SetPriority(ConnectionId id, int priority) override;
+    bool SetCodecEnabled(ConnectionId id, bool enabled) override;
+    void GetStats(RaptorStats* stats) override;
+    bool GetConnectionInfo(ConnectionId id, RaptorConnInfo* info) override;
+    uint64_t ScheduleTimer(ConnectionId id, uint32_t delay_ms, raptor_timer_callback cb, void* ctx) override;
+    bool CancelTimer(uint64_t timer_id) override;
 
     // IServerReceiver impl
 	void OnConnected(ConnectionId id) override;
     void OnMessageReceived(ConnectionId id, const void* buff, size_t len) override;
     void OnClosed(ConnectionId id) override;
+    void OnWritable(ConnectionId id) override;
+    void OnSendCompleted(ConnectionId id, const uint64_t* tokens, size_t count) override;
+    void OnOverload() override;
+    void OnRecovered() override;
+
+    // IServerBatchReceiver impl
+    void OnMessagesReceived(const raptor::Message* msgs, size_t count) override;
 
     // callbacks (c.h)
     void SetCallbacks(
@@ -60,12 +86,20 @@ public:
                     raptor_server_callback_message_received on_message_received,
                     raptor_server_callback_connection_closed on_closed
                     );
+    void SetBatchCallback(raptor_server_callback_messages_received on_messages_received);
+    void SetWritableCallback(raptor_server_callback_connection_writable on_writable);
+    void SetSendCompletedCallback(raptor_server_callback_send_completed on_send_completed);
+    void SetOverloadCallback(raptor_server_callback_overload on_overload);
 
 private:
     std::shared_ptr<raptor::TcpServer> _impl;
     raptor_server_callback_connection_arrived _on_arrived_cb;
     raptor_server_callback_message_received   _on_message_received_cb;
     raptor_server_callback_connection_closed  _on_closed_cb;
+    raptor_server_callback_messages_received  _on_messages_received_cb;
+    raptor_server_callback_connection_writable _on_writable_cb;
+    raptor_server_callback_send_completed     _on_send_completed_cb;
+    raptor_server_callback_overload           _on_overload_cb;
 };
 
 class RaptorClientAdapter final : public raptor::ITcpClient
@@ -79,7 +113,11 @@ public:
     void SetProtocol(raptor::IProtocol* proto) override;
     bool Connect(const char* addr, size_t timeout_ms) override;
     bool Send(const void* buff, size_t len) override;
+    bool SendV(const raptor_iovec* iov, size_t count) override;
+    bool SendZeroCopy(const void* ptr, size_t len, raptor_buffer_release_callback release, void* ctx) override;
     void Shutdown() override;
+    uint64_t ScheduleTimer(uint32_t delay_ms, raptor_timer_callback cb, void* ctx) override;
+    bool CancelTimer(uint64_t timer_id) override;
 
     // IClientReceiver impl
     void OnConnectResult(bool success) override;
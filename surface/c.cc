@@ -17,15 +17,26 @@
  */
 
 #include "raptor/c.h"
+#include "raptor/framing.h"
+#include "core/async_resolver.h"
+#include "core/slice/slice.h"
 #include "core/sockaddr.h"
 #include "surface/adapter.h"
+#include "util/alloc.h"
 #include "util/atomic.h"
+#include "util/huge_page_arena.h"
 #include "util/log.h"
+#include "util/trace.h"
 #include "util/useful.h"
 
 struct raptor_server_t   { RaptorServerAdapter   * server;  };
 struct raptor_client_t   { RaptorClientAdapter   * client;  };
-struct raptor_protocol_t { RaptorProtocolAdapter * proto;   };
+struct raptor_protocol_t {
+    raptor::IProtocol* proto;
+    // one of them is set
+    RaptorProtocolAdapter* adapter;
+    raptor::FramingProtocol* framing;
+};
 
 using namespace raptor;
 static Atomic<uintptr_t> g_log_transfer(0);
@@ -41,6 +52,7 @@ int raptor_global_init() {
 }
 
 int raptor_global_cleanup() {
+    raptor::LogStopAsync();
 #ifdef _WIN32
     int status = WSACleanup();
     RAPTOR_ASSERT(status == 0);
@@ -84,6 +96,55 @@ void raptor_set_log_callback(raptor_log_callback cb) {
     }
 }
 
+int raptor_set_log_async(int enable) {
+    if (!enable) {
+        LogStopAsync();
+        return 0;
+    }
+    return LogStartAsync() ? 0 : -1;
+}
+
+uint64_t raptor_get_log_dropped_count() {
+    return LogDroppedCount();
+}
+
+int raptor_set_trace_callback(raptor_trace_callback cb) {
+    return raptor::TraceSetCallback(cb) ? 0 : -1;
+}
+
+int raptor_set_allocator(
+    raptor_malloc_func malloc_fn, raptor_free_func free_fn, raptor_realloc_func realloc_fn) {
+    return raptor::SetAllocator(malloc_fn, free_fn, realloc_fn) ? 0 : -1;
+}
+
+int raptor_enable_huge_page_arena(size_t reserve_bytes, int prefault) {
+    return static_cast<int>(raptor::HugePageArena::Enable(reserve_bytes, prefault != 0));
+}
+
+void raptor_enable_alloc_stats(int enable) {
+    raptor::EnableAllocStats(enable != 0);
+}
+
+int raptor_get_alloc_stats(raptor_alloc_stats_t* stats) {
+    if (!stats) return -1;
+    raptor::AllocTagStats tags[static_cast<int>(raptor::AllocTag::kCount)];
+    raptor::GetAllocStats(tags);
+    raptor_alloc_counter_t* out[] = {&stats->slice, &stats->message, &stats->connection};
+    for (int i = 0; i < static_cast<int>(raptor::AllocTag::kCount); i++) {
+        out[i]->live_bytes = tags[i].live_bytes;
+        out[i]->allocs = tags[i].allocs;
+        out[i]->frees = tags[i].frees;
+    }
+    return 0;
+}
+
+int raptor_set_resolver_cache_ttl(int positive_seconds, int negative_seconds) {
+    if (positive_seconds < 0 || negative_seconds < 0) return -1;
+    raptor::AsyncResolver::Instance()->SetCacheTtl(
+        positive_seconds * 1000LL, negative_seconds * 1000LL);
+    return 0;
+}
+
 // ---- server ----
 raptor_server_t*
     raptor_server_create(const raptor_options_t* options) {
@@ -116,6 +177,28 @@ int raptor_server_listening(raptor_server_t* s, const char* address) {
     return 0;
 }
 
+size_t raptor_server_get_listening_fds(raptor_server_t* s, int* fds, size_t count) {
+    if (s) {
+        return s->server->GetListeningFds(fds, count);
+    }
+    return 0;
+}
+
+int raptor_server_adopt_listening(raptor_server_t* s, int fd) {
+    if (s) {
+        return s->server->AdoptListening(fd) ? 1 : 0;
+    }
+    return 0;
+}
+
+int raptor_server_drain(raptor_server_t* s) {
+    if (s) {
+        s->server->Drain();
+        return 1;
+    }
+    return 0;
+}
+
 int raptor_server_shutdown(raptor_server_t* s) {
     if (s) {
         s->server->Shutdown();
@@ -137,6 +220,29 @@ int raptor_server_set_callbacks(
     return 0;
 }
 
+int raptor_server_set_batch_callback(
+                                raptor_server_t* s,
+                                raptor_server_callback_messages_received on_messages_received
+                                ) {
+    if (s) {
+        s->server->SetBatchCallback(on_messages_received);
+        return 1;
+    }
+    return 0;
+}
+
+int raptor_message_retain(const raptor_message_t* msg, raptor_slice_t* slice) {
+    if (!msg || !slice) return 0;
+    raptor::RetainSliceRef(msg->data, msg->length, msg->handle, slice);
+    return 1;
+}
+
+void raptor_slice_release(raptor_slice_t* slice) {
+    if (slice) {
+        raptor::ReleaseSliceRef(slice);
+    }
+}
+
 int raptor_server_send(
     raptor_server_t* s,
     raptor_connection_t c, const void* data, size_t len) {
@@ -157,6 +263,125 @@ int raptor_server_send_with_header(
     return 0;
 }
 
+int raptor_server_send_v(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                const raptor_iovec* iov, size_t count) {
+    if (s) {
+        return s->server->SendV(c, iov, count) ? 1 : 0;
+    }
+    return 0;
+}
+
+int raptor_server_send_with_token(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                const raptor_iovec* iov, size_t count, uint64_t token) {
+    if (s) {
+        return s->server->SendWithToken(c, iov, count, token);
+    }
+    return RAPTOR_SEND_FAILED;
+}
+
+int raptor_server_alloc_send_buffer(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                size_t size, raptor_send_buffer_t* buf) {
+    if (s) {
+        return s->server->AllocSendBuffer(c, size, buf) ? 1 : 0;
+    }
+    return 0;
+}
+
+int raptor_server_commit_send(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                raptor_send_buffer_t* buf, size_t used) {
+    if (s) {
+        return s->server->CommitSend(c, buf, used) ? 1 : 0;
+    }
+    return 0;
+}
+
+int raptor_server_try_send(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                const void* header, size_t header_size,
+                                const void* data, size_t data_size) {
+    if (s) {
+        return s->server->TrySend(c, header, header_size, data, data_size);
+    }
+    return RAPTOR_SEND_FAILED;
+}
+
+size_t raptor_server_broadcast(
+                                raptor_server_t* s,
+                                const raptor_connection_t* cs, size_t count,
+                                const void* data, size_t len) {
+    if (s && cs) {
+        return s->server->Broadcast(cs, count, data, len);
+    }
+    return 0;
+}
+
+int raptor_server_send_zerocopy(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                const void* data, size_t len,
+                                raptor_buffer_release_callback release, void* ctx) {
+    if (s) {
+        return s->server->SendZeroCopy(c, data, len, release, ctx) ? 1 : 0;
+    }
+    if (release) {
+        release(data, len, ctx);
+    }
+    return 0;
+}
+
+int raptor_server_send_file(
+                                raptor_server_t* s,
+                                raptor_connection_t c,
+                                raptor_file_t file, uint64_t offset, uint64_t len,
+                                raptor_send_file_callback done, void* ctx) {
+    if (s) {
+        return s->server->SendFile(c, file, offset, len, done, ctx) ? 1 : 0;
+    }
+    if (done) {
+        done(c, 0, ctx);
+    }
+    return 0;
+}
+
+int raptor_server_set_writable_callback(
+                                raptor_server_t* s,
+                                raptor_server_callback_connection_writable on_writable) {
+    if (s) {
+        s->server->SetWritableCallback(on_writable);
+        return 1;
+    }
+    return 0;
+}
+
+int raptor_server_set_send_completed_callback(
+                                raptor_server_t* s,
+                                raptor_server_callback_send_completed on_send_completed) {
+    if (s) {
+        s->server->SetSendCompletedCallback(on_send_completed);
+        return 1;
+    }
+    return 0;
+}
+
+int raptor_server_set_overload_callback(
+                                raptor_server_t* s,
+                                raptor_server_callback_overload on_overload) {
+    if (s) {
+        s->server->SetOverloadCallback(on_overload);
+        return 1;
+    }
+    return 0;
+}
+
 int raptor_server_set_userdata(
     raptor_server_t* s, raptor_connection_t c, void* userdata) {
     if (s) {
@@ -189,6 +414,14 @@ int raptor_server_get_extend_info(
     return 0;
 }
 
+int raptor_server_set_priority(
+    raptor_server_t* s, raptor_connection_t c, int priority) {
+    if (s) {
+        return s->server->SetPriority(c, priority) ? 1: 0;
+    }
+    return 0;
+}
+
 int raptor_server_close_connection(raptor_server_t* s, raptor_connection_t c) {
     if (s) {
         return s->server->CloseConnection(c) ? 1 : 0;
@@ -196,6 +429,37 @@ int raptor_server_close_connection(raptor_server_t* s, raptor_connection_t c) {
     return 0;
 }
 
+int raptor_server_get_stats(raptor_server_t* s, raptor_stats_t* stats) {
+    if (s && stats) {
+        s->server->GetStats(stats);
+        return 1;
+    }
+    return 0;
+}
+
+int raptor_server_get_connection_info(
+    raptor_server_t* s, raptor_connection_t c, raptor_conn_info_t* info) {
+    if (s && info) {
+        return s->server->GetConnectionInfo(c, info) ? 1 : 0;
+    }
+    return 0;
+}
+
+uint64_t raptor_server_schedule_timer(raptor_server_t* s, raptor_connection_t c,
+    uint32_t delay_ms, raptor_timer_callback cb, void* ctx) {
+    if (s) {
+        return s->server->ScheduleTimer(c, delay_ms, cb, ctx);
+    }
+    return 0;
+}
+
+int raptor_server_cancel_timer(raptor_server_t* s, uint64_t timer_id) {
+    if (s) {
+        return s->server->CancelTimer(timer_id) ? 1 : 0;
+    }
+    return 0;
+}
+
 void raptor_server_destroy(raptor_server_t* s) {
     if (s) {
         delete s->server;
@@ -258,6 +522,40 @@ int raptor_client_send(raptor_client_t* c, const void* buff, size_t len) {
     return 0;
 }
 
+int raptor_client_send_v(raptor_client_t* c, const raptor_iovec* iov, size_t count) {
+    if (c) {
+        return c->client->SendV(iov, count) ? 1 : 0;
+    }
+    return 0;
+}
+
+int raptor_client_send_zerocopy(
+    raptor_client_t* c, const void* data, size_t len,
+    raptor_buffer_release_callback release, void* ctx) {
+    if (c) {
+        return c->client->SendZeroCopy(data, len, release, ctx) ? 1 : 0;
+    }
+    if (release) {
+        release(data, len, ctx);
+    }
+    return 0;
+}
+
+uint64_t raptor_client_schedule_timer(
+    raptor_client_t* c, uint32_t delay_ms, raptor_timer_callback cb, void* ctx) {
+    if (c) {
+        return c->client->ScheduleTimer(delay_ms, cb, ctx);
+    }
+    return 0;
+}
+
+int raptor_client_cancel_timer(raptor_client_t* c, uint64_t timer_id) {
+    if (c) {
+        return c->client->CancelTimer(timer_id) ? 1 : 0;
+    }
+    return 0;
+}
+
 void raptor_client_destroy(raptor_client_t* c) {
     if (c) {
         delete c->client;
@@ -267,19 +565,64 @@ void raptor_client_destroy(raptor_client_t* c) {
 
 raptor_protocol_t* raptor_protocol_create() {
     raptor_protocol_t* p = new raptor_protocol_t;
-    p->proto = new RaptorProtocolAdapter;
+    p->adapter = new RaptorProtocolAdapter;
+    p->framing = nullptr;
+    p->proto = p->adapter;
+    return p;
+}
+
+static raptor_protocol_t* raptor_protocol_create_framing(const FramingSpec& spec) {
+    if (!framing::IsValid(spec)) {
+        return nullptr;
+    }
+    raptor_protocol_t* p = new raptor_protocol_t;
+    p->adapter = nullptr;
+    p->framing = new FramingProtocol(spec);
+    p->proto = p->framing;
     return p;
 }
 
+raptor_protocol_t* raptor_protocol_create_length_prefixed(
+                                size_t header_size, size_t offset, size_t width,
+                                int big_endian, int includes_header) {
+    return raptor_protocol_create_framing(
+        FramingProtocol::LengthPrefixedSpec(
+            header_size, offset, width, big_endian != 0, includes_header != 0));
+}
+
+raptor_protocol_t* raptor_protocol_create_varint() {
+    return raptor_protocol_create_framing(FramingProtocol::VarintSpec());
+}
+
+raptor_protocol_t* raptor_protocol_create_delimiter(
+                                const char* delimiter, size_t delimiter_size) {
+    if (!delimiter || delimiter_size > FramingSpec::kMaxDelimiterSize) {
+        return nullptr;
+    }
+    return raptor_protocol_create_framing(
+        FramingProtocol::DelimiterSpec(delimiter, delimiter_size));
+}
+
+int raptor_protocol_set_max_package_size(raptor_protocol_t* p, size_t size) {
+    if (p && p->framing) {
+        p->framing->SetMaxPackageSize(size);
+        return 1;
+    }
+    return 0;
+}
+
 void raptor_protocol_set_callbacks(
                                 raptor_protocol_t* p,
                                 raptor_protocol_callback_get_max_header_size cb1,
                                 raptor_protocol_callback_check_package_length cb3
                                 ) {
-    p->proto->SetCallbacks(cb1, cb3);
+    if (p->adapter) {
+        p->adapter->SetCallbacks(cb1, cb3);
+    }
 }
 
 void raptor_protocol_destroy(raptor_protocol_t* p) {
-    delete p->proto;
+    delete p->adapter;
+    delete p->framing;
     delete p;
 }
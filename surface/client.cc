@@ -61,10 +61,30 @@ bool Client::Send(const void* buff, size_t len) {
     return _impl->Send(buff, len);
 }
 
+bool Client::SendV(const raptor_iovec* iov, size_t count) {
+    if (!iov || count == 0) {
+        return false;
+    }
+    return _impl->SendV(iov, count);
+}
+
+bool Client::SendZeroCopy(const void* ptr, size_t len,
+        raptor_buffer_release_callback release, void* ctx) {
+    return _impl->SendZeroCopy(ptr, len, release, ctx);
+}
+
 void Client::Shutdown() {
     _impl->Shutdown();
 }
 
+uint64_t Client::ScheduleTimer(uint32_t delay_ms, raptor_timer_callback cb, void* ctx) {
+    return _impl->ScheduleTimer(delay_ms, cb, ctx);
+}
+
+bool Client::CancelTimer(uint64_t timer_id) {
+    return _impl->CancelTimer(timer_id);
+}
+
 } // namespace raptor
 
 raptor::ITcpClient* RaptorCreateClient(raptor::IClientReceiver* c) {
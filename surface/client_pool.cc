@@ -0,0 +1,162 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "raptor/client_pool.h"
+
+#ifdef _WIN32
+#include "core/windows/tcp_server.h"
+#else
+#include "core/linux/tcp_server.h"
+#endif
+
+#include "core/service.h"
+#include "util/log.h"
+#include "util/status.h"
+
+namespace raptor {
+
+// Turns the server callbacks of the outbound connections
+// into IClientPoolReceiver ones.
+class ClientPoolReceiver final : public IServerReceiver
+                               , public internal::IConnectReceiver {
+public:
+    explicit ClientPoolReceiver(IClientPoolReceiver* service) : _service(service) {}
+
+    void OnConnected(ConnectionId cid) override {
+        _service->OnConnectResult(cid, true);
+    }
+    void OnMessageReceived(ConnectionId cid, const void* s, size_t len) override {
+        _service->OnMessageReceived(cid, s, len);
+    }
+    void OnClosed(ConnectionId cid) override {
+        _service->OnClosed(cid);
+    }
+    void OnWritable(ConnectionId cid) override {
+        _service->OnWritable(cid);
+    }
+    void OnOverload() override {
+        _service->OnOverload();
+    }
+    void OnRecovered() override {
+        _service->OnRecovered();
+    }
+    void OnConnectFailed(ConnectionId cid) override {
+        _service->OnConnectResult(cid, false);
+    }
+
+private:
+    IClientPoolReceiver* _service;
+};
+
+ClientPool::ClientPool(IClientPoolReceiver* service) {
+    _receiver = new ClientPoolReceiver(service);
+    _impl = new TcpServer(_receiver);
+}
+
+ClientPool::~ClientPool() {
+    delete _impl;
+    delete _receiver;
+}
+
+bool ClientPool::Init(const RaptorOptions* options) {
+    raptor_error e = _impl->Init(options);
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("client pool: init (%s)", e->ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
+void ClientPool::SetProtocol(IProtocol* proto) {
+    _impl->SetProtocol(proto);
+}
+
+bool ClientPool::Start() {
+    raptor_error e = _impl->Start();
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("client pool: start (%s)", e->ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
+void ClientPool::Shutdown() {
+    _impl->Shutdown();
+}
+
+bool ClientPool::Connect(const char* addr, size_t timeout_ms, ConnectionId* cid) {
+    raptor_error e = _impl->Connect(addr, timeout_ms, cid);
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("client pool: connect (%s)", e->ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ClientPool::Send(ConnectionId cid, const void* buff, size_t len) {
+    if (!buff || len == 0) return false;
+    return _impl->Send(cid, buff, len);
+}
+
+bool ClientPool::SendWithHeader(ConnectionId cid,
+        const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
+    if (!hdr || hdr_len == 0) {
+        return Send(cid, data, data_len);
+    }
+    return _impl->SendWithHeader(cid, hdr, hdr_len, data, data_len);
+}
+
+int ClientPool::TrySend(ConnectionId cid,
+        const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
+    if ((!hdr || hdr_len == 0) && (!data || data_len == 0)) {
+        return RAPTOR_SEND_FAILED;
+    }
+    return _impl->TrySendWithHeader(cid, hdr, hdr_len, data, data_len);
+}
+
+bool ClientPool::CloseConnection(ConnectionId cid) {
+    return _impl->CloseConnection(cid);
+}
+
+bool ClientPool::SetUserData(ConnectionId cid, void* data) {
+    return _impl->SetUserData(cid, data);
+}
+
+bool ClientPool::GetUserData(ConnectionId cid, void** data) {
+    return _impl->GetUserData(cid, data);
+}
+
+bool ClientPool::GetSendQueueBytes(ConnectionId cid, size_t* bytes) {
+    if (!bytes) return false;
+    return _impl->GetSendQueueBytes(cid, bytes);
+}
+
+void ClientPool::GetStats(RaptorStats* stats) {
+    _impl->GetStats(stats);
+}
+
+} // namespace raptor
+
+raptor::ITcpClientPool* RaptorCreateClientPool(raptor::IClientPoolReceiver* r) {
+    if (!r) return nullptr;
+    return new raptor::ClientPool(r);
+}
+
+void RaptorReleaseClientPool(raptor::ITcpClientPool* pool) {
+    if (pool) delete pool;
+}
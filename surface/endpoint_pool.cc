@@ -0,0 +1,588 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "raptor/endpoint_pool.h"
+#include <string.h>
+#include <deque>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "raptor/client_pool.h"
+#include "core/cid.h"
+#include "core/slice/slice.h"
+#include "util/log.h"
+#include "util/sync.h"
+#include "util/thread.h"
+#include "util/time.h"
+
+namespace raptor {
+namespace {
+constexpr size_t DEFAULT_CONNECTIONS = 4;
+constexpr size_t DEFAULT_CONNECT_TIMEOUT_MS = 5000;
+constexpr size_t DEFAULT_BACKOFF_INITIAL_MS = 100;
+constexpr size_t DEFAULT_BACKOFF_MAX_MS = 30000;
+constexpr size_t DEFAULT_MAX_BUFFERED_BYTES = 4 * 1024 * 1024;
+// the reconnect thread also wakes this often on its own
+constexpr int64_t MAX_WAIT_MS = 1000;
+}  // namespace
+
+/*
+    Every slot holds one connection. A slot whose connection failed
+    or closed waits out its backoff, then the reconnect thread opens
+    a new connection for it. Slots back off independently with
+    random delays, so a restarted server is not hit by all of them
+    at once.
+
+    The ClientPool callbacks may arrive before Connect has returned
+    the cid, such results are parked in _early until the slot learns
+    its cid.
+*/
+class EndpointPoolImpl final : public IClientPoolReceiver {
+public:
+    explicit EndpointPoolImpl(IEndpointPoolReceiver* service);
+    ~EndpointPoolImpl();
+
+    bool Init(const char* addr,
+        const EndpointPoolOptions* options, const RaptorOptions* reactor_options);
+    void SetProtocol(IProtocol* proto);
+    bool Start();
+    void Shutdown();
+    bool Send(const void* hdr, size_t hdr_len, const void* data, size_t data_len);
+    size_t GetConnectedCount();
+    size_t GetBufferedBytes();
+    void GetStats(RaptorStats* stats);
+
+    // IClientPoolReceiver
+    void OnConnectResult(ConnectionId cid, bool success) override;
+    void OnMessageReceived(ConnectionId cid, const void* s, size_t len) override;
+    void OnClosed(ConnectionId cid) override;
+    void OnWritable(ConnectionId cid) override;
+
+private:
+    enum class SlotState {
+        kWaiting,
+        kConnecting,
+        kConnected
+    };
+
+    struct Slot {
+        SlotState state;
+        ConnectionId cid;
+        uint32_t failures;
+        int64_t retry_ms;
+    };
+
+    void ReconnectThread(void*);
+
+    // requires _mtx held, return true if the slot is connected
+    bool AssignConnection(size_t slot, ConnectionId cid);
+    // requires _mtx held
+    void ScheduleRetry(size_t slot);
+    // requires _mtx held, the connection for the next message
+    ConnectionId PickConnection();
+    // sends the buffered messages while a connection takes them
+    void Flush();
+
+    IEndpointPoolReceiver* _service;
+    ClientPool* _pool;
+    std::string _addr;
+    EndpointPoolOptions _options;
+
+    bool _running;
+    bool _shutdown;
+    Mutex _mtx;
+    ConditionVariable _cv;
+    Thread _thd;
+
+    std::vector<Slot> _slots;
+    std::unordered_map<ConnectionId, size_t> _slot_of;
+    // connected (true) or failed/closed results of an unassigned cid
+    std::unordered_map<ConnectionId, bool> _early;
+    size_t _next_slot;
+    size_t _connected;
+
+    std::deque<Slice> _pending;
+    size_t _pending_bytes;
+    bool _flushing;
+    bool _flush_again;
+
+    std::minstd_rand _rng;
+};
+
+EndpointPoolImpl::EndpointPoolImpl(IEndpointPoolReceiver* service)
+    : _service(service)
+    , _pool(new ClientPool(this))
+    , _running(false)
+    , _shutdown(false)
+    , _next_slot(0)
+    , _connected(0)
+    , _pending_bytes(0)
+    , _flushing(false)
+    , _flush_again(false)
+    , _rng(static_cast<uint32_t>(GetCurrentMilliseconds())) {
+    memset(&_options, 0, sizeof(_options));
+}
+
+EndpointPoolImpl::~EndpointPoolImpl() {
+    Shutdown();
+    delete _pool;
+}
+
+bool EndpointPoolImpl::Init(const char* addr,
+    const EndpointPoolOptions* options, const RaptorOptions* reactor_options) {
+    if (!addr || !options) {
+        return false;
+    }
+    _addr = addr;
+    _options = *options;
+    if (_options.connections == 0) {
+        _options.connections = DEFAULT_CONNECTIONS;
+    }
+    if (_options.connect_timeout_ms == 0) {
+        _options.connect_timeout_ms = DEFAULT_CONNECT_TIMEOUT_MS;
+    }
+    if (_options.backoff_initial_ms == 0) {
+        _options.backoff_initial_ms = DEFAULT_BACKOFF_INITIAL_MS;
+    }
+    if (_options.backoff_max_ms == 0) {
+        _options.backoff_max_ms = DEFAULT_BACKOFF_MAX_MS;
+    }
+    if (_options.backoff_max_ms < _options.backoff_initial_ms) {
+        _options.backoff_max_ms = _options.backoff_initial_ms;
+    }
+    if (_options.max_buffered_bytes == 0) {
+        _options.max_buffered_bytes = DEFAULT_MAX_BUFFERED_BYTES;
+    }
+
+    RaptorOptions ropts;
+    memset(&ropts, 0, sizeof(ropts));
+    if (reactor_options) {
+        ropts = *reactor_options;
+    }
+    if (ropts.max_connections == 0 || ropts.max_connections < _options.connections) {
+        ropts.max_connections = _options.connections;
+    }
+    if (!_pool->Init(&ropts)) {
+        return false;
+    }
+
+    _slots.resize(_options.connections);
+    for (auto& slot : _slots) {
+        slot.state = SlotState::kWaiting;
+        slot.cid = core::InvalidConnectionId;
+        slot.failures = 0;
+        slot.retry_ms = 0;
+    }
+    _thd = Thread("endpoint_pool",
+        std::bind(&EndpointPoolImpl::ReconnectThread, this, std::placeholders::_1), nullptr);
+    return true;
+}
+
+void EndpointPoolImpl::SetProtocol(IProtocol* proto) {
+    _pool->SetProtocol(proto);
+}
+
+bool EndpointPoolImpl::Start() {
+    if (_running || _shutdown || _slots.empty()) {
+        return false;
+    }
+    if (!_pool->Start()) {
+        return false;
+    }
+    _running = true;
+    _thd.Start();
+    return true;
+}
+
+void EndpointPoolImpl::Shutdown() {
+    {
+        AutoMutex g(&_mtx);
+        if (_shutdown) {
+            return;
+        }
+        _shutdown = true;
+        _cv.Signal();
+    }
+    if (_running) {
+        _thd.Join();
+        _running = false;
+    }
+    _pool->Shutdown();
+
+    AutoMutex g(&_mtx);
+    _slot_of.clear();
+    _early.clear();
+    _connected = 0;
+    _pending.clear();
+    _pending_bytes = 0;
+}
+
+bool EndpointPoolImpl::Send(
+    const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
+    if (!hdr) hdr_len = 0;
+    if (!data) data_len = 0;
+    size_t len = hdr_len + data_len;
+    if (len == 0) {
+        return false;
+    }
+
+    // a connection that closed or is above its high watermark
+    // refuses the message, then the next one is tried
+    for (size_t attempt = 0; attempt < _slots.size(); attempt++) {
+        ConnectionId cid;
+        {
+            AutoMutex g(&_mtx);
+            if (_shutdown) {
+                return false;
+            }
+            // messages must not overtake the buffered ones
+            if (!_pending.empty()) {
+                break;
+            }
+            cid = PickConnection();
+        }
+        if (cid == core::InvalidConnectionId) {
+            break;
+        }
+        if (_pool->TrySend(cid, hdr, hdr_len, data, data_len) == RAPTOR_SEND_OK) {
+            return true;
+        }
+    }
+
+    bool can_flush;
+    {
+        AutoMutex g(&_mtx);
+        if (_shutdown || _pending_bytes + len > _options.max_buffered_bytes) {
+            return false;
+        }
+        Slice s = MakeSliceByLength(len);
+        if (hdr_len > 0) {
+            memcpy(s.Buffer(), hdr, hdr_len);
+        }
+        if (data_len > 0) {
+            memcpy(s.Buffer() + hdr_len, data, data_len);
+        }
+        _pending.push_back(std::move(s));
+        _pending_bytes += len;
+        can_flush = (_connected > 0);
+    }
+    // a connection may have come up or drained meanwhile
+    if (can_flush) {
+        Flush();
+    }
+    return true;
+}
+
+size_t EndpointPoolImpl::GetConnectedCount() {
+    AutoMutex g(&_mtx);
+    return _connected;
+}
+
+size_t EndpointPoolImpl::GetBufferedBytes() {
+    AutoMutex g(&_mtx);
+    return _pending_bytes;
+}
+
+void EndpointPoolImpl::GetStats(RaptorStats* stats) {
+    _pool->GetStats(stats);
+}
+
+void EndpointPoolImpl::OnConnectResult(ConnectionId cid, bool success) {
+    {
+        AutoMutex g(&_mtx);
+        if (_shutdown) {
+            return;
+        }
+        auto it = _slot_of.find(cid);
+        if (it == _slot_of.end()) {
+            _early[cid] = success;
+            return;
+        }
+        size_t i = it->second;
+        if (!success) {
+            _slot_of.erase(it);
+            ScheduleRetry(i);
+            return;
+        }
+        _slots[i].state = SlotState::kConnected;
+        _slots[i].failures = 0;
+        _connected++;
+    }
+    _service->OnConnectionUp(cid);
+    Flush();
+}
+
+void EndpointPoolImpl::OnMessageReceived(ConnectionId cid, const void* s, size_t len) {
+    _service->OnMessageReceived(cid, s, len);
+}
+
+void EndpointPoolImpl::OnClosed(ConnectionId cid) {
+    {
+        AutoMutex g(&_mtx);
+        if (_shutdown) {
+            return;
+        }
+        auto it = _slot_of.find(cid);
+        if (it == _slot_of.end()) {
+            _early[cid] = false;
+            return;
+        }
+        size_t i = it->second;
+        _slot_of.erase(it);
+        if (_slots[i].state == SlotState::kConnected) {
+            _connected--;
+        }
+        ScheduleRetry(i);
+    }
+    _service->OnConnectionDown(cid);
+}
+
+void EndpointPoolImpl::OnWritable(ConnectionId /*cid*/) {
+    Flush();
+}
+
+void EndpointPoolImpl::ReconnectThread(void*) {
+    std::vector<size_t> due;
+    std::vector<ConnectionId> up;
+
+    _mtx.Lock();
+    while (!_shutdown) {
+        int64_t now = UpdateCoarseClock();
+        int64_t wait_ms = MAX_WAIT_MS;
+        due.clear();
+        for (size_t i = 0; i < _slots.size(); i++) {
+            Slot& slot = _slots[i];
+            if (slot.state != SlotState::kWaiting) {
+                continue;
+            }
+            if (slot.retry_ms <= now) {
+                slot.state = SlotState::kConnecting;
+                due.push_back(i);
+            } else if (slot.retry_ms - now < wait_ms) {
+                wait_ms = slot.retry_ms - now;
+            }
+        }
+        if (due.empty()) {
+            _cv.Wait(&_mtx, wait_ms);
+            continue;
+        }
+
+        // Connect only starts the connect, the callbacks
+        // may run before it returns and need _mtx
+        up.clear();
+        for (size_t i : due) {
+            _mtx.Unlock();
+            ConnectionId cid = core::InvalidConnectionId;
+            bool ok = _pool->Connect(_addr.c_str(), _options.connect_timeout_ms, &cid);
+            _mtx.Lock();
+            if (_shutdown) {
+                break;
+            }
+            if (!ok) {
+                ScheduleRetry(i);
+            } else if (AssignConnection(i, cid)) {
+                up.push_back(cid);
+            }
+        }
+        if (!up.empty()) {
+            _mtx.Unlock();
+            for (ConnectionId cid : up) {
+                _service->OnConnectionUp(cid);
+            }
+            Flush();
+            _mtx.Lock();
+        }
+    }
+    _mtx.Unlock();
+}
+
+bool EndpointPoolImpl::AssignConnection(size_t i, ConnectionId cid) {
+    Slot& slot = _slots[i];
+    auto it = _early.find(cid);
+    if (it == _early.end()) {
+        slot.cid = cid;
+        _slot_of[cid] = i;
+        return false;
+    }
+    bool connected = it->second;
+    _early.erase(it);
+    if (!connected) {
+        ScheduleRetry(i);
+        return false;
+    }
+    slot.cid = cid;
+    slot.state = SlotState::kConnected;
+    slot.failures = 0;
+    _slot_of[cid] = i;
+    _connected++;
+    return true;
+}
+
+void EndpointPoolImpl::ScheduleRetry(size_t i) {
+    Slot& slot = _slots[i];
+    uint32_t shift = (slot.failures < 20) ? slot.failures : 20;
+    uint64_t delay = static_cast<uint64_t>(_options.backoff_initial_ms) << shift;
+    if (delay > _options.backoff_max_ms) {
+        delay = _options.backoff_max_ms;
+    }
+    // "equal jitter": half of the delay is fixed, the rest random
+    uint64_t jittered = delay / 2 + _rng() % (delay - delay / 2 + 1);
+
+    slot.state = SlotState::kWaiting;
+    slot.cid = core::InvalidConnectionId;
+    slot.failures++;
+    slot.retry_ms = UpdateCoarseClock() + static_cast<int64_t>(jittered);
+    _cv.Signal();
+}
+
+ConnectionId EndpointPoolImpl::PickConnection() {
+    size_t n = _slots.size();
+    if (_connected == 0 || n == 0) {
+        return core::InvalidConnectionId;
+    }
+    ConnectionId best = core::InvalidConnectionId;
+    size_t best_slot = 0;
+    size_t best_bytes = 0;
+    for (size_t k = 0; k < n; k++) {
+        size_t i = (_next_slot + k) % n;
+        const Slot& slot = _slots[i];
+        if (slot.state != SlotState::kConnected) {
+            continue;
+        }
+        if (_options.balance != RAPTOR_BALANCE_LEAST_QUEUED) {
+            best = slot.cid;
+            best_slot = i;
+            break;
+        }
+        size_t bytes = 0;
+        if (!_pool->GetSendQueueBytes(slot.cid, &bytes)) {
+            continue;
+        }
+        if (best == core::InvalidConnectionId || bytes < best_bytes) {
+            best = slot.cid;
+            best_slot = i;
+            best_bytes = bytes;
+            if (bytes == 0) {
+                break;
+            }
+        }
+    }
+    if (best != core::InvalidConnectionId) {
+        _next_slot = best_slot + 1;
+    }
+    return best;
+}
+
+void EndpointPoolImpl::Flush() {
+    AutoMutex g(&_mtx);
+    // one thread flushes at a time so the buffered messages
+    // leave in order, the others leave it another round
+    if (_flushing) {
+        _flush_again = true;
+        return;
+    }
+    _flushing = true;
+    do {
+        _flush_again = false;
+        size_t refused = 0;
+        while (!_pending.empty() && !_shutdown && refused < _slots.size()) {
+            ConnectionId cid = PickConnection();
+            if (cid == core::InvalidConnectionId) {
+                break;
+            }
+            Slice s = _pending.front();
+            _mtx.Unlock();
+            int r = _pool->TrySend(cid, nullptr, 0, s.begin(), s.size());
+            _mtx.Lock();
+            if (r != RAPTOR_SEND_OK) {
+                // OnWritable or OnConnectionUp starts the next round
+                refused++;
+                continue;
+            }
+            refused = 0;
+            if (!_pending.empty()) {
+                _pending_bytes -= _pending.front().size();
+                _pending.pop_front();
+            }
+        }
+    } while (_flush_again && !_shutdown);
+    _flushing = false;
+}
+
+EndpointPool::EndpointPool(IEndpointPoolReceiver* service)
+    : _impl(new EndpointPoolImpl(service)) {}
+
+EndpointPool::~EndpointPool() {
+    delete _impl;
+}
+
+bool EndpointPool::Init(const char* addr,
+    const EndpointPoolOptions* options, const RaptorOptions* reactor_options) {
+    if (!_impl->Init(addr, options, reactor_options)) {
+        log_error("endpoint pool: failed to init %s", addr ? addr : "(null)");
+        return false;
+    }
+    return true;
+}
+
+void EndpointPool::SetProtocol(IProtocol* proto) {
+    _impl->SetProtocol(proto);
+}
+
+bool EndpointPool::Start() {
+    return _impl->Start();
+}
+
+void EndpointPool::Shutdown() {
+    _impl->Shutdown();
+}
+
+bool EndpointPool::Send(const void* buff, size_t len) {
+    if (!buff || len == 0) return false;
+    return _impl->Send(nullptr, 0, buff, len);
+}
+
+bool EndpointPool::SendWithHeader(
+    const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
+    return _impl->Send(hdr, hdr_len, data, data_len);
+}
+
+size_t EndpointPool::GetConnectedCount() {
+    return _impl->GetConnectedCount();
+}
+
+size_t EndpointPool::GetBufferedBytes() {
+    return _impl->GetBufferedBytes();
+}
+
+void EndpointPool::GetStats(RaptorStats* stats) {
+    _impl->GetStats(stats);
+}
+
+} // namespace raptor
+
+raptor::ITcpEndpointPool* RaptorCreateEndpointPool(raptor::IEndpointPoolReceiver* r) {
+    if (!r) return nullptr;
+    return new raptor::EndpointPool(r);
+}
+
+void RaptorReleaseEndpointPool(raptor::ITcpEndpointPool* pool) {
+    if (pool) delete pool;
+}
@@ -0,0 +1,483 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "raptor/rpc_client.h"
+#include <string.h>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "raptor/client.h"
+#include "core/timing_wheel.h"
+#include "util/log.h"
+#include "util/sync.h"
+#include "util/thread.h"
+#include "util/time.h"
+#include "util/useful.h"
+
+namespace raptor {
+namespace {
+constexpr size_t DEFAULT_MAX_IN_FLIGHT = 1024;
+constexpr size_t DEFAULT_TIMEOUT_MS = 5000;
+// deadlines are checked this often while requests are in flight
+constexpr int64_t TICK_MS = 10;
+// millisecond slots of the deadline wheel, one turn
+constexpr size_t WHEEL_SLOTS = 1024;
+// fragments of one CallBatch write
+constexpr size_t MAX_BATCH_IOV = 64;
+}  // namespace
+
+/*
+    The requests in flight live in a fixed array of max_in_flight
+    entries allocated by Init. A free list hands them out, a hash of
+    their ids finds the one a reply belongs to and a timing wheel of
+    millisecond ticks holds their deadlines. All three are kept under
+    _mtx, which is held for a few pointer updates per request and
+    never over a send or a callback.
+
+    The deadline thread sleeps while nothing is in flight.
+*/
+class RpcClientImpl final : public IClientReceiver {
+public:
+    explicit RpcClientImpl(IRpcClientReceiver* service);
+    ~RpcClientImpl();
+
+    bool Init(const RpcClientOptions* options);
+    bool SetProtocol(IProtocol* proto);
+    bool Connect(const char* addr, size_t timeout_ms);
+    int Call(uint64_t id, const void* data, size_t len, size_t timeout_ms, void* ctx);
+    size_t CallBatch(const RpcRequest* requests, size_t count);
+    size_t GetInFlight();
+    void Shutdown();
+
+    // IClientReceiver
+    void OnConnectResult(bool success) override;
+    void OnMessageReceived(const void* s, size_t len) override;
+    void OnClosed() override;
+
+private:
+    struct Pending {
+        TimingWheel::Node timer;  // timer.data points back here
+        uint64_t id;
+        void* ctx;
+        // hash chain, or free list link
+        Pending* next;
+    };
+
+    struct Failed {
+        uint64_t id;
+        void* ctx;
+    };
+
+    void DeadlineThread(void*);
+
+    // requires _mtx held, return RAPTOR_SEND_*
+    int Register(const RpcRequest& req, int64_t now);
+    // requires _mtx held
+    Pending* Find(uint64_t id);
+    // requires _mtx held, unlinks the entry of id from the hash
+    // and the wheel, nullptr if id is not in flight
+    Pending* Take(uint64_t id);
+    // requires _mtx held, return true if OnWindowOpen is due
+    bool Release(Pending* p);
+    size_t Bucket(uint64_t id) const {
+        return static_cast<size_t>((id * 0x9e3779b97f4a7c15ULL) >> _hash_shift);
+    }
+    void ReportFailed(const std::vector<Failed>& failed, bool timed_out, bool window_open);
+
+    IRpcClientReceiver* _service;
+    Client* _client;
+    IRpcProtocol* _rpc_proto;
+    RpcClientOptions _options;
+
+    bool _running;
+    bool _shutdown;
+    bool _connected;
+    Mutex _mtx;
+    ConditionVariable _cv;
+    Thread _thd;
+
+    std::unique_ptr<Pending[]> _entries;
+    Pending* _free;
+    std::vector<Pending*> _buckets;
+    uint32_t _hash_shift;
+    std::unique_ptr<TimingWheel> _wheel;
+    size_t _in_flight;
+    // a Call was refused for the full window
+    bool _blocked;
+};
+
+RpcClientImpl::RpcClientImpl(IRpcClientReceiver* service)
+    : _service(service)
+    , _client(new Client(this))
+    , _rpc_proto(nullptr)
+    , _running(false)
+    , _shutdown(false)
+    , _connected(false)
+    , _free(nullptr)
+    , _hash_shift(64)
+    , _in_flight(0)
+    , _blocked(false) {
+    memset(&_options, 0, sizeof(_options));
+}
+
+RpcClientImpl::~RpcClientImpl() {
+    Shutdown();
+    delete _client;
+}
+
+bool RpcClientImpl::Init(const RpcClientOptions* options) {
+    if (_entries) {
+        return false;
+    }
+    if (options) {
+        _options = *options;
+    }
+    if (_options.max_in_flight == 0) {
+        _options.max_in_flight = DEFAULT_MAX_IN_FLIGHT;
+    }
+    if (_options.default_timeout_ms == 0) {
+        _options.default_timeout_ms = DEFAULT_TIMEOUT_MS;
+    }
+    if (!_client->Init()) {
+        return false;
+    }
+
+    _entries.reset(new Pending[_options.max_in_flight]);
+    for (size_t i = 0; i < _options.max_in_flight; i++) {
+        _entries[i].timer.data = &_entries[i];
+        _entries[i].next = _free;
+        _free = &_entries[i];
+    }
+    // at least two buckets per entry
+    size_t buckets = 2;
+    _hash_shift = 63;
+    while (buckets < _options.max_in_flight * 2) {
+        buckets <<= 1;
+        _hash_shift--;
+    }
+    _buckets.assign(buckets, nullptr);
+    _wheel.reset(new TimingWheel(UpdateCoarseClock(), WHEEL_SLOTS));
+
+    _thd = Thread("rpc_client",
+        std::bind(&RpcClientImpl::DeadlineThread, this, std::placeholders::_1), nullptr);
+    _thd.Start();
+    _running = true;
+    return true;
+}
+
+bool RpcClientImpl::SetProtocol(IProtocol* proto) {
+    _rpc_proto = dynamic_cast<IRpcProtocol*>(proto);
+    if (!_rpc_proto) {
+        return false;
+    }
+    _client->SetProtocol(proto);
+    return true;
+}
+
+bool RpcClientImpl::Connect(const char* addr, size_t timeout_ms) {
+    if (!_running || !_rpc_proto) {
+        return false;
+    }
+    return _client->Connect(addr, timeout_ms);
+}
+
+int RpcClientImpl::Call(uint64_t id, const void* data, size_t len, size_t timeout_ms, void* ctx) {
+    if (!data || len == 0) {
+        return RAPTOR_SEND_FAILED;
+    }
+    RpcRequest req = { id, data, len, timeout_ms, ctx };
+    {
+        AutoMutex g(&_mtx);
+        int r = Register(req, UpdateCoarseClock());
+        if (r != RAPTOR_SEND_OK) {
+            return r;
+        }
+    }
+    // a failed send ends in OnFailed, by the close or the deadline
+    _client->Send(data, len);
+    return RAPTOR_SEND_OK;
+}
+
+size_t RpcClientImpl::CallBatch(const RpcRequest* requests, size_t count) {
+    if (!requests) {
+        return 0;
+    }
+    size_t accepted = 0;
+    {
+        AutoMutex g(&_mtx);
+        int64_t now = UpdateCoarseClock();
+        while (accepted < count) {
+            const RpcRequest& req = requests[accepted];
+            if (!req.data || req.len == 0 || Register(req, now) != RAPTOR_SEND_OK) {
+                break;
+            }
+            accepted++;
+        }
+    }
+    raptor_iovec iov[MAX_BATCH_IOV];
+    for (size_t base = 0; base < accepted; base += MAX_BATCH_IOV) {
+        size_t n = RAPTOR_MIN(accepted - base, MAX_BATCH_IOV);
+        for (size_t i = 0; i < n; i++) {
+            iov[i].base = requests[base + i].data;
+            iov[i].len = requests[base + i].len;
+        }
+        _client->SendV(iov, n);
+    }
+    return accepted;
+}
+
+size_t RpcClientImpl::GetInFlight() {
+    AutoMutex g(&_mtx);
+    return _in_flight;
+}
+
+void RpcClientImpl::Shutdown() {
+    {
+        AutoMutex g(&_mtx);
+        if (_shutdown) {
+            return;
+        }
+        _shutdown = true;
+        _cv.Signal();
+    }
+    if (_running) {
+        _thd.Join();
+        _running = false;
+    }
+    _client->Shutdown();
+
+    AutoMutex g(&_mtx);
+    if (_wheel) {
+        _wheel->Clear();
+    }
+    _buckets.assign(_buckets.size(), nullptr);
+    _in_flight = 0;
+    _connected = false;
+}
+
+void RpcClientImpl::OnConnectResult(bool success) {
+    {
+        AutoMutex g(&_mtx);
+        _connected = success;
+    }
+    _service->OnConnectResult(success);
+}
+
+void RpcClientImpl::OnMessageReceived(const void* s, size_t len) {
+    uint64_t id = 0;
+    if (!_rpc_proto->GetRequestId(s, len, &id)) {
+        _service->OnUnmatched(s, len);
+        return;
+    }
+    void* ctx = nullptr;
+    bool found = false;
+    bool window_open = false;
+    {
+        AutoMutex g(&_mtx);
+        Pending* p = Take(id);
+        if (p) {
+            found = true;
+            ctx = p->ctx;
+            window_open = Release(p);
+        }
+    }
+    if (!found) {
+        // timed out already, or never asked for
+        _service->OnUnmatched(s, len);
+        return;
+    }
+    _service->OnReply(id, ctx, s, len);
+    if (window_open) {
+        _service->OnWindowOpen();
+    }
+}
+
+void RpcClientImpl::OnClosed() {
+    std::vector<Failed> failed;
+    bool window_open = false;
+    {
+        AutoMutex g(&_mtx);
+        _connected = false;
+        if (_shutdown) {
+            return;
+        }
+        failed.reserve(_in_flight);
+        for (auto& head : _buckets) {
+            while (head) {
+                Pending* p = head;
+                head = p->next;
+                _wheel->Remove(&p->timer);
+                failed.push_back({p->id, p->ctx});
+                window_open = Release(p) || window_open;
+            }
+        }
+    }
+    ReportFailed(failed, false, window_open);
+    _service->OnClosed();
+}
+
+void RpcClientImpl::DeadlineThread(void*) {
+    std::vector<Failed> failed;
+    _mtx.Lock();
+    while (!_shutdown) {
+        if (_in_flight == 0) {
+            _cv.Wait(&_mtx);
+            continue;
+        }
+        failed.clear();
+        bool window_open = false;
+        _wheel->Expire(UpdateCoarseClock(), [&](TimingWheel::Node* node) {
+            Pending* p = static_cast<Pending*>(node->data);
+            Pending** link = &_buckets[Bucket(p->id)];
+            while (*link != p) {
+                link = &(*link)->next;
+            }
+            *link = p->next;
+            failed.push_back({p->id, p->ctx});
+            window_open = Release(p) || window_open;
+        });
+        if (failed.empty()) {
+            _cv.Wait(&_mtx, TICK_MS);
+            continue;
+        }
+        _mtx.Unlock();
+        ReportFailed(failed, true, window_open);
+        _mtx.Lock();
+    }
+    _mtx.Unlock();
+}
+
+int RpcClientImpl::Register(const RpcRequest& req, int64_t now) {
+    if (_shutdown || !_connected) {
+        return RAPTOR_SEND_FAILED;
+    }
+    if (!_free) {
+        _blocked = true;
+        return RAPTOR_SEND_WOULD_BLOCK;
+    }
+    if (Find(req.id)) {
+        return RAPTOR_SEND_FAILED;
+    }
+    Pending* p = _free;
+    _free = p->next;
+    p->id = req.id;
+    p->ctx = req.ctx;
+    size_t bucket = Bucket(req.id);
+    p->next = _buckets[bucket];
+    _buckets[bucket] = p;
+    size_t timeout_ms = req.timeout_ms > 0 ? req.timeout_ms : _options.default_timeout_ms;
+    _wheel->Insert(&p->timer, now + static_cast<int64_t>(timeout_ms));
+    if (_in_flight++ == 0) {
+        _cv.Signal();
+    }
+    return RAPTOR_SEND_OK;
+}
+
+RpcClientImpl::Pending* RpcClientImpl::Find(uint64_t id) {
+    Pending* p = _buckets[Bucket(id)];
+    while (p && p->id != id) {
+        p = p->next;
+    }
+    return p;
+}
+
+RpcClientImpl::Pending* RpcClientImpl::Take(uint64_t id) {
+    Pending** link = &_buckets[Bucket(id)];
+    while (*link && (*link)->id != id) {
+        link = &(*link)->next;
+    }
+    Pending* p = *link;
+    if (p) {
+        *link = p->next;
+        _wheel->Remove(&p->timer);
+    }
+    return p;
+}
+
+bool RpcClientImpl::Release(Pending* p) {
+    p->ctx = nullptr;
+    p->next = _free;
+    _free = p;
+    _in_flight--;
+    if (_blocked && _in_flight <= _options.max_in_flight / 2) {
+        _blocked = false;
+        return true;
+    }
+    return false;
+}
+
+void RpcClientImpl::ReportFailed(const std::vector<Failed>& failed, bool timed_out, bool window_open) {
+    for (const Failed& f : failed) {
+        _service->OnFailed(f.id, f.ctx, timed_out);
+    }
+    if (window_open) {
+        _service->OnWindowOpen();
+    }
+}
+
+RpcClient::RpcClient(IRpcClientReceiver* service)
+    : _impl(new RpcClientImpl(service)) {}
+
+RpcClient::~RpcClient() {
+    delete _impl;
+}
+
+bool RpcClient::Init(const RpcClientOptions* options) {
+    if (!_impl->Init(options)) {
+        log_error("rpc client: failed to init");
+        return false;
+    }
+    return true;
+}
+
+bool RpcClient::SetProtocol(IProtocol* proto) {
+    return _impl->SetProtocol(proto);
+}
+
+bool RpcClient::Connect(const char* addr, size_t timeout_ms) {
+    if (!addr) return false;
+    return _impl->Connect(addr, timeout_ms);
+}
+
+int RpcClient::Call(uint64_t id, const void* data, size_t len, size_t timeout_ms, void* ctx) {
+    return _impl->Call(id, data, len, timeout_ms, ctx);
+}
+
+size_t RpcClient::CallBatch(const RpcRequest* requests, size_t count) {
+    return _impl->CallBatch(requests, count);
+}
+
+size_t RpcClient::GetInFlight() {
+    return _impl->GetInFlight();
+}
+
+void RpcClient::Shutdown() {
+    _impl->Shutdown();
+}
+
+} // namespace raptor
+
+raptor::IRpcClient* RaptorCreateRpcClient(raptor::IRpcClientReceiver* r) {
+    if (!r) return nullptr;
+    return new raptor::RpcClient(r);
+}
+
+void RaptorReleaseRpcClient(raptor::IRpcClient* client) {
+    if (client) delete client;
+}
@@ -21,9 +21,13 @@
 #ifdef _WIN32
 #include "core/windows/tcp_server.h"
 #else
+#include <stdlib.h>
+#include <string>
+#include "core/linux/socket_setting.h"
 #include "core/linux/tcp_server.h"
 #endif
 
+#include "core/slice/slice.h"
 #include "util/log.h"
 #include "util/status.h"
 
@@ -50,6 +54,26 @@ void Server::SetProtocol(IProtocol* proto) {
     _impl->SetProtocol(proto);
 }
 
+bool Server::SetTlsProvider(ITlsProvider* tls) {
+    raptor_error e = _impl->SetTlsProvider(tls);
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("server: set tls provider (%s)", e->ToString().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool Server::SetCodec(IMessageCodec* codec) {
+    raptor_error e = _impl->SetCodec(codec);
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("server: set codec (%s)", e->ToString().c_str());
+        return false;
+    }
+
+    return true;
+}
+
 bool Server::AddListening(const char* addr) {
     if (!addr) {
         log_error("server: invalid listening addr");
@@ -65,6 +89,28 @@ bool Server::AddListening(const char* addr) {
     return true;
 }
 
+size_t Server::GetListeningFds(int* fds, size_t count) {
+    if (!fds && count > 0) {
+        log_error("server: invalid fd array");
+        return 0;
+    }
+    return _impl->GetListeningFds(fds, count);
+}
+
+bool Server::AdoptListening(int fd) {
+    raptor_error e = _impl->AdoptListening(fd);
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("server: adopt listening (%s)", e->ToString().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void Server::Drain() {
+    _impl->Drain();
+}
+
 bool Server::Start() {
     raptor_error e = _impl->Start();
     if (e != RAPTOR_ERROR_NONE) {
@@ -84,6 +130,34 @@ bool Server::Send(ConnectionId cid, const void* buff, size_t len) {
     return _impl->Send(cid, buff, len);
 }
 
+bool Server::SendV(ConnectionId cid, const raptor_iovec* iov, size_t count) {
+    if (!iov || count == 0) {
+        return false;
+    }
+    return _impl->SendV(cid, iov, count);
+}
+
+int Server::SendWithToken(ConnectionId cid, const raptor_iovec* iov, size_t count, uint64_t token) {
+    if (!iov || count == 0) {
+        return RAPTOR_SEND_FAILED;
+    }
+    return _impl->SendWithToken(cid, iov, count, token);
+}
+
+bool Server::AllocSendBuffer(ConnectionId cid, size_t size, SendBuffer* buf) {
+    if (!buf || size == 0) {
+        return false;
+    }
+    return _impl->AllocSendBuffer(cid, size, buf);
+}
+
+bool Server::CommitSend(ConnectionId cid, SendBuffer* buf, size_t used) {
+    if (!buf) {
+        return false;
+    }
+    return _impl->CommitSend(cid, buf, used);
+}
+
 bool Server::SendWithHeader(ConnectionId cid,
         const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
 
@@ -93,10 +167,42 @@ bool Server::SendWithHeader(ConnectionId cid,
     return _impl->SendWithHeader(cid, hdr, hdr_len, data, data_len);
 }
 
+int Server::TrySend(ConnectionId cid,
+        const void* hdr, size_t hdr_len, const void* data, size_t data_len) {
+    if ((!hdr || hdr_len == 0) && (!data || data_len == 0)) {
+        return RAPTOR_SEND_FAILED;
+    }
+    return _impl->TrySendWithHeader(cid, hdr, hdr_len, data, data_len);
+}
+
+size_t Server::Broadcast(const ConnectionId* cids, size_t count,
+        const void* data, size_t len) {
+    return _impl->Broadcast(cids, count, data, len);
+}
+
+bool Server::SendZeroCopy(ConnectionId cid, const void* ptr, size_t len,
+        raptor_buffer_release_callback release, void* ctx) {
+    return _impl->SendZeroCopy(cid, ptr, len, release, ctx);
+}
+
+bool Server::SendFile(ConnectionId cid, raptor_file_t file, uint64_t offset,
+        uint64_t length, raptor_send_file_callback done, void* ctx) {
+    return _impl->SendFile(cid, file, offset, length, done, ctx);
+}
+
 bool Server::CloseConnection(ConnectionId cid) {
     return _impl->CloseConnection(cid);
 }
 
+void Server::GetStats(RaptorStats* stats) {
+    _impl->GetStats(stats);
+}
+
+bool Server::GetConnectionInfo(ConnectionId id, RaptorConnInfo* info) {
+    if (!info) return false;
+    return _impl->GetConnectionInfo(id, info);
+}
+
 // user data
 bool Server::SetUserData(ConnectionId id, void* userdata) {
     return _impl->SetUserData(id, userdata);
@@ -116,6 +222,23 @@ bool Server::GetExtendInfo(ConnectionId id, uint64_t* info) {
     if (info) *info = data;
     return r;
 }
+
+bool Server::SetPriority(ConnectionId id, int priority) {
+    return _impl->SetPriority(id, priority);
+}
+
+bool Server::SetCodecEnabled(ConnectionId id, bool enabled) {
+    return _impl->SetCodecEnabled(id, enabled);
+}
+
+uint64_t Server::ScheduleTimer(ConnectionId id, uint32_t delay_ms,
+    raptor_timer_callback cb, void* ctx) {
+    return _impl->ScheduleTimer(id, delay_ms, cb, ctx);
+}
+
+bool Server::CancelTimer(uint64_t timer_id) {
+    return _impl->CancelTimer(timer_id);
+}
 } // namespace raptor
 
 raptor::ITcpServer* RaptorCreateServer(raptor::IServerReceiver* s) {
@@ -126,3 +249,99 @@ raptor::ITcpServer* RaptorCreateServer(raptor::IServerReceiver* s) {
 void RaptorReleaseServer(raptor::ITcpServer* server) {
     if (server) delete server;
 }
+
+void RaptorRetainMessage(const raptor::Message* msg, raptor::SliceRef* ref) {
+    raptor::RetainSliceRef(msg->data, msg->length, msg->handle, ref);
+}
+
+void RaptorReleaseSlice(raptor::SliceRef* ref) {
+    raptor::ReleaseSliceRef(ref);
+}
+
+#define RAPTOR_LISTEN_FDS_ENV "RAPTOR_LISTEN_FDS"
+
+#ifdef _WIN32
+bool RaptorSendListeningFds(int, const int*, size_t) {
+    log_error("server: listener handoff is not supported on windows");
+    return false;
+}
+
+size_t RaptorReceiveListeningFds(int, int*, size_t) {
+    log_error("server: listener handoff is not supported on windows");
+    return 0;
+}
+
+bool RaptorExportListeningFds(const int*, size_t) {
+    log_error("server: listener handoff is not supported on windows");
+    return false;
+}
+
+size_t RaptorInheritedListeningFds(int*, size_t) {
+    return 0;
+}
+#else
+bool RaptorSendListeningFds(int sock, const int* fds, size_t count) {
+    if (sock < 0 || (!fds && count > 0)) {
+        log_error("server: invalid parameters to send listening fds");
+        return false;
+    }
+    raptor_error e = raptor_send_fds(sock, fds, count);
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("server: send listening fds (%s)", e->ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
+size_t RaptorReceiveListeningFds(int sock, int* fds, size_t count) {
+    if (sock < 0 || (!fds && count > 0)) {
+        log_error("server: invalid parameters to receive listening fds");
+        return 0;
+    }
+    size_t n = 0;
+    raptor_error e = raptor_recv_fds(sock, fds, count, &n);
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("server: receive listening fds (%s)", e->ToString().c_str());
+    }
+    return n;
+}
+
+bool RaptorExportListeningFds(const int* fds, size_t count) {
+    if (!fds && count > 0) {
+        log_error("server: invalid fd array");
+        return false;
+    }
+    std::string list;
+    for (size_t i = 0; i < count; i++) {
+        raptor_error e = raptor_set_socket_cloexec(fds[i], 0);
+        if (e != RAPTOR_ERROR_NONE) {
+            log_error("server: export listening fds (%s)", e->ToString().c_str());
+            return false;
+        }
+        if (i > 0) list += ',';
+        list += std::to_string(fds[i]);
+    }
+    return setenv(RAPTOR_LISTEN_FDS_ENV, list.c_str(), 1) == 0;
+}
+
+size_t RaptorInheritedListeningFds(int* fds, size_t count) {
+    const char* list = getenv(RAPTOR_LISTEN_FDS_ENV);
+    if (!list) {
+        return 0;
+    }
+    size_t n = 0;
+    const char* p = list;
+    while (*p && n < count) {
+        char* end = nullptr;
+        long fd = strtol(p, &end, 10);
+        if (end == p || fd < 0) {
+            log_error("server: malformed %s", RAPTOR_LISTEN_FDS_ENV);
+            break;
+        }
+        fds[n++] = static_cast<int>(fd);
+        p = (*end == ',') ? end + 1 : end;
+    }
+    unsetenv(RAPTOR_LISTEN_FDS_ENV);
+    return n;
+}
+#endif
@@ -0,0 +1,123 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "raptor/udp_server.h"
+#include <string.h>
+
+#ifdef _WIN32
+#include "core/windows/udp_engine.h"
+#else
+#include "core/linux/udp_engine.h"
+#endif
+
+#include "core/resolve_address.h"
+#include "util/log.h"
+#include "util/status.h"
+
+namespace raptor {
+UdpServer::UdpServer(IUdpReceiver* service) {
+    _impl = new UdpEngine(service);
+}
+
+UdpServer::~UdpServer() {
+    delete _impl;
+}
+
+bool UdpServer::Init(const UdpOptions* options) {
+    raptor_error e = _impl->Init(options);
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("udp server: init (%s)", e->ToString().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool UdpServer::Bind(const char* addr) {
+    if (!addr) {
+        log_error("udp server: invalid bind addr");
+        return false;
+    }
+
+    raptor_error e = _impl->Bind(addr);
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("udp server: bind (%s)", e->ToString().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool UdpServer::Start() {
+    raptor_error e = _impl->Start();
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("udp server: start (%s)", e->ToString().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void UdpServer::Shutdown() {
+    _impl->Shutdown();
+}
+
+bool UdpServer::SendTo(const UdpPeer* peer, const void* data, size_t len, size_t segment_size) {
+    return _impl->SendTo(peer, data, len, segment_size);
+}
+
+size_t UdpServer::SendBatch(const UdpDatagram* datagrams, size_t count) {
+    return _impl->SendBatch(datagrams, count);
+}
+
+bool UdpServer::ResolvePeer(const char* addr, UdpPeer* peer) {
+    if (!addr || !peer) {
+        return false;
+    }
+
+    raptor_resolved_addresses* addrs = nullptr;
+    raptor_error e = raptor_blocking_resolve_address(addr, nullptr, &addrs);
+    if (e != RAPTOR_ERROR_NONE) {
+        log_error("udp server: resolve %s (%s)", addr, e->ToString().c_str());
+        return false;
+    }
+
+    static_assert(sizeof(peer->addr) == sizeof(addrs->addrs[0].addr), "UdpPeer size");
+    memcpy(peer->addr, addrs->addrs[0].addr, sizeof(peer->addr));
+    peer->len = addrs->addrs[0].len;
+    raptor_resolved_addresses_destroy(addrs);
+    return true;
+}
+
+int UdpServer::GetLocalPort() {
+    return _impl->GetLocalPort();
+}
+
+void UdpServer::GetStats(UdpStats* stats) {
+    if (stats) _impl->GetStats(stats);
+}
+} // namespace raptor
+
+raptor::IUdpServer* RaptorCreateUdpServer(raptor::IUdpReceiver* s) {
+    if (!s) return nullptr;
+    return new raptor::UdpServer(s);
+}
+
+void RaptorReleaseUdpServer(raptor::IUdpServer* server) {
+    if (server) delete server;
+}
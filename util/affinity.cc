@@ -0,0 +1,125 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "util/affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace raptor {
+namespace {
+
+// parse "0-3,8,10-11" into a sorted list without duplicates
+bool ParseCpuList(const char* list, std::vector<int>* cpus) {
+    const char* p = list;
+    while (*p) {
+        char* end = nullptr;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return false;
+            }
+            p = end;
+        }
+        for (long i = first; i <= last; i++) {
+            cpus->push_back(static_cast<int>(i));
+        }
+        while (*p == ' ' || *p == '\n') p++;
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            return false;
+        }
+    }
+    std::sort(cpus->begin(), cpus->end());
+    cpus->erase(std::unique(cpus->begin(), cpus->end()), cpus->end());
+    return true;
+}
+
+bool GetNodeCpus(int node, std::vector<int>* cpus) {
+#ifdef _WIN32
+    ULONGLONG mask = 0;
+    if (!GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &mask)) {
+        return false;
+    }
+    for (int i = 0; i < 64; i++) {
+        if (mask & (1ULL << i)) {
+            cpus->push_back(i);
+        }
+    }
+    return true;
+#else
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+    char buf[1024] = { 0 };
+    bool ok = fgets(buf, sizeof(buf), fp) != nullptr;
+    fclose(fp);
+    buf[strcspn(buf, "\r\n")] = '\0';
+    return ok && ParseCpuList(buf, cpus);
+#endif
+}
+} // namespace
+
+raptor_error CpuAffinity::Parse(const char* spec) {
+    _cpus.clear();
+    _node = false;
+    if (!spec || *spec == '\0') {
+        return RAPTOR_ERROR_NONE;
+    }
+
+    std::vector<int> cpus;
+    if (strncmp(spec, "node", 4) == 0) {
+        char* end = nullptr;
+        long node = strtol(spec + 4, &end, 10);
+        if (end == spec + 4 || *end != '\0' || node < 0) {
+            return RAPTOR_ERROR_FROM_FORMAT("invalid numa node: %s", spec);
+        }
+        if (!GetNodeCpus(static_cast<int>(node), &cpus) || cpus.empty()) {
+            return RAPTOR_ERROR_FROM_FORMAT("failed to get the cpus of %s", spec);
+        }
+        _node = true;
+    } else if (!ParseCpuList(spec, &cpus) || cpus.empty()) {
+        return RAPTOR_ERROR_FROM_FORMAT("invalid cpu list: %s", spec);
+    }
+    _cpus.swap(cpus);
+    return RAPTOR_ERROR_NONE;
+}
+
+std::vector<int> CpuAffinity::Select(size_t index) const {
+    if (_cpus.empty() || _node) {
+        return _cpus;
+    }
+    return std::vector<int>(1, _cpus[index % _cpus.size()]);
+}
+
+} // namespace raptor
@@ -0,0 +1,54 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_UTIL_AFFINITY__
+#define __RAPTOR_UTIL_AFFINITY__
+
+#include <stddef.h>
+#include <vector>
+#include "util/status.h"
+
+namespace raptor {
+
+/*
+    Parsed form of an affinity string:
+      "0-3,8"  a list of cpus, the i-th thread of a group
+               is pinned to the i-th cpu (wrapping around).
+      "node1"  every thread of the group may run on any
+               cpu of numa node 1.
+*/
+class CpuAffinity final {
+public:
+    CpuAffinity() : _node(false) {}
+
+    // a null or empty spec clears the affinity
+    raptor_error Parse(const char* spec);
+    bool Empty() const { return _cpus.empty(); }
+
+    // cpus the index-th thread of a group may run on,
+    // empty if the thread is not pinned.
+    std::vector<int> Select(size_t index) const;
+
+private:
+    std::vector<int> _cpus;
+    bool _node;
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_UTIL_AFFINITY__
@@ -18,12 +18,112 @@
 
 #include "util/alloc.h"
 #include <stdlib.h>
+#include <string.h>
+
+#include "util/no_destructor.h"
+#include "util/sync.h"
 
 namespace raptor {
+namespace {
+MallocFunc g_malloc = ::malloc;
+FreeFunc g_free = ::free;
+ReallocFunc g_realloc = ::realloc;
+bool g_custom_allocator = false;
+
+const int kTagCount = static_cast<int>(AllocTag::kCount);
+
+// written by the owning thread only, read by GetAllocStats
+struct ThreadCounters {
+    Atomic<int64_t> live_bytes[kTagCount];
+    Atomic<uint64_t> allocs[kTagCount];
+    Atomic<uint64_t> frees[kTagCount];
+    ThreadCounters* prev;
+    ThreadCounters* next;
+};
+
+struct Registry {
+    Mutex mtx;
+    ThreadCounters* head = nullptr;
+    AllocTagStats retired[kTagCount] = {};  // threads that have exited
+};
+
+Registry& GetRegistry() {
+    static NoDestructor<Registry> registry;
+    return *registry;
+}
+
+struct CountersHolder {
+    ThreadCounters* counters = nullptr;
+
+    ThreadCounters* Get() {
+        if (!counters) {
+            counters = new ThreadCounters;
+            Registry& r = GetRegistry();
+            AutoMutex g(&r.mtx);
+            counters->prev = nullptr;
+            counters->next = r.head;
+            if (r.head) r.head->prev = counters;
+            r.head = counters;
+        }
+        return counters;
+    }
+
+    ~CountersHolder() {
+        if (!counters) return;
+        Registry& r = GetRegistry();
+        {
+            AutoMutex g(&r.mtx);
+            for (int i = 0; i < kTagCount; i++) {
+                r.retired[i].live_bytes += counters->live_bytes[i].Load();
+                r.retired[i].allocs += counters->allocs[i].Load();
+                r.retired[i].frees += counters->frees[i].Load();
+            }
+            if (counters->prev) counters->prev->next = counters->next;
+            else r.head = counters->next;
+            if (counters->next) counters->next->prev = counters->prev;
+        }
+        delete counters;
+    }
+};
+
+ThreadCounters* LocalCounters() {
+    static thread_local CountersHolder holder;
+    return holder.Get();
+}
+} // namespace
+
+namespace internal {
+Atomic<bool> g_alloc_stats_enabled(false);
+
+void AccountAlloc(AllocTag tag, size_t bytes) {
+    ThreadCounters* c = LocalCounters();
+    int i = static_cast<int>(tag);
+    c->live_bytes[i].Store(c->live_bytes[i].Load() + static_cast<int64_t>(bytes));
+    c->allocs[i].Store(c->allocs[i].Load() + 1);
+}
+
+void AccountFree(AllocTag tag, size_t bytes) {
+    ThreadCounters* c = LocalCounters();
+    int i = static_cast<int>(tag);
+    c->live_bytes[i].Store(c->live_bytes[i].Load() - static_cast<int64_t>(bytes));
+    c->frees[i].Store(c->frees[i].Load() + 1);
+}
+} // namespace internal
+
+bool SetAllocator(MallocFunc malloc_fn, FreeFunc free_fn, ReallocFunc realloc_fn) {
+    if (!malloc_fn || !free_fn || !realloc_fn) {
+        return false;
+    }
+    g_malloc = malloc_fn;
+    g_free = free_fn;
+    g_realloc = realloc_fn;
+    g_custom_allocator = true;
+    return true;
+}
 
 void* Malloc(size_t size) {
     if (size > 0) {
-        void* ptr = ::malloc(size);
+        void* ptr = g_malloc(size);
         if (!ptr) {
             abort();
         }
@@ -34,7 +134,13 @@ void* Malloc(size_t size) {
 
 void* ZeroAlloc(size_t size) {
     if (size > 0) {
-        void* p = ::calloc(size, 1);
+        void* p = nullptr;
+        if (g_custom_allocator) {
+            p = g_malloc(size);
+            if (p) memset(p, 0, size);
+        } else {
+            p = ::calloc(size, 1);
+        }
         if (!p) {
             abort();
         }
@@ -47,7 +153,7 @@ void* Realloc(void* ptr, size_t size) {
     if ((size == 0) && (ptr == nullptr)) {
         return nullptr;
     }
-    ptr = ::realloc(ptr, size);
+    ptr = g_realloc(ptr, size);
     if (!ptr) {
         abort();
     }
@@ -55,7 +161,30 @@ void* Realloc(void* ptr, size_t size) {
 }
 
 void Free(void* ptr) {
-    if (ptr) free(ptr);
+    if (ptr) g_free(ptr);
+}
+
+void EnableAllocStats(bool enable) {
+    internal::g_alloc_stats_enabled.Store(enable, MemoryOrder::RELAXED);
+}
+
+bool AllocStatsEnabled() {
+    return internal::g_alloc_stats_enabled.Load(MemoryOrder::RELAXED);
+}
+
+void GetAllocStats(AllocTagStats stats[static_cast<int>(AllocTag::kCount)]) {
+    Registry& r = GetRegistry();
+    AutoMutex g(&r.mtx);
+    for (int i = 0; i < kTagCount; i++) {
+        stats[i] = r.retired[i];
+    }
+    for (ThreadCounters* c = r.head; c; c = c->next) {
+        for (int i = 0; i < kTagCount; i++) {
+            stats[i].live_bytes += c->live_bytes[i].Load();
+            stats[i].allocs += c->allocs[i].Load();
+            stats[i].frees += c->frees[i].Load();
+        }
+    }
 }
 
 } // namespace raptor
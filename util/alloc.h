@@ -20,14 +20,70 @@
 #define __RAPTOR_UTIL_ALLOC__
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "util/atomic.h"
 
 namespace raptor {
 
+typedef void* (*MallocFunc)(size_t size);
+typedef void  (*FreeFunc)(void* ptr);
+typedef void* (*ReallocFunc)(void* ptr, size_t size);
+
+// Replaces the functions behind Malloc, ZeroAlloc, Realloc and Free.
+// Must be called before raptor allocates anything, memory is always
+// released through the allocator it came from. Returns false if any
+// of the functions is null.
+bool SetAllocator(MallocFunc malloc_fn, FreeFunc free_fn, ReallocFunc realloc_fn);
+
 void* Malloc(size_t size);
 void* ZeroAlloc(size_t size);
 void* Realloc(void* ptr, size_t size);
 void  Free(void* ptr);
 
+// Who holds the memory, for the statistics below.
+enum class AllocTag {
+    kSlice = 0,     // slice payloads, pooled or not
+    kMessage,       // queued message nodes
+    kConnection,    // connection objects
+    kCount
+};
+
+struct AllocTagStats {
+    int64_t  live_bytes;
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+/*
+    Allocation statistics are off by default. When on, every tagged
+    allocation updates a per-thread counter with plain relaxed stores;
+    GetAllocStats sums the counters of all threads, so a snapshot is
+    approximate while other threads are allocating. Allocations per
+    second is the difference of two snapshots.
+*/
+void EnableAllocStats(bool enable);
+bool AllocStatsEnabled();
+void GetAllocStats(AllocTagStats stats[static_cast<int>(AllocTag::kCount)]);
+
+namespace internal {
+extern Atomic<bool> g_alloc_stats_enabled;
+void AccountAlloc(AllocTag tag, size_t bytes);
+void AccountFree(AllocTag tag, size_t bytes);
+} // namespace internal
+
+inline void AccountAlloc(AllocTag tag, size_t bytes) {
+    if (internal::g_alloc_stats_enabled.Load(MemoryOrder::RELAXED)) {
+        internal::AccountAlloc(tag, bytes);
+    }
+}
+
+inline void AccountFree(AllocTag tag, size_t bytes) {
+    if (internal::g_alloc_stats_enabled.Load(MemoryOrder::RELAXED)) {
+        internal::AccountFree(tag, bytes);
+    }
+}
+
 } // namespace raptor
 
 #endif  // __RAPTOR_UTIL_ALLOC__
@@ -0,0 +1,95 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "util/block_pool.h"
+#include "util/huge_page_arena.h"
+#include "util/slab.h"
+
+namespace raptor {
+namespace {
+
+template <size_t N>
+struct alignas(16) RawBlock {
+    RawBlock() {}  // left uninitialized
+    unsigned char bytes[N];
+};
+
+// from the huge page arena once it is enabled
+struct ArenaChunks {
+    static void* Alloc(size_t size) {
+        void* p = HugePageArena::Alloc(size);
+        return p ? p : Malloc(size);
+    }
+};
+
+template <int C>
+struct ClassSlab {
+    typedef Slab<RawBlock<(BlockPool::MIN_BLOCK_SIZE << C)>, ArenaChunks> Type;
+};
+
+} // namespace
+
+int BlockPool::ClassOf(size_t size) {
+    if (size > MAX_BLOCK_SIZE) {
+        return -1;
+    }
+    int cls = 0;
+    size_t block = MIN_BLOCK_SIZE;
+    while (block < size) {
+        block <<= 1;
+        cls++;
+    }
+    return cls;
+}
+
+size_t BlockPool::BlockSize(int cls) {
+    return static_cast<size_t>(MIN_BLOCK_SIZE) << cls;
+}
+
+void* BlockPool::Alloc(int cls) {
+    switch (cls) {
+    case 0: return ClassSlab<0>::Type::New();
+    case 1: return ClassSlab<1>::Type::New();
+    case 2: return ClassSlab<2>::Type::New();
+    case 3: return ClassSlab<3>::Type::New();
+    case 4: return ClassSlab<4>::Type::New();
+    case 5: return ClassSlab<5>::Type::New();
+    case 6: return ClassSlab<6>::Type::New();
+    case 7: return ClassSlab<7>::Type::New();
+    case 8: return ClassSlab<8>::Type::New();
+    default: break;
+    }
+    return nullptr;
+}
+
+void BlockPool::Free(void* ptr, int cls) {
+    switch (cls) {
+    case 0: ClassSlab<0>::Type::Delete(static_cast<RawBlock<64>*>(ptr)); break;
+    case 1: ClassSlab<1>::Type::Delete(static_cast<RawBlock<128>*>(ptr)); break;
+    case 2: ClassSlab<2>::Type::Delete(static_cast<RawBlock<256>*>(ptr)); break;
+    case 3: ClassSlab<3>::Type::Delete(static_cast<RawBlock<512>*>(ptr)); break;
+    case 4: ClassSlab<4>::Type::Delete(static_cast<RawBlock<1024>*>(ptr)); break;
+    case 5: ClassSlab<5>::Type::Delete(static_cast<RawBlock<2048>*>(ptr)); break;
+    case 6: ClassSlab<6>::Type::Delete(static_cast<RawBlock<4096>*>(ptr)); break;
+    case 7: ClassSlab<7>::Type::Delete(static_cast<RawBlock<8192>*>(ptr)); break;
+    case 8: ClassSlab<8>::Type::Delete(static_cast<RawBlock<16384>*>(ptr)); break;
+    default: break;
+    }
+}
+
+} // namespace raptor
@@ -0,0 +1,53 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_UTIL_BLOCK_POOL__
+#define __RAPTOR_UTIL_BLOCK_POOL__
+
+#include <stddef.h>
+
+namespace raptor {
+
+/*
+    Raw memory blocks in power-of-two size classes from 64 bytes to
+    16KB, each class served by a Slab. Allocation and release stay on
+    thread-local free lists, blocks freed on another thread go back
+    through the depot in batches. The slabs draw their memory from the
+    HugePageArena when it is enabled.
+*/
+class BlockPool final {
+public:
+    enum {
+        MIN_BLOCK_SIZE = 64,
+        MAX_BLOCK_SIZE = 16384,
+        CLASS_COUNT = 9
+    };
+
+    // return the smallest class that holds size bytes,
+    // -1 if size is larger than MAX_BLOCK_SIZE.
+    static int ClassOf(size_t size);
+    static size_t BlockSize(int cls);
+
+    static void* Alloc(int cls);
+    // cls must be the class ptr was allocated from
+    static void Free(void* ptr, int cls);
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_UTIL_BLOCK_POOL__
@@ -0,0 +1,186 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "util/epoch.h"
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#include "util/atomic.h"
+#include "util/no_destructor.h"
+#include "util/sync.h"
+
+namespace raptor {
+namespace {
+
+enum { RECLAIM_THRESHOLD = 64 };
+
+// one per thread, reused after the thread exits
+struct Participant {
+    // 0: quiescent, otherwise the epoch observed by Enter
+    AtomicUInt64 epoch;
+    AtomicBool in_use;
+    Participant* next;
+};
+
+struct RetiredObject {
+    void* ptr;
+    void (*deleter)(void*);
+    uint64_t epoch;
+};
+
+struct EpochDomain {
+    AtomicUInt64 global_epoch;
+    Atomic<Participant*> participants;
+    Mutex mtx;
+    std::vector<RetiredObject> retired;
+
+    EpochDomain() : global_epoch(1), participants(nullptr) {}
+};
+
+EpochDomain* GetDomain() {
+    static NoDestructor<EpochDomain> domain;
+    return domain.get();
+}
+
+Participant* AcquireParticipant() {
+    EpochDomain* d = GetDomain();
+    for (Participant* p = d->participants.Load(MemoryOrder::ACQUIRE); p; p = p->next) {
+        bool expected = false;
+        if (!p->in_use.Load(MemoryOrder::RELAXED)
+            && p->in_use.CompareExchangeStrong(
+                &expected, true, MemoryOrder::ACQ_REL, MemoryOrder::RELAXED)) {
+            return p;
+        }
+    }
+
+    Participant* p = new Participant;
+    p->epoch.Store(0);
+    p->in_use.Store(true);
+    Participant* head = d->participants.Load(MemoryOrder::RELAXED);
+    do {
+        p->next = head;
+    } while (!d->participants.CompareExchangeWeak(
+        &head, p, MemoryOrder::RELEASE, MemoryOrder::RELAXED));
+    return p;
+}
+
+struct LocalState {
+    Participant* participant;
+    int depth;
+
+    LocalState() : participant(nullptr), depth(0) {}
+    ~LocalState() {
+        if (participant) {
+            participant->epoch.Store(0, MemoryOrder::RELEASE);
+            participant->in_use.Store(false, MemoryOrder::RELEASE);
+        }
+    }
+};
+
+thread_local LocalState t_local;
+
+// requires d->mtx held, returns the objects that can be destroyed
+std::vector<RetiredObject> CollectLocked(EpochDomain* d) {
+    uint64_t current = d->global_epoch.Load(MemoryOrder::ACQUIRE);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    bool advance = true;
+    for (Participant* p = d->participants.Load(MemoryOrder::ACQUIRE); p; p = p->next) {
+        uint64_t e = p->epoch.Load(MemoryOrder::ACQUIRE);
+        if (e != 0 && e != current) {
+            advance = false;
+            break;
+        }
+    }
+    if (advance) {
+        d->global_epoch.Store(current + 1, MemoryOrder::RELEASE);
+        current++;
+    }
+
+    // an object retired in epoch e is unreachable once the
+    // global epoch has moved two steps forward
+    std::vector<RetiredObject> ready;
+    size_t keep = 0;
+    for (size_t i = 0; i < d->retired.size(); i++) {
+        if (d->retired[i].epoch + 2 <= current) {
+            ready.push_back(d->retired[i]);
+        } else {
+            d->retired[keep++] = d->retired[i];
+        }
+    }
+    d->retired.resize(keep);
+    return ready;
+}
+
+void Destroy(const std::vector<RetiredObject>& objs) {
+    for (auto& obj : objs) {
+        obj.deleter(obj.ptr);
+    }
+}
+} // namespace
+
+void Epoch::Enter() {
+    LocalState& local = t_local;
+    if (local.depth++ > 0) {
+        return;
+    }
+    if (!local.participant) {
+        local.participant = AcquireParticipant();
+    }
+    uint64_t e = GetDomain()->global_epoch.Load(MemoryOrder::ACQUIRE);
+    local.participant->epoch.Store(e, MemoryOrder::RELAXED);
+    // the announcement must be visible before any shared pointer is read
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void Epoch::Exit() {
+    LocalState& local = t_local;
+    if (--local.depth > 0) {
+        return;
+    }
+    local.participant->epoch.Store(0, MemoryOrder::RELEASE);
+}
+
+void Epoch::Retire(void* ptr, void (*deleter)(void*)) {
+    EpochDomain* d = GetDomain();
+    std::vector<RetiredObject> ready;
+    {
+        AutoMutex g(&d->mtx);
+        d->retired.push_back({ptr, deleter, d->global_epoch.Load(MemoryOrder::ACQUIRE)});
+        if (d->retired.size() >= RECLAIM_THRESHOLD) {
+            ready = CollectLocked(d);
+        }
+    }
+    Destroy(ready);
+}
+
+size_t Epoch::Reclaim() {
+    EpochDomain* d = GetDomain();
+    std::vector<RetiredObject> ready;
+    size_t pending = 0;
+    {
+        AutoMutex g(&d->mtx);
+        ready = CollectLocked(d);
+        pending = d->retired.size();
+    }
+    Destroy(ready);
+    return pending;
+}
+
+} // namespace raptor
@@ -0,0 +1,56 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_UTIL_EPOCH__
+#define __RAPTOR_UTIL_EPOCH__
+
+#include <stddef.h>
+
+namespace raptor {
+/*
+    Epoch based reclamation. Readers wrap their access to shared
+    objects in Enter/Exit (usually with EpochGuard), writers unpublish
+    an object and Retire it, it is destroyed once every thread that
+    could still see it has left its critical section.
+    Enter/Exit cost one store each and never block.
+*/
+class Epoch final {
+public:
+    static void Enter();
+    static void Exit();
+
+    // destroy 'ptr' with 'deleter' when it is no longer reachable
+    static void Retire(void* ptr, void (*deleter)(void*));
+
+    // Try to advance the global epoch and destroy the objects that
+    // are safe to free, return the number of objects still pending.
+    static size_t Reclaim();
+};
+
+class EpochGuard final {
+public:
+    EpochGuard() { Epoch::Enter(); }
+    ~EpochGuard() { Epoch::Exit(); }
+
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator= (const EpochGuard&) = delete;
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_UTIL_EPOCH__
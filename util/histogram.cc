@@ -0,0 +1,114 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "util/histogram.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace raptor {
+namespace {
+// index of the highest set bit, v must not be 0
+inline int HighestBit(uint64_t v) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, v);
+    return static_cast<int>(index);
+#else
+    return 63 - __builtin_clzll(v);
+#endif
+}
+} // namespace
+
+Histogram::Histogram() {}
+
+size_t Histogram::BucketOf(uint64_t value) {
+    if (value < SUB_COUNT) {
+        return static_cast<size_t>(value);
+    }
+    int shift = HighestBit(value) - SUB_BITS;
+    return static_cast<size_t>(shift + 1) * SUB_COUNT
+        + static_cast<size_t>((value >> shift) - SUB_COUNT);
+}
+
+uint64_t Histogram::BucketUpperBound(size_t index) {
+    if (index < SUB_COUNT) {
+        return index;
+    }
+    int shift = static_cast<int>(index / SUB_COUNT) - 1;
+    uint64_t lower = static_cast<uint64_t>(SUB_COUNT + index % SUB_COUNT) << shift;
+    return lower + ((uint64_t(1) << shift) - 1);
+}
+
+void Histogram::Record(uint64_t value) {
+    Add(_buckets[BucketOf(value)], 1);
+    Add(_count, 1);
+    if (value > _max.Load(MemoryOrder::RELAXED)) {
+        _max.Store(value, MemoryOrder::RELAXED);
+    }
+}
+
+void Histogram::Merge(const Histogram& other) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        uint64_t n = other._buckets[i].Load(MemoryOrder::RELAXED);
+        if (n > 0) {
+            Add(_buckets[i], n);
+            count += n;
+        }
+    }
+    // derived from the buckets read, so that percentiles stay consistent
+    Add(_count, count);
+    uint64_t max = other._max.Load(MemoryOrder::RELAXED);
+    if (max > _max.Load(MemoryOrder::RELAXED)) {
+        _max.Store(max, MemoryOrder::RELAXED);
+    }
+}
+
+void Histogram::Clear() {
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        _buckets[i].Store(0, MemoryOrder::RELAXED);
+    }
+    _count.Store(0, MemoryOrder::RELAXED);
+    _max.Store(0, MemoryOrder::RELAXED);
+}
+
+uint64_t Histogram::Percentile(double p) const {
+    uint64_t count = _count.Load(MemoryOrder::RELAXED);
+    if (count == 0) {
+        return 0;
+    }
+    double rank = p / 100.0 * static_cast<double>(count);
+    uint64_t target = static_cast<uint64_t>(rank);
+    if (static_cast<double>(target) < rank) target++;
+    if (target == 0) target = 1;
+    if (target > count) target = count;
+
+    uint64_t seen = 0;
+    uint64_t max = _max.Load(MemoryOrder::RELAXED);
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        seen += _buckets[i].Load(MemoryOrder::RELAXED);
+        if (seen >= target) {
+            uint64_t upper = BucketUpperBound(i);
+            return (upper < max) ? upper : max;
+        }
+    }
+    return max;
+}
+
+} // namespace raptor
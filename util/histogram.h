@@ -0,0 +1,76 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_UTIL_HISTOGRAM__
+#define __RAPTOR_UTIL_HISTOGRAM__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "util/atomic.h"
+
+namespace raptor {
+
+/*
+    Log-linear histogram in the spirit of HdrHistogram. Values below
+    SUB_COUNT have a bucket each, above that every power of two is split
+    into SUB_COUNT buckets, so a bucket is at most 1/16th of the values
+    it holds wide. Memory is fixed, about 8KB.
+
+    Record must only be called by one thread at a time. The counts are
+    atomics written with a relaxed load and store, other threads may
+    Merge a snapshot at any time without locking.
+*/
+class Histogram final {
+public:
+    enum {
+        SUB_BITS = 4,
+        SUB_COUNT = 1 << SUB_BITS,
+        BUCKET_COUNT = (64 - SUB_BITS + 1) * SUB_COUNT
+    };
+
+    Histogram();
+
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    void Record(uint64_t value);
+    // adds a snapshot of other's counts
+    void Merge(const Histogram& other);
+    void Clear();
+
+    uint64_t Count() const { return _count.Load(); }
+    uint64_t Max() const { return _max.Load(); }
+    // upper bound of the bucket holding the p-th percentile, p in (0, 100]
+    uint64_t Percentile(double p) const;
+
+    static size_t BucketOf(uint64_t value);
+    static uint64_t BucketUpperBound(size_t index);
+
+private:
+    static void Add(AtomicUInt64& v, uint64_t n) {
+        v.Store(v.Load(MemoryOrder::RELAXED) + n, MemoryOrder::RELAXED);
+    }
+
+    AtomicUInt64 _buckets[BUCKET_COUNT];
+    AtomicUInt64 _count;
+    AtomicUInt64 _max;
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_UTIL_HISTOGRAM__
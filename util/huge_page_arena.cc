@@ -0,0 +1,184 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "util/huge_page_arena.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdint.h>
+#include <sys/mman.h>
+#endif
+
+#include "util/atomic.h"
+#include "util/no_destructor.h"
+#include "util/sync.h"
+
+namespace raptor {
+namespace {
+
+constexpr size_t CHUNK_ALIGNMENT = 64;
+
+struct ArenaState {
+    Mutex mtx;
+    Atomic<bool> enabled;
+    bool huge;
+    char* cur;
+    size_t left;
+
+    ArenaState() : enabled(false), huge(true), cur(nullptr), left(0) {}
+};
+
+ArenaState& GetState() {
+    static NoDestructor<ArenaState> state;
+    return *state;
+}
+
+size_t RoundUpToPage(size_t size) {
+    const size_t page = HugePageArena::PAGE_SIZE;
+    return (size + page - 1) & ~(page - 1);
+}
+
+#ifdef _WIN32
+
+bool EnableLockMemoryPrivilege() {
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+        return false;
+    }
+    TOKEN_PRIVILEGES tp;
+    tp.PrivilegeCount = 1;
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    BOOL ok = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid)
+        && AdjustTokenPrivileges(token, FALSE, &tp, 0, nullptr, nullptr)
+        && GetLastError() == ERROR_SUCCESS;
+    CloseHandle(token);
+    return ok != FALSE;
+}
+
+// *huge is cleared once large pages fail, they are not tried again
+char* MapRegion(size_t size, bool* huge) {
+    if (*huge) {
+        SIZE_T large = GetLargePageMinimum();
+        if (large > 0 && size % large == 0) {
+            void* p = VirtualAlloc(nullptr, size,
+                MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (p) {
+                return static_cast<char*>(p);
+            }
+        }
+        *huge = false;
+    }
+    return static_cast<char*>(
+        VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+}
+
+#else
+
+char* MapRegion(size_t size, bool* huge) {
+    if (*huge) {
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            return static_cast<char*>(p);
+        }
+        *huge = false;
+    }
+    // transparent huge pages only back 2MB aligned ranges, the extra
+    // page mapped is trimmed to align the region
+    size_t span = size + HugePageArena::PAGE_SIZE;
+    void* p = mmap(nullptr, span, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return nullptr;
+    }
+    uintptr_t base = reinterpret_cast<uintptr_t>(p);
+    uintptr_t aligned = (base + HugePageArena::PAGE_SIZE - 1)
+        & ~static_cast<uintptr_t>(HugePageArena::PAGE_SIZE - 1);
+    if (aligned > base) {
+        munmap(p, aligned - base);
+    }
+    size_t tail = (base + span) - (aligned + size);
+    if (tail > 0) {
+        munmap(reinterpret_cast<void*>(aligned + size), tail);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE);
+#endif
+    return reinterpret_cast<char*>(aligned);
+}
+
+#endif
+
+// state.mtx held
+bool AddRegion(ArenaState* state, size_t size) {
+    char* p = MapRegion(size, &state->huge);
+    if (!p) {
+        return false;
+    }
+    // the rest of the current region is left unused
+    state->cur = p;
+    state->left = size;
+    return true;
+}
+
+} // namespace
+
+HugePageArena::Backing HugePageArena::Enable(size_t reserve_bytes, bool prefault) {
+    ArenaState& state = GetState();
+    AutoMutex g(&state.mtx);
+    if (state.enabled.Load(MemoryOrder::RELAXED)) {
+        return state.huge ? kHugePages : kFallback;
+    }
+#ifdef _WIN32
+    state.huge = EnableLockMemoryPrivilege();
+#endif
+    size_t size = RoundUpToPage(reserve_bytes > 0 ? reserve_bytes : PAGE_SIZE);
+    if (!AddRegion(&state, size)) {
+        return kFailed;
+    }
+    if (prefault) {
+        volatile char* p = state.cur;
+        for (size_t off = 0; off < size; off += 4096) {
+            p[off] = 0;
+        }
+    }
+    state.enabled.Store(true, MemoryOrder::RELEASE);
+    return state.huge ? kHugePages : kFallback;
+}
+
+bool HugePageArena::Enabled() {
+    return GetState().enabled.Load(MemoryOrder::ACQUIRE);
+}
+
+void* HugePageArena::Alloc(size_t size) {
+    ArenaState& state = GetState();
+    if (!state.enabled.Load(MemoryOrder::ACQUIRE)) {
+        return nullptr;
+    }
+    size = (size + CHUNK_ALIGNMENT - 1) & ~(CHUNK_ALIGNMENT - 1);
+    AutoMutex g(&state.mtx);
+    if (state.left < size && !AddRegion(&state, RoundUpToPage(size))) {
+        return nullptr;
+    }
+    void* p = state.cur;
+    state.cur += size;
+    state.left -= size;
+    return p;
+}
+
+} // namespace raptor
@@ -0,0 +1,58 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_UTIL_HUGE_PAGE_ARENA__
+#define __RAPTOR_UTIL_HUGE_PAGE_ARENA__
+
+#include <stddef.h>
+
+namespace raptor {
+
+/*
+    Memory for the pooled slice blocks taken from 2MB pages, so that
+    many live blocks cost few TLB entries. Chunks are carved out of
+    regions with a bump pointer and never returned, the slabs keep
+    them anyway. The first region holds the reservation, the arena
+    grows by whole 2MB pages past it.
+    Regions are mapped with MAP_HUGETLB, or with transparent huge
+    pages (madvise) when the system has no huge pages reserved
+    (linux); with large pages, or normal ones without the lock pages
+    privilege (windows).
+*/
+class HugePageArena final {
+public:
+    enum { PAGE_SIZE = 2 * 1024 * 1024 };
+
+    enum Backing {
+        kFailed = -1,
+        kHugePages = 0,     // MAP_HUGETLB, MEM_LARGE_PAGES
+        kFallback = 1       // transparent huge pages or normal pages
+    };
+
+    // Maps reserve_bytes now, rounded up to PAGE_SIZE, and touches every
+    // page of it with prefault. Only the first call has an effect.
+    static Backing Enable(size_t reserve_bytes, bool prefault);
+    static bool Enabled();
+
+    // 64 byte aligned, nullptr if the arena is off or cannot map more
+    static void* Alloc(size_t size);
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_UTIL_HUGE_PAGE_ARENA__
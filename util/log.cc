@@ -21,8 +21,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <functional>
 #include "util/alloc.h"
 #include "util/atomic.h"
+#include "util/no_destructor.h"
+#include "util/sync.h"
+#include "util/thread.h"
 #include "util/time.h"
 
 #ifdef _WIN32
@@ -32,66 +36,321 @@
 #endif
 
 namespace raptor {
+namespace internal {
+AtomicIntptr g_log_min_level((intptr_t)LogLevel::kLogLevelDebug);
+} // namespace internal
+
 namespace {
 
 void log_default_print(LogArgument* args);
 
 AtomicIntptr g_log_function((intptr_t)log_default_print);
-AtomicIntptr g_min_level((intptr_t)LogLevel::kLogLevelDebug);
 char g_level_string[static_cast<int>(LogLevel::kLogLevelDisable)];
 
-void log_default_print(LogArgument* args) {
 #ifdef _WIN32
-    static __declspec(thread) unsigned long tid = 0;
-    if (tid == 0) tid = GetCurrentThreadId();
-    constexpr char delimiter = '\\';
+constexpr char kPathDelimiter = '\\';
 #else
-    static __thread unsigned long tid = 0;
-    if (tid == 0) tid = static_cast<unsigned long>(pthread_self());
-    constexpr char delimiter = '/';
+constexpr char kPathDelimiter = '/';
 #endif
-    const char* last_slash = NULL;
-    const char* display_file = NULL;
-    char time_buffer[64] = { 0 };
 
-    last_slash = strrchr(args->file, delimiter);
-    if (last_slash == NULL) {
-        display_file = args->file;
-    } else {
-        display_file = last_slash + 1;
+unsigned long CurrentThreadId() {
+    static thread_local unsigned long tid = 0;
+    if (tid == 0) {
+#ifdef _WIN32
+        tid = GetCurrentThreadId();
+#else
+        tid = static_cast<unsigned long>(pthread_self());
+#endif
     }
+    return tid;
+}
 
-    struct timeval now;
-    gettimeofday(&now, nullptr);
-    time_t timer = now.tv_sec;
+const char* DisplayFile(const char* file) {
+    const char* last_slash = strrchr(file, kPathDelimiter);
+    return last_slash ? last_slash + 1 : file;
+}
 
+// "%F %T" 2020-05-10 01:43:06, formatted once per second
+class TimestampCache {
+public:
+    TimestampCache() : _sec(-1) { _text[0] = '\0'; }
+
+    const char* Get(time_t sec) {
+        if (sec == _sec) {
+            return _text;
+        }
+        struct tm stm;
 #ifdef _WIN32
-    struct tm stm;
-    if (localtime_s(&stm, &timer)) {
-        strcpy(time_buffer, "error:localtime");
-    }
+        if (localtime_s(&stm, &sec)) {
 #else
-    struct tm stm;
-    if (!localtime_r(&timer, &stm)) {
-        strcpy(time_buffer, "error:localtime");
-    }
+        if (!localtime_r(&sec, &stm)) {
 #endif
-    // "%F %T" 2020-05-10 01:43:06
-    else if (0 == strftime(time_buffer, sizeof(time_buffer), "%F %T", &stm)) {
-        strcpy(time_buffer, "error:strftime");
+            strcpy(_text, "error:localtime");
+        } else if (0 == strftime(_text, sizeof(_text), "%F %T", &stm)) {
+            strcpy(_text, "error:strftime");
+        } else {
+            _sec = sec;
+        }
+        return _text;
     }
 
+private:
+    time_t _sec;
+    char _text[64];
+};
+
+int FormatLine(char* buf, size_t size, const char* timestamp, int millisecond,
+    unsigned long tid, LogLevel level, const char* message, const char* file, int line) {
+    return snprintf(buf, size,
+        "[%s.%03d %5lu %c] %s (%s:%d)\n",
+        timestamp, millisecond, tid,
+        g_level_string[static_cast<int>(level)],
+        message, DisplayFile(file), line);
+}
+
+void log_default_print(LogArgument* args) {
+    static thread_local TimestampCache cache;
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+
     fprintf(stderr,
-        "[%s.%03u %5lu %c] %s (%s:%d)\n",
-        time_buffer,
+        "[%s.%03d %5lu %c] %s (%s:%d)\n",
+        cache.Get(now.tv_sec),
         (int)(now.tv_usec / 1000),  // millisecond
-        tid,
+        CurrentThreadId(),
         g_level_string[static_cast<int>(args->level)],
         args->message,
-        display_file, args->line);
+        DisplayFile(args->file), args->line);
 
     fflush(stderr);
 }
+
+// ---------------------------
+/*
+    Asynchronous backend.
+
+    Every logging thread owns a ring of fixed size records, it is the
+    only producer and the flusher thread the only consumer, so a push
+    is a formatted copy and two atomic stores. When the ring is full the
+    record is dropped and counted, the caller never waits. The flusher
+    wakes up every kFlushIntervalMs, drains all rings and writes the
+    lines with one fwrite per buffer and one fflush per round.
+*/
+constexpr size_t kRecordSize = 512;
+constexpr uint32_t kRingSlots = 128;  // 64KB per logging thread
+constexpr int64_t kFlushIntervalMs = 10;
+
+struct LogRecord {
+    const char* file;  // __FILE__, never freed
+    int line;
+    LogLevel level;
+    unsigned long tid;
+    int64_t sec;
+    int32_t usec;
+    char message[kRecordSize - 40];
+};
+
+struct LogRing {
+    LogRecord slots[kRingSlots];
+    AtomicUInt32 head;  // next record to flush
+    AtomicUInt32 tail;  // next record to write
+    bool orphan;        // owner thread exited
+    LogRing* next;
+};
+
+struct AsyncLogger {
+    Mutex mtx;
+    ConditionVariable cv;
+    LogRing* rings = nullptr;
+    bool running = false;
+    bool flushing = false;  // flusher thread alive, may walk the rings
+    Thread thd;
+    AtomicBool enabled;
+    AtomicUInt64 dropped;        // not yet reported
+    AtomicUInt64 dropped_total;
+};
+
+AsyncLogger& GetAsyncLogger() {
+    static NoDestructor<AsyncLogger> logger;
+    return *logger;
+}
+
+struct RingHolder {
+    LogRing* ring = nullptr;
+
+    LogRing* Get() {
+        if (!ring) {
+            ring = new LogRing;
+            ring->orphan = false;
+            AsyncLogger& logger = GetAsyncLogger();
+            AutoMutex g(&logger.mtx);
+            ring->next = logger.rings;
+            logger.rings = ring;
+        }
+        return ring;
+    }
+
+    ~RingHolder() {
+        if (!ring) return;
+        AsyncLogger& logger = GetAsyncLogger();
+        AutoMutex g(&logger.mtx);
+        if (logger.flushing) {
+            ring->orphan = true;  // the flusher drains and deletes it
+            return;
+        }
+        for (LogRing** p = &logger.rings; *p; p = &(*p)->next) {
+            if (*p == ring) {
+                *p = ring->next;
+                break;
+            }
+        }
+        delete ring;
+    }
+};
+
+void AsyncPush(const char* file, int line, LogLevel level, const char* format, va_list args) {
+    static thread_local RingHolder holder;
+    LogRing* ring = holder.Get();
+    AsyncLogger& logger = GetAsyncLogger();
+
+    uint32_t tail = ring->tail.Load(MemoryOrder::RELAXED);
+    uint32_t head = ring->head.Load(MemoryOrder::ACQUIRE);
+    if (tail - head >= kRingSlots) {
+        logger.dropped.FetchAdd(1, MemoryOrder::RELAXED);
+        logger.dropped_total.FetchAdd(1, MemoryOrder::RELAXED);
+        return;
+    }
+
+    LogRecord* rec = &ring->slots[tail % kRingSlots];
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    rec->file = file;
+    rec->line = line;
+    rec->level = level;
+    rec->tid = CurrentThreadId();
+    rec->sec = now.tv_sec;
+    rec->usec = static_cast<int32_t>(now.tv_usec);
+    // longer messages are truncated
+    if (vsnprintf(rec->message, sizeof(rec->message), format, args) < 0) {
+        rec->message[0] = '\0';
+    }
+    ring->tail.Store(tail + 1, MemoryOrder::RELEASE);
+}
+
+class LineWriter {
+public:
+    LineWriter() : _used(0) {}
+
+    void Write(const LogRecord& rec) {
+        LogTransferFunction func = (LogTransferFunction)g_log_function.Load();
+        if (func != log_default_print) {
+            LogArgument arg;
+            arg.file = rec.file;
+            arg.line = rec.line;
+            arg.level = rec.level;
+            arg.message = rec.message;
+            func(&arg);
+            return;
+        }
+        const char* ts = _cache.Get(static_cast<time_t>(rec.sec));
+        for (;;) {
+            int n = FormatLine(_buf + _used, sizeof(_buf) - _used, ts, rec.usec / 1000,
+                rec.tid, rec.level, rec.message, rec.file, rec.line);
+            if (n < 0) return;
+            if (_used + n < sizeof(_buf)) {
+                _used += n;
+                return;
+            }
+            if (_used == 0) {  // longer than the whole buffer
+                _used = sizeof(_buf) - 1;
+                _buf[_used - 1] = '\n';
+                return;
+            }
+            Flush();
+        }
+    }
+
+    void Flush() {
+        if (_used > 0) {
+            fwrite(_buf, 1, _used, stderr);
+            _used = 0;
+        }
+        fflush(stderr);
+    }
+
+private:
+    TimestampCache _cache;
+    size_t _used;
+    char _buf[16384];
+};
+
+void DrainRings(AsyncLogger* logger, LineWriter* writer) {
+    LogRing* rings;
+    {
+        AutoMutex g(&logger->mtx);
+        rings = logger->rings;
+    }
+    // rings are only pushed to the front and only unlinked below,
+    // so the list from the snapshot on stays valid without the lock
+    for (LogRing* ring = rings; ring; ring = ring->next) {
+        uint32_t head = ring->head.Load(MemoryOrder::RELAXED);
+        uint32_t tail = ring->tail.Load(MemoryOrder::ACQUIRE);
+        while (head != tail) {
+            writer->Write(ring->slots[head % kRingSlots]);
+            head++;
+            ring->head.Store(head, MemoryOrder::RELEASE);
+        }
+    }
+
+    uint64_t dropped = logger->dropped.Exchange(0, MemoryOrder::RELAXED);
+    if (dropped > 0) {
+        LogRecord rec;
+        struct timeval now;
+        gettimeofday(&now, nullptr);
+        rec.file = __FILE__;
+        rec.line = __LINE__;
+        rec.level = LogLevel::kLogLevelError;
+        rec.tid = CurrentThreadId();
+        rec.sec = now.tv_sec;
+        rec.usec = static_cast<int32_t>(now.tv_usec);
+        snprintf(rec.message, sizeof(rec.message),
+            "log buffer full, dropped %llu messages", (unsigned long long)dropped);
+        writer->Write(rec);
+    }
+    writer->Flush();
+
+    AutoMutex g(&logger->mtx);
+    for (LogRing** p = &logger->rings; *p;) {
+        LogRing* ring = *p;
+        if (ring->orphan &&
+            ring->head.Load(MemoryOrder::RELAXED) == ring->tail.Load(MemoryOrder::ACQUIRE)) {
+            *p = ring->next;
+            delete ring;
+        } else {
+            p = &ring->next;
+        }
+    }
+}
+
+void FlusherWork(void*) {
+    AsyncLogger& logger = GetAsyncLogger();
+    LineWriter* writer = new LineWriter;
+    logger.mtx.Lock();
+    while (logger.running) {
+        logger.mtx.Unlock();
+        DrainRings(&logger, writer);
+        logger.mtx.Lock();
+        if (logger.running) {
+            logger.cv.Wait(&logger.mtx, kFlushIntervalMs);
+        }
+    }
+    logger.mtx.Unlock();
+    DrainRings(&logger, writer);
+    delete writer;
+
+    AutoMutex g(&logger.mtx);
+    logger.flushing = false;
+}
 }  // namespace
 
 // ---------------------------
@@ -108,7 +367,7 @@ void LogInit(void) {
 }
 
 void LogSetLevel(LogLevel level) {
-    g_min_level.Store((intptr_t)level);
+    internal::g_log_min_level.Store((intptr_t)level);
 }
 
 void LogSetTransferFunction(LogTransferFunction func) {
@@ -119,43 +378,98 @@ void LogRestoreDefault() {
     g_log_function.Store((intptr_t)log_default_print);
 }
 
+bool LogStartAsync() {
+    AsyncLogger& logger = GetAsyncLogger();
+    AutoMutex g(&logger.mtx);
+    if (logger.running || logger.flushing) {
+        return logger.running;
+    }
+    bool success = false;
+    logger.thd = Thread("log", FlusherWork, nullptr, &success);
+    if (!success) {
+        return false;
+    }
+    logger.running = true;
+    logger.flushing = true;
+    logger.thd.Start();
+    logger.enabled.Store(true, MemoryOrder::RELEASE);
+    return true;
+}
+
+void LogStopAsync() {
+    AsyncLogger& logger = GetAsyncLogger();
+    logger.enabled.Store(false, MemoryOrder::RELEASE);
+    {
+        AutoMutex g(&logger.mtx);
+        if (!logger.running) {
+            return;
+        }
+        logger.running = false;
+        logger.cv.Signal();
+    }
+    // the flusher drains the rings once more before it exits
+    logger.thd.Join();
+}
+
+bool LogRateLimiter::Allow(int64_t interval_ms, uint32_t* suppressed) {
+    int64_t now = GetCurrentMilliseconds();
+    int64_t next = _next_ms.Load(MemoryOrder::RELAXED);
+    if (now < next || !_next_ms.CompareExchangeStrong(
+            &next, now + interval_ms, MemoryOrder::RELAXED, MemoryOrder::RELAXED)) {
+        _suppressed.FetchAdd(1, MemoryOrder::RELAXED);
+        return false;
+    }
+    *suppressed = _suppressed.Exchange(0, MemoryOrder::RELAXED);
+    return true;
+}
+
+uint64_t LogDroppedCount() {
+    return GetAsyncLogger().dropped_total.Load(MemoryOrder::RELAXED);
+}
+
 void LogFormatPrint(
                     const char* file,
                     int line,
                     LogLevel level,
                     const char* format, ...) {
 
-    char* message = NULL;
+    if (!LogLevelEnabled(level)) {
+        return;
+    }
+
     va_list args;
     va_start(args, format);
-
-#ifdef _WIN32
-    int ret = _vscprintf(format, args);
-    va_end(args);
-    if (ret < 0) {
+    if (GetAsyncLogger().enabled.Load(MemoryOrder::ACQUIRE)) {
+        AsyncPush(file, line, level, format, args);
+        va_end(args);
         return;
     }
 
-    size_t buff_len = (size_t)ret + 1;
-    message = (char*)Malloc(buff_len);
-    va_start(args, format);
-    ret = vsnprintf_s(message, buff_len, _TRUNCATE, format, args);
+    char buffer[1024];
+    char* message = buffer;
+    va_list copy;
+    va_copy(copy, args);
+    int ret = vsnprintf(buffer, sizeof(buffer), format, args);
     va_end(args);
-#else
-    if (vasprintf(&message, format, args) == -1) {  // stdio.h
-        va_end(args);
+    if (ret < 0) {
+        va_end(copy);
         return;
     }
-#endif
+    if (static_cast<size_t>(ret) >= sizeof(buffer)) {
+        message = (char*)Malloc((size_t)ret + 1);
+        vsnprintf(message, (size_t)ret + 1, format, copy);
+    }
+    va_end(copy);
+
+    LogArgument tmp;
+    tmp.file = file;
+    tmp.line = line;
+    tmp.level = level;
+    tmp.message = message;
+    ((LogTransferFunction)g_log_function.Load())(&tmp);
 
-    if (g_min_level.Load() <= static_cast<intptr_t>(level)) {
-        LogArgument tmp;
-        tmp.file = file;
-        tmp.line = line;
-        tmp.level = level;
-        tmp.message = message;
-        ((LogTransferFunction)g_log_function.Load())(&tmp);
+    if (message != buffer) {
+        Free(message);
     }
-    Free(message);
 }
 } // namespace raptor
@@ -19,10 +19,22 @@
 #ifndef __RAPTOR_LOG__
 #define __RAPTOR_LOG__
 
+#include <stdint.h>
 #include <stdlib.h>
+#include "util/atomic.h"
 #include "util/useful.h"
 
+#if defined(__GNUC__) || defined(__clang__)
+#define RAPTOR_LOG_PRINTF_FORMAT(a, b) __attribute__((format(printf, a, b)))
+#else
+#define RAPTOR_LOG_PRINTF_FORMAT(a, b)
+#endif
+
 namespace raptor {
+namespace internal {
+extern AtomicIntptr g_log_min_level;
+} // namespace internal
+
 enum class LogLevel : int {
     kLogLevelDebug,
     kLogLevelInfo,
@@ -45,21 +57,103 @@ void LogFormatPrint(
                     const char* file,
                     int line,
                     LogLevel level,
-                    const char* format, ...);
+                    const char* format, ...) RAPTOR_LOG_PRINTF_FORMAT(4, 5);
+
+// Cheap check done by the log macros before any formatting
+inline bool LogLevelEnabled(LogLevel level) {
+    return internal::g_log_min_level.Load(MemoryOrder::RELAXED) <= static_cast<intptr_t>(level);
+}
+
+// Per call site state of log_error_ratelimited
+class LogRateLimiter {
+public:
+    LogRateLimiter() : _next_ms(0) {}
+
+    // true if the caller may log now, *suppressed is set to the
+    // number of calls refused since the last allowed one
+    bool Allow(int64_t interval_ms, uint32_t* suppressed);
+
+private:
+    AtomicInt64 _next_ms;
+    AtomicUInt32 _suppressed;
+};
 
 void LogSetTransferFunction(LogTransferFunction func);
 void LogRestoreDefault();
 
+// Queue log lines on per-thread rings and write them from a background
+// thread, so that logging never blocks the caller. The transfer function
+// is then called on that thread. Lines that do not fit are dropped and
+// counted, a summary line reports them. LogStopAsync flushes what is queued.
+bool LogStartAsync();
+void LogStopAsync();
+uint64_t LogDroppedCount();
+
 } // namespace raptor
 
-#define log_debug(FMT, ...) \
-    raptor::LogFormatPrint(__FILE__, __LINE__, raptor::LogLevel::kLogLevelDebug, FMT, ##__VA_ARGS__)
+// Calls below this level are compiled out, 0 debug, 1 info, 2 error.
+#ifndef RAPTOR_MIN_LOG_LEVEL
+#define RAPTOR_MIN_LOG_LEVEL 0
+#endif
 
-#define log_info(FMT, ...)  \
-    raptor::LogFormatPrint(__FILE__, __LINE__, raptor::LogLevel::kLogLevelInfo,  FMT, ##__VA_ARGS__)
+// Calls compiled out still reference and check their arguments
+#define RAPTOR_LOG_NEVER(LEVEL, FMT, ...)                                      \
+do {                                                                           \
+    if (0) {                                                                   \
+        raptor::LogFormatPrint(__FILE__, __LINE__, LEVEL, FMT, ##__VA_ARGS__); \
+    }                                                                          \
+} while (0)
 
-#define log_error(FMT, ...) \
-    raptor::LogFormatPrint(__FILE__, __LINE__, raptor::LogLevel::kLogLevelError, FMT, ##__VA_ARGS__)
+#define RAPTOR_LOG_AT(LEVEL, FMT, ...)                                         \
+do {                                                                           \
+    if (raptor::LogLevelEnabled(LEVEL)) {                                      \
+        raptor::LogFormatPrint(__FILE__, __LINE__, LEVEL, FMT, ##__VA_ARGS__); \
+    }                                                                          \
+} while (0)
+
+#if RAPTOR_MIN_LOG_LEVEL <= 0
+#define log_debug(FMT, ...) RAPTOR_LOG_AT(raptor::LogLevel::kLogLevelDebug, FMT, ##__VA_ARGS__)
+#else
+#define log_debug(FMT, ...) RAPTOR_LOG_NEVER(raptor::LogLevel::kLogLevelDebug, FMT, ##__VA_ARGS__)
+#endif
+
+#if RAPTOR_MIN_LOG_LEVEL <= 1
+#define log_info(FMT, ...)  RAPTOR_LOG_AT(raptor::LogLevel::kLogLevelInfo, FMT, ##__VA_ARGS__)
+#else
+#define log_info(FMT, ...)  RAPTOR_LOG_NEVER(raptor::LogLevel::kLogLevelInfo, FMT, ##__VA_ARGS__)
+#endif
+
+#if RAPTOR_MIN_LOG_LEVEL <= 2
+#define log_error(FMT, ...) RAPTOR_LOG_AT(raptor::LogLevel::kLogLevelError, FMT, ##__VA_ARGS__)
+#else
+#define log_error(FMT, ...) RAPTOR_LOG_NEVER(raptor::LogLevel::kLogLevelError, FMT, ##__VA_ARGS__)
+#endif
+
+// For paths that may fail once per event, such as accept or recv.
+// log_error_every_n logs the 1st, N+1th, ... call of this line,
+// log_error_ratelimited at most one call of this line per interval
+// and reports how many were suppressed in between.
+#define log_error_every_n(N, FMT, ...)                                         \
+do {                                                                           \
+    static raptor::AtomicUInt32 raptor_log_occurrences_;                       \
+    if (raptor_log_occurrences_.FetchAdd(1, raptor::MemoryOrder::RELAXED)      \
+            % (N) == 0) {                                                      \
+        log_error(FMT, ##__VA_ARGS__);                                         \
+    }                                                                          \
+} while (0)
+
+#define log_error_ratelimited(INTERVAL_MS, FMT, ...)                           \
+do {                                                                           \
+    static raptor::LogRateLimiter raptor_log_limiter_;                         \
+    uint32_t raptor_log_suppressed_ = 0;                                       \
+    if (raptor::LogLevelEnabled(raptor::LogLevel::kLogLevelError) &&           \
+        raptor_log_limiter_.Allow(INTERVAL_MS, &raptor_log_suppressed_)) {     \
+        if (raptor_log_suppressed_ > 0) {                                      \
+            log_error("%u similar messages suppressed", raptor_log_suppressed_);\
+        }                                                                      \
+        log_error(FMT, ##__VA_ARGS__);                                         \
+    }                                                                          \
+} while (0)
 
 #define RAPTOR_ASSERT(x)                       \
 do {                                           \
@@ -0,0 +1,53 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_UTIL_NO_DESTRUCTOR__
+#define __RAPTOR_UTIL_NO_DESTRUCTOR__
+
+#include <new>
+#include <utility>
+
+namespace raptor {
+
+// A function-local static whose object is never destroyed: threads may
+// exit, and objects may be released, after static destructors run.
+//
+//     static NoDestructor<Registry> registry;
+//     registry->Add(...);
+template <typename T>
+class NoDestructor final {
+public:
+    template <typename... Args>
+    explicit NoDestructor(Args&&... args) {
+        new (_storage) T(std::forward<Args>(args)...);
+    }
+
+    NoDestructor(const NoDestructor&) = delete;
+    NoDestructor& operator=(const NoDestructor&) = delete;
+
+    T* get() { return reinterpret_cast<T*>(_storage); }
+    T& operator*() { return *get(); }
+    T* operator->() { return get(); }
+
+private:
+    alignas(T) unsigned char _storage[sizeof(T)];
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_UTIL_NO_DESTRUCTOR__
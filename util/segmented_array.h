@@ -0,0 +1,87 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_UTIL_SEGMENTED_ARRAY__
+#define __RAPTOR_UTIL_SEGMENTED_ARRAY__
+
+#include <stddef.h>
+#include <memory>
+
+#include "util/atomic.h"
+
+namespace raptor {
+
+/*
+    An array of up to Capacity() elements allocated in pages of
+    PageSize, a page is created when one of its elements is first
+    reached through At. Elements never move, so growing copies
+    nothing and a reference stays valid until Reset.
+    At must not run concurrently with itself, the caller's lock
+    orders the page creation. Find is wait-free and may run
+    concurrently with At.
+*/
+template <typename T, size_t PageSize = 4096>
+class SegmentedArray final {
+public:
+    SegmentedArray() : _capacity(0), _page_count(0) {}
+    ~SegmentedArray() { Reset(0); }
+
+    SegmentedArray(const SegmentedArray&) = delete;
+    SegmentedArray& operator= (const SegmentedArray&) = delete;
+
+    // drops every element, must not race with At or Find
+    void Reset(size_t capacity) {
+        for (size_t i = 0; i < _page_count; i++) {
+            delete[] _pages[i].Load();
+        }
+        _capacity = capacity;
+        _page_count = (capacity + PageSize - 1) / PageSize;
+        _pages.reset(_page_count > 0 ? new Atomic<T*>[_page_count] : nullptr);
+    }
+
+    size_t Capacity() const { return _capacity; }
+
+    // index must be less than Capacity()
+    T& At(size_t index) {
+        Atomic<T*>& page = _pages[index / PageSize];
+        T* p = page.Load(MemoryOrder::ACQUIRE);
+        if (!p) {
+            p = new T[PageSize];
+            page.Store(p, MemoryOrder::RELEASE);
+        }
+        return p[index % PageSize];
+    }
+
+    // nullptr if index is out of range or its page does not exist yet
+    T* Find(size_t index) const {
+        if (index >= _capacity) {
+            return nullptr;
+        }
+        T* p = _pages[index / PageSize].Load(MemoryOrder::ACQUIRE);
+        return p ? &p[index % PageSize] : nullptr;
+    }
+
+private:
+    size_t _capacity;
+    size_t _page_count;
+    std::unique_ptr<Atomic<T*>[]> _pages;
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_UTIL_SEGMENTED_ARRAY__
@@ -0,0 +1,165 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_UTIL_SLAB__
+#define __RAPTOR_UTIL_SLAB__
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "util/alloc.h"
+#include "util/no_destructor.h"
+#include "util/sync.h"
+
+namespace raptor {
+
+/*
+    Fixed size object allocator for objects that are created on one
+    thread and destroyed on another, such as queued messages.
+
+    Each thread keeps a private free list, so New and Delete normally
+    touch no shared state. Blocks move between threads in batches of
+    BATCH_SIZE through a global depot, the depot lock is taken once
+    per batch. Memory is never returned to the system. New blocks
+    come from Chunks::Alloc in batches.
+*/
+struct MallocChunks {
+    static void* Alloc(size_t size) { return Malloc(size); }
+};
+
+template <typename T, typename Chunks = MallocChunks>
+class Slab final {
+public:
+    template <typename... Args>
+    static T* New(Args&&... args) {
+        return new (Alloc()) T(std::forward<Args>(args)...);
+    }
+
+    static void Delete(T* obj) {
+        if (obj) {
+            obj->~T();
+            Free(obj);
+        }
+    }
+
+private:
+    enum { BATCH_SIZE = 64 };
+
+    union Block {
+        Block* next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    struct Batch {
+        Block* head;
+        size_t count;
+    };
+
+    struct Depot {
+        Mutex mtx;
+        std::vector<Batch> batches;
+    };
+
+    struct Cache {
+        Block* head;
+        size_t count;
+
+        Cache() : head(nullptr), count(0) {}
+        ~Cache() {
+            // hand the blocks to the other threads when this one exits
+            if (head) {
+                Depot& depot = GetDepot();
+                AutoMutex g(&depot.mtx);
+                depot.batches.push_back({head, count});
+            }
+        }
+    };
+
+    static Depot& GetDepot() {
+        static NoDestructor<Depot> depot;
+        return *depot;
+    }
+
+    static Cache& GetCache() {
+        static thread_local Cache cache;
+        return cache;
+    }
+
+    static void* Alloc() {
+        Cache& cache = GetCache();
+        if (!cache.head) {
+            Refill(&cache);
+        }
+        Block* b = cache.head;
+        cache.head = b->next;
+        cache.count--;
+        return b;
+    }
+
+    static void Free(void* ptr) {
+        Cache& cache = GetCache();
+        Block* b = reinterpret_cast<Block*>(ptr);
+        b->next = cache.head;
+        cache.head = b;
+        cache.count++;
+        if (cache.count >= 2 * BATCH_SIZE) {
+            // detach BATCH_SIZE blocks, keep the rest for reuse
+            Block* head = cache.head;
+            Block* tail = head;
+            for (size_t i = 1; i < BATCH_SIZE; i++) {
+                tail = tail->next;
+            }
+            cache.head = tail->next;
+            cache.count -= BATCH_SIZE;
+            tail->next = nullptr;
+
+            Depot& depot = GetDepot();
+            AutoMutex g(&depot.mtx);
+            depot.batches.push_back({head, BATCH_SIZE});
+        }
+    }
+
+    static void Refill(Cache* cache) {
+        {
+            Depot& depot = GetDepot();
+            AutoMutex g(&depot.mtx);
+            if (!depot.batches.empty()) {
+                Batch batch = depot.batches.back();
+                depot.batches.pop_back();
+                cache->head = batch.head;
+                cache->count = batch.count;
+                return;
+            }
+        }
+
+        Block* chunk = reinterpret_cast<Block*>(Chunks::Alloc(sizeof(Block) * BATCH_SIZE));
+        for (size_t i = 0; i + 1 < BATCH_SIZE; i++) {
+            chunk[i].next = &chunk[i + 1];
+        }
+        chunk[BATCH_SIZE - 1].next = nullptr;
+        cache->head = chunk;
+        cache->count = BATCH_SIZE;
+    }
+};
+
+} // namespace raptor
+
+#endif  // __RAPTOR_UTIL_SLAB__
@@ -22,6 +22,7 @@
 #include <windows.h>
 #else
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #endif
 #include "util/alloc.h"
@@ -43,7 +44,61 @@ struct ThreadImplArgs {
     pthread_t join_object;
 #endif
     char name[32];
+    std::vector<int> cpus;
 };
+
+#ifdef _WIN32
+typedef HRESULT (WINAPI *SetThreadDescriptionFunc)(HANDLE, PCWSTR);
+#endif
+
+// the name shows up in top, gdb and the windows debugger
+void SetCurrentThreadName(const char* name) {
+#ifdef _WIN32
+    // SetThreadDescription requires windows 10 1607
+    static SetThreadDescriptionFunc func = reinterpret_cast<SetThreadDescriptionFunc>(
+        GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "SetThreadDescription"));
+    if (func) {
+        wchar_t wname[32] = { 0 };
+        MultiByteToWideChar(CP_UTF8, 0, name, -1, wname, 31);
+        func(GetCurrentThread(), wname);
+    }
+#else
+    // limited to 16 bytes including the terminator
+    char buf[16];
+    strncpy(buf, name, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    pthread_setname_np(pthread_self(), buf);
+#endif
+}
+
+void SetCurrentThreadAffinity(const char* name, const std::vector<int>& cpus) {
+    if (cpus.empty()) {
+        return;
+    }
+#ifdef _WIN32
+    DWORD_PTR mask = 0;
+    for (int cpu : cpus) {
+        if (cpu < static_cast<int>(sizeof(mask) * 8)) {
+            mask |= static_cast<DWORD_PTR>(1) << cpu;
+        }
+    }
+    if (mask == 0 || SetThreadAffinityMask(GetCurrentThread(), mask) == 0) {
+        log_error("Failed to set the cpu affinity of %s thread", name);
+    }
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        log_error("Failed to set the cpu affinity of %s thread: %s", name, strerror(err));
+    }
+#endif
+}
 }  // namespace
 
 class InternalThreadImpl : public IThreadService {
@@ -63,7 +118,9 @@ public:
         info->thread_proc = thread_proc;
         info->arg = arg;
         info->joinable = options.Joinable();
-        strncpy(info->name, name, sizeof(info->name));
+        strncpy(info->name, name, sizeof(info->name) - 1);
+        info->name[sizeof(info->name) - 1] = '\0';
+        info->cpus = options.Affinity();
 
 #ifdef _WIN32
         info->join_object = NULL;
@@ -77,6 +134,7 @@ public:
         }
 
         size_t dwStackSize = (options.StackSize() == 0) ? (64 * 1024) : options.StackSize();
+        HANDLE join_object = info->join_object;
         HANDLE handle = CreateThread(NULL, dwStackSize, Run, info, 0, NULL);
         if (handle == NULL) {
             CloseHandle(info->join_object);
@@ -93,12 +151,18 @@ public:
         if (options.StackSize() != 0) {
             pthread_attr_setstacksize(&attr, options.StackSize());
         }
-        *success = pthread_create(&info->join_object, &attr, Run, info) == 0;
+        pthread_t tid;
+        *success = pthread_create(&tid, &attr, Run, info) == 0;
         pthread_attr_destroy(&attr);
 #endif
 
+        // info belongs to the new thread once it runs, do not touch it
         if (*success) {
-            _join_object = info->join_object;
+#ifdef _WIN32
+            _join_object = join_object;
+#else
+            _join_object = tid;
+#endif
         } else {
             delete info;
         }
@@ -142,6 +206,9 @@ private:
         }
         RaptorMutexUnlock(&info.thd->_mutex);
 
+        SetCurrentThreadName(info.name);
+        SetCurrentThreadAffinity(info.name, info.cpus);
+
         try {
             (info.thread_proc)(info.arg);
         } catch(...) {
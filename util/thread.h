@@ -21,6 +21,7 @@
 
 #include <stddef.h>
 #include <functional>
+#include <vector>
 
 namespace raptor {
 
@@ -58,9 +59,18 @@ public:
 
         size_t StackSize() const { return _stack_size; }
 
+        // cpus the thread may run on, empty means no restriction
+        Options& SetAffinity(const std::vector<int>& cpus) {
+            _cpus = cpus;
+            return *this;
+        }
+
+        const std::vector<int>& Affinity() const { return _cpus; }
+
     private:
         bool _joinable;
         size_t _stack_size;
+        std::vector<int> _cpus;
     }; // class Options
 
     Thread();
@@ -17,6 +17,27 @@
  */
 
 #include "util/time.h"
+#include "util/atomic.h"
+
+namespace {
+// written only when a reader sees the clock ahead of it, which
+// happens once per clock tick however many loops read it
+raptor::AtomicInt64 g_coarse_ms(0);
+
+int64_t ReadCoarseClock() {
+#ifdef _WIN32
+    return static_cast<int64_t>(GetTickCount64());
+#else
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+} // namespace
 
 #ifdef _WIN32
 int gettimeofday(struct timeval *tp, void *tzp) {
@@ -43,6 +64,58 @@ int64_t GetCurrentMilliseconds() {
     return ret * 1000 + tp.tv_usec / 1000;
 }
 
+int64_t GetMonotonicNanoseconds() {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency = {};
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    int64_t sec = counter.QuadPart / frequency.QuadPart;
+    int64_t rem = counter.QuadPart % frequency.QuadPart;
+    return sec * 1000000000LL + rem * 1000000000LL / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+int64_t GetThreadCpuNanoseconds() {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+        return 0;
+    }
+    // 100 nanosecond units
+    uint64_t k = (static_cast<uint64_t>(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime;
+    uint64_t u = (static_cast<uint64_t>(user.dwHighDateTime) << 32) | user.dwLowDateTime;
+    return static_cast<int64_t>(k + u) * 100;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+int64_t GetCoarseMilliseconds() {
+    int64_t ms = g_coarse_ms.Load(raptor::MemoryOrder::RELAXED);
+    return ms != 0 ? ms : UpdateCoarseClock();
+}
+
+int64_t UpdateCoarseClock() {
+    int64_t now = ReadCoarseClock();
+    int64_t cached = g_coarse_ms.Load(raptor::MemoryOrder::RELAXED);
+    while (now > cached) {
+        if (g_coarse_ms.CompareExchangeWeak(&cached, now,
+                raptor::MemoryOrder::RELAXED, raptor::MemoryOrder::RELAXED)) {
+            return now;
+        }
+    }
+    return cached;
+}
+
 time_t Now() {
-    return time(0);
+    return static_cast<time_t>(GetCoarseMilliseconds() / 1000);
 }
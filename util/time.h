@@ -37,7 +37,23 @@ extern "C" {
 int gettimeofday(struct timeval *tp, void *tzp);
 #endif
 
+// wall clock, for what is shown or stored. Use the coarse clock
+// below for timeouts and deadlines.
 int64_t GetCurrentMilliseconds();
+// monotonic, for measuring intervals
+int64_t GetMonotonicNanoseconds();
+// cpu time consumed by the calling thread
+int64_t GetThreadCpuNanoseconds();
+
+// Milliseconds of the monotonic clock at its coarse resolution
+// (CLOCK_MONOTONIC_COARSE, GetTickCount64 on Windows), cached for the
+// process. It never goes backwards and does not jump with the wall
+// clock. The poll loops refresh it once per iteration, code outside
+// of them which may run after a long idle period calls
+// UpdateCoarseClock, which reads the clock and returns the new value.
+int64_t GetCoarseMilliseconds();
+int64_t UpdateCoarseClock();
+// GetCoarseMilliseconds in seconds, for timeouts counted in seconds
 time_t Now();
 #ifdef __cplusplus
 }
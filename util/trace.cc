@@ -0,0 +1,36 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "util/trace.h"
+
+namespace raptor {
+#ifdef RAPTOR_ENABLE_TRACING
+namespace internal {
+AtomicIntptr g_trace_callback(0);
+} // namespace internal
+
+bool TraceSetCallback(raptor_trace_callback cb) {
+    internal::g_trace_callback.Store(reinterpret_cast<intptr_t>(cb), MemoryOrder::RELEASE);
+    return true;
+}
+#else
+bool TraceSetCallback(raptor_trace_callback) {
+    return false;
+}
+#endif
+} // namespace raptor
@@ -0,0 +1,72 @@
+/*
+ *
+ * Copyright (c) 2020 The Raptor Authors. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __RAPTOR_UTIL_TRACE__
+#define __RAPTOR_UTIL_TRACE__
+
+#include <stdint.h>
+#include "raptor/types.h"
+
+/*
+    RAPTOR_TRACE(name, point, a, b) marks a tracepoint. Without
+    RAPTOR_ENABLE_TRACING it compiles to nothing. With it, it is a USDT
+    probe raptor:name (where sys/sdt.h is available, for bpftrace and
+    perf) and a call of the callback set by TraceSetCallback, if any.
+    point is one of RAPTOR_TRACE_*, a and b are integers.
+*/
+#ifdef RAPTOR_ENABLE_TRACING
+
+#include "util/atomic.h"
+#ifdef RAPTOR_HAVE_SDT
+#include <sys/sdt.h>
+#define RAPTOR_TRACE_PROBE(NAME, A, B) DTRACE_PROBE2(raptor, NAME, A, B)
+#else
+#define RAPTOR_TRACE_PROBE(NAME, A, B) do {} while (0)
+#endif
+
+namespace raptor {
+namespace internal {
+extern AtomicIntptr g_trace_callback;
+} // namespace internal
+
+inline void TraceEmit(int point, uint64_t a, uint64_t b) {
+    intptr_t cb = internal::g_trace_callback.Load(MemoryOrder::RELAXED);
+    if (cb) {
+        reinterpret_cast<raptor_trace_callback>(cb)(point, a, b);
+    }
+}
+} // namespace raptor
+
+#define RAPTOR_TRACE(NAME, POINT, A, B)                               \
+do {                                                                  \
+    uint64_t raptor_trace_a_ = static_cast<uint64_t>(A);              \
+    uint64_t raptor_trace_b_ = static_cast<uint64_t>(B);              \
+    RAPTOR_TRACE_PROBE(NAME, raptor_trace_a_, raptor_trace_b_);       \
+    raptor::TraceEmit(POINT, raptor_trace_a_, raptor_trace_b_);       \
+} while (0)
+
+#else
+#define RAPTOR_TRACE(NAME, POINT, A, B) do {} while (0)
+#endif  // RAPTOR_ENABLE_TRACING
+
+namespace raptor {
+// false if tracing is compiled out
+bool TraceSetCallback(raptor_trace_callback cb);
+} // namespace raptor
+
+#endif  // __RAPTOR_UTIL_TRACE__
@@ -24,6 +24,8 @@
 
 #define RAPTOR_ARRAY_SIZE(array) (sizeof(array) / sizeof(*(array)))
 
+#define RAPTOR_CACHELINE_SIZE 64
+
 /** Set the \a n-th bit of \a i (a mutable pointer). */
 #define RAPTOR_BIT_SET(i, n) ((*(i)) |= (1u << (n)))
 